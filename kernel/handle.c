@@ -44,12 +44,13 @@ typedef struct ResourceHandle {
     element_t          Header;
 } ResourceHandle_t;
 
-static Semaphore_t     EventHandle   = SEMAPHORE_INIT(0, 1);
-static queue_t         CleanQueue    = QUEUE_INIT;
-static list_t          Handles       = LIST_INIT;                      // TODO: hashtable
-static list_t          PathRegister  = LIST_INIT_CMP(list_cmp_string); // TODO: hashtable
-static UUId_t          JanitorHandle = UUID_INVALID;
-static _Atomic(UUId_t) HandleIdGen   = ATOMIC_VAR_INIT(1); // 0 is reserved for invalid
+static Semaphore_t           EventHandle   = SEMAPHORE_INIT(0, 1);
+static queue_t               CleanQueue    = QUEUE_INIT;
+static list_t                Handles       = LIST_INIT;                      // TODO: hashtable
+static list_t                PathRegister  = LIST_INIT_CMP(list_cmp_string); // TODO: hashtable
+static UUId_t                JanitorHandle = UUID_INVALID;
+static _Atomic(UUId_t)       HandleIdGen   = ATOMIC_VAR_INIT(1); // 0 is reserved for invalid
+static _Atomic(unsigned int) HandleGen     = ATOMIC_VAR_INIT(0); // Changes whenever a handle is destroyed
 
 static inline ResourceHandle_t*
 LookupHandleInstance(
@@ -236,6 +237,12 @@ LookupHandleOfType(
     return Instance->Resource;
 }
 
+unsigned int
+GetHandleGeneration(void)
+{
+    return atomic_load(&HandleGen);
+}
+
 void
 DestroyHandle(
     _In_ UUId_t Handle)
@@ -250,6 +257,7 @@ DestroyHandle(
     References = atomic_fetch_sub(&Instance->References, 1);
     if ((References - 1) == 0) {
         TRACE("[destroy_handle] cleaning up %u", Handle);
+        atomic_fetch_add(&HandleGen, 1);
         if (Instance->PathHeader) {
             list_remove(&PathRegister, Instance->PathHeader);
         }
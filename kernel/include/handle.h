@@ -33,7 +33,8 @@ typedef enum HandleType {
     HandleTypeMemorySpace,
     HandleTypeMemoryRegion,
     HandleTypeThread,
-    HandleTypeIpcContext
+    HandleTypeIpcContext,
+    HandleTypeIpcRing
 } HandleType_t;
 
 typedef void (*HandleDestructorFn)(void*);
@@ -102,6 +103,14 @@ KERNELAPI void* KERNELABI
 LookupHandle(
     _In_ UUId_t Handle);
 
+/**
+ * GetHandleGeneration
+ * * Returns a counter that changes whenever a handle is destroyed. A resource that
+ * * was looked up is still valid as long as the counter has not changed since.
+ */
+KERNELAPI unsigned int KERNELABI
+GetHandleGeneration(void);
+
 /* LookupHandleOfType
  * Retrieves the handle given, while also performing type validation of the handle. 
  * This can fail if the handle turns out to be invalid, otherwise the resource will be returned. */
@@ -75,4 +75,26 @@ IpcContextRespondMultiple(
     _In_ struct gracht_message** messageDescriptors,
     _In_ int                     messageCount);
 
+/**
+ * IpcContextRingCreate
+ * * Creates a submission/completion ring shared with the calling thread. The
+ * * ring memory is mapped into the caller at <UserRingOut>.
+ */
+KERNELAPI OsStatus_t KERNELABI
+IpcContextRingCreate(
+    _In_  unsigned int Entries,
+    _Out_ UUId_t*      HandleOut,
+    _Out_ void**       UserRingOut);
+
+/**
+ * IpcContextRingEnter
+ * * Submits all queued messages in the ring, and waits for at least <WaitCount>
+ * * completions to be available.
+ */
+KERNELAPI OsStatus_t KERNELABI
+IpcContextRingEnter(
+    _In_ UUId_t       Handle,
+    _In_ unsigned int WaitCount,
+    _In_ size_t       Timeout);
+
 #endif //!__VALI_IPC_CONTEXT_H__
@@ -28,6 +28,7 @@
 #include <os/osdefs.h>
 
 struct dma_sg;
+struct SystemMemorySpace;
 
 /**
  * MemoryRegionCreate
@@ -106,10 +107,29 @@ MemoryRegionUnherit(
     _In_ UUId_t Handle,
     _In_ void*  Memory);
 
+/**
+ * MemoryRegionMapInto
+ * * Maps the committed pages of the memory region into another memory space at a fixed
+ * * address. The pages stay owned by the region, so the region must be kept alive for
+ * * as long as the mapping exists. Pages added by a later resize are not mapped.
+ * @param Handle      [In]
+ * @param MemorySpace [In]
+ * @param Address     [In]
+ * @param Length      [In]
+ * @param Flags       [In]
+ */
+KERNELAPI OsStatus_t KERNELABI
+MemoryRegionMapInto(
+    _In_ UUId_t                    Handle,
+    _In_ struct SystemMemorySpace* MemorySpace,
+    _In_ VirtualAddress_t          Address,
+    _In_ size_t                    Length,
+    _In_ Flags_t                   Flags);
+
 /**
  * MemoryRegionResize
- * * Refreshes the current memory mapping to align with the memory region.
- * * This is neccessary for all users of an memory region that has been resized.
+ * * Grows the memory region. The new pages are committed in every user mapping
+ * * of the region, so other users do not have to refresh their mappings.
  * @param Handle        [In]
  * @param Memory        [In]
  * @param CurrentLength [In]
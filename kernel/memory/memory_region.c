@@ -35,12 +35,22 @@
 #include <heap.h>
 #include <os/dmabuf.h>
 #include <memoryspace.h>
+#include <memory_region.h>
 #include <machine.h>
 #include <string.h>
 #include <threading.h>
 
+// Every user mapping of a region is tracked, so pages committed by a resize can be
+// mapped into all of them and not only into the caller's.
+typedef struct MemoryRegionMapping {
+    element_t Header;
+    UUId_t    MemorySpaceHandle;
+    uintptr_t Address;
+} MemoryRegionMapping_t;
+
 typedef struct MemoryRegion {
     Mutex_t   SyncObject;
+    list_t    Mappings;
     uintptr_t KernelMapping;
     size_t    Length;
     size_t    Capacity;
@@ -72,6 +82,100 @@ CreateUserMapping(
     return Status;
 }
 
+// Threads of a process have their own memory space, but share the page tables of
+// the upper-most space for everything below the thread specific area.
+static UUId_t
+GetUserMappingSpaceHandle(void)
+{
+    SystemMemorySpace_t* MemorySpace = GetCurrentMemorySpace();
+    if (MemorySpace->ParentHandle != UUID_INVALID) {
+        return MemorySpace->ParentHandle;
+    }
+    return GetCurrentMemorySpaceHandle();
+}
+
+static void
+AddUserMapping(
+    _In_ MemoryRegion_t* Region,
+    _In_ uintptr_t       Address)
+{
+    MemoryRegionMapping_t* Mapping;
+    UUId_t                 MemorySpaceHandle = GetUserMappingSpaceHandle();
+    
+    if (MemorySpaceHandle == UUID_INVALID) {
+        return;
+    }
+    
+    Mapping = (MemoryRegionMapping_t*)kmalloc(sizeof(MemoryRegionMapping_t));
+    if (!Mapping) {
+        WARNING("[shared_region] [mapping] out of memory, mapping 0x%" PRIxIN " is not tracked", Address);
+        return;
+    }
+    
+    ELEMENT_INIT(&Mapping->Header, 0, Mapping);
+    Mapping->MemorySpaceHandle = MemorySpaceHandle;
+    Mapping->Address           = Address;
+    list_append(&Region->Mappings, &Mapping->Header);
+}
+
+static void
+RemoveUserMapping(
+    _In_ MemoryRegion_t* Region,
+    _In_ uintptr_t       Address)
+{
+    UUId_t MemorySpaceHandle = GetUserMappingSpaceHandle();
+    
+    foreach(i, &Region->Mappings) {
+        MemoryRegionMapping_t* Mapping = (MemoryRegionMapping_t*)i->value;
+        if (Mapping->MemorySpaceHandle == MemorySpaceHandle && Mapping->Address == Address) {
+            list_remove(&Region->Mappings, i);
+            kfree(Mapping);
+            break;
+        }
+    }
+}
+
+// Commits the pages from <CurrentPages> and up to <Length> in every tracked user mapping
+// except the callers, which has been committed already. Mappings of memory spaces that
+// no longer exist are dropped.
+static void
+CommitUserMappings(
+    _In_ MemoryRegion_t* Region,
+    _In_ int             CurrentPages,
+    _In_ size_t          Length,
+    _In_ uintptr_t       CallerAddress)
+{
+    UUId_t CallerSpaceHandle = GetUserMappingSpaceHandle();
+    
+    foreach_nolink(i, &Region->Mappings) {
+        MemoryRegionMapping_t* Mapping = (MemoryRegionMapping_t*)i->value;
+        SystemMemorySpace_t*   MemorySpace;
+        OsStatus_t             Status;
+        i = i->next;
+        
+        if (Mapping->MemorySpaceHandle == CallerSpaceHandle && Mapping->Address == CallerAddress) {
+            continue;
+        }
+        
+        MemorySpace = (SystemMemorySpace_t*)AcquireHandle(Mapping->MemorySpaceHandle);
+        if (!MemorySpace) {
+            list_remove(&Region->Mappings, &Mapping->Header);
+            kfree(Mapping);
+            continue;
+        }
+        
+        Status = MemorySpaceCommit(MemorySpace,
+            Mapping->Address + (CurrentPages * GetMemorySpacePageSize()),
+            &Region->Pages[CurrentPages], Length - (CurrentPages * GetMemorySpacePageSize()),
+            MAPPING_PHYSICAL_FIXED);
+        if (Status != OsSuccess) {
+            WARNING("[shared_region] [resize] failed to commit mapping 0x%" PRIxIN " in space %u",
+                Mapping->Address, Mapping->MemorySpaceHandle);
+        }
+        DestroyHandle(Mapping->MemorySpaceHandle);
+    }
+}
+
 static OsStatus_t
 CreateKernelMapping(
     _In_ MemoryRegion_t*      Region,
@@ -107,6 +211,14 @@ CreateKernelMappingFromExisting(
     return Status;
 }
 
+static void
+CleanupUserMapping(
+    _In_ element_t* Element,
+    _In_ void*      Context)
+{
+    kfree(Element->value);
+}
+
 static void
 MemoryRegionDestroy(
     _In_ void* Resource)
@@ -115,6 +227,7 @@ MemoryRegionDestroy(
     if (Region->KernelMapping) {
         MemorySpaceUnmap(GetCurrentMemorySpace(), Region->KernelMapping, Region->Capacity);
     }
+    list_clear(&Region->Mappings, CleanupUserMapping, NULL);
     kfree(Region);
 }
 
@@ -143,6 +256,7 @@ MemoryRegionCreate(
     
     memset(Region, 0, sizeof(MemoryRegion_t) + (sizeof(uintptr_t) * PageCount));
     MutexConstruct(&Region->SyncObject, MUTEX_PLAIN);
+    list_construct(&Region->Mappings);
     Region->Flags     = Flags;
     Region->Length    = Length;
     Region->Capacity  = Capacity;
@@ -159,6 +273,7 @@ MemoryRegionCreate(
         ERROR("[shared_region] [create] CreateUserMapping failed with %u", Status);
         goto ErrorHandler;
     }
+    AddUserMapping(Region, (uintptr_t)*UserMapping);
     
     *KernelMapping = (void*)Region->KernelMapping;
     *Handle        = CreateHandle(HandleTypeMemoryRegion, MemoryRegionDestroy, Region);
@@ -195,6 +310,7 @@ MemoryRegionCreateExisting(
     
     memset(Region, 0, sizeof(MemoryRegion_t) + (sizeof(uintptr_t) * PageCount));
     MutexConstruct(&Region->SyncObject, MUTEX_PLAIN);
+    list_construct(&Region->Mappings);
     Region->Flags     = Flags;
     Region->Length    = CapacityWithOffset;
     Region->Capacity  = CapacityWithOffset;
@@ -261,6 +377,9 @@ MemoryRegionInherit(
     // the Length of it.
     Offset = (Region->Pages[0] % GetMemorySpacePageSize());
     Status = CreateUserMapping(Region, GetCurrentMemorySpace(), &Address);
+    if (Status == OsSuccess) {
+        AddUserMapping(Region, Address);
+    }
     
     MutexUnlock(&Region->SyncObject);
     
@@ -297,10 +416,53 @@ MemoryRegionUnherit(
     Offset   = Address % GetMemorySpacePageSize();
     Address -= Offset;
     
+    MutexLock(&Region->SyncObject);
+    RemoveUserMapping(Region, Address);
+    MutexUnlock(&Region->SyncObject);
+    
     TRACE("... free vmem mappings of length 0x%x", LODWORD(Region->Capacity));
     return MemorySpaceUnmap(GetCurrentMemorySpace(), Address, Region->Capacity);
 }
 
+OsStatus_t
+MemoryRegionMapInto(
+    _In_ UUId_t               Handle,
+    _In_ SystemMemorySpace_t* MemorySpace,
+    _In_ VirtualAddress_t     Address,
+    _In_ size_t               Length,
+    _In_ Flags_t              Flags)
+{
+    MemoryRegion_t* Region;
+    OsStatus_t      Status;
+    TRACE("MemoryRegionMapInto(0x%x, 0x%" PRIxIN ")", Handle, Address);
+    
+    if (!MemorySpace || (Address % GetMemorySpacePageSize())) {
+        return OsInvalidParameters;
+    }
+    
+    Region = (MemoryRegion_t*)LookupHandleOfType(Handle, HandleTypeMemoryRegion);
+    if (!Region) {
+        return OsDoesNotExist;
+    }
+    
+    // The mapping is persistent, unmapping it or destroying the memory space does not
+    // release the pages of the region
+    MutexLock(&Region->SyncObject);
+    if (Length > Region->Length) {
+        MutexUnlock(&Region->SyncObject);
+        return OsInvalidParameters;
+    }
+    Status = MemorySpaceMap(MemorySpace, &Address, &Region->Pages[0], Length,
+        Flags | MAPPING_COMMIT | MAPPING_USERSPACE | MAPPING_PERSISTENT,
+        MAPPING_PHYSICAL_FIXED | MAPPING_VIRTUAL_FIXED);
+    MutexUnlock(&Region->SyncObject);
+    
+    if (Status != OsSuccess) {
+        ERROR("[shared_region] [map_into] failed to map 0x%" PRIxIN " with %u", Address, Status);
+    }
+    return Status;
+}
+
 OsStatus_t
 MemoryRegionResize(
     _In_ UUId_t Handle,
@@ -350,6 +512,8 @@ MemoryRegionResize(
         &Region->Pages[CurrentPages], NewLength - Region->Length, 
         MAPPING_PHYSICAL_FIXED);
     if (Status == OsSuccess) {
+        CommitUserMappings(Region, CurrentPages, NewLength,
+            (uintptr_t)Memory & ~(GetMemorySpacePageSize() - 1));
         Region->Length = NewLength;
     }
     MutexUnlock(&Region->SyncObject);
@@ -33,11 +33,21 @@
 #include <heap.h>
 #include <io_events.h>
 #include <ipc_context.h>
+#include <irq_spinlock.h>
 #include <memoryspace.h>
 #include <memory_region.h>
+#include <semaphore.h>
 #include <string.h>
 #include <threading.h>
 
+// Number of resolved target paths each ring remembers, and the number of distinct
+// targets a batch of messages defers its wake-ups for
+#define IPC_RING_TARGET_CACHE 8
+#define IPC_WAKE_BATCH        8
+
+// param_in and param_out are both 4 bits
+#define IPC_MAX_PARAMS 32
+
 typedef struct IpcContext {
     UUId_t          Handle;
     UUId_t          CreatorThreadHandle;
@@ -45,6 +55,32 @@ typedef struct IpcContext {
     streambuffer_t* KernelStream;
 } IpcContext_t;
 
+// Targets addressed by handle are cached with a NULL path
+typedef struct IpcRingTarget {
+    char*         Path;
+    UUId_t        Handle;
+    IpcContext_t* Context;
+    unsigned int  Generation;
+} IpcRingTarget_t;
+
+typedef struct IpcRing {
+    UUId_t                Handle;
+    UUId_t                MemoryRegionHandle;
+    struct ipring_header* Header;
+    struct ipring_sqe*    Submissions;
+    struct ipring_cqe*    Completions;
+    unsigned int          Entries;
+    IrqSpinlock_t         CompletionLock;
+    Semaphore_t           WaitObject;
+    IpcRingTarget_t       Targets[IPC_RING_TARGET_CACHE];
+    int                   TargetIndex;
+} IpcRing_t;
+
+struct wake_batch {
+    IpcContext_t* Targets[IPC_WAKE_BATCH];
+    int           Count;
+};
+
 static inline MCoreThread_t*
 GetContextThread(
     _In_ IpcContext_t* context)
@@ -103,38 +139,41 @@ struct message_state {
     unsigned int state;
 };
 
-static OsStatus_t
-AllocateMessage(
-    _In_  struct ipmsg_desc*    SourceMessage,
-    _In_  size_t                Timeout,
-    _In_  struct message_state* State,
-    _Out_ IpcContext_t**        TargetContext)
+static IpcContext_t*
+ResolveTarget(
+    _In_ struct ipmsg_addr* Address)
 {
     IpcContext_t* Context;
-    size_t        BytesAvailable;
-    size_t        BytesToAllocate = sizeof(struct ipmsg_resp) + SourceMessage->base->header.length;
-    TRACE("[ipc] [allocate] %u/%u", SourceMessage->base->header.protocol, SourceMessage->base->header.action);
     
-    if (SourceMessage->address->type == IPMSG_ADDRESS_HANDLE) {
-        Context = LookupHandleOfType(SourceMessage->address->data.handle, HandleTypeIpcContext);
+    if (Address->type == IPMSG_ADDRESS_HANDLE) {
+        Context = LookupHandleOfType(Address->data.handle, HandleTypeIpcContext);
     }
     else {
         UUId_t     Handle;
-        OsStatus_t Status = LookupHandleByPath(SourceMessage->address->data.path, &Handle);
+        OsStatus_t Status = LookupHandleByPath(Address->data.path, &Handle);
         if (Status != OsSuccess) {
-            ERROR("[ipc] [allocate] could not find target path %s", 
-                SourceMessage->address->data.path);
-            return Status;
+            ERROR("[ipc] [resolve] could not find target path %s", Address->data.path);
+            return NULL;
         }
         
         Context = LookupHandleOfType(Handle, HandleTypeIpcContext);
     }
     
     if (!Context) {
-        ERROR("[ipc] [allocate] could not find target handle %u", 
-            SourceMessage->address->data.handle);
-        return OsDoesNotExist;
+        ERROR("[ipc] [resolve] could not find target handle %u", Address->data.handle);
     }
+    return Context;
+}
+
+static OsStatus_t
+AllocateMessage(
+    _In_ IpcContext_t*         Context,
+    _In_ struct ipmsg_desc*    SourceMessage,
+    _In_ struct message_state* State)
+{
+    size_t BytesAvailable;
+    size_t BytesToAllocate = sizeof(struct ipmsg_resp) + SourceMessage->base->header.length;
+    TRACE("[ipc] [allocate] %u/%u", SourceMessage->base->header.protocol, SourceMessage->base->header.action);
     
     BytesAvailable = streambuffer_write_packet_start(Context->KernelStream,
         BytesToAllocate, 0, &State->base, &State->state);
@@ -142,39 +181,309 @@ AllocateMessage(
         ERROR("[ipc] [allocate] timeout allocating space for message");
         return OsTimeout;
     }
+    return OsSuccess;
+}
+
+static inline void
+RevokeGrant(
+    _In_ SystemMemorySpace_t* MemorySpace,
+    _In_ struct gracht_param* Parameter)
+{
+    VirtualAddress_t Address      = (VirtualAddress_t)Parameter->data.buffer;
+    size_t           OffsetInPage = Address % GetMemorySpacePageSize();
+    OsStatus_t       Status       = MemorySpaceUnmap(MemorySpace, Address - OffsetInPage,
+        Parameter->length + OffsetInPage);
+    if (Status != OsSuccess) {
+        WARNING("[ipc] [revoke_grant] failed to unmap 0x%" PRIxIN, Address);
+    }
+}
+
+// Bounce pages are fresh pages holding a copy of <Length> bytes at <Offset>, the
+// rest of the pages is cleared. They are allocated persistent so the temporary
+// kernel mapping can be removed without releasing them.
+static OsStatus_t
+AllocateBouncePages(
+    _In_  const void* Data,
+    _In_  size_t      Offset,
+    _In_  size_t      Length,
+    _In_  int         PageCount,
+    _Out_ uintptr_t*  Pages)
+{
+    size_t           Size = PageCount * GetMemorySpacePageSize();
+    VirtualAddress_t Mapping;
+    OsStatus_t       Status;
+    
+    Status = MemorySpaceMap(GetCurrentMemorySpace(), &Mapping, Pages, Size,
+        MAPPING_COMMIT | MAPPING_PERSISTENT, MAPPING_VIRTUAL_GLOBAL);
+    if (Status != OsSuccess) {
+        return Status;
+    }
     
-    *TargetContext = Context;
+    memset((void*)Mapping, 0, Size);
+    memcpy((uint8_t*)Mapping + Offset, Data, Length);
+    MemorySpaceUnmap(GetCurrentMemorySpace(), Mapping, Size);
     return OsSuccess;
 }
 
+static void
+FreeBouncePages(
+    _In_ uintptr_t* Pages,
+    _In_ int        PageCount)
+{
+    size_t           Size = PageCount * GetMemorySpacePageSize();
+    VirtualAddress_t Mapping;
+    
+    // Unmapping a mapping that is not persistent releases its pages
+    if (MemorySpaceMap(GetCurrentMemorySpace(), &Mapping, Pages, Size, MAPPING_COMMIT,
+            MAPPING_VIRTUAL_GLOBAL | MAPPING_PHYSICAL_FIXED) == OsSuccess) {
+        MemorySpaceUnmap(GetCurrentMemorySpace(), Mapping, Size);
+    }
+}
+
+// Bounce pages are mapped persistent into the receiver like the shared pages, and
+// are handed over afterwards so unmapping the grant releases them.
+static void
+ReleaseBouncePages(
+    _In_ SystemMemorySpace_t* MemorySpace,
+    _In_ VirtualAddress_t     Address,
+    _In_ size_t               Length)
+{
+    Flags_t Attributes = MAPPING_COMMIT | MAPPING_USERSPACE | MAPPING_READONLY;
+    if (MemorySpaceChangeProtection(MemorySpace, Address, Length, Attributes, &Attributes) != OsSuccess) {
+        WARNING("[ipc] [map_grant] failed to hand over bounce pages at 0x%" PRIxIN, Address);
+    }
+}
+
+// Only pages entirely covered by the buffer are shared with the receiver. The first
+// and last page of an unaligned buffer also hold other data of the sender, so they
+// are bounced instead. With <Copy> set every page is bounced, which is used when the
+// sender is not blocked while the receiver holds the grant. Bounce pages are mapped
+// as owned by the receiver, so revoking the grant releases them.
 static OsStatus_t
-MapUntypedParameter(
-    _In_ struct gracht_param* parameter,
-    _In_ SystemMemorySpace_t* TargetMemorySpace)
+MapGrant(
+    _In_ struct gracht_param* Parameter,
+    _In_ SystemMemorySpace_t* TargetMemorySpace,
+    _In_ int                  Copy)
 {
+    size_t           PageSize   = GetMemorySpacePageSize();
+    VirtualAddress_t Address    = (VirtualAddress_t)Parameter->data.buffer;
+    size_t           Offset     = Address % PageSize;
+    size_t           Tail       = (Offset + Parameter->length) % PageSize;
+    int              PageCount  = DIVUP(Offset + Parameter->length, PageSize);
+    int              BounceAll  = 0;
+    int              BounceHead = 0;
+    int              BounceTail = 0;
     VirtualAddress_t CopyAddress;
-    size_t     OffsetInPage = parameter->data.value % GetMemorySpacePageSize();
-    OsStatus_t Status       = CloneMemorySpaceMapping(
-        GetCurrentMemorySpace(), TargetMemorySpace,
-        (VirtualAddress_t)parameter->data.buffer, &CopyAddress, parameter->length + OffsetInPage,
-        MAPPING_COMMIT | MAPPING_USERSPACE | MAPPING_READONLY | MAPPING_PERSISTENT,
-        MAPPING_VIRTUAL_PROCESS);
+    uintptr_t*       Pages;
+    OsStatus_t       Status;
+    
+    if (!Parameter->length) {
+        return OsInvalidParameters;
+    }
+    
+    Pages = kmalloc(PageCount * sizeof(uintptr_t));
+    if (!Pages) {
+        return OsOutOfMemory;
+    }
+    
+    if (Copy) {
+        Status = AllocateBouncePages(Parameter->data.buffer, Offset, Parameter->length,
+            PageCount, &Pages[0]);
+        BounceAll = Status == OsSuccess;
+    }
+    else {
+        Status = GetMemorySpaceMapping(GetCurrentMemorySpace(), Address - Offset,
+            PageCount, &Pages[0]);
+        if (Status == OsSuccess && (Offset || (PageCount == 1 && Tail))) {
+            Status = AllocateBouncePages(Parameter->data.buffer, Offset,
+                MIN(Parameter->length, PageSize - Offset), 1, &Pages[0]);
+            BounceHead = Status == OsSuccess;
+        }
+        if (Status == OsSuccess && PageCount > 1 && Tail) {
+            Status = AllocateBouncePages((uint8_t*)Parameter->data.buffer + Parameter->length - Tail,
+                0, Tail, 1, &Pages[PageCount - 1]);
+            BounceTail = Status == OsSuccess;
+        }
+    }
+    
+    if (Status == OsSuccess) {
+        Status = MemorySpaceMap(TargetMemorySpace, &CopyAddress, &Pages[0], PageCount * PageSize,
+            MAPPING_COMMIT | MAPPING_USERSPACE | MAPPING_READONLY | MAPPING_PERSISTENT,
+            MAPPING_PHYSICAL_FIXED | MAPPING_VIRTUAL_PROCESS);
+    }
+    
     if (Status != OsSuccess) {
-        ERROR("[ipc] [map_untyped] Failed to clone ipc mapping");
+        ERROR("[ipc] [map_grant] failed to map grant of 0x%" PRIxIN " bytes", Parameter->length);
+        if (BounceAll) {
+            FreeBouncePages(&Pages[0], PageCount);
+        }
+        if (BounceHead) {
+            FreeBouncePages(&Pages[0], 1);
+        }
+        if (BounceTail) {
+            FreeBouncePages(&Pages[PageCount - 1], 1);
+        }
+        kfree(Pages);
         return Status;
     }
     
-    // Update buffer pointer in untyped argument
-    parameter->data.buffer = (void*)(CopyAddress + OffsetInPage);
-    smp_wmb();
+    if (BounceAll) {
+        ReleaseBouncePages(TargetMemorySpace, CopyAddress, PageCount * PageSize);
+    }
+    if (BounceHead) {
+        ReleaseBouncePages(TargetMemorySpace, CopyAddress, PageSize);
+    }
+    if (BounceTail) {
+        ReleaseBouncePages(TargetMemorySpace, CopyAddress + ((PageCount - 1) * PageSize), PageSize);
+    }
+    kfree(Pages);
     
+    Parameter->data.buffer = (void*)(CopyAddress + Offset);
     return OsSuccess;
 }
 
+// SHM parameters are grants of page ranges in the sender. They are mapped read-only
+// into the receiver when the message is delivered, and revoked again when the message
+// is responded to. Synchronous senders stay blocked for the lifetime of the grant, so
+// the receiver always sees a stable view of the data, and a sender that times out
+// detaches the shared pages first. The pages are shared read-only, not copy-on-write.
+// Senders that are not blocked
+// pass <Copy>, which gives the receiver a copy of the data instead. The descriptors
+// written to the receiver are prepared in <Params>, the senders message is left untouched.
 static OsStatus_t
+MapGrants(
+    _In_ IpcContext_t*        Context,
+    _In_ struct ipmsg_desc*   Message,
+    _In_ struct gracht_param* Params,
+    _In_ int                  Copy)
+{
+    SystemMemorySpace_t* MemorySpace = GetContextThread(Context)->MemorySpace;
+    int                  ParamCount  = Message->base->header.param_in + Message->base->header.param_out;
+    int                  i;
+    
+    memcpy(Params, &Message->base->params[0], ParamCount * sizeof(struct gracht_param));
+    for (i = 0; i < Message->base->header.param_in; i++) {
+        if (Params[i].type == GRACHT_PARAM_SHM) {
+            OsStatus_t Status = MapGrant(&Params[i], MemorySpace, Copy);
+            if (Status != OsSuccess) {
+                while (i--) {
+                    if (Params[i].type == GRACHT_PARAM_SHM) {
+                        RevokeGrant(MemorySpace, &Params[i]);
+                    }
+                }
+                return Status;
+            }
+        }
+    }
+    return OsSuccess;
+}
+
+static void
+RevokeGrants(
+    _In_ IpcContext_t*        Context,
+    _In_ struct ipmsg_desc*   Message,
+    _In_ struct gracht_param* Params)
+{
+    SystemMemorySpace_t* MemorySpace = GetContextThread(Context)->MemorySpace;
+    int                  i;
+    
+    for (i = 0; i < Message->base->header.param_in; i++) {
+        if (Params[i].type == GRACHT_PARAM_SHM) {
+            RevokeGrant(MemorySpace, &Params[i]);
+        }
+    }
+}
+
+// A synchronous sender that stops waiting no longer keeps the shared pages stable,
+// so every page still shared with the receiver is swapped for a copy at the same
+// address. The receiver keeps a valid view until it responds, and revoking the grant
+// then releases the copies. Pages the receiver already released are left alone.
+static void
+DetachGrant(
+    _In_ struct gracht_param* Source,
+    _In_ struct gracht_param* Grant,
+    _In_ SystemMemorySpace_t* TargetMemorySpace)
+{
+    size_t           PageSize  = GetMemorySpacePageSize();
+    VirtualAddress_t Address   = (VirtualAddress_t)Source->data.buffer;
+    size_t           Offset    = Address % PageSize;
+    size_t           Tail      = (Offset + Source->length) % PageSize;
+    int              PageCount = DIVUP(Offset + Source->length, PageSize);
+    VirtualAddress_t GrantBase = (VirtualAddress_t)Grant->data.buffer - Offset;
+    int              i;
+    
+    // The unaligned head and tail were bounced when the grant was mapped
+    for (i = Offset ? 1 : 0; i < PageCount - (Tail ? 1 : 0); i++) {
+        VirtualAddress_t SourcePage = Address - Offset + (i * PageSize);
+        VirtualAddress_t GrantPage  = GrantBase + (i * PageSize);
+        uintptr_t        Shared;
+        uintptr_t        Mapped;
+        uintptr_t        Copy;
+        
+        if (GetMemorySpaceMapping(GetCurrentMemorySpace(), SourcePage, 1, &Shared) != OsSuccess ||
+            GetMemorySpaceMapping(TargetMemorySpace, GrantPage, 1, &Mapped) != OsSuccess ||
+            Shared != Mapped) {
+            continue;
+        }
+        
+        if (AllocateBouncePages((const void*)SourcePage, 0, PageSize, 1, &Copy) != OsSuccess) {
+            WARNING("[ipc] [detach_grant] failed to copy 0x%" PRIxIN ", revoking it", GrantPage);
+            MemorySpaceUnmap(TargetMemorySpace, GrantPage, PageSize);
+            continue;
+        }
+        
+        MemorySpaceUnmap(TargetMemorySpace, GrantPage, PageSize);
+        if (MemorySpaceMap(TargetMemorySpace, &GrantPage, &Copy, PageSize,
+                MAPPING_COMMIT | MAPPING_USERSPACE | MAPPING_READONLY | MAPPING_PERSISTENT,
+                MAPPING_PHYSICAL_FIXED | MAPPING_VIRTUAL_FIXED) != OsSuccess) {
+            FreeBouncePages(&Copy, 1);
+            continue;
+        }
+        ReleaseBouncePages(TargetMemorySpace, GrantPage, PageSize);
+    }
+}
+
+static void
+DetachGrants(
+    _In_ IpcContext_t*        Context,
+    _In_ struct ipmsg_desc*   Message,
+    _In_ struct gracht_param* Params)
+{
+    SystemMemorySpace_t* MemorySpace = GetContextThread(Context)->MemorySpace;
+    int                  i;
+    
+    for (i = 0; i < Message->base->header.param_in; i++) {
+        if (Params[i].type == GRACHT_PARAM_SHM) {
+            DetachGrant(&Message->base->params[i], &Params[i], MemorySpace);
+        }
+    }
+}
+
+// The receiver side descriptors of the grants in a synchronous message
+struct grant_record {
+    IpcContext_t*       Context;
+    struct gracht_param Params[IPC_MAX_PARAMS];
+};
+
+static int
+HasGrants(
+    _In_ struct ipmsg_desc* Message)
+{
+    int i;
+    
+    for (i = 0; i < Message->base->header.param_in; i++) {
+        if (Message->base->params[i].type == GRACHT_PARAM_SHM) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
 WriteMessage(
     _In_ IpcContext_t*         Context,
     _In_ struct ipmsg_desc*    Message,
+    _In_ struct gracht_param*  Params,
     _In_ struct message_state* State)
 {
     int i;
@@ -185,47 +494,62 @@ WriteMessage(
     // Write all members in the order of ipmsg
     streambuffer_write_packet_data(Context->KernelStream, 
         Message->response, sizeof(struct ipmsg_resp), &State->state);
-    
-    // Fixup all SHM buffer values before writing the base message
-    for (i = 0; i < Message->base->header.param_in; i++) {
-        if (Message->base->params[i].type == GRACHT_PARAM_SHM) {
-            MCoreThread_t* Thread = GetContextThread(Context);
-            OsStatus_t     Status = MapUntypedParameter(&Message->base->params[i],
-                Thread->MemorySpace);
-            if (Status != OsSuccess) {
-                // WHAT DO
-                //CleanupMessage(Target, &IpcContext->Message);
-                //atomic_store(&IpcContext->WriteSyncObject, 0);
-                //(void)FutexWake(&IpcContext->WriteSyncObject, 1, 0);
-                ERROR("[ipc] [initialize_message] failed to map parameter");
-                return Status;
-            }
-        }
-    }
-    
     streambuffer_write_packet_data(Context->KernelStream, 
-        Message->base, sizeof(struct gracht_message) + 
-            ((Message->base->header.param_in + Message->base->header.param_out)
-                * sizeof(struct gracht_param)),
+        Message->base, sizeof(struct gracht_message), &State->state);
+    streambuffer_write_packet_data(Context->KernelStream, Params,
+        (Message->base->header.param_in + Message->base->header.param_out) * sizeof(struct gracht_param),
         &State->state);
     
-    // Handle all the buffer/shm parameters
+    // Only buffers are copied into the stream, values are carried by the parameters
+    // and grants are mapped
     for (i = 0; i < Message->base->header.param_in; i++) {
-        if (Message->base->params[i].type == GRACHT_PARAM_BUFFER) {
+        if (Params[i].type == GRACHT_PARAM_BUFFER) {
             streambuffer_write_packet_data(Context->KernelStream, 
-                Message->base->params[i].data.buffer,
-                Message->base->params[i].length,
-                &State->state);
+                Params[i].data.buffer, Params[i].length, &State->state);
         }
     }
-    return OsSuccess;
 }
 
+static inline void
+QueueWake(
+    _In_ struct wake_batch* Batch,
+    _In_ IpcContext_t*      Context)
+{
+    int i;
+    
+    for (i = 0; i < Batch->Count; i++) {
+        if (Batch->Targets[i] == Context) {
+            return;
+        }
+    }
+    
+    if (Batch->Count == IPC_WAKE_BATCH) {
+        MarkHandle(Context->Handle, IOEVTIN);
+        return;
+    }
+    Batch->Targets[Batch->Count++] = Context;
+}
+
+static inline void
+FlushWakes(
+    _In_ struct wake_batch* Batch)
+{
+    int i;
+    
+    for (i = 0; i < Batch->Count; i++) {
+        MarkHandle(Batch->Targets[i]->Handle, IOEVTIN);
+    }
+    Batch->Count = 0;
+}
+
+// Commits the message to the target stream, the receiver is woken once the whole
+// batch has been committed
 static inline void
 SendMessage(
     _In_ IpcContext_t*         context,
     _In_ struct ipmsg_desc*    message,
-    _In_ struct message_state* state)
+    _In_ struct message_state* state,
+    _In_ struct wake_batch*    wakes)
 {
     TRACE("[ipc] [send] %u/%u => %u",
         message->base->header.protocol, message->base->header.action,
@@ -233,7 +557,7 @@ SendMessage(
     
     streambuffer_write_packet_end(context->KernelStream, state->base,
         sizeof(struct ipmsg_resp) + message->base->header.length);
-    MarkHandle(context->Handle, IOEVTIN);
+    QueueWake(wakes, context);
 }
 
 static inline void
@@ -243,33 +567,54 @@ CleanupMessage(
     int i;
     TRACE("CleanupMessage(0x%llx)", message);
 
-    // Flush all the mappings granted in the argument phase
+    // Revoke all the grants mapped in the argument phase
     for (i = 0; i < message->base.header.param_in; i++) {
         if (message->base.params[i].type == GRACHT_PARAM_SHM) {
-            OsStatus_t status = MemorySpaceUnmap(GetCurrentMemorySpace(),
-                (VirtualAddress_t)message->base.params[i].data.buffer,
-                message->base.params[i].length);
-            if (status != OsSuccess) {
-                // LOG
-            }
+            RevokeGrant(GetCurrentMemorySpace(), &message->base.params[i]);
         }
     }
 }
 
-static void
+static OsStatus_t
 WaitForMessageNotification(
     _In_ struct ipmsg_resp* response,
     _In_ size_t             timeout)
 {
     if (response->notify_method == IPMSG_NOTIFY_NONE) {
         MCoreThread_t* thread = LookupHandleOfType(response->notify_data.handle, HandleTypeThread);
-        SemaphoreWait(&thread->WaitObject, timeout);
+        return SemaphoreWait(&thread->WaitObject, timeout);
     }
     else if (response->notify_method == IPMSG_NOTIFY_HANDLE_SET) {
         handle_event_t event;
         int            numberOfEvents;
-        WaitForHandleSet(response->notify_data.handle, &event, 1, timeout, &numberOfEvents);
+        return WaitForHandleSet(response->notify_data.handle, &event, 1, timeout, &numberOfEvents);
     }
+    return OsSuccess;
+}
+
+static void
+PostCompletion(
+    _In_ IpcRing_t* ring,
+    _In_ void*      userData,
+    _In_ OsStatus_t status)
+{
+    struct ipring_header* header  = ring->Header;
+    unsigned int          entries = ring->Entries * 2;
+    unsigned int          tail;
+    
+    IrqSpinlockAcquire(&ring->CompletionLock);
+    tail = atomic_load(&header->cq_tail);
+    if ((tail - atomic_load(&header->cq_head)) >= entries) {
+        header->cq_overflow++;
+    }
+    else {
+        struct ipring_cqe* completion = &ring->Completions[tail & (entries - 1)];
+        completion->user_data = userData;
+        completion->status    = status;
+        atomic_store(&header->cq_tail, tail + 1);
+    }
+    IrqSpinlockRelease(&ring->CompletionLock);
+    SemaphoreSignal(&ring->WaitObject, 1);
 }
 
 static void
@@ -289,6 +634,12 @@ SendNotification(
     else if (response->notify_method == IPMSG_NOTIFY_SIGNAL) {
         SignalSend(response->notify_data.handle, SIGIPC, response->notify_context);
     }
+    else if (response->notify_method == IPMSG_NOTIFY_RING) {
+        IpcRing_t* ring = LookupHandleOfType(response->notify_data.handle, HandleTypeIpcRing);
+        if (ring) {
+            PostCompletion(ring, response->notify_context, OsSuccess);
+        }
+    }
     else if (response->notify_method == IPMSG_NOTIFY_THREAD) {
         NOTIMPLEMENTED("[ipc] [send_notification] IPC_NOTIFY_METHOD_THREAD missing implementation");
     }
@@ -311,34 +662,65 @@ WriteShortResponse(
     return OsSuccess;
 }
 
+static void
+FlushResponse(
+    _In_ struct ipmsg* message,
+    _In_ uint8_t*      buffer,
+    _In_ size_t        length,
+    _In_ uint16_t      offset)
+{
+    size_t bytesWritten = 0;
+    
+    if (length) {
+        MemoryRegionWrite(message->response.dma_handle, offset, buffer, length, &bytesWritten);
+        TRACE("[ipc] [WriteFullResponse] wrote %u bytes at offset %u",
+            LODWORD(bytesWritten), offset);
+    }
+}
+
 static OsStatus_t
 WriteFullResponse(
     _In_ struct ipmsg*          message,
     _In_ struct gracht_message* messageDescriptor)
 {
+    uint8_t  buffer[GRACHT_MAX_MESSAGE_SIZE];
+    size_t   used   = 0;
     uint16_t offset = message->response.dma_offset;
     int      i;
     
     TRACE("[ipc] [WriteFullResponse] dma_handle %u, dma_offset %u",
         message->response.dma_handle, message->response.dma_offset);
     if (message->response.dma_handle != UUID_INVALID) {
+        // The output slots are laid out back to back in the response buffer, so
+        // gather them and write the region once instead of once per parameter
         for (i = 0; i < message->base.header.param_out; i++) {
-            struct gracht_param* param        = &messageDescriptor->params[i];
-            size_t               bytesWritten = 0;
+            struct gracht_param* param  = &messageDescriptor->params[i];
+            size_t               slot   = message->base.params[message->base.header.param_in + i].length;
+            size_t               length = MIN(param->length, slot);
+            void*                source = (param->type == GRACHT_PARAM_VALUE) ? 
+                (void*)&param->data.value : param->data.buffer;
             
-            if (param->type == GRACHT_PARAM_VALUE) {
-                MemoryRegionWrite(message->response.dma_handle, offset,
-                    &param->data.value, param->length, &bytesWritten);
+            if (param->type != GRACHT_PARAM_VALUE && param->type != GRACHT_PARAM_BUFFER) {
+                length = 0;
             }
-            else if (param->type == GRACHT_PARAM_BUFFER) {
-                MemoryRegionWrite(message->response.dma_handle, offset,
-                    param->data.buffer, param->length, &bytesWritten);
+            
+            if (used + slot > sizeof(buffer)) {
+                FlushResponse(message, &buffer[0], used, offset);
+                offset += used;
+                used    = 0;
             }
             
-            offset += message->base.params[message->base.header.param_in + i].length;
-            TRACE("[ipc] [WriteFullResponse] wrote %u bytes, new offset %u",
-                LODWORD(bytesWritten), offset);
+            if (slot > sizeof(buffer)) {
+                FlushResponse(message, source, length, offset);
+                offset += slot;
+                continue;
+            }
+            
+            memcpy(&buffer[used], source, length);
+            memset(&buffer[used + length], 0, slot - length);
+            used += slot;
         }
+        FlushResponse(message, &buffer[0], used, offset);
     }
     
     SendNotification(&message->response, messageDescriptor->header.flags);
@@ -352,6 +734,11 @@ IpcContextSendMultiple(
     _In_ size_t              Timeout)
 {
     struct message_state State;
+    struct gracht_param  Params[IPC_MAX_PARAMS];
+    struct wake_batch    Wakes = { { 0 }, 0 };
+    struct ipmsg_addr*   LastAddress = NULL;
+    IpcContext_t*        TargetContext = NULL;
+    struct grant_record* Grants = NULL;
     int                  i;
     TRACE("[ipc] [send] count %i, timeout %u", MessageCount, LODWORD(Timeout));
     
@@ -359,25 +746,70 @@ IpcContextSendMultiple(
         return OsInvalidParameters;
     }
     
-    for (int i = 0; i < MessageCount; i++) {
-        IpcContext_t* TargetContext;
-        OsStatus_t    Status = AllocateMessage(Messages[i], Timeout, 
-             &State, &TargetContext);
+    for (i = 0; i < MessageCount; i++) {
+        int        Async = Messages[i]->base->header.flags & MESSAGE_FLAG_ASYNC;
+        OsStatus_t Status;
+        
+        // Batches are usually sent to the same target, so only resolve it again
+        // when the address changes
+        if (!TargetContext || Messages[i]->address != LastAddress) {
+            TargetContext = ResolveTarget(Messages[i]->address);
+            LastAddress   = Messages[i]->address;
+        }
+        
+        // Asynchronous senders continue right away, so their data is copied instead
+        // of shared with the receiver
+        Status = TargetContext ? MapGrants(TargetContext, Messages[i], &Params[0], Async) : OsDoesNotExist;
+        if (Status == OsSuccess) {
+            Status = AllocateMessage(TargetContext, Messages[i], &State);
+            if (Status != OsSuccess) {
+                RevokeGrants(TargetContext, Messages[i], &Params[0]);
+            }
+        }
+        
         if (Status != OsSuccess) {
             if (WriteShortResponse(Messages[i], Status) != OsSuccess) {
                 WARNING("[ipc] [send_multiple] failed to write response");
             }
+            continue;
         }
-        WriteMessage(TargetContext, Messages[i], &State);
-        SendMessage(TargetContext, Messages[i], &State);
+        
+        // Shared pages of a synchronous message must be detached again if the wait
+        // for the response times out
+        if (!Async && Timeout && HasGrants(Messages[i])) {
+            if (!Grants) {
+                Grants = kmalloc(MessageCount * sizeof(struct grant_record));
+                if (Grants) {
+                    memset(Grants, 0, MessageCount * sizeof(struct grant_record));
+                }
+            }
+            if (Grants) {
+                Grants[i].Context = TargetContext;
+                memcpy(&Grants[i].Params[0], &Params[0],
+                    Messages[i]->base->header.param_in * sizeof(struct gracht_param));
+            }
+            else {
+                WARNING("[ipc] [send_multiple] grants of message %i can't be detached", i);
+            }
+        }
+        WriteMessage(TargetContext, Messages[i], &Params[0], &State);
+        SendMessage(TargetContext, Messages[i], &State, &Wakes);
     }
+    FlushWakes(&Wakes);
     
     // Iterate all messages again and wait for response
     for (i = 0; i < MessageCount; i++) {
         if (!(Messages[i]->base->header.flags & MESSAGE_FLAG_ASYNC)) {
-            WaitForMessageNotification(Messages[i]->response, Timeout);
+            OsStatus_t Status = WaitForMessageNotification(Messages[i]->response, Timeout);
+            if (Status == OsTimeout && Grants && Grants[i].Context) {
+                DetachGrants(Grants[i].Context, Messages[i], &Grants[i].Params[0]);
+            }
         }
     }
+    
+    if (Grants) {
+        kfree(Grants);
+    }
     return OsSuccess;
 }
 
@@ -401,3 +833,290 @@ IpcContextRespondMultiple(
     }
     return OsSuccess;
 }
+
+static void
+ClearRingTarget(
+    _In_ IpcRingTarget_t* Target)
+{
+    if (Target->Path) {
+        kfree(Target->Path);
+    }
+    memset(Target, 0, sizeof(IpcRingTarget_t));
+}
+
+static void
+IpcRingDestroy(
+    _In_ void* resource)
+{
+    IpcRing_t* ring = resource;
+    int        i;
+    
+    for (i = 0; i < IPC_RING_TARGET_CACHE; i++) {
+        ClearRingTarget(&ring->Targets[i]);
+    }
+    
+    SemaphoreDestruct(&ring->WaitObject);
+    DestroyHandle(ring->MemoryRegionHandle);
+    kfree(ring);
+}
+
+OsStatus_t
+IpcContextRingCreate(
+    _In_  unsigned int Entries,
+    _Out_ UUId_t*      HandleOut,
+    _Out_ void**       UserRingOut)
+{
+    IpcRing_t* Ring;
+    OsStatus_t Status;
+    void*      KernelMapping;
+    size_t     Size = IPRING_SIZE(Entries);
+    
+    if (!HandleOut || !UserRingOut || !Entries || 
+        Entries > IPRING_MAX_ENTRIES || (Entries & (Entries - 1))) {
+        return OsInvalidParameters;
+    }
+    
+    Ring = kmalloc(sizeof(IpcRing_t));
+    if (!Ring) {
+        return OsOutOfMemory;
+    }
+    memset(Ring, 0, sizeof(IpcRing_t));
+    
+    Status = MemoryRegionCreate(Size, Size, 0, &KernelMapping, UserRingOut,
+        &Ring->MemoryRegionHandle);
+    if (Status != OsSuccess) {
+        kfree(Ring);
+        return Status;
+    }
+    
+    Ring->Header = (struct ipring_header*)KernelMapping;
+    memset(Ring->Header, 0, Size);
+    Ring->Header->entries = Entries;
+    Ring->Entries         = Entries;
+    Ring->Submissions     = IPRING_SQES(Ring->Header);
+    Ring->Completions     = IPRING_CQES(Ring->Header);
+    IrqSpinlockConstruct(&Ring->CompletionLock);
+    SemaphoreConstruct(&Ring->WaitObject, 0, Entries * 2);
+    
+    Ring->Handle = CreateHandle(HandleTypeIpcRing, IpcRingDestroy, Ring);
+    *HandleOut   = Ring->Handle;
+    return OsSuccess;
+}
+
+static int
+IsRingTarget(
+    _In_ IpcRingTarget_t*   Target,
+    _In_ struct ipmsg_addr* Address)
+{
+    if (!Target->Context) {
+        return 0;
+    }
+    
+    if (Address->type == IPMSG_ADDRESS_HANDLE) {
+        return !Target->Path && Target->Handle == Address->data.handle;
+    }
+    return Target->Path && !strcmp(Target->Path, Address->data.path);
+}
+
+// Resolves the target of a ring submission. Both the path lookup and the handle lookup
+// search every handle in the system, so the resolved context of each target is cached
+// per ring. A cached context is used as is until any handle in the system is destroyed,
+// after that it is looked up once more before it is used again.
+static IpcContext_t*
+ResolveRingTarget(
+    _In_ IpcRing_t*         Ring,
+    _In_ struct ipmsg_addr* Address)
+{
+    IpcRingTarget_t* Target;
+    IpcContext_t*    Context;
+    unsigned int     Generation = GetHandleGeneration();
+    UUId_t           Handle;
+    size_t           PathLength;
+    int              i;
+    
+    for (i = 0; i < IPC_RING_TARGET_CACHE; i++) {
+        Target = &Ring->Targets[i];
+        if (IsRingTarget(Target, Address)) {
+            if (Target->Generation == Generation) {
+                return Target->Context;
+            }
+            
+            Context = LookupHandleOfType(Target->Handle, HandleTypeIpcContext);
+            if (Context) {
+                Target->Context    = Context;
+                Target->Generation = Generation;
+                return Context;
+            }
+            
+            // The target was destroyed, drop the stale entry
+            ClearRingTarget(Target);
+            break;
+        }
+    }
+    
+    if (Address->type == IPMSG_ADDRESS_HANDLE) {
+        Handle = Address->data.handle;
+    }
+    else if (LookupHandleByPath(Address->data.path, &Handle) != OsSuccess) {
+        ERROR("[ipc] [ring] could not find target path %s", Address->data.path);
+        return NULL;
+    }
+    
+    Context = LookupHandleOfType(Handle, HandleTypeIpcContext);
+    if (!Context) {
+        ERROR("[ipc] [ring] could not find target handle %u", Handle);
+        return NULL;
+    }
+    
+    Target = &Ring->Targets[Ring->TargetIndex];
+    ClearRingTarget(Target);
+    if (Address->type != IPMSG_ADDRESS_HANDLE) {
+        PathLength   = strlen(Address->data.path) + 1;
+        Target->Path = kmalloc(PathLength);
+        if (!Target->Path) {
+            return Context;
+        }
+        memcpy(Target->Path, Address->data.path, PathLength);
+    }
+    
+    Target->Handle     = Handle;
+    Target->Context    = Context;
+    Target->Generation = Generation;
+    Ring->TargetIndex  = (Ring->TargetIndex + 1) % IPC_RING_TARGET_CACHE;
+    return Context;
+}
+
+// The submitting thread is not blocked while the kernel processes the ring, so the
+// message descriptor is copied once and only the copy is validated and used.
+static OsStatus_t
+CopyRingMessage(
+    _In_ struct gracht_message* Source,
+    _In_ struct gracht_message* Destination)
+{
+    size_t Length;
+    int    ParamCount;
+    int    i;
+    
+    if (!Source) {
+        return OsInvalidParameters;
+    }
+    
+    memcpy(&Destination->header, &Source->header, sizeof(struct gracht_message_header));
+    ParamCount = Destination->header.param_in + Destination->header.param_out;
+    if (ParamCount > IPC_MAX_PARAMS) {
+        return OsInvalidParameters;
+    }
+    memcpy(&Destination->params[0], &Source->params[0], ParamCount * sizeof(struct gracht_param));
+    
+    // The receiver space is allocated from the length, it must cover everything written
+    Length = sizeof(struct gracht_message) + (ParamCount * sizeof(struct gracht_param));
+    for (i = 0; i < Destination->header.param_in; i++) {
+        if (Destination->params[i].type == GRACHT_PARAM_BUFFER) {
+            Length += Destination->params[i].length;
+        }
+    }
+    if (Length > Destination->header.length) {
+        return OsInvalidParameters;
+    }
+    return OsSuccess;
+}
+
+static void
+SubmitRingEntry(
+    _In_ IpcRing_t*         Ring,
+    _In_ struct ipring_sqe* Entry,
+    _In_ struct wake_batch* Wakes)
+{
+    struct message_state State;
+    struct gracht_param  Params[IPC_MAX_PARAMS];
+    union {
+        struct gracht_message Message;
+        uint8_t               Storage[sizeof(struct gracht_message) + (IPC_MAX_PARAMS * sizeof(struct gracht_param))];
+    } Base;
+    struct ipmsg_resp    Response = { 
+        Entry->dma_handle, Entry->dma_offset, IPMSG_NOTIFY_RING, Entry->user_data, { Ring->Handle }
+    };
+    struct ipmsg_desc    Message  = { &Entry->address, &Base.Message, &Response };
+    IpcContext_t*        Target;
+    OsStatus_t           Status;
+    
+    Status = CopyRingMessage(Entry->base, &Base.Message);
+    if (Status != OsSuccess) {
+        PostCompletion(Ring, Entry->user_data, Status);
+        return;
+    }
+    
+    Target = ResolveRingTarget(Ring, &Entry->address);
+    if (!Target) {
+        PostCompletion(Ring, Entry->user_data, OsDoesNotExist);
+        return;
+    }
+    
+    Status = MapGrants(Target, &Message, &Params[0], 1);
+    if (Status != OsSuccess) {
+        PostCompletion(Ring, Entry->user_data, Status);
+        return;
+    }
+    
+    Status = AllocateMessage(Target, &Message, &State);
+    if (Status != OsSuccess) {
+        RevokeGrants(Target, &Message, &Params[0]);
+        PostCompletion(Ring, Entry->user_data, Status);
+        return;
+    }
+    
+    WriteMessage(Target, &Message, &Params[0], &State);
+    SendMessage(Target, &Message, &State, Wakes);
+    
+    // Messages without a response are complete once they are delivered, the others
+    // complete when the receiver responds
+    if (Base.Message.header.flags & MESSAGE_FLAG_ASYNC) {
+        PostCompletion(Ring, Entry->user_data, OsSuccess);
+    }
+}
+
+OsStatus_t
+IpcContextRingEnter(
+    _In_ UUId_t       Handle,
+    _In_ unsigned int WaitCount,
+    _In_ size_t       Timeout)
+{
+    IpcRing_t*            Ring = LookupHandleOfType(Handle, HandleTypeIpcRing);
+    struct ipring_header* Header;
+    struct wake_batch     Wakes = { { 0 }, 0 };
+    unsigned int          Head;
+    unsigned int          Tail;
+    
+    if (!Ring) {
+        return OsDoesNotExist;
+    }
+    
+    Header = Ring->Header;
+    Head   = atomic_load(&Header->sq_head);
+    Tail   = atomic_load(&Header->sq_tail);
+    if ((Tail - Head) > Ring->Entries) {
+        return OsInvalidParameters;
+    }
+    
+    TRACE("[ipc] [ring] submitting %u entries", Tail - Head);
+    while (Head != Tail) {
+        // Copy the entry before using it, the submission memory is shared
+        struct ipring_sqe Entry;
+        memcpy(&Entry, &Ring->Submissions[Head & (Ring->Entries - 1)], sizeof(struct ipring_sqe));
+        SubmitRingEntry(Ring, &Entry, &Wakes);
+        atomic_store(&Header->sq_head, ++Head);
+    }
+    FlushWakes(&Wakes);
+    
+    while (WaitCount) {
+        unsigned int Available = atomic_load(&Header->cq_tail) - atomic_load(&Header->cq_head);
+        if (Available >= WaitCount) {
+            break;
+        }
+        
+        if (SemaphoreWait(&Ring->WaitObject, Timeout) == OsTimeout) {
+            return OsTimeout;
+        }
+    }
+    return OsSuccess;
+}
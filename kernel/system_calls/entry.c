@@ -68,6 +68,7 @@ extern OsStatus_t ScGetAssemblyDirectory(char* PathBuffer, size_t MaxLength);
 extern OsStatus_t ScCreateMemorySpace(Flags_t Flags, UUId_t* Handle);
 extern OsStatus_t ScGetThreadMemorySpaceHandle(UUId_t ThreadHandle, UUId_t* Handle);
 extern OsStatus_t ScCreateMemorySpaceMapping(UUId_t Handle, struct MemoryMappingParameters* Parameters, void** AddressOut);
+extern OsStatus_t ScCreateMemoryRegionMapping(UUId_t Handle, UUId_t RegionHandle, struct MemoryMappingParameters* Parameters);
 
 // Driver system calls
 extern OsStatus_t ScAcpiQueryStatus(AcpiDescriptor_t* AcpiDescriptor);
@@ -143,7 +144,7 @@ extern OsStatus_t ScPerformanceFrequency(LargeInteger_t *Frequency);
 extern OsStatus_t ScPerformanceTick(LargeInteger_t *Value);
 extern OsStatus_t ScIsServiceAvailable(UUId_t ServiceId);
 
-#define SYSTEM_CALL_COUNT 74
+#define SYSTEM_CALL_COUNT 77
 
 typedef size_t(*SystemCallHandlerFn)(void*,void*,void*,void*,void*);
 
@@ -256,7 +257,14 @@ static struct SystemCallDescriptor {
     DefineSyscall(70, ScSystemTick),
     DefineSyscall(71, ScPerformanceFrequency),
     DefineSyscall(72, ScPerformanceTick),
-    DefineSyscall(73, ScSystemTime)
+    DefineSyscall(73, ScSystemTime),
+    
+    // Communication ring system calls
+    DefineSyscall(74, IpcContextRingCreate),
+    DefineSyscall(75, IpcContextRingEnter),
+    
+    // Memory space system calls
+    DefineSyscall(76, ScCreateMemoryRegionMapping)
 };
 
 Context_t*
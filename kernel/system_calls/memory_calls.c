@@ -271,10 +271,17 @@ ScDmaAttachmentResize(
     _In_ struct dma_attachment* attachment,
     _In_ size_t                 length)
 {
+    OsStatus_t Status;
+    
     if (!attachment) {
         return OsInvalidParameters;
     }
-    return MemoryRegionResize(attachment->handle, attachment->buffer, length);
+    
+    Status = MemoryRegionResize(attachment->handle, attachment->buffer, length);
+    if (Status == OsSuccess) {
+        attachment->length = length;
+    }
+    return Status;
 }
 
 OsStatus_t
@@ -400,3 +407,30 @@ ScCreateMemorySpaceMapping(
     *AddressOut = (void*)CopyPlacement;
     return Status;
 }
+
+OsStatus_t
+ScCreateMemoryRegionMapping(
+    _In_ UUId_t                          Handle,
+    _In_ UUId_t                          RegionHandle,
+    _In_ struct MemoryMappingParameters* Parameters)
+{
+    SystemMemorySpace_t* MemorySpace   = (SystemMemorySpace_t*)LookupHandleOfType(Handle, HandleTypeMemorySpace);
+    Flags_t              RequiredFlags = 0;
+    
+    if (Parameters == NULL) {
+        return OsInvalidParameters;
+    }
+    
+    if (GetCurrentModule() == NULL || MemorySpace == NULL) {
+        return OsDoesNotExist;
+    }
+    
+    if (Parameters->Flags & MEMORY_EXECUTABLE) {
+        RequiredFlags |= MAPPING_EXECUTABLE;
+    }
+    if (!(Parameters->Flags & MEMORY_WRITE)) {
+        RequiredFlags |= MAPPING_READONLY;
+    }
+    return MemoryRegionMapInto(RegionHandle, MemorySpace, Parameters->VirtualAddress,
+        Parameters->Length, RequiredFlags);
+}
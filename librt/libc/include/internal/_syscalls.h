@@ -110,4 +110,9 @@ _CODE_END
 #define Syscall_SystemPerformanceTime(Value)                               (OsStatus_t)syscall1(72, SCPARAM(Value))
 #define Syscall_SystemTime(Time)                                           (OsStatus_t)syscall1(73, SCPARAM(Time))
 
+#define Syscall_IpcRingCreate(Entries, HandleOut, UserRingOut)             (OsStatus_t)syscall3(74, SCPARAM(Entries), SCPARAM(HandleOut), SCPARAM(UserRingOut))
+#define Syscall_IpcRingEnter(Handle, WaitCount, Timeout)                   (OsStatus_t)syscall3(75, SCPARAM(Handle), SCPARAM(WaitCount), SCPARAM(Timeout))
+
+#define Syscall_CreateMemoryRegionMapping(Handle, RegionHandle, Parameters) (OsStatus_t)syscall3(76, SCPARAM(Handle), SCPARAM(RegionHandle), SCPARAM(Parameters))
+
 #endif //!__INTERNAL_CRT_SYSCALLS__
@@ -46,6 +46,7 @@ struct ipmsg_addr {
 #define IPMSG_NOTIFY_HANDLE_SET 1 // Completion handle
 #define IPMSG_NOTIFY_SIGNAL     2 // SIGIPC
 #define IPMSG_NOTIFY_THREAD     3 // Thread callback
+#define IPMSG_NOTIFY_RING       4 // Completion ring entry
 
 struct ipmsg_resp {
     UUId_t   dma_handle;
@@ -73,11 +74,61 @@ struct ipmsg {
 
 #define IPMSG_DONTWAIT 0x1
 
+// Submission and completion rings
+// A ring is shared between the kernel and a single producer thread. Messages are
+// queued in the submission queue and submitted in one system call, and the kernel
+// posts a completion for each message once it has been delivered (asynchronous
+// messages) or responded to. Completions are reaped without system calls.
+#define IPRING_MAX_ENTRIES 256
+
+struct ipring_sqe {
+    struct ipmsg_addr      address;
+    struct gracht_message* base;
+    UUId_t                 dma_handle;
+    uint16_t               dma_offset;
+    void*                  user_data;
+};
+
+struct ipring_cqe {
+    void*      user_data;
+    OsStatus_t status;
+};
+
+// The completion queue holds twice the number of submission entries, so responses
+// to a full submission queue can be posted while new messages are queued.
+struct ipring_header {
+    _Atomic(unsigned int) sq_head;
+    _Atomic(unsigned int) sq_tail;
+    _Atomic(unsigned int) cq_head;
+    _Atomic(unsigned int) cq_tail;
+    unsigned int          entries;
+    unsigned int          cq_overflow;
+};
+
+#define IPRING_SQES(header)  ((struct ipring_sqe*)((char*)(header) + sizeof(struct ipring_header)))
+#define IPRING_CQES(header)  ((struct ipring_cqe*)(IPRING_SQES(header) + (header)->entries))
+#define IPRING_SIZE(entries) (sizeof(struct ipring_header) + ((entries) * sizeof(struct ipring_sqe)) + \
+    ((entries) * 2 * sizeof(struct ipring_cqe)))
+
+struct ipring {
+    UUId_t                handle;
+    struct ipring_header* header;
+    struct ipring_sqe*    sqes;
+    struct ipring_cqe*    cqes;
+    unsigned int          sq_pending;
+};
+
 _CODE_BEGIN
 CRTDECL(int, ipcontext(unsigned int, struct ipmsg_addr*));
 CRTDECL(int, putmsg(int, struct ipmsg_desc*, int));
 CRTDECL(int, getmsg(int, struct ipmsg*, unsigned int, int));
 CRTDECL(int, resp(int, struct ipmsg*, struct gracht_message*));
+
+CRTDECL(int,                ipring_create(unsigned int entries, struct ipring*));
+CRTDECL(int,                ipring_destroy(struct ipring*));
+CRTDECL(struct ipring_sqe*, ipring_get_sqe(struct ipring*));
+CRTDECL(int,                ipring_submit(struct ipring*, unsigned int waitCount, size_t timeout));
+CRTDECL(int,                ipring_peek_cqe(struct ipring*, struct ipring_cqe*));
 _CODE_END
 
 #endif //!__IPCONTEXT_H__
@@ -92,8 +92,9 @@ CRTDECL(OsStatus_t, dma_attachment_map(struct dma_attachment* attachment));
 
 /**
  * dma_attachment_resize
- * * Resizes the dma buffer to the given length argument. This must be within
- * * the provided capacity, otherwise the call will fail.
+ * * Grows the dma buffer to the given length argument. This must be within
+ * * the provided capacity, otherwise the call will fail. The new pages are mapped
+ * * into all existing attachment mappings of the buffer.
  * @param attachment [In] The dma buffer attachment that should be resized.
  * @param length     [In] The new length of the buffer attachment segment.
  */
@@ -29,6 +29,7 @@
 #include <internal/_syscalls.h>
 #include <ipcontext.h>
 #include <os/mollenos.h>
+#include <string.h>
 
 int ipcontext(unsigned int len, struct ipmsg_addr* addr)
 {
@@ -159,3 +160,104 @@ int resp(int iod, struct ipmsg* msg, struct gracht_message* msgbase)
     status = Syscall_IpcContextRespond(&msg, &msgbase, 1);
     return OsStatusToErrno(status);
 }
+
+int ipring_create(unsigned int entries, struct ipring* ring)
+{
+    OsStatus_t status;
+    void*      mapping;
+    
+    if (!ring || !entries || entries > IPRING_MAX_ENTRIES || (entries & (entries - 1))) {
+        _set_errno(EINVAL);
+        return -1;
+    }
+    
+    status = Syscall_IpcRingCreate(entries, &ring->handle, &mapping);
+    if (status != OsSuccess) {
+        return OsStatusToErrno(status);
+    }
+    
+    ring->header     = mapping;
+    ring->sqes       = IPRING_SQES(ring->header);
+    ring->cqes       = IPRING_CQES(ring->header);
+    ring->sq_pending = 0;
+    return 0;
+}
+
+int ipring_destroy(struct ipring* ring)
+{
+    OsStatus_t status;
+    
+    if (!ring) {
+        _set_errno(EINVAL);
+        return -1;
+    }
+    
+    // The ring mapping is not removed together with the handle
+    if (ring->header) {
+        status = MemoryFree(ring->header, IPRING_SIZE(ring->header->entries));
+        if (status != OsSuccess) {
+            return OsStatusToErrno(status);
+        }
+        
+        ring->header = NULL;
+        ring->sqes   = NULL;
+        ring->cqes   = NULL;
+    }
+    return OsStatusToErrno(handle_destroy(ring->handle));
+}
+
+struct ipring_sqe* ipring_get_sqe(struct ipring* ring)
+{
+    unsigned int head;
+    unsigned int tail;
+    
+    if (!ring) {
+        _set_errno(EINVAL);
+        return NULL;
+    }
+    
+    head = atomic_load(&ring->header->sq_head);
+    tail = atomic_load(&ring->header->sq_tail) + ring->sq_pending;
+    if ((tail - head) >= ring->header->entries) {
+        _set_errno(EBUSY);
+        return NULL;
+    }
+    
+    ring->sq_pending++;
+    return &ring->sqes[tail & (ring->header->entries - 1)];
+}
+
+int ipring_submit(struct ipring* ring, unsigned int waitCount, size_t timeout)
+{
+    if (!ring) {
+        _set_errno(EINVAL);
+        return -1;
+    }
+    
+    // Publish the queued entries, the kernel consumes everything up to the tail
+    if (ring->sq_pending) {
+        atomic_store(&ring->header->sq_tail, atomic_load(&ring->header->sq_tail) + ring->sq_pending);
+        ring->sq_pending = 0;
+    }
+    return OsStatusToErrno(Syscall_IpcRingEnter(ring->handle, waitCount, timeout));
+}
+
+int ipring_peek_cqe(struct ipring* ring, struct ipring_cqe* cqe)
+{
+    unsigned int head;
+    
+    if (!ring || !cqe) {
+        _set_errno(EINVAL);
+        return -1;
+    }
+    
+    head = atomic_load(&ring->header->cq_head);
+    if (head == atomic_load(&ring->header->cq_tail)) {
+        _set_errno(ENODATA);
+        return -1;
+    }
+    
+    memcpy(cqe, &ring->cqes[head & ((ring->header->entries * 2) - 1)], sizeof(struct ipring_cqe));
+    atomic_store(&ring->header->cq_head, head + 1);
+    return 0;
+}
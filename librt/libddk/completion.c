@@ -0,0 +1,231 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Completion Batching
+ *  - Completion queues and interrupt moderation for drivers. This part only
+ *    depends on the C library so it can be tested on the host.
+ */
+
+#include <ddk/completion.h>
+
+// The critical sections are a handful of instructions, so a plain spin is enough
+static void
+CompletionQueueLock(
+    CompletionQueue_t* Queue)
+{
+    while (atomic_exchange_explicit(&Queue->Lock, 1, memory_order_acquire)) {
+        while (atomic_load_explicit(&Queue->Lock, memory_order_relaxed));
+    }
+}
+
+static void
+CompletionQueueUnlock(
+    CompletionQueue_t* Queue)
+{
+    atomic_store_explicit(&Queue->Lock, 0, memory_order_release);
+}
+
+void
+CompletionQueueInitialize(
+    CompletionQueue_t*      Queue,
+    CompletionQueueCallback Callback,
+    void*                   Context)
+{
+    atomic_store(&Queue->Lock, 0);
+    Queue->Head     = NULL;
+    Queue->Tail     = NULL;
+    Queue->Count    = 0;
+    Queue->Callback = Callback;
+    Queue->Context  = Context;
+}
+
+int
+CompletionQueuePush(
+    CompletionQueue_t* Queue,
+    CompletionEntry_t* Entry)
+{
+    int Result = -1;
+
+    CompletionQueueLock(Queue);
+    if (!Entry->Queued) {
+        Entry->Link   = NULL;
+        Entry->Queued = 1;
+        if (Queue->Tail != NULL) {
+            Queue->Tail->Link = Entry;
+        }
+        else {
+            Queue->Head = Entry;
+        }
+        Queue->Tail = Entry;
+        Queue->Count++;
+        Result = 0;
+    }
+    CompletionQueueUnlock(Queue);
+    return Result;
+}
+
+void
+CompletionQueueRemove(
+    CompletionQueue_t* Queue,
+    CompletionEntry_t* Entry)
+{
+    CompletionEntry_t* Previous = NULL;
+    CompletionEntry_t* Itr;
+
+    CompletionQueueLock(Queue);
+    if (Entry->Queued) {
+        for (Itr = Queue->Head; Itr != NULL && Itr != Entry; Itr = Itr->Link) {
+            Previous = Itr;
+        }
+        if (Itr != NULL) {
+            if (Previous != NULL) {
+                Previous->Link = Entry->Link;
+            }
+            else {
+                Queue->Head = Entry->Link;
+            }
+            if (Queue->Tail == Entry) {
+                Queue->Tail = Previous;
+            }
+            Queue->Count--;
+        }
+        Entry->Link   = NULL;
+        Entry->Queued = 0;
+    }
+    CompletionQueueUnlock(Queue);
+}
+
+int
+CompletionQueueDrain(
+    CompletionQueue_t* Queue,
+    int                Budget)
+{
+    CompletionEntry_t* Entry;
+    int                Completed = 0;
+
+    while (Completed < Budget) {
+        CompletionQueueLock(Queue);
+        Entry = Queue->Head;
+        if (Entry != NULL) {
+            Queue->Head = Entry->Link;
+            if (Queue->Head == NULL) {
+                Queue->Tail = NULL;
+            }
+            Queue->Count--;
+            Entry->Link   = NULL;
+            Entry->Queued = 0;
+        }
+        CompletionQueueUnlock(Queue);
+        if (Entry == NULL) {
+            break;
+        }
+
+        Queue->Callback(Entry, Queue->Context);
+        Completed++;
+    }
+    return Completed;
+}
+
+int
+CompletionQueuePending(
+    CompletionQueue_t* Queue)
+{
+    int Count;
+
+    CompletionQueueLock(Queue);
+    Count = Queue->Count;
+    CompletionQueueUnlock(Queue);
+    return Count;
+}
+
+void
+CompletionQueueClear(
+    CompletionQueue_t* Queue)
+{
+    CompletionEntry_t* Entry;
+
+    CompletionQueueLock(Queue);
+    Entry = Queue->Head;
+    while (Entry != NULL) {
+        CompletionEntry_t* Next = Entry->Link;
+        Entry->Link   = NULL;
+        Entry->Queued = 0;
+        Entry         = Next;
+    }
+    Queue->Head  = NULL;
+    Queue->Tail  = NULL;
+    Queue->Count = 0;
+    CompletionQueueUnlock(Queue);
+}
+
+void
+CompletionModeratorInitialize(
+    CompletionModerator_t* Moderator,
+    int                    MaxThreshold)
+{
+    Moderator->MaxThreshold = MaxThreshold < 1 ? 1 : MaxThreshold;
+    Moderator->Threshold    = 1;
+    Moderator->Interrupts   = 0;
+    Moderator->Completions  = 0;
+}
+
+int
+CompletionModeratorUpdate(
+    CompletionModerator_t* Moderator,
+    int                    Completed,
+    int                    Outstanding)
+{
+    int Target;
+
+    if (Completed < 0) {
+        Completed = 0;
+    }
+    if (Outstanding < 0) {
+        Outstanding = 0;
+    }
+    Moderator->Interrupts++;
+    Moderator->Completions += (unsigned long)Completed;
+
+    // Collect half of the queue depth per interrupt, so the other half keeps the
+    // device busy while the driver completes and refills
+    Target = (Completed + Outstanding) / 2;
+    if (Target > Moderator->MaxThreshold) {
+        Target = Moderator->MaxThreshold;
+    }
+    if (Target < 1) {
+        Target = 1;
+    }
+
+    // Lower right away when less is in flight than the hardware waits for,
+    // otherwise only react to the depth changing by a factor of two to avoid
+    // reprogramming the hardware on every interrupt
+    if (Outstanding < Moderator->Threshold) {
+        if (Target > Outstanding) {
+            Target = Outstanding < 1 ? 1 : Outstanding;
+        }
+    }
+    else if (Target < (Moderator->Threshold * 2) && (Target * 2) > Moderator->Threshold) {
+        return 0;
+    }
+
+    if (Target == Moderator->Threshold) {
+        return 0;
+    }
+    Moderator->Threshold = Target;
+    return 1;
+}
@@ -0,0 +1,126 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Completion Batching
+ *  - Completion queues let drivers record finished requests from the interrupt
+ *    handler and complete them afterwards in bounded batches. The moderator adapts
+ *    the interrupt coalescing of the hardware to the number of requests in flight.
+ *    This part only depends on the C library so it can be tested on the host.
+ */
+
+#ifndef __DDK_COMPLETION_H__
+#define __DDK_COMPLETION_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Embedded in the request structure of the driver. An entry is queued at most
+// once, queueing it again before it has been processed does nothing.
+typedef struct CompletionEntry {
+    struct CompletionEntry* Link;
+    int                     Queued;
+} CompletionEntry_t;
+
+#define COMPLETION_ENTRY_OWNER(Entry, Type, Member) ((Type*)((char*)(Entry) - offsetof(Type, Member)))
+
+typedef void(*CompletionQueueCallback)(CompletionEntry_t* Entry, void* Context);
+
+typedef struct CompletionQueue {
+    _Atomic(int)            Lock;
+    CompletionEntry_t*      Head;
+    CompletionEntry_t*      Tail;
+    int                     Count;
+    CompletionQueueCallback Callback;
+    void*                   Context;
+} CompletionQueue_t;
+
+// The threshold is the number of completions the hardware should collect before it
+// raises an interrupt, 1 means that coalescing is off.
+typedef struct CompletionModerator {
+    int           MaxThreshold;
+    int           Threshold;
+    unsigned long Interrupts;
+    unsigned long Completions;
+} CompletionModerator_t;
+
+/* CompletionQueueInitialize
+ * Registers the callback that completes the entries of the queue. */
+extern void
+CompletionQueueInitialize(
+    CompletionQueue_t*      Queue,
+    CompletionQueueCallback Callback,
+    void*                   Context);
+
+/* CompletionQueuePush
+ * Queues the entry for completion in the order entries are pushed. Returns 0 if
+ * the entry was queued, or -1 if it already is. */
+extern int
+CompletionQueuePush(
+    CompletionQueue_t* Queue,
+    CompletionEntry_t* Entry);
+
+/* CompletionQueueRemove
+ * Takes the entry out of the queue without completing it, must be done before
+ * an entry that is queued is freed. */
+extern void
+CompletionQueueRemove(
+    CompletionQueue_t* Queue,
+    CompletionEntry_t* Entry);
+
+/* CompletionQueueDrain
+ * Invokes the callback for at most Budget entries, one at the time and without
+ * the queue being locked, so the callback may push entries again. Returns the
+ * number of entries completed. */
+extern int
+CompletionQueueDrain(
+    CompletionQueue_t* Queue,
+    int                Budget);
+
+/* CompletionQueuePending
+ * Returns the number of entries waiting to be completed. */
+extern int
+CompletionQueuePending(
+    CompletionQueue_t* Queue);
+
+/* CompletionQueueClear
+ * Forgets all queued entries without completing them. */
+extern void
+CompletionQueueClear(
+    CompletionQueue_t* Queue);
+
+/* CompletionModeratorInitialize
+ * Starts out with coalescing off, MaxThreshold is the largest threshold the
+ * hardware supports. */
+extern void
+CompletionModeratorInitialize(
+    CompletionModerator_t* Moderator,
+    int                    MaxThreshold);
+
+/* CompletionModeratorUpdate
+ * Accounts an interrupt that completed the given number of requests, with the
+ * number of requests that are still in flight afterwards. The threshold follows
+ * half the queue depth, and is never more than what is still in flight so nothing
+ * waits for the timeout of the hardware. Returns 1 if the threshold changed and the
+ * hardware must be reprogrammed. */
+extern int
+CompletionModeratorUpdate(
+    CompletionModerator_t* Moderator,
+    int                    Completed,
+    int                    Outstanding);
+
+#endif //!__DDK_COMPLETION_H__
@@ -55,4 +55,13 @@ CreateMemoryMapping(
     _In_  struct MemoryMappingParameters* Parameters,
     _Out_ void**                          AddressOut));
 
+/* CreateMemoryRegionMapping
+ * Maps the pages of a dma buffer into the memory space at a fixed address. The pages stay
+ * owned by the buffer, so it must outlive the mapping. Unmapping them does not release them. */
+DDKDECL(OsStatus_t,
+CreateMemoryRegionMapping(
+    _In_ UUId_t                          Handle,
+    _In_ UUId_t                          RegionHandle,
+    _In_ struct MemoryMappingParameters* Parameters));
+
 #endif //!__MEMORY_INTERFACE__
@@ -42,4 +42,14 @@ typedef struct StorageDescriptor {
     size_t   LUNCount;
 } StorageDescriptor_t;
 
+// A buffer segment of a vectored transfer. The segments of a request are filled in
+// order from the first sector, and their lengths must be multiples of the sector size.
+typedef struct StorageSegment {
+    UUId_t       BufferHandle;
+    unsigned int Offset;
+    size_t       Length;
+} StorageSegment_t;
+
+#define STORAGE_MAX_SEGMENTS                16
+
 #endif //!__DDK_STORAGE_H__
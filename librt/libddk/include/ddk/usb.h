@@ -29,6 +29,7 @@
 #include <ddk/bufferpool.h>
 #include <ddk/busdevice.h>
 #include <ddk/usb/definitions.h>
+#include <ddk/usb/isoc.h>
 #include <ddk/service.h>
 
 /* USB Definitions
@@ -81,13 +82,19 @@ PACKED_TYPESTRUCT(UsbHcEndpointDescriptor, {
 	size_t                       MaxPacketSize;
 	size_t                       Bandwidth;
 	size_t                       Interval;
+	size_t                       MaxBurst;      // SuperSpeed only, packets per burst - 1
+	size_t                       MaxStreams;    // SuperSpeed bulk only, 0 if streams are not supported
+	size_t                       PipeId;        // USB Attached SCSI pipe usage, 0 if not present
 });
 
 /* UsbHcInterfaceVersion 
- * Describes a version of an interface and it's endpoint count. */
+ * Describes a version of an interface and it's endpoint count. The endpoints
+ * of the version starts at EndpointIndex in the device endpoint table. */
 PACKED_TYPESTRUCT(UsbHcInterfaceVersion, {
-	int Id;
-	int EndpointCount;
+	int    Id;
+	size_t Protocol;
+	int    EndpointCount;
+	int    EndpointIndex;
 });
 
 /* UsbHcInterface 
@@ -190,7 +197,8 @@ typedef enum _UsbTransferStatus {
 	TransferInvalidToggles,
     TransferBufferError,
 	TransferNAK,
-	TransferBabble
+	TransferBabble,
+    TransferCancelled
 } UsbTransferStatus_t;
 
 PACKED_TYPESTRUCT(UsbTransaction, {
@@ -216,6 +224,7 @@ PACKED_TYPESTRUCT(UsbTransfer, {
 	
     UsbTransaction_t          Transactions[USB_TRANSACTIONCOUNT];
     int                       TransactionCount;
+    int                       StreamId;         // Bulk stream to use on stream endpoints
 
 	// Periodic Information
     const void*               PeriodicData;
@@ -226,6 +235,7 @@ PACKED_TYPESTRUCT(UsbTransfer, {
  * Bit-definitions and declarations for the field. */
 #define USB_TRANSFER_NO_NOTIFICATION 0x00000001
 #define USB_TRANSFER_SHORT_NOT_OK    0x00000002
+#define USB_TRANSFER_STREAM          0x00000004 // Isochronous stream, see UsbTransferIsochronousStream
 
 PACKED_TYPESTRUCT(UsbTransferResult, {
 	UUId_t				Id;
@@ -282,6 +292,46 @@ UsbTransferPeriodic(
     _In_ UsbTransactionType_t DataDirection,
     _In_ const void*          NotifificationData);
 
+/* UsbTransferIsochronousStream
+ * Initializes a transfer for a persistant isochronous stream. The buffer is split into
+ * segments of SegmentLength bytes that the controller keeps cycling through, and every
+ * completed segment is reported through the completion ring in the ring buffer instead
+ * of a notification. The ring must be initialized with UsbIsocRingInitialize.
+ * Streams are only available on EHCI controllers, for high-speed endpoints and for
+ * full-speed endpoints behind the transaction translator of a high-speed hub. A
+ * full-speed segment is a single packet, and in-segments are limited to 940 bytes so
+ * the split transaction completes in the frame it started in. Other controllers and
+ * speeds fail the transfer with TransferInvalid. */
+__EXTERN
+OsStatus_t
+UsbTransferIsochronousStream(
+    _In_ UsbTransfer_t*       Transfer,
+    _In_ UUId_t               BufferHandle,
+    _In_ size_t               BufferOffset,
+    _In_ size_t               BufferLength,
+    _In_ size_t               SegmentLength,
+    _In_ UsbTransactionType_t DataDirection,
+    _In_ UUId_t               RingHandle,
+    _In_ size_t               RingOffset,
+    _In_ size_t               RingLength);
+
+/* UsbIsocRingWait
+ * Waits for completions to be available in the ring of an isochronous stream. Returns
+ * OsSuccess if there are completions to read, or OsTimeout. A timeout of 0 waits forever. */
+__EXTERN
+OsStatus_t
+UsbIsocRingWait(
+    _In_ UsbIsocRing_t* Ring,
+    _In_ size_t         Timeout);
+
+/* UsbIsocRingSignal
+ * Wakes the owner of the ring if it is waiting for completions. Used by the host
+ * drivers once per batch of completions. */
+__EXTERN
+void
+UsbIsocRingSignal(
+    _In_ UsbIsocRing_t* Ring);
+
 /* UsbTransferIn 
  * Creates an In-transaction in the given usb-transfer. Both buffer and length 
  * must be pre-allocated - and passed here. If handshake == 1 it's an ack-transaction. */
@@ -318,6 +368,35 @@ UsbTransferQueue(
 	_In_  UsbTransfer_t* Transfer,
 	_Out_ size_t*        BytesTransferred);
 
+/* UsbTransferAllocateId
+ * Allocates a transfer id that is unique for this process, to be used with
+ * UsbTransferQueueWithId. */
+__EXTERN
+UUId_t
+UsbTransferAllocateId(void);
+
+/* UsbTransferQueueWithId 
+ * Same as UsbTransferQueue, but the transfer is queued under the given id so
+ * another thread can cancel it with UsbTransferCancel while this one waits. */
+__EXTERN
+UsbTransferStatus_t
+UsbTransferQueueWithId(
+	_In_  UUId_t         InterfaceId,
+	_In_  UUId_t         DeviceId,
+	_In_  UsbTransfer_t* Transfer,
+	_In_  UUId_t         TransferId,
+	_Out_ size_t*        BytesTransferred);
+
+/* UsbTransferCancel 
+ * Cancels a pending Control or Bulk transfer, it then completes with TransferCancelled.
+ * Returns OsDoesNotExist if the controller has not seen the transfer or it is done. */
+__EXTERN
+OsStatus_t
+UsbTransferCancel(
+	_In_ UUId_t InterfaceId,
+	_In_ UUId_t DeviceId,
+	_In_ UUId_t TransferId);
+
 /* UsbTransferQueuePeriodic 
  * Queues a new Interrupt or Isochronous transfer. This transfer is 
  * persistant untill device is disconnected or Dequeue is called. 
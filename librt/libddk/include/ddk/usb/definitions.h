@@ -142,6 +142,7 @@ PACKED_TYPESTRUCT(UsbPacket, {
 #define USB_DESCRIPTOR_INTERFACE_ASC    0x0B
 #define USB_DESCRIPTOR_BOS              0x0F
 #define USB_DESCRIPTOR_DEV_CAPS         0x10
+#define USB_DESCRIPTOR_PIPE_USAGE       0x24    //UAS Pipe Usage
 #define USB_DESCRIPTOR_SS_EP_CPN        0x30
 #define USB_DESCRIPTOR_SS_ISO_EP_CPN    0x31
 
@@ -231,6 +232,40 @@ PACKED_TYPESTRUCT(UsbEndpointDescriptor, {
 #define USB_ENDPOINT_ATTRIBUTES_SYNC(Attributes)    ((UsbEndpointSynchronization_t)((Attributes >> 2) & 0x3))
 #define USB_ENDPOINT_ATTRIBUTES_FEEDBACK            0x10
 
+/* UsbSsEndpointCompanionDescriptor (Shared)
+ * Follows every endpoint descriptor of a SuperSpeed device and describes
+ * the burst and stream capabilities of the endpoint */
+PACKED_TYPESTRUCT(UsbSsEndpointCompanionDescriptor, {
+    uint8_t             Length;         // Header - Length
+    uint8_t             Type;           // Header - Type
+
+    uint8_t             MaxBurst;       // Packets per burst - 1
+    uint8_t             Attributes;     // Bulk: max streams as 2^n, Isoc: mult
+    uint16_t            BytesPerInterval;
+});
+
+/* UsbSsEndpointCompanionDescriptor Definitions
+ * Contains bit-definitions and magic values for the field UsbSsEndpointCompanionDescriptor::Attributes */
+#define USB_SS_COMPANION_MAXSTREAMS(Attributes)     (Attributes & 0x1F)
+
+/* UsbPipeUsageDescriptor (Shared)
+ * Follows the endpoint descriptors of an USB Attached SCSI interface and
+ * tells which role the endpoint has */
+PACKED_TYPESTRUCT(UsbPipeUsageDescriptor, {
+    uint8_t             Length;         // Header - Length
+    uint8_t             Type;           // Header - Type
+
+    uint8_t             PipeId;
+    uint8_t             Reserved;
+});
+
+/* UsbPipeUsageDescriptor Definitions
+ * Contains bit-definitions and magic values for the field UsbPipeUsageDescriptor::PipeId */
+#define USB_PIPE_COMMAND                            0x01
+#define USB_PIPE_STATUS                             0x02
+#define USB_PIPE_DATA_IN                            0x03
+#define USB_PIPE_DATA_OUT                           0x04
+
 /* UsbStringDescriptor (Shared)
  * Contains the structure of the string-descriptor returned 
  * by an usb device */
@@ -0,0 +1,93 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Usb Isochronous Streams
+ *  - Completion ring shared between the usb host driver and the driver that owns
+ *    an isochronous stream. The host driver is the only producer and the owner the
+ *    only consumer. This part only depends on the C library so it can be tested
+ *    on the host.
+ */
+
+#ifndef __USB_ISOC_H__
+#define __USB_ISOC_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct UsbIsocCompletion {
+    uint32_t Sequence; // Segments completed since the stream was started
+    uint32_t Offset;   // Offset of the segment in the stream buffer
+    uint32_t Length;   // Bytes transferred
+    int      Status;   // UsbTransferStatus_t of the segment
+} UsbIsocCompletion_t;
+
+// The producer and consumer are free running counters, and the producer is
+// also the word the consumer sleeps on.
+typedef struct UsbIsocRing {
+    _Atomic(int)        Producer;
+    _Atomic(int)        Consumer;
+    _Atomic(int)        Waiters;
+    _Atomic(int)        Dropped;
+    int                 Capacity;
+    int                 Reserved[3];
+    UsbIsocCompletion_t Entries[];
+} UsbIsocRing_t;
+
+/* UsbIsocRingCapacity
+ * Returns the number of completions a ring of Length bytes can hold, this is always
+ * a power of two. Returns 0 if the buffer is too small to hold a ring. */
+extern int
+UsbIsocRingCapacity(
+    size_t Length);
+
+/* UsbIsocRingInitialize
+ * Initializes an empty ring in the buffer of Length bytes. Must be done by the owner
+ * before the stream is queued. Returns -1 if the buffer is too small. */
+extern int
+UsbIsocRingInitialize(
+    UsbIsocRing_t* Ring,
+    size_t         Length);
+
+/* UsbIsocRingPush
+ * Publishes a completion to the consumer. If the ring is full the completion is
+ * dropped and counted in Dropped, and -1 is returned. The ring memory is writable
+ * by the consumer, so the producer passes the Capacity it validated when the ring
+ * was handed over instead of trusting the header. */
+extern int
+UsbIsocRingPush(
+    UsbIsocRing_t*             Ring,
+    int                        Capacity,
+    const UsbIsocCompletion_t* Completion);
+
+/* UsbIsocRingRead
+ * Reads up to Count completions in one go, returns the number read. */
+extern int
+UsbIsocRingRead(
+    UsbIsocRing_t*       Ring,
+    UsbIsocCompletion_t* Completions,
+    int                  Count);
+
+/* UsbIsocRingHasWaiters
+ * Returns 1 if the consumer sleeps on the ring or is about to. The producer
+ * uses this to only wake the consumer once per batch, and only when needed. */
+extern int
+UsbIsocRingHasWaiters(
+    UsbIsocRing_t* Ring);
+
+#endif //!__USB_ISOC_H__
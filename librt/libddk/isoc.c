@@ -0,0 +1,117 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Usb Isochronous Streams
+ *  - Completion ring shared between the usb host driver and the driver that owns
+ *    an isochronous stream. This part only depends on the C library so it can be
+ *    tested on the host.
+ */
+
+#include <ddk/usb/isoc.h>
+#include <string.h>
+
+int
+UsbIsocRingCapacity(
+    size_t Length)
+{
+    size_t Count;
+    int    Capacity = 1;
+
+    if (Length < sizeof(UsbIsocRing_t) + (2 * sizeof(UsbIsocCompletion_t))) {
+        return 0;
+    }
+
+    Count = (Length - sizeof(UsbIsocRing_t)) / sizeof(UsbIsocCompletion_t);
+    while ((size_t)Capacity * 2 <= Count && Capacity < (1 << 24)) {
+        Capacity *= 2;
+    }
+    return Capacity;
+}
+
+int
+UsbIsocRingInitialize(
+    UsbIsocRing_t* Ring,
+    size_t         Length)
+{
+    int Capacity = UsbIsocRingCapacity(Length);
+    if (!Ring || !Capacity) {
+        return -1;
+    }
+
+    memset(Ring, 0, sizeof(UsbIsocRing_t));
+    atomic_store(&Ring->Producer, 0);
+    atomic_store(&Ring->Consumer, 0);
+    atomic_store(&Ring->Waiters, 0);
+    atomic_store(&Ring->Dropped, 0);
+    Ring->Capacity = Capacity;
+    return 0;
+}
+
+int
+UsbIsocRingPush(
+    UsbIsocRing_t*             Ring,
+    int                        Capacity,
+    const UsbIsocCompletion_t* Completion)
+{
+    // The counters wrap, so the distance between them is all that matters
+    unsigned int Producer = (unsigned int)atomic_load_explicit(&Ring->Producer, memory_order_relaxed);
+    unsigned int Consumer = (unsigned int)atomic_load_explicit(&Ring->Consumer, memory_order_acquire);
+
+    if (Producer - Consumer >= (unsigned int)Capacity) {
+        atomic_fetch_add_explicit(&Ring->Dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    memcpy(&Ring->Entries[Producer & (Capacity - 1)], Completion, sizeof(UsbIsocCompletion_t));
+    atomic_store(&Ring->Producer, (int)(Producer + 1));
+    return 0;
+}
+
+int
+UsbIsocRingRead(
+    UsbIsocRing_t*       Ring,
+    UsbIsocCompletion_t* Completions,
+    int                  Count)
+{
+    unsigned int Consumer  = (unsigned int)atomic_load_explicit(&Ring->Consumer, memory_order_relaxed);
+    unsigned int Producer  = (unsigned int)atomic_load_explicit(&Ring->Producer, memory_order_acquire);
+    unsigned int Available = Producer - Consumer;
+    int          i;
+
+    if (Count < 0 || Available > (unsigned int)Ring->Capacity) {
+        return 0;
+    }
+    if ((unsigned int)Count > Available) {
+        Count = (int)Available;
+    }
+
+    for (i = 0; i < Count; i++) {
+        memcpy(&Completions[i], &Ring->Entries[(Consumer + i) & (Ring->Capacity - 1)],
+            sizeof(UsbIsocCompletion_t));
+    }
+    atomic_store_explicit(&Ring->Consumer, (int)(Consumer + Count), memory_order_release);
+    return Count;
+}
+
+int
+UsbIsocRingHasWaiters(
+    UsbIsocRing_t* Ring)
+{
+    // Pairs with the consumer announcing itself before it checks the producer
+    return atomic_load(&Ring->Waiters) != 0 ? 1 : 0;
+}
@@ -57,3 +57,15 @@ CreateMemoryMapping(
     }
     return Syscall_CreateMemorySpaceMapping(Handle, Parameters, AddressOut);
 }
+
+OsStatus_t
+CreateMemoryRegionMapping(
+    _In_ UUId_t                          Handle,
+    _In_ UUId_t                          RegionHandle,
+    _In_ struct MemoryMappingParameters* Parameters)
+{
+    if (Parameters == NULL) {
+        return OsError;
+    }
+    return Syscall_CreateMemoryRegionMapping(Handle, RegionHandle, Parameters);
+}
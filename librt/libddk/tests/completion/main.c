@@ -0,0 +1,387 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Completion Batching Test
+ *  - Checks the completion queue on its own and with several producers, and then
+ *    runs a synthetic driver against a device with command completion coalescing.
+ *    Clients keep a fixed number of requests in flight, and the number of
+ *    interrupts per request is measured with and without the moderator.
+ */
+
+#include <ddk/completion.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRODUCER_COUNT   4
+#define PRODUCER_ENTRIES 50000
+#define DRAIN_BUDGET     8
+
+#define REQUEST_COUNT    100000
+#define MAX_DEPTH        32
+#define MAX_THRESHOLD    31   // AHCI allows up to 255, but there are only 32 slots
+#define HW_TIMEOUT       50   // Ticks the hardware waits for the threshold
+
+static int failures = 0;
+
+#define CHECK(expr) do { if (!(expr)) { \
+    printf("FAIL %s:%i: %s\n", __FILE__, __LINE__, #expr); failures++; } } while (0)
+
+struct item {
+    CompletionEntry_t entry; // First, so the entry is the item
+    int               owner;
+    int               index;
+    _Atomic(int)      completions;
+};
+
+static int order[PRODUCER_COUNT];
+
+static void single_callback(CompletionEntry_t* entry, void* context)
+{
+    struct item* item = (struct item*)entry;
+    (void)context;
+    atomic_fetch_add(&item->completions, 1);
+}
+
+static void test_queue(void)
+{
+    CompletionQueue_t queue;
+    struct item       items[6];
+    int               i;
+
+    memset(items, 0, sizeof(items));
+    CompletionQueueInitialize(&queue, single_callback, NULL);
+    CHECK(CompletionQueueDrain(&queue, 10) == 0);
+
+    // Entries are queued once
+    for (i = 0; i < 6; i++) {
+        CHECK(CompletionQueuePush(&queue, &items[i].entry) == 0);
+    }
+    CHECK(CompletionQueuePush(&queue, &items[2].entry) == -1);
+    CHECK(CompletionQueuePending(&queue) == 6);
+
+    // Removing the head, the middle and the tail
+    CompletionQueueRemove(&queue, &items[0].entry);
+    CompletionQueueRemove(&queue, &items[3].entry);
+    CompletionQueueRemove(&queue, &items[5].entry);
+    CompletionQueueRemove(&queue, &items[5].entry);
+    CHECK(CompletionQueuePending(&queue) == 3);
+
+    // The budget bounds the drain, the rest stays queued
+    CHECK(CompletionQueueDrain(&queue, 2) == 2);
+    CHECK(atomic_load(&items[1].completions) == 1 && atomic_load(&items[2].completions) == 1);
+    CHECK(CompletionQueuePending(&queue) == 1);
+
+    // The tail must be correct after removing it, and an entry can be queued
+    // again once it has been completed
+    CHECK(CompletionQueuePush(&queue, &items[1].entry) == 0);
+    CHECK(CompletionQueueDrain(&queue, 10) == 2);
+    CHECK(atomic_load(&items[4].completions) == 1 && atomic_load(&items[1].completions) == 2);
+    CHECK(atomic_load(&items[0].completions) == 0 && atomic_load(&items[5].completions) == 0);
+
+    CHECK(CompletionQueuePush(&queue, &items[0].entry) == 0);
+    CompletionQueueClear(&queue);
+    CHECK(CompletionQueuePending(&queue) == 0 && items[0].entry.Queued == 0);
+    CHECK(CompletionQueueDrain(&queue, 10) == 0);
+}
+
+static void threaded_callback(CompletionEntry_t* entry, void* context)
+{
+    struct item* item = (struct item*)entry;
+    (void)context;
+
+    // Entries of one producer come out in the order it pushed them
+    if (item->index != order[item->owner]) {
+        failures++;
+    }
+    order[item->owner]++;
+    atomic_fetch_add(&item->completions, 1);
+}
+
+struct producer {
+    CompletionQueue_t* queue;
+    struct item*       items;
+};
+
+static void* producer_thread(void* context)
+{
+    struct producer* producer = (struct producer*)context;
+    int              i;
+
+    for (i = 0; i < PRODUCER_ENTRIES; i++) {
+        if (CompletionQueuePush(producer->queue, &producer->items[i].entry)) {
+            printf("FAIL entry %i was pushed twice\n", i);
+        }
+    }
+    return NULL;
+}
+
+static void test_producers(void)
+{
+    CompletionQueue_t queue;
+    struct producer   producers[PRODUCER_COUNT];
+    pthread_t         threads[PRODUCER_COUNT];
+    struct item*      items;
+    long              total = 0;
+    int               batches = 0;
+    int               i;
+
+    items = (struct item*)calloc(PRODUCER_COUNT * PRODUCER_ENTRIES, sizeof(struct item));
+    CompletionQueueInitialize(&queue, threaded_callback, NULL);
+    for (i = 0; i < PRODUCER_COUNT * PRODUCER_ENTRIES; i++) {
+        items[i].owner = i / PRODUCER_ENTRIES;
+        items[i].index = i % PRODUCER_ENTRIES;
+    }
+
+    for (i = 0; i < PRODUCER_COUNT; i++) {
+        producers[i].queue = &queue;
+        producers[i].items = &items[i * PRODUCER_ENTRIES];
+        pthread_create(&threads[i], NULL, producer_thread, &producers[i]);
+    }
+
+    while (total < PRODUCER_COUNT * PRODUCER_ENTRIES) {
+        int count = CompletionQueueDrain(&queue, DRAIN_BUDGET);
+        CHECK(count <= DRAIN_BUDGET);
+        total += count;
+        batches += count ? 1 : 0;
+    }
+
+    for (i = 0; i < PRODUCER_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < PRODUCER_COUNT * PRODUCER_ENTRIES; i++) {
+        if (atomic_load(&items[i].completions) != 1) {
+            CHECK(atomic_load(&items[i].completions) == 1);
+            break;
+        }
+    }
+    CHECK(CompletionQueuePending(&queue) == 0);
+    printf("producers: %li entries from %i threads in %i batches\n", total, PRODUCER_COUNT, batches);
+    free(items);
+}
+
+static void test_moderator(void)
+{
+    CompletionModerator_t moderator;
+
+    CompletionModeratorInitialize(&moderator, 16);
+    CHECK(moderator.Threshold == 1);
+
+    // One request at the time never coalesces
+    CHECK(CompletionModeratorUpdate(&moderator, 1, 0) == 0);
+    CHECK(moderator.Threshold == 1);
+
+    // A deep queue raises the threshold to half of it, within the limit
+    CHECK(CompletionModeratorUpdate(&moderator, 1, 11) == 1);
+    CHECK(moderator.Threshold == 6);
+    CHECK(CompletionModeratorUpdate(&moderator, 6, 7) == 0);
+    CHECK(CompletionModeratorUpdate(&moderator, 6, 64) == 1);
+    CHECK(moderator.Threshold == 16);
+
+    // Less in flight than the threshold lowers it right away
+    CHECK(CompletionModeratorUpdate(&moderator, 16, 5) == 1);
+    CHECK(moderator.Threshold == 5);
+    CHECK(CompletionModeratorUpdate(&moderator, 5, 0) == 1);
+    CHECK(moderator.Threshold == 1);
+    CHECK(moderator.Interrupts == 6 && moderator.Completions == 35);
+}
+
+/* The synthetic driver. The device executes the commands in flight one after
+ * the other, one per tick, and the coalescing logic interrupts once the threshold
+ * is reached or the oldest unreported completion is HW_TIMEOUT ticks old. */
+struct request {
+    CompletionEntry_t entry;
+    long              completed_at;
+    int               completions;
+};
+
+struct driver {
+    CompletionQueue_t     queue;
+    CompletionModerator_t moderator;
+    int                   moderate;
+
+    // Device
+    struct request*       slots[MAX_DEPTH];
+    int                   head, count;
+    int                   threshold;
+    int                   unreported;
+    long                  oldest;
+    struct request*       done[MAX_DEPTH];
+    int                   done_count;
+
+    // Clients and statistics
+    struct request*       requests;
+    int                   submitted;
+    int                   responses;
+    int                   finished;
+    long                  now;
+    long                  interrupts;
+    long                  timeouts;
+    long                  max_delay;
+};
+
+static void submit(struct driver* driver)
+{
+    struct request* request;
+
+    if (driver->submitted == REQUEST_COUNT) {
+        return;
+    }
+    request = &driver->requests[driver->submitted++];
+    driver->slots[(driver->head + driver->count) % MAX_DEPTH] = request;
+    driver->count++;
+}
+
+static void request_done(CompletionEntry_t* entry, void* context)
+{
+    struct driver*  driver  = (struct driver*)context;
+    struct request* request = (struct request*)entry;
+    long            delay   = driver->now - request->completed_at;
+
+    request->completions++;
+    driver->finished++;
+    driver->responses++;
+    if (delay > driver->max_delay) {
+        driver->max_delay = delay;
+    }
+}
+
+static void interrupt(struct driver* driver)
+{
+    int completed = driver->done_count;
+    int i;
+
+    driver->interrupts++;
+    driver->unreported = 0;
+
+    // Interrupt handler, record what finished and complete it in batches
+    for (i = 0; i < driver->done_count; i++) {
+        CompletionQueuePush(&driver->queue, &driver->done[i]->entry);
+        CompletionQueuePush(&driver->queue, &driver->done[i]->entry);
+    }
+    driver->done_count = 0;
+    while (CompletionQueueDrain(&driver->queue, DRAIN_BUDGET) == DRAIN_BUDGET);
+
+    if (driver->moderate && CompletionModeratorUpdate(&driver->moderator, completed, driver->count)) {
+        driver->threshold = driver->moderator.Threshold;
+    }
+
+    // The clients send their next request once they got the response
+    for (; driver->responses; driver->responses--) {
+        submit(driver);
+    }
+}
+
+static void run_driver(int depth, int moderate, double* interrupts_per_io, long* max_delay)
+{
+    struct driver driver;
+    int           i;
+
+    memset(&driver, 0, sizeof(driver));
+    driver.requests = (struct request*)calloc(REQUEST_COUNT, sizeof(struct request));
+    driver.moderate  = moderate;
+    driver.threshold = 1;
+    CompletionQueueInitialize(&driver.queue, request_done, &driver);
+    CompletionModeratorInitialize(&driver.moderator, MAX_THRESHOLD);
+
+    for (i = 0; i < depth; i++) {
+        submit(&driver);
+    }
+
+    while (driver.finished < REQUEST_COUNT) {
+        driver.now++;
+        if (driver.count) {
+            struct request* request = driver.slots[driver.head];
+            driver.head = (driver.head + 1) % MAX_DEPTH;
+            driver.count--;
+
+            request->completed_at = driver.now;
+            driver.done[driver.done_count++] = request;
+            if (!driver.unreported++) {
+                driver.oldest = driver.now;
+            }
+        }
+
+        if (driver.unreported >= driver.threshold) {
+            interrupt(&driver);
+        }
+        else if (driver.unreported && (driver.now - driver.oldest) >= HW_TIMEOUT) {
+            driver.timeouts++;
+            interrupt(&driver);
+        }
+
+        if (driver.now > (long)REQUEST_COUNT * (HW_TIMEOUT + 1)) {
+            printf("FAIL the driver stalled at %i requests\n", driver.finished);
+            failures++;
+            break;
+        }
+    }
+
+    for (i = 0; i < REQUEST_COUNT; i++) {
+        if (driver.requests[i].completions != 1) {
+            CHECK(driver.requests[i].completions == 1);
+            break;
+        }
+    }
+
+    *interrupts_per_io = (double)driver.interrupts / REQUEST_COUNT;
+    *max_delay         = driver.max_delay;
+    printf("depth %2i, moderation %s: %.3f interrupts per request, %li timeouts, "
+           "longest wait %li ticks, threshold %i\n", depth, moderate ? "on " : "off",
+           *interrupts_per_io, driver.timeouts, driver.max_delay, driver.threshold);
+    free(driver.requests);
+}
+
+static void test_driver(void)
+{
+    double rate;
+    long   delay;
+
+    // Without the moderator every request is an interrupt
+    run_driver(32, 0, &rate, &delay);
+    CHECK(rate == 1.0);
+
+    // A single request in flight must not be delayed
+    run_driver(1, 1, &rate, &delay);
+    CHECK(rate == 1.0);
+    CHECK(delay == 0);
+
+    // Deeper queues share interrupts, and completions never wait for the timeout
+    run_driver(4, 1, &rate, &delay);
+    CHECK(rate < 0.51);
+    CHECK(delay < HW_TIMEOUT);
+
+    run_driver(32, 1, &rate, &delay);
+    CHECK(rate < 0.1);
+    CHECK(delay < HW_TIMEOUT);
+}
+
+int main(void)
+{
+    test_queue();
+    test_producers();
+    test_moderator();
+    test_driver();
+    if (failures) {
+        printf("%i checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,282 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Isochronous Completion Ring Test
+ *  - Checks the ring on its own, and then runs a synthetic isochronous device that
+ *    completes a segment every frame, with short and failed segments, against a
+ *    consumer thread. The host driver side processes the ring of elements in
+ *    batches like it does on interrupts, and the consumer checks that every segment
+ *    arrives once, in order and with the right result.
+ */
+
+#include <ddk/usb/isoc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGMENT_LENGTH   192 // 48kHz 16 bit stereo, a millisecond each
+#define ELEMENT_COUNT    32
+#define IOC_INTERVAL     (ELEMENT_COUNT / 4)
+#define FRAME_COUNT      200000
+#define READ_BATCH       16
+
+#define STATUS_FINISHED  2
+#define STATUS_ERROR     9
+
+static int failures = 0;
+
+#define CHECK(expr) do { if (!(expr)) { \
+    printf("FAIL %s:%i: %s\n", __FILE__, __LINE__, #expr); failures++; } } while (0)
+
+// What the device does with a segment, both sides can work it out from the sequence
+static void device_model(uint32_t sequence, uint32_t* length, int* status)
+{
+    *length = SEGMENT_LENGTH;
+    *status = STATUS_FINISHED;
+    if ((sequence % 97) == 13) {
+        *length = 0;
+        *status = STATUS_ERROR;
+    }
+    else if ((sequence % 7) == 3) {
+        *length = SEGMENT_LENGTH - 4 * (sequence % 5) - 4;
+    }
+}
+
+static UsbIsocRing_t* create_ring(size_t length)
+{
+    UsbIsocRing_t* ring = (UsbIsocRing_t*)malloc(length);
+    if (!ring || UsbIsocRingInitialize(ring, length)) {
+        printf("FAIL could not create a ring of %zu bytes\n", length);
+        exit(1);
+    }
+    return ring;
+}
+
+static void test_capacity(void)
+{
+    UsbIsocRing_t ring;
+
+    CHECK(UsbIsocRingCapacity(0) == 0);
+    CHECK(UsbIsocRingCapacity(sizeof(UsbIsocRing_t)) == 0);
+    CHECK(UsbIsocRingCapacity(sizeof(UsbIsocRing_t) + sizeof(UsbIsocCompletion_t)) == 0);
+    CHECK(UsbIsocRingCapacity(sizeof(UsbIsocRing_t) + 2 * sizeof(UsbIsocCompletion_t)) == 2);
+    CHECK(UsbIsocRingCapacity(sizeof(UsbIsocRing_t) + 7 * sizeof(UsbIsocCompletion_t)) == 4);
+    CHECK(UsbIsocRingCapacity(sizeof(UsbIsocRing_t) + 64 * sizeof(UsbIsocCompletion_t)) == 64);
+    CHECK(UsbIsocRingCapacity(4096) == 128);
+    CHECK(UsbIsocRingInitialize(&ring, sizeof(ring)) == -1);
+    CHECK(UsbIsocRingInitialize(NULL, 4096) == -1);
+}
+
+static void test_single(void)
+{
+    UsbIsocRing_t*      ring = create_ring(sizeof(UsbIsocRing_t) + 4 * sizeof(UsbIsocCompletion_t));
+    UsbIsocCompletion_t completion = { 0 };
+    UsbIsocCompletion_t read[8];
+    int                 i;
+
+    CHECK(ring->Capacity == 4);
+    CHECK(UsbIsocRingRead(ring, read, 8) == 0);
+
+    // Fill it, the fifth is dropped and counted
+    for (i = 0; i < 5; i++) {
+        completion.Sequence = i;
+        completion.Offset   = i * SEGMENT_LENGTH;
+        CHECK(UsbIsocRingPush(ring, 4, &completion) == (i < 4 ? 0 : -1));
+    }
+    CHECK(atomic_load(&ring->Dropped) == 1);
+
+    // Partial reads keep the order
+    CHECK(UsbIsocRingRead(ring, read, 3) == 3);
+    CHECK(read[0].Sequence == 0 && read[2].Sequence == 2 && read[2].Offset == 2 * SEGMENT_LENGTH);
+    completion.Sequence = 5;
+    CHECK(UsbIsocRingPush(ring, 4, &completion) == 0);
+    CHECK(UsbIsocRingRead(ring, read, 8) == 2);
+    CHECK(read[0].Sequence == 3 && read[1].Sequence == 5);
+    CHECK(UsbIsocRingRead(ring, read, 8) == 0);
+
+    // The counters are free running and must survive wrapping
+    atomic_store(&ring->Producer, 0x7FFFFFFE);
+    atomic_store(&ring->Consumer, 0x7FFFFFFE);
+    for (i = 0; i < 4; i++) {
+        completion.Sequence = 100 + i;
+        CHECK(UsbIsocRingPush(ring, 4, &completion) == 0);
+    }
+    CHECK(UsbIsocRingPush(ring, 4, &completion) == -1);
+    CHECK(UsbIsocRingRead(ring, read, 8) == 4);
+    for (i = 0; i < 4; i++) {
+        CHECK(read[i].Sequence == (uint32_t)(100 + i));
+    }
+    CHECK(UsbIsocRingHasWaiters(ring) == 0);
+    free(ring);
+}
+
+static void test_tampered(void)
+{
+    size_t              length = sizeof(UsbIsocRing_t) + 5 * sizeof(UsbIsocCompletion_t);
+    UsbIsocRing_t*      ring   = create_ring(length);
+    UsbIsocCompletion_t completion = { 0 };
+    int                 i;
+
+    // The owner can rewrite the header at any time, the producer must stay within
+    // the capacity it validated. The fifth entry acts as a guard.
+    memset(&ring->Entries[4], 0xA5, sizeof(UsbIsocCompletion_t));
+    ring->Capacity = 1 << 20;
+    for (i = 0; i < 8; i++) {
+        completion.Sequence = i;
+        CHECK(UsbIsocRingPush(ring, 4, &completion) == (i < 4 ? 0 : -1));
+    }
+    CHECK(ring->Entries[4].Sequence == 0xA5A5A5A5);
+
+    // Consumer counters far ahead of the producer only read as a full ring
+    atomic_store(&ring->Consumer, 0x40000000);
+    CHECK(UsbIsocRingPush(ring, 4, &completion) == -1);
+    CHECK(ring->Entries[4].Sequence == 0xA5A5A5A5);
+    free(ring);
+}
+
+// The synthetic stream, the elements complete one per frame in the order they are
+// linked and the host driver handles everything that completed on each interrupt
+struct stream {
+    UsbIsocRing_t* ring;
+    int            capacity;
+    _Atomic(int)   done;
+    int            batches;
+    long           signals;
+};
+
+static void* host_driver(void* context)
+{
+    struct stream* stream     = (struct stream*)context;
+    int            completed  = 0; // Elements completed by the device
+    int            next       = 0; // Next element the driver handles
+    uint32_t       sequence   = 0;
+    int            frame;
+
+    for (frame = 0; frame < FRAME_COUNT; frame++) {
+        completed++;
+
+        // Only some of the elements raise an interrupt, and the driver is sometimes
+        // late and finds several of them pending
+        if ((completed % IOC_INTERVAL) != 0 && frame != FRAME_COUNT - 1) {
+            continue;
+        }
+        if ((frame % 1000) < 3 && frame != FRAME_COUNT - 1) {
+            continue;
+        }
+
+        while (sequence < (uint32_t)completed) {
+            UsbIsocCompletion_t completion;
+            completion.Sequence = sequence++;
+            completion.Offset   = (uint32_t)(next * SEGMENT_LENGTH);
+            device_model(completion.Sequence, &completion.Length, &completion.Status);
+            while (UsbIsocRingPush(stream->ring, stream->capacity, &completion)) {
+                // A real driver drops it, here we wait to check that nothing is lost
+                atomic_fetch_sub(&stream->ring->Dropped, 1);
+                sched_yield();
+            }
+            next = (next + 1) % ELEMENT_COUNT;
+        }
+        stream->batches++;
+        if (UsbIsocRingHasWaiters(stream->ring)) {
+            stream->signals++;
+        }
+    }
+    atomic_store(&stream->done, 1);
+    return NULL;
+}
+
+static void test_stream(void)
+{
+    struct stream       stream = { 0 };
+    UsbIsocCompletion_t read[READ_BATCH];
+    pthread_t           thread;
+    struct timespec     start, end;
+    uint32_t            expected = 0;
+    long                reads = 0, shorts = 0, errors = 0;
+    int                 i, count;
+
+    stream.ring     = create_ring(sizeof(UsbIsocRing_t) + 64 * sizeof(UsbIsocCompletion_t));
+    stream.capacity = stream.ring->Capacity;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&thread, NULL, host_driver, &stream);
+
+    while (1) {
+        int done = atomic_load(&stream.done);
+
+        count = UsbIsocRingRead(stream.ring, read, READ_BATCH);
+        if (!count) {
+            if (done) {
+                break;
+            }
+
+            // Stand-in for sleeping on the ring
+            atomic_fetch_add(&stream.ring->Waiters, 1);
+            sched_yield();
+            atomic_fetch_sub(&stream.ring->Waiters, 1);
+            continue;
+        }
+
+        reads++;
+        for (i = 0; i < count; i++) {
+            uint32_t length;
+            int      status;
+
+            device_model(expected, &length, &status);
+            CHECK(read[i].Sequence == expected);
+            CHECK(read[i].Offset == (expected % ELEMENT_COUNT) * SEGMENT_LENGTH);
+            CHECK(read[i].Length == length);
+            CHECK(read[i].Status == status);
+            if (status != STATUS_FINISHED) {
+                errors++;
+            }
+            else if (length != SEGMENT_LENGTH) {
+                shorts++;
+            }
+            expected++;
+            if (failures > 10) {
+                exit(1);
+            }
+        }
+    }
+    pthread_join(thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    CHECK(expected == FRAME_COUNT);
+    CHECK(atomic_load(&stream.ring->Dropped) == 0);
+    printf("stream: %u segments (%li short, %li failed) in %i driver batches, %li reads, "
+           "%li wakeups needed, %.1f ms\n", expected, shorts, errors, stream.batches, reads,
+           stream.signals, (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    free(stream.ring);
+}
+
+int main(void)
+{
+    test_capacity();
+    test_single();
+    test_tampered();
+    test_stream();
+    if (failures) {
+        printf("%i checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
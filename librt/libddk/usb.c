@@ -25,6 +25,7 @@
 #include <ddk/service.h>
 #include <ddk/usb.h>
 #include <internal/_ipc.h>
+#include <internal/_syscalls.h>
 #include <internal/_utils.h>
 #include <gracht/server.h>
 
@@ -94,3 +95,48 @@ UsbQueryController(
     gracht_vali_message_finish(&msg);
     return OsSuccess;
 }
+
+OsStatus_t
+UsbIsocRingWait(
+    _In_ UsbIsocRing_t* Ring,
+    _In_ size_t         Timeout)
+{
+    FutexParameters_t parameters;
+    OsStatus_t        status = OsSuccess;
+    int               producer;
+
+    // Announce the waiter before checking the ring, that way the host driver either
+    // sees us or has already moved the producer we sleep on
+    atomic_fetch_add(&Ring->Waiters, 1);
+    producer = atomic_load(&Ring->Producer);
+    while (producer == atomic_load(&Ring->Consumer)) {
+        // The ring is mapped by the host driver as well, so the futex must be shared
+        parameters._futex0  = &Ring->Producer;
+        parameters._val0    = producer;
+        parameters._timeout = Timeout;
+        parameters._flags   = 0;
+        if (Syscall_FutexWait(&parameters) == OsTimeout) {
+            status = OsTimeout;
+            break;
+        }
+        producer = atomic_load(&Ring->Producer);
+    }
+    atomic_fetch_sub(&Ring->Waiters, 1);
+    return status;
+}
+
+void
+UsbIsocRingSignal(
+    _In_ UsbIsocRing_t* Ring)
+{
+    FutexParameters_t parameters;
+
+    if (!UsbIsocRingHasWaiters(Ring)) {
+        return;
+    }
+
+    parameters._futex0 = &Ring->Producer;
+    parameters._val0   = 1;
+    parameters._flags  = 0;
+    (void)Syscall_FutexWake(&parameters);
+}
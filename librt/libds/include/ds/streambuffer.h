@@ -81,6 +81,15 @@ streambuffer_clear_option(
     _In_ streambuffer_t* stream,
     _In_ unsigned int    option));
 
+DSDECL(size_t,
+streambuffer_bytes_readable(
+    _In_ streambuffer_t* stream));
+
+DSDECL(OsStatus_t,
+streambuffer_resize(
+    _In_ streambuffer_t* stream,
+    _In_ size_t          capacity));
+
 DSDECL(size_t,
 streambuffer_stream_out(
     _In_ streambuffer_t* stream,
@@ -0,0 +1,126 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * PE/COFF Image Loader - Checksum
+ *    - Calculation of the image checksum. This part only depends on the C library
+ *      so it can be tested on the host.
+ */
+
+#include "checksum.h"
+
+// The kernel is built without sse, so the vector paths are only used when the
+// compiler targets them anyway.
+#if defined(__AVX2__) && !defined(__LIBDS_KERNEL__)
+#include <immintrin.h>
+#define PE_CHECKSUM_AVX2
+#elif defined(__SSE2__) && !defined(__LIBDS_KERNEL__)
+#include <emmintrin.h>
+#define PE_CHECKSUM_SSE2
+#endif
+
+// Folds the carries above bit 32 back in. The value keeps its remainder modulo
+// 2^32 - 1, and is never folded to zero unless it was zero.
+static inline uint64_t
+FoldCarries(
+    uint64_t Sum)
+{
+    return (Sum & UINT32_MAX) + (Sum >> 32);
+}
+
+static uint64_t
+SumWords(
+    const uint32_t* Words,
+    size_t          Count)
+{
+    uint64_t Sum0 = 0, Sum1 = 0, Sum2 = 0, Sum3 = 0;
+    size_t   i    = 0;
+
+#if defined(PE_CHECKSUM_AVX2)
+    __m256i Lanes0 = _mm256_setzero_si256();
+    __m256i Lanes1 = _mm256_setzero_si256();
+    uint64_t Lanes[4];
+
+    for (; (i + 8) <= Count; i += 8) {
+        Lanes0 = _mm256_add_epi64(Lanes0, _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)&Words[i])));
+        Lanes1 = _mm256_add_epi64(Lanes1, _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)&Words[i + 4])));
+    }
+    _mm256_storeu_si256((__m256i*)&Lanes[0], _mm256_add_epi64(Lanes0, Lanes1));
+    Sum0 = Lanes[0]; Sum1 = Lanes[1]; Sum2 = Lanes[2]; Sum3 = Lanes[3];
+#elif defined(PE_CHECKSUM_SSE2)
+    __m128i  Zero   = _mm_setzero_si128();
+    __m128i  Lanes0 = _mm_setzero_si128();
+    __m128i  Lanes1 = _mm_setzero_si128();
+    uint64_t Lanes[4];
+
+    for (; (i + 4) <= Count; i += 4) {
+        __m128i Value = _mm_loadu_si128((const __m128i*)&Words[i]);
+        Lanes0 = _mm_add_epi64(Lanes0, _mm_unpacklo_epi32(Value, Zero));
+        Lanes1 = _mm_add_epi64(Lanes1, _mm_unpackhi_epi32(Value, Zero));
+    }
+    _mm_storeu_si128((__m128i*)&Lanes[0], Lanes0);
+    _mm_storeu_si128((__m128i*)&Lanes[2], Lanes1);
+    Sum0 = Lanes[0]; Sum1 = Lanes[1]; Sum2 = Lanes[2]; Sum3 = Lanes[3];
+#else
+    for (; (i + 4) <= Count; i += 4) {
+        Sum0 += Words[i];
+        Sum1 += Words[i + 1];
+        Sum2 += Words[i + 2];
+        Sum3 += Words[i + 3];
+    }
+#endif
+
+    for (; i < Count; i++) {
+        Sum0 += Words[i];
+    }
+
+    // Each lane holds less than 2^32 words, so none of them has overflowed
+    return FoldCarries(Sum0) + FoldCarries(Sum1) + FoldCarries(Sum2) + FoldCarries(Sum3);
+}
+
+// The checksum is an end-around carry sum of all 32 bit words except the checksum
+// field itself, folded to 16 bits and added to the length of the file. Trailing
+// bytes that do not make up a full word are not included.
+uint32_t
+PeCalculateChecksum(
+    uint8_t* Data,
+    size_t   DataLength,
+    size_t   PeChkSumOffset)
+{
+    const uint32_t* Words     = (const uint32_t*)Data;
+    size_t          WordCount = DataLength / 4;
+    size_t          SkipIndex = PeChkSumOffset / 4;
+    uint64_t        CheckSum;
+
+    if (SkipIndex < WordCount) {
+        CheckSum = FoldCarries(SumWords(Words, SkipIndex)) +
+            FoldCarries(SumWords(&Words[SkipIndex + 1], WordCount - SkipIndex - 1));
+    }
+    else {
+        CheckSum = SumWords(Words, WordCount);
+    }
+
+    while (CheckSum >> 32) {
+        CheckSum = FoldCarries(CheckSum);
+    }
+
+    CheckSum = (CheckSum & UINT16_MAX) + (CheckSum >> 16);
+    CheckSum = (CheckSum) + (CheckSum >> 16);
+    CheckSum = CheckSum & UINT16_MAX;
+    CheckSum += (uint32_t)DataLength;
+    return (uint32_t)(CheckSum & UINT32_MAX);
+}
@@ -0,0 +1,39 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * PE/COFF Image Loader - Checksum
+ *    - Calculation of the image checksum. This part only depends on the C library
+ *      so it can be tested on the host.
+ */
+
+#ifndef __PE_CHECKSUM__
+#define __PE_CHECKSUM__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* PeCalculateChecksum
+ * Calculates the checksum of an image file. The 32 bit word at PeChkSumOffset, which
+ * holds the checksum in the header, is not included. */
+extern uint32_t
+PeCalculateChecksum(
+    uint8_t* Data,
+    size_t   DataLength,
+    size_t   PeChkSumOffset);
+
+#endif //!__PE_CHECKSUM__
@@ -0,0 +1,128 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * PE/COFF Image Loader - Export Index
+ *    - Name-keyed lookup of exported functions and loaded libraries. This part
+ *      only depends on the C library so it can be tested on the host.
+ */
+
+#include "exports.h"
+#include <string.h>
+
+// FNV-1a
+uint32_t
+PeHashName(
+    const char* Name,
+    int         IgnoreCase)
+{
+    uint32_t Hash = 2166136261U;
+
+    while (*Name) {
+        uint8_t Character = (uint8_t)*Name++;
+        if (IgnoreCase && Character >= 'A' && Character <= 'Z') {
+            Character += 'a' - 'A';
+        }
+        Hash ^= Character;
+        Hash *= 16777619U;
+    }
+    return Hash;
+}
+
+size_t
+PeExportIndexCapacity(
+    int NumberOfExports)
+{
+    size_t Capacity = 16;
+    while (Capacity < ((size_t)NumberOfExports * 2)) {
+        Capacity <<= 1;
+    }
+    return Capacity;
+}
+
+void
+PeBuildExportIndex(
+    PeExportIndex_t*      Index,
+    int*                  Slots,
+    PeExportedFunction_t* Exports,
+    int                   NumberOfExports)
+{
+    size_t Capacity = PeExportIndexCapacity(NumberOfExports);
+    int    i;
+
+    memset(Slots, 0xFF, Capacity * sizeof(int));
+    Index->Slots = Slots;
+    Index->Mask  = Capacity - 1;
+
+    for (i = 0; i < NumberOfExports; i++) {
+        size_t Slot;
+
+        if (!Exports[i].Name) {
+            continue;
+        }
+
+        // Keep the first of duplicate names, which is what a linear search finds
+        Slot = PeHashName(Exports[i].Name, 0) & Index->Mask;
+        while (Slots[Slot] != -1) {
+            if (!strcmp(Exports[Slots[Slot]].Name, Exports[i].Name)) {
+                break;
+            }
+            Slot = (Slot + 1) & Index->Mask;
+        }
+
+        if (Slots[Slot] == -1) {
+            Slots[Slot] = i;
+        }
+    }
+}
+
+PeExportedFunction_t*
+PeLookupExport(
+    PeExportIndex_t*      Index,
+    PeExportedFunction_t* Exports,
+    int                   NumberOfExports,
+    const char*           Name,
+    int                   Hint)
+{
+    size_t Slot;
+
+    // The exports are stored in name table order, so a valid hint is a direct hit
+    if (Hint >= 0 && Hint < NumberOfExports && Exports[Hint].Name &&
+        !strcmp(Exports[Hint].Name, Name)) {
+        return &Exports[Hint];
+    }
+
+    if (!Index->Slots) {
+        int i;
+        for (i = 0; i < NumberOfExports; i++) {
+            if (Exports[i].Name && !strcmp(Exports[i].Name, Name)) {
+                return &Exports[i];
+            }
+        }
+        return NULL;
+    }
+
+    Slot = PeHashName(Name, 0) & Index->Mask;
+    while (Index->Slots[Slot] != -1) {
+        PeExportedFunction_t* Export = &Exports[Index->Slots[Slot]];
+        if (!strcmp(Export->Name, Name)) {
+            return Export;
+        }
+        Slot = (Slot + 1) & Index->Mask;
+    }
+    return NULL;
+}
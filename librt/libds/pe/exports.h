@@ -0,0 +1,78 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * PE/COFF Image Loader - Export Index
+ *    - Name-keyed lookup of exported functions and loaded libraries. This part
+ *      only depends on the C library so it can be tested on the host.
+ */
+
+#ifndef __PE_EXPORT_INDEX__
+#define __PE_EXPORT_INDEX__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct PeExportedFunction {
+    const char* Name;
+    const char* ForwardName; //Library.Function
+    int         Ordinal;
+    uintptr_t   Address;
+} PeExportedFunction_t;
+
+// The index is an open-addressed table of export indices, sized to at most
+// half full. Empty slots are -1.
+typedef struct PeExportIndex {
+    int*   Slots;
+    size_t Mask;
+} PeExportIndex_t;
+
+/* PeHashName
+ * Hashes a name, optionally ignoring the case of ascii letters. */
+extern uint32_t
+PeHashName(
+    const char* Name,
+    int         IgnoreCase);
+
+/* PeExportIndexCapacity
+ * Returns the number of slots the index for the given number of exports needs. */
+extern size_t
+PeExportIndexCapacity(
+    int NumberOfExports);
+
+/* PeBuildExportIndex
+ * Builds the index over the exports in the provided slot storage, which must hold
+ * PeExportIndexCapacity(NumberOfExports) entries. */
+extern void
+PeBuildExportIndex(
+    PeExportIndex_t*      Index,
+    int*                  Slots,
+    PeExportedFunction_t* Exports,
+    int                   NumberOfExports);
+
+/* PeLookupExport
+ * Looks up an export by name. The hint is the index into the export name table the
+ * importer was linked against, and is tried first. Use -1 if no hint is available. */
+extern PeExportedFunction_t*
+PeLookupExport(
+    PeExportIndex_t*      Index,
+    PeExportedFunction_t* Exports,
+    int                   NumberOfExports,
+    const char*           Name,
+    int                   Hint);
+
+#endif //!__PE_EXPORT_INDEX__
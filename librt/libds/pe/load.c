@@ -34,6 +34,7 @@ typedef struct SectionMapping {
     uint8_t*          BasePointer;
     uintptr_t         RVA;
     size_t            Size;
+    int               Shared; // Prepared by an earlier load, must not be modified
 } SectionMapping_t;
 
 #define OFFSET_IN_SECTION(Section, _RVA) (uintptr_t)(Section->BasePointer + ((_RVA) - Section->RVA))
@@ -43,6 +44,10 @@ OsStatus_t PeHandleRelocations(PeExecutable_t*,PeExecutable_t*, SectionMapping_t
 OsStatus_t PeHandleExports(PeExecutable_t*,PeExecutable_t*, SectionMapping_t*, int, uint8_t*, size_t);
 OsStatus_t PeHandleImports(PeExecutable_t*,PeExecutable_t*, SectionMapping_t*, int, uint8_t*, size_t);
 
+// Library index
+void PeIndexLibrary(PeExecutable_t*, PeExecutable_t*);
+void PeUnindexLibrary(PeExecutable_t*, PeExecutable_t*);
+
 typedef OsStatus_t(*DataDirectoryHandler)(PeExecutable_t*, PeExecutable_t*, SectionMapping_t*, int, uint8_t*, size_t);
 static struct {
     int                  Index;
@@ -112,44 +117,56 @@ GetExportedFunctionByOrdinal(
     return NULL;
 }
 
-static PeExportedFunction_t*
-GetExportedFunctionByNameDescriptor(
-    _In_ PeExportedFunction_t*     Exports,
-    _In_ int                       NumberOfExports,
-    _In_ PeImportNameDescriptor_t* Descriptor)
+// A section of a library at a stable base has the same contents in every process that
+// loads it, unless it is written after loading. Such sections are mapped from pages that
+// are shared by all these processes and relocated only by the first load. The import
+// address tables are bound per process, so sections holding them are never shared.
+// The section must also own all of its pages, as they are mapped as a whole.
+static int
+PeIsSectionShareable(
+    _In_ PeExecutable_t*    Image,
+    _In_ PeSectionHeader_t* Section,
+    _In_ PeSectionHeader_t* NextSection,
+    _In_ PeDataDirectory_t* Directories)
 {
-    int i;
+    static const int Tables[] = { PE_SECTION_IMPORT, PE_SECTION_IAT };
+    uintptr_t        PageSize = GetPageSize();
+    uintptr_t        Start    = Section->VirtualAddress;
+    uintptr_t        End      = Start + MAX(Section->RawSize, Section->VirtualSize);
+    int              i;
+
+    if (!Image->StableBase || (Section->Flags & PE_SECTION_WRITE)) {
+        return 0;
+    }
 
-    // Use the hint if provided
-    if (Descriptor->OrdinalHint != 0) {
-        for (i = 0; i < NumberOfExports; i++) {
-            if (Exports[i].Ordinal == Descriptor->OrdinalHint) {
-                if (!strcmp(Exports[i].Name, (const char*)&Descriptor->Name[0])) {
-                    return &Exports[i];
-                }
-            }
-        }
+    if (((Image->VirtualAddress + Start) % PageSize) ||
+        (NextSection && NextSection->VirtualAddress < DIVUP(End, PageSize) * PageSize)) {
+        return 0;
     }
 
-    // Hint was invalid or not present
-    for (i = 0; i < NumberOfExports; i++) {
-        if (Exports[i].Name != NULL) {
-            if (!strcmp(Exports[i].Name, (const char*)&Descriptor->Name[0])) {
-                return &Exports[i];
-            }
+    // Without the IAT directory the address tables can be anywhere in the image
+    if (Directories[PE_SECTION_IMPORT].Size && !Directories[PE_SECTION_IAT].Size) {
+        return 0;
+    }
+
+    for (i = 0; i < (int)(sizeof(Tables) / sizeof(Tables[0])); i++) {
+        PeDataDirectory_t* Directory = &Directories[Tables[i]];
+        if (Directory->Size && Directory->AddressRVA < End && Start < (Directory->AddressRVA + Directory->Size)) {
+            return 0;
         }
     }
-    return NULL;
+    return 1;
 }
 
 static OsStatus_t
 PeHandleSections(
-    _In_ PeExecutable_t*   Parent,
-    _In_ PeExecutable_t*   Image,
-    _In_ uint8_t*          Data,
-    _In_ uintptr_t         SectionAddress,
-    _In_ int               SectionCount,
-    _In_ SectionMapping_t* SectionHandles)
+    _In_ PeExecutable_t*    Parent,
+    _In_ PeExecutable_t*    Image,
+    _In_ uint8_t*           Data,
+    _In_ uintptr_t          SectionAddress,
+    _In_ int                SectionCount,
+    _In_ PeDataDirectory_t* Directories,
+    _In_ SectionMapping_t*  SectionHandles)
 {
     PeSectionHeader_t* Section        = (PeSectionHeader_t*)SectionAddress;
     uintptr_t          CurrentAddress = Image->VirtualAddress;
@@ -166,7 +183,8 @@ PeHandleSections(
         uint8_t*  FileBuffer         = (uint8_t*)(Data + Section->RawAddress);
         Flags_t   PageFlags          = MEMORY_READ;
         size_t    SectionSize        = MAX(Section->RawSize, Section->VirtualSize);
-        uint8_t*  Destination;
+        uint8_t*  Destination        = NULL;
+        int       Shared             = 0;
 
         // Make a local copy of the name, just in case
         // we need to do some debug print
@@ -181,19 +199,33 @@ PeHandleSections(
             PageFlags |= MEMORY_WRITE;
         }
 
+        // Shared sections fall back to pages of our own if they can't be shared
+        MapHandle = NULL;
+        if (PeIsSectionShareable(Image, Section, (i + 1 < SectionCount) ? Section + 1 : NULL, Directories)) {
+            Status = AcquireSharedSection(Image->MemorySpace, Data, VirtualDestination,
+                SectionSize, PageFlags, &Destination, &Shared);
+            if (Status != OsSuccess) {
+                Destination = NULL;
+                Shared      = 0;
+            }
+        }
+
         // Iterate pages and map them in our memory space
-        Status = AcquireImageMapping(Image->MemorySpace, &VirtualDestination, SectionSize, PageFlags, &MapHandle);
-        if (Status != OsSuccess) {
-            dserror("%s: Failed to map section %s at 0x%" PRIxIN ": %u", 
-                MStringRaw(Image->Name), &SectionName[0], VirtualDestination, Status);
-            return Status;
+        if (Destination == NULL) {
+            Status = AcquireImageMapping(Image->MemorySpace, &VirtualDestination, SectionSize, PageFlags, &MapHandle);
+            if (Status != OsSuccess) {
+                dserror("%s: Failed to map section %s at 0x%" PRIxIN ": %u", 
+                    MStringRaw(Image->Name), &SectionName[0], VirtualDestination, Status);
+                return Status;
+            }
+            Destination = (uint8_t*)VirtualDestination;
         }
-        Destination = (uint8_t*)VirtualDestination;
 
         SectionHandles[i].Handle      = MapHandle;
         SectionHandles[i].BasePointer = Destination;
         SectionHandles[i].RVA         = Section->VirtualAddress;
         SectionHandles[i].Size        = SectionSize;
+        SectionHandles[i].Shared      = Shared;
 
         // Store first code segment we encounter
         if (Section->Flags & PE_SECTION_CODE) {
@@ -207,7 +239,10 @@ PeHandleSections(
         // BSS: Zero out the memory 
         // Code: Copy memory 
         // Data: Copy memory
-        if (Section->RawSize == 0 || (Section->Flags & PE_SECTION_BSS)) {
+        if (Shared) {
+            dstrace("section(%i): shared at 0x%x", i, Image->VirtualAddress + Section->VirtualAddress);
+        }
+        else if (Section->RawSize == 0 || (Section->Flags & PE_SECTION_BSS)) {
             dstrace("section(%i): clearing %u bytes => 0x%x (0x%x, 0x%x)", i, Section->VirtualSize, Destination,
                 Image->VirtualAddress + Section->VirtualAddress, PageFlags);
             memset(Destination, 0, Section->VirtualSize);
@@ -237,8 +272,11 @@ PeHandleSections(
         CurrentAddress += (GetPageSize() - (CurrentAddress % GetPageSize()));
     }
 
-    if (Parent != NULL) Parent->NextLoadingAddress = CurrentAddress;
-    else                Image->NextLoadingAddress  = CurrentAddress;
+    // Libraries at a stable base live outside the range that is handed out per process
+    Image->NextLoadingAddress = CurrentAddress;
+    if (Parent != NULL && !Image->StableBase) {
+        Parent->NextLoadingAddress = CurrentAddress;
+    }
     return OsSuccess;
 }
 
@@ -288,7 +326,8 @@ PeResolveImportDescriptor(
             }
             else {
                 NameDescriptor = (PeImportNameDescriptor_t*)OFFSET_IN_SECTION(Section, Value & PE_IMPORT_NAMEMASK);
-                Function       = GetExportedFunctionByNameDescriptor(Exports, NumberOfExports, NameDescriptor);
+                Function       = PeLookupExport(&ResolvedLibrary->ExportIndex, Exports, NumberOfExports,
+                    (const char*)&NameDescriptor->Name[0], NameDescriptor->OrdinalHint);
                 if (!Function) {
                     dserror("Failed to locate function (%s)", &NameDescriptor->Name[0]);
                     return OsError;
@@ -315,7 +354,8 @@ PeResolveImportDescriptor(
             }
             else {
                 NameDescriptor = (PeImportNameDescriptor_t*)OFFSET_IN_SECTION(Section, Value & PE_IMPORT_NAMEMASK);
-                Function       = GetExportedFunctionByNameDescriptor(Exports, NumberOfExports, NameDescriptor);
+                Function       = PeLookupExport(&ResolvedLibrary->ExportIndex, Exports, NumberOfExports,
+                    (const char*)&NameDescriptor->Name[0], NameDescriptor->OrdinalHint);
                 if (!Function) {
                     dserror("Failed to locate function (%s)", &NameDescriptor->Name[0]);
                     return OsError;
@@ -380,6 +420,13 @@ PeHandleRelocations(
             dserror("Invalid relocation data: BlockSize > BytesLeft, bailing");
             assert(0);
         }
+
+        // Shared sections were relocated by the load that prepared them
+        if (Section->Shared) {
+            RelocationPointer += (BlockSize / sizeof(uint32_t));
+            BytesLeft         -= BlockSize;
+            continue;
+        }
         
         NumRelocs       = (BlockSize - 8) / sizeof(uint16_t);
         RelocationTable = (uint16_t*)&RelocationPointer[2];
@@ -448,6 +495,7 @@ PeHandleExports(
     uint16_t*            FunctionOrdinalsTable;
     uint32_t*            FunctionAddressTable;
     size_t               FunctionNameLengths;
+    int*                 IndexSlots;
     int                  OrdinalBase;
     int                  i;
 
@@ -501,7 +549,7 @@ PeHandleExports(
             NameAddress = OFFSET_IN_SECTION(Section, FunctionAddressTable[i]);
         }
         else {
-            uintptr_t MaxImageValue = (ParentImage == NULL) ? Image->NextLoadingAddress : ParentImage->NextLoadingAddress; 
+            uintptr_t MaxImageValue = Image->NextLoadingAddress;
             if (!ISINRANGE(ExFunc->Address, Image->CodeBase, MaxImageValue)) {
                 dserror("%s: Address 0x%x (Table RVA value: 0x%x), %i", 
                     MStringRaw(Image->Name), ExFunc->Address, FunctionAddressTable[ExFunc->Ordinal], i);
@@ -539,6 +587,14 @@ PeHandleExports(
         ExFunc->Name         = NameBuffer;
         FunctionNameLengths += FunctionLength;
     }
+
+    // Index the exports by name once, so each import binds in constant time. Without
+    // the index lookups fall back to a linear search.
+    IndexSlots = (int*)dsalloc(sizeof(int) * PeExportIndexCapacity(Image->NumberOfExportedFunctions));
+    if (IndexSlots != NULL) {
+        PeBuildExportIndex(&Image->ExportIndex, IndexSlots,
+            Image->ExportedFunctions, Image->NumberOfExportedFunctions);
+    }
     return OsSuccess;
 }
 
@@ -602,7 +658,7 @@ PeParseAndMapImage(
 
     // Now we want to handle all the directories and sections in the image
     dstrace("Handling sections and data directory mappings");
-    Status = PeHandleSections(Parent, Image, ImageBuffer, SectionBase, SectionCount, SectionMappings);
+    Status = PeHandleSections(Parent, Image, ImageBuffer, SectionBase, SectionCount, Directories, SectionMappings);
     if (Status != OsSuccess) {
         return OsError;
     }
@@ -629,6 +685,7 @@ PeParseAndMapImage(
     if (Parent != NULL) {
         ELEMENT_INIT(&Image->Header, 0, Image);
         list_append(Parent->Libraries, &Image->Header);
+        PeIndexLibrary(Parent, Image);
     }
 
     // Handle all the data directories, if they are present
@@ -661,11 +718,32 @@ PeParseAndMapImage(
     return Status;
 }
 
+// Files that stay loaded in a cache only have to be validated once
+static OsStatus_t
+PeValidateLoadedImage(
+    _In_ MString_t* FullPath,
+    _In_ uint8_t*   Buffer,
+    _In_ size_t     Length)
+{
+    OsStatus_t Status;
+
+    if (IsFileVerified(FullPath, Buffer)) {
+        return OsSuccess;
+    }
+
+    Status = PeValidateImageBuffer(Buffer, Length);
+    if (Status == OsSuccess) {
+        SetFileVerified(FullPath, Buffer);
+    }
+    return Status;
+}
+
 static OsStatus_t
 ResolvePeImagePath(
     _In_  UUId_t           Owner,
     _In_  MString_t*       Path,
     _Out_ uint8_t**        BufferOut,
+    _Out_ size_t*          LengthOut,
     _Out_ MString_t**      FullPathOut)
 {
     MString_t* FullPath;
@@ -689,8 +767,188 @@ ResolvePeImagePath(
     }
 
     *BufferOut   = Buffer;
+    *LengthOut   = Length;
     *FullPathOut = FullPath;
-    return PeValidateImageBuffer(Buffer, Length);
+    return PeValidateLoadedImage(FullPath, Buffer, Length);
+}
+
+// Converts an RVA to an offset in the image file, as long as <Length> bytes are present
+static uint8_t*
+PeGetFileDataFromRVA(
+    _In_ uint8_t*           Buffer,
+    _In_ size_t             BufferLength,
+    _In_ PeSectionHeader_t* Sections,
+    _In_ int                SectionCount,
+    _In_ uint32_t           RVA,
+    _In_ size_t             Length)
+{
+    int i;
+    for (i = 0; i < SectionCount; i++) {
+        if (RVA >= Sections[i].VirtualAddress &&
+            (RVA + Length) <= (Sections[i].VirtualAddress + Sections[i].RawSize) &&
+            (Sections[i].RawAddress + Sections[i].RawSize) <= BufferLength) {
+            return Buffer + Sections[i].RawAddress + (RVA - Sections[i].VirtualAddress);
+        }
+    }
+    return NULL;
+}
+
+/* PeGetImportedLibraries
+ * Retrieves the names of the libraries a raw image file imports. The names point
+ * into the buffer. Returns the number of names, at most MaxNames. */
+static int
+PeGetImportedLibraries(
+    _In_ uint8_t*     Buffer,
+    _In_ size_t       Length,
+    _In_ const char** Names,
+    _In_ int          MaxNames)
+{
+    MzHeader_t*           DosHeader = (MzHeader_t*)Buffer;
+    PeHeader_t*           BaseHeader;
+    PeOptionalHeader_t*   OptHeader;
+    PeDataDirectory_t*    Directory;
+    PeSectionHeader_t*    Sections;
+    PeImportDescriptor_t* ImportDescriptor;
+    uint8_t*              DirectoryEnd;
+    int                   Count = 0;
+
+    BaseHeader = (PeHeader_t*)(Buffer + DosHeader->PeHeaderAddress);
+    OptHeader  = (PeOptionalHeader_t*)(Buffer + DosHeader->PeHeaderAddress + sizeof(PeHeader_t));
+    Sections   = (PeSectionHeader_t*)((uint8_t*)OptHeader + BaseHeader->SizeOfOptionalHeader);
+    if (OptHeader->Architecture == PE_ARCHITECTURE_32) {
+        Directory = &((PeOptionalHeader32_t*)OptHeader)->Directories[PE_SECTION_IMPORT];
+    }
+    else if (OptHeader->Architecture == PE_ARCHITECTURE_64) {
+        Directory = &((PeOptionalHeader64_t*)OptHeader)->Directories[PE_SECTION_IMPORT];
+    }
+    else {
+        return 0;
+    }
+
+    if ((uintptr_t)&Sections[BaseHeader->NumSections] > (uintptr_t)(Buffer + Length) ||
+        Directory->AddressRVA == 0 || Directory->Size == 0) {
+        return 0;
+    }
+
+    ImportDescriptor = (PeImportDescriptor_t*)PeGetFileDataFromRVA(Buffer, Length, Sections,
+        BaseHeader->NumSections, Directory->AddressRVA, Directory->Size);
+    if (ImportDescriptor == NULL) {
+        return 0;
+    }
+    DirectoryEnd = (uint8_t*)ImportDescriptor + Directory->Size;
+
+    while (Count < MaxNames && (uint8_t*)(ImportDescriptor + 1) <= DirectoryEnd &&
+           ImportDescriptor->ImportAddressTable != 0) {
+        const char* Name = (const char*)PeGetFileDataFromRVA(Buffer, Length, Sections,
+            BaseHeader->NumSections, ImportDescriptor->ModuleName, 1);
+        if (Name != NULL) {
+            Names[Count++] = Name;
+        }
+        ImportDescriptor++;
+    }
+    return Count;
+}
+
+typedef struct PePrefetchState {
+    int        Count;
+    MString_t* Names[PE_PREFETCH_MAX_LIBRARIES];
+    MString_t* FullPaths[PE_PREFETCH_MAX_LIBRARIES];
+    void*      Buffers[PE_PREFETCH_MAX_LIBRARIES];
+    size_t     Lengths[PE_PREFETCH_MAX_LIBRARIES];
+} PePrefetchState_t;
+
+static void
+PePrefetchAddImports(
+    _In_ PePrefetchState_t* State,
+    _In_ uint8_t*           Buffer,
+    _In_ size_t             Length)
+{
+    const char* Imports[PE_PREFETCH_MAX_LIBRARIES];
+    int         ImportCount;
+    int         i, j;
+
+    ImportCount = PeGetImportedLibraries(Buffer, Length, &Imports[0], PE_PREFETCH_MAX_LIBRARIES);
+    for (i = 0; i < ImportCount && State->Count < PE_PREFETCH_MAX_LIBRARIES; i++) {
+        MString_t* Name = MStringCreate((void*)Imports[i], StrUTF8);
+        for (j = 0; j < State->Count; j++) {
+            if (MStringCompare(State->Names[j], Name, 1) == MSTRING_FULL_MATCH) {
+                break;
+            }
+        }
+
+        if (j == State->Count) {
+            State->Names[State->Count++] = Name;
+        }
+        else {
+            MStringDestroy(Name);
+        }
+    }
+}
+
+/* PePrefetchDependencies
+ * Discovers the dependency graph of an executable from the import directories of the
+ * image files, and loads the files of each level of the graph concurrently. The files
+ * are kept loaded until PeReleasePrefetch, so the serial load of the dependencies that
+ * follows does not have to wait for the disk. */
+static PePrefetchState_t*
+PePrefetchDependencies(
+    _In_ UUId_t   Owner,
+    _In_ uint8_t* Buffer,
+    _In_ size_t   Length)
+{
+    PePrefetchState_t* State;
+    OsStatus_t         Status;
+    clock_t            Timing = GetTimestamp();
+    int                LevelStart = 0;
+    int                i;
+
+    State = (PePrefetchState_t*)dsalloc(sizeof(PePrefetchState_t));
+    if (!State) {
+        return NULL;
+    }
+    memset(State, 0, sizeof(PePrefetchState_t));
+
+    PePrefetchAddImports(State, Buffer, Length);
+    while (LevelStart < State->Count) {
+        int LevelEnd = State->Count;
+
+        Status = PrefetchFiles(Owner, LevelEnd - LevelStart, &State->Names[LevelStart],
+            &State->FullPaths[LevelStart], &State->Buffers[LevelStart], &State->Lengths[LevelStart]);
+        if (Status != OsSuccess) {
+            break;
+        }
+
+        for (i = LevelStart; i < LevelEnd; i++) {
+            if (State->Buffers[i] != NULL &&
+                PeValidateLoadedImage(State->FullPaths[i], State->Buffers[i], State->Lengths[i]) == OsSuccess) {
+                PePrefetchAddImports(State, State->Buffers[i], State->Lengths[i]);
+            }
+        }
+        LevelStart = LevelEnd;
+    }
+    dstrace("prefetched %i libraries in %u ms", State->Count, GetTimestamp() - Timing);
+    return State;
+}
+
+static void
+PeReleasePrefetch(
+    _In_ PePrefetchState_t* State)
+{
+    int i;
+    if (State == NULL) {
+        return;
+    }
+
+    for (i = 0; i < State->Count; i++) {
+        if (State->Buffers[i] != NULL) {
+            UnloadFile(State->FullPaths[i], State->Buffers[i]);
+        }
+        if (State->FullPaths[i] != NULL) {
+            MStringDestroy(State->FullPaths[i]);
+        }
+        MStringDestroy(State->Names[i]);
+    }
+    dsfree(State);
 }
 
 OsStatus_t
@@ -707,19 +965,23 @@ PeLoadImage(
     PeOptionalHeader64_t* OptHeader64;
 
     MString_t*         FullPath = NULL;
+    PePrefetchState_t* Prefetch = NULL;
     uintptr_t          SectionAddress;
     uintptr_t          ImageBase;
+    uintptr_t          LoadAddress;
+    size_t             SizeOfImage;
     size_t             SizeOfMetaData;
     PeDataDirectory_t* DirectoryPtr;
     PeExecutable_t*    Image;
     OsStatus_t         Status;
     uint8_t*           Buffer;
+    size_t             Length;
     int                Index;
 
     dstrace("PeLoadImage(Path %s, Parent %s)",
         MStringRaw(Path), (Parent == NULL) ? "None" : MStringRaw(Parent->Name));
     
-    Status = ResolvePeImagePath(Owner, Path, &Buffer, &FullPath);
+    Status = ResolvePeImagePath(Owner, Path, &Buffer, &Length, &FullPath);
     if (Status != OsSuccess) {
         if (FullPath != NULL) {
             MStringDestroy(FullPath);
@@ -752,6 +1014,7 @@ PeLoadImage(
         OptHeader32     = (PeOptionalHeader32_t*)(Buffer 
             + DosHeader->PeHeaderAddress + sizeof(PeHeader_t));
         ImageBase       = OptHeader32->BaseAddress;
+        SizeOfImage     = OptHeader32->SizeOfImage;
         SizeOfMetaData  = OptHeader32->SizeOfHeaders;
         SectionAddress  = (uintptr_t)(Buffer + DosHeader->PeHeaderAddress 
             + sizeof(PeHeader_t) + sizeof(PeOptionalHeader32_t));
@@ -761,6 +1024,7 @@ PeLoadImage(
         OptHeader64     = (PeOptionalHeader64_t*)(Buffer 
             + DosHeader->PeHeaderAddress + sizeof(PeHeader_t));
         ImageBase       = (uintptr_t)OptHeader64->BaseAddress;
+        SizeOfImage     = OptHeader64->SizeOfImage;
         SizeOfMetaData  = OptHeader64->SizeOfHeaders;
         SectionAddress  = (uintptr_t)(Buffer + DosHeader->PeHeaderAddress 
             + sizeof(PeHeader_t) + sizeof(PeOptionalHeader64_t));
@@ -771,6 +1035,21 @@ PeLoadImage(
         return OsError;
     }
 
+    // Libraries are placed at their system-wide address when one is available, and
+    // a library prelinked for that address needs no relocation. Otherwise they
+    // are placed after the previous image of the process.
+    LoadAddress = 0;
+    if (Parent != NULL) {
+        LoadAddress = GetLibraryBaseAddress(FullPath, ImageBase, SizeOfImage);
+        if (!LoadAddress && (Parent->NextLoadingAddress + SizeOfImage) >
+                (GetBaseAddress() + PE_SHARED_REGION_OFFSET)) {
+            dserror("%s: no room for the image in the process", MStringRaw(FullPath));
+            UnloadFile(FullPath, (void*)Buffer);
+            MStringDestroy(FullPath);
+            return OsOutOfMemory;
+        }
+    }
+
     Image = (PeExecutable_t*)dsalloc(sizeof(PeExecutable_t));
     if (!Image) {
         return OsOutOfMemory;
@@ -782,10 +1061,13 @@ PeLoadImage(
     Image->Owner             = Owner;
     Image->FullPath          = FullPath;
     Image->Architecture      = OptHeader->Architecture;
-    Image->VirtualAddress    = (Parent == NULL) ? GetBaseAddress() : Parent->NextLoadingAddress;
+    Image->StableBase        = (LoadAddress != 0);
+    Image->VirtualAddress    = (Parent == NULL) ? GetBaseAddress() :
+        (LoadAddress != 0) ? LoadAddress : Parent->NextLoadingAddress;
     Image->Libraries         = dsalloc(sizeof(list_t));
     Image->References        = 1;
     Image->OriginalImageBase = ImageBase;
+    Image->NameHash          = PeHashName(MStringRaw(Image->Name), 1);
     list_construct(Image->Libraries);
     dstrace("library (%s) => 0x%x", MStringRaw(Image->Name), Image->VirtualAddress);
 
@@ -804,14 +1086,30 @@ PeLoadImage(
             dsfree(Image);
             return OsError;
         }
+
+        // Without the index libraries are resolved by walking the library list
+        Image->LibraryIndex = (PeExecutable_t**)dsalloc(sizeof(PeExecutable_t*) * PE_LIBRARY_INDEX_SIZE);
+        if (Image->LibraryIndex != NULL) {
+            memset(Image->LibraryIndex, 0, sizeof(PeExecutable_t*) * PE_LIBRARY_INDEX_SIZE);
+        }
     }
     else {
         Image->MemorySpace = Parent->MemorySpace;
     }
 
+    // The dependencies of an executable are fetched up front, and are then loaded
+    // and bound depth-first while handling the import directories
+    if (Parent == NULL) {
+        Prefetch = PePrefetchDependencies(Owner, Buffer, Length);
+    }
+
     // Parse the headers, directories and handle them.
     Status = PeParseAndMapImage(Parent, Image, Buffer, SizeOfMetaData, SectionAddress, 
         (int)BaseHeader->NumSections, DirectoryPtr);
+    if (Image->StableBase) {
+        CompleteSharedSections(Image->MemorySpace, Buffer, Status);
+    }
+    PeReleasePrefetch(Prefetch);
     UnloadFile(FullPath, (void*)Buffer);
     if (Status != OsSuccess) {
         PeUnloadLibrary(Parent, Image);
@@ -832,6 +1130,15 @@ PeUnloadImage(
         if (Image->ExportedFunctions != NULL) {
             dsfree(Image->ExportedFunctions);
         }
+        if (Image->ExportedFunctionNames != NULL) {
+            dsfree(Image->ExportedFunctionNames);
+        }
+        if (Image->ExportIndex.Slots != NULL) {
+            dsfree(Image->ExportIndex.Slots);
+        }
+        if (Image->LibraryIndex != NULL) {
+            dsfree(Image->LibraryIndex);
+        }
         if (Image->Libraries != NULL) {
             _foreach(Element, Image->Libraries) {
                 PeUnloadImage(Element->value);
@@ -858,6 +1165,7 @@ PeUnloadLibrary(
                 PeExecutable_t* lLib = i->value;
                 if (lLib == Library) {
                     list_remove(Parent->Libraries, i);
+                    PeUnindexLibrary(Parent, Library);
                     break;
                 }
             }
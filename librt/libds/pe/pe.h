@@ -29,6 +29,7 @@
 #include <ds/list.h>
 #include <os/pe.h>
 #include <time.h>
+#include "exports.h"
 
 DECL_STRUCT(MString);
 typedef void* MemorySpaceHandle_t;
@@ -44,13 +45,6 @@ typedef void* MemoryMapHandle_t;
 #error "Unhandled PE architecture used"
 #endif
 
-typedef struct PeExportedFunction {
-    const char* Name;
-    const char* ForwardName; //Library.Function
-    int         Ordinal;
-    uintptr_t   Address;
-} PeExportedFunction_t;
-
 typedef struct PeExecutable {
     UUId_t                Owner;
     MString_t*            Name;
@@ -67,25 +61,55 @@ typedef struct PeExecutable {
     uintptr_t             CodeBase;
     size_t                CodeSize;
     uintptr_t             NextLoadingAddress;
+    int                   StableBase;
     
     int                   NumberOfExportedFunctions;
     PeExportedFunction_t* ExportedFunctions;
     char*                 ExportedFunctionNames;
+    PeExportIndex_t       ExportIndex;
     list_t*               Libraries;
+
+    // Name-keyed index of <Libraries>, only present on the root image
+    uint32_t              NameHash;
+    struct PeExecutable** LibraryIndex;
+    struct PeExecutable*  LibraryIndexLink;
 } PeExecutable_t;
 
+#define PE_LIBRARY_INDEX_SIZE 32
+
+// The maximum number of dependencies of an executable that are fetched ahead of loading
+#define PE_PREFETCH_MAX_LIBRARIES 64
+
+// Libraries that are given a stable address are placed in the upper part of the
+// user code region, which images placed per process never grow into. The offset
+// is relative to the base address of the process.
+#if __BITS == 32
+#define PE_SHARED_REGION_OFFSET  0x08000000
+#define PE_SHARED_REGION_SIZE    0x08000000
+#else
+#define PE_SHARED_REGION_OFFSET  0x80000000ULL
+#define PE_SHARED_REGION_SIZE    0x80000000ULL
+#endif
+#define PE_SHARED_REGION_ALIGN   0x10000
+
 /*******************************************************************************
  * Support Methods 
  *******************************************************************************/
 __EXTERN uintptr_t  GetPageSize(void);
 __EXTERN uintptr_t  GetBaseAddress(void);
+__EXTERN uintptr_t  GetLibraryBaseAddress(MString_t*, uintptr_t, size_t);
 __EXTERN clock_t    GetTimestamp(void);
 __EXTERN OsStatus_t ResolveFilePath(UUId_t, MString_t*, MString_t**);
 __EXTERN OsStatus_t LoadFile(MString_t*, void**, size_t*);
 __EXTERN void       UnloadFile(MString_t*, void*);
+__EXTERN OsStatus_t PrefetchFiles(UUId_t, int, MString_t**, MString_t**, void**, size_t*);
+__EXTERN int        IsFileVerified(MString_t*, void*);
+__EXTERN void       SetFileVerified(MString_t*, void*);
 __EXTERN OsStatus_t CreateImageSpace(MemorySpaceHandle_t*);
 __EXTERN OsStatus_t AcquireImageMapping(MemorySpaceHandle_t, uintptr_t*, size_t, Flags_t, MemoryMapHandle_t*);
 __EXTERN void       ReleaseImageMapping(MemoryMapHandle_t);
+__EXTERN OsStatus_t AcquireSharedSection(MemorySpaceHandle_t, void*, uintptr_t, size_t, Flags_t, uint8_t**, int*);
+__EXTERN void       CompleteSharedSections(MemorySpaceHandle_t, void*, OsStatus_t);
 
 /*******************************************************************************
  * Public API 
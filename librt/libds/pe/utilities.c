@@ -55,15 +55,32 @@ PeResolveLibrary(
 
     // Before actually loading the file, we want to
     // try to locate the library in the parent first.
-    foreach(i, ExportParent->Libraries) {
-        PeExecutable_t *Library = i->value;
-        if (MStringCompare(Library->Name, LibraryName, 1) == MSTRING_FULL_MATCH) {
-            dstrace("Library %s was already resolved, increasing ref count", MStringRaw(Library->Name));
-            Library->References++;
-            Exports = Library;
-            break;
+    if (ExportParent->LibraryIndex != NULL) {
+        uint32_t        NameHash = PeHashName(MStringRaw(LibraryName), 1);
+        PeExecutable_t* Library  = ExportParent->LibraryIndex[NameHash % PE_LIBRARY_INDEX_SIZE];
+        while (Library != NULL) {
+            if (Library->NameHash == NameHash && 
+                MStringCompare(Library->Name, LibraryName, 1) == MSTRING_FULL_MATCH) {
+                Exports = Library;
+                break;
+            }
+            Library = Library->LibraryIndexLink;
         }
     }
+    else {
+        foreach(i, ExportParent->Libraries) {
+            PeExecutable_t *Library = i->value;
+            if (MStringCompare(Library->Name, LibraryName, 1) == MSTRING_FULL_MATCH) {
+                Exports = Library;
+                break;
+            }
+        }
+    }
+
+    if (Exports != NULL) {
+        dstrace("Library %s was already resolved, increasing ref count", MStringRaw(Exports->Name));
+        Exports->References++;
+    }
 
     // Sanitize the exports, if its null we have to resolve the library
     if (Exports == NULL) {
@@ -84,15 +101,50 @@ PeResolveFunction(
     _In_ PeExecutable_t* Library, 
     _In_ const char*    Function)
 {
-    PeExportedFunction_t* Exports = Library->ExportedFunctions;
-    if (Exports != NULL) {
-        for (int i = 0; i < Library->NumberOfExportedFunctions; i++) {
-            if (Exports[i].Name != NULL && !strcmp(Exports[i].Name, Function)) {
-                return Exports[i].Address;
-            }
+    PeExportedFunction_t* Export;
+    if (Library->ExportedFunctions == NULL) {
+        return 0;
+    }
+
+    Export = PeLookupExport(&Library->ExportIndex, Library->ExportedFunctions,
+        Library->NumberOfExportedFunctions, Function, -1);
+    return (Export != NULL) ? Export->Address : 0;
+}
+
+void
+PeIndexLibrary(
+    _In_ PeExecutable_t* Parent,
+    _In_ PeExecutable_t* Library)
+{
+    PeExecutable_t** Bucket;
+    if (Parent->LibraryIndex == NULL) {
+        return;
+    }
+
+    Bucket                    = &Parent->LibraryIndex[Library->NameHash % PE_LIBRARY_INDEX_SIZE];
+    Library->LibraryIndexLink = *Bucket;
+    *Bucket                   = Library;
+}
+
+void
+PeUnindexLibrary(
+    _In_ PeExecutable_t* Parent,
+    _In_ PeExecutable_t* Library)
+{
+    PeExecutable_t** Link;
+    if (Parent->LibraryIndex == NULL) {
+        return;
+    }
+
+    Link = &Parent->LibraryIndex[Library->NameHash % PE_LIBRARY_INDEX_SIZE];
+    while (*Link != NULL) {
+        if (*Link == Library) {
+            *Link = Library->LibraryIndexLink;
+            break;
         }
+        Link = &(*Link)->LibraryIndexLink;
     }
-    return 0;
+    Library->LibraryIndexLink = NULL;
 }
 
 OsStatus_t
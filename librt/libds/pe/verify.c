@@ -22,38 +22,9 @@
  */
 
 #include <ds/ds.h>
+#include "checksum.h"
 #include "pe.h"
 
-uint32_t
-PeCalculateChecksum(
-    _In_ uint8_t* Data,
-    _In_ size_t   DataLength,
-    _In_ size_t   PeChkSumOffset)
-{
-    uint32_t* DataPtr  = (uint32_t*)Data;
-    uint64_t  Limit    = 4294967296;
-    uint64_t  CheckSum = 0;
-
-    for (size_t i = 0; i < (DataLength / 4); i++, DataPtr++) {
-        uint32_t Val = *DataPtr;
-
-        // Skip the checksum index
-        if (i == (PeChkSumOffset / 4)) {
-            continue;
-        }
-        CheckSum = (CheckSum & UINT32_MAX) + Val + (CheckSum >> 32);
-        if (CheckSum > Limit) {
-            CheckSum = (CheckSum & UINT32_MAX) + (CheckSum >> 32);
-        }
-    }
-
-    CheckSum = (CheckSum & UINT16_MAX) + (CheckSum >> 16);
-    CheckSum = (CheckSum) + (CheckSum >> 16);
-    CheckSum = CheckSum & UINT16_MAX;
-    CheckSum += (uint32_t)DataLength;
-    return (uint32_t)(CheckSum & UINT32_MAX);
-}
-
 OsStatus_t
 PeValidateImageBuffer(
     _In_ uint8_t* Buffer,
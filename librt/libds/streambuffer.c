@@ -130,6 +130,12 @@ bytes_writable(
         }
         return capacity - (write_index - (read_index - UINT_MAX));
     }
+    
+    // A resize in progress allocates the new capacity, which must look like a
+    // full buffer also to writers that still see the old capacity
+    if ((write_index - read_index) >= capacity) {
+        return 0;
+    }
     return capacity - (write_index - read_index);
 }
 
@@ -191,6 +197,65 @@ streambuffer_try_truncate(
     atomic_fetch_add(&stream->consumer_comitted_index, bytes_comitted);
 }
 
+size_t
+streambuffer_bytes_readable(
+    _In_ streambuffer_t* stream)
+{
+    return bytes_readable(stream->capacity, atomic_load(&stream->consumer_index),
+        atomic_load(&stream->producer_comitted_index));
+}
+
+// The capacity can only change while the stream is empty and no readers or writers
+// are in the middle of an operation. The resize is claimed by allocating the new capacity
+// worth of bytes, which makes the stream look full to writers no matter which capacity they
+// see, and then all indices are moved past the claim so the stream is empty again. Readers
+// and writers that raced with it fail their allocation and start over.
+OsStatus_t
+streambuffer_resize(
+    _In_ streambuffer_t* stream,
+    _In_ size_t          capacity)
+{
+    unsigned int      index = atomic_load(&stream->producer_index);
+    unsigned int      claim_index;
+    FutexParameters_t parameters;
+    
+    if (capacity <= stream->capacity) {
+        return OsNotSupported;
+    }
+    
+    // The indices must not wrap while being moved, retry when they have
+    if (index > (UINT_MAX - (2 * capacity))) {
+        return OsBusy;
+    }
+    
+    if (atomic_load(&stream->producer_comitted_index) != index ||
+        atomic_load(&stream->consumer_index) != index ||
+        atomic_load(&stream->consumer_comitted_index) != index) {
+        return OsBusy;
+    }
+    
+    claim_index = index + (unsigned int)capacity;
+    if (!atomic_compare_exchange_strong(&stream->producer_index, &index, claim_index)) {
+        return OsBusy;
+    }
+    
+    // Readers must never see the committed write index ahead of the read index, and
+    // writers must not see room before the committed read index has been moved
+    stream->capacity = capacity;
+    atomic_store(&stream->consumer_index, claim_index);
+    atomic_store(&stream->producer_comitted_index, claim_index);
+    atomic_store(&stream->consumer_comitted_index, claim_index);
+    
+    // Wake writers that were waiting for room, a larger write may fit now
+    parameters._val0 = atomic_exchange(&stream->producer_count, 0);
+    if (parameters._val0 != 0) {
+        parameters._futex0 = (atomic_int*)&stream->consumer_comitted_index;
+        parameters._flags  = STREAMBUFFER_WAKE_FLAGS(stream);
+        dswake(&parameters);
+    }
+    return OsSuccess;
+}
+
 size_t
 streambuffer_stream_out(
     _In_ streambuffer_t* stream,
@@ -274,6 +274,62 @@ void UnloadFile(MString_t* FullPath, void* Buffer)
     _CRT_UNUSED(FullPath);
     _CRT_UNUSED(Buffer);
 }
+
+OsStatus_t PrefetchFiles(UUId_t ProcessId, int Count, MString_t** Paths, MString_t** FullPaths, void** Buffers, size_t* Lengths)
+{
+    // Modules are already in memory, nothing to gain
+    _CRT_UNUSED(ProcessId);
+    _CRT_UNUSED(Count);
+    _CRT_UNUSED(Paths);
+    _CRT_UNUSED(FullPaths);
+    _CRT_UNUSED(Buffers);
+    _CRT_UNUSED(Lengths);
+    return OsNotSupported;
+}
+
+int IsFileVerified(MString_t* FullPath, void* Buffer)
+{
+    // Module images are only loaded a few times, validate them each time
+    _CRT_UNUSED(FullPath);
+    _CRT_UNUSED(Buffer);
+    return 0;
+}
+
+void SetFileVerified(MString_t* FullPath, void* Buffer)
+{
+    _CRT_UNUSED(FullPath);
+    _CRT_UNUSED(Buffer);
+}
+
+uintptr_t GetLibraryBaseAddress(MString_t* FullPath, uintptr_t PreferredBase, size_t ImageSize)
+{
+    // Modules loaded by the kernel are placed sequentially in each process
+    _CRT_UNUSED(FullPath);
+    _CRT_UNUSED(PreferredBase);
+    _CRT_UNUSED(ImageSize);
+    return 0;
+}
+
+OsStatus_t AcquireSharedSection(MemorySpaceHandle_t Handle, void* FileBuffer, uintptr_t Address,
+    size_t Length, Flags_t Flags, uint8_t** BufferOut, int* PreparedOut)
+{
+    // Modules have no stable base, so there is nothing to share
+    _CRT_UNUSED(Handle);
+    _CRT_UNUSED(FileBuffer);
+    _CRT_UNUSED(Address);
+    _CRT_UNUSED(Length);
+    _CRT_UNUSED(Flags);
+    _CRT_UNUSED(BufferOut);
+    _CRT_UNUSED(PreparedOut);
+    return OsNotSupported;
+}
+
+void CompleteSharedSections(MemorySpaceHandle_t Handle, void* FileBuffer, OsStatus_t Status)
+{
+    _CRT_UNUSED(Handle);
+    _CRT_UNUSED(FileBuffer);
+    _CRT_UNUSED(Status);
+}
 #endif
 
 OsStatus_t CreateImageSpace(MemorySpaceHandle_t* HandleOut)
@@ -0,0 +1,217 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * PE Checksum Test
+ *  - Compares the checksum against the original word-by-word implementation for
+ *    many image sizes, checksum positions and data patterns, including the ones
+ *    that hit the carry corner cases. Reports the time of both on a large image.
+ */
+
+#include "../../pe/checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_IMAGE_SIZE (1024 * 1024)
+#define BENCH_SIZE     (16 * 1024 * 1024)
+#define BENCH_ROUNDS   16
+
+// The implementation the loader used before, kept as the reference
+static uint32_t reference_checksum(uint8_t* data, size_t length, size_t offset)
+{
+    uint32_t* pointer  = (uint32_t*)data;
+    uint64_t  limit    = 4294967296;
+    uint64_t  checksum = 0;
+    size_t    i;
+
+    for (i = 0; i < (length / 4); i++, pointer++) {
+        uint32_t value = *pointer;
+        if (i == (offset / 4)) {
+            continue;
+        }
+        checksum = (checksum & UINT32_MAX) + value + (checksum >> 32);
+        if (checksum > limit) {
+            checksum = (checksum & UINT32_MAX) + (checksum >> 32);
+        }
+    }
+
+    checksum = (checksum & UINT16_MAX) + (checksum >> 16);
+    checksum = (checksum) + (checksum >> 16);
+    checksum = checksum & UINT16_MAX;
+    checksum += (uint32_t)length;
+    return (uint32_t)(checksum & UINT32_MAX);
+}
+
+static uint32_t next_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+enum pattern {
+    PATTERN_RANDOM,
+    PATTERN_ZERO,
+    PATTERN_ONES,
+    PATTERN_HIGH,
+    PATTERN_SPARSE,
+    PATTERN_COUNT
+};
+
+static void fill(uint8_t* data, size_t length, enum pattern pattern, uint32_t* state)
+{
+    size_t i;
+    switch (pattern) {
+        case PATTERN_RANDOM:
+            for (i = 0; i < length; i++) {
+                data[i] = (uint8_t)next_random(state);
+            }
+            break;
+        case PATTERN_ZERO:
+            memset(data, 0, length);
+            break;
+        case PATTERN_ONES:
+            memset(data, 0xFF, length);
+            break;
+        case PATTERN_HIGH:
+            // Words close to the top make the sum wrap on almost every word
+            for (i = 0; i + 4 <= length; i += 4) {
+                uint32_t value = UINT32_MAX - (next_random(state) & 0xF);
+                memcpy(&data[i], &value, sizeof(value));
+            }
+            break;
+        case PATTERN_SPARSE:
+            memset(data, 0, length);
+            for (i = 0; i < length; i += 1 + (next_random(state) % 4096)) {
+                data[i] = (uint8_t)next_random(state);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static int check(uint8_t* data, size_t length, size_t offset, const char* what)
+{
+    uint32_t expected = reference_checksum(data, length, offset);
+    uint32_t actual   = PeCalculateChecksum(data, length, offset);
+    if (expected != actual) {
+        printf("pe_checksum: %s mismatch, length %zu offset %zu: 0x%08x != 0x%08x\n",
+            what, length, offset, actual, expected);
+        return -1;
+    }
+    return 0;
+}
+
+// Makes the words besides the checksum field sum to an exact multiple of 2^32 - 1,
+// which is where the end-around carry sum has two representations of zero.
+static int check_multiple_of_modulus(uint8_t* data, uint32_t* state)
+{
+    uint32_t words[64];
+    uint64_t sum = 0;
+    int      count = 2 + (int)(next_random(state) % 60);
+    int      i;
+
+    for (i = 0; i < count - 1; i++) {
+        words[i] = next_random(state);
+        sum     += words[i];
+    }
+    sum %= UINT32_MAX;
+    words[count - 1] = (uint32_t)((UINT32_MAX - sum) % UINT32_MAX);
+    memcpy(data, words, count * sizeof(uint32_t));
+    return check(data, count * sizeof(uint32_t), count * sizeof(uint32_t), "modulus");
+}
+
+static double elapsed_ms(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double)(now.tv_sec - start->tv_sec) * 1e3) + ((double)(now.tv_nsec - start->tv_nsec) / 1e6);
+}
+
+static int bench(uint32_t* state)
+{
+    uint8_t*          data = malloc(BENCH_SIZE);
+    volatile uint32_t result = 0;
+    struct timespec   start;
+    double            referenceTime, optimizedTime;
+    int               i;
+
+    if (!data) {
+        return -1;
+    }
+    fill(data, BENCH_SIZE, PATTERN_RANDOM, state);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        result += reference_checksum(data, BENCH_SIZE, 0xD8);
+    }
+    referenceTime = elapsed_ms(&start) / BENCH_ROUNDS;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        result += PeCalculateChecksum(data, BENCH_SIZE, 0xD8);
+    }
+    optimizedTime = elapsed_ms(&start) / BENCH_ROUNDS;
+
+    printf("%d MiB image: reference %8.3f ms, optimized %8.3f ms (%.1fx)\n",
+        BENCH_SIZE / (1024 * 1024), referenceTime, optimizedTime, referenceTime / optimizedTime);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t* data  = malloc(MAX_IMAGE_SIZE);
+    uint32_t state = 0x12345678;
+    int      checks = 0;
+    size_t   length;
+    int      pattern;
+    int      i;
+
+    if (!data) {
+        return -1;
+    }
+
+    // Every small size, then growing sizes with odd tails up to the maximum
+    for (pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+        for (length = 0; length < MAX_IMAGE_SIZE; length = (length < 512) ? length + 1 : length * 2 + 3) {
+            size_t offsets[] = { 0, 4, 0xD8, 0x158, length / 2, length > 4 ? length - 4 : 0, length + 64 };
+            fill(data, length, (enum pattern)pattern, &state);
+            for (i = 0; i < (int)(sizeof(offsets) / sizeof(offsets[0])); i++) {
+                if (check(data, length, offsets[i], "pattern")) {
+                    return -1;
+                }
+                checks++;
+            }
+        }
+    }
+
+    for (i = 0; i < 100000; i++) {
+        if (check_multiple_of_modulus(data, &state)) {
+            return -1;
+        }
+        checks++;
+    }
+
+    printf("pe_checksum: %i checks passed\n", checks);
+    free(data);
+    return bench(&state);
+}
@@ -0,0 +1,202 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * PE Export Index Test
+ *  - Builds synthetic export tables of increasing size, binds every export the
+ *    way the loader binds an import table and verifies the result against a
+ *    linear search. Reports the bind time with and without the index.
+ */
+
+#include "../../pe/exports.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NAME_LENGTH 32
+
+struct export_table {
+    PeExportedFunction_t* exports;
+    char*                 names;
+    int                   count;
+};
+
+struct import {
+    const char* name;
+    int         hint;
+};
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp((const char*)a, (const char*)b);
+}
+
+// Names are generated with a common prefix like real libraries, and stored in sorted
+// order like the export name table of an image.
+static int create_table(struct export_table* table, int count)
+{
+    int i;
+
+    table->count   = count;
+    table->names   = malloc((size_t)count * NAME_LENGTH);
+    table->exports = malloc(sizeof(PeExportedFunction_t) * count);
+    if (!table->names || !table->exports) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        snprintf(&table->names[i * NAME_LENGTH], NAME_LENGTH, "__synthetic_%x_symbol_%i",
+            (unsigned int)(i * 2654435761U) >> 20, i);
+    }
+    qsort(table->names, count, NAME_LENGTH, compare_names);
+
+    for (i = 0; i < count; i++) {
+        table->exports[i].Name        = &table->names[i * NAME_LENGTH];
+        table->exports[i].ForwardName = NULL;
+        table->exports[i].Ordinal     = i;
+        table->exports[i].Address     = 0x10000000 + (uintptr_t)(i * 16);
+    }
+    return 0;
+}
+
+static void destroy_table(struct export_table* table)
+{
+    free(table->names);
+    free(table->exports);
+}
+
+static PeExportedFunction_t* lookup_linear(struct export_table* table, const char* name)
+{
+    int i;
+    for (i = 0; i < table->count; i++) {
+        if (!strcmp(table->exports[i].Name, name)) {
+            return &table->exports[i];
+        }
+    }
+    return NULL;
+}
+
+static double elapsed_ms(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double)(now.tv_sec - start->tv_sec) * 1e3) + ((double)(now.tv_nsec - start->tv_nsec) / 1e6);
+}
+
+static int bench_table(int count)
+{
+    struct export_table table;
+    struct import*      imports;
+    PeExportIndex_t     index;
+    int*                slots;
+    struct timespec     start;
+    double              linearTime, buildTime, hashTime, hintTime;
+    int                 status = 0;
+    int                 i;
+
+    if (create_table(&table, count)) {
+        printf("pe_exports: failed to allocate table\n");
+        return -1;
+    }
+
+    // Bind every export once, in a scrambled order, with the hints a linker would
+    // have written. Every fourth hint is stale to exercise the fallback.
+    imports = malloc(sizeof(struct import) * count);
+    slots   = malloc(sizeof(int) * PeExportIndexCapacity(count));
+    if (!imports || !slots) {
+        printf("pe_exports: failed to allocate imports\n");
+        destroy_table(&table);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        int export      = (int)(((unsigned int)i * 7919U) % (unsigned int)count);
+        imports[i].name = table.exports[export].Name;
+        imports[i].hint = (i % 4) ? export : (export + 1) % count;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        if (!lookup_linear(&table, imports[i].name)) {
+            status = -1;
+        }
+    }
+    linearTime = elapsed_ms(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PeBuildExportIndex(&index, slots, table.exports, count);
+    buildTime = elapsed_ms(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        if (!PeLookupExport(&index, table.exports, count, imports[i].name, -1)) {
+            status = -1;
+        }
+    }
+    hashTime = elapsed_ms(&start);
+
+    for (i = 0; i < count; i++) {
+        if (PeLookupExport(&index, table.exports, count, imports[i].name, -1) !=
+                lookup_linear(&table, imports[i].name)) {
+            status = -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        PeExportedFunction_t* export = PeLookupExport(&index, table.exports, count,
+            imports[i].name, imports[i].hint);
+        if (!export || strcmp(export->Name, imports[i].name)) {
+            status = -1;
+        }
+    }
+    hintTime = elapsed_ms(&start);
+
+    if (PeLookupExport(&index, table.exports, count, "__not_exported", -1) != NULL) {
+        status = -1;
+    }
+
+    printf("%6i exports: linear %9.3f ms, index build %7.3f ms, hashed %7.3f ms, hinted %7.3f ms\n",
+        count, linearTime, buildTime, hashTime, hintTime);
+    if (status) {
+        printf("pe_exports: lookup mismatch with %i exports\n", count);
+    }
+
+    free(slots);
+    free(imports);
+    destroy_table(&table);
+    return status;
+}
+
+int main(int argc, char** argv)
+{
+    static const int counts[] = { 16, 256, 1024, 4096, 16384 };
+    int              i;
+
+    if (PeHashName("LibC.dll", 1) != PeHashName("libc.DLL", 1)) {
+        printf("pe_exports: case-insensitive hashes differ\n");
+        return -1;
+    }
+
+    for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+        if (bench_table(counts[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
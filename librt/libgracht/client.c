@@ -26,34 +26,450 @@
 #include <errno.h>
 #include "include/gracht/client.h"
 #include "include/gracht/crc.h"
-#include "include/gracht/list.h"
 #include "include/gracht/debug.h"
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <threads.h>
+
+#define GRACHT_CLIENT_INFLIGHT_BUCKETS 64
+
+// A thread waiting for requests to complete or for the link. Each waiter sleeps on
+// its own condition so a response only wakes the thread it completes.
+struct client_waiter {
+    cnd_t                           condition;
+    struct gracht_message_context** contexts;
+    int                             count;
+    unsigned int                    flags;
+    struct client_waiter*           link;
+};
 
 typedef struct gracht_client {
-    uint32_t                client_id;
-    int                     iod;
-    struct client_link_ops* ops;
-    struct gracht_list      protocols;
+    uint32_t                       client_id;
+    int                            iod;
+    struct client_link_ops*        ops;
+    gracht_protocol_t*             protocols[GRACHT_MAX_PROTOCOLS];
+    
+    // Pipelining state, the in-flight table is hashed on the message id. Only one
+    // thread reads from the link at a time, the others wait for it to complete
+    // their requests or to hand over the link.
+    mtx_t                          sync_object;
+    mtx_t                          send_object;
+    uint32_t                       message_id;
+    int                            reader_active;
+    struct client_waiter*          waiters;
+    struct gracht_message_context* inflight[GRACHT_CLIENT_INFLIGHT_BUCKETS];
 } gracht_client_t;
 
-extern int client_invoke_action(struct gracht_list*, struct gracht_recv_message*);
+extern int client_invoke_action(gracht_protocol_t**, struct gracht_recv_message*);
+
+static void client_inflight_add(gracht_client_t* client, struct gracht_message_context* context)
+{
+    struct gracht_message_context** bucket = &client->inflight[context->message_id % GRACHT_CLIENT_INFLIGHT_BUCKETS];
+    context->link = *bucket;
+    *bucket       = context;
+}
+
+static struct gracht_message_context* client_inflight_remove(gracht_client_t* client, uint32_t messageId)
+{
+    struct gracht_message_context** link = &client->inflight[messageId % GRACHT_CLIENT_INFLIGHT_BUCKETS];
+    
+    while (*link) {
+        struct gracht_message_context* context = *link;
+        if (context->message_id == messageId) {
+            *link         = context->link;
+            context->link = NULL;
+            return context;
+        }
+        link = &context->link;
+    }
+    return NULL;
+}
+
+static void client_unpack_response(struct gracht_param* out, int outCount,
+    struct gracht_param* in, int inCount, char* payload)
+{
+    int i;
+    
+    for (i = 0; i < inCount && i < outCount; i++) {
+        size_t length = in[i].length < out[i].length ? in[i].length : out[i].length;
+        
+        if (in[i].type == GRACHT_PARAM_VALUE) {
+            if (out[i].data.buffer) {
+                memcpy(out[i].data.buffer, &in[i].data.value,
+                    out[i].length < sizeof(size_t) ? out[i].length : sizeof(size_t));
+            }
+            continue;
+        }
+        
+        if (out[i].data.buffer) {
+            memcpy(out[i].data.buffer, (in[i].type == GRACHT_PARAM_SHM) ? in[i].data.buffer : payload, length);
+            if (length < out[i].length) {
+                ((char*)out[i].data.buffer)[length] = '\0';
+            }
+        }
+        
+        if (in[i].type == GRACHT_PARAM_BUFFER) {
+            payload += in[i].length;
+        }
+    }
+}
+
+// Asynchronous responses are stored until they are retrieved, so copy the response
+// into a self-contained message that no longer references link storage
+static struct gracht_message* client_copy_response(struct gracht_recv_message* message)
+{
+    struct gracht_param*   params  = message->params;
+    char*                  payload = (char*)message->params + (message->param_count * sizeof(struct gracht_param));
+    size_t                 length  = sizeof(struct gracht_message) + (message->param_count * sizeof(struct gracht_param));
+    struct gracht_message* response;
+    char*                  storage;
+    int                    i;
+    
+    for (i = 0; i < message->param_in; i++) {
+        if (params[i].type != GRACHT_PARAM_VALUE) {
+            length += params[i].length;
+        }
+    }
+    
+    response = (struct gracht_message*)malloc(length);
+    if (!response) {
+        return NULL;
+    }
+    
+    memset(&response->header, 0, sizeof(struct gracht_message_header));
+    response->header.length   = (uint32_t)length;
+    response->header.id       = message->message_id;
+    response->header.param_in = message->param_in;
+    response->header.flags    = message->flags;
+    response->header.protocol = message->protocol;
+    response->header.action   = message->action;
+    if (!message->param_count) {
+        return response;
+    }
+    
+    memcpy(&response->params[0], params, message->param_count * sizeof(struct gracht_param));
+    storage = (char*)&response->params[message->param_count];
+    for (i = 0; i < message->param_in; i++) {
+        if (params[i].type == GRACHT_PARAM_BUFFER) {
+            memcpy(storage, payload, params[i].length);
+            payload += params[i].length;
+        }
+        else if (params[i].type == GRACHT_PARAM_SHM) {
+            memcpy(storage, params[i].data.buffer, params[i].length);
+            response->params[i].type = GRACHT_PARAM_BUFFER;
+        }
+        else {
+            continue;
+        }
+        storage += params[i].length;
+    }
+    return response;
+}
+
+static int client_contexts_done(struct gracht_message_context** contexts, int count, unsigned int flags)
+{
+    int completed = 0;
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        if (contexts[i]->state != GRACHT_MESSAGE_INPROGRESS) {
+            completed++;
+        }
+    }
+    return (flags & GRACHT_AWAIT_ALL) ? (completed == count) : (completed != 0);
+}
+
+static void client_waiter_add(gracht_client_t* client, struct client_waiter* waiter)
+{
+    waiter->link    = client->waiters;
+    client->waiters = waiter;
+}
+
+static void client_waiter_remove(gracht_client_t* client, struct client_waiter* waiter)
+{
+    struct client_waiter** link = &client->waiters;
+    
+    while (*link) {
+        if (*link == waiter) {
+            *link = waiter->link;
+            break;
+        }
+        link = &(*link)->link;
+    }
+}
+
+// Wakes the waiters whose requests are done, must be called with the sync object held
+static void client_wake_completed(gracht_client_t* client)
+{
+    struct client_waiter* waiter;
+    
+    for (waiter = client->waiters; waiter; waiter = waiter->link) {
+        if (waiter->count && client_contexts_done(waiter->contexts, waiter->count, waiter->flags)) {
+            cnd_signal(&waiter->condition);
+        }
+    }
+}
+
+// Hands the link to a waiter that still needs it, must be called with the sync
+// object held after the reader role has been released
+static void client_wake_reader(gracht_client_t* client)
+{
+    struct client_waiter* waiter;
+    
+    for (waiter = client->waiters; waiter; waiter = waiter->link) {
+        if (!waiter->count || !client_contexts_done(waiter->contexts, waiter->count, waiter->flags)) {
+            cnd_signal(&waiter->condition);
+            break;
+        }
+    }
+}
+
+// Completes every request in flight, used when the link fails
+static void client_fail_inflight(gracht_client_t* client)
+{
+    struct client_waiter* waiter;
+    int i;
+    
+    for (i = 0; i < GRACHT_CLIENT_INFLIGHT_BUCKETS; i++) {
+        while (client->inflight[i]) {
+            struct gracht_message_context* context = client->inflight[i];
+            client->inflight[i] = context->link;
+            context->link  = NULL;
+            context->state = GRACHT_MESSAGE_ERROR;
+        }
+    }
+    
+    for (waiter = client->waiters; waiter; waiter = waiter->link) {
+        cnd_signal(&waiter->condition);
+    }
+}
+
+// Reads a single message from the link. Responses complete the request they answer,
+// while events are left in the message for the caller, in which case 1 is returned.
+static int client_read_message(gracht_client_t* client, struct gracht_recv_message* message, unsigned int flags)
+{
+    struct gracht_message_context* context;
+    gracht_message_callback_fn     callback;
+    void*                          callbackContext;
+    int                            state = GRACHT_MESSAGE_COMPLETED;
+    
+    if (client->ops->recv(client->ops, message, flags)) {
+        return -1;
+    }
+    
+    if (!(message->flags & MESSAGE_FLAG_RESPONSE)) {
+        return 1;
+    }
+    
+    mtx_lock(&client->sync_object);
+    context = client_inflight_remove(client, message->message_id);
+    mtx_unlock(&client->sync_object);
+    if (!context) {
+        WARNING("[gracht] [client] response for unknown message %u\n", message->message_id);
+        return 0;
+    }
+    
+    // The requester is still waiting for the state change, so the context and the
+    // request it points to are safe to use until then
+    if (context->message) {
+        client_unpack_response(&context->message->params[context->message->header.param_in],
+            context->message->header.param_out, message->params, message->param_in,
+            (char*)message->params + (message->param_count * sizeof(struct gracht_param)));
+    }
+    else {
+        context->response = client_copy_response(message);
+        if (!context->response) {
+            state = GRACHT_MESSAGE_ERROR;
+        }
+    }
+    
+    // Once the state is published the requester may return and release the context,
+    // so the callback is taken from it before that
+    callback        = context->callback;
+    callbackContext = context->callback_context;
+    
+    mtx_lock(&client->sync_object);
+    context->state = state;
+    client_wake_completed(client);
+    mtx_unlock(&client->sync_object);
+    
+    if (callback) {
+        callback(context, callbackContext);
+    }
+    return 0;
+}
+
+int gracht_client_invoke_async(gracht_client_t* client, struct gracht_message_context* context,
+    struct gracht_message* message)
+{
+    int status;
+    
+    if (!client || !context || !message) {
+        errno = (EINVAL);
+        return -1;
+    }
+    
+    if (!(client->ops->flags & LINK_FLAG_PIPELINED)) {
+        errno = (ENOTSUP);
+        return -1;
+    }
+    
+    mtx_lock(&client->sync_object);
+    if (++client->message_id == 0) {
+        client->message_id = 1;
+    }
+    context->message_id = client->message_id;
+    context->state      = GRACHT_MESSAGE_INPROGRESS;
+    context->response   = NULL;
+    client_inflight_add(client, context);
+    mtx_unlock(&client->sync_object);
+    
+    message->header.id = context->message_id;
+    
+    mtx_lock(&client->send_object);
+    status = client->ops->send(client->ops, message, NULL);
+    mtx_unlock(&client->send_object);
+    if (status) {
+        mtx_lock(&client->sync_object);
+        client_inflight_remove(client, context->message_id);
+        context->state = GRACHT_MESSAGE_ERROR;
+        mtx_unlock(&client->sync_object);
+    }
+    return status;
+}
+
+int gracht_client_await_multiple(gracht_client_t* client, struct gracht_message_context** contexts,
+    int count, unsigned int flags)
+{
+    size_t                     buffer[GRACHT_MAX_MESSAGE_SIZE / sizeof(size_t)];
+    struct gracht_recv_message message = { .storage = &buffer[0] };
+    struct client_waiter       waiter  = { .contexts = contexts, .count = count, .flags = flags };
+    int                        status  = 0;
+    int                        i;
+    
+    if (!client || !contexts || count <= 0) {
+        errno = (EINVAL);
+        return -1;
+    }
+    
+    cnd_init(&waiter.condition);
+    mtx_lock(&client->sync_object);
+    client_waiter_add(client, &waiter);
+    while (!client_contexts_done(contexts, count, flags)) {
+        if (client->reader_active) {
+            cnd_wait(&waiter.condition, &client->sync_object);
+            continue;
+        }
+        
+        // Take over the link until our requests are completed, responses to other
+        // requests are completed along the way. Messages are read into the stack of
+        // the reader, so an event stays valid after the link has been handed over.
+        client->reader_active = 1;
+        mtx_unlock(&client->sync_object);
+        
+        status = client_read_message(client, &message, 0);
+        
+        mtx_lock(&client->sync_object);
+        client->reader_active = 0;
+        if (status == 1) {
+            // Event handlers may invoke functions themselves, so hand over the link
+            // before dispatching the event
+            client_wake_reader(client);
+            mtx_unlock(&client->sync_object);
+            status = client_invoke_action(&client->protocols[0], &message);
+            mtx_lock(&client->sync_object);
+        }
+        
+        if (status == -1 && errno != EPROTONOSUPPORT) {
+            ERROR("[gracht] [client] failed to read from link %i\n", errno);
+            client_fail_inflight(client);
+            break;
+        }
+    }
+    
+    // Another thread may be left waiting for the link
+    client_waiter_remove(client, &waiter);
+    if (!client->reader_active) {
+        client_wake_reader(client);
+    }
+    mtx_unlock(&client->sync_object);
+    cnd_destroy(&waiter.condition);
+    
+    for (i = 0; i < count; i++) {
+        if (contexts[i]->state == GRACHT_MESSAGE_ERROR) {
+            errno = (EPIPE);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int gracht_client_await(gracht_client_t* client, struct gracht_message_context* context)
+{
+    return gracht_client_await_multiple(client, &context, 1, GRACHT_AWAIT_ALL);
+}
+
+int gracht_client_status(gracht_client_t* client, struct gracht_message_context* context,
+    struct gracht_param* params)
+{
+    struct gracht_message* response;
+    
+    if (!client || !context || !params) {
+        errno = (EINVAL);
+        return -1;
+    }
+    
+    if (context->state == GRACHT_MESSAGE_INPROGRESS) {
+        errno = (EINPROGRESS);
+        return -1;
+    }
+    
+    response = context->response;
+    if (context->state != GRACHT_MESSAGE_COMPLETED || !response) {
+        errno = (EPIPE);
+        return -1;
+    }
+    
+    client_unpack_response(params, response->header.param_in, &response->params[0], response->header.param_in,
+        (char*)&response->params[response->header.param_in]);
+    context->response = NULL;
+    free(response);
+    return 0;
+}
 
 int gracht_client_invoke(gracht_client_t* client, struct gracht_message* message, void* context)
 {
+    struct gracht_message_context messageContext = GRACHT_MESSAGE_CONTEXT_INIT(NULL, NULL);
+    int                           status;
+    
     if (!client || !message) {
         errno = (EINVAL);
         return -1;
     }
     
-    if (message->header.length > GRACHT_MAX_MESSAGE_SIZE) {
-        errno = (E2BIG);
-        return -1;
+    // The message size limit is enforced by the link, as links may move
+    // large parameters out of the message
+    if (!(client->ops->flags & LINK_FLAG_PIPELINED)) {
+        return client->ops->send(client->ops, message, context);
     }
     
-    return client->ops->send(client->ops, message, context);
+    if (!message->header.param_out || (message->header.flags & MESSAGE_FLAG_ASYNC)) {
+        message->header.id = 0;
+        mtx_lock(&client->send_object);
+        status = client->ops->send(client->ops, message, context);
+        mtx_unlock(&client->send_object);
+        return status;
+    }
+    
+    // Synchronous calls are pipelined as well so they can share the link with
+    // other requests, the response is unpacked directly into the output parameters
+    messageContext.message = message;
+    status = gracht_client_invoke_async(client, &messageContext, message);
+    if (status) {
+        return status;
+    }
+    return gracht_client_await(client, &messageContext);
 }
 
 int gracht_client_process_message(gracht_client_t* client, struct gracht_recv_message* message)
@@ -62,16 +478,47 @@ int gracht_client_process_message(gracht_client_t* client, struct gracht_recv_me
         errno = (EINVAL);
         return -1;
     }
-    return client_invoke_action(&client->protocols, message);
+    return client_invoke_action(&client->protocols[0], message);
 }
 
 int gracht_client_wait_message(gracht_client_t* client, struct gracht_recv_message* message)
 {
+    struct client_waiter waiter = { .contexts = NULL, .count = 0 };
+    int                  status;
+    
     if (!client) {
         errno = (EINVAL);
         return -1;
     }
-    return client->ops->recv(client->ops, message, 0);
+    
+    if (!(client->ops->flags & LINK_FLAG_PIPELINED)) {
+        return client->ops->recv(client->ops, message, 0);
+    }
+    
+    // Read until an event arrives, completing any responses in between
+    cnd_init(&waiter.condition);
+    mtx_lock(&client->sync_object);
+    client_waiter_add(client, &waiter);
+    while (client->reader_active) {
+        cnd_wait(&waiter.condition, &client->sync_object);
+    }
+    client_waiter_remove(client, &waiter);
+    client->reader_active = 1;
+    mtx_unlock(&client->sync_object);
+    cnd_destroy(&waiter.condition);
+    
+    do {
+        status = client_read_message(client, message, 0);
+    } while (status == 0);
+    
+    mtx_lock(&client->sync_object);
+    client->reader_active = 0;
+    if (status == -1) {
+        client_fail_inflight(client);
+    }
+    client_wake_reader(client);
+    mtx_unlock(&client->sync_object);
+    return (status == 1) ? 0 : -1;
 }
 
 int gracht_client_create(gracht_client_configuration_t* config, gracht_client_t** client_out)
@@ -100,6 +547,9 @@ int gracht_client_create(gracht_client_configuration_t* config, gracht_client_t*
         return -1;
     }
     
+    mtx_init(&client->sync_object, mtx_plain);
+    mtx_init(&client->send_object, mtx_plain);
+    
     *client_out = client;
     return 0;
 }
@@ -111,7 +561,12 @@ int gracht_client_register_protocol(gracht_client_t* client, gracht_protocol_t*
         return -1;
     }
     
-    gracht_list_append(&client->protocols, &protocol->header);
+    if (client->protocols[protocol->id]) {
+        errno = (EEXIST);
+        return -1;
+    }
+    
+    client->protocols[protocol->id] = protocol;
     return 0;
 }
 
@@ -122,7 +577,12 @@ int gracht_client_unregister_protocol(gracht_client_t* client, gracht_protocol_t
         return -1;
     }
     
-    gracht_list_remove(&client->protocols, &protocol->header);
+    if (client->protocols[protocol->id] != protocol) {
+        errno = (ENOENT);
+        return -1;
+    }
+    
+    client->protocols[protocol->id] = NULL;
     return 0;
 }
 
@@ -134,6 +594,8 @@ int gracht_client_shutdown(gracht_client_t* client)
     }
     
     client->ops->destroy(client->ops);
+    mtx_destroy(&client->send_object);
+    mtx_destroy(&client->sync_object);
     free(client);
     return 0;
 }
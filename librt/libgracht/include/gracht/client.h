@@ -34,6 +34,34 @@ typedef struct gracht_client_configuration {
 
 typedef struct gracht_client gracht_client_t;
 
+#define GRACHT_MESSAGE_CREATED    0
+#define GRACHT_MESSAGE_INPROGRESS 1
+#define GRACHT_MESSAGE_COMPLETED  2
+#define GRACHT_MESSAGE_ERROR      3
+
+#define GRACHT_AWAIT_ANY 0
+#define GRACHT_AWAIT_ALL 1
+
+struct gracht_message_context;
+
+typedef void (*gracht_message_callback_fn)(struct gracht_message_context*, void*);
+
+// Tracks an asynchronous request until its response has been read. The context
+// is owned by the caller and must stay valid until the request has completed, and
+// if a callback is set, until the callback has returned. The callback is invoked
+// from the thread that reads the response.
+struct gracht_message_context {
+    uint32_t                       message_id;
+    int                            state;
+    struct gracht_message*         message;
+    struct gracht_message*         response;
+    gracht_message_callback_fn     callback;
+    void*                          callback_context;
+    struct gracht_message_context* link;
+};
+
+#define GRACHT_MESSAGE_CONTEXT_INIT(callback, callbackContext) { 0, GRACHT_MESSAGE_CREATED, NULL, NULL, callback, callbackContext, NULL }
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,6 +77,15 @@ int gracht_client_unregister_protocol(gracht_client_t*, gracht_protocol_t*);
 int gracht_client_invoke(gracht_client_t*, struct gracht_message*, void*);
 int gracht_client_shutdown(gracht_client_t*);
 
+// Pipelined API
+// Available on links that deliver responses through recv. Any number of requests
+// can be in flight on a single client, from any number of threads, and responses
+// complete in the order the server sends them.
+int gracht_client_invoke_async(gracht_client_t*, struct gracht_message_context*, struct gracht_message*);
+int gracht_client_await(gracht_client_t*, struct gracht_message_context*);
+int gracht_client_await_multiple(gracht_client_t*, struct gracht_message_context**, int count, unsigned int flags);
+int gracht_client_status(gracht_client_t*, struct gracht_message_context*, struct gracht_param*);
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,10 @@
 #define LINK_LISTEN_DGRAM  0
 #define LINK_LISTEN_SOCKET 1
 
+// Client links that deliver responses through recv instead of completing them
+// during send. These links support multiple requests in flight.
+#define LINK_FLAG_PIPELINED 0x1
+
 enum gracht_link_type {
     gracht_link_stream_based, // connection mode
     gracht_link_packet_based  // connection less mode
@@ -74,6 +78,7 @@ struct client_link_ops {
     client_link_recv_fn    recv;
     client_link_send_fn    send;
     client_link_destroy_fn destroy;
+    unsigned int           flags;
 };
 
 #endif // !__GRACHT_LINK_H__
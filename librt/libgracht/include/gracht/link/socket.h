@@ -45,6 +45,16 @@ struct socket_server_configuration {
     socklen_t               dgram_address_length;
 };
 
+// Shared memory regions that can be passed as SHM parameters over a stream
+// based socket link. The region is handed to the peer once per connection,
+// after which parameters pointing into it are passed without any copies.
+struct gracht_shm {
+    void*  buffer;
+    size_t length;
+    int    fd;
+    int    id;
+};
+
 struct socket_client_configuration {
     enum gracht_link_type   type;
     struct sockaddr_storage address;
@@ -61,6 +71,9 @@ int gracht_link_socket_server_create(struct server_link_ops** linkOut,
 int gracht_link_socket_client_create(struct client_link_ops** linkOut, 
     struct socket_client_configuration* configuration);
 
+int gracht_link_socket_shm_create(size_t length, struct gracht_shm* shmOut);
+int gracht_link_socket_shm_destroy(struct gracht_shm* shm);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,6 +43,7 @@
 typedef void* gracht_handle_t;
 
 #define MESSAGE_FLAG_ASYNC    0x00000001
+#define MESSAGE_FLAG_RESPONSE 0x00000002
 
 #define GRACHT_MAX_MESSAGE_SIZE 512
 
@@ -59,14 +60,16 @@ struct gracht_param {
     size_t length;
 };
 
+// The id is assigned by the client when invoking a function, and is echoed back
+// by the server in the response so responses can be matched out of order.
 struct gracht_message_header {
-    uint32_t length    : 16;
+    uint32_t length;
+    uint32_t id;
     uint32_t param_in  : 4;
     uint32_t param_out : 4;
     uint32_t flags     : 8;
     uint32_t protocol  : 8;
     uint32_t action    : 8;
-    uint32_t reserved  : 16;
 };
 
 struct gracht_message {
@@ -78,11 +81,13 @@ struct gracht_recv_message {
     void*   storage;
     void*   params;
     
-    int     client;
-    uint8_t param_in;
-    uint8_t param_count;
-    uint8_t protocol;
-    uint8_t action;
+    int      client;
+    uint32_t message_id;
+    uint8_t  param_in;
+    uint8_t  param_count;
+    uint8_t  protocol;
+    uint8_t  action;
+    uint8_t  flags;
 };
 
 typedef struct gracht_object_header {
@@ -90,18 +95,30 @@ typedef struct gracht_object_header {
     struct gracht_object_header* link;
 } gracht_object_header_t;
 
+// Generated, type-specialized invokers. When present, the invoker unpacks the
+// message parameters directly into the argument structure of the action and
+// calls the action, bypassing the generic unpacking.
+typedef void (*gracht_invoke_fn)(struct gracht_recv_message*);
+
 typedef struct gracht_protocol_function {
-    uint8_t id;
-    void*   address;
+    uint8_t          id;
+    void*            address;
+    gracht_invoke_fn invoke;
 } gracht_protocol_function_t;
 
+// The function table of a protocol is dense when entry i has the action id
+// (action_base + i), which allows action lookup by direct indexing.
 typedef struct gracht_protocol {
     gracht_object_header_t      header;
     uint8_t                     id;
     uint8_t                     num_functions;
     gracht_protocol_function_t* functions;
+    uint8_t                     action_base;
 } gracht_protocol_t;
 
-#define GRACHT_PROTOCOL_INIT(id, num_functions, functions) { { id, NULL }, id, num_functions, functions }
+#define GRACHT_MAX_PROTOCOLS 256
+
+#define GRACHT_PROTOCOL_INIT(id, num_functions, functions) { { id, NULL }, id, num_functions, functions, 0 }
+#define GRACHT_PROTOCOL_INIT_INDEXED(id, action_base, num_functions, functions) { { id, NULL }, id, num_functions, functions, action_base }
 
 #endif // !__GRACHT_TYPES_H__
@@ -21,10 +21,10 @@
  *   and functionality, refer to the individual things for descriptions
  */
 
-#include <assert.h>
 #include <errno.h>
 #include "../include/gracht/link/socket.h"
 #include "../include/gracht/debug.h"
+#include "socket_shm.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -32,16 +32,17 @@ struct socket_link_manager {
     struct client_link_ops             ops;
     struct socket_client_configuration config;
     int                                iod;
+    struct socket_shm_link             shm;
 };
 
 static int socket_link_recv_response(int iod, struct gracht_message* message)
 {
-    struct iovec  iov[1 + message->header.param_out];
-    size_t        length = 0;
-    int           i;
-    intmax_t      byteCount;
-    uint8_t       recvBuffer[sizeof(struct gracht_message) + (message->header.param_out * sizeof(struct gracht_param))];
-    struct msghdr msg = {
+    struct iovec           iov[1 + message->header.param_out];
+    int                    i;
+    intmax_t               byteCount;
+    uint8_t                recvBuffer[sizeof(struct gracht_message) + (message->header.param_out * sizeof(struct gracht_param))];
+    struct gracht_message* response = (struct gracht_message*)&recvBuffer[0];
+    struct msghdr          msg = {
         .msg_name = NULL,
         .msg_namelen = 0,
         .msg_iov = &iov[0],
@@ -54,12 +55,20 @@ static int socket_link_recv_response(int iod, struct gracht_message* message)
     TRACE("link_client: receiving response\n");
     
     iov[0].iov_base = &recvBuffer[0];
-    iov[0].iov_len  = sizeof(struct gracht_message) + (message->header.param_out * sizeof(struct gracht_param));
+    iov[0].iov_len  = sizeof(recvBuffer);
 
+    // Values are carried by the parameters, so only buffers are read into the
+    // output parameters directly
     for (i = 0; i < message->header.param_out; i++) {
-        iov[1 + i].iov_base = message->params[message->header.param_in + i].data.buffer;
-        iov[1 + i].iov_len  = message->params[message->header.param_in + i].length;
-        length += message->params[message->header.param_in + i].length;
+        struct gracht_param* param = &message->params[message->header.param_in + i];
+        if (param->type == GRACHT_PARAM_VALUE) {
+            iov[1 + i].iov_base = NULL;
+            iov[1 + i].iov_len  = 0;
+        }
+        else {
+            iov[1 + i].iov_base = param->data.buffer;
+            iov[1 + i].iov_len  = param->length;
+        }
     }
 
     byteCount = recvmsg(iod, &msg, MSG_WAITALL);
@@ -67,57 +76,24 @@ static int socket_link_recv_response(int iod, struct gracht_message* message)
         errno = (EPIPE);
         return -1;
     }
+    
+    for (i = 0; i < message->header.param_out; i++) {
+        struct gracht_param* param = &message->params[message->header.param_in + i];
+        if (param->type == GRACHT_PARAM_VALUE && param->data.buffer) {
+            memcpy(param->data.buffer, &response->params[i].data.value, 
+                param->length < sizeof(size_t) ? param->length : sizeof(size_t));
+        }
+    }
     return 0;
 }
 
 static int socket_link_send_stream(struct socket_link_manager* linkManager,
     struct gracht_message* message)
 {
-    struct iovec  iov[1 + message->header.param_in];
-    int           i;
-    intmax_t      byteCount;
-    struct msghdr msg = {
-        .msg_name = NULL,
-        .msg_namelen = 0,
-        .msg_iov = &iov[0],
-        .msg_iovlen = 1 + message->header.param_in,
-        .msg_control = NULL,
-        .msg_controllen = 0,
-        .msg_flags = 0
-    };
-    
-    // Prepare the header
-    iov[0].iov_base = message;
-    iov[0].iov_len  = sizeof(struct gracht_message) + (
-        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
-    
-    // Prepare the parameters
-    for (i = 0; i < message->header.param_in; i++) {
-        iov[1 + i].iov_len   = message->params[i].length;
-        if (message->params[i].type == GRACHT_PARAM_VALUE) {
-            iov[1 + i].iov_base = (void*)&message->params[i].data.value;
-        }
-        else if (message->params[i].type == GRACHT_PARAM_BUFFER) {
-            iov[1 + i].iov_base = message->params[i].data.buffer;
-        }
-        else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
-        }
-    }
-
-    byteCount = sendmsg(linkManager->iod, &msg, MSG_WAITALL);
-    if (byteCount != message->header.length) {
-        ERROR("link_client: failed to send message, bytes sent: %u, expected: %u\n",
-              (uint32_t)byteCount, message->header.length);
-        errno = (EPIPE);
-        return -1;
-    }
-
-    if (message->header.param_out && !(message->header.flags & MESSAGE_FLAG_ASYNC)) {
-        return socket_link_recv_response(linkManager->iod, message);
-    }
-    return 0;
+    // Large buffers are moved through the connection ring, and SHM parameters
+    // are passed as region descriptors. Responses are read by the client through
+    // recv, which allows multiple requests in flight.
+    return socket_shm_send(linkManager->iod, &linkManager->shm, message, 1);
 }
 
 static int socket_link_recv_stream(struct socket_link_manager* linkManager,
@@ -126,11 +102,16 @@ static int socket_link_recv_stream(struct socket_link_manager* linkManager,
     struct gracht_message* message        = context->storage;
     char*                  params_storage = NULL;
     size_t                 bytes_read;
+    int                    fds[SOCKET_SHM_MAX_FDS];
+    int                    fdCount;
+    
+    // Regions of the previous message are no longer in use
+    socket_shm_release(&linkManager->shm);
     
     TRACE("[gracht_connection_recv_stream] reading message header");
-    bytes_read = recv(linkManager->iod, message, sizeof(struct gracht_message), flags);
+    bytes_read = socket_shm_recv_header(linkManager->iod, message, &fds[0], &fdCount, flags);
     if (bytes_read != sizeof(struct gracht_message)) {
-        if (bytes_read == 0) {
+        if (bytes_read == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
             errno = (ENODATA);
         }
         else {
@@ -139,6 +120,10 @@ static int socket_link_recv_stream(struct socket_link_manager* linkManager,
         return -1;
     }
     
+    if (socket_shm_check_header(message, &fds[0], fdCount)) {
+        return -1;
+    }
+    
     if (message->header.param_in) {
         TRACE("[gracht_connection_recv_stream] reading message payload");
         params_storage = (char*)context->storage + sizeof(struct gracht_message);
@@ -151,15 +136,22 @@ static int socket_link_recv_stream(struct socket_link_manager* linkManager,
             errno = (EPIPE);
             return -1; 
         }
+        
+        if (socket_shm_resolve(&linkManager->shm, message, params_storage,
+                message->header.length - sizeof(struct gracht_message), &fds[0], fdCount)) {
+            return -1;
+        }
     }
     
     context->client      = linkManager->iod;
+    context->message_id  = message->header.id;
     context->params      = (void*)params_storage;
     
     context->param_in    = message->header.param_in;
     context->param_count = message->header.param_in + message->header.param_out;
     context->protocol    = message->header.protocol;
     context->action      = message->header.action;
+    context->flags       = message->header.flags;
     return 0;
 }
 
@@ -191,14 +183,17 @@ static int socket_link_send_packet(struct socket_link_manager* linkManager,
     for (i = 0; i < message->header.param_in; i++) {
         iov[1 + i].iov_len = message->params[i].length;
         if (message->params[i].type == GRACHT_PARAM_VALUE) {
-            iov[1 + i].iov_base = (void*)&message->params[i].data.value;
+            // Values are carried by the parameter itself
+            iov[1 + i].iov_base = NULL;
+            iov[1 + i].iov_len  = 0;
         }
         else if (message->params[i].type == GRACHT_PARAM_BUFFER) {
             iov[1 + i].iov_base = message->params[i].data.buffer;
         }
         else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
+            // Shared memory regions are only passed on connection based links
+            errno = (ENOTSUP);
+            return -1;
         }
     }
     
@@ -255,12 +250,14 @@ static int socket_link_recv_packet(struct socket_link_manager* linkManager,
     }
     
     context->client      = linkManager->iod;
+    context->message_id  = message->header.id;
     context->params      = (void*)params_storage;
     
     context->param_in    = message->header.param_in;
     context->param_count = message->header.param_in + message->header.param_out;
     context->protocol    = message->header.protocol;
     context->action      = message->header.action;
+    context->flags       = message->header.flags;
     return 0;
 }
 
@@ -322,6 +319,7 @@ static void socket_link_destroy(struct socket_link_manager* linkManager)
         close(linkManager->iod);
     }
     
+    socket_shm_cleanup(&linkManager->shm);
     free(linkManager);
 }
 
@@ -343,6 +341,9 @@ int gracht_link_socket_client_create(struct client_link_ops** linkOut,
     linkManager->ops.recv    = (client_link_recv_fn)socket_link_recv;
     linkManager->ops.send    = (client_link_send_fn)socket_link_send;
     linkManager->ops.destroy = (client_link_destroy_fn)socket_link_destroy;
+    if (configuration->type == gracht_link_stream_based) {
+        linkManager->ops.flags = LINK_FLAG_PIPELINED;
+    }
     
     *linkOut = &linkManager->ops;
     return 0;
@@ -21,10 +21,10 @@
  *   and functionality, refer to the individual things for descriptions
  */
 
-#include <assert.h>
 #include <errno.h>
 #include "../include/gracht/link/socket.h"
 #include "../include/gracht/debug.h"
+#include "socket_shm.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -32,6 +32,7 @@ struct socket_link {
     struct link_ops         ops;
     struct sockaddr_storage address;
     int                     iod;
+    struct socket_shm_link  shm;
 };
 
 struct socket_link_manager {
@@ -45,46 +46,10 @@ struct socket_link_manager {
 static int socket_link_send(struct socket_link* linkContext,
     struct gracht_message* message, unsigned int flags)
 {
-    struct iovec  iov[1 + message->header.param_in];
-    int           i;
-    intmax_t      bytesWritten;
-    struct msghdr msg = {
-        .msg_name = NULL,
-        .msg_namelen = 0,
-        .msg_iov = &iov[0],
-        .msg_iovlen = 1 + message->header.param_in,
-        .msg_control = NULL,
-        .msg_controllen = 0,
-        .msg_flags = 0
-    };
-    
-    // Prepare the header
-    iov[0].iov_base = message;
-    iov[0].iov_len  = sizeof(struct gracht_message) + (
-        (message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
-    
-    // Prepare the parameters
-    for (i = 0; i < message->header.param_in; i++) {
-        iov[1 + i].iov_len    = message->params[i].length;
-        if (message->params[i].type == GRACHT_PARAM_VALUE) {
-            iov[1 + i].iov_base = (void*)&message->params[i].data.value;
-        }
-        else if (message->params[i].type == GRACHT_PARAM_BUFFER) {
-            iov[1 + i].iov_base = message->params[i].data.buffer;
-        }
-        else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
-        }
-    }
-
+    // Responses are read directly into the callers buffers, so only explicit
+    // SHM parameters are passed through shared memory from the server side
     TRACE("[socket_link_send] sending message\n");
-    bytesWritten = sendmsg(linkContext->iod, &msg, MSG_WAITALL);
-    if (bytesWritten != message->header.length) {
-        return -1;
-    }
-
-    return 0;
+    return socket_shm_send(linkContext->iod, &linkContext->shm, message, 0);
 }
 
 static int socket_link_recv(struct socket_link* linkContext,
@@ -93,16 +58,26 @@ static int socket_link_recv(struct socket_link* linkContext,
     struct gracht_message* message        = context->storage;
     char*                  params_storage = NULL;
     size_t                 bytes_read;
+    int                    fds[SOCKET_SHM_MAX_FDS];
+    int                    fdCount;
+    
+    // The previous message has been handled, release the ring space and any
+    // one-shot regions it used
+    socket_shm_release(&linkContext->shm);
     
     TRACE("[gracht_connection_recv_stream] reading message header\n");
-    bytes_read = recv(linkContext->iod, message, sizeof(struct gracht_message), flags);
+    bytes_read = socket_shm_recv_header(linkContext->iod, message, &fds[0], &fdCount, flags);
     if (bytes_read != sizeof(struct gracht_message)) {
-        if (bytes_read == 0) {
+        if (bytes_read == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
             errno = (ENODATA);
         }
         return -1;
     }
     
+    if (socket_shm_check_header(message, &fds[0], fdCount)) {
+        return -1;
+    }
+    
     if (message->header.param_in) {
         intmax_t bytesToRead = message->header.length - sizeof(struct gracht_message);
 
@@ -117,15 +92,22 @@ static int socket_link_recv(struct socket_link* linkContext,
             errno = (EPIPE);
             return -1;
         }
+        
+        if (socket_shm_resolve(&linkContext->shm, message, params_storage,
+                message->header.length - sizeof(struct gracht_message), &fds[0], fdCount)) {
+            return -1;
+        }
     }
     
     context->client      = linkContext->iod;
+    context->message_id  = message->header.id;
     context->params      = (void*)params_storage;
     
     context->param_in    = message->header.param_in;
     context->param_count = message->header.param_in + message->header.param_out;
     context->protocol    = message->header.protocol;
     context->action      = message->header.action;
+    context->flags       = message->header.flags;
     return 0;
 }
 
@@ -139,6 +121,7 @@ static int socket_link_close(struct socket_link* linkContext)
     }
     
     status = close(linkContext->iod);
+    socket_shm_cleanup(&linkContext->shm);
     free(linkContext);
     return status;
 }
@@ -213,6 +196,7 @@ static int socket_link_accept(struct socket_link_manager* linkManager, struct li
         return -1;
     }
     
+    memset(&link->shm, 0, sizeof(struct socket_shm_link));
     link->ops.send  = (link_send_fn)socket_link_send;
     link->ops.recv  = (link_recv_fn)socket_link_recv;
     link->ops.close = (link_close_fn)socket_link_close;
@@ -264,12 +248,14 @@ static int socket_link_recv_packet(struct socket_link_manager* linkManager,
     }
     
     context->client      = linkManager->dgram_socket;
+    context->message_id  = message->header.id;
     context->params      = (void*)params_storage;
     
     context->param_in    = message->header.param_in;
     context->param_count = message->header.param_in + message->header.param_out;
     context->protocol    = message->header.protocol;
     context->action      = message->header.action;
+    context->flags       = message->header.flags;
     return 0;
 }
 
@@ -298,14 +284,17 @@ static int socket_link_respond(struct socket_link_manager* linkManager,
     for (i = 0; i < message->header.param_in; i++) {
         iov[1 + i].iov_len    = message->params[i].length;
         if (message->params[i].type == GRACHT_PARAM_VALUE) {
-            iov[1 + i].iov_base = (void*)&message->params[i].data.value;
+            // Values are carried by the parameter itself
+            iov[1 + i].iov_base = NULL;
+            iov[1 + i].iov_len  = 0;
         }
         else if (message->params[i].type == GRACHT_PARAM_BUFFER) {
             iov[1 + i].iov_base = message->params[i].data.buffer;
         }
         else if (message->params[i].type == GRACHT_PARAM_SHM) {
-            // NO SUPPORT
-            assert(0);
+            // Shared memory regions are only passed on connection based links
+            errno = (ENOTSUP);
+            return -1;
         }
     }
     
@@ -0,0 +1,799 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Socket Link Shared Memory Transport
+ * - Shared memory parameters and the per-connection bulk ring for the socket
+ *   links. On linux regions are memfd backed and passed with SCM_RIGHTS, on
+ *   Vali the ipc context link maps SHM parameters in the kernel instead, so
+ *   the socket link falls back to inline copies there.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include "socket_shm.h"
+#include "../include/gracht/debug.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct socket_shm_ring {
+    _Atomic(uint32_t) head;
+    _Atomic(uint32_t) tail;
+    uint32_t          size;
+    uint32_t          reserved;
+};
+
+struct socket_shm_sent {
+    uint32_t                region;
+    struct socket_shm_sent* link;
+};
+
+// The layout of a peer ring is derived from the length of the mapping, the values
+// in the shared ring header can be changed by the peer at any time.
+struct socket_shm_mapping {
+    uint32_t                   region;
+    void*                      buffer;
+    size_t                     length;
+    int                        oneshot;
+    struct socket_shm_mapping* link;
+};
+
+struct socket_shm_region {
+    struct gracht_shm         shm;
+    struct socket_shm_region* link;
+};
+
+static _Atomic(int) g_regionId = ATOMIC_VAR_INIT(1);
+
+#if defined(__linux__)
+#define SOCKET_SHM_CONTROL_SIZE CMSG_SPACE(sizeof(int) * SOCKET_SHM_MAX_FDS)
+
+static void socket_shm_attach_fds(struct msghdr* msg, char* control, int* fds, int fdCount)
+{
+    struct cmsghdr* cmsg;
+
+    memset(control, 0, SOCKET_SHM_CONTROL_SIZE);
+    msg->msg_control    = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+    cmsg             = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * fdCount);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+}
+
+static int socket_shm_extract_fds(struct msghdr* msg, int* fds)
+{
+    struct cmsghdr* cmsg;
+    int             fdCount = 0;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(&fds[fdCount], CMSG_DATA(cmsg), sizeof(int) * count);
+            fdCount += count;
+        }
+    }
+    return fdCount;
+}
+
+static struct socket_shm_region* g_regions = NULL;
+static pthread_mutex_t           g_regionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int socket_shm_region_create(size_t length, struct gracht_shm* shm)
+{
+    shm->fd = memfd_create("gracht_shm", MFD_CLOEXEC);
+    if (shm->fd < 0) {
+        return -1;
+    }
+
+    if (ftruncate(shm->fd, (off_t)length)) {
+        close(shm->fd);
+        return -1;
+    }
+
+    shm->buffer = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (shm->buffer == MAP_FAILED) {
+        close(shm->fd);
+        return -1;
+    }
+
+    shm->length = length;
+    shm->id     = atomic_fetch_add(&g_regionId, 1);
+    return 0;
+}
+
+static void socket_shm_region_destroy(struct gracht_shm* shm)
+{
+    munmap(shm->buffer, shm->length);
+    close(shm->fd);
+    shm->buffer = NULL;
+}
+
+static void* socket_shm_region_map(int fd, size_t* lengthOut)
+{
+    struct stat stats;
+    void*       buffer;
+
+    if (fstat(fd, &stats)) {
+        return NULL;
+    }
+
+    buffer = mmap(NULL, (size_t)stats.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buffer == MAP_FAILED) {
+        return NULL;
+    }
+
+    *lengthOut = (size_t)stats.st_size;
+    return buffer;
+}
+
+static void socket_shm_region_unmap(void* buffer, size_t length)
+{
+    munmap(buffer, length);
+}
+
+static struct socket_shm_region* socket_shm_region_lookup(void* buffer, size_t length)
+{
+    struct socket_shm_region* region;
+
+    pthread_mutex_lock(&g_regionsLock);
+    region = g_regions;
+    while (region) {
+        if ((char*)buffer >= (char*)region->shm.buffer &&
+            ((char*)buffer + length) <= ((char*)region->shm.buffer + region->shm.length)) {
+            break;
+        }
+        region = region->link;
+    }
+    pthread_mutex_unlock(&g_regionsLock);
+    return region;
+}
+
+int gracht_link_socket_shm_create(size_t length, struct gracht_shm* shmOut)
+{
+    struct socket_shm_region* region;
+
+    if (!length || !shmOut) {
+        errno = (EINVAL);
+        return -1;
+    }
+
+    region = (struct socket_shm_region*)malloc(sizeof(struct socket_shm_region));
+    if (!region) {
+        errno = (ENOMEM);
+        return -1;
+    }
+
+    if (socket_shm_region_create(length, &region->shm)) {
+        ERROR("[socket_shm] failed to create shared memory region\n");
+        free(region);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_regionsLock);
+    region->link = g_regions;
+    g_regions    = region;
+    pthread_mutex_unlock(&g_regionsLock);
+
+    memcpy(shmOut, &region->shm, sizeof(struct gracht_shm));
+    return 0;
+}
+
+int gracht_link_socket_shm_destroy(struct gracht_shm* shm)
+{
+    struct socket_shm_region* region;
+    struct socket_shm_region* previous = NULL;
+
+    if (!shm) {
+        errno = (EINVAL);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_regionsLock);
+    region = g_regions;
+    while (region && region->shm.id != shm->id) {
+        previous = region;
+        region   = region->link;
+    }
+
+    if (region) {
+        if (previous) {
+            previous->link = region->link;
+        }
+        else {
+            g_regions = region->link;
+        }
+    }
+    pthread_mutex_unlock(&g_regionsLock);
+
+    if (!region) {
+        errno = (ENOENT);
+        return -1;
+    }
+
+    socket_shm_region_destroy(&region->shm);
+    free(region);
+    return 0;
+}
+
+#else
+#define SOCKET_SHM_CONTROL_SIZE sizeof(struct cmsghdr)
+
+static void socket_shm_attach_fds(struct msghdr* msg, char* control, int* fds, int fdCount) { }
+
+static int socket_shm_extract_fds(struct msghdr* msg, int* fds)
+{
+    return 0;
+}
+
+static int socket_shm_region_create(size_t length, struct gracht_shm* shm)
+{
+    errno = (ENOTSUP);
+    return -1;
+}
+
+static void socket_shm_region_destroy(struct gracht_shm* shm) { }
+
+static void* socket_shm_region_map(int fd, size_t* lengthOut)
+{
+    errno = (ENOTSUP);
+    return NULL;
+}
+
+static void socket_shm_region_unmap(void* buffer, size_t length) { }
+
+static struct socket_shm_region* socket_shm_region_lookup(void* buffer, size_t length)
+{
+    return NULL;
+}
+
+int gracht_link_socket_shm_create(size_t length, struct gracht_shm* shmOut)
+{
+    errno = (ENOTSUP);
+    return -1;
+}
+
+int gracht_link_socket_shm_destroy(struct gracht_shm* shm)
+{
+    errno = (ENOTSUP);
+    return -1;
+}
+#endif
+
+static int socket_shm_is_sent(struct socket_shm_link* shm, uint32_t region)
+{
+    struct socket_shm_sent* sent = shm->sent;
+    while (sent) {
+        if (sent->region == region) {
+            return 1;
+        }
+        sent = sent->link;
+    }
+    return 0;
+}
+
+static int socket_shm_is_announced(uint32_t* announced, int announceCount, uint32_t region)
+{
+    int i;
+    for (i = 0; i < announceCount; i++) {
+        if (announced[i] == region) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void socket_shm_mark_sent(struct socket_shm_link* shm, uint32_t region)
+{
+    struct socket_shm_sent* sent = (struct socket_shm_sent*)malloc(sizeof(struct socket_shm_sent));
+    if (!sent) {
+        // the region will simply be attached again on the next message
+        return;
+    }
+
+    sent->region = region;
+    sent->link   = shm->sent;
+    shm->sent    = sent;
+}
+
+// The ring is a single-producer single-consumer byte ring. Positions are free
+// running 32 bit counters, chunks never wrap around the end of the ring, and
+// the consumer releases a chunk by advancing tail past it. The size is fixed, the
+// size in the ring header is informational only as the peer can write it.
+// Chunks are allocated from the head given, and only become part of the ring once
+// the message referencing them was sent and the head is committed.
+static void* socket_shm_ring_allocate(struct socket_shm_link* shm, uint32_t* ringHead,
+    size_t length, uint32_t* positionOut)
+{
+    struct socket_shm_ring* ring;
+    uint32_t                head;
+    uint32_t                tail;
+    uint32_t                offset;
+    uint32_t                padding = 0;
+
+    if (!shm->ring.buffer) {
+        if (socket_shm_region_create(sizeof(struct socket_shm_ring) + SOCKET_SHM_RING_SIZE, &shm->ring)) {
+            shm->ring.buffer = NULL;
+            return NULL;
+        }
+
+        ring = (struct socket_shm_ring*)shm->ring.buffer;
+        atomic_store(&ring->head, 0);
+        atomic_store(&ring->tail, 0);
+        ring->size = SOCKET_SHM_RING_SIZE;
+        shm->ring_head = 0;
+        *ringHead      = 0;
+    }
+
+    ring = (struct socket_shm_ring*)shm->ring.buffer;
+    if (length > SOCKET_SHM_RING_SIZE) {
+        return NULL;
+    }
+
+    // The head is only written by us, the tail is checked against it as the peer
+    // may write anything there
+    head   = *ringHead;
+    tail   = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    offset = head % SOCKET_SHM_RING_SIZE;
+    if (offset + length > SOCKET_SHM_RING_SIZE) {
+        padding = SOCKET_SHM_RING_SIZE - offset;
+    }
+
+    if ((head - tail) > SOCKET_SHM_RING_SIZE ||
+        (head - tail) + padding + length > SOCKET_SHM_RING_SIZE) {
+        return NULL;
+    }
+
+    *positionOut = head + padding;
+    *ringHead    = head + padding + (uint32_t)length;
+    return (char*)(ring + 1) + ((head + padding) % SOCKET_SHM_RING_SIZE);
+}
+
+static void socket_shm_ring_commit(struct socket_shm_link* shm, uint32_t ringHead)
+{
+    struct socket_shm_ring* ring = (struct socket_shm_ring*)shm->ring.buffer;
+    if (!ring || ringHead == shm->ring_head) {
+        return;
+    }
+
+    shm->ring_head = ringHead;
+    atomic_store_explicit(&ring->head, ringHead, memory_order_relaxed);
+}
+
+int socket_shm_send(int iod, struct socket_shm_link* shm, struct gracht_message* message, int useRing)
+{
+    int                    paramCount = message->header.param_in + message->header.param_out;
+    size_t                 headerLength = sizeof(struct gracht_message) + (paramCount * sizeof(struct gracht_param));
+    uint8_t                headerBuffer[headerLength];
+    struct gracht_message* header = (struct gracht_message*)&headerBuffer[0];
+    struct iovec           iov[2 + message->header.param_in];
+    struct socket_shm_desc descriptors[message->header.param_in];
+    struct gracht_shm      oneshots[message->header.param_in];
+    uint32_t               announced[message->header.param_in];
+    int                    fds[SOCKET_SHM_MAX_FDS];
+    int                    descriptorCount = 0;
+    int                    oneshotCount    = 0;
+    int                    announceCount   = 0;
+    int                    fdCount         = 0;
+    size_t                 length          = headerLength;
+    uint32_t               ringHead        = shm->ring_head;
+    intmax_t               byteCount;
+    int                    status = 0;
+    int                    i;
+    union {
+        char           buffer[SOCKET_SHM_CONTROL_SIZE];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = &iov[0],
+        .msg_iovlen = 1 + message->header.param_in,
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = 0
+    };
+
+    // Work on a copy of the header, parameters that are moved into shared memory
+    // are rewritten to SHM parameters for the peer
+    memcpy(header, message, headerLength);
+    iov[0].iov_base = header;
+    iov[0].iov_len  = headerLength;
+
+    for (i = 0; i < message->header.param_in; i++) {
+        struct gracht_param*   param      = &message->params[i];
+        struct socket_shm_desc descriptor = { 0 };
+        void*                  chunk;
+        uint32_t               position;
+        int                    attachRing;
+
+        iov[1 + i].iov_len = param->length;
+        if (param->type == GRACHT_PARAM_VALUE) {
+            // Values are carried by the parameter itself
+            iov[1 + i].iov_base = NULL;
+            iov[1 + i].iov_len  = 0;
+            continue;
+        }
+        else if (param->type == GRACHT_PARAM_BUFFER) {
+            iov[1 + i].iov_base = param->data.buffer;
+            if (!useRing || param->length <= SOCKET_SHM_BUFFER_THRESHOLD) {
+                length += param->length;
+                continue;
+            }
+
+            // The ring is attached once per message until the peer has it, if no
+            // more descriptors fit in this message the buffer is sent inline
+            attachRing = !shm->ring.buffer || (!socket_shm_is_sent(shm, (uint32_t)shm->ring.id) &&
+                !socket_shm_is_announced(&announced[0], announceCount, (uint32_t)shm->ring.id));
+            if (attachRing && fdCount == SOCKET_SHM_MAX_FDS) {
+                length += param->length;
+                continue;
+            }
+
+            chunk = socket_shm_ring_allocate(shm, &ringHead, param->length, &position);
+            if (chunk) {
+                memcpy(chunk, param->data.buffer, param->length);
+                descriptor.region = (uint32_t)shm->ring.id;
+                descriptor.flags  = SOCKET_SHM_DESC_RING;
+                descriptor.offset = position;
+                if (attachRing) {
+                    descriptor.flags |= SOCKET_SHM_DESC_ATTACH;
+                    fds[fdCount++] = shm->ring.fd;
+                    announced[announceCount++] = descriptor.region;
+                }
+            }
+            else {
+                // The ring is either full or too small for this buffer, move the
+                // buffer through a region of its own. If shared memory is not
+                // available the buffer is simply sent inline.
+                if (fdCount == SOCKET_SHM_MAX_FDS ||
+                    socket_shm_region_create(param->length, &oneshots[oneshotCount])) {
+                    length += param->length;
+                    continue;
+                }
+
+                memcpy(oneshots[oneshotCount].buffer, param->data.buffer, param->length);
+                descriptor.region = (uint32_t)oneshots[oneshotCount].id;
+                descriptor.flags  = SOCKET_SHM_DESC_ATTACH | SOCKET_SHM_DESC_ONESHOT;
+                fds[fdCount++] = oneshots[oneshotCount++].fd;
+            }
+        }
+        else if (param->type == GRACHT_PARAM_SHM) {
+            struct socket_shm_region* region = socket_shm_region_lookup(param->data.buffer, param->length);
+            if (!region) {
+                ERROR("[socket_shm_send] SHM parameter %i is not a shared memory region\n", i);
+                status = -1;
+                errno  = (ENOTSUP);
+                goto cleanup;
+            }
+
+            descriptor.region = (uint32_t)region->shm.id;
+            descriptor.offset = (uint64_t)((char*)param->data.buffer - (char*)region->shm.buffer);
+            if (!socket_shm_is_sent(shm, descriptor.region) &&
+                !socket_shm_is_announced(&announced[0], announceCount, descriptor.region)) {
+                if (fdCount == SOCKET_SHM_MAX_FDS) {
+                    status = -1;
+                    errno  = (E2BIG);
+                    goto cleanup;
+                }
+                descriptor.flags = SOCKET_SHM_DESC_ATTACH;
+                fds[fdCount++] = region->shm.fd;
+                announced[announceCount++] = descriptor.region;
+            }
+        }
+
+        // The parameter now travels as a descriptor instead of inline data
+        header->params[i].type = GRACHT_PARAM_SHM;
+        iov[1 + i].iov_len     = 0;
+        length += sizeof(struct socket_shm_desc);
+        memcpy(&descriptors[descriptorCount++], &descriptor, sizeof(struct socket_shm_desc));
+    }
+
+    if (descriptorCount) {
+        iov[1 + message->header.param_in].iov_base = &descriptors[0];
+        iov[1 + message->header.param_in].iov_len  = descriptorCount * sizeof(struct socket_shm_desc);
+        msg.msg_iovlen++;
+    }
+    header->header.length = (uint32_t)length;
+
+    if (length > GRACHT_MAX_MESSAGE_SIZE) {
+        status = -1;
+        errno  = (E2BIG);
+        goto cleanup;
+    }
+
+    if (fdCount) {
+        socket_shm_attach_fds(&msg, control.buffer, &fds[0], fdCount);
+    }
+
+    byteCount = sendmsg(iod, &msg, MSG_WAITALL);
+    if (byteCount != length) {
+        ERROR("[socket_shm_send] failed to send message, bytes sent: %u, expected: %u\n",
+              (uint32_t)byteCount, (uint32_t)length);
+        errno  = (EPIPE);
+        status = -1;
+        goto cleanup;
+    }
+
+    // Chunks of a message that was not sent are never released by the peer, so the
+    // ring only moves forward once the message is out
+    socket_shm_ring_commit(shm, ringHead);
+    for (i = 0; i < announceCount; i++) {
+        socket_shm_mark_sent(shm, announced[i]);
+    }
+
+cleanup:
+    // The peer holds its own reference to the one-shot regions now
+    for (i = 0; i < oneshotCount; i++) {
+        socket_shm_region_destroy(&oneshots[i]);
+    }
+    return status;
+}
+
+int socket_shm_recv_header(int iod, struct gracht_message* message, int* fds, int* fdCount, unsigned int flags)
+{
+    intmax_t     bytesRead;
+    struct iovec iov[1] = {
+        { .iov_base = message, .iov_len = sizeof(struct gracht_message) }
+    };
+    union {
+        char           buffer[SOCKET_SHM_CONTROL_SIZE];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_name       = NULL,
+        .msg_namelen    = 0,
+        .msg_iov        = &iov[0],
+        .msg_iovlen     = 1,
+        .msg_control    = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+        .msg_flags      = 0
+    };
+
+    *fdCount  = 0;
+    bytesRead = recvmsg(iod, &msg, flags);
+    if (bytesRead <= 0) {
+        return (int)bytesRead;
+    }
+
+    *fdCount = socket_shm_extract_fds(&msg, fds);
+
+    // Read the rest of the header in case it was split
+    if (bytesRead < sizeof(struct gracht_message)) {
+        intmax_t remaining = recv(iod, (char*)message + bytesRead,
+            sizeof(struct gracht_message) - bytesRead, MSG_WAITALL);
+        if (remaining <= 0) {
+            return (int)remaining;
+        }
+        bytesRead += remaining;
+    }
+    return (int)bytesRead;
+}
+
+int socket_shm_check_header(struct gracht_message* message, int* fds, int fdCount)
+{
+    size_t minimumLength = sizeof(struct gracht_message) +
+        ((message->header.param_in + message->header.param_out) * sizeof(struct gracht_param));
+    int    i;
+
+    if (message->header.length >= minimumLength && message->header.length <= GRACHT_MAX_MESSAGE_SIZE) {
+        return 0;
+    }
+
+    ERROR("[socket_shm_check_header] invalid message length (%u)\n", message->header.length);
+    for (i = 0; i < fdCount; i++) {
+        close(fds[i]);
+    }
+    errno = (EPROTO);
+    return -1;
+}
+
+static struct socket_shm_mapping* socket_shm_mapping_lookup(struct socket_shm_link* shm, uint32_t region)
+{
+    struct socket_shm_mapping* mapping = shm->mappings;
+    while (mapping) {
+        if (mapping->region == region) {
+            return mapping;
+        }
+        mapping = mapping->link;
+    }
+    return NULL;
+}
+
+int socket_shm_resolve(struct socket_shm_link* shm, struct gracht_message* message,
+    char* payload, size_t payloadLength, int* fds, int fdCount)
+{
+    struct socket_shm_desc* descriptors;
+    int                     descriptorCount = 0;
+    int                     fdIndex = 0;
+    int                     status = 0;
+    int                     i;
+
+    for (i = 0; i < message->header.param_in; i++) {
+        if (message->params[i].type == GRACHT_PARAM_SHM) {
+            descriptorCount++;
+        }
+    }
+
+    if (!descriptorCount) {
+        goto close_fds;
+    }
+
+    // The descriptors are appended after the inline payload
+    if (payloadLength < ((message->header.param_in + message->header.param_out) * sizeof(struct gracht_param)) +
+            (descriptorCount * sizeof(struct socket_shm_desc))) {
+        errno  = (EPROTO);
+        status = -1;
+        goto close_fds;
+    }
+    descriptors = (struct socket_shm_desc*)(payload + payloadLength -
+        (descriptorCount * sizeof(struct socket_shm_desc)));
+
+    for (i = 0; i < message->header.param_in; i++) {
+        struct gracht_param*       param = &message->params[i];
+        struct socket_shm_desc     descriptor;
+        struct socket_shm_mapping* mapping;
+
+        if (param->type != GRACHT_PARAM_SHM) {
+            continue;
+        }
+
+        memcpy(&descriptor, descriptors++, sizeof(struct socket_shm_desc));
+        if (descriptor.flags & SOCKET_SHM_DESC_ATTACH) {
+            if (fdIndex == fdCount) {
+                errno  = (EPROTO);
+                status = -1;
+                break;
+            }
+
+            mapping = (struct socket_shm_mapping*)malloc(sizeof(struct socket_shm_mapping));
+            if (!mapping) {
+                errno  = (ENOMEM);
+                status = -1;
+                break;
+            }
+
+            mapping->region  = descriptor.region;
+            mapping->oneshot = (descriptor.flags & SOCKET_SHM_DESC_ONESHOT) != 0;
+            mapping->buffer  = socket_shm_region_map(fds[fdIndex++], &mapping->length);
+            if (!mapping->buffer) {
+                free(mapping);
+                status = -1;
+                break;
+            }
+
+            mapping->link = shm->mappings;
+            shm->mappings = mapping;
+        }
+        else {
+            mapping = socket_shm_mapping_lookup(shm, descriptor.region);
+            if (!mapping) {
+                ERROR("[socket_shm_resolve] unknown region %u\n", descriptor.region);
+                errno  = (EPROTO);
+                status = -1;
+                break;
+            }
+        }
+
+        if (descriptor.flags & SOCKET_SHM_DESC_RING) {
+            struct socket_shm_ring* ring = (struct socket_shm_ring*)mapping->buffer;
+            size_t                  size;
+            size_t                  offset;
+
+            if (mapping->length <= sizeof(struct socket_shm_ring)) {
+                errno  = (EPROTO);
+                status = -1;
+                break;
+            }
+
+            size   = mapping->length - sizeof(struct socket_shm_ring);
+            offset = (size_t)((uint32_t)descriptor.offset % size);
+            if (param->length > size - offset) {
+                errno  = (EPROTO);
+                status = -1;
+                break;
+            }
+
+            param->data.buffer      = (char*)(ring + 1) + offset;
+            shm->peer_ring          = ring;
+            shm->peer_ring_release  = (uint32_t)descriptor.offset + (uint32_t)param->length;
+            shm->peer_ring_pending  = 1;
+        }
+        else {
+            if (descriptor.offset > mapping->length ||
+                param->length > mapping->length - descriptor.offset) {
+                errno  = (EPROTO);
+                status = -1;
+                break;
+            }
+            param->data.buffer = (char*)mapping->buffer + descriptor.offset;
+        }
+    }
+
+close_fds:
+    // The mappings keep the regions alive, the descriptors are no longer needed
+    for (i = 0; i < fdCount; i++) {
+        close(fds[i]);
+    }
+    return status;
+}
+
+void socket_shm_release(struct socket_shm_link* shm)
+{
+    struct socket_shm_mapping* mapping;
+    struct socket_shm_mapping* previous = NULL;
+
+    if (shm->peer_ring_pending) {
+        atomic_store_explicit(&shm->peer_ring->tail, shm->peer_ring_release, memory_order_release);
+        shm->peer_ring_pending = 0;
+    }
+
+    mapping = shm->mappings;
+    while (mapping) {
+        struct socket_shm_mapping* next = mapping->link;
+        if (mapping->oneshot) {
+            if (previous) {
+                previous->link = next;
+            }
+            else {
+                shm->mappings = next;
+            }
+            socket_shm_region_unmap(mapping->buffer, mapping->length);
+            free(mapping);
+        }
+        else {
+            previous = mapping;
+        }
+        mapping = next;
+    }
+}
+
+void socket_shm_cleanup(struct socket_shm_link* shm)
+{
+    struct socket_shm_sent*    sent = shm->sent;
+    struct socket_shm_mapping* mapping = shm->mappings;
+
+    while (sent) {
+        struct socket_shm_sent* next = sent->link;
+        free(sent);
+        sent = next;
+    }
+
+    while (mapping) {
+        struct socket_shm_mapping* next = mapping->link;
+        socket_shm_region_unmap(mapping->buffer, mapping->length);
+        free(mapping);
+        mapping = next;
+    }
+
+    if (shm->ring.buffer) {
+        socket_shm_region_destroy(&shm->ring);
+    }
+    memset(shm, 0, sizeof(struct socket_shm_link));
+}
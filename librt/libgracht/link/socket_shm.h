@@ -0,0 +1,70 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Socket Link Shared Memory Transport
+ * - Shared memory parameters and the per-connection bulk ring for the socket
+ *   links. SHM parameters are sent as descriptors appended after the inline
+ *   payload, and the region itself is passed once per connection.
+ */
+
+#ifndef __GRACHT_LINK_SOCKET_SHM_H__
+#define __GRACHT_LINK_SOCKET_SHM_H__
+
+#include "../include/gracht/link/socket.h"
+
+// Buffer parameters larger than this are moved through the connection ring
+// instead of being copied inline through the socket.
+#define SOCKET_SHM_BUFFER_THRESHOLD 256
+#define SOCKET_SHM_RING_SIZE        (1024 * 1024)
+#define SOCKET_SHM_MAX_FDS          8
+
+#define SOCKET_SHM_DESC_ATTACH  0x1 // region fd is attached to this message
+#define SOCKET_SHM_DESC_RING    0x2 // data lives in the senders bulk ring
+#define SOCKET_SHM_DESC_ONESHOT 0x4 // region is released after this message
+
+struct socket_shm_desc {
+    uint32_t region;
+    uint32_t flags;
+    uint64_t offset;
+};
+
+struct socket_shm_sent;
+struct socket_shm_mapping;
+struct socket_shm_ring;
+
+struct socket_shm_link {
+    // sender side, regions already announced to the peer and our bulk ring
+    struct socket_shm_sent*    sent;
+    struct gracht_shm          ring;
+    uint32_t                   ring_head;
+
+    // receiver side, regions mapped from the peer and pending releases
+    struct socket_shm_mapping* mappings;
+    struct socket_shm_ring*    peer_ring;
+    uint32_t                   peer_ring_release;
+    int                        peer_ring_pending;
+};
+
+int  socket_shm_send(int iod, struct socket_shm_link*, struct gracht_message*, int useRing);
+int  socket_shm_recv_header(int iod, struct gracht_message*, int* fds, int* fdCount, unsigned int flags);
+int  socket_shm_check_header(struct gracht_message*, int* fds, int fdCount);
+int  socket_shm_resolve(struct socket_shm_link*, struct gracht_message*, char* payload, size_t payloadLength, int* fds, int fdCount);
+void socket_shm_release(struct socket_shm_link*);
+void socket_shm_cleanup(struct socket_shm_link*);
+
+#endif // !__GRACHT_LINK_SOCKET_SHM_H__
@@ -36,6 +36,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Input buffers of this size or larger are granted to the receiver instead of being
+// copied through its message stream. The pages are mapped read-only into the receiver
+// and revoked again when it responds. Only pages entirely covered by the buffer are
+// shared, the partial first and last page of an unaligned buffer are copied. Mapping
+// and unmapping a grant with its two bounced pages costs at least 7us, two copies
+// through the stream only catch up with that around 256KiB. Smaller buffers are only
+// granted when the message would not fit the stream otherwise.
+#define VALI_LINK_GRANT_THRESHOLD (64 * 4096)
+
+// param_in and param_out are both 4 bits
+#define VALI_LINK_MAX_PARAMS 32
+
 struct vali_link_manager {
     struct client_link_ops ops;
     struct dma_attachment  dma;
@@ -77,6 +89,46 @@ static void vali_link_unpack_response(void* buffer, struct gracht_message* messa
     }
 }
 
+static void vali_link_grant_buffer(struct gracht_message* message, int index)
+{
+    struct gracht_param* param = &message->params[index];
+    
+    if (param->type == GRACHT_PARAM_BUFFER) {
+        param->type            = GRACHT_PARAM_SHM;
+        message->header.length -= param->length;
+    }
+}
+
+// Grants are made on a copy of the message, so the callers message keeps its buffer
+// parameters and can be sent again as is. The copy is returned when it differs.
+static struct gracht_message* vali_link_grant_buffers(struct gracht_message* message,
+    struct gracht_message* copy)
+{
+    int paramCount = message->header.param_in + message->header.param_out;
+    int grant      = !(message->header.flags & MESSAGE_FLAG_ASYNC);
+    int i;
+    
+    if (paramCount > VALI_LINK_MAX_PARAMS) {
+        return message;
+    }
+    
+    // Grants are revoked by the response, so messages without one are always copied.
+    // Granted data does not travel through the message stream.
+    memcpy(copy, message, sizeof(struct gracht_message) + (paramCount * sizeof(struct gracht_param)));
+    for (i = 0; i < copy->header.param_in; i++) {
+        if (copy->params[i].type == GRACHT_PARAM_SHM) {
+            copy->header.length -= copy->params[i].length;
+        }
+        else if (grant && copy->params[i].length >= VALI_LINK_GRANT_THRESHOLD) {
+            vali_link_grant_buffer(copy, i);
+        }
+    }
+    for (i = 0; grant && i < copy->header.param_in && copy->header.length > GRACHT_MAX_MESSAGE_SIZE; i++) {
+        vali_link_grant_buffer(copy, i);
+    }
+    return copy->header.length != message->header.length ? copy : message;
+}
+
 static int vali_link_message_finish(struct vali_link_manager* linkManager,
     struct vali_link_message* messageContext)
 {
@@ -89,14 +141,25 @@ static int vali_link_message_finish(struct vali_link_manager* linkManager,
 static int vali_link_send_packet(struct vali_link_manager* linkManager,
     struct gracht_message* messageBase, struct vali_link_message* messageContext)
 {
-    struct ipmsg_desc  message;
-    struct ipmsg_desc* messagePointer = &message;
-    OsStatus_t         status;
-    int                i;
+    struct ipmsg_desc      message;
+    struct ipmsg_desc*     messagePointer = &message;
+    struct gracht_message* messageSent;
+    OsStatus_t             status;
+    int                    i;
+    union {
+        struct gracht_message message;
+        uint8_t               storage[sizeof(struct gracht_message) + (VALI_LINK_MAX_PARAMS * sizeof(struct gracht_param))];
+    } granted;
+    
+    messageSent = vali_link_grant_buffers(messageBase, &granted.message);
+    if (messageSent->header.length > GRACHT_MAX_MESSAGE_SIZE) {
+        errno = (E2BIG);
+        return -1;
+    }
     
     message.address  = &messageContext->address;
     message.response = &messageContext->response;
-    message.base     = messageBase;
+    message.base     = messageSent;
     
     // Setup the response
     if (messageBase->header.param_out) {
@@ -192,6 +255,7 @@ int gracht_link_vali_client_create(struct client_link_ops** linkOut)
     linkManager->ops.recv    = vali_link_recv;
     linkManager->ops.send    = (client_link_send_fn)vali_link_send_packet;
     linkManager->ops.destroy = (client_link_destroy_fn)vali_link_destroy;
+    linkManager->ops.flags   = 0;
     
     *linkOut = &linkManager->ops;
     return 0;
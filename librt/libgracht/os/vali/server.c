@@ -63,12 +63,14 @@ static int vali_link_recv_packet(struct vali_link_manager* linkManager, struct g
     }
     
     context->client      = linkManager->iod;
+    context->message_id  = message->base.header.id;
     context->params      = &message->base.params[0];
     
     context->param_in    = message->base.header.param_in;
     context->param_count = message->base.header.param_in + message->base.header.param_out;
     context->protocol    = message->base.header.protocol;
     context->action      = message->base.header.action;
+    context->flags       = message->base.header.flags;
     return 0;
 }
 
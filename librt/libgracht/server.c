@@ -32,7 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-extern int server_invoke_action(struct gracht_list*, struct gracht_recv_message*);
+extern int server_invoke_action(gracht_protocol_t**, struct gracht_recv_message*);
 
 struct gracht_server_client {
     struct gracht_object_header header;
@@ -46,9 +46,9 @@ struct gracht_server {
     int                     completion_iod;
     int                     client_iod;
     int                     dgram_iod;
-    struct gracht_list      protocols;
+    gracht_protocol_t*      protocols[GRACHT_MAX_PROTOCOLS];
     struct gracht_list      clients;
-} server_object = { NULL, 0, -1, -1, -1, { 0 }, { 0 } };
+} server_object = { NULL, 0, -1, -1, -1, { NULL }, { 0 } };
 
 int gracht_server_initialize(gracht_server_configuration_t* configuration)
 {
@@ -136,7 +136,7 @@ static int handle_sync_event(int iod, uint32_t events, void* storage)
             }
             break;
         }
-        status = server_invoke_action(&server_object.protocols, &message);
+        status = server_invoke_action(&server_object.protocols[0], &message);
     }
     
     return status;
@@ -172,7 +172,7 @@ static int handle_async_event(int iod, uint32_t events, void* storage)
                 break;
             }
             
-            status = server_invoke_action(&server_object.protocols, &message);
+            status = server_invoke_action(&server_object.protocols[0], &message);
         }
     }
     return 0;
@@ -255,6 +255,10 @@ int gracht_server_respond(struct gracht_recv_message* messageContext, struct gra
         return -1;
     }
 
+    // Echo the id of the request so the client can match the response
+    message->header.id     = messageContext->message_id;
+    message->header.flags |= MESSAGE_FLAG_RESPONSE;
+
     if (messageContext->client == server_object.dgram_iod) {
         return server_object.ops->respond(server_object.ops, messageContext, message);
     }
@@ -299,7 +303,12 @@ int gracht_server_register_protocol(gracht_protocol_t* protocol)
         return -1;
     }
     
-    gracht_list_append(&server_object.protocols, &protocol->header);
+    if (server_object.protocols[protocol->id]) {
+        errno = (EEXIST);
+        return -1;
+    }
+    
+    server_object.protocols[protocol->id] = protocol;
     return 0;
 }
 
@@ -310,7 +319,12 @@ int gracht_server_unregister_protocol(gracht_protocol_t* protocol)
         return -1;
     }
     
-    gracht_list_remove(&server_object.protocols, &protocol->header);
+    if (server_object.protocols[protocol->id] != protocol) {
+        errno = (ENOENT);
+        return -1;
+    }
+    
+    server_object.protocols[protocol->id] = NULL;
     return 0;
 }
 
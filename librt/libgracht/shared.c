@@ -23,7 +23,6 @@
  */
 
 #include "include/gracht/types.h"
-#include "include/gracht/list.h"
 #include "include/gracht/debug.h"
 #include <errno.h>
 
@@ -35,17 +34,24 @@ typedef void (*client_invokeA0_t)(void*);
 typedef void (*server_invoke00_t)(struct gracht_recv_message*);
 typedef void (*server_invokeA0_t)(struct gracht_recv_message*, void*);
 
-static gracht_protocol_function_t* get_protocol_action(struct gracht_list* protocols,
+static gracht_protocol_function_t* get_protocol_action(gracht_protocol_t** protocols,
     uint8_t protocol_id, uint8_t action_id)
 {
+    gracht_protocol_t* protocol = protocols[protocol_id];
+    uint8_t            index;
     int                i;
-    gracht_protocol_t* protocol = (struct gracht_protocol*)
-        gracht_list_lookup(protocols, (int)(uint32_t)protocol_id);
     
     if (!protocol) {
         return NULL;
     }
     
+    // Generated protocols have dense function tables indexed by the action id, so
+    // try the direct index first and only fall back to a search for hand-built tables
+    index = action_id - protocol->action_base;
+    if (index < protocol->num_functions && protocol->functions[index].id == action_id) {
+        return &protocol->functions[index];
+    }
+    
     for (i = 0; i < protocol->num_functions; i++) {
         if (protocol->functions[i].id == action_id) {
             return &protocol->functions[i];
@@ -98,7 +104,7 @@ static void unpack_parameters(struct gracht_recv_message* message, uint8_t* unpa
     }
 }
 
-int server_invoke_action(struct gracht_list* protocols, struct gracht_recv_message* message)
+int server_invoke_action(gracht_protocol_t** protocols, struct gracht_recv_message* message)
 {
     gracht_protocol_function_t* function = get_protocol_action(protocols,
         message->protocol, message->action);
@@ -108,7 +114,10 @@ int server_invoke_action(struct gracht_list* protocols, struct gracht_recv_messa
         return -1;
     }
     
-    if (message->param_in) {
+    if (function->invoke) {
+        function->invoke(message);
+    }
+    else if (message->param_in) {
         uint8_t unpackBuffer[message->param_in * sizeof(void*)];
         unpack_parameters(message, &unpackBuffer[0]);
         ((server_invokeA0_t)function->address)(message, &unpackBuffer[0]);
@@ -119,7 +128,7 @@ int server_invoke_action(struct gracht_list* protocols, struct gracht_recv_messa
     return 0;
 }
 
-int client_invoke_action(struct gracht_list* protocols, struct gracht_recv_message* message)
+int client_invoke_action(gracht_protocol_t** protocols, struct gracht_recv_message* message)
 {
     gracht_protocol_function_t* function = get_protocol_action(protocols,
         message->protocol, message->action);
@@ -129,7 +138,10 @@ int client_invoke_action(struct gracht_list* protocols, struct gracht_recv_messa
     }
     
     // parse parameters into a parameter struct
-    if (message->param_count) {
+    if (function->invoke) {
+        function->invoke(message);
+    }
+    else if (message->param_count) {
         uint8_t unpackBuffer[message->param_count * sizeof(void*)];
         unpack_parameters(message, &unpackBuffer[0]);
         ((client_invokeA0_t)function->address)(&unpackBuffer[0]);
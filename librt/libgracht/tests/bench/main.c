@@ -0,0 +1,359 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Gracht Socket Link Benchmark
+ *  - Measures large payload transfers over the socket link, comparing chunked
+ *    inline copies with the connection ring and explicit SHM regions
+ *  - Measures request throughput with increasing pipeline depth, and with
+ *    multiple threads sharing one client
+ */
+
+#include <errno.h>
+#include <gracht/link/socket.h>
+#include <gracht/server.h>
+#include "../test_utils_protocol_client.h"
+#include "../test_utils_protocol_server.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE         256
+#define TOTAL_PER_RUN      (16 * 1024 * 1024)
+#define PIPELINE_REQUESTS  50000
+#define PIPELINE_MAX_DEPTH 64
+#define PIPELINE_PAYLOAD   64
+
+static const char* dgramPath = "/tmp/g_bench_dgram";
+static const char* clientsPath = "/tmp/g_bench_clients";
+
+void test_utils_print_callback(struct gracht_recv_message* message, struct test_utils_print_args* args)
+{
+    test_utils_print_response(message, 0);
+}
+
+void test_utils_transfer_callback(struct gracht_recv_message* message, struct test_utils_transfer_args* args)
+{
+    struct gracht_param* params = message->params;
+    const uint8_t*       data   = args->data;
+
+    // touch both ends of the payload to make sure it is actually readable
+    if (data[0] != 0xAB || data[params[0].length - 1] != 0xAB) {
+        test_utils_transfer_response(message, 0);
+        return;
+    }
+    test_utils_transfer_response(message, (unsigned int)params[0].length);
+}
+
+void test_utils_transfer_shm_callback(struct gracht_recv_message* message, struct test_utils_transfer_shm_args* args)
+{
+    struct gracht_param* params = message->params;
+    const uint8_t*       data   = args->data;
+
+    if (data[0] != 0xAB || data[params[0].length - 1] != 0xAB) {
+        test_utils_transfer_shm_response(message, 0);
+        return;
+    }
+    test_utils_transfer_shm_response(message, (unsigned int)params[0].length);
+}
+
+static int run_server(void)
+{
+    struct socket_server_configuration linkConfiguration;
+    struct gracht_server_configuration serverConfiguration;
+
+    struct sockaddr_un* dgramAddr = (struct sockaddr_un*)&linkConfiguration.dgram_address;
+    struct sockaddr_un* serverAddr = (struct sockaddr_un*)&linkConfiguration.server_address;
+
+    memset(&linkConfiguration, 0, sizeof(linkConfiguration));
+    linkConfiguration.dgram_address_length = sizeof(struct sockaddr_un);
+    linkConfiguration.server_address_length = sizeof(struct sockaddr_un);
+
+    dgramAddr->sun_family = AF_LOCAL;
+    strncpy(dgramAddr->sun_path, dgramPath, sizeof(dgramAddr->sun_path) - 1);
+    serverAddr->sun_family = AF_LOCAL;
+    strncpy(serverAddr->sun_path, clientsPath, sizeof(serverAddr->sun_path) - 1);
+
+    gracht_link_socket_server_create(&serverConfiguration.link, &linkConfiguration);
+    if (gracht_server_initialize(&serverConfiguration)) {
+        printf("gracht_bench: error initializing server %i\n", errno);
+        return -1;
+    }
+
+    gracht_server_register_protocol(&test_utils_protocol);
+    return gracht_server_main_loop();
+}
+
+static int create_client(gracht_client_t** clientOut)
+{
+    struct socket_client_configuration linkConfiguration;
+    struct gracht_client_configuration clientConfiguration;
+    struct sockaddr_un*                addr = (struct sockaddr_un*)&linkConfiguration.address;
+    int                                attempts = 100;
+
+    memset(&linkConfiguration, 0, sizeof(linkConfiguration));
+    linkConfiguration.type           = gracht_link_stream_based;
+    linkConfiguration.address_length = sizeof(struct sockaddr_un);
+    addr->sun_family = AF_LOCAL;
+    strncpy(addr->sun_path, clientsPath, sizeof(addr->sun_path) - 1);
+
+    // the server is started in parallel, retry until it is listening
+    while (attempts--) {
+        gracht_link_socket_client_create(&clientConfiguration.link, &linkConfiguration);
+        if (!gracht_client_create(&clientConfiguration, clientOut)) {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+static double elapsed_seconds(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + ((double)(now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static void report(const char* mode, size_t size, int iterations, double seconds)
+{
+    double megabytes = ((double)size * iterations) / (1024.0 * 1024.0);
+    printf("%-8s %9zu bytes x %6i: %8.3f s, %9.1f MiB/s, %9.1f us/message\n",
+        mode, size, iterations, seconds, megabytes / seconds, (seconds * 1e6) / iterations);
+}
+
+static int bench_size(gracht_client_t* client, struct gracht_shm* shm, size_t size)
+{
+    int             iterations = (int)(TOTAL_PER_RUN / size);
+    uint8_t*        payload = malloc(size);
+    unsigned int    length;
+    struct timespec start;
+    int             i;
+    size_t          offset;
+
+    if (!payload) {
+        return -1;
+    }
+
+    if (iterations < 4) {
+        iterations = 4;
+    }
+
+    memset(payload, 0xAB, size);
+    memset(shm->buffer, 0xAB, size);
+
+    // chunked inline copies, each chunk is a full round-trip
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        for (offset = 0; offset < size; offset += CHUNK_SIZE) {
+            size_t chunk = (size - offset) < CHUNK_SIZE ? (size - offset) : CHUNK_SIZE;
+            test_utils_transfer(client, NULL, payload + offset, chunk, &length);
+        }
+    }
+    report("chunked", size, iterations, elapsed_seconds(&start));
+
+    // single message, the link moves the buffer through the connection ring
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        length = 0;
+        test_utils_transfer(client, NULL, payload, size, &length);
+        if (length != size) {
+            printf("gracht_bench: ring transfer failed (%u != %zu)\n", length, size);
+            free(payload);
+            return -1;
+        }
+    }
+    report("ring", size, iterations, elapsed_seconds(&start));
+
+    // single message, payload already lives in a shared region
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        length = 0;
+        test_utils_transfer_shm(client, NULL, shm->buffer, size, &length);
+        if (length != size) {
+            printf("gracht_bench: shm transfer failed (%u != %zu)\n", length, size);
+            free(payload);
+            return -1;
+        }
+    }
+    report("shm", size, iterations, elapsed_seconds(&start));
+
+    free(payload);
+    return 0;
+}
+
+static void report_rate(const char* mode, int parallelism, int requests, double seconds)
+{
+    printf("%-8s %15i x %6i: %8.3f s, %9.0f requests/s\n",
+        mode, parallelism, requests, seconds, (double)requests / seconds);
+}
+
+static int bench_pipeline(gracht_client_t* client, int depth)
+{
+    struct gracht_message_context  contexts[PIPELINE_MAX_DEPTH];
+    struct gracht_message_context* awaitables[PIPELINE_MAX_DEPTH];
+    uint8_t                        payload[PIPELINE_PAYLOAD];
+    unsigned int                   length;
+    struct timespec                start;
+    int                            issued = 0;
+    int                            i;
+
+    memset(payload, 0xAB, sizeof(payload));
+    memset(contexts, 0, sizeof(contexts));
+    for (i = 0; i < depth; i++) {
+        awaitables[i] = &contexts[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (issued < PIPELINE_REQUESTS) {
+        for (i = 0; i < depth; i++) {
+            if (test_utils_transfer_async(client, &contexts[i], payload, sizeof(payload))) {
+                printf("gracht_bench: failed to invoke async %i\n", errno);
+                return -1;
+            }
+        }
+
+        if (gracht_client_await_multiple(client, &awaitables[0], depth, GRACHT_AWAIT_ALL)) {
+            printf("gracht_bench: failed to await %i\n", errno);
+            return -1;
+        }
+
+        for (i = 0; i < depth; i++) {
+            length = 0;
+            test_utils_transfer_result(client, &contexts[i], &length);
+            if (length != sizeof(payload)) {
+                printf("gracht_bench: pipelined transfer failed (%u)\n", length);
+                return -1;
+            }
+        }
+        issued += depth;
+    }
+    report_rate("pipeline", depth, issued, elapsed_seconds(&start));
+    return 0;
+}
+
+struct bench_thread_context {
+    gracht_client_t* client;
+    int              requests;
+    int              status;
+};
+
+static int bench_thread(void* argument)
+{
+    struct bench_thread_context* context = argument;
+    uint8_t                      payload[PIPELINE_PAYLOAD];
+    unsigned int                 length;
+    int                          i;
+
+    memset(payload, 0xAB, sizeof(payload));
+    for (i = 0; i < context->requests; i++) {
+        length = 0;
+        test_utils_transfer(context->client, NULL, payload, sizeof(payload), &length);
+        if (length != sizeof(payload)) {
+            context->status = -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int bench_threads(gracht_client_t* client, int threadCount)
+{
+    thrd_t                      threads[PIPELINE_MAX_DEPTH];
+    struct bench_thread_context contexts[PIPELINE_MAX_DEPTH];
+    struct timespec             start;
+    int                         status = 0;
+    int                         i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threadCount; i++) {
+        contexts[i].client   = client;
+        contexts[i].requests = PIPELINE_REQUESTS / threadCount;
+        contexts[i].status   = 0;
+        thrd_create(&threads[i], bench_thread, &contexts[i]);
+    }
+
+    for (i = 0; i < threadCount; i++) {
+        thrd_join(threads[i], NULL);
+        status |= contexts[i].status;
+    }
+
+    if (status) {
+        printf("gracht_bench: threaded transfer failed\n");
+        return -1;
+    }
+    report_rate("threads", threadCount, (PIPELINE_REQUESTS / threadCount) * threadCount, elapsed_seconds(&start));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 4096, 65536, 512 * 1024, 4 * 1024 * 1024 };
+    gracht_client_t*    client;
+    struct gracht_shm   shm;
+    pid_t               server;
+    int                 status = 0;
+    int                 i;
+
+    unlink(dgramPath);
+    unlink(clientsPath);
+
+    server = fork();
+    if (server == 0) {
+        return run_server();
+    }
+
+    if (create_client(&client)) {
+        printf("gracht_bench: failed to connect to server\n");
+        kill(server, SIGTERM);
+        return -1;
+    }
+
+    if (gracht_link_socket_shm_create(sizes[(sizeof(sizes) / sizeof(sizes[0])) - 1], &shm)) {
+        printf("gracht_bench: failed to create shared memory %i\n", errno);
+        kill(server, SIGTERM);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        status = bench_size(client, &shm, sizes[i]);
+        if (status) {
+            break;
+        }
+    }
+
+    for (i = 1; !status && i <= PIPELINE_MAX_DEPTH; i *= 4) {
+        status = bench_pipeline(client, i);
+    }
+
+    for (i = 1; !status && i <= 16; i *= 2) {
+        status = bench_threads(client, i);
+    }
+
+    gracht_link_socket_shm_destroy(&shm);
+    gracht_client_shutdown(client);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return status;
+}
@@ -25,7 +25,6 @@
 #include <errno.h>
 #include <gracht/link/socket.h>
 #include <gracht/server.h>
-#include <gracht/os.h>
 #include <stdio.h>
 #include <string.h>
 #include "../test_utils_protocol_server.h"
@@ -40,6 +39,18 @@ void test_utils_print_callback(struct gracht_recv_message* message, struct test_
     test_utils_print_response(message, strlen(args->message));
 }
 
+void test_utils_transfer_callback(struct gracht_recv_message* message, struct test_utils_transfer_args* args)
+{
+    struct gracht_param* params = message->params;
+    test_utils_transfer_response(message, (unsigned int)params[0].length);
+}
+
+void test_utils_transfer_shm_callback(struct gracht_recv_message* message, struct test_utils_transfer_shm_args* args)
+{
+    struct gracht_param* params = message->params;
+    test_utils_transfer_shm_response(message, (unsigned int)params[0].length);
+}
+
 int main(int argc, char **argv)
 {
     struct socket_server_configuration linkConfiguration;
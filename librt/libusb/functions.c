@@ -173,6 +173,45 @@ UsbTransferPeriodic(
     return OsSuccess;
 }
 
+OsStatus_t
+UsbTransferIsochronousStream(
+    _In_ UsbTransfer_t*       Transfer,
+    _In_ UUId_t               BufferHandle,
+    _In_ size_t               BufferOffset,
+    _In_ size_t               BufferLength,
+    _In_ size_t               SegmentLength,
+    _In_ UsbTransactionType_t DataDirection,
+    _In_ UUId_t               RingHandle,
+    _In_ size_t               RingOffset,
+    _In_ size_t               RingLength)
+{
+    // Sanitize, the stream must be an isochronous transfer of whole segments
+    if (Transfer->TransactionCount != 0 || Transfer->Type != IsochronousTransfer ||
+        SegmentLength == 0 || BufferLength < SegmentLength || (BufferLength % SegmentLength) ||
+        !UsbIsocRingCapacity(RingLength)) {
+        return OsInvalidParameters;
+    }
+
+    // The data stage describes one segment, and the periodic buffer size the
+    // entire buffer the segments are laid out in
+    Transfer->Transactions[0].Type         = DataDirection;
+    Transfer->Transactions[0].BufferHandle = BufferHandle;
+    Transfer->Transactions[0].BufferOffset = BufferOffset;
+    Transfer->Transactions[0].Length       = SegmentLength;
+
+    // The second transaction carries the completion ring
+    Transfer->Transactions[1].Type         = DataDirection;
+    Transfer->Transactions[1].BufferHandle = RingHandle;
+    Transfer->Transactions[1].BufferOffset = RingOffset;
+    Transfer->Transactions[1].Length       = RingLength;
+
+    Transfer->Flags                        |= USB_TRANSFER_STREAM;
+    Transfer->PeriodicData                  = NULL;
+    Transfer->PeriodicBufferSize            = BufferLength;
+    Transfer->TransactionCount              = 2;
+    return OsSuccess;
+}
+
 OsStatus_t
 UsbTransferIn(
 	_In_ UsbTransfer_t* Transfer,
@@ -236,16 +275,47 @@ UsbTransferQueue(
 	_In_  UsbTransfer_t* Transfer,
 	_Out_ size_t*        BytesTransferred)
 {
-    struct vali_link_message msg        = VALI_MSG_INIT_HANDLE(InterfaceId);
-    UUId_t                   transferId = atomic_fetch_add(&TransferIdGenerator, 1);
+    return UsbTransferQueueWithId(InterfaceId, DeviceId, Transfer,
+        UsbTransferAllocateId(), BytesTransferred);
+}
+
+UUId_t
+UsbTransferAllocateId(void)
+{
+    return atomic_fetch_add(&TransferIdGenerator, 1);
+}
+
+UsbTransferStatus_t
+UsbTransferQueueWithId(
+	_In_  UUId_t         InterfaceId,
+	_In_  UUId_t         DeviceId,
+	_In_  UsbTransfer_t* Transfer,
+	_In_  UUId_t         TransferId,
+	_Out_ size_t*        BytesTransferred)
+{
+    struct vali_link_message msg = VALI_MSG_INIT_HANDLE(InterfaceId);
     UsbTransferStatus_t      status;
     
-    ctt_usbhost_queue(GetGrachtClient(), &msg, ProcessGetCurrentId(), DeviceId, transferId, Transfer,
+    ctt_usbhost_queue(GetGrachtClient(), &msg, ProcessGetCurrentId(), DeviceId, TransferId, Transfer,
         &status, BytesTransferred);
     gracht_vali_message_finish(&msg);
     return status;
 }
 
+OsStatus_t
+UsbTransferCancel(
+	_In_ UUId_t InterfaceId,
+	_In_ UUId_t DeviceId,
+	_In_ UUId_t TransferId)
+{
+    struct vali_link_message msg = VALI_MSG_INIT_HANDLE(InterfaceId);
+    OsStatus_t               status;
+    
+    ctt_usbhost_dequeue(GetGrachtClient(), &msg, ProcessGetCurrentId(), DeviceId, TransferId, &status);
+    gracht_vali_message_finish(&msg);
+    return status;
+}
+
 UsbTransferStatus_t
 UsbTransferQueuePeriodic(
 	_In_  UUId_t         InterfaceId,
@@ -78,6 +78,7 @@ FsReadFromFile(
         size_t   SectorCount;
         size_t   SectorsRead;
         size_t   ByteCount;
+        int      ReadTail = 0;
         
         // The buffer handle + offset that was selected for reading 
         UUId_t SelectedHandle = Mfs->TransferBuffer.handle;
@@ -96,6 +97,12 @@ FsReadFromFile(
             SectorCount    = BytesToRead / FileSystem->Disk.Descriptor.SectorSize;
             SelectedHandle = BufferHandle;
             SelectedOffset = BufferOffset;
+
+            // If the read ends inside a sector of this bucket, then read that last sector
+            // into the intermediate buffer with the same request instead of doing CASE 4
+            if ((BytesToRead % FileSystem->Disk.Descriptor.SectorSize) != 0 && SectorCount < SectorsLeft) {
+                ReadTail = 1;
+            }
         }
         
         // CASE 2: SINGLE READ INTO INTERMEDIATE BUFFER
@@ -137,15 +144,34 @@ FsReadFromFile(
             TRACE(" > sector %u (b-start %u, b-index %u), num-sectors %u, sector-byte-offset %u, bytecount %u",
                 LODWORD(Sector), LODWORD(Sector) - SectorIndex, SectorIndex, SectorCount, LODWORD(SectorOffset), ByteCount);
     
-            if (MfsReadSectors(FileSystem, SelectedHandle, SelectedOffset, 
+            if (ReadTail) {
+                StorageSegment_t Segments[2] = {
+                    { SelectedHandle, SelectedOffset, SectorCount * FileSystem->Disk.Descriptor.SectorSize },
+                    { Mfs->TransferBuffer.handle, 0, FileSystem->Disk.Descriptor.SectorSize }
+                };
+
+                if (MfsReadSectorsVectored(FileSystem, &Segments[0], 2,
+                        Sector, SectorCount + 1, &SectorsRead) != OsSuccess) {
+                    ERROR("Failed to read sector");
+                    Result = OsDeviceError;
+                    break;
+                }
+            }
+            else if (MfsReadSectors(FileSystem, SelectedHandle, SelectedOffset, 
                     Sector, SectorCount, &SectorsRead) != OsSuccess) {
                 ERROR("Failed to read sector");
                 Result = OsDeviceError;
                 break;
             }
             
-            // Adjust for how many sectors we actually read
-            if (SectorCount != SectorsRead) {
+            // Adjust for how many sectors we actually read, the tail sector holds the
+            // remaining bytes which must be copied from the intermediate buffer
+            if (ReadTail && SectorsRead > SectorCount) {
+                memcpy(((uint8_t*)Buffer + BufferOffset + ByteCount), Mfs->TransferBuffer.buffer,
+                    BytesToRead - ByteCount);
+                ByteCount = BytesToRead;
+            }
+            else if (SectorCount != SectorsRead) {
                 ByteCount = (FileSystem->Disk.Descriptor.SectorSize * SectorsRead) - SectorOffset;
             }
             
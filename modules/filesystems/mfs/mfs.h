@@ -239,6 +239,18 @@ MfsReadSectors(
     _In_ size_t                     Count,
     _In_ size_t*                    SectorsRead);
 
+/* MfsReadSectorsVectored 
+ * Reads the sectors into the segments in order with a single request
+ * to the disk associated with the file-system descriptor */
+__EXTERN OsStatus_t
+MfsReadSectorsVectored(
+    _In_ FileSystemDescriptor_t*    FileSystem,
+    _In_ const StorageSegment_t*    Segments,
+    _In_ int                        SegmentCount,
+    _In_ uint64_t                   Sector,
+    _In_ size_t                     Count,
+    _In_ size_t*                    SectorsRead);
+
 /* MfsWriteSectors 
  * A wrapper for writing sectors to the disk associated
  * with the file-system descriptor */
@@ -67,6 +67,27 @@ MfsReadSectors(
 	return status;
 }
 
+OsStatus_t
+MfsReadSectorsVectored(
+    _In_ FileSystemDescriptor_t* FileSystem,
+    _In_ const StorageSegment_t* Segments,
+    _In_ int                     SegmentCount,
+    _In_ uint64_t                Sector,
+    _In_ size_t                  Count,
+    _In_ size_t*                 SectorsRead)
+{
+	struct vali_link_message msg            = VALI_MSG_INIT_HANDLE(FileSystem->Disk.Driver);
+    uint64_t                 absoluteSector = FileSystem->SectorStart + Sector;
+	OsStatus_t               status;
+	
+	ctt_storage_transfer_segments(GetGrachtClient(), &msg, FileSystem->Disk.Device,
+			__STORAGE_OPERATION_READ, LODWORD(absoluteSector), HIDWORD(absoluteSector), 
+			Count, SegmentCount, (void*)Segments, sizeof(StorageSegment_t) * SegmentCount,
+			&status, SectorsRead);
+	gracht_vali_message_finish(&msg);
+	return status;
+}
+
 OsStatus_t
 MfsWriteSectors(
     _In_ FileSystemDescriptor_t* FileSystem,
@@ -24,32 +24,7 @@
 #include <ddk/usb.h>
 #include <ddk/utils.h>
 #include <stdlib.h>
-
-/* HidExtractValue
- * Retrieves a value from a buffer by the given bit-offset and the for a certain
- * number of bits, the extracted value will be treated unsigned */
-uint64_t
-HidExtractValue(
-    _In_ uint8_t *Buffer, 
-    _In_ uint32_t BitOffset, 
-    _In_ uint32_t NumBits)
-{
-    // Variables
-    uint64_t value = 0;
-    uint32_t i = 0;
-    uint32_t offset = BitOffset;
-
-    // Do it by loop
-    while (i < NumBits) {
-        uint8_t bits = ((offset % 8) + NumBits - i) < 8 ? NumBits % 8 : 8 - (offset % 8);
-        value |= ((Buffer[offset / 8] >> (offset % 8)) & ((1 << bits) - 1)) << i;
-        i += bits;
-        offset += bits;
-    }
-
-    // Return calculated value
-    return value;
-}
+#include <string.h>
 
 /* HidCollectionCreate
  * Allocates a new collection and fills it from the current states. */
@@ -253,6 +228,50 @@ HidParseGlobalState(
     }
 }
 
+/* HidCollectionCompile
+ * Adds the input items of the collection tree to the decoder in the order they
+ * appear in the reports. This call is recursive. */
+static OsStatus_t
+HidCollectionCompile(
+    _In_ HidDecoder_t *Decoder,
+    _In_ UsbHidReportCollection_t *Collection)
+{
+    UsbHidReportCollectionItem_t *Itr = Collection->Childs;
+    
+    while (Itr != NULL) {
+        if (Itr->CollectionType == HID_TYPE_COLLECTION && Itr->ItemPointer != NULL) {
+            if (HidCollectionCompile(Decoder, (UsbHidReportCollection_t*)Itr->ItemPointer) != OsSuccess) {
+                return OsError;
+            }
+        }
+        else if (Itr->CollectionType == HID_TYPE_INPUT) {
+            UsbHidReportInputItem_t *InputItem = (UsbHidReportInputItem_t*)Itr->ItemPointer;
+            uint32_t Usages[16];
+            int UsageCount = 0;
+            int ReportId = HID_DECODER_NO_REPORT_ID;
+
+            // The usage list is zero terminated
+            while (UsageCount < 16 && InputItem->LocalState.Usages[UsageCount] != 0) {
+                Usages[UsageCount] = (uint32_t)InputItem->LocalState.Usages[UsageCount];
+                UsageCount++;
+            }
+
+            if (Itr->Stats.ReportId != UUID_INVALID) {
+                ReportId = (int)Itr->Stats.ReportId;
+            }
+
+            if (HidDecoderAddItem(Decoder, ReportId, (int)InputItem->Flags, (int)Itr->InputType,
+                Itr->Stats.UsagePage, &Usages[0], UsageCount, InputItem->LocalState.UsageMin,
+                InputItem->LocalState.UsageMax, Itr->Stats.LogicalMin, Itr->Stats.ReportSize,
+                Itr->Stats.ReportCount)) {
+                return OsError;
+            }
+        }
+        Itr = Itr->Link;
+    }
+    return OsSuccess;
+}
+
 /* HidParseReportDescriptor
  * Parses the report descriptor and stores it as collection tree. The size
  * of the largest individual report is returned. */
@@ -265,9 +284,6 @@ HidParseReportDescriptor(
     // Variables
     DeviceInputType_t CurrentType = DeviceInputPointer;
     size_t i = 0, j = 0, Depth = 0;
-    size_t LongestReport = 0;
-    size_t BitOffset = 0;
-    int ReportIdsUsed = 0;
 
     // Collection buffers and pointers
     UsbHidReportCollection_t *CurrentCollection = NULL, 
@@ -361,9 +377,18 @@ HidParseReportDescriptor(
                     // closed and we should switch to parent collection context
                     case HID_MAIN_ENDCOLLECTION: {
                         if (CurrentCollection != NULL) {
-                            // If we finish with root collection, no more!
+                            // When a top-level collection finishes it becomes the root,
+                            // devices with more top-level collections (one per report id
+                            // usually) get them appended to the first one
                             if (CurrentCollection->Parent == NULL) {
-                                RootCollection = CurrentCollection;
+                                if (RootCollection == NULL) {
+                                    RootCollection = CurrentCollection;
+                                }
+                                else {
+                                    HidCollectionCreateChild(
+                                        RootCollection, &GlobalStats, CurrentType,
+                                        HID_TYPE_COLLECTION, CurrentCollection);
+                                }
                             }
                             CurrentCollection = CurrentCollection->Parent;
                         }
@@ -403,28 +428,19 @@ HidParseReportDescriptor(
                         }
 
                         // Debug
-                        TRACE("Input type %u at bit-offset %u, with data-size in bits %u", 
-                            InputItem->Flags, BitOffset, (GlobalStats.ReportCount * GlobalStats.ReportSize));
+                        TRACE("Input type %u, with data-size in bits %u", 
+                            InputItem->Flags, (GlobalStats.ReportCount * GlobalStats.ReportSize));
 
                         // Create a new copy of the current local state that applies
-                        // only to this input item. Override BitOffset member
+                        // only to this input item, the decoder lays out the offsets
                         memcpy(&InputItem->LocalState, &ItemStats, 
                             sizeof(UsbHidReportItemStats_t));
-                        InputItem->LocalState.BitOffset = BitOffset;
 
                         // Append it as a child note now that we 
                         // aren't a child
                         HidCollectionCreateChild(
                             CurrentCollection, &GlobalStats, CurrentType,
                             HID_TYPE_INPUT, InputItem);
-
-                        // Adjust BitOffset now to past this item
-                        // and also sanitize current length, make sure we store
-                        // the longest report
-                        BitOffset += GlobalStats.ReportCount * GlobalStats.ReportSize;
-                        if ((GlobalStats.ReportCount * GlobalStats.ReportSize) > LongestReport) {
-                            LongestReport = GlobalStats.ReportCount * GlobalStats.ReportSize;
-                        }
                     } break;
 
                     // Output examples could be @todo
@@ -445,7 +461,6 @@ HidParseReportDescriptor(
                 }
                 ItemStats.UsageMin = 0;
                 ItemStats.UsageMax = 0;
-                ItemStats.BitOffset = 0;
             } break;
 
             // Global items are actually a global state for the entire collection
@@ -454,9 +469,6 @@ HidParseReportDescriptor(
             // report
             case HID_REPORT_TYPE_GLOBAL: {
                 HidParseGlobalState(&GlobalStats, Tag, Packet);
-                if (GlobalStats.ReportId != UUID_INVALID) {
-                    ReportIdsUsed = 1;
-                }
             } break;
 
             // Local items are a local state that only applies to items in the current
@@ -514,15 +526,23 @@ HidParseReportDescriptor(
         }
     }
 
-    // Store the collection in the device
-    // and return the calculated number of maximum bytes reports can use
+    // Store the collection in the device and compile the decoder from it, the
+    // decoder knows the layout of every report so it determines the length
     Device->Collection = (RootCollection == NULL) ? CurrentCollection : RootCollection;
-    if (ReportIdsUsed) {
-        return DIVUP(LongestReport, 8) + 1;
+    if (Device->Collection == NULL) {
+        return 0;
     }
-    else {
-        return DIVUP(BitOffset, 8);
+
+    Device->Decoder = HidDecoderCreate();
+    if (Device->Decoder == NULL) {
+        return 0;
     }
+
+    if (HidCollectionCompile(Device->Decoder, Device->Collection) != OsSuccess) {
+        ERROR("Failed to compile the report decoder");
+        return 0;
+    }
+    return HidDecoderFinish(Device->Decoder);
 }
 
 /* HidCollectionDestroy
@@ -575,245 +595,6 @@ HidCollectionCleanup(
     }
 
     // Recursively cleanup
+    HidDecoderDestroy(Device->Decoder);
     return HidCollectionDestroy(Device->Collection);
 }
-
-/* HidParseReportInput
- * Handles report data from a collection-item of the type input.
- * This means we have actual input data from the device */
-void
-HidParseReportInput(
-    _In_ HidDevice_t *Device,
-    _In_ UsbHidReportCollectionItem_t *CollectionItem,
-    _In_ size_t DataIndex)
-{
-    // Variables
-    uint8_t *DataPointer = NULL, *PreviousDataPointer = NULL;
-    UsbHidReportInputItem_t *InputItem = NULL;
-    uint64_t Value = 0, OldValue = 0;
-    size_t i, Offset, Length, Usage;
-
-    // Static buffers
-    SystemInput_t InputData = { 0 };
-
-    // Cast the input-item from the ItemPointer
-    InputItem = (UsbHidReportInputItem_t*)CollectionItem->ItemPointer;
-
-    // Initiate pointers to new and previous data
-    DataPointer = &((uint8_t*)Device->Buffer)[DataIndex];
-    PreviousDataPointer = &((uint8_t*)Device->Buffer)[Device->PreviousDataIndex];
-
-    // Sanitize the type of input, if we are constant, it's padding
-    if (InputItem->Flags == REPORT_INPUT_TYPE_CONSTANT) {
-        return;
-    }
-
-    // If report-ids are active, we must make sure this data-packet
-    // is actually for this report
-    // The first byte of the data-report is the id
-    if (CollectionItem->Stats.ReportId != UUID_INVALID) {
-        uint8_t ReportId = DataPointer[0];
-        if (ReportId != (uint8_t)CollectionItem->Stats.ReportId) {
-            return;
-        }
-    }
-
-    // Initiate the mInputEvent data
-    InputData.Type = CollectionItem->InputType;
-
-    // Extract some of the state variables for parsing
-    Offset = InputItem->LocalState.BitOffset;
-    Length = CollectionItem->Stats.ReportSize;
-
-    // Iterate the data
-    for (i = 0; i < CollectionItem->Stats.ReportCount; i++, Offset += Length) {
-        Value = HidExtractValue(DataPointer, Offset, Length);
-        OldValue = HidExtractValue(PreviousDataPointer, Offset, Length);
-        
-        // We cant expect this to be correct though, it might be 0
-        Usage = InputItem->LocalState.Usages[i];
-
-        // Take action based on the type of input
-        // currently we only handle generic pc input devices
-        switch (CollectionItem->Stats.UsagePage) {
-            case HID_USAGE_PAGE_GENERIC_PC: {
-                switch (Usage) {
-                    // Calculating Device Bounds 
-                    // Resolution = (Logical Maximum � Logical Minimum) / 
-                    // ((Physical Maximum � Physical Minimum) * (10 Unit Exponent))
-
-                    // If physical min/max is not defined or are 0, 
-                    // we set them to be logical min/max
-
-                    // Grid updates like x, y or z coordinates have
-                    // changed. 
-                    case HID_REPORT_USAGE_X_AXIS:
-                    case HID_REPORT_USAGE_Y_AXIS:
-                    case HID_REPORT_USAGE_Z_AXIS: {
-                        // Variables
-                        int64_t Relative = (int64_t)Value;
-
-                        // Sanitize against no changes
-                        if (Value == 0) {
-                            break;
-                        }
-
-                        // If the value is absolute, we want to
-                        // make sure we calculate the relative
-                        if (InputItem->Flags == REPORT_INPUT_TYPE_ABSOLUTE) {
-                            Relative = (int64_t)(Value - OldValue);
-                        }
-
-                        // Handle sign-cases where we have to turn them negative
-                        if (Relative > CollectionItem->Stats.LogicalMax
-                            && CollectionItem->Stats.LogicalMin < 0) {
-                            if (Relative & (int64_t)(1 << (Length - 1))) {
-                                Relative -= (int64_t)(1 << Length);
-                            }
-                        }
-
-                        // Guard against relative = 0
-                        if (Relative != 0) {
-                            char *DebugAxis = NULL;
-                            if (Usage == HID_REPORT_USAGE_X_AXIS) {
-                                DebugAxis = "X";
-                                InputData.RelativeX = (int16_t)(Relative & 0xFFFF);
-                            }
-                            else if (Usage == HID_REPORT_USAGE_Y_AXIS) {
-                                DebugAxis = "Y";
-                                InputData.RelativeY = (int16_t)(Relative & 0xFFFF);
-                            }
-                            else { // HID_REPORT_USAGE_Z_AXIS
-                                DebugAxis = "Z";
-                                InputData.RelativeZ = (int16_t)(Relative & 0xFFFF);
-                            }
-                            
-                            // Debug
-                            TRACE("%s-Change: %i (Original 0x%x, Old 0x%x, LogMax %i)",
-                                DebugAxis, (int32_t)Relative, (uint32_t)Value, (uint32_t)OldValue, 
-                                CollectionItem->Stats.LogicalMax);
-                        }
-
-                    } break;
-                }
-            } break;
-
-            // Describes keyboard or keypad events
-            case HID_REPORT_USAGE_PAGE_KEYBOARD: {
-
-            } break;
-
-            // Generic Button events
-            case HID_REPORT_USAGE_PAGE_BUTTON: {
-                uint8_t KeystateChanged = 0;
-
-                // Check against old values if any changes are neccessary
-                if (Value != OldValue) {
-                    KeystateChanged = 1;
-                }
-                else {
-                    break;
-                }
-
-                // Ok, so if we have multiple buttons (an array) 
-                // we will use the logical min & max to find out which
-                // button id this is
-                TRACE("Button %u: %u", i, (uint32_t)Value);
-
-                // Possible types are: Keyboard, keypad, mouse, gamepad or joystick
-                switch (CollectionItem->InputType) {
-                    // Mouse button event
-                    case DeviceInputPointer: {
-
-                    } break;
-
-                    // Gamepad button event
-                    case DeviceInputGamePad: {
-
-                    } break;
-
-                    // Joystick button event
-                    case DeviceInputJoystick: {
-
-                    } break;
-
-                    // Ignore the rest of the input-types
-                    default:
-                        break;
-                }
-            } break;
-
-            // Consumer, this is device-specific
-            case HID_REPORT_USAGE_PAGE_CONSUMER: {
-                // Virtual box sends me 0x238 which means AC Pan 
-                // which actually is a kind of scrolling 
-                // From the HID Usage Table Specs:
-                // Sel - Set the horizontal offset of the display in the document. 
-            } break;
-
-            // We don't handle rest of usage-pages, but should be ok
-            default: {
-                TRACE("Usage Page 0x%x (Input Type 0x%x), Usage 0x%x, Value 0x%x",
-                    CollectionItem->Stats.UsagePage, CollectionItem->InputType, Usage, (uint32_t)Value);
-            } break;
-        }
-    }
-    
-    // Create a new input report
-    // @todo
-
-    // Buttons @todo
-}
-
-/* HidParseReport
- * Recursive report-parser that applies the given report-data
- * to the parsed report collection. */
-OsStatus_t
-HidParseReport(
-    _In_ HidDevice_t *Device,
-    _In_ UsbHidReportCollection_t *Collection,
-    _In_ size_t DataIndex)
-{
-    // Variables
-    UsbHidReportCollectionItem_t *Itr = NULL;
-    int Calls = 0;
-
-    // Get the collection pointer
-    Itr = Collection->Childs;
-    
-    // Iterate over all the children elements of root
-    while (Itr != NULL) {
-        switch (Itr->CollectionType) {
-
-            // Collections inside collections must be parsed
-            // recursively, so handle them
-            case HID_TYPE_COLLECTION: {
-                // Sanitize data attached
-                if (Itr->ItemPointer == NULL) {
-                    break;
-                }
-                
-                // Recursive parser for sub-collections
-                Calls += HidParseReport(Device, 
-                    (UsbHidReportCollection_t*)Itr->ItemPointer, DataIndex);
-            } break;
-            
-            // Input reports are interesting, that means we have an input event
-            case HID_TYPE_INPUT: {
-                HidParseReportInput(Device, Itr, DataIndex);
-                Calls++;
-            } break;
-
-            // For now we don't handle feature-reports
-            // output reports are not handled here, but never should
-            default:
-                break;
-        }
-        
-        // Go to next collection item in the collection
-        Itr = Itr->Link;
-    }
-
-    // Return the number of actual parses we made
-    return Calls;
-}
@@ -0,0 +1,374 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Human Input Device Driver (Generic)
+ *    - Report decoder, a flat table of the input fields of each report that is
+ *      compiled from the report descriptor. This part only depends on the C library
+ *      so it can be tested on the host.
+ */
+
+#include "decoder.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The usages the decoder produces input for, the rest of the usages are
+// only skipped over
+#define DECODER_PAGE_GENERIC_DESKTOP 0x1
+#define DECODER_PAGE_BUTTON          0x9
+#define DECODER_USAGE_X              0x30
+#define DECODER_USAGE_Y              0x31
+#define DECODER_USAGE_Z              0x32
+#define DECODER_MAX_BUTTONS          32
+
+HidDecoder_t*
+HidDecoderCreate(void)
+{
+    HidDecoder_t* Decoder = (HidDecoder_t*)malloc(sizeof(HidDecoder_t));
+    if (!Decoder) {
+        return NULL;
+    }
+    memset(Decoder, 0, sizeof(HidDecoder_t));
+    return Decoder;
+}
+
+static uint32_t
+HidDecoderGetUsage(
+    const uint32_t* Usages,
+    int             UsageCount,
+    uint32_t        UsageMin,
+    uint32_t        UsageMax,
+    uint32_t        Index)
+{
+    // Explicit usages come first, then the range, and if both run out the
+    // last usage applies to the rest of the values
+    if (Index < (uint32_t)UsageCount) {
+        return Usages[Index];
+    }
+    if (UsageMin != 0 || UsageMax != 0) {
+        uint32_t Usage = UsageMin + (Index - (uint32_t)UsageCount);
+        return Usage > UsageMax ? UsageMax : Usage;
+    }
+    return UsageCount != 0 ? Usages[UsageCount - 1] : 0;
+}
+
+static int
+HidDecoderGetSlot(
+    int      Type,
+    uint32_t UsagePage,
+    uint32_t Usage,
+    uint8_t* Index)
+{
+    if (UsagePage == DECODER_PAGE_GENERIC_DESKTOP && Type != HID_ITEM_ARRAY) {
+        switch (Usage) {
+            case DECODER_USAGE_X: return HID_SLOT_X;
+            case DECODER_USAGE_Y: return HID_SLOT_Y;
+            case DECODER_USAGE_Z: return HID_SLOT_Z;
+            default:
+                break;
+        }
+    }
+    else if (UsagePage == DECODER_PAGE_BUTTON) {
+        if (Type == HID_ITEM_ARRAY) {
+            return HID_SLOT_BUTTON_ARRAY;
+        }
+
+        // Buttons are numbered from 1
+        if (Usage != 0 && Usage <= DECODER_MAX_BUTTONS) {
+            *Index = (uint8_t)(Usage - 1);
+            return HID_SLOT_BUTTON;
+        }
+    }
+    return 0;
+}
+
+static int
+HidDecoderAppend(
+    HidDecodeReport_t* Report,
+    HidDecodeField_t*  Field)
+{
+    if (Report->FieldCount == Report->FieldCapacity) {
+        int               Capacity = Report->FieldCapacity ? Report->FieldCapacity * 2 : 8;
+        HidDecodeField_t* Fields   = (HidDecodeField_t*)realloc(Report->Fields,
+            Capacity * sizeof(HidDecodeField_t));
+        if (!Fields) {
+            return -1;
+        }
+        Report->Fields        = Fields;
+        Report->FieldCapacity = Capacity;
+    }
+    memcpy(&Report->Fields[Report->FieldCount++], Field, sizeof(HidDecodeField_t));
+    return 0;
+}
+
+int
+HidDecoderAddItem(
+    HidDecoder_t*   Decoder,
+    int             ReportId,
+    int             Type,
+    int             InputType,
+    uint32_t        UsagePage,
+    const uint32_t* Usages,
+    int             UsageCount,
+    uint32_t        UsageMin,
+    uint32_t        UsageMax,
+    int32_t         LogicalMin,
+    uint32_t        Size,
+    uint32_t        Count)
+{
+    HidDecodeReport_t* Report;
+    uint32_t           i;
+
+    if (!Decoder || ReportId >= HID_DECODER_MAX_REPORTS) {
+        return -1;
+    }
+
+    // Reports with an id start with the id byte
+    if (ReportId == HID_DECODER_NO_REPORT_ID) {
+        Report = &Decoder->Reports[0];
+    }
+    else {
+        Report = &Decoder->Reports[ReportId];
+        Decoder->ReportIdsUsed = 1;
+        if (Report->BitLength == 0) {
+            Report->BitLength = 8;
+        }
+    }
+
+    for (i = 0; i < Count; i++, Report->BitLength += Size) {
+        HidDecodeField_t Field = { 0 };
+        size_t           BitOffset = Report->BitLength;
+        uint32_t         Usage;
+
+        // Fields larger than 32 bits are not used by anything we decode
+        if (Type == HID_ITEM_CONSTANT || Size == 0 || Size > 32) {
+            continue;
+        }
+
+        Usage      = HidDecoderGetUsage(Usages, UsageCount, UsageMin, UsageMax, i);
+        Field.Slot = (uint8_t)HidDecoderGetSlot(Type, UsagePage, Usage, &Field.Index);
+        if (!Field.Slot) {
+            continue;
+        }
+
+        Field.ByteOffset = (uint16_t)(BitOffset / 8);
+        Field.BitShift   = (uint8_t)(BitOffset % 8);
+        Field.ByteCount  = (uint8_t)((Field.BitShift + Size + 7) / 8);
+        Field.BitCount   = (uint8_t)Size;
+        Field.Mask       = Size == 32 ? UINT32_MAX : ((1U << Size) - 1);
+        Field.InputType  = InputType;
+        if (LogicalMin < 0) {
+            Field.Flags |= HID_FIELD_SIGNED;
+        }
+        if (Type == HID_ITEM_RELATIVE) {
+            Field.Flags |= HID_FIELD_RELATIVE;
+            Report->HasRelative = 1;
+        }
+
+        if (HidDecoderAppend(Report, &Field)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+size_t
+HidDecoderFinish(
+    HidDecoder_t* Decoder)
+{
+    size_t LongestReport = 0;
+    int    i;
+
+    for (i = 0; i < HID_DECODER_MAX_REPORTS; i++) {
+        HidDecodeReport_t* Report = &Decoder->Reports[i];
+        size_t             Length = (Report->BitLength + 7) / 8;
+        if (!Length) {
+            continue;
+        }
+
+        if (Length > LongestReport) {
+            LongestReport = Length;
+        }
+
+        // Reports without fields we decode keep no state
+        if (Report->FieldCount) {
+            Report->Previous   = (uint8_t*)calloc(Length, 1);
+            Report->Difference = (uint8_t*)calloc(Length, 1);
+            if (!Report->Previous || !Report->Difference) {
+                return 0;
+            }
+        }
+    }
+    return LongestReport;
+}
+
+static inline uint32_t
+HidDecoderLoad(
+    const uint8_t*          Data,
+    const HidDecodeField_t* Field)
+{
+    uint64_t Value = 0;
+    int      i;
+
+    for (i = 0; i < Field->ByteCount; i++) {
+        Value |= (uint64_t)Data[Field->ByteOffset + i] << (i * 8);
+    }
+    return (uint32_t)(Value >> Field->BitShift) & Field->Mask;
+}
+
+static inline int32_t
+HidDecoderExtend(
+    const HidDecodeField_t* Field,
+    uint32_t                Value)
+{
+    if ((Field->Flags & HID_FIELD_SIGNED) && Field->BitCount < 32 &&
+        (Value & (1U << (Field->BitCount - 1)))) {
+        Value |= ~Field->Mask;
+    }
+    return (int32_t)Value;
+}
+
+int
+HidDecoderDecode(
+    HidDecoder_t*      Decoder,
+    const uint8_t*     Data,
+    size_t             Length,
+    HidDecodedInput_t* Input)
+{
+    HidDecodeReport_t* Report;
+    uint32_t           Buttons;
+    uint32_t           ArrayButtons = 0;
+    uint8_t            Changed = 0;
+    size_t             ReportLength;
+    size_t             i;
+    int                j;
+
+    if (!Decoder || !Data || !Length) {
+        return 0;
+    }
+
+    Report       = &Decoder->Reports[Decoder->ReportIdsUsed ? Data[0] : 0];
+    ReportLength = (Report->BitLength + 7) / 8;
+    if (!Report->FieldCount) {
+        return 0;
+    }
+
+    // Short reports leave the rest of the previous report as it was
+    if (Length > ReportLength) {
+        Length = ReportLength;
+    }
+
+    // Find out which bits changed before extracting anything, if nothing did
+    // only relative fields can carry input
+    for (i = 0; i < Length; i++) {
+        Report->Difference[i] = Data[i] ^ Report->Previous[i];
+        Changed |= Report->Difference[i];
+    }
+    if (!Changed && !Report->HasRelative) {
+        return 0;
+    }
+
+    memset(Input, 0, sizeof(HidDecodedInput_t));
+    Input->ReportId = Decoder->ReportIdsUsed ? Data[0] : HID_DECODER_NO_REPORT_ID;
+    Buttons         = Report->Buttons;
+
+    for (j = 0; j < Report->FieldCount; j++) {
+        const HidDecodeField_t* Field = &Report->Fields[j];
+        int32_t                 Value;
+
+        if ((size_t)(Field->ByteOffset + Field->ByteCount) > Length) {
+            continue;
+        }
+
+        // Array fields hold the pressed buttons in any order, so all of them
+        // together make up the state
+        if (Field->Slot == HID_SLOT_BUTTON_ARRAY) {
+            uint32_t Button = HidDecoderLoad(Data, Field);
+            Input->InputType = Field->InputType;
+            if (Button != 0 && Button <= DECODER_MAX_BUTTONS) {
+                ArrayButtons |= (1U << (Button - 1));
+            }
+            continue;
+        }
+
+        if (Field->Flags & HID_FIELD_RELATIVE) {
+            Value = HidDecoderExtend(Field, HidDecoderLoad(Data, Field));
+            if (!Value) {
+                continue;
+            }
+        }
+        else {
+            if (!Changed || !HidDecoderLoad(Report->Difference, Field)) {
+                continue;
+            }
+            Value = HidDecoderExtend(Field, HidDecoderLoad(Data, Field));
+        }
+
+        Input->InputType = Field->InputType;
+        switch (Field->Slot) {
+            case HID_SLOT_X:
+            case HID_SLOT_Y:
+            case HID_SLOT_Z: {
+                int32_t* Axis = Field->Slot == HID_SLOT_X ? &Input->RelativeX :
+                    (Field->Slot == HID_SLOT_Y ? &Input->RelativeY : &Input->RelativeZ);
+
+                // Absolute axes are turned into movement since the previous report
+                if (!(Field->Flags & HID_FIELD_RELATIVE)) {
+                    Value -= HidDecoderExtend(Field, HidDecoderLoad(Report->Previous, Field));
+                }
+                *Axis += Value;
+            } break;
+
+            case HID_SLOT_BUTTON: {
+                if (Value) Buttons |= (1U << Field->Index);
+                else       Buttons &= ~(1U << Field->Index);
+            } break;
+
+            default:
+                break;
+        }
+    }
+
+    if (ArrayButtons != Report->ArrayButtons) {
+        Buttons              = (Buttons & ~Report->ArrayButtons) | ArrayButtons;
+        Report->ArrayButtons = ArrayButtons;
+    }
+
+    memcpy(Report->Previous, Data, Length);
+    Input->Buttons        = Buttons;
+    Input->ButtonsChanged = Buttons ^ Report->Buttons;
+    Report->Buttons       = Buttons;
+    return (Input->RelativeX || Input->RelativeY || Input->RelativeZ || Input->ButtonsChanged) ? 1 : 0;
+}
+
+void
+HidDecoderDestroy(
+    HidDecoder_t* Decoder)
+{
+    int i;
+
+    if (!Decoder) {
+        return;
+    }
+
+    for (i = 0; i < HID_DECODER_MAX_REPORTS; i++) {
+        free(Decoder->Reports[i].Fields);
+        free(Decoder->Reports[i].Previous);
+        free(Decoder->Reports[i].Difference);
+    }
+    free(Decoder);
+}
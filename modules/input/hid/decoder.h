@@ -0,0 +1,142 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Human Input Device Driver (Generic)
+ *    - Report decoder, a flat table of the input fields of each report that is
+ *      compiled from the report descriptor. This part only depends on the C library
+ *      so it can be tested on the host.
+ */
+
+#ifndef __HID_DECODER_H__
+#define __HID_DECODER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HID_DECODER_MAX_REPORTS             256
+#define HID_DECODER_NO_REPORT_ID            -1
+
+/* HidDecodeField::Slot
+ * The part of the decoded input a field is written to */
+#define HID_SLOT_X                          0x1
+#define HID_SLOT_Y                          0x2
+#define HID_SLOT_Z                          0x3
+#define HID_SLOT_BUTTON                     0x4 // Index is the button number
+#define HID_SLOT_BUTTON_ARRAY               0x5 // Value is the button number
+
+/* HidDecodeField::Flags
+ * Contains definitions and bitfield definitions for HidDecodeField::Flags */
+#define HID_FIELD_SIGNED                    0x1
+#define HID_FIELD_RELATIVE                  0x2
+
+/* HidDecoderAddItem::Type
+ * The kind of input item, matches the REPORT_INPUT_TYPE values */
+#define HID_ITEM_CONSTANT                   0x0
+#define HID_ITEM_RELATIVE                   0x1
+#define HID_ITEM_ABSOLUTE                   0x2
+#define HID_ITEM_ARRAY                      0x3
+
+typedef struct _HidDecodeField {
+    uint16_t ByteOffset;
+    uint8_t  ByteCount;
+    uint8_t  BitShift;
+    uint32_t Mask;
+    uint8_t  Flags;
+    uint8_t  Slot;
+    uint8_t  Index;
+    uint8_t  BitCount;
+    int      InputType;
+} HidDecodeField_t;
+
+typedef struct _HidDecodeReport {
+    size_t            BitLength;
+    int               FieldCount;
+    int               FieldCapacity;
+    int               HasRelative;
+    HidDecodeField_t* Fields;
+    uint8_t*          Previous;
+    uint8_t*          Difference;
+    uint32_t          Buttons;
+    uint32_t          ArrayButtons;
+} HidDecodeReport_t;
+
+typedef struct _HidDecoder {
+    int               ReportIdsUsed;
+    HidDecodeReport_t Reports[HID_DECODER_MAX_REPORTS];
+} HidDecoder_t;
+
+typedef struct _HidDecodedInput {
+    int      InputType;
+    int      ReportId;
+    int32_t  RelativeX;
+    int32_t  RelativeY;
+    int32_t  RelativeZ;
+    uint32_t Buttons;
+    uint32_t ButtonsChanged;
+} HidDecodedInput_t;
+
+/* HidDecoderCreate
+ * Creates an empty decoder. Items are added in the order they appear in the report
+ * descriptor, and HidDecoderFinish must be called before reports are decoded. */
+extern HidDecoder_t*
+HidDecoderCreate(void);
+
+/* HidDecoderAddItem
+ * Adds an input item of Count values of Size bits each to the report. Padding and
+ * usages we do not handle only advance the offset, the rest is added as fields.
+ * Usages lists the explicit usages, the usage range is used for the rest. */
+extern int
+HidDecoderAddItem(
+    HidDecoder_t*   Decoder,
+    int             ReportId,
+    int             Type,
+    int             InputType,
+    uint32_t        UsagePage,
+    const uint32_t* Usages,
+    int             UsageCount,
+    uint32_t        UsageMin,
+    uint32_t        UsageMax,
+    int32_t         LogicalMin,
+    uint32_t        Size,
+    uint32_t        Count);
+
+/* HidDecoderFinish
+ * Allocates the state buffers for the reports, returns the length in bytes of the
+ * longest report, including the report id. */
+extern size_t
+HidDecoderFinish(
+    HidDecoder_t* Decoder);
+
+/* HidDecoderDecode
+ * Decodes a report. Fields without changes compared to the previous report with the
+ * same id are skipped, relative fields are always decoded. Returns 1 if there was
+ * any input, otherwise 0. */
+extern int
+HidDecoderDecode(
+    HidDecoder_t*      Decoder,
+    const uint8_t*     Data,
+    size_t             Length,
+    HidDecodedInput_t* Input);
+
+/* HidDecoderDestroy
+ * Frees the decoder and its tables. */
+extern void
+HidDecoderDestroy(
+    HidDecoder_t* Decoder);
+
+#endif //!__HID_DECODER_H__
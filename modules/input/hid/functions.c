@@ -166,6 +166,10 @@ HidSetupGeneric(
         
     // Cleanup unneeded descriptor
     free(ReportDescriptor);
+    if (ReportLength == 0) {
+        ERROR("The report descriptor contained no input reports.");
+        return OsError;
+    }
 
     // Store the length of the report
     Device->ReportLength = ReportLength;
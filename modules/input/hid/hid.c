@@ -137,17 +137,24 @@ HidInterrupt(
     _In_ UsbTransferStatus_t Status,
     _In_ size_t DataIndex)
 {
+    HidDecodedInput_t Input;
+
     // Sanitize
-    if (Device->Collection == NULL || Status == TransferNAK) {
+    if (Device->Decoder == NULL || Status == TransferNAK) {
         return InterruptHandled;
     }
 
-    // Perform the report parse
-    if (!HidParseReport(Device, Device->Collection, DataIndex)) {
+    // Decode the report, the decoder keeps the previous report of each id
+    if (!HidDecoderDecode(Device->Decoder, &((uint8_t*)Device->Buffer)[DataIndex],
+        Device->ReportLength, &Input)) {
         return InterruptHandled;
     }
 
-    // Store previous index
-    Device->PreviousDataIndex = DataIndex;
+    TRACE("Input(Type %i, Report %i): X %i, Y %i, Z %i, Buttons 0x%x (Changed 0x%x)",
+        Input.InputType, Input.ReportId, Input.RelativeX, Input.RelativeY,
+        Input.RelativeZ, Input.Buttons, Input.ButtonsChanged);
+
+    // Create a new input report
+    // @todo
     return InterruptHandled;
 }
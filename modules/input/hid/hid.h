@@ -24,6 +24,7 @@
 
 #include <os/osdefs.h>
 #include <ddk/usbdevice.h>
+#include "decoder.h"
 
 typedef enum _DeviceInputType {
     DeviceInputKeyboard     = 0,
@@ -194,15 +195,13 @@ PACKED_TYPESTRUCT(UsbHidReportGlobalStats, {
 });
 
 /* UsbHidReportItemStats
- * Describes an HID-item for which kind of usages, and
- * where in the report (bit index) its data is */
+ * Describes an HID-item for which kind of usages. Where in the report
+ * its data is, is determined by the decoder. */
 typedef struct _UsbHidReportItemStats {
     int                             Usages[16];
 
     uint32_t                        UsageMin;
     uint32_t                        UsageMax;
-
-    uint32_t                        BitOffset;
 } UsbHidReportItemStats_t;
 
 /* UsbHidReportInputItem
@@ -256,8 +255,8 @@ typedef struct _HidDevice {
 
     // Buffers
     UsbHidReportCollection_t    *Collection;
+    HidDecoder_t                *Decoder;
     uintptr_t                   *Buffer;
-    size_t                       PreviousDataIndex;
     size_t                       ReportLength;
     
     // Endpoint Information
@@ -309,8 +308,8 @@ HidSetIdle(
     _In_ int Duration);
 
 /* HidParseReportDescriptor
- * Parses the report descriptor and stores it as collection tree. The size
- * of the largest individual report is returned. */
+ * Parses the report descriptor and stores it as collection tree, and compiles the
+ * report decoder from it. The size of the largest individual report is returned. */
 __EXTERN
 size_t
 HidParseReportDescriptor(
@@ -318,16 +317,6 @@ HidParseReportDescriptor(
     _In_ uint8_t *Descriptor,
     _In_ size_t DescriptorLength);
 
-/* HidParseReport
- * Recursive report-parser that applies the given report-data
- * to the parsed report collection. */
-__EXTERN
-OsStatus_t
-HidParseReport(
-    _In_ HidDevice_t *Device,
-    _In_ UsbHidReportCollection_t *Collection,
-    _In_ size_t DataIndex);
-
 /* HidCollectionCleanup
  * Cleans up any resources allocated by the collection parser. */
 __EXTERN
@@ -0,0 +1,41 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * HID Decoder Test - Host definitions
+ *  - Stand-ins for the usb types hid.h refers to, the parser does not use them
+ */
+
+#ifndef _USB_INTERFACE_H_
+#define _USB_INTERFACE_H_
+
+#include <os/osdefs.h>
+
+typedef enum _UsbTransferStatus {
+    TransferNotProcessed,
+    TransferFinished
+} UsbTransferStatus_t;
+
+typedef struct _UsbTransfer {
+    int Unused;
+} UsbTransfer_t;
+
+typedef struct _UsbHcEndpointDescriptor {
+    int Unused;
+} UsbHcEndpointDescriptor_t;
+
+#endif //!_USB_INTERFACE_H_
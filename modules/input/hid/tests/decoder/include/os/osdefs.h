@@ -0,0 +1,54 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * HID Decoder Test - Host definitions
+ *  - The subset of os/osdefs.h the report descriptor parser uses, so collection.c
+ *    can be built with the host compiler.
+ */
+
+#ifndef __OS_DEFINITIONS__
+#define __OS_DEFINITIONS__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define _In_
+#define _Out_
+#define _InOut_
+#define __EXTERN extern
+
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) name body name##_t
+
+typedef unsigned int UUId_t;
+typedef unsigned int Flags_t;
+
+#define UUID_INVALID 0
+
+typedef enum {
+    OsSuccess = 0,
+    OsError
+} OsStatus_t;
+
+typedef enum {
+    InterruptNotHandled,
+    InterruptHandled,
+    InterruptHandledStop
+} InterruptStatus_t;
+
+#endif //!__OS_DEFINITIONS__
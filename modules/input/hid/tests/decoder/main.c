@@ -0,0 +1,309 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * HID Decoder Test
+ *  - Parses recorded report descriptors with the driver's parser and checks the input decoded
+ *    from recorded reports. Fields of every size and offset are checked against a
+ *    bit-by-bit extraction, and the decode time per report is reported.
+ */
+
+#include "../../hid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_REPORTS 4000000
+
+// Compiles the decoder with the driver's own report descriptor parser, the decoder
+// is stored in the device and released with the collection tree
+static HidDecoder_t* compile(HidDevice_t* device, const uint8_t* descriptor, size_t length,
+    size_t* reportLength)
+{
+    memset(device, 0, sizeof(HidDevice_t));
+    *reportLength = HidParseReportDescriptor(device, (uint8_t*)descriptor, length);
+    if (!*reportLength) {
+        HidCollectionCleanup(device);
+        return NULL;
+    }
+    return device->Decoder;
+}
+
+struct report {
+    uint8_t  data[16];
+    size_t   length;
+    int      result;
+    int32_t  x, y, z;
+    uint32_t buttons;
+    uint32_t changed;
+};
+
+static int run(const char* name, const uint8_t* descriptor, size_t descriptorLength,
+    size_t expectedLength, const struct report* reports, int reportCount)
+{
+    HidDevice_t   device;
+    HidDecoder_t* decoder;
+    size_t        reportLength = 0;
+    int           i;
+
+    decoder = compile(&device, descriptor, descriptorLength, &reportLength);
+    if (!decoder) {
+        printf("hid_decoder: %s: failed to compile the decoder\n", name);
+        return -1;
+    }
+
+    if (reportLength != expectedLength) {
+        printf("hid_decoder: %s: report length %zu != %zu\n", name, reportLength, expectedLength);
+        HidCollectionCleanup(&device);
+        return -1;
+    }
+
+    for (i = 0; i < reportCount; i++) {
+        const struct report* report = &reports[i];
+        HidDecodedInput_t    input;
+        int                  result;
+
+        memset(&input, 0, sizeof(input));
+        result = HidDecoderDecode(decoder, &report->data[0], report->length, &input);
+        if (result != report->result || (result &&
+            (input.RelativeX != report->x || input.RelativeY != report->y ||
+             input.RelativeZ != report->z || input.Buttons != report->buttons ||
+             input.ButtonsChanged != report->changed))) {
+            printf("hid_decoder: %s: report %i decoded to %i (X %i, Y %i, Z %i, buttons 0x%x, changed 0x%x)\n",
+                name, i, result, input.RelativeX, input.RelativeY, input.RelativeZ,
+                input.Buttons, input.ButtonsChanged);
+            HidCollectionCleanup(&device);
+            return -1;
+        }
+    }
+
+    HidCollectionCleanup(&device);
+    return 0;
+}
+
+// Boot protocol compatible mouse, three buttons and a wheel that is not decoded
+static const uint8_t boot_mouse[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+    0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05,
+    0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38,
+    0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03, 0x81, 0x06,
+    0xC0, 0xC0
+};
+
+static const struct report boot_mouse_reports[] = {
+    { { 0x01, 0x05, 0xFB, 0x00 }, 4, 1, 5, -5, 0, 0x1, 0x1 },
+    { { 0x01, 0x00, 0x00, 0x00 }, 4, 0, 0, 0, 0, 0, 0 },
+    { { 0x01, 0x00, 0x00, 0x01 }, 4, 0, 0, 0, 0, 0, 0 },
+    { { 0x04, 0x7F, 0x81, 0x00 }, 4, 1, 127, -127, 0, 0x4, 0x5 },
+    { { 0x04, 0x7F, 0x81, 0x00 }, 4, 1, 127, -127, 0, 0x4, 0 }
+};
+
+// Gaming mouse with report ids, five buttons and 12 bit axes that are not byte
+// aligned, and a consumer control report that is not decoded
+static const uint8_t report_id_mouse[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x01, 0x09, 0x01,
+    0xA1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00,
+    0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01,
+    0x75, 0x03, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31,
+    0x16, 0x01, 0xF8, 0x26, 0xFF, 0x07, 0x75, 0x0C, 0x95, 0x02,
+    0x81, 0x06, 0xC0, 0xC0, 0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01,
+    0x85, 0x02, 0x19, 0x00, 0x2A, 0x3C, 0x02, 0x15, 0x00, 0x26,
+    0x3C, 0x02, 0x95, 0x01, 0x75, 0x10, 0x81, 0x00, 0xC0
+};
+
+static const struct report report_id_mouse_reports[] = {
+    // X = -3, Y = 100
+    { { 0x01, 0x02, 0xFD, 0x4F, 0x06 }, 5, 1, -3, 100, 0, 0x2, 0x2 },
+    { { 0x02, 0x38, 0x02 }, 3, 0, 0, 0, 0, 0, 0 },
+    // X = 2047, Y = -2047
+    { { 0x01, 0x12, 0xFF, 0x17, 0x80 }, 5, 1, 2047, -2047, 0, 0x12, 0x10 },
+    { { 0x01, 0x00, 0x00, 0x00, 0x00 }, 5, 1, 0, 0, 0, 0, 0x12 }
+};
+
+// Absolute pointer, the movement is computed from the previous report
+static const uint8_t tablet[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x02, 0x15, 0x00, 0x25, 0x01,
+    0x95, 0x02, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x06,
+    0x81, 0x03, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x00,
+    0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x81, 0x02, 0xC0,
+    0xC0
+};
+
+static const struct report tablet_reports[] = {
+    { { 0x00, 0xE8, 0x03, 0xD0, 0x07 }, 5, 1, 1000, 2000, 0, 0, 0 },
+    { { 0x00, 0xE8, 0x03, 0xD0, 0x07 }, 5, 0, 0, 0, 0, 0, 0 },
+    { { 0x02, 0xF2, 0x03, 0xD0, 0x07 }, 5, 1, 10, 0, 0, 0x2, 0x2 },
+    { { 0x02, 0x00, 0x00, 0xD0, 0x07 }, 5, 1, -1010, 0, 0, 0x2, 0 }
+};
+
+// Boot protocol keyboard, nothing in it is decoded but the length must match
+static const uint8_t keyboard[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0,
+    0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08,
+    0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05,
+    0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+    0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06, 0x75, 0x08,
+    0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+    0x81, 0x00, 0xC0
+};
+
+static const struct report keyboard_reports[] = {
+    { { 0x02, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00 }, 8, 0, 0, 0, 0, 0, 0 }
+};
+
+// Gamepad reporting the pressed button as an array index
+static const uint8_t button_array[] = {
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x05, 0x09, 0x19, 0x01,
+    0x29, 0x08, 0x15, 0x00, 0x25, 0x08, 0x75, 0x04, 0x95, 0x02,
+    0x81, 0x00, 0xC0
+};
+
+static const struct report button_array_reports[] = {
+    { { 0x03 }, 1, 1, 0, 0, 0, 0x04, 0x04 },
+    { { 0x53 }, 1, 1, 0, 0, 0, 0x14, 0x10 },
+    { { 0x50 }, 1, 1, 0, 0, 0, 0x10, 0x04 },
+    { { 0x00 }, 1, 1, 0, 0, 0, 0x00, 0x10 }
+};
+
+static uint32_t next_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int32_t reference_extract(const uint8_t* data, size_t offset, uint32_t bits)
+{
+    uint32_t value = 0;
+    uint32_t i;
+
+    for (i = 0; i < bits; i++, offset++) {
+        value |= (uint32_t)((data[offset / 8] >> (offset % 8)) & 1) << i;
+    }
+    if (bits < 32 && (value & (1U << (bits - 1)))) {
+        value |= ~((1U << (bits - 1)) - 1);
+    }
+    return (int32_t)value;
+}
+
+// A relative X field of every size behind every amount of padding
+static int check_fields(uint32_t* state)
+{
+    uint32_t usage = 0x30;
+    uint32_t padding, bits;
+    int      round;
+
+    for (padding = 0; padding < 16; padding++) {
+        for (bits = 1; bits <= 32; bits++) {
+            HidDecoder_t*     decoder = HidDecoderCreate();
+            HidDecodedInput_t input;
+            uint8_t           data[8];
+            size_t            length;
+
+            if (!decoder ||
+                HidDecoderAddItem(decoder, HID_DECODER_NO_REPORT_ID, HID_ITEM_CONSTANT, 0, 1,
+                    NULL, 0, 0, 0, 0, padding, 1) ||
+                HidDecoderAddItem(decoder, HID_DECODER_NO_REPORT_ID, HID_ITEM_RELATIVE, 0, 1,
+                    &usage, 1, 0, 0, -1, bits, 1)) {
+                printf("hid_decoder: failed to compile a %u bit field\n", bits);
+                return -1;
+            }
+
+            length = HidDecoderFinish(decoder);
+            for (round = 0; round < 64; round++) {
+                int32_t expected;
+                size_t  i;
+
+                for (i = 0; i < sizeof(data); i++) {
+                    data[i] = (uint8_t)next_random(state);
+                }
+                expected = reference_extract(data, padding, bits);
+
+                memset(&input, 0, sizeof(input));
+                if (HidDecoderDecode(decoder, data, length, &input) != (expected != 0) ||
+                    input.RelativeX != expected) {
+                    printf("hid_decoder: %u bit field at bit %u decoded to %i != %i\n",
+                        bits, padding, input.RelativeX, expected);
+                    return -1;
+                }
+            }
+            HidDecoderDestroy(decoder);
+        }
+    }
+    return 0;
+}
+
+static int bench(void)
+{
+    HidDevice_t       device;
+    HidDecoder_t*     decoder;
+    HidDecodedInput_t input;
+    struct timespec   start, end;
+    uint8_t           data[5] = { 0x01, 0x00, 0x00, 0x00, 0x00 };
+    size_t            length;
+    volatile int32_t  result = 0;
+    double            elapsed;
+    int               i;
+
+    decoder = compile(&device, report_id_mouse, sizeof(report_id_mouse), &length);
+    if (!decoder) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_REPORTS; i++) {
+        data[1] = (uint8_t)(i & 0x1);
+        data[2] = (uint8_t)i;
+        HidDecoderDecode(decoder, data, length, &input);
+        result += input.RelativeX;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = ((double)(end.tv_sec - start.tv_sec) * 1e9) + (double)(end.tv_nsec - start.tv_nsec);
+    printf("mouse report: %.1f ns per report\n", elapsed / BENCH_REPORTS);
+    HidCollectionCleanup(&device);
+    return 0;
+}
+
+#define RUN(name, expectedLength) \
+    run(#name, name, sizeof(name), expectedLength, name##_reports, \
+        (int)(sizeof(name##_reports) / sizeof(name##_reports[0])))
+
+int main(int argc, char** argv)
+{
+    uint32_t state = 0x12345678;
+
+    if (RUN(boot_mouse, 4) || RUN(report_id_mouse, 5) || RUN(tablet, 5) ||
+        RUN(keyboard, 8) || RUN(button_array, 1)) {
+        return -1;
+    }
+
+    if (check_fields(&state)) {
+        return -1;
+    }
+
+    if (bench()) {
+        return -1;
+    }
+
+    printf("hid_decoder: all checks passed\n");
+    return 0;
+}
@@ -32,12 +32,14 @@
 #include <threads.h>
 #include "manager.h"
 #include "hci.h"
+#include "stream.h"
 
 #include "ctt_driver_protocol_server.h"
 #include "ctt_usbhost_protocol_server.h"
 
-static EventQueue_t* EventQueue  = NULL;
-static Collection_t  Controllers = COLLECTION_INIT(KeyId);
+static EventQueue_t*           EventQueue     = NULL;
+static Collection_t            Controllers    = COLLECTION_INIT(KeyId);
+static UsbManagerController_t* LastController = NULL;
 
 OsStatus_t
 UsbManagerInitialize(void)
@@ -110,6 +112,7 @@ UsbManagerDestroyController(
     }
 
     // Remove from list
+    LastController = NULL;
     cNode = CollectionGetNodeByKey(&Controllers, Key, 0);
     if (cNode != NULL) {
         CollectionUnlinkNode(&Controllers, cNode);
@@ -118,6 +121,18 @@ UsbManagerDestroyController(
     return OsError;
 }
 
+void
+UsbManagerRegisterTransfer(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer)
+{
+    DataKey_t Key = { .Value.Integer = (int)Transfer->Id };
+    if (Transfer->ListNode == NULL) {
+        Transfer->ListNode = CollectionCreateNode(Key, Transfer);
+        CollectionAppend(Controller->TransactionList, Transfer->ListNode);
+    }
+}
+
 void
 UsbManagerIterateTransfers(
     _In_ UsbManagerController_t* Controller,
@@ -145,65 +160,45 @@ UsbManagerController_t*
 UsbManagerGetController(
     _In_ UUId_t Device)
 {
+    // Most drivers only serve a single controller, so remember the last one
+    UsbManagerController_t* Controller = LastController;
+    if (Controller != NULL && Controller->Device.Base.Id == Device) {
+        return Controller;
+    }
+
     foreach(cNode, &Controllers) {
-        UsbManagerController_t *Controller = (UsbManagerController_t*)cNode->Data;
+        Controller = (UsbManagerController_t*)cNode->Data;
         if (Controller->Device.Base.Id == Device) {
+            LastController = Controller;
             return Controller;
         }
     }
     return NULL;
 }
 
-int
-UsbManagerGetToggle(
+static UsbManagerEndpoint_t*
+UsbManagerGetEndpoint(
     _In_ UUId_t          Device,
     _In_ UsbHcAddress_t* Address)
 {
-    DataKey_t Key;
-    UUId_t    Pipe;
-
-    // Create an unique id for this endpoint
-    Pipe = ((uint32_t)Address->DeviceAddress << 8)  | Address->EndpointAddress;
-    Key.Value.Integer = (int)Pipe;
-
-    // Iterate list of controllers
-    foreach(cNode, &Controllers) {
-        // Cast data of node to our type
-        UsbManagerController_t *Controller = (UsbManagerController_t*)cNode->Data;
-        if (Controller->Device.Base.Id == Device) {
-            // Locate the correct endpoint
-            foreach(eNode, Controller->Endpoints) {
-                // Cast data again
-                UsbManagerEndpoint_t *Endpoint = (UsbManagerEndpoint_t*)eNode->Data;
-                if (Endpoint->Pipe == Pipe) {
-                    return Endpoint->Toggle;
-                }
-            }
-        }
+    UsbManagerController_t* Controller = UsbManagerGetController(Device);
+    if (Controller == NULL || Address->DeviceAddress >= USB_MANAGER_DEVICE_COUNT) {
+        return NULL;
     }
+    return &Controller->Endpoints[Address->DeviceAddress]
+        [Address->EndpointAddress & (USB_MANAGER_ENDPOINT_COUNT - 1)];
+}
 
-    // Not found, create a new endpoint with toggle 0
-    // Iterate list of controllers
-    _foreach(cNode, &Controllers) {
-        // Cast data of node to our type
-        UsbManagerController_t *Controller = (UsbManagerController_t*)cNode->Data;
-        if (Controller->Device.Base.Id == Device) {
-            // Create the endpoint
-            UsbManagerEndpoint_t *Endpoint = NULL;
-            Endpoint = (UsbManagerEndpoint_t*)malloc(sizeof(UsbManagerEndpoint_t));
-            if (!Endpoint) {
-                ERROR("Ran out of memory allocating new endpoint syncs");
-                return 0;
-            }
-            
-            Endpoint->Pipe = Pipe;
-            Endpoint->Toggle = 0;
-
-            // Add it to the list
-            CollectionAppend(Controller->Endpoints, CollectionCreateNode(Key, Endpoint));
-        }
+int
+UsbManagerGetToggle(
+    _In_ UUId_t          Device,
+    _In_ UsbHcAddress_t* Address)
+{
+    UsbManagerEndpoint_t* Endpoint = UsbManagerGetEndpoint(Device, Address);
+    if (Endpoint == NULL) {
+        return 0;
     }
-    return 0;
+    return Endpoint->Toggle;
 }
 
 OsStatus_t
@@ -212,51 +207,12 @@ UsbManagerSetToggle(
     _In_ UsbHcAddress_t* Address,
     _In_ int             Toggle)
 {
-    DataKey_t Key;
-    UUId_t    Pipe;
-
-    // Create an unique id for this endpoint
-    Pipe = ((uint32_t)Address->DeviceAddress << 8)  | Address->EndpointAddress;
-    Key.Value.Integer = (int)Pipe;
-
-    // Iterate list of controllers
-    foreach(cNode, &Controllers) {
-        // Cast data of node to our type
-        UsbManagerController_t *Controller = (UsbManagerController_t*)cNode->Data;
-        if (Controller->Device.Base.Id == Device) {
-            // Locate the correct endpoint
-            foreach(eNode, Controller->Endpoints) {
-                // Cast data again
-                UsbManagerEndpoint_t *Endpoint = (UsbManagerEndpoint_t*)eNode->Data;
-                if (Endpoint->Pipe == Pipe) {
-                    Endpoint->Toggle = Toggle;
-                    return OsSuccess;
-                }
-            }
-        }
+    UsbManagerEndpoint_t* Endpoint = UsbManagerGetEndpoint(Device, Address);
+    if (Endpoint == NULL) {
+        return OsInvalidParameters;
     }
-
-    // Not found, create a new endpoint with given toggle
-    // Iterate list of controllers
-    _foreach(cNode, &Controllers) {
-        // Cast data of node to our type
-        UsbManagerController_t *Controller = (UsbManagerController_t*)cNode->Data;
-        if (Controller->Device.Base.Id == Device) {
-            // Create the endpoint
-            UsbManagerEndpoint_t *Endpoint = NULL;
-            Endpoint = (UsbManagerEndpoint_t*)malloc(sizeof(UsbManagerEndpoint_t));
-            if (!Endpoint) {
-                return OsOutOfMemory;
-            }
-            
-            Endpoint->Pipe      = Pipe;
-            Endpoint->Toggle    = Toggle;
-
-            // Add it to the list
-            return CollectionAppend(Controller->Endpoints, CollectionCreateNode(Key, Endpoint));
-        }
-    }
-    return OsError;
+    Endpoint->Toggle = (uint8_t)(Toggle & 1);
+    return OsSuccess;
 }
 
 void ctt_usbhost_reset_endpoint_callback(struct gracht_recv_message* message, struct ctt_usbhost_reset_endpoint_args* args)
@@ -292,6 +248,7 @@ UsbManagerFinalizeTransfer(
     else {
         // Should we notify the user here?...
         UsbManagerSendNotification(Transfer);
+        UsbManagerDestroyStream(Controller, Transfer);
 
         // Now run through transactions and check if any are ready to run
         _foreach(Node, Controller->TransactionList) {
@@ -306,6 +263,7 @@ UsbManagerFinalizeTransfer(
                 break;
             }
         }
+        CompletionQueueRemove(&Controller->Completions, &Transfer->Completion);
         UsbManagerDestroyTransfer(Transfer);
         return OsSuccess;
     }
@@ -323,6 +281,7 @@ UsbManagerClearTransfers(
         UsbManagerFinalizeTransfer(Controller, Transfer);
     }
     CollectionClear(Controller->TransactionList);
+    CompletionQueueClear(&Controller->Completions);
 }
 
 OsStatus_t
@@ -405,7 +364,8 @@ UsbManagerProcessTransfer(
     
     // Has the transfer been marked for cleanup?
     if (Transfer->Flags & TransferFlagCleanup) {
-        if (Transfer->EndpointDescriptor != NULL) {
+        // Streams free their elements when the transfer is finalized
+        if (Transfer->EndpointDescriptor != NULL && Transfer->Stream == NULL) {
             UsbManagerIterateChain(Controller, Transfer->EndpointDescriptor, 
                 USB_CHAIN_DEPTH, USB_REASON_CLEANUP, HciProcessElement, Transfer);
             Transfer->EndpointDescriptor = NULL; // Reset
@@ -420,6 +380,12 @@ UsbManagerProcessTransfer(
     if (Transfer->Status != TransferQueued) {
         return ITERATOR_CONTINUE;
     }
+
+    // Streams complete segment by segment and are never restarted as a whole
+    if (Transfer->Stream != NULL) {
+        UsbManagerProcessStream(Controller, Transfer);
+        return ITERATOR_CONTINUE;
+    }
     
     // Debug
     TRACE("> Validation transfer(Id %u, Status %u)", Transfer->Id, Transfer->Status);
@@ -468,6 +434,54 @@ UsbManagerProcessTransfers(
     UsbManagerIterateTransfers(Controller, UsbManagerProcessTransfer, NULL);
 }
 
+void
+UsbManagerQueueTransferCompletion(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer)
+{
+    CompletionQueuePush(&Controller->Completions, &Transfer->Completion);
+}
+
+void
+UsbManagerQueueCompletion(
+    _In_ UsbManagerController_t* Controller,
+    _In_ uint8_t*                Element)
+{
+    UsbManagerTransfer_t* Transfer = (UsbManagerTransfer_t*)
+        UsbSchedulerGetElementOwner(Controller->Scheduler, Element);
+    if (Transfer != NULL) {
+        UsbManagerQueueTransferCompletion(Controller, Transfer);
+    }
+}
+
+void
+UsbManagerCompleteTransfer(
+    _In_ CompletionEntry_t* Entry,
+    _In_ void*              Context)
+{
+    UsbManagerController_t* Controller = (UsbManagerController_t*)Context;
+    UsbManagerTransfer_t*   Transfer   = COMPLETION_ENTRY_OWNER(Entry, UsbManagerTransfer_t, Completion);
+    CollectionItem_t*       Node       = Transfer->ListNode;
+
+    // The transfer is gone once it asks to be removed, so keep its node
+    if (UsbManagerProcessTransfer(Controller, Transfer, NULL) & ITERATOR_REMOVE) {
+        if (Node != NULL) {
+            CollectionUnlinkNode(Controller->TransactionList, Node);
+            CollectionDestroyNode(Controller->TransactionList, Node);
+        }
+    }
+}
+
+int
+UsbManagerProcessCompletions(
+    _In_ UsbManagerController_t* Controller)
+{
+    // Transfers are taken one at the time, processing a transfer may finalize
+    // and queue others
+    CompletionQueueDrain(&Controller->Completions, USB_COMPLETION_BUDGET);
+    return CompletionQueuePending(&Controller->Completions);
+}
+
 void
 UsbManagerIterateChain(
     _In_ UsbManagerController_t*     Controller,
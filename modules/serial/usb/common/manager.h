@@ -32,9 +32,15 @@
 #include "transfer.h"
 #include "scheduler.h"
 
+/* UsbManagerEndpoint
+ * Endpoint state is kept in a table per controller indexed directly by the
+ * device address and endpoint number. */
+#define USB_MANAGER_DEVICE_COUNT   128
+#define USB_MANAGER_ENDPOINT_COUNT 16
+#define USB_COMPLETION_BUDGET      16 // Transfers completed per call to UsbManagerProcessCompletions
+
 typedef struct _UsbManagerEndpoint {
-    UUId_t Pipe;
-    int    Toggle;
+    uint8_t Toggle;
 } UsbManagerEndpoint_t;
 
 typedef struct _UsbManagerController {
@@ -49,9 +55,10 @@ typedef struct _UsbManagerController {
     DeviceIo_t*         IoBase;
     UsbScheduler_t*     Scheduler;
 
-    Collection_t*       Endpoints;
-    Collection_t*       TransactionList;
-    spinlock_t          Lock;
+    UsbManagerEndpoint_t  Endpoints[USB_MANAGER_DEVICE_COUNT][USB_MANAGER_ENDPOINT_COUNT];
+    Collection_t*         TransactionList;
+    CompletionQueue_t     Completions;
+    spinlock_t            Lock;
 } UsbManagerController_t;
 
 #define USB_OUT_OF_RESOURCES       (void*)0
@@ -117,6 +124,14 @@ __EXTERN void
 UsbManagerClearTransfers(
     _In_ UsbManagerController_t* Controller);
 
+/* UsbManagerRegisterTransfer
+ * Adds the transfer to the list of transfers associated with the controller,
+ * if it's not already present. */
+__EXTERN void
+UsbManagerRegisterTransfer(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer);
+
 /* UsbManagerIterateTransfers
  * Iterate the transfers associated with the given controller. The iteration
  * flow can be controlled with the return codes. */
@@ -181,6 +196,38 @@ __EXTERN void
 UsbManagerProcessTransfers(
     _In_ UsbManagerController_t* Controller);
 
+/* UsbManagerQueueCompletion
+ * Routes the scheduler element back to the transfer that owns it, and queues the
+ * transfer for processing. Controllers that know which elements completed use this
+ * together with <UsbManagerProcessCompletions> instead of scanning every transfer. */
+__EXTERN void
+UsbManagerQueueCompletion(
+    _In_ UsbManagerController_t* Controller,
+    _In_ uint8_t*                Element);
+
+/* UsbManagerQueueTransferCompletion
+ * Queues the transfer for processing by <UsbManagerProcessCompletions>. */
+__EXTERN void
+UsbManagerQueueTransferCompletion(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer);
+
+/* UsbManagerCompleteTransfer
+ * Callback of the completion queue, controllers register it for
+ * Controller->Completions when they are created. */
+__EXTERN void
+UsbManagerCompleteTransfer(
+    _In_ CompletionEntry_t* Entry,
+    _In_ void*              Context);
+
+/* UsbManagerProcessCompletions
+ * Processes at most USB_COMPLETION_BUDGET of the transfers that have been queued
+ * for completion. The iteration process will invoke <HciProcessElement>. Returns
+ * the number of transfers that are still queued. */
+__EXTERN int
+UsbManagerProcessCompletions(
+    _In_ UsbManagerController_t* Controller);
+
 /* UsbManagerScheduleTransfers
  * Handles all transfers that are marked for either Schedule or Unscheduling.
  * The iteration process will invoke <HciProcessElement> */
@@ -49,27 +49,41 @@ UsbSchedulerResetInternalData(
 
     // Start out by zeroing out memory
     if (ResetElements) {
+        spinlock_acquire(&Scheduler->Lock);
         for (i = 0; i < Scheduler->Settings.PoolCount; i++) {
-            memset((void*)Scheduler->Settings.Pools[i].ElementPool, 0, (Scheduler->Settings.Pools[i].ElementCount * Scheduler->Settings.Pools[i].ElementAlignedSize));
+            UsbSchedulerPool_t* sPool = &Scheduler->Settings.Pools[i];
+            memset((void*)sPool->ElementPool, 0, (sPool->ElementCount * sPool->ElementAlignedSize));
             
             // Allocate and initialze all the reserved elements
-            for (j = 0; j < Scheduler->Settings.Pools[i].ElementCountReserved; j++) {
-                uint8_t *Element              = USB_ELEMENT_INDEX((&Scheduler->Settings.Pools[i]), j);
-                UsbSchedulerObject_t *sObject = USB_ELEMENT_OBJECT((&Scheduler->Settings.Pools[i]), Element);
+            for (j = 0; j < sPool->ElementCountReserved; j++) {
+                uint8_t *Element              = USB_ELEMENT_INDEX(sPool, j);
+                UsbSchedulerObject_t *sObject = USB_ELEMENT_OBJECT(sPool, Element);
                 sObject->Index                = USB_ELEMENT_CREATE_INDEX(i, j);
                 sObject->BreathIndex          = USB_ELEMENT_NO_INDEX;
                 sObject->DepthIndex           = USB_ELEMENT_NO_INDEX;
                 sObject->Flags                = USB_ELEMENT_ALLOCATED;
             }
+
+            // Rebuild the free list so the lowest indices are handed out first
+            sPool->FreeCount     = 0;
+            sPool->ElementsInUse = 0;
+            memset((void*)sPool->Owners, 0, sPool->ElementCount * sizeof(void*));
+            for (j = (int)sPool->ElementCount - 1; j >= (int)sPool->ElementCountReserved; j--) {
+                sPool->FreeList[sPool->FreeCount++] = (uint16_t)j;
+            }
         }
+        spinlock_release(&Scheduler->Lock);
     }
     if (ResetFramelist) {
         reg32_t NoLink = (Scheduler->Settings.Flags & USB_SCHEDULER_LINK_BIT_EOL) ? USB_ELEMENT_LINK_END : 0;
-        memset((void*)Scheduler->Settings.FrameList, 0, (Scheduler->Settings.FrameCount * 4));
         memset((void*)Scheduler->VirtualFrameList, 0, (Scheduler->Settings.FrameCount * sizeof(uintptr_t)));
         memset((void*)Scheduler->Bandwidth, 0, (Scheduler->Settings.FrameCount * Scheduler->Settings.SubframeCount * sizeof(size_t)));
-        for (i = 0; i < Scheduler->Settings.FrameCount; i++) {
-            Scheduler->Settings.FrameList[i] = NoLink;
+        
+        // Controllers that schedule in hardware (xhci) have no framelist
+        if (Scheduler->Settings.FrameList != NULL) {
+            for (i = 0; i < Scheduler->Settings.FrameCount; i++) {
+                Scheduler->Settings.FrameList[i] = NoLink;
+            }
         }
     }
     return OsSuccess;
@@ -101,6 +115,14 @@ AllocateMemoryForPool(
 
     TRACE("... address 0x%" PRIxIN, Pool->ElementPoolDMATable.entries[0].address);
     Pool->ElementPool = Pool->ElementPoolDMA.buffer;
+
+    // Indices are 13 bits, so the free list can use 16 bit entries
+    assert(Pool->ElementCount <= (USB_ELEMENT_INDEX_MASK + 1));
+    Pool->FreeList = (uint16_t*)malloc(Pool->ElementCount * sizeof(uint16_t));
+    Pool->Owners   = (void**)malloc(Pool->ElementCount * sizeof(void*));
+    if (!Pool->FreeList || !Pool->Owners) {
+        return OsOutOfMemory;
+    }
     return OsSuccess;
 }
 
@@ -157,6 +179,10 @@ UsbSchedulerInitialize(
     memset((void*)Scheduler, 0, sizeof(UsbScheduler_t));
     spinlock_init(&Scheduler->Lock, spinlock_plain);
     memcpy((void*)&Scheduler->Settings, Settings, sizeof(UsbSchedulerSettings_t));
+    for (i = 0; i < Scheduler->Settings.PoolCount; i++) {
+        Scheduler->Settings.Pools[i].FreeList = NULL;
+        Scheduler->Settings.Pools[i].Owners   = NULL;
+    }
 
     // Start out by allocating the frame list if requested by the user
     if (Scheduler->Settings.Flags & USB_SCHEDULER_FRAMELIST) {
@@ -206,6 +232,15 @@ static void
 FreePoolMemory(
     _In_ UsbSchedulerPool_t* Pool)
 {
+    if (Pool->FreeList != NULL) {
+        free(Pool->FreeList);
+        Pool->FreeList = NULL;
+    }
+    if (Pool->Owners != NULL) {
+        free(Pool->Owners);
+        Pool->Owners = NULL;
+    }
+
     if (!Pool->ElementPoolDMA.buffer) {
         return;
     }
@@ -326,46 +361,145 @@ UsbSchedulerGetPoolFromElement(
     return OsError;
 }
 
+/* UsbSchedulerPopElement
+ * Takes the next element from the free list, the scheduler lock must be held. Elements
+ * on the free list have already been cleared when they were freed. */
+static uint8_t*
+UsbSchedulerPopElement(
+    _In_ UsbSchedulerPool_t* sPool,
+    _In_ int                 Pool)
+{
+    UsbSchedulerObject_t* sObject;
+    uint8_t*              Element;
+    uint16_t              Index;
+
+    if (!sPool->FreeCount) {
+        sPool->AllocationFailures++;
+        return NULL;
+    }
+
+    Index   = sPool->FreeList[--sPool->FreeCount];
+    Element = USB_ELEMENT_INDEX(sPool, Index);
+    sObject = USB_ELEMENT_OBJECT(sPool, Element);
+
+    sObject->Index       = USB_ELEMENT_CREATE_INDEX(Pool, Index);
+    sObject->BreathIndex = USB_ELEMENT_NO_INDEX;
+    sObject->DepthIndex  = USB_ELEMENT_NO_INDEX;
+    sObject->Flags       = USB_ELEMENT_ALLOCATED;
+
+    sPool->ElementsInUse++;
+    if (sPool->ElementsInUse > sPool->ElementsPeak) {
+        sPool->ElementsPeak = sPool->ElementsInUse;
+    }
+    return Element;
+}
+
 OsStatus_t
 UsbSchedulerAllocateElement(
     _In_  UsbScheduler_t* Scheduler,
     _In_  int             Pool,
     _Out_ uint8_t**       ElementOut)
 {
-    UsbSchedulerObject_t* sObject = NULL;
-    UsbSchedulerPool_t*   sPool   = NULL;
-    size_t                i;
+    UsbSchedulerPool_t* sPool = NULL;
 
     // Get pool
     assert(ElementOut != NULL);
     assert(Pool < Scheduler->Settings.PoolCount);
     sPool = &Scheduler->Settings.Pools[Pool];
-    
-    // Reset output value
-    *ElementOut = NULL;
 
     // Now, we usually allocated new descriptors for interrupts
     // and isoc, but it doesn't make sense for us as we keep one
     // large pool of TDs, just allocate from that in any case
     spinlock_acquire(&Scheduler->Lock);
-    for (i = sPool->ElementCountReserved; i < sPool->ElementCount; i++) {
-        uint8_t *Element = USB_ELEMENT_INDEX(sPool, i);
-        sObject          = USB_ELEMENT_OBJECT(sPool, Element);
-        if (sObject->Flags & USB_ELEMENT_ALLOCATED) {
-            continue;
-        }
+    *ElementOut = UsbSchedulerPopElement(sPool, Pool);
+    spinlock_release(&Scheduler->Lock);
+    if (*ElementOut == NULL) {
+        TRACE("UsbSchedulerAllocateElement(Pool %i) pool exhausted, %u failures",
+            Pool, sPool->AllocationFailures);
+        return OsError;
+    }
+    return OsSuccess;
+}
 
-        // Found one, reset
-        memset((void*)Element, 0, sPool->ElementAlignedSize);
-        sObject->Index       = USB_ELEMENT_CREATE_INDEX(Pool, i);
-        sObject->BreathIndex = USB_ELEMENT_NO_INDEX;
-        sObject->DepthIndex  = USB_ELEMENT_NO_INDEX;
-        sObject->Flags       = USB_ELEMENT_ALLOCATED;
-        *ElementOut          = Element;
-        break;
+OsStatus_t
+UsbSchedulerAllocateElements(
+    _In_  UsbScheduler_t* Scheduler,
+    _In_  int             Pool,
+    _In_  int             Count,
+    _Out_ uint8_t**       ElementsOut,
+    _Out_ int*            CountOut)
+{
+    UsbSchedulerPool_t* sPool     = NULL;
+    int                 Allocated = 0;
+
+    assert(ElementsOut != NULL);
+    assert(CountOut != NULL);
+    assert(Pool < Scheduler->Settings.PoolCount);
+    sPool = &Scheduler->Settings.Pools[Pool];
+
+    spinlock_acquire(&Scheduler->Lock);
+    while (Allocated < Count) {
+        uint8_t* Element = UsbSchedulerPopElement(sPool, Pool);
+        if (Element == NULL) {
+            break;
+        }
+        ElementsOut[Allocated++] = Element;
     }
     spinlock_release(&Scheduler->Lock);
-    return (i == sPool->ElementCount) ? OsError : OsSuccess;
+
+    *CountOut = Allocated;
+    return (Allocated == 0) ? OsError : OsSuccess;
+}
+
+void
+UsbSchedulerGetPoolStatistics(
+    _In_      UsbScheduler_t* Scheduler,
+    _In_      int             Pool,
+    _Out_Opt_ size_t*         InUse,
+    _Out_Opt_ size_t*         Peak,
+    _Out_Opt_ size_t*         Failures)
+{
+    UsbSchedulerPool_t* sPool;
+
+    assert(Pool < Scheduler->Settings.PoolCount);
+    sPool = &Scheduler->Settings.Pools[Pool];
+    if (InUse != NULL) {
+        *InUse = sPool->ElementsInUse;
+    }
+    if (Peak != NULL) {
+        *Peak = sPool->ElementsPeak;
+    }
+    if (Failures != NULL) {
+        *Failures = sPool->AllocationFailures;
+    }
+}
+
+void
+UsbSchedulerSetElementOwner(
+    _In_ UsbScheduler_t* Scheduler,
+    _In_ uint8_t*        Element,
+    _In_ void*           Owner)
+{
+    UsbSchedulerObject_t* sObject = NULL;
+    UsbSchedulerPool_t*   sPool   = NULL;
+    OsStatus_t            Result  = UsbSchedulerGetPoolFromElement(Scheduler, Element, &sPool);
+    assert(Result == OsSuccess);
+    sObject = USB_ELEMENT_OBJECT(sPool, Element);
+    sPool->Owners[sObject->Index & USB_ELEMENT_INDEX_MASK] = Owner;
+}
+
+void*
+UsbSchedulerGetElementOwner(
+    _In_ UsbScheduler_t* Scheduler,
+    _In_ uint8_t*        Element)
+{
+    UsbSchedulerObject_t* sObject = NULL;
+    UsbSchedulerPool_t*   sPool   = NULL;
+    if (UsbSchedulerGetPoolFromElement(Scheduler, Element, &sPool) != OsSuccess) {
+        return NULL;
+    }
+    sObject = USB_ELEMENT_OBJECT(sPool, Element);
+    return sPool->Owners[sObject->Index & USB_ELEMENT_INDEX_MASK];
 }
 
 OsStatus_t
@@ -480,24 +614,17 @@ UsbSchedulerTryAllocateBandwidth(
 }
 
 OsStatus_t
-UsbSchedulerAllocateBandwidth(
+UsbSchedulerReserveBandwidth(
     _In_ UsbScheduler_t*            Scheduler,
     _In_ UsbHcEndpointDescriptor_t* Endpoint,
     _In_ size_t                     BytesToTransfer,
     _In_ UsbTransferType_t          Type,
     _In_ UsbSpeed_t                 Speed,
-    _In_ uint8_t*                   Element)
+    _In_ UsbSchedulerObject_t*      sObject)
 {
-    UsbSchedulerObject_t* sObject              = NULL;
-    UsbSchedulerPool_t*   sPool                = NULL;
-    OsStatus_t            Result               = OsSuccess;
-    int                   NumberOfTransactions = 0;
-    int                   Exponent             = 0;
-
-    // Validate element and lookup pool
-    Result = UsbSchedulerGetPoolFromElement(Scheduler, Element, &sPool);
-    assert(Result == OsSuccess);
-    sObject = USB_ELEMENT_OBJECT(sPool, Element);
+    OsStatus_t Result               = OsSuccess;
+    int        NumberOfTransactions = 0;
+    int        Exponent             = 0;
 
     // Calculate the required number of transactions based on the MPS
     NumberOfTransactions = DIVUP(BytesToTransfer, Endpoint->MaxPacketSize);
@@ -550,19 +677,34 @@ UsbSchedulerAllocateBandwidth(
 }
 
 OsStatus_t
-UsbSchedulerFreeBandwidth(
-    _In_  UsbScheduler_t* Scheduler,
-    _In_  uint8_t*        Element)
+UsbSchedulerAllocateBandwidth(
+    _In_ UsbScheduler_t*            Scheduler,
+    _In_ UsbHcEndpointDescriptor_t* Endpoint,
+    _In_ size_t                     BytesToTransfer,
+    _In_ UsbTransferType_t          Type,
+    _In_ UsbSpeed_t                 Speed,
+    _In_ uint8_t*                   Element)
 {
-    UsbSchedulerObject_t* sObject = NULL;
-    UsbSchedulerPool_t*   sPool   = NULL;
-    OsStatus_t            Result  = OsSuccess;
-    size_t                i, j;
+    UsbSchedulerPool_t* sPool  = NULL;
+    OsStatus_t          Result = OsSuccess;
 
     // Validate element and lookup pool
     Result = UsbSchedulerGetPoolFromElement(Scheduler, Element, &sPool);
     assert(Result == OsSuccess);
-    sObject = USB_ELEMENT_OBJECT(sPool, Element);
+    return UsbSchedulerReserveBandwidth(Scheduler, Endpoint, BytesToTransfer,
+        Type, Speed, USB_ELEMENT_OBJECT(sPool, Element));
+}
+
+void
+UsbSchedulerReleaseBandwidth(
+    _In_ UsbScheduler_t*       Scheduler,
+    _In_ UsbSchedulerObject_t* sObject)
+{
+    size_t i, j;
+
+    if (!(sObject->Flags & USB_ELEMENT_BANDWIDTH)) {
+        return;
+    }
 
     // Iterate the requested period and clean up
     spinlock_acquire(&Scheduler->Lock);
@@ -582,8 +724,8 @@ UsbSchedulerFreeBandwidth(
             }
         }
     }
+    sObject->Flags &= ~(USB_ELEMENT_BANDWIDTH);
     spinlock_release(&Scheduler->Lock);
-    return Result;
 }
 
 void
@@ -602,9 +744,22 @@ UsbSchedulerFreeElement(
 
     // Should we free bandwidth?
     if (sObject->Flags & USB_ELEMENT_BANDWIDTH) {
-        UsbSchedulerFreeBandwidth(Scheduler, Element);
+        UsbSchedulerReleaseBandwidth(Scheduler, sObject);
+    }
+
+    // Clear the element now so allocation does not have to, the padding
+    // up to the alignment is never written and stays clear
+    spinlock_acquire(&Scheduler->Lock);
+    if (sObject->Flags & USB_ELEMENT_ALLOCATED) {
+        uint16_t Index = sObject->Index & USB_ELEMENT_INDEX_MASK;
+        memset((void*)Element, 0, sPool->ElementBaseSize);
+        sPool->Owners[Index] = NULL;
+        if (Index >= sPool->ElementCountReserved) {
+            sPool->FreeList[sPool->FreeCount++] = Index;
+            sPool->ElementsInUse--;
+        }
     }
-    memset((void*)Element, 0, sPool->ElementAlignedSize);
+    spinlock_release(&Scheduler->Lock);
 }
 
 uintptr_t
@@ -102,6 +102,15 @@ typedef struct _UsbSchedulerPool {
     struct dma_attachment ElementPoolDMA;         // Frame element pool DMA attachment
     struct dma_sg_table   ElementPoolDMATable;
     uint8_t*              ElementPool;
+
+    uint16_t* FreeList;                   // Stack of free element indices
+    size_t    FreeCount;                  // Number of indices on the stack
+    void**    Owners;                     // Owner of each element, usually a transfer
+
+    // Pool pressure statistics
+    size_t    ElementsInUse;
+    size_t    ElementsPeak;
+    size_t    AllocationFailures;
 } UsbSchedulerPool_t;
 
 typedef struct _UsbSchedulerSettings {
@@ -234,6 +243,18 @@ UsbSchedulerAllocateElement(
     _In_  int                       Pool,
     _Out_ uint8_t**                 ElementOut);
 
+/* UsbSchedulerAllocateElements
+ * Allocates up to Count elements from the pool while holding the lock once. The number
+ * of elements allocated is returned in CountOut, which can be less than requested if the
+ * pool is running out. Returns OsError if no elements could be allocated. */
+__EXTERN OsStatus_t
+UsbSchedulerAllocateElements(
+    _In_  UsbScheduler_t*           Scheduler,
+    _In_  int                       Pool,
+    _In_  int                       Count,
+    _Out_ uint8_t**                 ElementsOut,
+    _Out_ int*                      CountOut);
+
 /* UsbSchedulerFreeElement
  * Releases the previously allocated element by resetting it. This call automatically
  * frees any bandwidth associated with the element. */
@@ -242,6 +263,33 @@ UsbSchedulerFreeElement(
     _In_ UsbScheduler_t*            Scheduler,
     _In_ uint8_t*                   Element);
 
+/* UsbSchedulerGetPoolStatistics
+ * Retrieves the number of elements in use, the highest number of elements that have been
+ * in use at once and the number of allocations that failed because the pool was empty. */
+__EXTERN void
+UsbSchedulerGetPoolStatistics(
+    _In_      UsbScheduler_t*           Scheduler,
+    _In_      int                       Pool,
+    _Out_Opt_ size_t*                   InUse,
+    _Out_Opt_ size_t*                   Peak,
+    _Out_Opt_ size_t*                   Failures);
+
+/* UsbSchedulerSetElementOwner
+ * Associates an owner with the element, which can be retrieved from the element
+ * again by <UsbSchedulerGetElementOwner>. The owner is cleared when the element is freed. */
+__EXTERN void
+UsbSchedulerSetElementOwner(
+    _In_ UsbScheduler_t* Scheduler,
+    _In_ uint8_t*        Element,
+    _In_ void*           Owner);
+
+/* UsbSchedulerGetElementOwner
+ * Retrieves the owner associated with the element. */
+__EXTERN void*
+UsbSchedulerGetElementOwner(
+    _In_ UsbScheduler_t* Scheduler,
+    _In_ uint8_t*        Element);
+
 /* UsbSchedulerAllocateBandwidth
  * Allocates bandwidth for a scheduler element. The bandwidth will automatically
  * be fitted into where is best place on schedule. If there is no more room it will
@@ -255,6 +303,26 @@ UsbSchedulerAllocateBandwidth(
 	_In_ UsbSpeed_t                 Speed,
     _In_ uint8_t*                   Element);
 
+/* UsbSchedulerReserveBandwidth
+ * Same as UsbSchedulerAllocateBandwidth, but for a scheduler object that is not part of
+ * an element. Used for streams that keep their reservation while the elements that
+ * execute it are recycled. */
+__EXTERN OsStatus_t
+UsbSchedulerReserveBandwidth(
+    _In_ UsbScheduler_t*            Scheduler,
+    _In_ UsbHcEndpointDescriptor_t* Endpoint,
+    _In_ size_t                     BytesToTransfer,
+    _In_ UsbTransferType_t          Type,
+    _In_ UsbSpeed_t                 Speed,
+    _In_ UsbSchedulerObject_t*      Object);
+
+/* UsbSchedulerReleaseBandwidth
+ * Releases the bandwidth reserved by the scheduler object, if any. */
+__EXTERN void
+UsbSchedulerReleaseBandwidth(
+    _In_ UsbScheduler_t*       Scheduler,
+    _In_ UsbSchedulerObject_t* Object);
+
 /* UsbSchedulerChainElement
  * Chains up a new element to the given element chain. The root element
  * must be specified and the element to append to the chain. Also the
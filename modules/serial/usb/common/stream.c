@@ -0,0 +1,192 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * USB Isochronous Streams
+ * - Persistant isochronous transfers that keep a ring of scheduler elements,
+ *   one per segment of the stream buffer, and recycle them in place. Completions
+ *   are reported through the completion ring shared with the owner.
+ */
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hci.h"
+#include "stream.h"
+
+UsbTransferStatus_t
+UsbManagerCreateStream(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer,
+    _In_ int                     MaxElements)
+{
+    UsbManagerStream_t* Stream;
+    UsbTransaction_t*   RingTransaction = &Transfer->Transfer.Transactions[1];
+    size_t              SegmentLength   = Transfer->Transfer.Transactions[0].Length;
+    size_t              ElementCount;
+    int                 Capacity;
+    TRACE("UsbManagerCreateStream(Id %u)", Transfer->Id);
+
+    // The stream buffer must consist of whole segments, and there must be an element
+    // for each of them
+    if (Transfer->Transfer.TransactionCount != 2 || SegmentLength == 0 ||
+        RingTransaction->BufferHandle == UUID_INVALID ||
+        (Transfer->Transfer.PeriodicBufferSize % SegmentLength) != 0) {
+        return TransferInvalid;
+    }
+
+    ElementCount = Transfer->Transfer.PeriodicBufferSize / SegmentLength;
+    Capacity     = UsbIsocRingCapacity(RingTransaction->Length);
+    if (ElementCount == 0 || ElementCount > (size_t)MaxElements || !Capacity) {
+        return TransferInvalid;
+    }
+
+    Stream = (UsbManagerStream_t*)malloc(sizeof(UsbManagerStream_t));
+    if (!Stream) {
+        return TransferInvalid;
+    }
+    memset(Stream, 0, sizeof(UsbManagerStream_t));
+
+    Stream->Elements = (uint8_t**)calloc(ElementCount, sizeof(uint8_t*));
+    if (!Stream->Elements) {
+        free(Stream);
+        return TransferInvalid;
+    }
+    Stream->ElementCount  = (int)ElementCount;
+    Stream->SegmentLength = SegmentLength;
+    Stream->Capacity      = Capacity;
+    Transfer->Stream      = Stream;
+
+    // The ring is written by us from now on, make sure the owner initialized it
+    // for the length it gave us
+    if (dma_attachment_map(&Transfer->Transactions[1].DmaAttachment) != OsSuccess ||
+        (RingTransaction->BufferOffset + RingTransaction->Length) >
+            Transfer->Transactions[1].DmaAttachment.length) {
+        ERROR("[usb] [stream] failed to map the completion ring");
+        UsbManagerDestroyStream(Controller, Transfer);
+        return TransferInvalid;
+    }
+    Stream->Ring = (UsbIsocRing_t*)((uint8_t*)Transfer->Transactions[1].DmaAttachment.buffer +
+        RingTransaction->BufferOffset);
+    if (Stream->Ring->Capacity != Capacity) {
+        ERROR("[usb] [stream] completion ring is not initialized");
+        UsbManagerDestroyStream(Controller, Transfer);
+        return TransferInvalid;
+    }
+
+    // Bandwidth for a segment is reserved for as long as the stream lives, the
+    // elements only ever execute it
+    if (UsbSchedulerReserveBandwidth(Controller->Scheduler, &Transfer->Transfer.Endpoint,
+            SegmentLength, IsochronousTransfer, Transfer->Transfer.Speed,
+            &Stream->Bandwidth) != OsSuccess) {
+        UsbManagerDestroyStream(Controller, Transfer);
+        return TransferNoBandwidth;
+    }
+    return TransferQueued;
+}
+
+OsStatus_t
+UsbManagerGetStreamSegment(
+    _In_  UsbManagerTransfer_t* Transfer,
+    _In_  int                   Index,
+    _Out_ uintptr_t*            AddressOut)
+{
+    struct dma_sg_table* Table  = &Transfer->Transactions[0].DmaTable;
+    size_t               Length = Transfer->Stream->SegmentLength;
+    size_t               SgOffset;
+    int                  SgIndex;
+
+    if (dma_sg_table_offset(Table, Transfer->Transfer.Transactions[0].BufferOffset +
+            ((size_t)Index * Length), &SgIndex, &SgOffset) != OsSuccess) {
+        return OsInvalidParameters;
+    }
+
+    if (SgIndex >= Table->count || (SgOffset + Length) > Table->entries[SgIndex].length) {
+        return OsInvalidParameters;
+    }
+    *AddressOut = Table->entries[SgIndex].address + SgOffset;
+    return OsSuccess;
+}
+
+int
+UsbManagerProcessStream(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer)
+{
+    UsbManagerStream_t* Stream    = Transfer->Stream;
+    UsbIsocCompletion_t Completion;
+    int                 Completed = 0;
+
+    // Elements complete in the order they execute, so the first one that is still
+    // active ends the batch. Every element is visited at most once per batch.
+    while (Completed < Stream->ElementCount) {
+        Stream->Status           = TransferFinished;
+        Stream->BytesTransferred = 0;
+        if (HciProcessElement(Controller, Stream->Elements[Stream->Next],
+                USB_REASON_STREAM, Transfer) & ITERATOR_STOP) {
+            break;
+        }
+
+        Completion.Sequence = Stream->Sequence++;
+        Completion.Offset   = (uint32_t)((size_t)Stream->Next * Stream->SegmentLength);
+        Completion.Length   = (uint32_t)Stream->BytesTransferred;
+        Completion.Status   = (int)Stream->Status;
+        if (UsbIsocRingPush(Stream->Ring, Stream->Capacity, &Completion)) {
+            TRACE("[usb] [stream] completion ring is full, segment %u dropped", Completion.Sequence);
+        }
+
+        Stream->Next = (Stream->Next + 1) % Stream->ElementCount;
+        Completed++;
+    }
+
+    if (Completed) {
+        UsbIsocRingSignal(Stream->Ring);
+    }
+    return Completed;
+}
+
+void
+UsbManagerDestroyStream(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer)
+{
+    UsbManagerStream_t* Stream = Transfer->Stream;
+    int                 i;
+
+    if (!Stream) {
+        return;
+    }
+
+    for (i = 0; i < Stream->ElementCount; i++) {
+        if (Stream->Elements[i] != NULL) {
+            HciProcessElement(Controller, Stream->Elements[i], USB_REASON_CLEANUP, Transfer);
+        }
+    }
+    UsbSchedulerReleaseBandwidth(Controller->Scheduler, &Stream->Bandwidth);
+
+    if (Transfer->Transactions[1].DmaAttachment.buffer != NULL) {
+        dma_attachment_unmap(&Transfer->Transactions[1].DmaAttachment);
+    }
+
+    Transfer->EndpointDescriptor = NULL;
+    Transfer->Stream             = NULL;
+    free(Stream->Elements);
+    free(Stream);
+}
@@ -0,0 +1,87 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * USB Isochronous Streams
+ * - Persistant isochronous transfers that keep a ring of scheduler elements,
+ *   one per segment of the stream buffer, and recycle them in place. Completions
+ *   are reported through the completion ring shared with the owner.
+ */
+
+#ifndef __USB_STREAM__
+#define __USB_STREAM__
+
+#include <ddk/usb.h>
+#include "manager.h"
+
+#define USB_REASON_STREAM           7
+
+typedef struct UsbManagerStream {
+    UsbIsocRing_t*       Ring;
+    int                  Capacity;       // Validated once, the ring header is owner writable
+    uint8_t**            Elements;       // In the order they execute
+    int                  ElementCount;
+    int                  Next;           // The oldest element still in flight
+    uint32_t             Sequence;
+    size_t               SegmentLength;
+    UsbSchedulerObject_t Bandwidth;      // Reserved once for the lifetime of the stream
+
+    // Result of the element processed with USB_REASON_STREAM
+    UsbTransferStatus_t  Status;
+    size_t               BytesTransferred;
+} UsbManagerStream_t;
+
+/* UsbManagerCreateStream
+ * Validates the stream transfer, maps the completion ring and reserves the
+ * bandwidth of a segment. The controller allocates the elements afterwards, one
+ * for each segment, and stores them in Elements. */
+__EXTERN UsbTransferStatus_t
+UsbManagerCreateStream(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer,
+    _In_ int                     MaxElements);
+
+/* UsbManagerGetStreamSegment
+ * Retrieves the physical address of a segment, segments must not cross the
+ * physical ranges of the buffer. */
+__EXTERN OsStatus_t
+UsbManagerGetStreamSegment(
+    _In_  UsbManagerTransfer_t* Transfer,
+    _In_  int                   Index,
+    _Out_ uintptr_t*            AddressOut);
+
+/* UsbManagerProcessStream
+ * Processes the elements that completed in the order they execute, invoking
+ * HciProcessElement with USB_REASON_STREAM. The controller returns ITERATOR_STOP
+ * for an element that is still active, otherwise it stores the result in the stream
+ * and rearms the element. The owner is woken once per batch. Returns the number of
+ * segments completed. */
+__EXTERN int
+UsbManagerProcessStream(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer);
+
+/* UsbManagerDestroyStream
+ * Frees the elements, which must be unlinked by the controller, releases the
+ * bandwidth and unmaps the completion ring. */
+__EXTERN void
+UsbManagerDestroyStream(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer);
+
+#endif //!__USB_STREAM__
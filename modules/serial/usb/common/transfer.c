@@ -41,7 +41,9 @@ UsbManagerTransfer_t*
 UsbManagerCreateTransfer(
     _In_ UsbTransfer_t*              transfer,
     _In_ struct gracht_recv_message* message,
-    _In_ UUId_t                      deviceId)
+    _In_ UUId_t                      deviceId,
+    _In_ UUId_t                      processId,
+    _In_ UUId_t                      requestId)
 {
     UsbManagerTransfer_t* usbTransfer;
     int                   i;
@@ -59,9 +61,11 @@ UsbManagerCreateTransfer(
     
     gracht_vali_message_defer_response(&usbTransfer->DeferredMessage, message);
     
-    usbTransfer->DeviceId = deviceId;
-    usbTransfer->Id       = __GlbTransferId++;
-    usbTransfer->Status   = TransferNotProcessed;
+    usbTransfer->DeviceId  = deviceId;
+    usbTransfer->ProcessId = processId;
+    usbTransfer->RequestId = requestId;
+    usbTransfer->Id        = __GlbTransferId++;
+    usbTransfer->Status    = TransferNotProcessed;
     
     // When attaching to dma buffers make sure we don't attach
     // multiple times as we can then save a system call or two
@@ -176,7 +180,8 @@ UsbManagerSendNotification(
 
 void ctt_usbhost_queue_async_callback(struct gracht_recv_message* message, struct ctt_usbhost_queue_async_args* args)
 {
-    UsbManagerTransfer_t* transfer = UsbManagerCreateTransfer(args->transfer, message, args->device_id);
+    UsbManagerTransfer_t* transfer = UsbManagerCreateTransfer(args->transfer, message, args->device_id,
+        args->process_id, args->transfer_id);
     UsbTransferStatus_t   status   = HciQueueTransferGeneric(transfer);
     if (status != OsSuccess) {
         ctt_usbhost_queue_async_response(message, transfer->Id, status, 0);
@@ -185,7 +190,8 @@ void ctt_usbhost_queue_async_callback(struct gracht_recv_message* message, struc
 
 void ctt_usbhost_queue_callback(struct gracht_recv_message* message, struct ctt_usbhost_queue_args* args)
 {
-    UsbManagerTransfer_t* transfer = UsbManagerCreateTransfer(args->transfer, message, args->device_id);
+    UsbManagerTransfer_t* transfer = UsbManagerCreateTransfer(args->transfer, message, args->device_id,
+        args->process_id, args->transfer_id);
     UsbTransferStatus_t   status   = HciQueueTransferGeneric(transfer);
     if (status != OsSuccess) {
         ctt_usbhost_queue_response(message, status, 0);
@@ -194,7 +200,8 @@ void ctt_usbhost_queue_callback(struct gracht_recv_message* message, struct ctt_
 
 void ctt_usbhost_queue_periodic_callback(struct gracht_recv_message* message, struct ctt_usbhost_queue_periodic_args* args)
 {
-    UsbManagerTransfer_t* transfer = UsbManagerCreateTransfer(args->transfer, message, args->device_id);
+    UsbManagerTransfer_t* transfer = UsbManagerCreateTransfer(args->transfer, message, args->device_id,
+        args->process_id, args->transfer_id);
     UsbTransferStatus_t   status;
     
     if (transfer->Transfer.Type == IsochronousTransfer) {
@@ -213,17 +220,23 @@ void ctt_usbhost_dequeue_callback(struct gracht_recv_message* message, struct ct
     UsbManagerController_t* controller = UsbManagerGetController(args->device_id);
     UsbManagerTransfer_t*   transfer   = NULL;
 
-    // Lookup transfer by iterating through available transfers
+    // Lookup transfer by iterating through available transfers, the id is the one
+    // the requester queued it with
     foreach(node, controller->TransactionList) {
         UsbManagerTransfer_t* itr = (UsbManagerTransfer_t*)node->Data;
-        if (itr->Id == args->transfer_id) {
+        if (itr->ProcessId == args->process_id && itr->RequestId == args->transfer_id &&
+            !(itr->Flags & TransferFlagCleanup)) {
             transfer = itr;
             break;
         }
     }
 
-    // Dequeue and send result back
+    // Dequeue and send result back, the requester of a control or bulk transfer
+    // is still waiting for it and is told it was cancelled
     if (transfer != NULL) {
+        if (transfer->Transfer.Type == ControlTransfer || transfer->Transfer.Type == BulkTransfer) {
+            transfer->Status = TransferCancelled;
+        }
         status = HciDequeueTransfer(transfer);
     }
     
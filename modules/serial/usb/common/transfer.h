@@ -25,7 +25,9 @@
 #ifndef __USB_TRANSFER__
 #define __USB_TRANSFER__
 
+#include <ddk/completion.h>
 #include <ddk/usb.h>
+#include <ds/collection.h>
 #include <gracht/link/vali.h>
 #include <os/dmabuf.h>
 #include <os/osdefs.h>
@@ -49,6 +51,8 @@ typedef struct UsbManagerTransfer {
     // Transfer Metadata
     UUId_t                    Id;
     UUId_t                    DeviceId;
+    UUId_t                    ProcessId;           // Requester and its id for the transfer
+    UUId_t                    RequestId;
     UsbTransferStatus_t       Status;
     UsbManagerTransferFlags_t Flags;
     void*                     EndpointDescriptor;  // We only use one no matter what
@@ -63,7 +67,13 @@ typedef struct UsbManagerTransfer {
     } Transactions[USB_TRANSACTIONCOUNT];
 
     // Periodic Transfers
-    size_t CurrentDataIndex;
+    size_t                   CurrentDataIndex;
+    struct UsbManagerStream* Stream; // Isochronous streams only
+
+    // Controller bookkeeping, the node in the transaction list and the
+    // entry in the completion queue
+    CollectionItem_t*          ListNode;
+    CompletionEntry_t          Completion;
     
     // Deferred message for async responding
     struct vali_link_deferred_response DeferredMessage;
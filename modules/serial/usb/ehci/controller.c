@@ -65,7 +65,7 @@ HciControllerCreate(
     // Fill in some basic stuff needed for init
     Controller->Base.Type               = UsbEHCI;
     Controller->Base.TransactionList    = CollectionCreate(KeyInteger);
-    Controller->Base.Endpoints          = CollectionCreate(KeyInteger);
+    CompletionQueueInitialize(&Controller->Base.Completions, UsbManagerCompleteTransfer, &Controller->Base);
     spinlock_init(&Controller->Base.Lock, spinlock_plain);
 
     // Get I/O Base, and for EHCI it'll be the first address we encounter
@@ -161,7 +161,6 @@ HciControllerDestroy(
 
     // Free the list of endpoints
     CollectionDestroy(Controller->TransactionList);
-    CollectionDestroy(Controller->Endpoints);
     free(Controller);
     return OsSuccess;
 }
@@ -31,6 +31,7 @@
 #include "../common/manager.h"
 #include "../common/scheduler.h"
 #include "../common/hci.h"
+#include "../common/stream.h"
 
 /* EHCI Controller Definitions 
  * Contains generic magic constants and definitions */
@@ -224,6 +225,7 @@ PACKED_TYPESTRUCT(EhciIsochronousDescriptor, {
 #define EHCI_iTD_LENGTH(n)              ((n & 0xFFF) << 16)
 #define EHCI_iTD_ACTIVE                 (1 << 31)
 
+#define EHCI_iTD_GETLENGTH(n)           ((n >> 16) & 0xFFF)
 #define EHCI_iTD_CC(n)                  ((n >> 28) & 0xF)
 
 /* EhciIsochronousDescriptor::Buffers[0]
@@ -275,20 +277,27 @@ PACKED_TYPESTRUCT(EhciSplitIsochronousDescriptor, {
 
     // Software metadata
     UsbSchedulerObject_t    Object;
+    reg32_t                 StatusCopy;
+    reg32_t                 Bp0AndOffsetCopy;
+    reg32_t                 Bp1AndInfoCopy;
 });
 
 /* EhciSplitIsochronousDescriptor::Flags
  * Contains definitions and bitfield definitions for EhciSplitIsochronousDescriptor::Flags
- * Bit 0-11: Transaction Offset
- * Bit 12-14: Page Selector 
- * Bit 15: Interrupt on Completion 
- * Bit 16-27: Transaction Length 
- * Bit 28-31: Condition Code (Status) */
-#define EHCI_siTD_XACTIONOFFSET(Offset) (Offset & 0xFFF)
-#define EHCI_siTD_PAGESELECT(Page)      ((Page & 0x7) << 12)
-#define EHCI_siTD_IOC                   (1 << 15)
-#define EHCI_siTD_LENGTH(Length)        ((Length & 0xFFF) << 16)
-#define EHCI_siTD_CC(Code)              ((Code & 0xF) << 28)
+ * Bit 0-6: Device Address
+ * Bit 7: Reserved
+ * Bit 8-11: Endpoint Number
+ * Bit 12-15: Reserved
+ * Bit 16-22: Hub Address (of the transaction translator)
+ * Bit 23: Reserved
+ * Bit 24-30: Port Number (of the transaction translator)
+ * Bit 31: Direction (0 = out, 1 = in) */
+#define EHCI_siTD_DEVADDR(n)            (n & 0x7F)
+#define EHCI_siTD_EPADDR(n)             ((n & 0xF) << 8)
+#define EHCI_siTD_HUBADDR(n)            ((n & 0x7F) << 16)
+#define EHCI_siTD_PORT(n)               ((n & 0x7F) << 24)
+#define EHCI_siTD_OUT                   0
+#define EHCI_siTD_IN                    (1 << 31)
 
 /* EhciSplitIsochronousDescriptor::Status
  * Contains definitions and bitfield definitions for EhciSplitIsochronousDescriptor::Status
@@ -299,21 +308,22 @@ PACKED_TYPESTRUCT(EhciSplitIsochronousDescriptor, {
  * Bit 30: Page Select (0 = Bp0, 1 = Bp1)
  * Bit 31: IOC */
 #define EHCI_siTD_ACTIVE                (1 << 7)
+#define EHCI_siTD_ERROR                 (1 << 6)
+#define EHCI_siTD_BUFFERERROR           (1 << 5)
+#define EHCI_siTD_BABBLE                (1 << 4)
+#define EHCI_siTD_XACTERROR             (1 << 3)
+#define EHCI_siTD_MISSEDFRAME           (1 << 2)
 #define EHCI_siTD_STATUS(n)             (n & 0xFF)
 #define EHCI_siTD_CSPMASK(n)            ((n & 0xFF) << 8)
 #define EHCI_siTD_XFERLENGTH(n)         ((n & 0x3FF) << 16)
+#define EHCI_siTD_GETLENGTH(n)          ((n >> 16) & 0x3FF)
 #define EHCI_siTD_PAGE(n)               ((n & 0x1) << 30)
-#define EHCI_siTD_IOCSTATUS             (n << 31)
-
-#define EHCI_siTD_DEVADDR(n)            (n & 0x7F)
-#define EHCI_siTD_EPADDR(n)             ((n & 0xF) << 8)
-#define EHCI_siTD_HUBADDR(n)            ((n & 0x7F) << 16)
-#define EHCI_siTD_PORT(n)               ((n & 0x7F) << 24)
-#define EHCI_siTD_OUT                   0
-#define EHCI_siTD_IN                    (1 << 31)
+#define EHCI_siTD_IOC                   (1U << 31)
 
-#define EHCI_siTD_SMASK(n)              (n & 0xFF)
-#define EHCI_siTD_CMASK(n)              ((n & 0xFF) << 8)
+/* EhciSplitIsochronousDescriptor::FrameStartMask/FrameCompletionMask
+ * The microframes the start-splits and complete-splits are issued in. The
+ * transaction translator moves at most 188 bytes per microframe. */
+#define EHCI_siTD_SPLIT_BYTES           188
 
 /* EhciSplitIsochronousDescriptor::Bp0AndOffset
  * Contains definitions and bitfield definitions for EhciSplitIsochronousDescriptor::Bp0AndOffset
@@ -329,6 +339,7 @@ PACKED_TYPESTRUCT(EhciSplitIsochronousDescriptor, {
  * Bit 5-11: Reserved
  * Bit 12-31: Bp1 */
 #define EHCI_siTD_TCOUNT(n)             (MIN(6, n) & 0x7)
+#define EHCI_siTD_EXTBUFFER(n)          ((n >> 32) & 0xFFFFFFFF)
 #define EHCI_siTD_POSITION_ALL          0
 #define EHCI_siTD_POSITION_BEGIN        (1 << 3)
 #define EHCI_siTD_POSITION_MID          (2 << 3)
@@ -502,11 +513,21 @@ PACKED_TYPESTRUCT(EhciFSTN, {
 #define EHCI_TD_ALIGNMENT                   32
 #define EHCI_TD_POOL                        1
 #define EHCI_TD_COUNT                       400
+#define EHCI_TD_BATCH                       16
 
 #define EHCI_iTD_ALIGNMENT                  32
 #define EHCI_iTD_POOL                       2
 #define EHCI_iTD_COUNT                      50
 
+// Isochronous streams use an iTD (high-speed) or siTD (full-speed) per frame, started
+// a few frames ahead of the controller, and ask for an interrupt a few times per lap
+// of the ring. Complete-splits of full-speed in-streams must end in the frame they
+// started in, which leaves room for five of them after the start-split.
+#define EHCI_STREAM_MAX_ELEMENTS            32
+#define EHCI_STREAM_MAX_SPLIT_IN            (5 * EHCI_siTD_SPLIT_BYTES)
+#define EHCI_STREAM_FRAME_LEAD              4
+#define EHCI_STREAM_IOC_PER_RING            4
+
 #define EHCI_siTD_ALIGNMENT                 32
 #define EHCI_siTD_POOL                      3
 #define EHCI_siTD_COUNT                     50
@@ -765,6 +786,52 @@ EhciiTdRestart(
     _In_ UsbManagerTransfer_t*          Transfer,
     _In_ EhciIsochronousDescriptor_t*   Td);
 
+/* EhciiTdStreamRecycle
+ * Handles a completed iTD of an isochronous stream, the result is stored in the stream
+ * and the descriptor is rearmed and moved a lap of the ring ahead in the frame list.
+ * Returns ITERATOR_STOP if the descriptor is still active. */
+__EXTERN
+int
+EhciiTdStreamRecycle(
+    _In_ EhciController_t*              Controller,
+    _In_ UsbManagerTransfer_t*          Transfer,
+    _In_ EhciIsochronousDescriptor_t*   Td);
+
+/*******************************************************************************
+ * Split-Isochronous TD Methods
+ *******************************************************************************/
+
+/* EhciTdSplitIsochronous
+ * Initializes a siTD for a full-speed isochronous transfer of at most a packet, which
+ * is executed through the transaction translator of the hub the device is behind. */
+__EXTERN
+void
+EhciTdSplitIsochronous(
+    _In_ EhciController_t*                 Controller,
+    _In_ UsbTransfer_t*                    Transfer,
+    _In_ EhciSplitIsochronousDescriptor_t* siTd,
+    _In_ uintptr_t                         BufferAddress,
+    _In_ size_t                            ByteCount);
+
+/* EhcisiTdDump
+ * Dumps the information contained in the descriptor by writing it. */
+__EXTERN
+void
+EhcisiTdDump(
+    _In_ EhciController_t*                 Controller,
+    _In_ EhciSplitIsochronousDescriptor_t* siTd);
+
+/* EhcisiTdStreamRecycle
+ * Handles a completed siTD of an isochronous stream, the result is stored in the stream
+ * and the descriptor is rearmed and moved a lap of the ring ahead in the frame list.
+ * Returns ITERATOR_STOP if the descriptor is still active. */
+__EXTERN
+int
+EhcisiTdStreamRecycle(
+    _In_ EhciController_t*                 Controller,
+    _In_ UsbManagerTransfer_t*             Transfer,
+    _In_ EhciSplitIsochronousDescriptor_t* siTd);
+
 /*******************************************************************************
  * Queue Methods
  *******************************************************************************/
@@ -799,4 +866,13 @@ EhciTransactionDispatch(
     _In_ EhciController_t*      Controller,
     _In_ UsbManagerTransfer_t*  Transfer);
 
+/* EhciStreamUnlink
+ * Removes all the descriptors of an isochronous stream from the frame list, the
+ * controller may still be executing the current frame when this returns. */
+__EXTERN
+void
+EhciStreamUnlink(
+    _In_ EhciController_t*      Controller,
+    _In_ UsbManagerTransfer_t*  Transfer);
+
 #endif //!__USB_EHCI__
@@ -344,6 +344,7 @@ HciProcessElement(
 {
     UsbManagerTransfer_t *Transfer  = (UsbManagerTransfer_t*)Context;
     UsbSchedulerPool_t *QhPool      = &Controller->Scheduler->Settings.Pools[EHCI_QH_POOL];
+    UsbSchedulerPool_t *SitdPool    = &Controller->Scheduler->Settings.Pools[EHCI_siTD_POOL];
     UsbSchedulerPool_t *Pool        = NULL;
     uint8_t *AsyncRootElement       = NULL;
     UsbSchedulerGetPoolFromElement(Controller->Scheduler, Element, &Pool);
@@ -363,6 +364,9 @@ HciProcessElement(
                     EhciTdDump((EhciController_t*)Controller, (EhciTransferDescriptor_t*)Element);
                 }
             }
+            else if (Pool == SitdPool) {
+                EhcisiTdDump((EhciController_t*)Controller, (EhciSplitIsochronousDescriptor_t*)Element);
+            }
             else {
                 EhciiTdDump((EhciController_t*)Controller, (EhciIsochronousDescriptor_t*)Element);
             }
@@ -447,6 +451,14 @@ HciProcessElement(
             // Very simple cleanup
             UsbSchedulerFreeElement(Controller->Scheduler, Element);
         } break;
+
+        case USB_REASON_STREAM: {
+            if (Pool == SitdPool) {
+                return EhcisiTdStreamRecycle((EhciController_t*)Controller, Transfer,
+                    (EhciSplitIsochronousDescriptor_t*)Element);
+            }
+            return EhciiTdStreamRecycle((EhciController_t*)Controller, Transfer, (EhciIsochronousDescriptor_t*)Element);
+        }
     }
     return ITERATOR_CONTINUE;
 }
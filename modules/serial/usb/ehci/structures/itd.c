@@ -107,10 +107,6 @@ EhciTdIsochronous(
         // Create copies of transaction details
         iTd->TransactionsCopy[i] = iTd->Transactions[i];
     }
-
-    // Handle bandwidth allocation
-    Status = UsbSchedulerAllocateBandwidth(Controller->Base.Scheduler, 
-        &Transfer->Endpoint, ByteCount, Transfer->Type, Transfer->Speed, (uint8_t*)iTd);
     return Status;
 }
 
@@ -194,3 +190,58 @@ EhciiTdRestart(
         Td->Transactions[i] = Td->TransactionsCopy[i];
     }
 }
+
+int
+EhciiTdStreamRecycle(
+    _In_ EhciController_t*            Controller,
+    _In_ UsbManagerTransfer_t*        Transfer,
+    _In_ EhciIsochronousDescriptor_t* Td)
+{
+    UsbManagerStream_t* Stream = Transfer->Stream;
+    int                 ConditionCode;
+    int                 i;
+
+    // The transactions execute a microframe each, wait for all of them
+    for (i = 0; i < 8; i++) {
+        if (Td->Transactions[i] & EHCI_iTD_ACTIVE) {
+            return ITERATOR_STOP;
+        }
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (!(Td->TransactionsCopy[i] & EHCI_iTD_ACTIVE)) {
+            continue;
+        }
+
+        ConditionCode = EhciConditionCodeToIndex(EHCI_iTD_CC(Td->Transactions[i]));
+        if (ConditionCode != 0) {
+            if (Stream->Status == TransferFinished) {
+                Stream->Status = ConditionCode == 1 ? TransferNotResponding :
+                    (ConditionCode == 2 ? TransferBabble : TransferBufferError);
+            }
+            continue;
+        }
+
+        // The controller writes back the length received for in-transactions,
+        // out-transactions are always sent in full
+        if (Transfer->Transfer.Endpoint.Direction == USB_ENDPOINT_IN) {
+            Stream->BytesTransferred += EHCI_iTD_GETLENGTH(Td->Transactions[i]);
+        }
+        else {
+            Stream->BytesTransferred += EHCI_iTD_GETLENGTH(Td->TransactionsCopy[i]);
+        }
+    }
+
+    // Move the descriptor a lap of the ring ahead, if we have fallen that far behind
+    // the controller the rest of the ring runs a frame list later, but still in order
+    spinlock_acquire(&Controller->Base.Lock);
+    UsbSchedulerUnlinkPeriodicElement(Controller->Base.Scheduler, EHCI_iTD_POOL, (uint8_t*)Td);
+    for (i = 0; i < 8; i++) {
+        Td->Transactions[i] = Td->TransactionsCopy[i];
+    }
+    Td->Object.StartFrame = (uint16_t)((Td->Object.StartFrame + Stream->ElementCount) &
+        (Controller->FrameCount - 1));
+    UsbSchedulerLinkPeriodicElement(Controller->Base.Scheduler, EHCI_iTD_POOL, (uint8_t*)Td);
+    spinlock_release(&Controller->Base.Lock);
+    return ITERATOR_CONTINUE;
+}
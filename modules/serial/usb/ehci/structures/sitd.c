@@ -0,0 +1,140 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Enhanced Host Controller Interface Driver
+ * - Split-isochronous transfer descriptors, full-speed isochronous endpoints
+ *   behind the transaction translator of a high-speed hub
+ */
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include "../ehci.h"
+
+void
+EhciTdSplitIsochronous(
+    _In_ EhciController_t*                 Controller,
+    _In_ UsbTransfer_t*                    Transfer,
+    _In_ EhciSplitIsochronousDescriptor_t* siTd,
+    _In_ uintptr_t                         BufferAddress,
+    _In_ size_t                            ByteCount)
+{
+    int Splits = MAX(1, (int)DIVUP(ByteCount, EHCI_siTD_SPLIT_BYTES));
+
+    siTd->Link         = EHCI_LINK_END;
+    siTd->BackPointer  = EHCI_LINK_END;
+    siTd->Object.Flags |= EHCI_LINK_siTD;
+
+    siTd->Flags = EHCI_siTD_DEVADDR(Transfer->Address.DeviceAddress) |
+        EHCI_siTD_EPADDR(Transfer->Address.EndpointAddress) |
+        EHCI_siTD_HUBADDR(Transfer->Address.HubAddress) |
+        EHCI_siTD_PORT(Transfer->Address.PortAddress);
+
+    // In-transactions are started in the first microframe, and the data is collected
+    // with a complete-split in each of the following ones, leaving one microframe for
+    // the translator to start. Out-transactions are sent in pieces of 188 bytes, a
+    // start-split each, and are never completed.
+    if (Transfer->Endpoint.Direction == USB_ENDPOINT_IN) {
+        siTd->Flags               |= EHCI_siTD_IN;
+        siTd->FrameStartMask      = 0x01;
+        siTd->FrameCompletionMask = (uint8_t)(((1 << (Splits + 1)) - 1) << 2);
+        siTd->Bp1AndInfo          = 0;
+    }
+    else {
+        siTd->Flags               |= EHCI_siTD_OUT;
+        siTd->FrameStartMask      = (uint8_t)((1 << Splits) - 1);
+        siTd->FrameCompletionMask = 0;
+        siTd->Bp1AndInfo          = EHCI_siTD_TCOUNT(Splits) |
+            ((Splits == 1) ? EHCI_siTD_POSITION_ALL : EHCI_siTD_POSITION_BEGIN);
+    }
+
+    // The packet crosses at most one page boundary
+    siTd->Status       = EHCI_siTD_ACTIVE | EHCI_siTD_XFERLENGTH(ByteCount) | EHCI_siTD_IOC;
+    siTd->Bp0AndOffset = LODWORD(BufferAddress);
+    siTd->Bp1AndInfo   |= EHCI_siTD_BUFFER(LODWORD(BufferAddress + ByteCount));
+    siTd->ExtBp0       = 0;
+    siTd->ExtBp1       = 0;
+#if __BITS == 64
+    if (Controller->CParameters & EHCI_CPARAM_64BIT) {
+        siTd->ExtBp0 = EHCI_siTD_EXTBUFFER(BufferAddress);
+        siTd->ExtBp1 = EHCI_siTD_EXTBUFFER((BufferAddress + ByteCount));
+    }
+#else
+    _CRT_UNUSED(Controller);
+#endif
+
+    // The controller updates the state, offset and progress while executing
+    siTd->StatusCopy       = siTd->Status;
+    siTd->Bp0AndOffsetCopy = siTd->Bp0AndOffset;
+    siTd->Bp1AndInfoCopy   = siTd->Bp1AndInfo;
+}
+
+void
+EhcisiTdDump(
+    _In_ EhciController_t*                 Controller,
+    _In_ EhciSplitIsochronousDescriptor_t* siTd)
+{
+    uintptr_t PhysicalAddress = 0;
+
+    UsbSchedulerGetPoolElement(Controller->Base.Scheduler, EHCI_siTD_POOL,
+        siTd->Object.Index & USB_ELEMENT_INDEX_MASK, NULL, &PhysicalAddress);
+    WARNING("EHCI: siTD(0x%x), Link(0x%x), Flags(0x%x), Masks(0x%x:0x%x), Status(0x%x)",
+        PhysicalAddress, siTd->Link, siTd->Flags, siTd->FrameStartMask,
+        siTd->FrameCompletionMask, siTd->Status);
+    WARNING("          Buffer0(0x%x:0x%x), Buffer1(0x%x:0x%x), BackPointer(0x%x)",
+        siTd->ExtBp0, siTd->Bp0AndOffset, siTd->ExtBp1, siTd->Bp1AndInfo, siTd->BackPointer);
+}
+
+int
+EhcisiTdStreamRecycle(
+    _In_ EhciController_t*                 Controller,
+    _In_ UsbManagerTransfer_t*             Transfer,
+    _In_ EhciSplitIsochronousDescriptor_t* siTd)
+{
+    UsbManagerStream_t* Stream = Transfer->Stream;
+    reg32_t             Status = siTd->Status;
+
+    if (Status & EHCI_siTD_ACTIVE) {
+        return ITERATOR_STOP;
+    }
+
+    if (Status & EHCI_siTD_BABBLE) {
+        Stream->Status = TransferBabble;
+    }
+    else if (Status & (EHCI_siTD_BUFFERERROR | EHCI_siTD_MISSEDFRAME)) {
+        Stream->Status = TransferBufferError;
+    }
+    else if (Status & (EHCI_siTD_ERROR | EHCI_siTD_XACTERROR)) {
+        Stream->Status = TransferNotResponding;
+    }
+    else {
+        // The controller counts down the bytes left, in-transactions may end short
+        Stream->BytesTransferred = EHCI_siTD_GETLENGTH(siTd->StatusCopy) - EHCI_siTD_GETLENGTH(Status);
+    }
+
+    // Move the descriptor a lap of the ring ahead, like the iTDs of high-speed streams
+    spinlock_acquire(&Controller->Base.Lock);
+    UsbSchedulerUnlinkPeriodicElement(Controller->Base.Scheduler, EHCI_siTD_POOL, (uint8_t*)siTd);
+    siTd->Bp0AndOffset = siTd->Bp0AndOffsetCopy;
+    siTd->Bp1AndInfo   = siTd->Bp1AndInfoCopy;
+    siTd->Status       = siTd->StatusCopy;
+    siTd->Object.StartFrame = (uint16_t)((siTd->Object.StartFrame + Stream->ElementCount) &
+        (Controller->FrameCount - 1));
+    UsbSchedulerLinkPeriodicElement(Controller->Base.Scheduler, EHCI_siTD_POOL, (uint8_t*)siTd);
+    spinlock_release(&Controller->Base.Lock);
+    return ITERATOR_CONTINUE;
+}
@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <threads.h>
 
 UsbTransferStatus_t
 EhciTransactionDispatch(
@@ -57,6 +58,12 @@ HciTransactionFinalize(
     // Debug
     TRACE("EhciTransactionFinalize(Id %u)", Transfer->Id);
 
+    // Streams free their descriptors when the transfer is finalized
+    if (Transfer->Stream != NULL) {
+        EhciStreamUnlink((EhciController_t*)Controller, Transfer);
+        return OsSuccess;
+    }
+
     // Always unlink
     UsbManagerIterateChain(Controller, Transfer->EndpointDescriptor, 
         USB_CHAIN_DEPTH, USB_REASON_UNLINK, HciProcessElement, Transfer);
@@ -85,6 +92,16 @@ HciDequeueTransfer(
     if (!Controller) {
         return OsInvalidParameters;
     }
+
+    // Wait for the frame the controller might be in to pass before freeing the stream,
+    // the remains of the transfer are finalized by the next processing
+    if (Transfer->Stream != NULL) {
+        EhciStreamUnlink(Controller, Transfer);
+        thrd_sleepex(2);
+        UsbManagerDestroyStream(&Controller->Base, Transfer);
+        Transfer->Flags |= TransferFlagCleanup;
+        return OsSuccess;
+    }
     
     // Unschedule immediately, but keep data intact as hardware still (might) reference it.
     UsbManagerIterateChain(&Controller->Base, Transfer->EndpointDescriptor, 
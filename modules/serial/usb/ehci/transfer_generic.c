@@ -38,6 +38,9 @@ EhciTransferFill(
     EhciTransferDescriptor_t* PreviousTd = NULL;
     EhciTransferDescriptor_t* Td         = NULL;
     EhciQueueHead_t*          Qh         = (EhciQueueHead_t*)Transfer->EndpointDescriptor;
+    uint8_t*                  Batch[EHCI_TD_BATCH];
+    int                       BatchCount = 0;
+    int                       BatchIndex = 0;
     
     int OutOfResources = 0;
     int i;
@@ -92,8 +95,20 @@ EhciTransferFill(
                 Length  = MIN(Length, Dma->length - Transfer->Transactions[i].SgOffset);
             }
             
+            // Take descriptors from the pool in batches, a td covers at most a few pages
+            // so estimate from the bytes left
+            if (BatchIndex == BatchCount) {
+                int Estimate = (int)MIN(EHCI_TD_BATCH, (BytesToTransfer / 0x4000) + 1);
+                BatchIndex = 0;
+                if (UsbSchedulerAllocateElements(Controller->Base.Scheduler, EHCI_TD_POOL,
+                        Estimate, &Batch[0], &BatchCount) != OsSuccess) {
+                    BatchCount = 0;
+                }
+            }
+            Td = (BatchIndex < BatchCount) ? (EhciTransferDescriptor_t*)Batch[BatchIndex++] : NULL;
+
             Toggle = UsbManagerGetToggle(Transfer->DeviceId, &Transfer->Transfer.Address);
-            if (UsbSchedulerAllocateElement(Controller->Base.Scheduler, EHCI_TD_POOL, (uint8_t**)&Td) == OsSuccess) {
+            if (Td != NULL) {
                 if (Type == SetupTransaction) {
                     TRACE(" > Creating setup packet");
                     Toggle = 0; // Initial toggle must ALWAYS be 0 for setup
@@ -152,6 +167,11 @@ EhciTransferFill(
         }
     }
 
+    // Return the descriptors we did not need
+    while (BatchIndex < BatchCount) {
+        UsbSchedulerFreeElement(Controller->Base.Scheduler, Batch[BatchIndex++]);
+    }
+
     // If we ran out of resources queue up later
     if (PreviousTd != NULL) {
         // Set last td to generate a interrupt (not null)
@@ -170,7 +190,6 @@ HciQueueTransferGeneric(
 {
     EhciQueueHead_t*  EndpointDescriptor = NULL;
     EhciController_t* Controller;
-    DataKey_t         Key;
 
     Controller       = (EhciController_t*)UsbManagerGetController(Transfer->DeviceId);
     Transfer->Status = TransferNotProcessed;
@@ -195,10 +214,7 @@ HciQueueTransferGeneric(
     }
 
     // Store transaction in queue if it's not there already
-    Key.Value.Integer = (int)Transfer->Id;
-    if (CollectionGetDataByKey(Controller->Base.TransactionList, Key, 0) == NULL) {
-        CollectionAppend(Controller->Base.TransactionList, CollectionCreateNode(Key, Transfer));
-    }
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
 
     // If it fails to queue up => restore toggle
     if (EhciTransferFill(Controller, Transfer) != OsSuccess) {
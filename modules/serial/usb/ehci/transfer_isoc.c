@@ -29,6 +29,137 @@
 #include <string.h>
 #include <stdlib.h>
 
+// High-speed endpoints are served by iTDs, full-speed endpoints behind the
+// transaction translator of a high-speed hub by siTDs
+static int
+EhciStreamPool(
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    return Transfer->Transfer.Speed == HighSpeed ? EHCI_iTD_POOL : EHCI_siTD_POOL;
+}
+
+static OsStatus_t
+EhciStreamValidate(
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    size_t SegmentLength = Transfer->Transfer.Transactions[0].Length;
+
+    // An iTD moves up to eight microframes of data, a siTD a single full-speed packet
+    if (Transfer->Transfer.Speed == HighSpeed) {
+        return SegmentLength <= (size_t)(8 * 1024 * MAX(3, Transfer->Transfer.Endpoint.Bandwidth)) ?
+            OsSuccess : OsInvalidParameters;
+    }
+    else if (Transfer->Transfer.Speed == FullSpeed) {
+        if (SegmentLength > Transfer->Transfer.Endpoint.MaxPacketSize || SegmentLength > 1023) {
+            return OsInvalidParameters;
+        }
+        if (Transfer->Transfer.Endpoint.Direction == USB_ENDPOINT_IN &&
+            SegmentLength > EHCI_STREAM_MAX_SPLIT_IN) {
+            return OsInvalidParameters;
+        }
+        return OsSuccess;
+    }
+    return OsInvalidParameters;
+}
+
+static UsbTransferStatus_t
+EhciQueueStream(
+    _In_ EhciController_t*     Controller,
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    UsbManagerStream_t* Stream;
+    UsbSchedulerPool_t* ElementPool;
+    UsbTransferStatus_t Status;
+    size_t              Frame;
+    int                 Pool = EhciStreamPool(Transfer);
+    int                 IocInterval;
+    int                 i, j;
+
+    if (EhciStreamValidate(Transfer) != OsSuccess) {
+        return TransferInvalid;
+    }
+
+    Status = UsbManagerCreateStream(&Controller->Base, Transfer, EHCI_STREAM_MAX_ELEMENTS);
+    if (Status != TransferQueued) {
+        return Status;
+    }
+    Stream      = Transfer->Stream;
+    IocInterval = MAX(1, Stream->ElementCount / EHCI_STREAM_IOC_PER_RING);
+
+    for (i = 0; i < Stream->ElementCount; i++) {
+        uint8_t*  Element = NULL;
+        uintptr_t AddressPointer;
+        int       Interrupt;
+
+        if (UsbManagerGetStreamSegment(Transfer, i, &AddressPointer) != OsSuccess ||
+            UsbSchedulerAllocateElement(Controller->Base.Scheduler, Pool, &Element) != OsSuccess) {
+            UsbManagerDestroyStream(&Controller->Base, Transfer);
+            return TransferInvalid;
+        }
+        Stream->Elements[i] = Element;
+
+        // Completions are handled in batches, so only some of the descriptors
+        // need to raise an interrupt
+        Interrupt = ((i + 1) % IocInterval) == 0 || i == (Stream->ElementCount - 1);
+        if (Pool == EHCI_iTD_POOL) {
+            EhciIsochronousDescriptor_t* iTd = (EhciIsochronousDescriptor_t*)Element;
+            EhciTdIsochronous(Controller, &Transfer->Transfer, iTd, AddressPointer,
+                Stream->SegmentLength, Transfer->Transfer.Address.DeviceAddress,
+                Transfer->Transfer.Address.EndpointAddress);
+            if (!Interrupt) {
+                for (j = 0; j < 8; j++) {
+                    iTd->Transactions[j]     &= ~(EHCI_iTD_IOC);
+                    iTd->TransactionsCopy[j] &= ~(EHCI_iTD_IOC);
+                }
+            }
+        }
+        else {
+            EhciSplitIsochronousDescriptor_t* siTd = (EhciSplitIsochronousDescriptor_t*)Element;
+            EhciTdSplitIsochronous(Controller, &Transfer->Transfer, siTd, AddressPointer,
+                Stream->SegmentLength);
+            if (!Interrupt) {
+                siTd->Status     &= ~(EHCI_siTD_IOC);
+                siTd->StatusCopy &= ~(EHCI_siTD_IOC);
+            }
+        }
+    }
+
+    Transfer->EndpointDescriptor = Stream->Elements[0];
+    Transfer->Status             = TransferQueued;
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
+
+    // Each descriptor owns a single frame, start a bit ahead of the controller
+    // so it doesn't pass the first of them while we link the rest
+    ElementPool = &Controller->Base.Scheduler->Settings.Pools[Pool];
+    spinlock_acquire(&Controller->Base.Lock);
+    Frame = (READ_VOLATILE(Controller->OpRegisters->FrameIndex) >> 3) + EHCI_STREAM_FRAME_LEAD;
+    for (i = 0; i < Stream->ElementCount; i++) {
+        UsbSchedulerObject_t* Object = USB_ELEMENT_OBJECT(ElementPool, Stream->Elements[i]);
+        Object->StartFrame    = (uint16_t)((Frame + i) & (Controller->FrameCount - 1));
+        Object->FrameInterval = (uint16_t)Controller->FrameCount;
+        UsbSchedulerLinkPeriodicElement(Controller->Base.Scheduler, Pool, Stream->Elements[i]);
+    }
+    EhciEnableScheduler(Controller, IsochronousTransfer);
+    spinlock_release(&Controller->Base.Lock);
+    return TransferQueued;
+}
+
+void
+EhciStreamUnlink(
+    _In_ EhciController_t*     Controller,
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    UsbManagerStream_t* Stream = Transfer->Stream;
+    int                 Pool   = EhciStreamPool(Transfer);
+    int                 i;
+
+    spinlock_acquire(&Controller->Base.Lock);
+    for (i = 0; i < Stream->ElementCount; i++) {
+        UsbSchedulerUnlinkPeriodicElement(Controller->Base.Scheduler, Pool, Stream->Elements[i]);
+    }
+    spinlock_release(&Controller->Base.Lock);
+}
+
 UsbTransferStatus_t
 HciQueueTransferIsochronous(
     _In_ UsbManagerTransfer_t* Transfer)
@@ -38,11 +169,13 @@ HciQueueTransferIsochronous(
     EhciController_t*            Controller;
     size_t                       BytesToTransfer;
     size_t                       MaxBytesPerDescriptor;
-    DataKey_t                    Key;
     int                          i;
 
     Controller       = (EhciController_t *)UsbManagerGetController(Transfer->DeviceId);
     Transfer->Status = TransferNotProcessed;
+    if (Transfer->Transfer.Flags & USB_TRANSFER_STREAM) {
+        return EhciQueueStream(Controller, Transfer);
+    }
     BytesToTransfer  = Transfer->Transfer.Transactions[0].Length;
 
     // Calculate mpd
@@ -66,9 +199,11 @@ HciQueueTransferIsochronous(
             Transfer->Transactions[0].SgIndex].address + Transfer->Transactions[0].SgOffset;
         
         if (UsbSchedulerAllocateElement(Controller->Base.Scheduler, EHCI_iTD_POOL, (uint8_t**)&iTd) == OsSuccess) {
-            if (EhciTdIsochronous(Controller, &Transfer->Transfer, iTd, 
-                    AddressPointer, BytesStep, Transfer->Transfer.Address.DeviceAddress, 
-                    Transfer->Transfer.Address.EndpointAddress) != OsSuccess) {
+            EhciTdIsochronous(Controller, &Transfer->Transfer, iTd, 
+                AddressPointer, BytesStep, Transfer->Transfer.Address.DeviceAddress, 
+                Transfer->Transfer.Address.EndpointAddress);
+            if (UsbSchedulerAllocateBandwidth(Controller->Base.Scheduler, &Transfer->Transfer.Endpoint,
+                    BytesStep, Transfer->Transfer.Type, Transfer->Transfer.Speed, (uint8_t*)iTd) != OsSuccess) {
                 // TODO: Out of bandwidth
                 TRACE(" > Out of bandwidth");
                 for(;;);
@@ -112,8 +247,6 @@ HciQueueTransferIsochronous(
     }
 
     Transfer->EndpointDescriptor = (void*)FirstTd;
-    Key.Value.Integer            = 0;
-    
-    CollectionAppend(Controller->Base.TransactionList, CollectionCreateNode(Key, Transfer));
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
     return EhciTransactionDispatch(Controller, Transfer);
 }
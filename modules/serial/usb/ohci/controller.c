@@ -67,7 +67,7 @@ HciControllerCreate(
     // Fill in some basic stuff needed for init
     Controller->Base.Type               = UsbOHCI;
     Controller->Base.TransactionList    = CollectionCreate(KeyInteger);
-    Controller->Base.Endpoints          = CollectionCreate(KeyInteger);
+    CompletionQueueInitialize(&Controller->Base.Completions, UsbManagerCompleteTransfer, &Controller->Base);
     spinlock_init(&Controller->Base.Lock, spinlock_plain);
 
     // Get I/O Base, and for OHCI it'll be the first address we encounter
@@ -183,7 +183,6 @@ HciControllerDestroy(
     ReleaseDeviceIo(Controller->IoBase);
 
     // Free the list of endpoints
-    CollectionDestroy(Controller->Endpoints);
     free(Controller);
     return OsSuccess;
 }
@@ -178,7 +178,6 @@ HciQueueTransferGeneric(
 {
     OhciQueueHead_t*  EndpointDescriptor = NULL;
     OhciController_t* Controller;
-    DataKey_t         Key;
 
     Controller          = (OhciController_t*)UsbManagerGetController(Transfer->DeviceId);
     Transfer->Status    = TransferNotProcessed;
@@ -203,10 +202,7 @@ HciQueueTransferGeneric(
     }
 
     // Store transaction in queue if it's not there already
-    Key.Value.Integer = (int)Transfer->Id;
-    if (CollectionGetDataByKey(Controller->Base.TransactionList, Key, 0) == NULL) {
-        CollectionAppend(Controller->Base.TransactionList, CollectionCreateNode(Key, Transfer));
-    }
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
 
     // If it fails to queue up => restore toggle
     if (OhciTransferFill(Controller, Transfer) != OsSuccess) {
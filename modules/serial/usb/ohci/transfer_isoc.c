@@ -118,11 +118,17 @@ HciQueueTransferIsochronous(
 {
     OhciQueueHead_t*  EndpointDescriptor = NULL;
     OhciController_t* Controller;
-    DataKey_t         Key;
 
     Controller          = (OhciController_t*)UsbManagerGetController(Transfer->DeviceId);
     Transfer->Status    = TransferNotProcessed;
 
+    // Isochronous streams are not supported on OHCI. A stream would need the iTDs
+    // to be given a starting frame and re-appended behind the ED tail as they retire
+    // through the done queue, and the isochronous path below does neither yet.
+    if (Transfer->Transfer.Flags & USB_TRANSFER_STREAM) {
+        return TransferInvalid;
+    }
+
     // Step 1 - Allocate queue head
     if (Transfer->EndpointDescriptor == NULL) {
         if (UsbSchedulerAllocateElement(Controller->Base.Scheduler, 
@@ -143,10 +149,7 @@ HciQueueTransferIsochronous(
     }
 
     // Store transaction in queue if it's not there already
-    Key.Value.Integer = (int)Transfer->Id;
-    if (CollectionGetDataByKey(Controller->Base.TransactionList, Key, 0) == NULL) {
-        CollectionAppend(Controller->Base.TransactionList, CollectionCreateNode(Key, Transfer));
-    }
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
 
     // If it fails to queue up => restore toggle
     if (OhciTransferFill(Controller, Transfer) != OsSuccess) {
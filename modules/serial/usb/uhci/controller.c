@@ -101,7 +101,7 @@ HciControllerCreate(
     // Fill in some basic stuff needed for init
     Controller->Base.Type               = UsbUHCI;
     Controller->Base.TransactionList    = CollectionCreate(KeyInteger);
-    Controller->Base.Endpoints          = CollectionCreate(KeyInteger);
+    CompletionQueueInitialize(&Controller->Base.Completions, UsbManagerCompleteTransfer, &Controller->Base);
     spinlock_init(&Controller->Base.Lock, spinlock_plain);
 
     // Get I/O Base, and for UHCI it'll be the first address we encounter
@@ -200,7 +200,6 @@ HciControllerDestroy(
 
     // Clean up allocated lists
     CollectionDestroy(Controller->TransactionList);
-    CollectionDestroy(Controller->Endpoints);
     free(Controller);
     return OsSuccess;
 }
@@ -255,7 +255,6 @@ HciQueueTransferGeneric(
 {
     UhciQueueHead_t*  EndpointDescriptor = NULL;
     UhciController_t* Controller;
-    DataKey_t         Key;
     
     Controller       = (UhciController_t*)UsbManagerGetController(Transfer->DeviceId);
     Transfer->Status = TransferNotProcessed;
@@ -278,10 +277,7 @@ HciQueueTransferGeneric(
     }
 
     // Store transaction in queue if it's not there already
-    Key.Value.Integer = (int)Transfer->Id;
-    if (CollectionGetDataByKey(Controller->Base.TransactionList, Key, 0) == NULL) {
-        CollectionAppend(Controller->Base.TransactionList, CollectionCreateNode(Key, Transfer));
-    }
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
 
     // If it fails to queue up => restore toggle
     if (UhciTransferFill(Controller, Transfer) != OsSuccess) {
@@ -295,17 +291,18 @@ HciQueueTransferIsochronous(
     _In_ UsbManagerTransfer_t* Transfer)
 {
     UhciController_t* Controller;
-    DataKey_t         Key;
 
     // Get Controller
     Controller       = (UhciController_t*)UsbManagerGetController(Transfer->DeviceId);
     Transfer->Status = TransferNotProcessed;
 
-    // Store transaction in queue if it's not there already
-    Key.Value.Integer = (int)Transfer->Id;
-    if (CollectionGetDataByKey(Controller->Base.TransactionList, Key, 0) == NULL) {
-        CollectionAppend(Controller->Base.TransactionList, CollectionCreateNode(Key, Transfer));
+    // Isochronous streams are only supported on EHCI for now
+    if (Transfer->Transfer.Flags & USB_TRANSFER_STREAM) {
+        return TransferInvalid;
     }
+
+    // Store transaction in queue if it's not there already
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
     
     // Fill the transfer
     if (UhciTransferFillIsochronous(Controller, Transfer) != OsSuccess) {
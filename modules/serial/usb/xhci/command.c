@@ -0,0 +1,156 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ */
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include "xhci.h"
+#include <threads.h>
+
+// Reserves the command ring before the command TRB is known, TRBs are 16 byte
+// aligned so the value never matches a completion
+#define XHCI_COMMAND_RESERVED 1
+
+/* XhciCommandAbort
+ * Aborts the command at Address by setting CRCR.CA and waits for the controller to
+ * report the ring stopped. A command that never started is rewritten into a no-op,
+ * so it doesn't execute when the ring is restarted by the next doorbell. */
+static void
+XhciCommandAbort(
+    _In_ XhciController_t* Controller,
+    _In_ uintptr_t         Address)
+{
+    int Fault = 0;
+    int Timeout;
+
+    atomic_store(&Controller->CommandStopped, 0);
+    WRITE_VOLATILE(Controller->OpRegisters->CommandRingLo, XHCI_CRCR_ABORT);
+    WRITE_VOLATILE(Controller->OpRegisters->CommandRingHi, 0);
+
+    WaitForConditionWithFault(Fault,
+        (READ_VOLATILE(Controller->OpRegisters->CommandRingLo) & XHCI_CRCR_RUNNING) == 0, 500, 10);
+    if (Fault) {
+        ERROR("XHCI-Failure: Command ring failed to stop");
+        return;
+    }
+
+    // The aborted and ring stopped events are posted to the primary interrupter
+    for (Timeout = XHCI_COMMAND_TIMEOUT; Timeout > 0; Timeout--) {
+        XhciProcessEvents(Controller, &Controller->Interrupters[0]);
+        if (atomic_load(&Controller->CommandStopped) || atomic_load(&Controller->CommandDone)) {
+            break;
+        }
+        thrd_sleepex(1);
+    }
+
+    if (!atomic_load(&Controller->CommandDone)) {
+        volatile XhciTrb_t* Trb = (volatile XhciTrb_t*)((uint8_t*)Controller->CommandRing.Memory.Virtual +
+            (Address - Controller->CommandRing.Memory.Physical));
+        Trb->Control = (Trb->Control & XHCI_TRB_CYCLE) | XHCI_TRB_TYPE(XHCI_TRB_NOOP_COMMAND);
+    }
+}
+
+OsStatus_t
+XhciCommandExecute(
+    _In_      XhciController_t* Controller,
+    _In_      uint32_t          ParameterLo,
+    _In_      uint32_t          ParameterHi,
+    _In_      uint32_t          Status,
+    _In_      uint32_t          Control,
+    _Out_Opt_ int*              SlotId)
+{
+    uintptr_t Address;
+    uintptr_t Expected = 0;
+    int       Timeout  = XHCI_COMMAND_TIMEOUT;
+
+    TRACE("XhciCommandExecute(Type %u)", XHCI_TRB_GET_TYPE(Control));
+
+    // Commands are executed one at the time, the ring is reserved before the
+    // TRB is written so two callers can never enqueue at the same time
+    if (!atomic_compare_exchange_strong(&Controller->CommandPending, &Expected, XHCI_COMMAND_RESERVED)) {
+        return OsBusy;
+    }
+
+    atomic_store(&Controller->CommandDone, 0);
+    Address = XhciRingEnqueue(&Controller->CommandRing, ParameterLo, ParameterHi, Status, Control);
+    atomic_store(&Controller->CommandPending, Address);
+    WRITE_VOLATILE(Controller->Doorbells[0], 0);
+
+    // Completions arrive on the primary interrupter, poll it as the interrupt
+    // handler might not get to run before we return
+    while (!atomic_load(&Controller->CommandDone) && Timeout > 0) {
+        XhciProcessEvents(Controller, &Controller->Interrupters[0]);
+        if (atomic_load(&Controller->CommandDone)) {
+            break;
+        }
+        thrd_sleepex(1);
+        Timeout--;
+    }
+
+    // A command left on the ring would complete into the next command's slot
+    if (!atomic_load(&Controller->CommandDone)) {
+        XhciCommandAbort(Controller, Address);
+    }
+    atomic_store(&Controller->CommandPending, 0);
+
+    if (!atomic_load(&Controller->CommandDone) ||
+        Controller->CommandCode == XHCI_CC_COMMAND_ABORTED) {
+        ERROR("XHCI-Failure: Command %u timed out", XHCI_TRB_GET_TYPE(Control));
+        return OsTimeout;
+    }
+
+    if (SlotId != NULL) {
+        *SlotId = Controller->CommandSlot;
+    }
+
+    if (Controller->CommandCode != XHCI_CC_SUCCESS) {
+        ERROR("XHCI-Failure: Command %u failed with code %i",
+            XHCI_TRB_GET_TYPE(Control), Controller->CommandCode);
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+void
+XhciCommandCompleted(
+    _In_ XhciController_t* Controller,
+    _In_ XhciTrb_t*        Event)
+{
+    uintptr_t Address = (uintptr_t)READ_VOLATILE(Event->ParameterLo);
+
+    int       Code    = (int)XHCI_TRB_COMPLETION(READ_VOLATILE(Event->Status));
+
+    TRACE("XhciCommandCompleted(Address 0x%x, Code %i)", Address, Code);
+
+    // The ring stopped event points at the next TRB and doesn't consume it
+    if (Code == XHCI_CC_COMMAND_STOPPED) {
+        atomic_store(&Controller->CommandStopped, 1);
+        return;
+    }
+
+    Controller->CommandRing.Free++;
+    if (Address == atomic_load(&Controller->CommandPending)) {
+        Controller->CommandCode = Code;
+        Controller->CommandSlot = (int)XHCI_TRB_GET_SLOT(READ_VOLATILE(Event->Control));
+        atomic_store(&Controller->CommandDone, 1);
+    }
+}
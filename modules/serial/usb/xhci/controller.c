@@ -0,0 +1,660 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ */
+//#define __TRACE
+
+#include <ddk/interrupt.h>
+#include <ddk/utils.h>
+#include "../common/hci.h"
+#include "xhci.h"
+#include <threads.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Prototypes
+ * This is to keep the create/destroy at the top of the source file */
+OsStatus_t          XhciSetup(XhciController_t *Controller);
+InterruptStatus_t   OnFastInterrupt(FastInterruptResources_t*, void*);
+
+void GetModuleIdentifiers(unsigned int* vendorId, unsigned int* deviceId,
+    unsigned int* class, unsigned int* subClass)
+{
+    *vendorId = 0;
+    *deviceId = 0;
+    *class    = 0xC0003;
+    *subClass = 0x300000;
+}
+
+UsbManagerController_t*
+HciControllerCreate(
+    _In_ BusDevice_t* Device)
+{
+    XhciController_t* Controller;
+    DeviceIo_t*       IoBase = NULL;
+    int i;
+
+    // Allocate a new instance of the controller
+    Controller = (XhciController_t*)malloc(sizeof(XhciController_t));
+    if (!Controller) {
+        return NULL;
+    }
+
+    memset(Controller, 0, sizeof(XhciController_t));
+    memcpy(&Controller->Base.Device, Device, Device->Base.Length);
+
+    // Fill in some basic stuff needed for init
+    Controller->Base.Type            = UsbXHCI;
+    Controller->Base.Interrupt       = UUID_INVALID;
+    Controller->Base.TransactionList = CollectionCreate(KeyInteger);
+    CompletionQueueInitialize(&Controller->Base.Completions, UsbManagerCompleteTransfer, &Controller->Base);
+    spinlock_init(&Controller->Base.Lock, spinlock_plain);
+    for (i = 0; i < XHCI_MAX_INTERRUPTERS; i++) {
+        Controller->Interrupters[i].Controller = Controller;
+        Controller->Interrupters[i].Index      = i;
+        Controller->Interrupters[i].Interrupt  = UUID_INVALID;
+    }
+
+    // Get I/O Base, and for XHCI it'll be the first address we encounter
+    // of type MMIO
+    for (i = 0; i < __DEVICEMANAGER_MAX_IOSPACES; i++) {
+        if (Controller->Base.Device.IoSpaces[i].Type == DeviceIoMemoryBased) {
+            IoBase = &Controller->Base.Device.IoSpaces[i];
+            break;
+        }
+    }
+
+    // Sanitize that we found the io-space
+    if (IoBase == NULL) {
+        ERROR("No memory space found for xhci-controller");
+        free(Controller);
+        return NULL;
+    }
+
+    TRACE("Found Io-Space (Type %u, Physical 0x%x, Size 0x%x)",
+        IoBase->Type, IoBase->PhysicalBase, IoBase->Size);
+
+    // Acquire the io-space
+    if (AcquireDeviceIo(IoBase) != OsSuccess) {
+        ERROR("Failed to create and acquire the io-space for xhci-controller");
+        free(Controller);
+        return NULL;
+    }
+    else {
+        // Store information
+        Controller->Base.IoBase = IoBase;
+    }
+
+    TRACE("Io-Space was assigned virtual address 0x%x", IoBase->Access.Memory.VirtualBase);
+
+    // Instantiate the register-access
+    Controller->CapRegisters  = (XhciCapabilityRegisters_t*)IoBase->Access.Memory.VirtualBase;
+    Controller->OpRegisters   = (XhciOperationalRegisters_t*)
+        (IoBase->Access.Memory.VirtualBase + Controller->CapRegisters->Length);
+    Controller->PortRegisters = (XhciPortRegisters_t*)
+        ((uintptr_t)Controller->OpRegisters + XHCI_PORT_REGISTERS_OFFSET);
+    Controller->Doorbells     = (reg32_t*)(IoBase->Access.Memory.VirtualBase +
+        (READ_VOLATILE(Controller->CapRegisters->DoorbellOffset) & ~0x3));
+    Controller->RuntimeBase   = IoBase->Access.Memory.VirtualBase +
+        (READ_VOLATILE(Controller->CapRegisters->RuntimeOffset) & ~0x1F);
+
+    // Enable device
+    if (IoctlDevice(Controller->Base.Device.Base.Id, __DEVICEMANAGER_IOCTL_BUS,
+        (__DEVICEMANAGER_IOCTL_ENABLE | __DEVICEMANAGER_IOCTL_MMIO_ENABLE
+            | __DEVICEMANAGER_IOCTL_BUSMASTER_ENABLE)) != OsSuccess) {
+        ERROR("Failed to enable the xhci-controller");
+        ReleaseDeviceIo(Controller->Base.IoBase);
+        free(Controller);
+        return NULL;
+    }
+
+    // Now that all formalities has been taken care
+    // off we can actually setup controller
+    if (XhciSetup(Controller) == OsSuccess) {
+        return &Controller->Base;
+    }
+    else {
+        HciControllerDestroy(&Controller->Base);
+        return NULL;
+    }
+}
+
+/* HciControllerDestroy
+ * Destroys an existing controller instance and cleans up
+ * any resources related to it */
+OsStatus_t
+HciControllerDestroy(
+    _In_ UsbManagerController_t* Controller)
+{
+    XhciController_t* Xhci = (XhciController_t*)Controller;
+    int               i;
+
+    // Unregister, then destroy
+    UsbManagerDestroyController(Controller);
+    XhciHalt(Xhci);
+
+    // Fail all transfers and release devices without issuing commands
+    UsbManagerClearTransfers(Controller);
+    for (i = 1; i <= XHCI_MAX_SLOTS; i++) {
+        if (Xhci->Devices[i] != NULL) {
+            XhciDeviceDestroy(Xhci, Xhci->Devices[i]);
+        }
+    }
+
+    // Unregister the interrupts
+    for (i = 0; i < XHCI_MAX_INTERRUPTERS; i++) {
+        if (Xhci->Interrupters[i].Interrupt != UUID_INVALID) {
+            UnregisterInterruptSource(Xhci->Interrupters[i].Interrupt);
+        }
+        XhciInterrupterDestroy(Xhci, &Xhci->Interrupters[i]);
+    }
+
+    // Cleanup controller structures
+    XhciRingDestroy(&Xhci->CommandRing);
+    for (i = 0; i < Xhci->ScratchpadCount; i++) {
+        XhciDmaFree(&Xhci->Scratchpads[i]);
+    }
+    if (Xhci->Scratchpads != NULL) {
+        free(Xhci->Scratchpads);
+    }
+    XhciDmaFree(&Xhci->ScratchpadArray);
+    XhciDmaFree(&Xhci->DeviceContextArray);
+    if (Controller->Scheduler != NULL) {
+        UsbSchedulerDestroy(Controller->Scheduler);
+    }
+
+    // Release the io-spaces
+    if (Xhci->MsixIo != NULL) {
+        ReleaseDeviceIo(Xhci->MsixIo);
+    }
+    ReleaseDeviceIo(Controller->IoBase);
+
+    // Free the list of endpoints
+    CollectionDestroy(Controller->TransactionList);
+    free(Controller);
+    return OsSuccess;
+}
+
+OsStatus_t
+XhciDmaAllocate(
+    _In_ size_t     Length,
+    _In_ XhciDma_t* Dma)
+{
+    struct dma_buffer_info DmaInfo;
+    struct dma_sg_table    DmaTable;
+    OsStatus_t             Status;
+    int                    i;
+
+    DmaInfo.name     = "xhci_memory";
+    DmaInfo.length   = Length;
+    DmaInfo.capacity = Length;
+    DmaInfo.flags    = DMA_UNCACHEABLE | DMA_CLEAN;
+
+    Status = dma_create(&DmaInfo, &Dma->Attachment);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    // The controller addresses these structures by their first physical address
+    // only, so the whole buffer must be physically contiguous
+    Status = dma_get_sg_table(&Dma->Attachment, &DmaTable, -1);
+    if (Status != OsSuccess) {
+        dma_attachment_unmap(&Dma->Attachment);
+        dma_detach(&Dma->Attachment);
+        return Status;
+    }
+
+    for (i = 1; i < DmaTable.count; i++) {
+        if (DmaTable.entries[i].address !=
+                DmaTable.entries[i - 1].address + DmaTable.entries[i - 1].length) {
+            ERROR("XhciDmaAllocate %u bytes are not physically contiguous", LODWORD(Length));
+            free(DmaTable.entries);
+            dma_attachment_unmap(&Dma->Attachment);
+            dma_detach(&Dma->Attachment);
+            return OsError;
+        }
+    }
+
+    Dma->Virtual  = Dma->Attachment.buffer;
+    Dma->Physical = DmaTable.entries[0].address;
+    free(DmaTable.entries);
+    return OsSuccess;
+}
+
+void
+XhciDmaFree(
+    _In_ XhciDma_t* Dma)
+{
+    if (Dma->Virtual != NULL) {
+        dma_attachment_unmap(&Dma->Attachment);
+        dma_detach(&Dma->Attachment);
+        Dma->Virtual  = NULL;
+        Dma->Physical = 0;
+    }
+}
+
+static void
+XhciParseExtendedCapabilities(
+    _In_ XhciController_t* Controller)
+{
+    uintptr_t IoBase = Controller->Base.IoBase->Access.Memory.VirtualBase;
+    size_t    Offset = XHCI_CPARAM1_XECP(Controller->CParameters) << 2;
+    int       Fault  = 0;
+
+    TRACE("XhciParseExtendedCapabilities()");
+
+    while (Offset) {
+        reg32_t* Capability = (reg32_t*)(IoBase + Offset);
+        reg32_t  Value      = READ_VOLATILE(Capability[0]);
+
+        // Take ownership from the BIOS and disable the SMIs it uses
+        if (XHCI_XCAP_ID(Value) == XHCI_XCAP_LEGACY) {
+            if (Value & XHCI_LEGACY_BIOS_OWNED) {
+                WRITE_VOLATILE(Capability[0], Value | XHCI_LEGACY_OS_OWNED);
+                WaitForConditionWithFault(Fault, (READ_VOLATILE(Capability[0]) & XHCI_LEGACY_BIOS_OWNED) == 0, 250, 10);
+                if (Fault) {
+                    WARNING("XHCI: Failed to release BIOS Semaphore");
+                }
+            }
+            Value = READ_VOLATILE(Capability[1]);
+            Value &= ~(XHCI_LEGACY_SMI_ENABLE);
+            WRITE_VOLATILE(Capability[1], Value | XHCI_LEGACY_SMI_EVENTS);
+        }
+        else if (XHCI_XCAP_ID(Value) == XHCI_XCAP_PROTOCOL) {
+            // Ports are 1-based in the protocol capability
+            reg32_t PortInfo = READ_VOLATILE(Capability[2]);
+            int     First    = (int)XHCI_PROTOCOL_PORT_OFFSET(PortInfo);
+            int     Count    = (int)XHCI_PROTOCOL_PORT_COUNT(PortInfo);
+            int     i;
+
+            TRACE("Ports %i-%i are usb %u", First, First + Count - 1, XHCI_PROTOCOL_MAJOR(Value));
+            for (i = First; i < (First + Count) && i <= XHCI_MAX_PORTS && i > 0; i++) {
+                Controller->PortProtocol[i - 1] = (uint8_t)XHCI_PROTOCOL_MAJOR(Value);
+            }
+        }
+
+        if (!XHCI_XCAP_NEXT(Value)) {
+            break;
+        }
+        Offset += XHCI_XCAP_NEXT(Value) << 2;
+    }
+}
+
+OsStatus_t
+XhciHalt(
+    _In_ XhciController_t* Controller)
+{
+    reg32_t TemporaryValue;
+    int     Fault = 0;
+
+    TRACE("XhciHalt()");
+
+    TemporaryValue = READ_VOLATILE(Controller->OpRegisters->UsbCommand);
+    TemporaryValue &= ~(XHCI_COMMAND_RUN | XHCI_COMMAND_INTERRUPT_ENABLE | XHCI_COMMAND_HOSTERROR_ENABLE);
+    WRITE_VOLATILE(Controller->OpRegisters->UsbCommand, TemporaryValue);
+
+    // The controller must halt within 16 ms
+    WaitForConditionWithFault(Fault, (READ_VOLATILE(Controller->OpRegisters->UsbStatus) & XHCI_STATUS_HALTED) != 0, 250, 10);
+    if (Fault) {
+        ERROR("XHCI-Failure: Failed to stop controller, Command Register: 0x%x - Status: 0x%x",
+            Controller->OpRegisters->UsbCommand, Controller->OpRegisters->UsbStatus);
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+static OsStatus_t
+XhciReset(
+    _In_ XhciController_t* Controller)
+{
+    reg32_t TemporaryValue;
+    int     Fault = 0;
+
+    TRACE("XhciReset()");
+
+    TemporaryValue = READ_VOLATILE(Controller->OpRegisters->UsbCommand);
+    WRITE_VOLATILE(Controller->OpRegisters->UsbCommand, TemporaryValue | XHCI_COMMAND_HCRESET);
+
+    // Wait for the reset to finish and the controller to be ready for register writes
+    WaitForConditionWithFault(Fault, (READ_VOLATILE(Controller->OpRegisters->UsbCommand) & XHCI_COMMAND_HCRESET) == 0 &&
+        (READ_VOLATILE(Controller->OpRegisters->UsbStatus) & XHCI_STATUS_NOT_READY) == 0, 250, 10);
+    if (Fault) {
+        ERROR("XHCI-Failure: Reset signal won't deassert, Command Register: 0x%x - Status: 0x%x",
+            Controller->OpRegisters->UsbCommand, Controller->OpRegisters->UsbStatus);
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+static void
+XhciMsixDisable(
+    _In_ XhciController_t* Controller,
+    _In_ size_t            Capability)
+{
+    size_t Value = 0;
+
+    IoctlDeviceEx(Controller->Base.Device.Base.Id, 0, Capability + 2, &Value, 2);
+    Value &= ~(XHCI_MSIX_ENABLE | XHCI_MSIX_FUNCTION_MASK);
+    IoctlDeviceEx(Controller->Base.Device.Base.Id, 1, Capability + 2, &Value, 2);
+}
+
+static int
+XhciMsixInitialize(
+    _In_ XhciController_t* Controller)
+{
+    XhciMsixEntry_t* Table;
+    DeviceIo_t*      TableIo;
+    size_t           Capability = 0;
+    size_t           Control    = 0;
+    size_t           Value      = 0;
+    UUId_t           DeviceId   = Controller->Base.Device.Base.Id;
+    int              Count;
+    int              i;
+
+    TRACE("XhciMsixInitialize()");
+
+    // Locate the msi-x capability in the pci configuration space
+    if (IoctlDeviceEx(DeviceId, 0, XHCI_PCI_STATUS, &Value, 2) != OsSuccess ||
+        !(Value & XHCI_PCI_STATUS_CAPABILITIES)) {
+        return 0;
+    }
+
+    if (IoctlDeviceEx(DeviceId, 0, XHCI_PCI_CAPABILITIES, &Capability, 1) != OsSuccess) {
+        return 0;
+    }
+
+    Capability &= 0xFC;
+    while (Capability) {
+        if (IoctlDeviceEx(DeviceId, 0, Capability, &Value, 1) != OsSuccess) {
+            return 0;
+        }
+        if (Value == XHCI_PCI_CAP_MSIX) {
+            break;
+        }
+        if (IoctlDeviceEx(DeviceId, 0, Capability + 1, &Capability, 1) != OsSuccess) {
+            return 0;
+        }
+        Capability &= 0xFC;
+    }
+
+    if (!Capability) {
+        return 0;
+    }
+
+    IoctlDeviceEx(DeviceId, 0, Capability + 2, &Control, 2);
+    IoctlDeviceEx(DeviceId, 0, Capability + 4, &Value, 4);
+    Count = MIN(XHCI_MAX_INTERRUPTERS, (int)XHCI_SPARAM1_MAXINTRS(Controller->SParameters1));
+    Count = MIN(Count, (int)XHCI_MSIX_TABLESIZE(Control));
+
+    // The io-spaces are indexed by their BAR, and the table usually shares
+    // the BAR with the registers
+    TableIo = &Controller->Base.Device.IoSpaces[XHCI_MSIX_BIR(Value)];
+    if (TableIo->Type != DeviceIoMemoryBased) {
+        return 0;
+    }
+
+    if (TableIo->Access.Memory.PhysicalBase != Controller->Base.IoBase->Access.Memory.PhysicalBase) {
+        if (AcquireDeviceIo(TableIo) != OsSuccess) {
+            return 0;
+        }
+        Controller->MsixIo = TableIo;
+    }
+    else {
+        TableIo = Controller->Base.IoBase;
+    }
+    Table = (XhciMsixEntry_t*)(TableIo->Access.Memory.VirtualBase + XHCI_MSIX_OFFSET(Value));
+
+    // Mask all vectors while the table is written
+    Control |= XHCI_MSIX_ENABLE | XHCI_MSIX_FUNCTION_MASK;
+    IoctlDeviceEx(DeviceId, 1, Capability + 2, &Control, 2);
+
+    for (i = 0; i < Count; i++) {
+        XhciInterrupter_t* Interrupter = &Controller->Interrupters[i];
+        DeviceInterrupt_t  Interrupt;
+
+        DeviceInterruptInitialize(&Interrupt, &Controller->Base.Device);
+        RegisterFastInterruptHandler(&Interrupt, OnFastInterrupt);
+        RegisterFastInterruptIoResource(&Interrupt, Controller->Base.IoBase);
+        RegisterFastInterruptMemoryResource(&Interrupt, (uintptr_t)Interrupter, sizeof(XhciInterrupter_t), 0);
+        RegisterInterruptContext(&Interrupt, Interrupter);
+        Interrupter->Interrupt = RegisterInterruptSource(&Interrupt, INTERRUPT_USERSPACE | INTERRUPT_MSI);
+        if (Interrupter->Interrupt == UUID_INVALID) {
+            break;
+        }
+
+        WRITE_VOLATILE(Table[i].AddressLo, LODWORD(Interrupt.MsiAddress));
+        WRITE_VOLATILE(Table[i].AddressHi, 0);
+        WRITE_VOLATILE(Table[i].Data, (reg32_t)Interrupt.MsiValue);
+        WRITE_VOLATILE(Table[i].VectorControl, 0);
+    }
+
+    if (i == 0) {
+        XhciMsixDisable(Controller, Capability);
+        return 0;
+    }
+
+    // Unmask the function and disable the legacy interrupt line
+    Control &= ~(XHCI_MSIX_FUNCTION_MASK);
+    IoctlDeviceEx(DeviceId, 1, Capability + 2, &Control, 2);
+    IoctlDeviceEx(DeviceId, 0, XHCI_PCI_COMMAND, &Value, 2);
+    Value |= XHCI_PCI_COMMAND_INTX_DISABLE;
+    IoctlDeviceEx(DeviceId, 1, XHCI_PCI_COMMAND, &Value, 2);
+    return i;
+}
+
+static OsStatus_t
+XhciInterruptsInitialize(
+    _In_ XhciController_t* Controller)
+{
+    uintptr_t IoBase = Controller->Base.IoBase->Access.Memory.VirtualBase;
+    int       i;
+
+    // Completions are spread over an interrupter per vector when msi-x is available,
+    // otherwise everything is handled by the primary interrupter on the line
+    Controller->InterrupterCount = XhciMsixInitialize(Controller);
+    if (!Controller->InterrupterCount) {
+        XhciInterrupter_t* Interrupter = &Controller->Interrupters[0];
+        DeviceInterrupt_t  Interrupt;
+
+        DeviceInterruptInitialize(&Interrupt, &Controller->Base.Device);
+        RegisterFastInterruptHandler(&Interrupt, OnFastInterrupt);
+        RegisterFastInterruptIoResource(&Interrupt, Controller->Base.IoBase);
+        RegisterFastInterruptMemoryResource(&Interrupt, (uintptr_t)Interrupter, sizeof(XhciInterrupter_t), 0);
+        RegisterInterruptContext(&Interrupt, Interrupter);
+        Interrupter->Interrupt = RegisterInterruptSource(&Interrupt, INTERRUPT_USERSPACE);
+        if (Interrupter->Interrupt == UUID_INVALID) {
+            ERROR("Failed to register the xhci interrupt");
+            return OsError;
+        }
+        Controller->InterrupterCount = 1;
+    }
+    Controller->Base.Interrupt = Controller->Interrupters[0].Interrupt;
+    TRACE("Using %i interrupters", Controller->InterrupterCount);
+
+    for (i = 0; i < Controller->InterrupterCount; i++) {
+        XhciInterrupter_t* Interrupter = &Controller->Interrupters[i];
+        Interrupter->RegisterOffset = (Controller->RuntimeBase + XHCI_INTERRUPTER_OFFSET(i)) - IoBase;
+        Interrupter->StatusOffset   = ((uintptr_t)&Controller->OpRegisters->UsbStatus) - IoBase;
+        if (XhciInterrupterInitialize(Controller, Interrupter) != OsSuccess) {
+            return OsOutOfMemory;
+        }
+    }
+    return OsSuccess;
+}
+
+static OsStatus_t
+XhciMemoryInitialize(
+    _In_ XhciController_t* Controller)
+{
+    reg32_t* Entries;
+    int      i;
+
+    TRACE("XhciMemoryInitialize()");
+
+    // The device context array holds one 64 bit pointer per slot, the first
+    // one points to the scratchpad array
+    if (XhciDmaAllocate((XHCI_MAX_SLOTS + 1) * sizeof(uint64_t), &Controller->DeviceContextArray) != OsSuccess) {
+        return OsOutOfMemory;
+    }
+
+    Controller->ScratchpadCount = MIN(XHCI_MAX_SCRATCHPADS,
+        (int)XHCI_SPARAM2_SCRATCHPADS(Controller->SParameters2));
+    if (Controller->ScratchpadCount) {
+        if (XhciDmaAllocate(Controller->ScratchpadCount * sizeof(uint64_t), &Controller->ScratchpadArray) != OsSuccess) {
+            return OsOutOfMemory;
+        }
+
+        Controller->Scratchpads = (XhciDma_t*)malloc(Controller->ScratchpadCount * sizeof(XhciDma_t));
+        if (!Controller->Scratchpads) {
+            return OsOutOfMemory;
+        }
+        memset(Controller->Scratchpads, 0, Controller->ScratchpadCount * sizeof(XhciDma_t));
+
+        Entries = (reg32_t*)Controller->ScratchpadArray.Virtual;
+        for (i = 0; i < Controller->ScratchpadCount; i++) {
+            if (XhciDmaAllocate(0x1000, &Controller->Scratchpads[i]) != OsSuccess) {
+                Controller->ScratchpadCount = i;
+                return OsOutOfMemory;
+            }
+            Entries[i * 2]       = LODWORD(Controller->Scratchpads[i].Physical);
+            Entries[(i * 2) + 1] = 0;
+        }
+        ((reg32_t*)Controller->DeviceContextArray.Virtual)[0] = LODWORD(Controller->ScratchpadArray.Physical);
+    }
+
+    if (XhciRingInitialize(&Controller->CommandRing, XHCI_RING_SIZE) != OsSuccess) {
+        return OsOutOfMemory;
+    }
+    return XhciInterruptsInitialize(Controller);
+}
+
+OsStatus_t
+XhciRestart(
+    _In_ XhciController_t* Controller)
+{
+    reg32_t TemporaryValue;
+    int     Fault = 0;
+    int     i;
+
+    TRACE("XhciRestart()");
+
+    // Stop controller and reset it
+    if (XhciHalt(Controller)  != OsSuccess ||
+        XhciReset(Controller) != OsSuccess) {
+        ERROR("Failed to halt or reset controller");
+        return OsError;
+    }
+
+    // Program the structures, the command ring must be reset as the controller
+    // starts from the beginning
+    XhciRingReset(&Controller->CommandRing);
+    WRITE_VOLATILE(Controller->OpRegisters->Configure, Controller->MaxSlots);
+    WRITE_VOLATILE(Controller->OpRegisters->DcbaapLo, LODWORD(Controller->DeviceContextArray.Physical));
+    WRITE_VOLATILE(Controller->OpRegisters->DcbaapHi, 0);
+    WRITE_VOLATILE(Controller->OpRegisters->CommandRingLo,
+        LODWORD(Controller->CommandRing.Memory.Physical) | XHCI_CRCR_CYCLE);
+    WRITE_VOLATILE(Controller->OpRegisters->CommandRingHi, 0);
+    for (i = 0; i < Controller->InterrupterCount; i++) {
+        XhciInterrupterReset(Controller, &Controller->Interrupters[i]);
+    }
+
+    // Start the controller
+    TemporaryValue = READ_VOLATILE(Controller->OpRegisters->UsbCommand);
+    TemporaryValue |= XHCI_COMMAND_RUN | XHCI_COMMAND_INTERRUPT_ENABLE | XHCI_COMMAND_HOSTERROR_ENABLE;
+    WRITE_VOLATILE(Controller->OpRegisters->UsbCommand, TemporaryValue);
+
+    WaitForConditionWithFault(Fault, (READ_VOLATILE(Controller->OpRegisters->UsbStatus) & XHCI_STATUS_HALTED) == 0, 250, 10);
+    if (Fault) {
+        ERROR("XHCI-Failure: Failed to start controller, Command Register: 0x%x - Status: 0x%x",
+            Controller->OpRegisters->UsbCommand, Controller->OpRegisters->UsbStatus);
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+XhciSetup(
+    _In_ XhciController_t* Controller)
+{
+    UsbSchedulerSettings_t Settings;
+    size_t                 i;
+
+    TRACE("XhciSetup()");
+
+    // Save some read-only but often accessed information
+    Controller->SParameters1   = READ_VOLATILE(Controller->CapRegisters->SParams1);
+    Controller->SParameters2   = READ_VOLATILE(Controller->CapRegisters->SParams2);
+    Controller->CParameters    = READ_VOLATILE(Controller->CapRegisters->CParams1);
+    Controller->MaxSlots       = MIN(XHCI_MAX_SLOTS, (int)XHCI_SPARAM1_MAXSLOTS(Controller->SParameters1));
+    Controller->ContextSize    = (Controller->CParameters & XHCI_CPARAM1_CSZ) ? 64 : 32;
+    Controller->Base.PortCount = XHCI_SPARAM1_MAXPORTS(Controller->SParameters1);
+
+    // Take ownership and read the port protocols
+    XhciParseExtendedCapabilities(Controller);
+    if (XhciHalt(Controller) != OsSuccess || XhciReset(Controller) != OsSuccess) {
+        return OsError;
+    }
+
+    // The controller schedules in hardware, so the scheduler is only used for
+    // keeping the transfer bookkeeping
+    UsbSchedulerSettingsCreate(&Settings, 1, 1, 900, 0);
+    UsbSchedulerSettingsAddPool(&Settings, sizeof(XhciTransferDescriptor_t), XHCI_TD_ALIGNMENT, XHCI_TD_COUNT, 0,
+        offsetof(XhciTransferDescriptor_t, AlternativeLink), offsetof(XhciTransferDescriptor_t, Link),
+        offsetof(XhciTransferDescriptor_t, Object));
+    if (UsbSchedulerInitialize(&Settings, &Controller->Base.Scheduler) != OsSuccess) {
+        ERROR("Failed to initialize the xhci scheduler");
+        return OsError;
+    }
+
+    if (XhciMemoryInitialize(Controller) != OsSuccess) {
+        ERROR("Failed to allocate the xhci structures");
+        return OsOutOfMemory;
+    }
+
+    if (XhciRestart(Controller) != OsSuccess) {
+        return OsError;
+    }
+
+    // Register the controller before starting
+    if (UsbManagerRegisterController(&Controller->Base) != OsSuccess) {
+        ERROR(" > failed to register xhci controller with the system.");
+    }
+
+    // Power on the ports if the controller requires it
+    if (Controller->CParameters & XHCI_CPARAM1_PPC) {
+        TRACE(" > Powering up ports");
+        for (i = 0; i < Controller->Base.PortCount; i++) {
+            reg32_t PortStatus = READ_VOLATILE(Controller->PortRegisters[i].StatusControl);
+            WRITE_VOLATILE(Controller->PortRegisters[i].StatusControl,
+                (PortStatus & XHCI_PORT_PRESERVE) | XHCI_PORT_POWER);
+        }
+        thrd_sleepex(20);
+    }
+
+    TRACE(" > Initializing ports");
+    for (i = 0; i < Controller->Base.PortCount; i++) {
+        reg32_t PortStatus = READ_VOLATILE(Controller->PortRegisters[i].StatusControl);
+        if (PortStatus & XHCI_PORT_CONNECTED) {
+            UsbEventPort(Controller->Base.Device.Base.Id, 0, (uint8_t)(i & 0xFF));
+        }
+    }
+    return OsSuccess;
+}
@@ -0,0 +1,796 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ */
+//#define __TRACE
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include "xhci.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int
+XhciDeviceGetSpeedId(
+    _In_ UsbSpeed_t Speed)
+{
+    switch (Speed) {
+        case LowSpeed: return XHCI_SPEED_LOW;
+        case FullSpeed: return XHCI_SPEED_FULL;
+        case HighSpeed: return XHCI_SPEED_HIGH;
+        default: return XHCI_SPEED_SUPER;
+    }
+}
+
+static int
+XhciDeviceGetEndpointId(
+    _In_ UsbTransfer_t* Transfer)
+{
+    // Control endpoints are bidirectional and use the IN index
+    if (Transfer->Type == ControlTransfer) {
+        return (int)(Transfer->Address.EndpointAddress * 2) + 1;
+    }
+    return XHCI_DCI(Transfer->Address.EndpointAddress, Transfer->Endpoint.Direction);
+}
+
+static XhciDevice_t*
+XhciDeviceFind(
+    _In_ XhciController_t* Controller,
+    _In_ UsbHcAddress_t*   Address)
+{
+    for (int i = 1; i <= Controller->MaxSlots; i++) {
+        XhciDevice_t* Device = Controller->Devices[i];
+        if (Device == NULL || Device->Detached) {
+            continue;
+        }
+
+        // Unaddressed devices are found by their port, only one device per
+        // port can be in the default state
+        if (Address->DeviceAddress == 0) {
+            if (Device->Address == 0 && Device->HubAddress == Address->HubAddress &&
+                Device->PortAddress == Address->PortAddress) {
+                return Device;
+            }
+        }
+        else if (Device->Address == Address->DeviceAddress) {
+            return Device;
+        }
+    }
+    return NULL;
+}
+
+XhciRing_t*
+XhciDeviceGetRing(
+    _In_ XhciDevice_t* Device,
+    _In_ int           EndpointId,
+    _In_ int           StreamId)
+{
+    XhciEndpoint_t* Endpoint = &Device->Endpoints[EndpointId];
+    if (Endpoint->StreamCount) {
+        if (StreamId <= 0 || StreamId >= Endpoint->StreamCount) {
+            return NULL;
+        }
+        return &Endpoint->Streams[StreamId];
+    }
+    return &Endpoint->Ring;
+}
+
+static reg32_t
+XhciDeviceGetHardwareDequeue(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ int               EndpointId,
+    _In_ int               StreamId)
+{
+    XhciEndpoint_t* Endpoint = &Device->Endpoints[EndpointId];
+    if (Endpoint->StreamCount) {
+        reg32_t* Context = (reg32_t*)((uint8_t*)Endpoint->StreamContexts.Virtual + (StreamId * 16));
+        return READ_VOLATILE(Context[0]) & ~0xFU;
+    }
+    return READ_VOLATILE(XHCI_CONTEXT(Controller, &Device->OutputContext, EndpointId)[2]) & ~0xFU;
+}
+
+static OsStatus_t
+XhciDeviceSetDequeue(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ int               EndpointId,
+    _In_ int               StreamId,
+    _In_ uintptr_t         Dequeue)
+{
+    uint32_t Type = Device->Endpoints[EndpointId].StreamCount ? XHCI_STREAM_PRIMARY_RING : 0;
+    return XhciCommandExecute(Controller, LODWORD(Dequeue) | Type, 0, XHCI_TRB_STREAM(StreamId),
+        XHCI_TRB_TYPE(XHCI_TRB_SET_DEQUEUE) | XHCI_TRB_SLOT(Device->SlotId) |
+        XHCI_TRB_ENDPOINT(EndpointId), NULL);
+}
+
+static void
+XhciDeviceInitializeInput(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ size_t            MaxPacketSize)
+{
+    reg32_t* Control  = XHCI_CONTEXT(Controller, &Device->InputContext, 0);
+    reg32_t* Slot     = XHCI_CONTEXT(Controller, &Device->InputContext, 1);
+    reg32_t* Endpoint = XHCI_CONTEXT(Controller, &Device->InputContext, 2);
+
+    memset(Device->InputContext.Virtual, 0, (XHCI_MAX_ENDPOINTS + 1) * Controller->ContextSize);
+    Control[XHCI_INPUT_ADD] = (1 << 0) | (1 << 1);
+
+    Slot[0] = XHCI_SLOT_ROUTE(Device->Route) | XHCI_SLOT_SPEED(XhciDeviceGetSpeedId(Device->Speed)) |
+        XHCI_SLOT_ENTRIES(1);
+    Slot[1] = XHCI_SLOT_ROOTPORT(Device->RootPort);
+    Slot[2] = XHCI_SLOT_INTERRUPTER(Device->Interrupter) | XHCI_SLOT_TT_SLOT(Device->TtSlot) |
+        XHCI_SLOT_TT_PORT(Device->TtPort);
+
+    Endpoint[1] = XHCI_EP_CERR(3) | XHCI_EP_TYPE(XHCI_EP_TYPE_CONTROL) | XHCI_EP_MPS(MaxPacketSize);
+    Endpoint[2] = LODWORD(XhciRingGetDequeue(&Device->Endpoints[1].Ring));
+    Endpoint[3] = 0;
+    Endpoint[4] = XHCI_EP_AVERAGE_TRB(8);
+}
+
+void
+XhciDeviceDestroy(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device)
+{
+    TRACE("XhciDeviceDestroy(Slot %i)", Device->SlotId);
+
+    for (int i = 1; i < XHCI_MAX_ENDPOINTS; i++) {
+        XhciEndpoint_t* Endpoint = &Device->Endpoints[i];
+        if (Endpoint->Ring.Trbs != NULL) {
+            XhciRingDestroy(&Endpoint->Ring);
+        }
+        if (Endpoint->Streams != NULL) {
+            for (int j = 1; j < Endpoint->StreamCount; j++) {
+                XhciRingDestroy(&Endpoint->Streams[j]);
+            }
+            free(Endpoint->Streams);
+        }
+        XhciDmaFree(&Endpoint->StreamContexts);
+    }
+
+    // Transfers that are still around must not find a new device in this slot
+    foreach(Node, Controller->Base.TransactionList) {
+        UsbManagerTransfer_t*     Transfer = (UsbManagerTransfer_t*)Node->Data;
+        XhciTransferDescriptor_t* Td       = (XhciTransferDescriptor_t*)Transfer->EndpointDescriptor;
+        if (Td != NULL && Td->SlotId == Device->SlotId) {
+            Td->SlotId = 0;
+        }
+    }
+
+    ((uint64_t*)Controller->DeviceContextArray.Virtual)[Device->SlotId] = 0;
+    Controller->Devices[Device->SlotId] = NULL;
+    XhciDmaFree(&Device->InputContext);
+    XhciDmaFree(&Device->OutputContext);
+    free(Device);
+}
+
+static OsStatus_t
+XhciDeviceCreate(
+    _In_  XhciController_t* Controller,
+    _In_  UsbTransfer_t*    Transfer,
+    _Out_ XhciDevice_t**    DeviceOut)
+{
+    XhciDevice_t* Device;
+    OsStatus_t    Status;
+    int           SlotId = 0;
+
+    TRACE("XhciDeviceCreate(Hub %u, Port %u)", Transfer->Address.HubAddress, Transfer->Address.PortAddress);
+
+    Status = XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_ENABLE_SLOT), &SlotId);
+    if (Status != OsSuccess || SlotId <= 0 || SlotId > Controller->MaxSlots) {
+        ERROR("XHCI-Failure: Failed to enable a device slot");
+        return OsOutOfMemory;
+    }
+
+    Device = (XhciDevice_t*)malloc(sizeof(XhciDevice_t));
+    if (!Device) {
+        XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(SlotId), NULL);
+        return OsOutOfMemory;
+    }
+
+    memset(Device, 0, sizeof(XhciDevice_t));
+    Device->SlotId      = SlotId;
+    Device->HubAddress  = Transfer->Address.HubAddress;
+    Device->PortAddress = Transfer->Address.PortAddress;
+    Device->Speed       = Transfer->Speed;
+    Controller->Devices[SlotId] = Device;
+
+    // Events of the slot itself go to a secondary interrupter, the primary one is
+    // kept for commands and port events. Transfer events are spread per endpoint.
+    if (Controller->InterrupterCount > 1) {
+        Device->Interrupter = 1 + (SlotId % (Controller->InterrupterCount - 1));
+    }
+
+    // Build the route string, each hub tier takes a nibble
+    if (Device->HubAddress == 0) {
+        Device->RootPort = Device->PortAddress + 1;
+    }
+    else {
+        UsbHcAddress_t Parent = { 0 };
+        XhciDevice_t*  Hub;
+
+        Parent.DeviceAddress = Device->HubAddress;
+        Hub = XhciDeviceFind(Controller, &Parent);
+        if (Hub == NULL) {
+            ERROR("XHCI-Failure: Hub %u of device is not present", Device->HubAddress);
+            XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(SlotId), NULL);
+            XhciDeviceDestroy(Controller, Device);
+            return OsDoesNotExist;
+        }
+
+        Device->RootPort = Hub->RootPort;
+        Device->Depth    = Hub->Depth + 1;
+        Device->Route    = Hub->Route | ((uint32_t)MIN(Device->PortAddress + 1, 15) << (Hub->Depth * 4));
+        if (Hub->Speed == HighSpeed && Device->Speed < HighSpeed) {
+            Device->TtSlot = Hub->SlotId;
+            Device->TtPort = Device->PortAddress + 1;
+        }
+        else {
+            Device->TtSlot = Hub->TtSlot;
+            Device->TtPort = Hub->TtPort;
+        }
+    }
+
+    if (XhciDmaAllocate((XHCI_MAX_ENDPOINTS + 1) * Controller->ContextSize, &Device->InputContext) != OsSuccess ||
+        XhciDmaAllocate(XHCI_MAX_ENDPOINTS * Controller->ContextSize, &Device->OutputContext) != OsSuccess ||
+        XhciRingInitialize(&Device->Endpoints[1].Ring, XHCI_RING_SIZE) != OsSuccess) {
+        XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(SlotId), NULL);
+        XhciDeviceDestroy(Controller, Device);
+        return OsOutOfMemory;
+    }
+    Device->Endpoints[1].Configured    = 1;
+    Device->Endpoints[1].Type          = XHCI_EP_TYPE_CONTROL;
+    Device->Endpoints[1].MaxPacketSize = Transfer->Endpoint.MaxPacketSize;
+
+    ((uint64_t*)Controller->DeviceContextArray.Virtual)[SlotId] = Device->OutputContext.Physical;
+
+    // Move the slot into the default state without sending SET_ADDRESS, the usb
+    // stack still needs to read the device descriptor at address 0
+    XhciDeviceInitializeInput(Controller, Device, Transfer->Endpoint.MaxPacketSize);
+    Status = XhciCommandExecute(Controller, LODWORD(Device->InputContext.Physical), 0, 0,
+        XHCI_TRB_TYPE(XHCI_TRB_ADDRESS_DEVICE) | XHCI_TRB_SLOT(SlotId) | XHCI_TRB_BSR, NULL);
+    if (Status != OsSuccess) {
+        XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(SlotId), NULL);
+        XhciDeviceDestroy(Controller, Device);
+        return Status;
+    }
+
+    *DeviceOut = Device;
+    return OsSuccess;
+}
+
+OsStatus_t
+XhciDeviceSetAddress(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ uint8_t           Address)
+{
+    OsStatus_t Status;
+
+    TRACE("XhciDeviceSetAddress(Slot %i, Address %u)", Device->SlotId, Address);
+
+    XhciDeviceInitializeInput(Controller, Device, Device->Endpoints[1].MaxPacketSize);
+    Status = XhciCommandExecute(Controller, LODWORD(Device->InputContext.Physical), 0, 0,
+        XHCI_TRB_TYPE(XHCI_TRB_ADDRESS_DEVICE) | XHCI_TRB_SLOT(Device->SlotId), NULL);
+    if (Status == OsSuccess) {
+        Device->Address = Address;
+    }
+    return Status;
+}
+
+static OsStatus_t
+XhciDeviceUpdateControl(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ size_t            MaxPacketSize)
+{
+    reg32_t*   Control  = XHCI_CONTEXT(Controller, &Device->InputContext, 0);
+    reg32_t*   Endpoint = XHCI_CONTEXT(Controller, &Device->InputContext, 2);
+    OsStatus_t Status;
+
+    TRACE("XhciDeviceUpdateControl(Slot %i, MaxPacketSize %u)", Device->SlotId, MaxPacketSize);
+
+    memset(Device->InputContext.Virtual, 0, (XHCI_MAX_ENDPOINTS + 1) * Controller->ContextSize);
+    memcpy(Endpoint, XHCI_CONTEXT(Controller, &Device->OutputContext, 1), XHCI_CONTEXT_DWORDS * sizeof(reg32_t));
+    Control[XHCI_INPUT_ADD] = (1 << 1);
+    Endpoint[1]             = (Endpoint[1] & ~XHCI_EP_MPS(0xFFFF)) | XHCI_EP_MPS(MaxPacketSize);
+
+    Status = XhciCommandExecute(Controller, LODWORD(Device->InputContext.Physical), 0, 0,
+        XHCI_TRB_TYPE(XHCI_TRB_EVALUATE_CONTEXT) | XHCI_TRB_SLOT(Device->SlotId), NULL);
+    if (Status == OsSuccess) {
+        Device->Endpoints[1].MaxPacketSize = MaxPacketSize;
+    }
+    return Status;
+}
+
+static int
+XhciDeviceGetEndpointType(
+    _In_ UsbTransfer_t* Transfer)
+{
+    int In = Transfer->Endpoint.Direction == USB_ENDPOINT_IN;
+    switch (Transfer->Type) {
+        case ControlTransfer: return XHCI_EP_TYPE_CONTROL;
+        case BulkTransfer: return In ? XHCI_EP_TYPE_BULK_IN : XHCI_EP_TYPE_BULK_OUT;
+        case InterruptTransfer: return In ? XHCI_EP_TYPE_INTERRUPT_IN : XHCI_EP_TYPE_INTERRUPT_OUT;
+        default: return In ? XHCI_EP_TYPE_ISOC_IN : XHCI_EP_TYPE_ISOC_OUT;
+    }
+}
+
+static int
+XhciDeviceGetStreamCount(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ UsbTransfer_t*    Transfer)
+{
+    int MaxStreams = 1 << (XHCI_CPARAM1_MAXPSA(Controller->CParameters) + 1);
+    int Count      = 1;
+
+    if (Transfer->Type != BulkTransfer || Device->Speed != SuperSpeed ||
+        XHCI_CPARAM1_MAXPSA(Controller->CParameters) == 0 || Transfer->Endpoint.MaxStreams <= 1) {
+        return 0;
+    }
+
+    // Stream 0 is reserved, the array is sized to a power of two
+    MaxStreams = MIN(MaxStreams, XHCI_MAX_STREAMS);
+    MaxStreams = MIN(MaxStreams, (int)Transfer->Endpoint.MaxStreams);
+    while ((Count << 1) <= MaxStreams) {
+        Count <<= 1;
+    }
+    return Count > 1 ? Count : 0;
+}
+
+static int
+XhciDeviceGetInterval(
+    _In_ XhciDevice_t*  Device,
+    _In_ UsbTransfer_t* Transfer)
+{
+    int Interval = (int)Transfer->Endpoint.Interval;
+    int Exponent = 3;
+
+    if (Transfer->Type != InterruptTransfer && Transfer->Type != IsochronousTransfer) {
+        return 0;
+    }
+
+    // High-speed and super-speed intervals are already exponents, and so are full-speed
+    // isochronous ones but in frames instead of micro-frames
+    if (Device->Speed >= HighSpeed || Transfer->Type == IsochronousTransfer) {
+        Interval = MAX(1, MIN(Interval, 16)) - 1;
+        if (Device->Speed < HighSpeed) {
+            Interval += 3;
+        }
+        return Interval;
+    }
+
+    // Full- and low-speed interrupt intervals are in frames, convert to the
+    // largest power of two in micro-frames not exceeding it
+    while (Exponent < 10 && (1 << (Exponent + 1)) <= (Interval * 8)) {
+        Exponent++;
+    }
+    return Exponent;
+}
+
+static OsStatus_t
+XhciDeviceConfigureEndpoint(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ UsbTransfer_t*    Transfer,
+    _In_ int               EndpointId)
+{
+    XhciEndpoint_t  Endpoint   = { 0 };
+    XhciEndpoint_t* Existing   = &Device->Endpoints[EndpointId];
+    reg32_t*        Control    = XHCI_CONTEXT(Controller, &Device->InputContext, 0);
+    reg32_t*        Slot       = XHCI_CONTEXT(Controller, &Device->InputContext, 1);
+    reg32_t*        Context    = XHCI_CONTEXT(Controller, &Device->InputContext, EndpointId + 1);
+    size_t          PacketSize = Transfer->Endpoint.MaxPacketSize & 0x7FF;
+    size_t          Burst      = 0;
+    size_t          Payload;
+    size_t          AverageTrb;
+    int             Entries;
+    OsStatus_t      Status;
+    int             i;
+
+    TRACE("XhciDeviceConfigureEndpoint(Slot %i, Endpoint %i)", Device->SlotId, EndpointId);
+
+    Endpoint.Configured    = 1;
+    Endpoint.Type          = XhciDeviceGetEndpointType(Transfer);
+    Endpoint.MaxPacketSize = Transfer->Endpoint.MaxPacketSize;
+    Endpoint.StreamCount   = XhciDeviceGetStreamCount(Controller, Device, Transfer);
+
+    // Allocate the new rings before touching the contexts
+    if (Endpoint.StreamCount) {
+        if (XhciDmaAllocate(Endpoint.StreamCount * 16, &Endpoint.StreamContexts) != OsSuccess) {
+            return OsOutOfMemory;
+        }
+        Endpoint.Streams = (XhciRing_t*)malloc(Endpoint.StreamCount * sizeof(XhciRing_t));
+        if (!Endpoint.Streams) {
+            XhciDmaFree(&Endpoint.StreamContexts);
+            return OsOutOfMemory;
+        }
+        memset(Endpoint.Streams, 0, Endpoint.StreamCount * sizeof(XhciRing_t));
+        memset(Endpoint.StreamContexts.Virtual, 0, Endpoint.StreamCount * 16);
+        for (i = 1; i < Endpoint.StreamCount; i++) {
+            reg32_t* StreamContext = (reg32_t*)((uint8_t*)Endpoint.StreamContexts.Virtual + (i * 16));
+            if (XhciRingInitialize(&Endpoint.Streams[i], XHCI_STREAM_RING_SIZE) != OsSuccess) {
+                Status = OsOutOfMemory;
+                goto Cleanup;
+            }
+            StreamContext[0] = LODWORD(XhciRingGetDequeue(&Endpoint.Streams[i])) | XHCI_STREAM_PRIMARY_RING;
+        }
+    }
+    else if (XhciRingInitialize(&Endpoint.Ring, XHCI_RING_SIZE) != OsSuccess) {
+        return OsOutOfMemory;
+    }
+
+    // The slot context is copied from the output context, it must announce the
+    // highest endpoint in use
+    memset(Device->InputContext.Virtual, 0, (XHCI_MAX_ENDPOINTS + 1) * Controller->ContextSize);
+    memcpy(Slot, XHCI_CONTEXT(Controller, &Device->OutputContext, 0), XHCI_CONTEXT_DWORDS * sizeof(reg32_t));
+    Entries = MAX((int)XHCI_SLOT_GET_ENTRIES(Slot[0]), EndpointId);
+    Slot[0] = (Slot[0] & ~XHCI_SLOT_ENTRIES(0x1F)) | XHCI_SLOT_ENTRIES(Entries);
+    Slot[3] = 0;
+
+    Control[XHCI_INPUT_ADD] = (1 << 0) | (1 << EndpointId);
+    if (Existing->Configured) {
+        Control[XHCI_INPUT_DROP] = (1 << EndpointId);
+    }
+
+    if (Transfer->Type == InterruptTransfer || Transfer->Type == IsochronousTransfer) {
+        Burst = (Device->Speed == SuperSpeed) ? Transfer->Endpoint.MaxBurst :
+            ((Transfer->Endpoint.MaxPacketSize >> 11) & 0x3);
+    }
+    else if (Device->Speed == SuperSpeed) {
+        Burst = Transfer->Endpoint.MaxBurst;
+    }
+    Payload = PacketSize * (Burst + 1);
+
+    switch (Transfer->Type) {
+        case ControlTransfer: AverageTrb = 8; break;
+        case InterruptTransfer: AverageTrb = MIN(1024, Payload); break;
+        default: AverageTrb = 3072; break;
+    }
+
+    Context[0] = XHCI_EP_INTERVAL(XhciDeviceGetInterval(Device, Transfer));
+    Context[1] = XHCI_EP_CERR(Transfer->Type == IsochronousTransfer ? 0 : 3) | XHCI_EP_TYPE(Endpoint.Type) |
+        XHCI_EP_MAXBURST(Burst) | XHCI_EP_MPS(PacketSize);
+    if (Endpoint.StreamCount) {
+        int Exponent = 0;
+        while ((1 << (Exponent + 1)) < Endpoint.StreamCount) {
+            Exponent++;
+        }
+        Context[0] |= XHCI_EP_MAXPSTREAMS(Exponent) | XHCI_EP_LSA;
+        Context[2]  = LODWORD(Endpoint.StreamContexts.Physical);
+    }
+    else {
+        Context[2] = LODWORD(XhciRingGetDequeue(&Endpoint.Ring));
+    }
+    Context[3] = 0;
+    Context[4] = XHCI_EP_AVERAGE_TRB(AverageTrb);
+    if (Transfer->Type == InterruptTransfer || Transfer->Type == IsochronousTransfer) {
+        Context[0] |= XHCI_EP_ESIT_HI(Payload);
+        Context[4] |= XHCI_EP_ESIT_LO(Payload);
+    }
+
+    Status = XhciCommandExecute(Controller, LODWORD(Device->InputContext.Physical), 0, 0,
+        XHCI_TRB_TYPE(XHCI_TRB_CONFIGURE_ENDPOINT) | XHCI_TRB_SLOT(Device->SlotId), NULL);
+    if (Status != OsSuccess) {
+        goto Cleanup;
+    }
+
+    // Swap the endpoint state, the old rings are no longer referenced
+    Endpoint.HaltDequeue = 0;
+    if (Existing->Ring.Trbs != NULL) {
+        XhciRingDestroy(&Existing->Ring);
+    }
+    if (Existing->Streams != NULL) {
+        for (i = 1; i < Existing->StreamCount; i++) {
+            XhciRingDestroy(&Existing->Streams[i]);
+        }
+        free(Existing->Streams);
+    }
+    XhciDmaFree(&Existing->StreamContexts);
+    memcpy(Existing, &Endpoint, sizeof(XhciEndpoint_t));
+    return OsSuccess;
+
+Cleanup:
+    if (Endpoint.Streams != NULL) {
+        for (i = 1; i < Endpoint.StreamCount; i++) {
+            if (Endpoint.Streams[i].Trbs != NULL) {
+                XhciRingDestroy(&Endpoint.Streams[i]);
+            }
+        }
+        free(Endpoint.Streams);
+    }
+    XhciDmaFree(&Endpoint.StreamContexts);
+    if (Endpoint.Ring.Trbs != NULL) {
+        XhciRingDestroy(&Endpoint.Ring);
+    }
+    return Status;
+}
+
+int
+XhciDeviceInterrupter(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ int               EndpointId)
+{
+    // Consecutive endpoints of a device land on different interrupters, so one busy
+    // device with several endpoints still spreads its completions
+    if (Controller->InterrupterCount <= 1) {
+        return 0;
+    }
+    return 1 + ((Device->SlotId + EndpointId) % (Controller->InterrupterCount - 1));
+}
+
+OsStatus_t
+XhciDeviceConfigureHub(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device)
+{
+    reg32_t*   Control = XHCI_CONTEXT(Controller, &Device->InputContext, 0);
+    reg32_t*   Slot    = XHCI_CONTEXT(Controller, &Device->InputContext, 1);
+    OsStatus_t Status;
+
+    TRACE("XhciDeviceConfigureHub(Slot %i, Ports %i)", Device->SlotId, Device->HubPorts);
+
+    // Only the slot context is added, the endpoints are left as they are. Multiple
+    // TTs are not enabled as the alternate setting of the hub is not known here.
+    memset(Device->InputContext.Virtual, 0, (XHCI_MAX_ENDPOINTS + 1) * Controller->ContextSize);
+    memcpy(Slot, XHCI_CONTEXT(Controller, &Device->OutputContext, 0), XHCI_CONTEXT_DWORDS * sizeof(reg32_t));
+    Slot[0] |= XHCI_SLOT_HUB;
+    Slot[1]  = (Slot[1] & ~XHCI_SLOT_PORTS(0xFF)) | XHCI_SLOT_PORTS(Device->HubPorts);
+    if (Device->Speed == HighSpeed) {
+        Slot[2] = (Slot[2] & ~XHCI_SLOT_TT_THINK(0x3)) | XHCI_SLOT_TT_THINK(Device->HubThinkTime);
+    }
+    Slot[3] = 0;
+    Control[XHCI_INPUT_ADD] = (1 << 0);
+
+    Status = XhciCommandExecute(Controller, LODWORD(Device->InputContext.Physical), 0, 0,
+        XHCI_TRB_TYPE(XHCI_TRB_CONFIGURE_ENDPOINT) | XHCI_TRB_SLOT(Device->SlotId), NULL);
+    if (Status != OsBusy) {
+        Device->HubPending = 0;
+    }
+    return Status;
+}
+
+OsStatus_t
+XhciDeviceRecoverEndpoint(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ int               EndpointId)
+{
+    XhciEndpoint_t* Endpoint = &Device->Endpoints[EndpointId];
+    OsStatus_t      Status;
+
+    if (!Endpoint->Halted) {
+        return OsSuccess;
+    }
+
+    TRACE("XhciDeviceRecoverEndpoint(Slot %i, Endpoint %i)", Device->SlotId, EndpointId);
+
+    // Resetting the endpoint moves it to the stopped state, then skip the TD that
+    // caused the halt, it has already been completed
+    Status = XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_RESET_ENDPOINT) |
+        XHCI_TRB_SLOT(Device->SlotId) | XHCI_TRB_ENDPOINT(EndpointId), NULL);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    Status = XhciDeviceSetDequeue(Controller, Device, EndpointId, Endpoint->HaltStream, Endpoint->HaltDequeue);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    Endpoint->Halted = 0;
+    XhciRingDoorbell(Controller, Device->SlotId, EndpointId, Endpoint->HaltStream);
+    return OsSuccess;
+}
+
+OsStatus_t
+XhciDeviceCancelTransfer(
+    _In_ XhciController_t*         Controller,
+    _In_ XhciTransferDescriptor_t* Td)
+{
+    XhciDevice_t* Device = Controller->Devices[Td->SlotId];
+    XhciRing_t*   Ring;
+    uintptr_t     Address;
+    reg32_t       Dequeue;
+
+    TRACE("XhciDeviceCancelTransfer(Slot %u, Endpoint %u)", Td->SlotId, Td->EndpointId);
+
+    if (Td->Completed) {
+        return OsSuccess;
+    }
+
+    if (Device == NULL || Device->Detached || !Td->TrbCount) {
+        Td->CompletionCode = XHCI_CC_STOPPED;
+        Td->Completed      = 1;
+        return OsSuccess;
+    }
+
+    Ring = XhciDeviceGetRing(Device, Td->EndpointId, Td->StreamId);
+    if (XhciDeviceRecoverEndpoint(Controller, Device, Td->EndpointId) != OsSuccess) {
+        return OsError;
+    }
+
+    // Stopping fails if the endpoint is already stopped, which is fine
+    XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_STOP_ENDPOINT) |
+        XHCI_TRB_SLOT(Device->SlotId) | XHCI_TRB_ENDPOINT(Td->EndpointId), NULL);
+
+    // Turn the TRBs into no-ops, the controller skips them when it resumes. The
+    // cycle and chain bits are kept so the ring stays consistent.
+    Address = Td->FirstTrb;
+    while (1) {
+        XhciTrb_t* Trb     = XhciRingTrb(Ring, Address);
+        reg32_t    Control = READ_VOLATILE(Trb->Control);
+        if (XHCI_TRB_GET_TYPE(Control) != XHCI_TRB_LINK) {
+            Trb->ParameterLo = 0;
+            Trb->ParameterHi = 0;
+            Trb->Status      = 0;
+            WRITE_VOLATILE(Trb->Control, (Control & (XHCI_TRB_CYCLE | XHCI_TRB_CHAIN)) | XHCI_TRB_TYPE(XHCI_TRB_NOOP));
+        }
+
+        if (Address == Td->LastTrb) {
+            break;
+        }
+        Address += sizeof(XhciTrb_t);
+        if (Address == (Ring->Memory.Physical + (Ring->Size * sizeof(XhciTrb_t)))) {
+            Address = Ring->Memory.Physical;
+        }
+    }
+
+    // If the controller stopped inside the TD, move it past
+    Dequeue = XhciDeviceGetHardwareDequeue(Controller, Device, Td->EndpointId, Td->StreamId);
+    if (XhciRingContains(Ring, Td->FirstTrb, Td->LastTrb, Dequeue)) {
+        XhciDeviceSetDequeue(Controller, Device, Td->EndpointId, Td->StreamId, Td->NextDequeue);
+    }
+
+    Td->CompletionCode = XHCI_CC_STOPPED;
+    Td->Completed      = 1;
+    Ring->Free        += Td->TrbCount;
+    XhciRingDoorbell(Controller, Device->SlotId, Td->EndpointId, Td->StreamId);
+    return OsSuccess;
+}
+
+int
+XhciDeviceDetach(
+    _In_ XhciController_t* Controller,
+    _In_ int               RootPort)
+{
+    int Failed = 0;
+
+    TRACE("XhciDeviceDetach(RootPort %i)", RootPort);
+
+    for (int i = 1; i <= Controller->MaxSlots; i++) {
+        XhciDevice_t* Device = Controller->Devices[i];
+        if (Device != NULL && (RootPort == 0 || Device->RootPort == RootPort)) {
+            Device->Detached = 1;
+        }
+    }
+
+    // Fail everything that was queued for the devices
+    foreach(Node, Controller->Base.TransactionList) {
+        UsbManagerTransfer_t*     Transfer = (UsbManagerTransfer_t*)Node->Data;
+        XhciTransferDescriptor_t* Td       = (XhciTransferDescriptor_t*)Transfer->EndpointDescriptor;
+        XhciDevice_t*             Device;
+        if (Td == NULL || Td->Completed) {
+            continue;
+        }
+
+        Device = Controller->Devices[Td->SlotId];
+        if (Device != NULL && Device->Detached) {
+            Td->CompletionCode = XHCI_CC_TRANSACTION;
+            Td->Completed      = 1;
+            UsbManagerQueueTransferCompletion(&Controller->Base, Transfer);
+            Failed++;
+        }
+    }
+
+    if (Failed) {
+        atomic_store(&Controller->TransfersPending, 1);
+    }
+    return Failed;
+}
+
+void
+XhciDeviceReleaseDetached(
+    _In_ XhciController_t* Controller)
+{
+    for (int i = 1; i <= Controller->MaxSlots; i++) {
+        XhciDevice_t* Device = Controller->Devices[i];
+        if (Device != NULL && Device->Detached) {
+            XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(i), NULL);
+            XhciDeviceDestroy(Controller, Device);
+        }
+    }
+}
+
+OsStatus_t
+XhciDeviceAcquire(
+    _In_  XhciController_t*     Controller,
+    _In_  UsbManagerTransfer_t* Transfer,
+    _Out_ XhciDevice_t**        DeviceOut)
+{
+    UsbTransfer_t*  Request    = &Transfer->Transfer;
+    int             EndpointId = XhciDeviceGetEndpointId(Request);
+    XhciDevice_t*   Device;
+    XhciEndpoint_t* Endpoint;
+    OsStatus_t      Status;
+
+    TRACE("XhciDeviceAcquire(Address %u, Endpoint %i)", Request->Address.DeviceAddress, EndpointId);
+
+    // Enumeration of a new device starts at address 0, use that chance to release
+    // the slots of devices that are gone
+    Device = XhciDeviceFind(Controller, &Request->Address);
+    if (Device == NULL) {
+        if (Request->Address.DeviceAddress != 0) {
+            return OsDoesNotExist;
+        }
+
+        XhciDeviceReleaseDetached(Controller);
+        Status = XhciDeviceCreate(Controller, Request, &Device);
+        if (Status != OsSuccess) {
+            return Status;
+        }
+    }
+
+    if (EndpointId >= XHCI_MAX_ENDPOINTS) {
+        return OsInvalidParameters;
+    }
+
+    // Recover halted endpoints before anything else is queued
+    for (int i = 1; i < XHCI_MAX_ENDPOINTS; i++) {
+        if (Device->Endpoints[i].Halted) {
+            XhciDeviceRecoverEndpoint(Controller, Device, i);
+        }
+    }
+
+    // Devices that turned out to be hubs are marked before their ports are used
+    if (Device->HubPending) {
+        Status = XhciDeviceConfigureHub(Controller, Device);
+        if (Status == OsBusy) {
+            return Status;
+        }
+    }
+
+    Endpoint = &Device->Endpoints[EndpointId];
+    if (EndpointId == 1) {
+        if (Endpoint->MaxPacketSize != Request->Endpoint.MaxPacketSize) {
+            Status = XhciDeviceUpdateControl(Controller, Device, Request->Endpoint.MaxPacketSize);
+            if (Status != OsSuccess) {
+                return Status;
+            }
+        }
+    }
+    else if (!Endpoint->Configured || Endpoint->Type != XhciDeviceGetEndpointType(Request) ||
+        Endpoint->MaxPacketSize != Request->Endpoint.MaxPacketSize ||
+        Endpoint->StreamCount != XhciDeviceGetStreamCount(Controller, Device, Request)) {
+        Status = XhciDeviceConfigureEndpoint(Controller, Device, Request, EndpointId);
+        if (Status != OsSuccess) {
+            return Status;
+        }
+    }
+
+    *DeviceOut = Device;
+    return OsSuccess;
+}
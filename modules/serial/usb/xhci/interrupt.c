@@ -0,0 +1,206 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ */
+//#define __TRACE
+
+#include <os/mollenos.h>
+#include <ddk/interrupt.h>
+#include <ddk/utils.h>
+#include "../common/manager.h"
+#include "xhci.h"
+
+/* OnFastInterrupt
+ * Is called for the sole purpose to determine if this source
+ * has invoked an irq. If it has, silence and return (Handled) */
+InterruptStatus_t
+OnFastInterrupt(
+    _In_ FastInterruptResources_t*  InterruptTable,
+    _In_ void*                      NotUsed)
+{
+    XhciInterrupter_t*          Interrupter = (XhciInterrupter_t*)INTERRUPT_RESOURCE(InterruptTable, 0);
+    uintptr_t                   IoBase      = INTERRUPT_IOSPACE(InterruptTable, 0)->Access.Memory.VirtualBase;
+    XhciInterrupterRegisters_t* Registers   = (XhciInterrupterRegisters_t*)(IoBase + Interrupter->RegisterOffset);
+    reg32_t*                    UsbStatus   = (reg32_t*)(IoBase + Interrupter->StatusOffset);
+    reg32_t                     InterruptStatus;
+    reg32_t                     Management;
+    _CRT_UNUSED(NotUsed);
+
+    // Was the interrupt even from this interrupter? Host errors are
+    // reported only in the status register, and handled by the primary one
+    Management      = Registers->Management;
+    InterruptStatus = 0;
+    if (Interrupter->Index == 0) {
+        InterruptStatus = *UsbStatus & (XHCI_STATUS_EVENT_INTERRUPT | XHCI_STATUS_HOSTERROR);
+    }
+    if (!(Management & XHCI_IMAN_PENDING) && !(InterruptStatus & XHCI_STATUS_HOSTERROR)) {
+        return InterruptNotHandled;
+    }
+
+    // Acknowledge the interrupt by clearing
+    Registers->Management = Management;
+    if (InterruptStatus) {
+        *UsbStatus = InterruptStatus;
+    }
+    atomic_fetch_or(&Interrupter->InterruptStatus, InterruptStatus | XHCI_STATUS_EVENT_INTERRUPT);
+    return InterruptHandled;
+}
+
+void
+XhciProcessEvents(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter)
+{
+    XhciInterrupterRegisters_t* Registers = XHCI_INTERRUPTER(Controller, Interrupter->Index);
+    int                         Completed = 0;
+    int                         Processed = 0;
+
+    // The command wait polls the primary event ring, so make sure only one
+    // context drains it at the time
+    if (atomic_exchange(&Interrupter->Processing, 1)) {
+        return;
+    }
+
+    while (1) {
+        XhciTrb_t* Event   = &Interrupter->Events[Interrupter->Dequeue];
+        reg32_t    Control = READ_VOLATILE(Event->Control);
+        if ((Control & XHCI_TRB_CYCLE) != (reg32_t)Interrupter->Cycle) {
+            break;
+        }
+
+        TRACE("Event(Type %u, Interrupter %i)", XHCI_TRB_GET_TYPE(Control), Interrupter->Index);
+        switch (XHCI_TRB_GET_TYPE(Control)) {
+            case XHCI_TRB_TRANSFER_EVENT: {
+                Completed += XhciTransferEvent(Controller, Event);
+            } break;
+
+            case XHCI_TRB_COMMAND_COMPLETION: {
+                XhciCommandCompleted(Controller, Event);
+            } break;
+
+            case XHCI_TRB_PORT_STATUS_CHANGE: {
+                // Port ids are 1-based
+                int Port = (int)((READ_VOLATILE(Event->ParameterLo) >> 24) & 0xFF);
+                if (Port > 0 && Port <= (int)Controller->Base.PortCount) {
+                    Completed += XhciPortCheck(Controller, Port - 1);
+                }
+            } break;
+
+            case XHCI_TRB_HOST_CONTROLLER: {
+                ERROR("XHCI-Failure: Host controller event (code %u)",
+                    XHCI_TRB_COMPLETION(READ_VOLATILE(Event->Status)));
+            } break;
+
+            default:
+                break;
+        }
+
+        Interrupter->Dequeue++;
+        if (Interrupter->Dequeue == XHCI_EVENT_RING_SIZE) {
+            Interrupter->Dequeue = 0;
+            Interrupter->Cycle  ^= 1;
+        }
+        Processed++;
+    }
+
+    // Update the dequeue pointer and clear the busy flag
+    if (Processed) {
+        WRITE_VOLATILE(Registers->DequeueLo, LODWORD(Interrupter->Ring.Physical +
+            (Interrupter->Dequeue * sizeof(XhciTrb_t))) | XHCI_ERDP_BUSY);
+    }
+
+    if (Completed) {
+        atomic_store(&Controller->TransfersPending, 1);
+
+        // The interrupter waits longer between interrupts the more transfers
+        // are in flight, and not at all when there is only one
+        if (CompletionModeratorUpdate(&Interrupter->Moderator, Completed,
+                atomic_load(&Interrupter->Outstanding))) {
+            WRITE_VOLATILE(Registers->Moderation, XHCI_IMOD(Interrupter->Moderator.Threshold));
+        }
+    }
+    atomic_store(&Interrupter->Processing, 0);
+}
+
+int
+XhciProcessTransfers(
+    _In_ XhciController_t* Controller)
+{
+    int Pending = 0;
+
+    if (atomic_exchange(&Controller->TransfersBusy, 1)) {
+        return 0;
+    }
+
+    // Only the transfers that completed are processed, events identify them.
+    // What is left over after a batch stays pending for the next call.
+    if (atomic_exchange(&Controller->TransfersPending, 0)) {
+        if (UsbManagerProcessCompletions(&Controller->Base)) {
+            atomic_store(&Controller->TransfersPending, 1);
+            Pending = 1;
+        }
+    }
+    atomic_store(&Controller->TransfersBusy, 0);
+    return Pending;
+}
+
+void
+OnInterrupt(
+    _In_     int   Signal,
+    _In_Opt_ void* InterruptData)
+{
+    XhciInterrupter_t* Interrupter = (XhciInterrupter_t*)InterruptData;
+    XhciController_t*  Controller  = Interrupter->Controller;
+    reg32_t            InterruptStatus;
+
+ProcessInterrupt:
+    InterruptStatus = atomic_exchange(&Interrupter->InterruptStatus, 0);
+
+    // HC Fatal Error
+    // Clear all queued, reset controller
+    if (InterruptStatus & XHCI_STATUS_HOSTERROR) {
+        ERROR("XHCI-Failure: Host system error, restarting controller");
+        UsbManagerClearTransfers(&Controller->Base);
+        XhciDeviceDetach(Controller, 0);
+        if (XhciRestart(Controller) != OsSuccess) {
+            ERROR("XHCI-Failure: Failed to reset controller after fatal error");
+        }
+        for (size_t i = 0; i < Controller->Base.PortCount; i++) {
+            if (READ_VOLATILE(Controller->PortRegisters[i].StatusControl) & XHCI_PORT_CONNECTED) {
+                UsbEventPort(Controller->Base.Device.Base.Id, 0, (uint8_t)(i & 0xFF));
+            }
+        }
+        return;
+    }
+
+    // Completions, command results and port changes all arrive as events. The
+    // transfers are completed in bounded batches so new events are handled in between.
+    if (InterruptStatus & XHCI_STATUS_EVENT_INTERRUPT) {
+        XhciProcessEvents(Controller, Interrupter);
+    }
+    XhciProcessTransfers(Controller);
+
+    // In case an interrupt fired during processing
+    if (atomic_load(&Interrupter->InterruptStatus) != 0 ||
+        atomic_load(&Controller->TransfersPending) != 0) {
+        goto ProcessInterrupt;
+    }
+}
@@ -0,0 +1,137 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ */
+//#define __TRACE
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include "xhci.h"
+#include <threads.h>
+
+static void
+XhciPortWrite(
+    _In_ XhciController_t* Controller,
+    _In_ int               Index,
+    _In_ reg32_t           Bits)
+{
+    reg32_t PortBits = READ_VOLATILE(Controller->PortRegisters[Index].StatusControl);
+    WRITE_VOLATILE(Controller->PortRegisters[Index].StatusControl, (PortBits & XHCI_PORT_PRESERVE) | Bits);
+}
+
+OsStatus_t
+HciPortReset(
+    _In_ UsbManagerController_t* Controller, 
+    _In_ int                     Index)
+{
+    XhciController_t* XhciHci = (XhciController_t*)Controller;
+    reg32_t           Status  = READ_VOLATILE(XhciHci->PortRegisters[Index].StatusControl);
+    reg32_t           ResetChange;
+    int               Fault   = 0;
+
+    TRACE("HciPortReset(Index %i)", Index);
+
+    // A reset means the device is enumerated again, so fail anything that is
+    // still queued for the old device and release its slot before continuing
+    XhciDeviceDetach(XhciHci, Index + 1);
+    XhciDeviceReleaseDetached(XhciHci);
+    while (XhciProcessTransfers(XhciHci));
+
+    if (!(Status & XHCI_PORT_POWER)) {
+        XhciPortWrite(XhciHci, Index, XHCI_PORT_POWER);
+        thrd_sleepex(20);
+    }
+
+    // USB 3 ports train their link by themselves and are enabled after connect,
+    // a warm reset is only needed if the link failed to come up
+    if (XhciHci->PortProtocol[Index] == 3) {
+        if (READ_VOLATILE(XhciHci->PortRegisters[Index].StatusControl) & XHCI_PORT_ENABLED) {
+            return OsSuccess;
+        }
+        XhciPortWrite(XhciHci, Index, XHCI_PORT_WARMRESET);
+        ResetChange = XHCI_PORT_WARMRESET_CHANGE;
+    }
+    else {
+        XhciPortWrite(XhciHci, Index, XHCI_PORT_RESET);
+        ResetChange = XHCI_PORT_RESET_CHANGE;
+    }
+
+    WaitForConditionWithFault(Fault, (READ_VOLATILE(XhciHci->PortRegisters[Index].StatusControl) & ResetChange) != 0, 500, 1);
+    if (Fault != 0) {
+        ERROR("XHCI-Failure: Host controller failed to reset port %i in time", Index);
+        return OsError;
+    }
+    XhciPortWrite(XhciHci, Index, XHCI_PORT_RESET_CHANGE | XHCI_PORT_WARMRESET_CHANGE);
+
+    // Give the device the reset recovery time
+    thrd_sleepex(10);
+    if (!(READ_VOLATILE(XhciHci->PortRegisters[Index].StatusControl) & XHCI_PORT_ENABLED)) {
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+void
+HciPortGetStatus(
+    _In_  UsbManagerController_t* Controller,
+    _In_  int                     Index,
+    _Out_ UsbHcPortDescriptor_t*  Port)
+{
+    XhciController_t* XhciHci = (XhciController_t*)Controller;
+    reg32_t           Status  = READ_VOLATILE(XhciHci->PortRegisters[Index].StatusControl);
+
+    Port->Connected = (Status & XHCI_PORT_CONNECTED) == 0 ? 0 : 1;
+    Port->Enabled   = (Status & XHCI_PORT_ENABLED) == 0 ? 0 : 1;
+    switch (XHCI_PORT_SPEED(Status)) {
+        case XHCI_SPEED_FULL: Port->Speed = FullSpeed; break;
+        case XHCI_SPEED_LOW: Port->Speed = LowSpeed; break;
+        case XHCI_SPEED_HIGH: Port->Speed = HighSpeed; break;
+        default: Port->Speed = SuperSpeed; break;
+    }
+}
+
+int
+XhciPortCheck(
+    _In_ XhciController_t* Controller,
+    _In_ int               Index)
+{
+    reg32_t Status = READ_VOLATILE(Controller->PortRegisters[Index].StatusControl);
+    int     Failed = 0;
+
+    TRACE("XhciPortCheck(Index %i, Status 0x%x)", Index, Status);
+
+    // Clear the change bits, the reset changes are handled by HciPortReset
+    XhciPortWrite(Controller, Index, Status & (XHCI_PORT_CONNECT_CHANGE | XHCI_PORT_ENABLE_CHANGE |
+        XHCI_PORT_OVERCURRENT_CHANGE | XHCI_PORT_LINKSTATE_CHANGE | XHCI_PORT_CONFIG_ERROR_CHANGE));
+
+    if (Status & XHCI_PORT_OVERCURRENT_CHANGE) {
+        ERROR("XHCI-Failure: Port %i reported over current", Index);
+    }
+
+    if (Status & XHCI_PORT_CONNECT_CHANGE) {
+        if (!(Status & XHCI_PORT_CONNECTED)) {
+            Failed = XhciDeviceDetach(Controller, Index + 1) != 0;
+        }
+        UsbEventPort(Controller->Base.Device.Base.Id, 0, (uint8_t)(Index & 0xFF));
+    }
+    return Failed;
+}
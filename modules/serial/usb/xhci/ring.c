@@ -0,0 +1,224 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ */
+//#define __TRACE
+
+#include <ddk/barrier.h>
+#include <ddk/utils.h>
+#include "xhci.h"
+#include <string.h>
+
+OsStatus_t
+XhciRingInitialize(
+    _In_ XhciRing_t* Ring,
+    _In_ int         Size)
+{
+    OsStatus_t Status;
+
+    TRACE("XhciRingInitialize(Size %i)", Size);
+
+    Status = XhciDmaAllocate(Size * sizeof(XhciTrb_t), &Ring->Memory);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    Ring->Trbs = (XhciTrb_t*)Ring->Memory.Virtual;
+    Ring->Size = Size;
+    XhciRingReset(Ring);
+    return OsSuccess;
+}
+
+void
+XhciRingDestroy(
+    _In_ XhciRing_t* Ring)
+{
+    XhciDmaFree(&Ring->Memory);
+    Ring->Trbs = NULL;
+}
+
+void
+XhciRingReset(
+    _In_ XhciRing_t* Ring)
+{
+    XhciTrb_t* Link = &Ring->Trbs[Ring->Size - 1];
+
+    memset((void*)Ring->Trbs, 0, Ring->Size * sizeof(XhciTrb_t));
+    Ring->Enqueue = 0;
+    Ring->Cycle   = 1;
+    Ring->Free    = Ring->Size - 1;
+    Ring->Pending = -1;
+
+    // The last TRB links back to the start and toggles the cycle state, it's
+    // handed to the controller when the enqueue position reaches it
+    Link->ParameterLo = LODWORD(Ring->Memory.Physical);
+    Link->ParameterHi = 0;
+    Link->Control     = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TOGGLE_CYCLE;
+}
+
+void
+XhciRingBegin(
+    _In_ XhciRing_t* Ring)
+{
+    Ring->Pending = Ring->Enqueue;
+}
+
+void
+XhciRingCommit(
+    _In_ XhciRing_t* Ring)
+{
+    if (Ring->Pending != -1) {
+        dma_wmb();
+        Ring->Trbs[Ring->Pending].Control ^= XHCI_TRB_CYCLE;
+        Ring->Pending = -1;
+    }
+}
+
+uintptr_t
+XhciRingEnqueue(
+    _In_ XhciRing_t* Ring,
+    _In_ uint32_t    ParameterLo,
+    _In_ uint32_t    ParameterHi,
+    _In_ uint32_t    Status,
+    _In_ uint32_t    Control)
+{
+    XhciTrb_t* Trb      = &Ring->Trbs[Ring->Enqueue];
+    uintptr_t  Physical = Ring->Memory.Physical + (Ring->Enqueue * sizeof(XhciTrb_t));
+    int        Cycle    = Ring->Cycle;
+
+    // The first TRB of a pending TD is kept from the controller until commit
+    if (Ring->Enqueue == Ring->Pending) {
+        Cycle ^= 1;
+    }
+
+    Trb->ParameterLo = ParameterLo;
+    Trb->ParameterHi = ParameterHi;
+    Trb->Status      = Status;
+    dma_wmb();
+    Trb->Control     = (Control & ~(XHCI_TRB_CYCLE)) | (Cycle ? XHCI_TRB_CYCLE : 0);
+    Ring->Enqueue++;
+    Ring->Free--;
+
+    // Hand the link TRB to the controller, it must keep the chain bit so
+    // TDs can span across it
+    if (Ring->Enqueue == (Ring->Size - 1)) {
+        XhciTrb_t* Link = &Ring->Trbs[Ring->Enqueue];
+        dma_wmb();
+        Link->Control = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TOGGLE_CYCLE |
+            (Control & XHCI_TRB_CHAIN) | (Ring->Cycle ? XHCI_TRB_CYCLE : 0);
+        Ring->Enqueue = 0;
+        Ring->Cycle  ^= 1;
+    }
+    return Physical;
+}
+
+uintptr_t
+XhciRingGetDequeue(
+    _In_ XhciRing_t* Ring)
+{
+    return (Ring->Memory.Physical + (Ring->Enqueue * sizeof(XhciTrb_t))) | (uintptr_t)Ring->Cycle;
+}
+
+int
+XhciRingContains(
+    _In_ XhciRing_t* Ring,
+    _In_ uintptr_t   First,
+    _In_ uintptr_t   Last,
+    _In_ uintptr_t   Address)
+{
+    if (Address < Ring->Memory.Physical ||
+        Address >= (Ring->Memory.Physical + (Ring->Size * sizeof(XhciTrb_t)))) {
+        return 0;
+    }
+
+    // Handle TDs that wrap around the end of the ring
+    if (First <= Last) {
+        return Address >= First && Address <= Last;
+    }
+    return Address >= First || Address <= Last;
+}
+
+XhciTrb_t*
+XhciRingTrb(
+    _In_ XhciRing_t* Ring,
+    _In_ uintptr_t   Address)
+{
+    return &Ring->Trbs[(Address - Ring->Memory.Physical) / sizeof(XhciTrb_t)];
+}
+
+OsStatus_t
+XhciInterrupterInitialize(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter)
+{
+    TRACE("XhciInterrupterInitialize(Index %i)", Interrupter->Index);
+
+    if (XhciDmaAllocate(sizeof(XhciEventRingSegment_t), &Interrupter->SegmentTable) != OsSuccess ||
+        XhciDmaAllocate(XHCI_EVENT_RING_SIZE * sizeof(XhciTrb_t), &Interrupter->Ring) != OsSuccess) {
+        return OsOutOfMemory;
+    }
+    Interrupter->Events = (XhciTrb_t*)Interrupter->Ring.Virtual;
+    CompletionModeratorInitialize(&Interrupter->Moderator, XHCI_IMOD_MAX_THRESHOLD);
+    return OsSuccess;
+}
+
+void
+XhciInterrupterReset(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter)
+{
+    XhciInterrupterRegisters_t* Registers = XHCI_INTERRUPTER(Controller, Interrupter->Index);
+    XhciEventRingSegment_t*     Segment   = (XhciEventRingSegment_t*)Interrupter->SegmentTable.Virtual;
+
+    TRACE("XhciInterrupterReset(Index %i)", Interrupter->Index);
+
+    memset((void*)Interrupter->Events, 0, XHCI_EVENT_RING_SIZE * sizeof(XhciTrb_t));
+    Interrupter->Dequeue = 0;
+    Interrupter->Cycle   = 1;
+
+    Segment->AddressLo = LODWORD(Interrupter->Ring.Physical);
+    Segment->AddressHi = 0;
+    Segment->Size      = XHCI_EVENT_RING_SIZE;
+    Segment->Reserved  = 0;
+
+    // The segment table address must be written last, it enables the event ring
+    WRITE_VOLATILE(Registers->TableSize, 1);
+    WRITE_VOLATILE(Registers->DequeueLo, LODWORD(Interrupter->Ring.Physical) | XHCI_ERDP_BUSY);
+    WRITE_VOLATILE(Registers->DequeueHi, 0);
+    WRITE_VOLATILE(Registers->TableAddressLo, LODWORD(Interrupter->SegmentTable.Physical));
+    WRITE_VOLATILE(Registers->TableAddressHi, 0);
+    WRITE_VOLATILE(Registers->Moderation, XHCI_IMOD(Interrupter->Moderator.Threshold));
+    WRITE_VOLATILE(Registers->Management, XHCI_IMAN_ENABLE | XHCI_IMAN_PENDING);
+}
+
+void
+XhciInterrupterDestroy(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter)
+{
+    if (Interrupter->Index < Controller->InterrupterCount) {
+        XhciInterrupterRegisters_t* Registers = XHCI_INTERRUPTER(Controller, Interrupter->Index);
+        WRITE_VOLATILE(Registers->Management, XHCI_IMAN_PENDING);
+    }
+    XhciDmaFree(&Interrupter->Ring);
+    XhciDmaFree(&Interrupter->SegmentTable);
+    Interrupter->Events = NULL;
+}
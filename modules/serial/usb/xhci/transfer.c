@@ -0,0 +1,728 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ */
+//#define __TRACE
+
+//#define __TRACE
+
+#include <ddk/utils.h>
+#include "xhci.h"
+#include <string.h>
+
+#define XHCI_QUEUE_SUCCESS  0
+#define XHCI_QUEUE_NOSPACE  1
+
+UsbTransferStatus_t
+XhciGetStatusCode(
+    _In_ int CompletionCode)
+{
+    switch (CompletionCode) {
+        case XHCI_CC_SUCCESS:
+        case XHCI_CC_SHORT_PACKET:
+            return TransferFinished;
+        case XHCI_CC_STALL:
+            return TransferStalled;
+        case XHCI_CC_BABBLE:
+            return TransferBabble;
+        case XHCI_CC_DATA_BUFFER:
+        case XHCI_CC_RING_UNDERRUN:
+        case XHCI_CC_RING_OVERRUN:
+            return TransferBufferError;
+        case XHCI_CC_TRB:
+            return TransferInvalid;
+        case XHCI_CC_BANDWIDTH:
+            return TransferNoBandwidth;
+        default:
+            return TransferNotResponding;
+    }
+}
+
+void
+XhciRingDoorbell(
+    _In_ XhciController_t* Controller,
+    _In_ int               SlotId,
+    _In_ int               Target,
+    _In_ int               StreamId)
+{
+    WRITE_VOLATILE(Controller->Doorbells[SlotId], (reg32_t)(Target | (StreamId << 16)));
+}
+
+static void
+XhciTransferRetire(
+    _In_ XhciTransferDescriptor_t* Td)
+{
+    if (Td->Outstanding != NULL) {
+        atomic_fetch_sub(Td->Outstanding, 1);
+        Td->Outstanding = NULL;
+    }
+}
+
+static void
+XhciTransferComplete(
+    _In_ XhciController_t*         Controller,
+    _In_ XhciTransferDescriptor_t* Td,
+    _In_ int                       CompletionCode)
+{
+    XhciDevice_t* Device = Controller->Devices[Td->SlotId];
+
+    XhciTransferRetire(Td);
+    if (CompletionCode != XHCI_CC_SUCCESS) {
+        Td->CompletionCode = CompletionCode;
+    }
+    Td->Completed = 1;
+    UsbManagerQueueCompletion(&Controller->Base, (uint8_t*)Td);
+
+    // The TRBs are free for reuse once the TD is done
+    if (Device != NULL && Td->TrbCount) {
+        XhciRing_t* Ring = XhciDeviceGetRing(Device, Td->EndpointId, Td->StreamId);
+        if (Ring != NULL) {
+            Ring->Free += Td->TrbCount;
+        }
+    }
+}
+
+/* XhciTransferSignal
+ * Completes a TD without involving the transfer ring. A no-op command is used so
+ * an interrupt is raised and the completion is processed from interrupt context. */
+static void
+XhciTransferSignal(
+    _In_ XhciController_t*         Controller,
+    _In_ XhciTransferDescriptor_t* Td,
+    _In_ int                       CompletionCode)
+{
+    XhciTransferComplete(Controller, Td, CompletionCode);
+    atomic_store(&Controller->TransfersPending, 1);
+    XhciCommandExecute(Controller, 0, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_NOOP_COMMAND), NULL);
+}
+
+static size_t
+XhciTransferMeasure(
+    _In_  UsbManagerTransfer_t* Transfer,
+    _In_  int                   Index,
+    _In_  size_t                Length,
+    _In_  int                   MaxTrbs,
+    _Out_ int*                  TrbCount)
+{
+    struct UsbManagerTransaction* Transaction = &Transfer->Transactions[Index];
+    int                           SgIndex     = Transaction->SgIndex;
+    size_t                        SgOffset    = Transaction->SgOffset;
+    size_t                        Measured    = 0;
+    int                           Count       = 0;
+
+    while (Measured < Length && Count < MaxTrbs && SgIndex < Transaction->DmaTable.count) {
+        struct dma_sg* Sg      = &Transaction->DmaTable.entries[SgIndex];
+        uintptr_t      Address = Sg->address + SgOffset;
+        size_t         Chunk   = MIN(Length - Measured, Sg->length - SgOffset);
+        
+        Chunk     = MIN(Chunk, XHCI_TRB_MAX_LENGTH - (Address & (XHCI_TRB_MAX_LENGTH - 1)));
+        Measured += Chunk;
+        SgOffset += Chunk;
+        if (SgOffset == Sg->length) {
+            SgIndex++;
+            SgOffset = 0;
+        }
+        Count++;
+    }
+
+    *TrbCount = Count;
+    return Measured;
+}
+
+static uintptr_t
+XhciTransferEnqueueData(
+    _In_ XhciRing_t*           Ring,
+    _In_ UsbManagerTransfer_t* Transfer,
+    _In_ int                   Index,
+    _In_ size_t                Length,
+    _In_ uint32_t              FirstControl,
+    _In_ int                   Interrupter)
+{
+    struct UsbManagerTransaction* Transaction = &Transfer->Transactions[Index];
+    size_t                        PacketSize  = MAX(1, Transfer->Transfer.Endpoint.MaxPacketSize & 0x7FF);
+    uintptr_t                     First       = 0;
+    size_t                        Left        = Length;
+
+    while (Left) {
+        struct dma_sg* Sg      = &Transaction->DmaTable.entries[Transaction->SgIndex];
+        uintptr_t      Address = Sg->address + Transaction->SgOffset;
+        size_t         Chunk   = MIN(Left, Sg->length - Transaction->SgOffset);
+        size_t         Packets;
+        uint32_t       Control;
+        uintptr_t      Physical;
+
+        // The TD size is the number of packets left after this TRB
+        Chunk   = MIN(Chunk, XHCI_TRB_MAX_LENGTH - (Address & (XHCI_TRB_MAX_LENGTH - 1)));
+        Packets = ((Left - Chunk) + PacketSize - 1) / PacketSize;
+        Control = (First == 0 ? FirstControl : XHCI_TRB_TYPE(XHCI_TRB_NORMAL)) | XHCI_TRB_CHAIN;
+
+        Physical = XhciRingEnqueue(Ring, LODWORD(Address), 0, XHCI_TRB_LENGTH(Chunk) |
+            XHCI_TRB_TDSIZE(Packets) | XHCI_TRB_INTERRUPTER(Interrupter), Control);
+        if (First == 0) {
+            First = Physical;
+        }
+
+        Left                   -= Chunk;
+        Transaction->SgOffset += Chunk;
+        if (Transaction->SgOffset == Sg->length) {
+            Transaction->SgIndex++;
+            Transaction->SgOffset = 0;
+        }
+    }
+    return First;
+}
+
+static uintptr_t
+XhciTransferEnqueueEventData(
+    _In_ XhciRing_t*               Ring,
+    _In_ XhciTransferDescriptor_t* Td,
+    _In_ int                       Index,
+    _In_ int                       Interrupter)
+{
+    Td->LastTransaction = Index;
+    return XhciRingEnqueue(Ring, XHCI_EVENT_DATA(Td->Object.Index, Index), 0,
+        XHCI_TRB_INTERRUPTER(Interrupter), XHCI_TRB_TYPE(XHCI_TRB_EVENTDATA) | XHCI_TRB_IOC);
+}
+
+static int
+XhciTransferFillControl(
+    _In_ XhciRing_t*               Ring,
+    _In_ UsbManagerTransfer_t*     Transfer,
+    _In_ XhciTransferDescriptor_t* Td,
+    _In_ int                       Interrupter)
+{
+    UsbTransfer_t* Request     = &Transfer->Transfer;
+    int            AckIndex    = Request->TransactionCount - 1;
+    int            HasData     = Request->TransactionCount > 2 && Request->Transactions[1].Length != 0;
+    int            DataIn      = HasData && Request->Transactions[1].Type == InTransaction;
+    int            DataTrbs    = 0;
+    uint32_t       Setup[2];
+    uint32_t       TransferType;
+    uint8_t*       Buffer;
+
+    // Control transfers are never split, so they must fit entirely
+    if (HasData && XhciTransferMeasure(Transfer, 1, Request->Transactions[1].Length,
+            Ring->Free, &DataTrbs) != Request->Transactions[1].Length) {
+        return XHCI_QUEUE_NOSPACE;
+    }
+    if ((1 + (HasData ? DataTrbs + 1 : 0) + 2) > Ring->Free) {
+        return XHCI_QUEUE_NOSPACE;
+    }
+
+    // The setup packet is passed as immediate data
+    if (dma_attachment_map(&Transfer->Transactions[0].DmaAttachment) != OsSuccess) {
+        return XHCI_QUEUE_NOSPACE;
+    }
+    Buffer = (uint8_t*)Transfer->Transactions[0].DmaAttachment.buffer + Request->Transactions[0].BufferOffset;
+    memcpy(&Setup[0], Buffer, sizeof(Setup));
+    dma_attachment_unmap(&Transfer->Transactions[0].DmaAttachment);
+
+    TransferType = HasData ? (DataIn ? XHCI_SETUP_IN_DATA : XHCI_SETUP_OUT_DATA) : XHCI_SETUP_NO_DATA;
+    Td->FirstTrb = XhciRingEnqueue(Ring, Setup[0], Setup[1], XHCI_TRB_LENGTH(8) | XHCI_TRB_INTERRUPTER(Interrupter),
+        XHCI_TRB_TYPE(XHCI_TRB_SETUP) | XHCI_TRB_IDT | XHCI_TRB_TRANSFER_TYPE(TransferType));
+    Td->Transferred[0] = 8;
+
+    if (HasData) {
+        XhciTransferEnqueueData(Ring, Transfer, 1, Request->Transactions[1].Length,
+            XHCI_TRB_TYPE(XHCI_TRB_DATA) | (DataIn ? XHCI_TRB_DIRECTION_IN : 0), Interrupter);
+        XhciTransferEnqueueEventData(Ring, Td, 1, Interrupter);
+    }
+
+    // The status stage goes in the opposite direction of the data stage
+    XhciRingEnqueue(Ring, 0, 0, XHCI_TRB_INTERRUPTER(Interrupter), XHCI_TRB_TYPE(XHCI_TRB_STATUS) |
+        XHCI_TRB_CHAIN | (Request->Transactions[AckIndex].Type == InTransaction ? XHCI_TRB_DIRECTION_IN : 0));
+    Td->LastTrb = XhciTransferEnqueueEventData(Ring, Td, AckIndex, Interrupter);
+    return XHCI_QUEUE_SUCCESS;
+}
+
+static int
+XhciTransferFillData(
+    _In_ XhciRing_t*               Ring,
+    _In_ UsbManagerTransfer_t*     Transfer,
+    _In_ XhciTransferDescriptor_t* Td,
+    _In_ int                       Interrupter)
+{
+    UsbTransfer_t* Request = &Transfer->Transfer;
+    uint32_t       FirstControl;
+    int            Queued  = 0;
+    int            i;
+
+    FirstControl = (Request->Type == IsochronousTransfer) ?
+        (XHCI_TRB_TYPE(XHCI_TRB_ISOCHRONOUS) | XHCI_TRB_SIA) : XHCI_TRB_TYPE(XHCI_TRB_NORMAL);
+
+    for (i = 0; i < Request->TransactionCount; i++) {
+        size_t    Left  = Request->Transactions[i].Length - Transfer->Transactions[i].BytesTransferred;
+        int       IsZLP = Request->Transactions[i].Flags & USB_TRANSACTION_ZLP;
+        size_t    Bytes = 0;
+        int       Trbs  = 1;
+        uintptr_t First;
+
+        if (Left == 0 && !IsZLP) {
+            continue;
+        }
+
+        // Keep room for the event data TRB, and split the transfer if the ring is full
+        if (Left) {
+            Bytes = XhciTransferMeasure(Transfer, i, Left, Ring->Free - 1, &Trbs);
+        }
+        if (Ring->Free < (Trbs + 1) || (Left && !Bytes)) {
+            Transfer->Flags |= TransferFlagPartial;
+            break;
+        }
+
+        if (Bytes) {
+            First = XhciTransferEnqueueData(Ring, Transfer, i, Bytes, FirstControl, Interrupter);
+        }
+        else {
+            First = XhciRingEnqueue(Ring, 0, 0, XHCI_TRB_INTERRUPTER(Interrupter), FirstControl | XHCI_TRB_CHAIN);
+            if (Request->Type == BulkTransfer) {
+                Request->Transactions[i].Flags &= ~(USB_TRANSACTION_ZLP);
+            }
+        }
+
+        if (!Queued) {
+            Td->FirstTrb = First;
+        }
+        Td->LastTrb = XhciTransferEnqueueEventData(Ring, Td, i, Interrupter);
+        Queued      = 1;
+
+        if (Bytes < Left) {
+            Transfer->Flags |= TransferFlagPartial;
+            break;
+        }
+    }
+    return Queued ? XHCI_QUEUE_SUCCESS : XHCI_QUEUE_NOSPACE;
+}
+
+static int
+XhciTransferFill(
+    _In_ XhciController_t*         Controller,
+    _In_ XhciDevice_t*             Device,
+    _In_ UsbManagerTransfer_t*     Transfer,
+    _In_ XhciTransferDescriptor_t* Td)
+{
+    XhciRing_t* Ring        = XhciDeviceGetRing(Device, Td->EndpointId, Td->StreamId);
+    int         Interrupter = XhciDeviceInterrupter(Controller, Device, Td->EndpointId);
+    int         Free        = Ring->Free;
+    int         Result;
+
+    TRACE("XhciTransferFill(Slot %i, Endpoint %u, Free %i)", Device->SlotId, Td->EndpointId, Free);
+
+    Transfer->Flags &= ~(TransferFlagPartial);
+    XhciRingBegin(Ring);
+    if (Transfer->Transfer.Type == ControlTransfer) {
+        Result = XhciTransferFillControl(Ring, Transfer, Td, Interrupter);
+    }
+    else {
+        Result = XhciTransferFillData(Ring, Transfer, Td, Interrupter);
+    }
+    XhciRingCommit(Ring);
+
+    if (Result == XHCI_QUEUE_SUCCESS) {
+        Td->TrbCount    = Free - Ring->Free;
+        Td->NextDequeue = XhciRingGetDequeue(Ring);
+
+        // Counted before the doorbell, as it may complete right away. Periodic transfers
+        // are always in flight and would only hold back interrupts.
+        if (Transfer->Transfer.Type == ControlTransfer || Transfer->Transfer.Type == BulkTransfer) {
+            Td->Outstanding = &Controller->Interrupters[Interrupter].Outstanding;
+            atomic_fetch_add(Td->Outstanding, 1);
+        }
+        XhciRingDoorbell(Controller, Device->SlotId, Td->EndpointId, Td->StreamId);
+    }
+    return Result;
+}
+
+static void
+XhciTransferResetDescriptor(
+    _In_ XhciTransferDescriptor_t* Td)
+{
+    XhciTransferRetire(Td);
+    Td->Completed      = 0;
+    Td->CompletionCode = XHCI_CC_SUCCESS;
+    Td->TrbCount       = 0;
+    Td->HubDescriptor  = 0;
+    memset((void*)&Td->Transferred[0], 0, sizeof(Td->Transferred));
+}
+
+static int
+XhciTransferReadSetup(
+    _In_  UsbManagerTransfer_t* Transfer,
+    _Out_ uint8_t*              Setup)
+{
+    if (Transfer->Transfer.Type != ControlTransfer || Transfer->Transfer.Address.EndpointAddress != 0 ||
+        dma_attachment_map(&Transfer->Transactions[0].DmaAttachment) != OsSuccess) {
+        return 0;
+    }
+
+    memcpy(Setup, (uint8_t*)Transfer->Transactions[0].DmaAttachment.buffer +
+        Transfer->Transfer.Transactions[0].BufferOffset, 8);
+    dma_attachment_unmap(&Transfer->Transactions[0].DmaAttachment);
+    return 1;
+}
+
+/* XhciTransferReadHubDescriptor
+ * The slot of a hub must announce its port count and TT think time, there is no
+ * other place than the hub descriptor the hub driver reads to learn them from. */
+static void
+XhciTransferReadHubDescriptor(
+    _In_ XhciController_t*         Controller,
+    _In_ UsbManagerTransfer_t*     Transfer,
+    _In_ XhciTransferDescriptor_t* Td)
+{
+    XhciDevice_t* Device = Controller->Devices[Td->SlotId];
+    uint8_t*      Buffer;
+
+    if (Device == NULL || Td->Transferred[1] < 5 ||
+        dma_attachment_map(&Transfer->Transactions[1].DmaAttachment) != OsSuccess) {
+        return;
+    }
+
+    Buffer = (uint8_t*)Transfer->Transactions[1].DmaAttachment.buffer + Transfer->Transfer.Transactions[1].BufferOffset;
+    Device->HubPorts     = Buffer[2];
+    Device->HubThinkTime = (Buffer[3] >> 5) & 0x3;
+    Device->HubPending   = 1;
+    dma_attachment_unmap(&Transfer->Transactions[1].DmaAttachment);
+}
+
+static UsbTransferStatus_t
+XhciTransferQueue(
+    _In_ XhciController_t*     Controller,
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    XhciTransferDescriptor_t* Td = (XhciTransferDescriptor_t*)Transfer->EndpointDescriptor;
+    XhciDevice_t*             Device;
+    OsStatus_t                Status;
+    uint8_t                   Setup[8];
+
+    // Allocate the bookkeeping for the transfer, if the pool is exhausted the transfer
+    // is queued once another one completes
+    if (Td == NULL) {
+        if (UsbSchedulerAllocateElement(Controller->Base.Scheduler, XHCI_TD_POOL, (uint8_t**)&Td) != OsSuccess) {
+            return TransferQueued;
+        }
+        Transfer->EndpointDescriptor = Td;
+        UsbSchedulerSetElementOwner(Controller->Base.Scheduler, (uint8_t*)Td, Transfer);
+    }
+    XhciTransferResetDescriptor(Td);
+    Td->SlotId = 0;
+
+    // Store transaction in queue if it's not there already
+    UsbManagerRegisterTransfer(&Controller->Base, Transfer);
+
+    // Commands can't be issued while another one is in progress, retry later
+    Status = XhciDeviceAcquire(Controller, Transfer, &Device);
+    if (Status == OsBusy) {
+        return TransferQueued;
+    }
+
+    Transfer->Status = TransferQueued;
+    if (Status != OsSuccess) {
+        XhciTransferSignal(Controller, Td, Status == OsInvalidParameters ? XHCI_CC_TRB : XHCI_CC_TRANSACTION);
+        return TransferQueued;
+    }
+
+    Td->SlotId     = (uint8_t)Device->SlotId;
+    Td->EndpointId = (uint8_t)((Transfer->Transfer.Type == ControlTransfer) ?
+        ((Transfer->Transfer.Address.EndpointAddress * 2) + 1) :
+        XHCI_DCI(Transfer->Transfer.Address.EndpointAddress, Transfer->Transfer.Endpoint.Direction));
+    Td->StreamId   = Device->Endpoints[Td->EndpointId].StreamCount ? (uint16_t)Transfer->Transfer.StreamId : 0;
+    if (XhciDeviceGetRing(Device, Td->EndpointId, Td->StreamId) == NULL) {
+        XhciTransferSignal(Controller, Td, XHCI_CC_TRB);
+        return TransferQueued;
+    }
+
+    if (XhciTransferReadSetup(Transfer, &Setup[0])) {
+        // The controller assigns the bus address itself when the slot is addressed
+        if (Setup[0] == 0x00 && Setup[1] == 0x05) {
+            Status = XhciDeviceSetAddress(Controller, Device, Setup[2] & 0x7F);
+            Td->Transferred[0] = 8;
+            XhciTransferSignal(Controller, Td, Status == OsSuccess ? XHCI_CC_SUCCESS : XHCI_CC_TRANSACTION);
+            return TransferQueued;
+        }
+
+        // GET_DESCRIPTOR of the hub or super-speed hub class descriptor
+        Td->HubDescriptor = Setup[0] == 0xA0 && Setup[1] == 0x06 && (Setup[3] == 0x29 || Setup[3] == 0x2A) &&
+            Transfer->Transfer.TransactionCount > 1;
+    }
+
+    if (XhciTransferFill(Controller, Device, Transfer, Td) != XHCI_QUEUE_SUCCESS) {
+        Transfer->Status = TransferNotProcessed;
+    }
+    return TransferQueued;
+}
+
+UsbTransferStatus_t
+HciQueueTransferGeneric(
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    XhciController_t* Controller;
+
+    Controller       = (XhciController_t*)UsbManagerGetController(Transfer->DeviceId);
+    Transfer->Status = TransferNotProcessed;
+
+    // Isochronous streams are only supported on EHCI for now
+    if (Transfer->Transfer.Flags & USB_TRANSFER_STREAM) {
+        return TransferInvalid;
+    }
+    return XhciTransferQueue(Controller, Transfer);
+}
+
+UsbTransferStatus_t
+HciQueueTransferIsochronous(
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    XhciController_t* Controller;
+
+    Controller       = (XhciController_t*)UsbManagerGetController(Transfer->DeviceId);
+    Transfer->Status = TransferNotProcessed;
+    return XhciTransferQueue(Controller, Transfer);
+}
+
+OsStatus_t
+HciTransactionFinalize(
+    _In_ UsbManagerController_t* Controller,
+    _In_ UsbManagerTransfer_t*   Transfer,
+    _In_ int                     Reset)
+{
+    XhciTransferDescriptor_t* Td = (XhciTransferDescriptor_t*)Transfer->EndpointDescriptor;
+
+    TRACE("XhciTransactionFinalize(Id %u)", Transfer->Id);
+
+    // The TRBs of a transfer are consumed once it completes, so the descriptor can be
+    // released right away. The notification is sent when the transfer is finalized.
+    if (Td != NULL) {
+        if (!Reset && !Td->Completed) {
+            XhciDeviceCancelTransfer((XhciController_t*)Controller, Td);
+        }
+        XhciTransferRetire(Td);
+        UsbSchedulerFreeElement(Controller->Scheduler, (uint8_t*)Td);
+        Transfer->EndpointDescriptor = NULL;
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+HciDequeueTransfer(
+    _In_ UsbManagerTransfer_t* Transfer)
+{
+    XhciController_t*         Controller;
+    XhciTransferDescriptor_t* Td;
+
+    Controller = (XhciController_t*)UsbManagerGetController(Transfer->DeviceId);
+    if (!Controller) {
+        return OsInvalidParameters;
+    }
+
+    Td = (XhciTransferDescriptor_t*)Transfer->EndpointDescriptor;
+    if (Td != NULL) {
+        XhciDeviceCancelTransfer(Controller, Td);
+    }
+
+    Transfer->Flags |= TransferFlagCleanup;
+    UsbManagerQueueTransferCompletion(&Controller->Base, Transfer);
+    atomic_store(&Controller->TransfersPending, 1);
+    while (XhciProcessTransfers(Controller));
+    return OsSuccess;
+}
+
+int
+XhciTransferEvent(
+    _In_ XhciController_t* Controller,
+    _In_ XhciTrb_t*        Event)
+{
+    reg32_t                   Status  = READ_VOLATILE(Event->Status);
+    reg32_t                   Control = READ_VOLATILE(Event->Control);
+    int                       Code    = (int)XHCI_TRB_COMPLETION(Status);
+    XhciTransferDescriptor_t* Td      = NULL;
+    XhciDevice_t*             Device;
+    uintptr_t                 Address;
+
+    // Stopped events are caused by cancellation, which completes the TD itself
+    if (Code == XHCI_CC_STOPPED || Code == XHCI_CC_STOPPED_LENGTH) {
+        return 0;
+    }
+
+    if (Control & XHCI_TRB_EVENT_DATA) {
+        reg32_t             Parameter   = READ_VOLATILE(Event->ParameterLo);
+        uint16_t            Index       = XHCI_EVENT_DATA_INDEX(Parameter);
+        int                 Transaction = XHCI_EVENT_DATA_TRANSACTION(Parameter);
+        UsbSchedulerPool_t* Pool        = USB_ELEMENT_GET_POOL(Controller->Base.Scheduler, Index);
+
+        if ((Index & USB_ELEMENT_INDEX_MASK) >= Pool->ElementCount) {
+            return 0;
+        }
+
+        Td = (XhciTransferDescriptor_t*)USB_ELEMENT_INDEX(Pool, Index);
+        if (!(Td->Object.Flags & USB_ELEMENT_ALLOCATED) || Td->Completed) {
+            return 0;
+        }
+
+        // Keep the first condition that is not success, usually a short packet
+        Td->Transferred[Transaction] = XHCI_TRB_EVENT_LENGTH(Status);
+        if (Code != XHCI_CC_SUCCESS && Td->CompletionCode == XHCI_CC_SUCCESS) {
+            Td->CompletionCode = Code;
+        }
+
+        if (Transaction == Td->LastTransaction) {
+            XhciTransferComplete(Controller, Td, XHCI_CC_SUCCESS);
+            return 1;
+        }
+        return 0;
+    }
+
+    // Short packets are reported again by the event data TRB of the TD
+    if (Code == XHCI_CC_SUCCESS || Code == XHCI_CC_SHORT_PACKET) {
+        return 0;
+    }
+
+    // Errors point to the TRB that failed, find the TD that contains it
+    Device  = Controller->Devices[XHCI_TRB_GET_SLOT(Control)];
+    Address = (uintptr_t)READ_VOLATILE(Event->ParameterLo);
+    if (Device == NULL) {
+        return 0;
+    }
+
+    foreach(Node, Controller->Base.TransactionList) {
+        UsbManagerTransfer_t*     Transfer = (UsbManagerTransfer_t*)Node->Data;
+        XhciTransferDescriptor_t* Itr      = (XhciTransferDescriptor_t*)Transfer->EndpointDescriptor;
+        XhciRing_t*               Ring;
+        if (Itr == NULL || Itr->Completed || !Itr->TrbCount || Itr->SlotId != Device->SlotId ||
+            Itr->EndpointId != XHCI_TRB_GET_ENDPOINT(Control)) {
+            continue;
+        }
+
+        Ring = XhciDeviceGetRing(Device, Itr->EndpointId, Itr->StreamId);
+        if (Ring != NULL && XhciRingContains(Ring, Itr->FirstTrb, Itr->LastTrb, Address)) {
+            Td = Itr;
+            break;
+        }
+    }
+
+    if (Td == NULL) {
+        WARNING("XHCI: Transfer event (code %i) for unknown TRB 0x%x", Code, Address);
+        return 0;
+    }
+
+    // A halted endpoint is recovered before anything else is queued for the device
+    if (XHCI_EP_STATE(READ_VOLATILE(XHCI_CONTEXT(Controller, &Device->OutputContext, Td->EndpointId)[0])) ==
+            XHCI_EP_STATE_HALTED) {
+        XhciEndpoint_t* Endpoint = &Device->Endpoints[Td->EndpointId];
+        Endpoint->Halted      = 1;
+        Endpoint->HaltDequeue = Td->NextDequeue;
+        Endpoint->HaltStream  = Td->StreamId;
+    }
+    XhciTransferComplete(Controller, Td, Code);
+    return 1;
+}
+
+int
+HciProcessElement(
+    _In_ UsbManagerController_t* Controller,
+    _In_ uint8_t*                Element,
+    _In_ int                     Reason,
+    _In_ void*                   Context)
+{
+    UsbManagerTransfer_t*     Transfer = (UsbManagerTransfer_t*)Context;
+    XhciTransferDescriptor_t* Td       = (XhciTransferDescriptor_t*)Element;
+    int                       i;
+
+    TRACE("XhciProcessElement(Reason %i)", Reason);
+
+    switch (Reason) {
+        case USB_REASON_DUMP: {
+            TRACE("TD(Slot %u, Endpoint %u, Stream %u, Trbs %i, First 0x%x, Last 0x%x, Completed %i, Code %i)",
+                Td->SlotId, Td->EndpointId, Td->StreamId, Td->TrbCount, Td->FirstTrb, Td->LastTrb,
+                Td->Completed, Td->CompletionCode);
+        } break;
+
+        case USB_REASON_SCAN: {
+            if (!Td->Completed) {
+                return ITERATOR_CONTINUE;
+            }
+
+            Transfer->Status = XhciGetStatusCode(Td->CompletionCode);
+            for (i = 0; i < USB_TRANSACTIONCOUNT; i++) {
+                Transfer->Transactions[i].BytesTransferred += Td->Transferred[i];
+            }
+            if (Td->CompletionCode == XHCI_CC_SHORT_PACKET) {
+                Transfer->Flags |= TransferFlagShort;
+            }
+            if (Td->HubDescriptor && Transfer->Status == TransferFinished) {
+                XhciTransferReadHubDescriptor((XhciController_t*)Controller, Transfer, Td);
+            }
+        } break;
+
+        case USB_REASON_RESET: {
+            // Periodic transfers continue with the next part of the buffer, unless
+            // the device had no data for us
+            size_t Offset = Transfer->CurrentDataIndex;
+            if (Transfer->Status != TransferNAK) {
+                Offset = (ADDLIMIT(0, Transfer->CurrentDataIndex,
+                    Transfer->Transfer.Transactions[0].Length, Transfer->Transfer.PeriodicBufferSize));
+            }
+
+            XhciTransferResetDescriptor(Td);
+            for (i = 0; i < Transfer->Transfer.TransactionCount; i++) {
+                Transfer->Transactions[i].BytesTransferred = 0;
+                if (Transfer->Transfer.Transactions[i].BufferHandle != UUID_INVALID) {
+                    dma_sg_table_offset(&Transfer->Transactions[i].DmaTable,
+                        Transfer->Transfer.Transactions[i].BufferOffset + Offset,
+                        &Transfer->Transactions[i].SgIndex, &Transfer->Transactions[i].SgOffset);
+                }
+            }
+        } break;
+
+        case USB_REASON_CLEANUP: {
+            UsbSchedulerFreeElement(Controller->Scheduler, Element);
+        } break;
+
+        default:
+            break;
+    }
+    return ITERATOR_CONTINUE;
+}
+
+void
+HciProcessEvent(
+    _In_ UsbManagerController_t* Controller,
+    _In_ int                     Event,
+    _In_ void*                   Context)
+{
+    UsbManagerTransfer_t*     Transfer = (UsbManagerTransfer_t*)Context;
+    XhciController_t*         Xhci     = (XhciController_t*)Controller;
+    XhciTransferDescriptor_t* Td       = (XhciTransferDescriptor_t*)Transfer->EndpointDescriptor;
+    XhciDevice_t*             Device;
+
+    TRACE("XhciProcessEvent(Event %i)", Event);
+
+    switch (Event) {
+        case USB_EVENT_RESTART_DONE: {
+            // Requeue the periodic transfer, unless the device went away
+            Device = (Td != NULL) ? Xhci->Devices[Td->SlotId] : NULL;
+            if (Device != NULL && !Device->Detached) {
+                if (XhciTransferFill(Xhci, Device, Transfer, Td) != XHCI_QUEUE_SUCCESS) {
+                    ERROR("XHCI-Failure: No room to restart periodic transfer %u", Transfer->Id);
+                }
+            }
+        } break;
+    }
+}
@@ -0,0 +1,871 @@
+/* MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * MollenOS MCore - eXtensible Host Controller Interface Driver
+ * TODO:
+ * - Power Management
+ * - USB 3 Hub Support
+ */
+
+#ifndef __USB_XHCI__
+#define __USB_XHCI__
+
+#include <os/osdefs.h>
+#include <os/dmabuf.h>
+#include <ds/collection.h>
+
+#include "../common/manager.h"
+#include "../common/scheduler.h"
+#include "../common/hci.h"
+
+/* XHCI Controller Definitions
+ * Contains generic magic constants and definitions */
+#define XHCI_MAX_PORTS              255
+#define XHCI_MAX_SLOTS              255
+#define XHCI_MAX_INTERRUPTERS       8
+#define XHCI_MAX_ENDPOINTS          32
+#define XHCI_MAX_STREAMS            32
+#define XHCI_MAX_SCRATCHPADS        512
+
+#define XHCI_RING_SIZE              256     // One page of TRBs, the last one is a link
+#define XHCI_STREAM_RING_SIZE       64
+#define XHCI_EVENT_RING_SIZE        256
+#define XHCI_TRB_MAX_LENGTH         0x10000 // TRB buffers may not cross 64kb
+#define XHCI_COMMAND_TIMEOUT        5000    // ms
+#define XHCI_IMOD_STEP              40      // 10us in 250ns units, per completion the interrupter collects
+#define XHCI_IMOD_MAX_THRESHOLD     16      // So an interrupt is never held back more than 160us
+#define XHCI_IMOD(Threshold)        ((reg32_t)((Threshold) * XHCI_IMOD_STEP))
+
+#define XHCI_TD_POOL                0
+#define XHCI_TD_ALIGNMENT           32
+#define XHCI_TD_COUNT               512
+
+/* XhciCapabilityRegisters
+ * Read-only registers that describe the controller limits. They are located at
+ * the start of the io-space. */
+PACKED_ATYPESTRUCT(volatile, XhciCapabilityRegisters, {
+    uint8_t                     Length;
+    uint8_t                     Reserved;
+    uint16_t                    Version;
+    reg32_t                     SParams1;
+    reg32_t                     SParams2;
+    reg32_t                     SParams3;
+    reg32_t                     CParams1;
+    reg32_t                     DoorbellOffset;
+    reg32_t                     RuntimeOffset;
+    reg32_t                     CParams2;
+});
+
+/* XhciCapabilityRegisters::SParams1
+ * Bits 0-7: Max device slots
+ * Bits 8-18: Max interrupters
+ * Bits 24-31: Max ports */
+#define XHCI_SPARAM1_MAXSLOTS(n)            (n & 0xFF)
+#define XHCI_SPARAM1_MAXINTRS(n)            ((n >> 8) & 0x7FF)
+#define XHCI_SPARAM1_MAXPORTS(n)            ((n >> 24) & 0xFF)
+
+/* XhciCapabilityRegisters::SParams2
+ * Bits 0-3: Isochronous Scheduling Threshold
+ * Bits 4-7: Event Ring Segment Table Max (2^n)
+ * Bits 21-25: Max Scratchpad Buffers (Hi)
+ * Bits 26: Scratchpad Restore
+ * Bits 27-31: Max Scratchpad Buffers (Lo) */
+#define XHCI_SPARAM2_IST(n)                 (n & 0xF)
+#define XHCI_SPARAM2_ERSTMAX(n)             ((n >> 4) & 0xF)
+#define XHCI_SPARAM2_SCRATCHPADS(n)         ((((n >> 21) & 0x1F) << 5) | ((n >> 27) & 0x1F))
+
+/* XhciCapabilityRegisters::CParams1
+ * Bits 0: 64 bit addressing capability
+ * Bits 2: Context size, if set all contexts are 64 bytes
+ * Bits 3: Port power control
+ * Bits 12-15: Maximum primary stream array size (2^(n+1))
+ * Bits 16-31: Extended capabilities pointer (in dwords) */
+#define XHCI_CPARAM1_AC64                   (1 << 0)
+#define XHCI_CPARAM1_CSZ                    (1 << 2)
+#define XHCI_CPARAM1_PPC                    (1 << 3)
+#define XHCI_CPARAM1_MAXPSA(n)              ((n >> 12) & 0xF)
+#define XHCI_CPARAM1_XECP(n)                ((n >> 16) & 0xFFFF)
+
+/* XhciOperationalRegisters
+ * Registers that are used to control and command the xHCI controller. 64 bit
+ * registers are split as not all controllers accept 64 bit accesses. */
+PACKED_ATYPESTRUCT(volatile, XhciOperationalRegisters, {
+    reg32_t                     UsbCommand;
+    reg32_t                     UsbStatus;
+    reg32_t                     PageSize;
+    reg32_t                     Reserved0[2];
+    reg32_t                     DeviceNotification;
+    reg32_t                     CommandRingLo;
+    reg32_t                     CommandRingHi;
+    reg32_t                     Reserved1[4];
+    reg32_t                     DcbaapLo;
+    reg32_t                     DcbaapHi;
+    reg32_t                     Configure;
+});
+
+#define XHCI_PORT_REGISTERS_OFFSET          0x400
+
+PACKED_ATYPESTRUCT(volatile, XhciPortRegisters, {
+    reg32_t                     StatusControl;
+    reg32_t                     PowerManagement;
+    reg32_t                     LinkInfo;
+    reg32_t                     HardwareLpm;
+});
+
+/* XhciOperationalRegisters::UsbCommand */
+#define XHCI_COMMAND_RUN                    (1 << 0)
+#define XHCI_COMMAND_HCRESET                (1 << 1)
+#define XHCI_COMMAND_INTERRUPT_ENABLE       (1 << 2)
+#define XHCI_COMMAND_HOSTERROR_ENABLE       (1 << 3)
+
+/* XhciOperationalRegisters::UsbStatus */
+#define XHCI_STATUS_HALTED                  (1 << 0)
+#define XHCI_STATUS_HOSTERROR               (1 << 2)
+#define XHCI_STATUS_EVENT_INTERRUPT         (1 << 3)
+#define XHCI_STATUS_PORTCHANGE              (1 << 4)
+#define XHCI_STATUS_NOT_READY               (1 << 11)
+#define XHCI_STATUS_CONTROLLER_ERROR        (1 << 12)
+
+/* XhciOperationalRegisters::CommandRingLo */
+#define XHCI_CRCR_CYCLE                     (1 << 0)
+#define XHCI_CRCR_ABORT                     (1 << 2)
+#define XHCI_CRCR_RUNNING                   (1 << 3)
+
+/* XhciPortRegisters::StatusControl
+ * The change bits are RW1C, and writing 1 to the enabled bit disables
+ * the port, so they must be masked out when updating the register */
+#define XHCI_PORT_CONNECTED                 (1 << 0)
+#define XHCI_PORT_ENABLED                   (1 << 1)
+#define XHCI_PORT_OVERCURRENT               (1 << 3)
+#define XHCI_PORT_RESET                     (1 << 4)
+#define XHCI_PORT_LINKSTATE(n)              ((n >> 5) & 0xF)
+#define XHCI_PORT_POWER                     (1 << 9)
+#define XHCI_PORT_SPEED(n)                  ((n >> 10) & 0xF)
+#define XHCI_PORT_CONNECT_CHANGE            (1 << 17)
+#define XHCI_PORT_ENABLE_CHANGE             (1 << 18)
+#define XHCI_PORT_WARMRESET_CHANGE          (1 << 19)
+#define XHCI_PORT_OVERCURRENT_CHANGE        (1 << 20)
+#define XHCI_PORT_RESET_CHANGE              (1 << 21)
+#define XHCI_PORT_LINKSTATE_CHANGE          (1 << 22)
+#define XHCI_PORT_CONFIG_ERROR_CHANGE       (1 << 23)
+#define XHCI_PORT_WARMRESET                 (1 << 31)
+
+#define XHCI_PORT_CHANGE_BITS               (XHCI_PORT_CONNECT_CHANGE | XHCI_PORT_ENABLE_CHANGE | \
+    XHCI_PORT_WARMRESET_CHANGE | XHCI_PORT_OVERCURRENT_CHANGE | XHCI_PORT_RESET_CHANGE | \
+    XHCI_PORT_LINKSTATE_CHANGE | XHCI_PORT_CONFIG_ERROR_CHANGE)
+#define XHCI_PORT_RWC                       (XHCI_PORT_ENABLED | XHCI_PORT_CHANGE_BITS)
+#define XHCI_PORT_PRESERVE                  0x0E00C3E0 // Link state, power, indicators and wake bits
+
+/* Default protocol speed ids */
+#define XHCI_SPEED_FULL                     1
+#define XHCI_SPEED_LOW                      2
+#define XHCI_SPEED_HIGH                     3
+#define XHCI_SPEED_SUPER                    4
+
+/* XhciInterrupterRegisters
+ * Each interrupter controls one event ring. They are located in the runtime
+ * register space at offset 0x20. */
+PACKED_ATYPESTRUCT(volatile, XhciInterrupterRegisters, {
+    reg32_t                     Management;
+    reg32_t                     Moderation;
+    reg32_t                     TableSize;
+    reg32_t                     Reserved;
+    reg32_t                     TableAddressLo;
+    reg32_t                     TableAddressHi;
+    reg32_t                     DequeueLo;
+    reg32_t                     DequeueHi;
+});
+
+#define XHCI_INTERRUPTER_OFFSET(n)          (0x20 + ((n) * 0x20))
+
+/* XhciInterrupterRegisters::Management */
+#define XHCI_IMAN_PENDING                   (1 << 0)
+#define XHCI_IMAN_ENABLE                    (1 << 1)
+
+/* XhciInterrupterRegisters::DequeueLo */
+#define XHCI_ERDP_BUSY                      (1 << 3)
+
+/* Extended capabilities, located in the io-space at xECP */
+#define XHCI_XCAP_ID(n)                     (n & 0xFF)
+#define XHCI_XCAP_NEXT(n)                   ((n >> 8) & 0xFF)
+#define XHCI_XCAP_LEGACY                    1
+#define XHCI_XCAP_PROTOCOL                  2
+
+#define XHCI_LEGACY_BIOS_OWNED              (1 << 16)
+#define XHCI_LEGACY_OS_OWNED                (1 << 24)
+#define XHCI_LEGACY_SMI_ENABLE              0xE011
+#define XHCI_LEGACY_SMI_EVENTS              (0x7U << 29)
+
+#define XHCI_PROTOCOL_MAJOR(n)              ((n >> 24) & 0xFF)
+#define XHCI_PROTOCOL_PORT_OFFSET(n)        (n & 0xFF)
+#define XHCI_PROTOCOL_PORT_COUNT(n)         ((n >> 8) & 0xFF)
+
+/* Pci MSI-X capability */
+#define XHCI_PCI_STATUS                     0x06
+#define XHCI_PCI_STATUS_CAPABILITIES        (1 << 4)
+#define XHCI_PCI_COMMAND                    0x04
+#define XHCI_PCI_COMMAND_INTX_DISABLE       (1 << 10)
+#define XHCI_PCI_CAPABILITIES               0x34
+#define XHCI_PCI_CAP_MSIX                   0x11
+#define XHCI_MSIX_ENABLE                    (1 << 15)
+#define XHCI_MSIX_FUNCTION_MASK             (1 << 14)
+#define XHCI_MSIX_TABLESIZE(n)              ((n & 0x7FF) + 1)
+#define XHCI_MSIX_BIR(n)                    (n & 0x7)
+#define XHCI_MSIX_OFFSET(n)                 (n & ~0x7)
+
+PACKED_ATYPESTRUCT(volatile, XhciMsixEntry, {
+    reg32_t                     AddressLo;
+    reg32_t                     AddressHi;
+    reg32_t                     Data;
+    reg32_t                     VectorControl;
+});
+
+/* XhciTrb
+ * The generic transfer request block, all rings are made of these. The cycle bit
+ * in Control hands ownership between software and hardware. */
+PACKED_TYPESTRUCT(XhciTrb, {
+    reg32_t                     ParameterLo;
+    reg32_t                     ParameterHi;
+    reg32_t                     Status;
+    reg32_t                     Control;
+});
+
+/* XhciTrb::Status */
+#define XHCI_TRB_LENGTH(n)                  (n & 0x1FFFF)
+#define XHCI_TRB_TDSIZE(n)                  ((MIN(n, 31) & 0x1F) << 17)
+#define XHCI_TRB_INTERRUPTER(n)             ((n & 0x3FF) << 22)
+#define XHCI_TRB_COMPLETION(n)              ((n >> 24) & 0xFF)
+#define XHCI_TRB_EVENT_LENGTH(n)            (n & 0xFFFFFF)
+
+/* XhciTrb::Control */
+#define XHCI_TRB_CYCLE                      (1 << 0)
+#define XHCI_TRB_TOGGLE_CYCLE               (1 << 1)    // Link TRBs
+#define XHCI_TRB_EVENT_DATA                 (1 << 2)    // Events
+#define XHCI_TRB_ISP                        (1 << 2)
+#define XHCI_TRB_CHAIN                      (1 << 4)
+#define XHCI_TRB_IOC                        (1 << 5)
+#define XHCI_TRB_IDT                        (1 << 6)
+#define XHCI_TRB_BSR                        (1 << 9)    // Address Device
+#define XHCI_TRB_DECONFIGURE                (1 << 9)    // Configure Endpoint
+#define XHCI_TRB_SIA                        (1 << 31)   // Isochronous
+#define XHCI_TRB_TYPE(n)                    ((n & 0x3F) << 10)
+#define XHCI_TRB_GET_TYPE(n)                ((n >> 10) & 0x3F)
+#define XHCI_TRB_DIRECTION_IN               (1 << 16)
+#define XHCI_TRB_TRANSFER_TYPE(n)           ((n & 0x3) << 16)
+#define XHCI_TRB_ENDPOINT(n)                ((n & 0x1F) << 16)
+#define XHCI_TRB_GET_ENDPOINT(n)            ((n >> 16) & 0x1F)
+#define XHCI_TRB_SLOT(n)                    ((n & 0xFF) << 24)
+#define XHCI_TRB_GET_SLOT(n)                ((n >> 24) & 0xFF)
+#define XHCI_TRB_STREAM(n)                  ((n & 0xFFFF) << 16)
+
+#define XHCI_EVENT_DATA(Index, Transaction) (((uint32_t)(Index) << 2) | (Transaction))
+#define XHCI_EVENT_DATA_INDEX(n)            ((uint16_t)((n) >> 2))
+#define XHCI_EVENT_DATA_TRANSACTION(n)      ((int)((n) & 0x3))
+
+#define XHCI_SETUP_NO_DATA                  0
+#define XHCI_SETUP_OUT_DATA                 2
+#define XHCI_SETUP_IN_DATA                  3
+
+/* Transfer request block types */
+#define XHCI_TRB_NORMAL                     1
+#define XHCI_TRB_SETUP                      2
+#define XHCI_TRB_DATA                       3
+#define XHCI_TRB_STATUS                     4
+#define XHCI_TRB_ISOCHRONOUS                5
+#define XHCI_TRB_LINK                       6
+#define XHCI_TRB_EVENTDATA                  7
+#define XHCI_TRB_NOOP                       8
+#define XHCI_TRB_ENABLE_SLOT                9
+#define XHCI_TRB_DISABLE_SLOT               10
+#define XHCI_TRB_ADDRESS_DEVICE             11
+#define XHCI_TRB_CONFIGURE_ENDPOINT         12
+#define XHCI_TRB_EVALUATE_CONTEXT           13
+#define XHCI_TRB_RESET_ENDPOINT             14
+#define XHCI_TRB_STOP_ENDPOINT              15
+#define XHCI_TRB_SET_DEQUEUE                16
+#define XHCI_TRB_RESET_DEVICE               17
+#define XHCI_TRB_NOOP_COMMAND               23
+#define XHCI_TRB_TRANSFER_EVENT             32
+#define XHCI_TRB_COMMAND_COMPLETION         33
+#define XHCI_TRB_PORT_STATUS_CHANGE         34
+#define XHCI_TRB_HOST_CONTROLLER            37
+
+/* Completion codes */
+#define XHCI_CC_INVALID                     0
+#define XHCI_CC_SUCCESS                     1
+#define XHCI_CC_DATA_BUFFER                 2
+#define XHCI_CC_BABBLE                      3
+#define XHCI_CC_TRANSACTION                 4
+#define XHCI_CC_TRB                         5
+#define XHCI_CC_STALL                       6
+#define XHCI_CC_RESOURCE                    7
+#define XHCI_CC_BANDWIDTH                   8
+#define XHCI_CC_NO_SLOTS                    9
+#define XHCI_CC_SHORT_PACKET                13
+#define XHCI_CC_RING_UNDERRUN               14
+#define XHCI_CC_RING_OVERRUN                15
+#define XHCI_CC_MISSED_SERVICE              23
+#define XHCI_CC_COMMAND_ABORTED             24
+#define XHCI_CC_COMMAND_STOPPED             25
+#define XHCI_CC_STOPPED                     26
+#define XHCI_CC_STOPPED_LENGTH              27
+
+/* XhciEventRingSegment
+ * One entry of the event ring segment table. */
+PACKED_TYPESTRUCT(XhciEventRingSegment, {
+    reg32_t                     AddressLo;
+    reg32_t                     AddressHi;
+    reg32_t                     Size;
+    reg32_t                     Reserved;
+});
+
+/* Contexts
+ * The controller uses either 32 or 64 byte contexts, only the first 32 bytes are
+ * defined. Contexts are accessed as dwords with the definitions below. */
+#define XHCI_CONTEXT_DWORDS                 8
+
+/* Input Control Context */
+#define XHCI_INPUT_DROP                     0
+#define XHCI_INPUT_ADD                      1
+
+/* Slot Context */
+#define XHCI_SLOT_ROUTE(n)                  (n & 0xFFFFF)
+#define XHCI_SLOT_SPEED(n)                  ((n & 0xF) << 20)
+#define XHCI_SLOT_MTT                       (1 << 25)
+#define XHCI_SLOT_HUB                       (1 << 26)
+#define XHCI_SLOT_ENTRIES(n)                ((n & 0x1F) << 27)
+#define XHCI_SLOT_GET_ENTRIES(n)            ((n >> 27) & 0x1F)
+#define XHCI_SLOT_ROOTPORT(n)               ((n & 0xFF) << 16)
+#define XHCI_SLOT_PORTS(n)                  ((n & 0xFF) << 24)
+#define XHCI_SLOT_TT_THINK(n)               ((n & 0x3) << 16)
+#define XHCI_SLOT_TT_SLOT(n)                (n & 0xFF)
+#define XHCI_SLOT_TT_PORT(n)                ((n & 0xFF) << 8)
+#define XHCI_SLOT_INTERRUPTER(n)            ((n & 0x3FF) << 22)
+#define XHCI_SLOT_GET_ADDRESS(n)            (n & 0xFF)
+
+/* Endpoint Context */
+#define XHCI_EP_STATE(n)                    (n & 0x7)
+#define XHCI_EP_MULT(n)                     ((n & 0x3) << 8)
+#define XHCI_EP_MAXPSTREAMS(n)              ((n & 0x1F) << 10)
+#define XHCI_EP_LSA                         (1 << 15)
+#define XHCI_EP_INTERVAL(n)                 ((n & 0xFF) << 16)
+#define XHCI_EP_ESIT_HI(n)                  (((n >> 16) & 0xFF) << 24)
+#define XHCI_EP_CERR(n)                     ((n & 0x3) << 1)
+#define XHCI_EP_TYPE(n)                     ((n & 0x7) << 3)
+#define XHCI_EP_MAXBURST(n)                 ((n & 0xFF) << 8)
+#define XHCI_EP_MPS(n)                      ((n & 0xFFFF) << 16)
+#define XHCI_EP_GET_MPS(n)                  ((n >> 16) & 0xFFFF)
+#define XHCI_EP_AVERAGE_TRB(n)              (n & 0xFFFF)
+#define XHCI_EP_ESIT_LO(n)                  ((n & 0xFFFF) << 16)
+
+#define XHCI_EP_STATE_DISABLED              0
+#define XHCI_EP_STATE_RUNNING               1
+#define XHCI_EP_STATE_HALTED                2
+#define XHCI_EP_STATE_STOPPED               3
+#define XHCI_EP_STATE_ERROR                 4
+
+#define XHCI_EP_TYPE_ISOC_OUT               1
+#define XHCI_EP_TYPE_BULK_OUT               2
+#define XHCI_EP_TYPE_INTERRUPT_OUT          3
+#define XHCI_EP_TYPE_CONTROL                4
+#define XHCI_EP_TYPE_ISOC_IN                5
+#define XHCI_EP_TYPE_BULK_IN                6
+#define XHCI_EP_TYPE_INTERRUPT_IN           7
+
+/* Stream Context */
+#define XHCI_STREAM_PRIMARY_RING            (1 << 1)
+
+/* XhciDma
+ * A piece of controller accessible memory. All structures used by the controller
+ * are kept within a page so they are physically contiguous. */
+typedef struct XhciDma {
+    struct dma_attachment Attachment;
+    void*                 Virtual;
+    uintptr_t             Physical;
+} XhciDma_t;
+
+/* XhciRing
+ * A producer ring of TRBs, used for the command ring and all transfer rings. The last
+ * TRB is a link back to the start that toggles the cycle state. */
+typedef struct XhciRing {
+    XhciDma_t  Memory;
+    XhciTrb_t* Trbs;
+    int        Size;
+    int        Enqueue;
+    int        Cycle;
+    int        Free;
+    int        Pending;
+} XhciRing_t;
+
+/* XhciEndpoint
+ * Software state for a device endpoint, indexed by the device context index. Stream
+ * endpoints have a ring per stream instead of the endpoint ring. */
+typedef struct XhciEndpoint {
+    int         Configured;
+    int         Halted;
+    uintptr_t   HaltDequeue;
+    int         HaltStream;
+    int         Type;
+    size_t      MaxPacketSize;
+    XhciRing_t  Ring;
+
+    int         StreamCount;
+    XhciDma_t   StreamContexts;
+    XhciRing_t* Streams;
+} XhciEndpoint_t;
+
+/* XhciDevice
+ * A device slot and the contexts that belongs to it. Devices are found by the
+ * address the usb stack gave them, or by their port while they are unaddressed. */
+typedef struct XhciDevice {
+    int            SlotId;
+    int            Detached;
+    uint8_t        Address;
+    uint8_t        HubAddress;
+    uint8_t        PortAddress;
+    int            RootPort;
+    int            TtSlot;
+    int            TtPort;
+    uint32_t       Route;
+    int            Depth;
+    UsbSpeed_t     Speed;
+    int            Interrupter;
+    int            HubPorts;      // Set from the hub descriptor, applied before the next transfer
+    int            HubThinkTime;
+    int            HubPending;
+
+    XhciDma_t      InputContext;
+    XhciDma_t      OutputContext;
+    XhciEndpoint_t Endpoints[XHCI_MAX_ENDPOINTS];
+} XhciDevice_t;
+
+/* XhciInterrupter
+ * An interrupter with its own event ring. When MSI-X is available every interrupter has
+ * its own vector, otherwise only the primary interrupter is used on the legacy line.
+ * The structure is shared with the fast interrupt handler. The vectors are acked on
+ * whichever core they arrive at, but every event ring is drained on the driver thread,
+ * so the rings, the transfer list and the device state are never touched in parallel. */
+typedef struct XhciInterrupter {
+    struct XhciController* Controller;
+    int                    Index;
+    UUId_t                 Interrupt;
+    size_t                 RegisterOffset;
+    size_t                 StatusOffset;
+    _Atomic(reg32_t)       InterruptStatus;
+    _Atomic(int)           Processing;
+    _Atomic(int)           Outstanding;  // Control and bulk transfers in flight
+    CompletionModerator_t  Moderator;
+
+    XhciDma_t              SegmentTable;
+    XhciDma_t              Ring;
+    XhciTrb_t*             Events;
+    int                    Dequeue;
+    int                    Cycle;
+} XhciInterrupter_t;
+
+/* XhciTransferDescriptor
+ * Software bookkeeping for the TRBs queued for one transfer. Elements come from the
+ * scheduler pool so the common manager can iterate them like any other descriptor.
+ * Every transaction ends with an event data TRB that carries the element index and
+ * the transaction index, so completions are found without searching. */
+typedef struct XhciTransferDescriptor {
+    reg32_t              Link;
+    reg32_t              AlternativeLink;
+
+    uint8_t              SlotId;
+    uint8_t              EndpointId;
+    uint16_t             StreamId;
+    int                  TrbCount;
+    uintptr_t            FirstTrb;
+    uintptr_t            LastTrb;
+    uintptr_t            NextDequeue;
+    size_t               Lengths[USB_TRANSACTIONCOUNT];
+    int                  LastTransaction;
+    int                  HubDescriptor; // The transfer reads the descriptor of a hub
+
+    volatile int         Completed;
+    volatile int         CompletionCode;
+    volatile size_t      Transferred[USB_TRANSACTIONCOUNT];
+    _Atomic(int)*        Outstanding;   // Counter of the interrupter while in flight
+    UsbSchedulerObject_t Object;
+} XhciTransferDescriptor_t;
+
+typedef struct XhciController {
+    UsbManagerController_t      Base;
+
+    XhciCapabilityRegisters_t*  CapRegisters;
+    XhciOperationalRegisters_t* OpRegisters;
+    XhciPortRegisters_t*        PortRegisters;
+    reg32_t*                    Doorbells;
+    uintptr_t                   RuntimeBase;
+
+    reg32_t                     SParameters1;
+    reg32_t                     SParameters2;
+    reg32_t                     CParameters;
+    int                         MaxSlots;
+    size_t                      ContextSize;
+    uint8_t                     PortProtocol[XHCI_MAX_PORTS];
+
+    XhciDma_t                   DeviceContextArray;
+    XhciDma_t                   ScratchpadArray;
+    XhciDma_t*                  Scratchpads;
+    int                         ScratchpadCount;
+
+    XhciRing_t                  CommandRing;
+    _Atomic(uintptr_t)          CommandPending;
+    _Atomic(int)                CommandDone;
+    _Atomic(int)                CommandStopped;
+    volatile int                CommandCode;
+    volatile int                CommandSlot;
+
+    _Atomic(int)                TransfersBusy;
+    _Atomic(int)                TransfersPending;
+
+    DeviceIo_t*                 MsixIo;
+    int                         InterrupterCount;
+    XhciInterrupter_t           Interrupters[XHCI_MAX_INTERRUPTERS];
+    XhciDevice_t*               Devices[XHCI_MAX_SLOTS + 1];
+} XhciController_t;
+
+#define XHCI_OPERATIONAL(Controller)    ((Controller)->OpRegisters)
+#define XHCI_INTERRUPTER(Controller, n) ((XhciInterrupterRegisters_t*)((Controller)->RuntimeBase + XHCI_INTERRUPTER_OFFSET(n)))
+#define XHCI_CONTEXT(Controller, Dma, n) ((reg32_t*)((uint8_t*)(Dma)->Virtual + ((n) * (Controller)->ContextSize)))
+#define XHCI_DCI(Address, Direction)    (((Address) == 0) ? 1 : (((Address) * 2) + (((Direction) == USB_ENDPOINT_IN) ? 1 : 0)))
+
+/*******************************************************************************
+ * Controller Methods
+ *******************************************************************************/
+
+/* XhciHalt
+ * Halt's the controller and waits for it to acknowledge. */
+__EXTERN
+OsStatus_t
+XhciHalt(
+    _In_ XhciController_t* Controller);
+
+/* XhciRestart
+ * Resets and restarts the entire controller, this can be used in
+ * case of serious failures. All devices must be enumerated again. */
+__EXTERN
+OsStatus_t
+XhciRestart(
+    _In_ XhciController_t* Controller);
+
+/* XhciDmaAllocate
+ * Allocates a piece of controller memory, it can be at most a page. */
+__EXTERN
+OsStatus_t
+XhciDmaAllocate(
+    _In_ size_t     Length,
+    _In_ XhciDma_t* Dma);
+
+/* XhciDmaFree
+ * Frees memory allocated by XhciDmaAllocate. */
+__EXTERN
+void
+XhciDmaFree(
+    _In_ XhciDma_t* Dma);
+
+/*******************************************************************************
+ * Ring Methods
+ *******************************************************************************/
+
+/* XhciRingInitialize
+ * Allocates a producer ring with the given number of TRBs and links it. */
+__EXTERN
+OsStatus_t
+XhciRingInitialize(
+    _In_ XhciRing_t* Ring,
+    _In_ int         Size);
+
+/* XhciRingDestroy
+ * Frees the memory of a producer ring. */
+__EXTERN
+void
+XhciRingDestroy(
+    _In_ XhciRing_t* Ring);
+
+/* XhciRingEnqueue
+ * Writes a TRB at the enqueue position and hands it to the controller by setting the
+ * cycle bit. The physical address of the TRB is returned. Chain must be set if the
+ * TRB is not the last of its TD, so a link TRB in between keeps the TD intact. */
+__EXTERN
+uintptr_t
+XhciRingEnqueue(
+    _In_ XhciRing_t* Ring,
+    _In_ uint32_t    ParameterLo,
+    _In_ uint32_t    ParameterHi,
+    _In_ uint32_t    Status,
+    _In_ uint32_t    Control);
+
+/* XhciRingReset
+ * Clears all TRBs of the ring and resets the enqueue position. */
+__EXTERN
+void
+XhciRingReset(
+    _In_ XhciRing_t* Ring);
+
+/* XhciRingBegin
+ * Starts a new TD on the ring. The first TRB of the TD is not handed to the controller
+ * before XhciRingCommit is called, so it never sees a partial TD. */
+__EXTERN
+void
+XhciRingBegin(
+    _In_ XhciRing_t* Ring);
+
+/* XhciRingCommit
+ * Hands the TD started with XhciRingBegin to the controller. */
+__EXTERN
+void
+XhciRingCommit(
+    _In_ XhciRing_t* Ring);
+
+/* XhciRingGetDequeue
+ * Retrieves the physical address of the enqueue pointer combined with the cycle
+ * state, as used for dequeue pointers in contexts. */
+__EXTERN
+uintptr_t
+XhciRingGetDequeue(
+    _In_ XhciRing_t* Ring);
+
+/* XhciRingContains
+ * Returns whether or not the TRB address is within the range [First, Last] of the
+ * ring, taking wrap-around into account. */
+__EXTERN
+int
+XhciRingContains(
+    _In_ XhciRing_t* Ring,
+    _In_ uintptr_t   First,
+    _In_ uintptr_t   Last,
+    _In_ uintptr_t   Address);
+
+/* XhciRingTrb
+ * Retrieves the virtual address of a TRB in the ring by physical address. */
+__EXTERN
+XhciTrb_t*
+XhciRingTrb(
+    _In_ XhciRing_t* Ring,
+    _In_ uintptr_t   Address);
+
+/* XhciInterrupterInitialize
+ * Allocates the event ring of the interrupter and programs the registers. */
+__EXTERN
+OsStatus_t
+XhciInterrupterInitialize(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter);
+
+/* XhciInterrupterReset
+ * Clears the event ring of the interrupter and programs the interrupter registers. */
+__EXTERN
+void
+XhciInterrupterReset(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter);
+
+/* XhciInterrupterDestroy
+ * Disables the interrupter and frees the event ring. */
+__EXTERN
+void
+XhciInterrupterDestroy(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter);
+
+/* XhciProcessEvents
+ * Drains the event ring of the interrupter. If another context is already draining
+ * it the call returns immediately. Completed transfers are marked pending and handled
+ * by XhciProcessTransfers. */
+__EXTERN
+void
+XhciProcessEvents(
+    _In_ XhciController_t*  Controller,
+    _In_ XhciInterrupter_t* Interrupter);
+
+/* XhciProcessTransfers
+ * Processes a bounded batch of the pending transfer completions, and returns 1 if
+ * there are more left. Calls from within the processing are deferred to the outermost
+ * call, as the transfer list can't be iterated recursively. */
+__EXTERN
+int
+XhciProcessTransfers(
+    _In_ XhciController_t* Controller);
+
+/*******************************************************************************
+ * Command Methods
+ *******************************************************************************/
+
+/* XhciCommandExecute
+ * Queues a command on the command ring and waits for its completion. This must not be
+ * called while processing events. The slot id of the completion is optionally returned. */
+__EXTERN
+OsStatus_t
+XhciCommandExecute(
+    _In_      XhciController_t* Controller,
+    _In_      uint32_t          ParameterLo,
+    _In_      uint32_t          ParameterHi,
+    _In_      uint32_t          Status,
+    _In_      uint32_t          Control,
+    _Out_Opt_ int*              SlotId);
+
+/* XhciCommandCompleted
+ * Invoked by the event processing on command completion events. */
+__EXTERN
+void
+XhciCommandCompleted(
+    _In_ XhciController_t* Controller,
+    _In_ XhciTrb_t*        Event);
+
+/*******************************************************************************
+ * Device Methods
+ *******************************************************************************/
+
+/* XhciDeviceAcquire
+ * Retrieves the device slot that the transfer is for. Unaddressed devices
+ * get a slot in the default state, and endpoints are configured on first use. */
+__EXTERN
+OsStatus_t
+XhciDeviceAcquire(
+    _In_  XhciController_t*     Controller,
+    _In_  UsbManagerTransfer_t* Transfer,
+    _Out_ XhciDevice_t**        DeviceOut);
+
+/* XhciDeviceSetAddress
+ * Performs the SET_ADDRESS request for the device by addressing the slot, the
+ * controller chooses the bus address itself. */
+__EXTERN
+OsStatus_t
+XhciDeviceSetAddress(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ uint8_t           Address);
+
+/* XhciDeviceInterrupter
+ * Selects the interrupter the events of an endpoint are posted to. Endpoints are
+ * spread over the secondary interrupters, the primary one is kept for commands and
+ * port events. */
+__EXTERN
+int
+XhciDeviceInterrupter(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ int               EndpointId);
+
+/* XhciDeviceConfigureHub
+ * Marks the slot as a hub with the port count and TT think time read from its
+ * hub descriptor. */
+__EXTERN
+OsStatus_t
+XhciDeviceConfigureHub(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device);
+
+/* XhciDeviceRecoverEndpoint
+ * Resets a halted endpoint and moves the dequeue pointer past the failed TD. */
+__EXTERN
+OsStatus_t
+XhciDeviceRecoverEndpoint(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device,
+    _In_ int               EndpointId);
+
+/* XhciDeviceCancelTransfer
+ * Stops the endpoint, turns the TRBs of the transfer into no-ops and restarts the endpoint. */
+__EXTERN
+OsStatus_t
+XhciDeviceCancelTransfer(
+    _In_ XhciController_t*         Controller,
+    _In_ XhciTransferDescriptor_t* Td);
+
+/* XhciDeviceDetach
+ * Marks all devices behind the root port as detached and fails their transfers. Their
+ * slots are released on the next enumeration, as commands can't be executed from
+ * event processing. A root port of 0 detaches all devices. */
+__EXTERN
+int
+XhciDeviceDetach(
+    _In_ XhciController_t* Controller,
+    _In_ int               RootPort);
+
+/* XhciDeviceReleaseDetached
+ * Disables the slots of all detached devices. */
+__EXTERN
+void
+XhciDeviceReleaseDetached(
+    _In_ XhciController_t* Controller);
+
+/* XhciDeviceDestroy
+ * Frees the structures of the device without disabling the slot. */
+__EXTERN
+void
+XhciDeviceDestroy(
+    _In_ XhciController_t* Controller,
+    _In_ XhciDevice_t*     Device);
+
+/* XhciDeviceGetRing
+ * Retrieves the transfer ring for the endpoint and stream. */
+__EXTERN
+XhciRing_t*
+XhciDeviceGetRing(
+    _In_ XhciDevice_t* Device,
+    _In_ int           EndpointId,
+    _In_ int           StreamId);
+
+/*******************************************************************************
+ * Port Methods
+ *******************************************************************************/
+
+/* XhciPortCheck
+ * Handles a port status change event for the given port index. Returns 1 if
+ * transfers were failed because of a disconnect. */
+__EXTERN
+int
+XhciPortCheck(
+    _In_ XhciController_t* Controller,
+    _In_ int               Index);
+
+/*******************************************************************************
+ * Transfer Methods
+ *******************************************************************************/
+
+/* XhciTransferEvent
+ * Invoked by the event processing on transfer events, updates the TD that the event
+ * belongs to. Returns 1 if a TD was completed. */
+__EXTERN
+int
+XhciTransferEvent(
+    _In_ XhciController_t* Controller,
+    _In_ XhciTrb_t*        Event);
+
+/* XhciRingDoorbell
+ * Notifies the controller of new TRBs on the endpoint ring. */
+__EXTERN
+void
+XhciRingDoorbell(
+    _In_ XhciController_t* Controller,
+    _In_ int               SlotId,
+    _In_ int               Target,
+    _In_ int               StreamId);
+
+/* XhciGetStatusCode
+ * Retrieves a transfer status from the given completion code */
+__EXTERN
+UsbTransferStatus_t
+XhciGetStatusCode(
+    _In_ int CompletionCode);
+
+#endif //!__USB_XHCI__
@@ -28,7 +28,7 @@
 #include <ddk/utils.h>
 #include <threads.h>
 #include <stdlib.h>
-#include "ahci.h"
+#include "manager.h"
 
 // Prototypes
 InterruptStatus_t OnFastInterrupt(FastInterruptResources_t*, void*);
@@ -53,6 +53,7 @@ AhciControllerCreate(
     memcpy(&Controller->Device, Device, Device->Base.Length);
     
     spinlock_init(&Controller->Lock, spinlock_plain);
+    CompletionModeratorInitialize(&Controller->Moderator, 1);
 
     // Get I/O Base, and for AHCI there might be between 1-5
     // IO-spaces filled, so we always, ALWAYS go for the last one
@@ -137,6 +138,91 @@ AhciControllerDestroy(
     return OsSuccess;
 }
 
+static int
+CountCommandSlots(
+    _In_ int Slots)
+{
+    int Count = 0;
+    while (Slots) {
+        Slots &= Slots - 1;
+        Count++;
+    }
+    return Count;
+}
+
+static void
+SetCompletionInterrupts(
+    _In_ AhciController_t* Controller,
+    _In_ reg32_t           Ports,
+    _In_ int               Enable)
+{
+    int i;
+
+    for (i = 0; i < AHCI_MAX_PORTS; i++) {
+        AhciPort_t* Port = Controller->Ports[i];
+        if (Port != NULL && (Ports & AHCI_IMPLEMENTED_PORT(i))) {
+            reg32_t InterruptEnable = READ_VOLATILE(Port->Registers->InterruptEnable);
+            if (Enable) {
+                InterruptEnable |= AHCI_PORT_IE_COMPLETION;
+            }
+            else {
+                InterruptEnable &= ~(AHCI_PORT_IE_COMPLETION);
+            }
+            WRITE_VOLATILE(Port->Registers->InterruptEnable, InterruptEnable);
+        }
+    }
+}
+
+reg32_t
+AhciControllerModerate(
+    _In_ AhciController_t* Controller,
+    _In_ int               Completed)
+{
+    reg32_t Coalesced   = Controller->InterruptResource.CoalescingPorts;
+    reg32_t Ports       = 0;
+    int     Outstanding = 0;
+    int     Threshold;
+    int     i;
+
+    if (!Controller->InterruptResource.CoalescingInterrupt || !Completed) {
+        return 0;
+    }
+
+    for (i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (Controller->Ports[i] != NULL && Controller->Ports[i]->Connected) {
+            Outstanding += CountCommandSlots(atomic_load(&Controller->Ports[i]->Slots));
+            Ports       |= AHCI_IMPLEMENTED_PORT(i);
+        }
+    }
+
+    if (!CompletionModeratorUpdate(&Controller->Moderator, Completed, Outstanding)) {
+        return 0;
+    }
+    Threshold = Controller->Moderator.Threshold;
+    TRACE("AhciControllerModerate(Threshold %i, Outstanding %i)", Threshold, Outstanding);
+
+    // The count and timeout may only be changed while coalescing is disabled. The
+    // ports keep their own completion interrupts when coalescing is off, and the
+    // coalescing interrupt replaces them while it is on.
+    WRITE_VOLATILE(Controller->Registers->CcControl, 0);
+    if (Threshold > 1) {
+        WRITE_VOLATILE(Controller->Registers->CcPorts, Ports);
+        WRITE_VOLATILE(Controller->Registers->CcControl, AHCI_CCC_TV(AHCI_COALESCING_TIMEOUT) |
+            AHCI_CCC_CC(Threshold) | AHCI_CCC_EN);
+        Controller->InterruptResource.CoalescingPorts = Ports;
+        SetCompletionInterrupts(Controller, Ports & ~(Coalesced), 0);
+        SetCompletionInterrupts(Controller, Coalesced & ~(Ports), 1);
+    }
+    else {
+        Controller->InterruptResource.CoalescingPorts = 0;
+        SetCompletionInterrupts(Controller, Coalesced, 1);
+    }
+
+    // Commands that completed while coalescing was disabled were not counted, so
+    // the caller must check these ports again
+    return Coalesced | Ports;
+}
+
 OsStatus_t
 AhciReset(
     _In_ AhciController_t* Controller)
@@ -264,6 +350,9 @@ AhciSetup(
 
         // Create a port descriptor and get register access
         Controller->Ports[i] = AhciPortCreate(Controller, ActivePortCount++, i);
+        if (Controller->Ports[i] == NULL) {
+            continue;
+        }
         AhciPortInitiateSetup(Controller, Controller->Ports[i]);
         AhciPortRebase(Controller, Controller->Ports[i]);
     }
@@ -287,6 +376,17 @@ AhciSetup(
         }
     }
 
+    // Command completion coalescing starts out disabled, and is enabled by the
+    // moderator once several commands are in flight
+    if (Caps & AHCI_CAPABILITIES_CCCS) {
+        reg32_t Ccc = READ_VOLATILE(Controller->Registers->CcControl);
+        WRITE_VOLATILE(Controller->Registers->CcControl, 0);
+        Controller->InterruptResource.CoalescingInterrupt = (reg32_t)(1 << AHCI_CCC_INT(Ccc));
+        Controller->InterruptResource.CoalescingPorts     = 0;
+        CompletionModeratorInitialize(&Controller->Moderator,
+            MIN(AHCI_CCC_MAX_COMPLETIONS, (int)Controller->CommandSlotCount));
+    }
+
     // To enable the HBA to generate interrupts, 
     // system software must also set GHC.IE to a 1
     Ghc = READ_VOLATILE(Controller->Registers->GlobalHostControl);
@@ -26,12 +26,14 @@
 #define _AHCI_H_
 
 #include <ddk/busdevice.h>
+#include <ddk/completion.h>
 #include <ddk/storage.h>
 #include <ddk/interrupt.h>
 #include <ds/collection.h>
 #include <os/osdefs.h>
 #include <os/spinlock.h>
 #include <os/dmabuf.h>
+#include <threads.h>
 
 // SATA includes
 #include <commands.h>
@@ -42,7 +44,10 @@
 #define AHCI_REGISTER_VENDORSPEC        0xA0
 #define AHCI_REGISTER_PORTBASE(Port)    (0x100 + (Port * 0x80))
 #define AHCI_MAX_PORTS                  32
+#define AHCI_MAX_SLOTS                  32
 #define AHCI_RECIEVED_FIS_SIZE          256
+#define AHCI_COMPLETION_BUDGET          16  // Transactions a port worker completes or dispatches per round
+#define AHCI_COALESCING_TIMEOUT         1   // ms, the shortest the hardware supports
 
 PACKED_ATYPESTRUCT(volatile, AHCIGenericRegisters, {
     reg32_t                Capabilities;
@@ -200,6 +205,14 @@ PACKED_ATYPESTRUCT(volatile, AHCIFis, {
  * - Generic Registers */
 #define AHCI_INTERRUPT_PORT(Port)           (1 << Port)
 
+/* Command Completion Coalescing Control (CcControl)
+ * - Generic Registers */
+#define AHCI_CCC_EN                         0x1             /* Enable */
+#define AHCI_CCC_INT(Register)              ((Register >> 3) & 0x1F)    /* Interrupt used by coalescing */
+#define AHCI_CCC_CC(Count)                  ((Count & 0xFF) << 8)       /* Command Completions */
+#define AHCI_CCC_TV(Ms)                     ((Ms & 0xFFFF) << 16)       /* Timeout Value */
+#define AHCI_CCC_MAX_COMPLETIONS            255
+
 /* Ports Implemented (PortsImplemented)
  * - Generic Registers */
 #define AHCI_IMPLEMENTED_PORT(Port)         (1 << Port)
@@ -283,6 +296,10 @@ PACKED_ATYPESTRUCT(volatile, AHCIFis, {
 #define AHCI_PORT_IE_TFEE                   0x40000000      /* Task File Error Enable */
 #define AHCI_PORT_IE_CPDE                   0x80000000      /* Cold Presence Detect Enable */
 
+/* The interrupts that signal command completion, these are replaced by the
+ * coalescing interrupt for ports that are coalesced */
+#define AHCI_PORT_IE_COMPLETION             (AHCI_PORT_IE_DHRE | AHCI_PORT_IE_PSE | AHCI_PORT_IE_DSE)
+
 /* Port x Task File Data (TaskFileData)
  * - Port Registers */
 #define AHCI_PORT_TFD_ERR                   0x1
@@ -324,8 +341,18 @@ typedef struct _AhciPort {
     struct dma_attachment   RecievedFisDMA;
 
     _Atomic(int)            Slots;
+    _Atomic(int)            Issued;     // Slots written to the issue register and not yet completed
     int                     SlotCount;
-    Collection_t*           Transactions;
+    struct AhciTransation*  Transactions[AHCI_MAX_SLOTS]; // Indexed by command slot
+
+    // Each port dispatches and completes its transactions on its own worker, so
+    // a slow device only holds up its own port
+    struct _AhciController* Controller;
+    thrd_t                  Worker;
+    _Atomic(int)            WorkerRunning;
+    _Atomic(int)            WorkerEvents;
+    CompletionQueue_t       Submissions;
+    CompletionQueue_t       Completions;
 } AhciPort_t;
 
 /* AhciInterruptResource
@@ -334,6 +361,8 @@ typedef struct _AhciPort {
 typedef struct _AhciInterruptResource {
     reg32_t                 ControllerInterruptStatus;
     reg32_t                 PortInterruptStatus[AHCI_MAX_PORTS];
+    reg32_t                 CoalescingInterrupt; // Bit in InterruptStatus, 0 if not supported
+    reg32_t                 CoalescingPorts;     // Ports that are currently coalesced
 } AhciInterruptResource_t;
 
 typedef struct _AhciController {
@@ -349,6 +378,7 @@ typedef struct _AhciController {
     uint32_t                ValidPorts;
     int                     PortCount;
     size_t                  CommandSlotCount;
+    CompletionModerator_t   Moderator;
 } AhciController_t;
 
 /* AhciControllerCreate
@@ -364,6 +394,15 @@ __EXTERN OsStatus_t
 AhciControllerDestroy(
     _In_ AhciController_t*  Controller);
 
+/* AhciControllerModerate
+ * Adapts the command completion coalescing to the number of commands in flight,
+ * after an interrupt completed the given number of transactions. Returns the ports
+ * that must be checked for completions if the coalescing was reprogrammed. */
+__EXTERN reg32_t
+AhciControllerModerate(
+    _In_ AhciController_t* Controller,
+    _In_ int               Completed);
+
 /* AhciPortCreate
  * Initializes the port structure, but not memory structures yet */
 __EXTERN AhciPort_t*
@@ -408,6 +447,15 @@ AhciPortStart(
     _In_ AhciController_t*  Controller, 
     _In_ AhciPort_t*        Port);
 
+/* AhciPortSignalWorker
+ * Wakes the worker of the port after transactions were queued for submission or
+ * completion. Does not block, so it can be used from the interrupt handler. */
+__EXTERN void
+AhciPortSignalWorker(
+    _In_ AhciPort_t* Port);
+
+/* AhciPortAllocateCommandSlot
+ * Allocates a free command slot on the port, returns OsBusy if they are all in use. */
 OsStatus_t
 AhciPortAllocateCommandSlot(
     _In_  AhciPort_t* Port,
@@ -419,15 +467,17 @@ AhciPortFreeCommandSlot(
     _In_ int         Slot);
 
 /* AhciPortStartCommandSlot
- * Starts a command slot on the given port */
+ * Starts a command slot on the given port, the slot is tracked as issued from
+ * here on and is only completed once the port has cleared it. */
 __EXTERN void
 AhciPortStartCommandSlot(
     _In_ AhciPort_t*        Port, 
     _In_ int                Slot);
 
 /* AhciPortInterruptHandler
- * Handles port-specific interrupts. */
-__EXTERN void
+ * Handles port-specific interrupts, and hands the finished transactions to the
+ * worker of the port. Returns the number of transactions that finished. */
+__EXTERN int
 AhciPortInterruptHandler(
     _In_ AhciController_t*  Controller, 
     _In_ AhciPort_t*        Port);
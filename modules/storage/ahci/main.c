@@ -47,6 +47,7 @@ OnFastInterrupt(
     AhciInterruptResource_t* Resource  = (AhciInterruptResource_t*)INTERRUPT_RESOURCE(InterruptTable, 0);
     AHCIGenericRegisters_t*  Registers = (AHCIGenericRegisters_t*)INTERRUPT_IOSPACE(InterruptTable, 0)->Access.Memory.VirtualBase;
     reg32_t                  InterruptStatus;
+    reg32_t                  PortStatus;
     int                      i;
     _CRT_UNUSED(Reserved);
 
@@ -56,9 +57,15 @@ OnFastInterrupt(
         return InterruptNotHandled;
     }
 
+    // The coalescing interrupt stands in for the completions of all coalesced ports
+    PortStatus = InterruptStatus;
+    if (InterruptStatus & Resource->CoalescingInterrupt) {
+        PortStatus = (InterruptStatus & ~(Resource->CoalescingInterrupt)) | Resource->CoalescingPorts;
+    }
+
     // Save the status to port that made it and clear
     for (i = 0; i < AHCI_MAX_PORTS; i++) {
-        if ((InterruptStatus & (1 << i)) != 0) {
+        if ((PortStatus & (1 << i)) != 0) {
             AHCIPortRegisters_t* PortRegister   = (AHCIPortRegisters_t*)((uintptr_t)Registers + AHCI_REGISTER_PORTBASE(i));
             Resource->PortInterruptStatus[i]   |= PortRegister->InterruptStatus;
             PortRegister->InterruptStatus       = PortRegister->InterruptStatus;
@@ -67,7 +74,7 @@ OnFastInterrupt(
 
     // Write clear interrupt register and return
     Registers->InterruptStatus              = InterruptStatus;
-    Resource->ControllerInterruptStatus    |= InterruptStatus;
+    Resource->ControllerInterruptStatus    |= PortStatus;
     return InterruptHandled;
 }
 
@@ -78,17 +85,19 @@ OnInterrupt(
 {
     AhciController_t* Controller = (AhciController_t*)InterruptData;
     reg32_t           InterruptStatus;
+    int               Completed = 0;
     int               i;
 
 HandleInterrupt:
     InterruptStatus = Controller->InterruptResource.ControllerInterruptStatus;
     Controller->InterruptResource.ControllerInterruptStatus = 0;
     
+HandlePorts:
     // Iterate the port-map and check if the interrupt
     // came from that port
     for (i = 0; i < AHCI_MAX_PORTS; i++) {
         if (Controller->Ports[i] != NULL && ((InterruptStatus & (1 << i)) != 0)) {
-            AhciPortInterruptHandler(Controller, Controller->Ports[i]);
+            Completed += AhciPortInterruptHandler(Controller, Controller->Ports[i]);
         }
     }
     
@@ -96,6 +105,14 @@ HandleInterrupt:
     if (Controller->InterruptResource.ControllerInterruptStatus != 0) {
         goto HandleInterrupt;
     }
+
+    // Adapt the coalescing to the load, the ports it returns may have completions
+    // that did not raise an interrupt while it was reprogrammed
+    InterruptStatus = AhciControllerModerate(Controller, Completed);
+    if (InterruptStatus != 0) {
+        Completed = 0;
+        goto HandlePorts;
+    }
 }
 
 void GetModuleIdentifiers(unsigned int* vendorId, unsigned int* deviceId,
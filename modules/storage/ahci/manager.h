@@ -71,12 +71,17 @@ typedef struct _AhciDevice {
     } CHS;
 } AhciDevice_t;
 
+// The storage protocol responses of the transfer functions all share this form
+typedef int(*AhciTransactionResponse_t)(struct gracht_recv_message*, OsStatus_t, size_t);
+
 #define AHCI_DEVICE_MODE_CHS    0
 #define AHCI_DEVICE_MODE_LBA28  1
 #define AHCI_DEVICE_MODE_LBA48  2
 
 typedef struct AhciTransation {
-    CollectionItem_t      Header;
+    CompletionEntry_t     Submission;
+    CompletionEntry_t     Completion;
+    AhciPort_t*           Port;
     int                   Internal;
     TransactionState_t    State;
     TransactionType_t     Type;
@@ -84,8 +89,9 @@ typedef struct AhciTransation {
     int                   Slot;
     int                   Direction;
     AHCIFis_t             Response;
-    struct dma_attachment DmaAttachment;
-    struct dma_sg_table   DmaTable;
+    struct dma_attachment DmaAttachments[STORAGE_MAX_SEGMENTS];
+    int                   DmaAttachmentCount;
+    struct dma_sg_table   DmaTable; // The segments joined in transfer order
 
     struct {
         DeviceType_t Type;
@@ -102,6 +108,7 @@ typedef struct AhciTransation {
     size_t                SgOffset;
     
     struct vali_link_deferred_response DeferredMessage;
+    AhciTransactionResponse_t          Respond;
 } AhciTransaction_t;
 
 #define AHCI_XACTION_IN     0
@@ -146,6 +153,26 @@ __EXTERN OsStatus_t
 AhciManagerCancelTransaction(
     _In_ AhciTransaction_t* Transaction);
 
+/**
+ * AhciTransactionSubmit
+ * Submission queue callback of the port worker, dispatches the transaction on a
+ * free command slot. The worker only drains as many as there are free slots.
+ */
+__EXTERN void
+AhciTransactionSubmit(
+    _In_ CompletionEntry_t* Entry,
+    _In_ void*              Context);
+
+/**
+ * AhciTransactionComplete
+ * Completion queue callback of the port worker for transactions the port has
+ * finished, invokes AhciTransactionHandleResponse.
+ */
+__EXTERN void
+AhciTransactionComplete(
+    _In_ CompletionEntry_t* Entry,
+    _In_ void*              Context);
+
 /**
  * AhciTransactionHandleResponse
  */
@@ -24,16 +24,91 @@
 //#define __TRACE
 
 #include <assert.h>
+#include <internal/_syscalls.h>
+#include <internal/_utils.h>
+#include <os/futex.h>
 #include <os/mollenos.h>
 #include <ddk/io.h>
 #include <ddk/utils.h>
-#include <ds/collection.h>
 #include "manager.h"
 #include "dispatch.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <threads.h>
 
+static int
+AhciPortFreeSlots(
+    _In_ AhciPort_t* Port)
+{
+    int Slots = atomic_load(&Port->Slots);
+    int Free  = 0;
+    int i;
+
+    for (i = 0; i < Port->SlotCount; i++) {
+        if (!(Slots & (1 << i))) {
+            Free++;
+        }
+    }
+    return Free;
+}
+
+static int
+AhciPortHasWork(
+    _In_ AhciPort_t* Port)
+{
+    if (CompletionQueuePending(&Port->Completions)) {
+        return 1;
+    }
+    return CompletionQueuePending(&Port->Submissions) && AhciPortFreeSlots(Port);
+}
+
+static int
+AhciPortWorker(
+    _In_ void* Context)
+{
+    AhciPort_t*       Port = (AhciPort_t*)Context;
+    FutexParameters_t Parameters;
+    int               Events;
+
+    while (1) {
+        // Read the event counter before looking for work, a signal that arrives in
+        // between changes it and the wait returns right away
+        Events = atomic_load(&Port->WorkerEvents);
+        if (!AhciPortHasWork(Port)) {
+            if (!atomic_load(&Port->WorkerRunning)) {
+                break;
+            }
+
+            Parameters._futex0  = &Port->WorkerEvents;
+            Parameters._val0    = Events;
+            Parameters._timeout = 0;
+            Parameters._flags   = FUTEX_WAIT_PRIVATE;
+            (void)Syscall_FutexWait(&Parameters);
+            continue;
+        }
+
+        // Completions go first as they free the slots the submissions need, and
+        // the submissions are only drained as far as there are free slots
+        CompletionQueueDrain(&Port->Completions, AHCI_COMPLETION_BUDGET);
+        CompletionQueueDrain(&Port->Submissions, MIN(AhciPortFreeSlots(Port), AHCI_COMPLETION_BUDGET));
+    }
+    return 0;
+}
+
+void
+AhciPortSignalWorker(
+    _In_ AhciPort_t* Port)
+{
+    FutexParameters_t Parameters;
+
+    atomic_fetch_add(&Port->WorkerEvents, 1);
+    Parameters._futex0 = &Port->WorkerEvents;
+    Parameters._val0   = 1;
+    Parameters._flags  = FUTEX_WAKE_PRIVATE;
+    (void)Syscall_FutexWake(&Parameters);
+}
+
 AhciPort_t*
 AhciPortCreate(
     _In_ AhciController_t*  Controller, 
@@ -59,8 +134,9 @@ AhciPortCreate(
     
     memset(AhciPort, 0, sizeof(AhciPort_t));
     AhciPort->Id        = Port;     // Sequential port number
-    AhciPort->Index     = Index;    // Index in validity map
-    AhciPort->SlotCount = AHCI_CAPABILITIES_NCS(Controller->Registers->Capabilities);
+    AhciPort->Index      = Index;    // Index in validity map
+    AhciPort->SlotCount  = AHCI_CAPABILITIES_NCS(Controller->Registers->Capabilities);
+    AhciPort->Controller = Controller;
 
     // Allocate a transfer buffer for internal transactions
     DmaInfo.length   = AhciManagerGetFrameSize();
@@ -69,8 +145,19 @@ AhciPortCreate(
     dma_create(&DmaInfo, &AhciPort->InternalBuffer);
     
     // TODO: port nr or bit index? Right now use the Index in the validity map
-    AhciPort->Registers    = (AHCIPortRegisters_t*)((uintptr_t)Controller->Registers + AHCI_REGISTER_PORTBASE(Index));
-    AhciPort->Transactions = CollectionCreate(KeyInteger);
+    AhciPort->Registers = (AHCIPortRegisters_t*)((uintptr_t)Controller->Registers + AHCI_REGISTER_PORTBASE(Index));
+    
+    // Start the worker that dispatches and completes the transactions of the port
+    CompletionQueueInitialize(&AhciPort->Submissions, AhciTransactionSubmit, AhciPort);
+    CompletionQueueInitialize(&AhciPort->Completions, AhciTransactionComplete, AhciPort);
+    atomic_store(&AhciPort->WorkerRunning, 1);
+    if (thrd_create(&AhciPort->Worker, AhciPortWorker, AhciPort) != thrd_success) {
+        ERROR("AHCI::Port (%i): failed to start the port worker", Port);
+        dma_attachment_unmap(&AhciPort->InternalBuffer);
+        dma_detach(&AhciPort->InternalBuffer);
+        free(AhciPort);
+        return NULL;
+    }
     return AhciPort;
 }
 
@@ -79,18 +166,43 @@ AhciPortCleanup(
     _In_ AhciController_t* Controller, 
     _In_ AhciPort_t*       Port)
 {
-    CollectionItem_t* Node;
+    reg32_t Status;
+    int     Outstanding;
+    int     Hung;
+    int     i;
 
     // Null out the port-entry in the controller
     Controller->Ports[Port->Index] = NULL;
 
-    // Go through each transaction for the ports and clean up
-    Node = CollectionPopFront(Port->Transactions);
-    while (Node) {
-        AhciManagerCancelTransaction((AhciTransaction_t*)Node);
-        Node = CollectionPopFront(Port->Transactions);
+    // Let the worker finish what has completed, it cancels queued transactions
+    // once it is no longer running
+    atomic_store(&Port->WorkerRunning, 0);
+    AhciPortSignalWorker(Port);
+    thrd_join(Port->Worker, NULL);
+
+    // Claim the commands still in flight before the port is stopped. Stopping it
+    // clears CI and SACT, which would otherwise make them look completed
+    WRITE_VOLATILE(Port->Registers->InterruptEnable, 0);
+    Outstanding = atomic_exchange(&Port->Issued, 0);
+
+    // The port must be stopped before the transactions are cancelled, otherwise
+    // it could still transfer into their buffers once they are released
+    Status = READ_VOLATILE(Port->Registers->CommandAndStatus);
+    WRITE_VOLATILE(Port->Registers->CommandAndStatus, Status & ~AHCI_PORT_ST);
+    WaitForConditionWithFault(Hung, (READ_VOLATILE(Port->Registers->CommandAndStatus) & AHCI_PORT_CR) == 0, 6, 100);
+    if (Hung) {
+        ERROR("AHCI::Port (%i): failed to stop command engine: 0x%x", Port->Id,
+            Port->Registers->CommandAndStatus);
+    }
+
+    // Go through each transaction in flight and clean up
+    for (i = 0; i < AHCI_MAX_SLOTS; i++) {
+        if ((Outstanding & (1 << i)) && Port->Transactions[i] != NULL) {
+            AhciManagerCancelTransaction(Port->Transactions[i]);
+        }
     }
-    CollectionDestroy(Port->Transactions);
+    CompletionQueueDrain(&Port->Completions, INT_MAX);
+    CompletionQueueDrain(&Port->Submissions, INT_MAX);
     AhciManagerUnregisterDevice(Controller, Port);
     
     // Destroy the internal transfer buffer
@@ -381,12 +493,61 @@ AhciPortStart(
     return AhciPortEnable(Controller, Port);
 }
 
+static int
+AhciPortCompleteCommands(
+    _In_ AhciPort_t* Port)
+{
+    AhciTransaction_t* Transaction;
+    int                DoneCommands;
+    int                Completed = 0;
+    int                i;
+
+    // A command is done once the port has cleared it from both the issue and the
+    // active (NCQ) registers. Only slots that were actually issued count, a slot that
+    // is allocated but still being built is clear in both registers as well
+    DoneCommands = atomic_load(&Port->Issued) & ~(READ_VOLATILE(Port->Registers->CommandIssue) |
+        READ_VOLATILE(Port->Registers->AtaActive));
+    TRACE("DoneCommands(0x%x) <= Issued(0x%x) & ~(CommandIssue(0x%x) | AtaActive(0x%x))", 
+        DoneCommands, atomic_load(&Port->Issued), Port->Registers->CommandIssue, Port->Registers->AtaActive);
+
+    // Both the interrupt handler and the submitter look for completions, so the
+    // slots are claimed first and each command is completed once
+    DoneCommands &= atomic_fetch_and(&Port->Issued, ~DoneCommands);
+    if (DoneCommands == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < Port->SlotCount; i++) {
+        if (DoneCommands & (1 << i)) {
+            Transaction = Port->Transactions[i];
+            assert(Transaction != NULL);
+
+            // Release the slot and leave the response to the worker of the port
+            Port->Transactions[i] = NULL;
+            memcpy((void*)&Transaction->Response, Port->RecievedFisDMA.buffer, sizeof(AHCIFis_t));
+            AhciPortFreeCommandSlot(Port, Transaction->Slot);
+            Transaction->Slot = -1;
+
+            CompletionQueuePush(&Port->Completions, &Transaction->Completion);
+            Completed++;
+        }
+    }
+    return Completed;
+}
+
 void
 AhciPortStartCommandSlot(
     _In_ AhciPort_t* Port, 
     _In_ int         Slot)
 {
     WRITE_VOLATILE(Port->Registers->CommandIssue, (1 << Slot));
+    atomic_fetch_or(&Port->Issued, (1 << Slot));
+
+    // The command may have finished before it was marked issued, in which case
+    // the interrupt it raised did not see it
+    if (AhciPortCompleteCommands(Port)) {
+        AhciPortSignalWorker(Port);
+    }
 }
 
 OsStatus_t
@@ -394,27 +555,24 @@ AhciPortAllocateCommandSlot(
     _In_  AhciPort_t* Port,
     _Out_ int*        SlotOut)
 {
-    OsStatus_t Status = OsError;
-    int        Slots;
-    int        i;
+    int Slots = atomic_load(&Port->Slots);
+    int i;
     
-    while (Status != OsSuccess) {
-        Slots = atomic_load(&Port->Slots);
-        
-        for (i = 0; i < Port->SlotCount; i++) {
-            // Check availability status on this command slot
-            if (Slots & (1 << i)) {
-                continue;
-            }
+    for (i = 0; i < Port->SlotCount; i++) {
+        // Check availability status on this command slot
+        if (Slots & (1 << i)) {
+            continue;
+        }
 
-            if (atomic_compare_exchange_strong(&Port->Slots, &Slots, Slots | (1 << i))) {
-                Status   = OsSuccess;
-                *SlotOut = i;
-            }
-            break;
+        if (atomic_compare_exchange_strong(&Port->Slots, &Slots, Slots | (1 << i))) {
+            *SlotOut = i;
+            return OsSuccess;
         }
+
+        // A slot was released meanwhile, the exchange reloaded them so start over
+        i = -1;
     }
-    return Status;
+    return OsBusy;
 }
 
 void
@@ -422,19 +580,17 @@ AhciPortFreeCommandSlot(
     _In_ AhciPort_t* Port,
     _In_ int         Slot)
 {
-    
+    atomic_fetch_and(&Port->Issued, ~(1 << Slot));
+    atomic_fetch_and(&Port->Slots, ~(1 << Slot));
 }
 
-void
+int
 AhciPortInterruptHandler(
     _In_ AhciController_t* Controller, 
     _In_ AhciPort_t*       Port)
 {
-    AhciTransaction_t* Transaction;
-    reg32_t            InterruptStatus;
-    reg32_t            DoneCommands;
-    DataKey_t          Key;
-    int                i;
+    reg32_t InterruptStatus;
+    int     Completed = 0;
     
     // Check interrupt services 
     // Cold port detect, recieved fis etc
@@ -476,34 +632,15 @@ HandleInterrupt:
         }
     }
 
-    // Get completed commands, by using our own slot-status
-    DoneCommands = atomic_load(&Port->Slots) ^ READ_VOLATILE(Port->Registers->AtaActive);
-    TRACE("DoneCommands(0x%x) <= SlotStatus(0x%x) ^ AtaActive(0x%x)", 
-        DoneCommands, atomic_load(&Port->Slots), Port->Registers->AtaActive);
-
-    // Check for command completion
-    // by iterating through the command slots
-    if (DoneCommands != 0) {
-        for (i = 0; i < AHCI_MAX_PORTS; i++) {
-            if (DoneCommands & (1 << i)) {
-                Key.Value.Integer = i;
-                Transaction       = (AhciTransaction_t*)CollectionGetNodeByKey(Port->Transactions, Key, 0);                
-                assert(Transaction != NULL);
-
-                // Handle transaction completion, release slot, queue up a new command if any
-                // and then handle the event
-                CollectionRemoveByNode(Port->Transactions, &Transaction->Header);
-                memcpy((void*)&Transaction->Response, Port->RecievedFisDMA.buffer, sizeof(AHCIFis_t));
-                AhciPortFreeCommandSlot(Port, Transaction->Slot);
-                Transaction->Slot = -1;
-
-                AhciTransactionHandleResponse(Controller, Port, Transaction);
-            }
-        }
-    }
+    Completed += AhciPortCompleteCommands(Port);
 
     // Re-handle?
     if (Controller->InterruptResource.PortInterruptStatus[Port->Index] != 0) {
         goto HandleInterrupt;
     }
+
+    if (Completed) {
+        AhciPortSignalWorker(Port);
+    }
+    return Completed;
 }
@@ -34,8 +34,6 @@
 #include "ctt_driver_protocol_server.h"
 #include "ctt_storage_protocol_server.h"
 
-static UUId_t TransactionId = 0;
-
 static struct {
     int          Direction;
     int          DMA;
@@ -62,27 +60,84 @@ static struct {
 
 static OsStatus_t
 QueueTransaction(
-    _In_ AhciController_t*  Controller,
     _In_ AhciPort_t*        Port,
     _In_ AhciTransaction_t* Transaction)
 {
-    OsStatus_t Status;
-    
-    // OK so the transaction we just recieved needs to be queued up,
-    // so we must initally see if we can allocate a new slot on the port
+    // The transaction is handed to the worker of the port, which dispatches it
+    // once a command slot is free
+    Transaction->Port  = Port;
+    Transaction->State = TransactionQueued;
+    CompletionQueuePush(&Port->Submissions, &Transaction->Submission);
+    AhciPortSignalWorker(Port);
+    return OsSuccess;
+}
+
+static OsStatus_t
+AhciTransactionDestroy(
+    _In_ AhciTransaction_t* Transaction)
+{
+    int i;
+
+    // Detach from our buffer references
+    for (i = 0; i < Transaction->DmaAttachmentCount; i++) {
+        dma_detach(&Transaction->DmaAttachments[i]);
+    }
+    free(Transaction->DmaTable.entries);
+    free(Transaction);
+    return OsSuccess;
+}
+
+static OsStatus_t
+AhciTransactionFinish(
+    _In_ AhciPort_t*        Port,
+    _In_ AhciTransaction_t* Transaction,
+    _In_ OsStatus_t         Status)
+{
+    if (Transaction->Internal) {
+        if (Status == OsSuccess) {
+            AhciManagerHandleControlResponse(Port, Transaction);
+        }
+        else {
+            WARNING("AHCI::Port (%i): control command 0x%x failed", Port->Id, Transaction->Command);
+        }
+    }
+    else {
+        Transaction->Respond(&Transaction->DeferredMessage.recv_message,
+            Status, Transaction->SectorsTransferred);
+    }
+    return AhciTransactionDestroy(Transaction);
+}
+
+void
+AhciTransactionSubmit(
+    _In_ CompletionEntry_t* Entry,
+    _In_ void*              Context)
+{
+    AhciTransaction_t* Transaction = COMPLETION_ENTRY_OWNER(Entry, AhciTransaction_t, Submission);
+    AhciPort_t*        Port        = (AhciPort_t*)Context;
+    OsStatus_t         Status;
+
+    // Nothing new is started on a port that is going away
+    if (!atomic_load(&Port->WorkerRunning)) {
+        AhciManagerCancelTransaction(Transaction);
+        return;
+    }
+
+    // The worker is the only one allocating slots and never drains more than there
+    // are free, so this does not fail. Should it anyway, the transaction is requeued
     Status = AhciPortAllocateCommandSlot(Port, &Transaction->Slot);
-    CollectionAppend(Port->Transactions, &Transaction->Header);
     if (Status != OsSuccess) {
-        Transaction->State = TransactionQueued;
-        return OsSuccess;
+        Transaction->Slot = -1;
+        CompletionQueuePush(&Port->Submissions, &Transaction->Submission);
+        return;
     }
-    
-    // If we reach here we've successfully allocated a slot, now we should dispatch 
-    // the transaction
+
+    // Completions are looked up by the slot
+    Port->Transactions[Transaction->Slot] = Transaction;
     Transaction->State = TransactionInProgress;
     switch (Transaction->Type) {
         case TransactionRegisterFISH2D: {
-            Status = AhciDispatchRegisterFIS(Controller, Port, Transaction);
+            Status = AhciDispatchRegisterFIS(Port->Controller, Port, Transaction);
         } break;
         
         default: {
@@ -91,21 +146,11 @@ QueueTransaction(
     }
     
     if (Status != OsSuccess) {
-        CollectionRemoveByNode(Port->Transactions, &Transaction->Header);
+        Port->Transactions[Transaction->Slot] = NULL;
         AhciPortFreeCommandSlot(Port, Transaction->Slot);
+        Transaction->Slot = -1;
+        AhciTransactionFinish(Port, Transaction, Status);
     }
-    return Status;
-}
-
-static OsStatus_t
-AhciTransactionDestroy(
-    _In_ AhciTransaction_t* Transaction)
-{
-    // Detach from our buffer reference
-    dma_detach(&Transaction->DmaAttachment);
-    free(Transaction->DmaTable.entries);
-    free(Transaction);
-    return OsSuccess;
 }
 
 OsStatus_t
@@ -116,7 +161,6 @@ AhciTransactionControlCreate(
     _In_ int           Direction)
 {
     AhciTransaction_t* Transaction;
-    OsStatus_t         Status;
     
     if (!Device) {
         return OsInvalidParameters;
@@ -129,9 +173,9 @@ AhciTransactionControlCreate(
     
     // Do not bother about zeroing the array
     memset(Transaction, 0, sizeof(AhciTransaction_t));
-    dma_attach(Device->Port->InternalBuffer.handle, &Transaction->DmaAttachment);
-    dma_get_sg_table(&Transaction->DmaAttachment, &Transaction->DmaTable, -1);
-    Transaction->Header.Key.Value.Id = TransactionId++;
+    dma_attach(Device->Port->InternalBuffer.handle, &Transaction->DmaAttachments[0]);
+    dma_get_sg_table(&Transaction->DmaAttachments[0], &Transaction->DmaTable, -1);
+    Transaction->DmaAttachmentCount = 1;
 
     Transaction->Internal  = 1;
     Transaction->Type      = TransactionRegisterFISH2D;
@@ -146,49 +190,109 @@ AhciTransactionControlCreate(
     Transaction->Target.AddressingMode = Device->AddressingMode;
     
     // The transaction is now prepared and ready for the dispatch
-    Status = QueueTransaction(Device->Controller, Device->Port, Transaction);
-    if (Status != OsSuccess) {
-        AhciTransactionDestroy(Transaction);
+    return QueueTransaction(Device->Port, Transaction);
+}
+
+static OsStatus_t
+AppendSegment(
+    _In_ AhciTransaction_t*      transaction,
+    _In_ const StorageSegment_t* segment,
+    _In_ size_t                  length)
+{
+    struct dma_attachment* attachment = &transaction->DmaAttachments[transaction->DmaAttachmentCount];
+    struct dma_sg_table    sgTable;
+    struct dma_sg*         entries;
+    size_t                 sgOffset;
+    int                    sgIndex;
+    OsStatus_t             status;
+
+    status = dma_attach(segment->BufferHandle, attachment);
+    if (status != OsSuccess) {
+        return OsInvalidParameters;
+    }
+    transaction->DmaAttachmentCount++;
+
+    status = dma_get_sg_table(attachment, &sgTable, -1);
+    if (status != OsSuccess) {
+        return status;
+    }
+
+    status = dma_sg_table_offset(&sgTable, segment->Offset, &sgIndex, &sgOffset);
+    if (status != OsSuccess) {
+        free(sgTable.entries);
+        return OsInvalidParameters;
+    }
+
+    // At most the remaining entries of the buffer are added
+    entries = (struct dma_sg*)realloc(transaction->DmaTable.entries,
+        sizeof(struct dma_sg) * (transaction->DmaTable.count + (sgTable.count - sgIndex)));
+    if (!entries) {
+        free(sgTable.entries);
+        return OsOutOfMemory;
     }
-    return Status;
+    transaction->DmaTable.entries = entries;
+
+    for (; sgIndex < sgTable.count && length > 0; sgIndex++, sgOffset = 0) {
+        uintptr_t      address = sgTable.entries[sgIndex].address + sgOffset;
+        size_t         count   = MIN(length, sgTable.entries[sgIndex].length - sgOffset);
+        struct dma_sg* last    = &entries[transaction->DmaTable.count - 1];
+
+        // Physically contiguous pieces are joined, so they share PRDT entries
+        if (transaction->DmaTable.count != 0 && (last->address + last->length) == address) {
+            last->length += count;
+        }
+        else {
+            entries[transaction->DmaTable.count].address = address;
+            entries[transaction->DmaTable.count].length  = count;
+            transaction->DmaTable.count++;
+        }
+        length -= count;
+    }
+    free(sgTable.entries);
+
+    // The segment must not extend past its buffer
+    return length == 0 ? OsSuccess : OsInvalidParameters;
 }
 
 OsStatus_t
 AhciTransactionStorageCreate(
     _In_ AhciDevice_t*               device,
     _In_ struct gracht_recv_message* message,
+    _In_ AhciTransactionResponse_t   respond,
     _In_ int                         direction,
     _In_ uint64_t                    sector,
-    _In_ UUId_t                      bufferHandle,
-    _In_ unsigned int                bufferOffset,
+    _In_ const StorageSegment_t*     segments,
+    _In_ int                         segmentCount,
     _In_ size_t                      sectorCount)
 {
-    struct dma_attachment dmaAttachment;
-    AhciTransaction_t*    transaction;
-    OsStatus_t            status;
-    int                   i;
+    AhciTransaction_t* transaction;
+    OsStatus_t         status;
+    size_t             length = 0;
+    int                i;
     
-    if (!device) {
+    if (!device || !segments || segmentCount <= 0 || segmentCount > STORAGE_MAX_SEGMENTS ||
+        sector >= device->SectorCount) {
         return OsInvalidParameters;
     }
-    
-    status = dma_attach(bufferHandle, &dmaAttachment);
-    if (status != OsSuccess) {
+
+    // The segments must cover the sectors exactly, in whole sectors
+    for (i = 0; i < segmentCount; i++) {
+        if (!segments[i].Length || (segments[i].Length % device->SectorSize) != 0) {
+            return OsInvalidParameters;
+        }
+        length += segments[i].Length;
+    }
+    if (length != sectorCount * device->SectorSize) {
         return OsInvalidParameters;
     }
     
     transaction = (AhciTransaction_t*)malloc(sizeof(AhciTransaction_t));
     if (!transaction) {
-        dma_detach(&dmaAttachment);
         return OsOutOfMemory;
     }
     
     // Do not bother about zeroing the array
     memset(transaction, 0, sizeof(AhciTransaction_t));
-    memcpy(&transaction->DmaAttachment, &dmaAttachment, sizeof(struct dma_attachment));
-    transaction->Header.Key.Value.Id = TransactionId++;
-    gracht_vali_message_defer_response(&transaction->DeferredMessage, message);
-
     transaction->Type    = TransactionRegisterFISH2D;
     transaction->Sector  = sector;
     transaction->State   = TransactionCreated;
@@ -205,15 +309,23 @@ AhciTransactionStorageCreate(
         transaction->Direction = AHCI_XACTION_OUT;
     }
     
-    // Do not bother to check return code again, things should go ok now
-    dma_get_sg_table(&dmaAttachment, &transaction->DmaTable, -1);
-    dma_sg_table_offset(&transaction->DmaTable, bufferOffset, 
-        &transaction->SgIndex, &transaction->SgOffset);
-    
     // Set upper bound on transaction
     if ((transaction->Sector + sectorCount) >= device->SectorCount) {
         sectorCount = device->SectorCount - transaction->Sector;
     }
+
+    // The segments are joined into one scatter-gather table that the PRDT is built
+    // from, so a single command can span all of them
+    length = sectorCount * device->SectorSize;
+    for (i = 0; i < segmentCount && length > 0; i++) {
+        size_t segmentLength = MIN(length, segments[i].Length);
+        status = AppendSegment(transaction, &segments[i], segmentLength);
+        if (status != OsSuccess) {
+            AhciTransactionDestroy(transaction);
+            return status;
+        }
+        length -= segmentLength;
+    }
     
     // Select the appropriate command
     i = 0;
@@ -234,43 +346,83 @@ AhciTransactionStorageCreate(
     assert(CommandTable[i].Direction != -1);
     assert(transaction->BytesLeft != 0);
     
-    // The transaction is now prepared and ready for the dispatch
-    status = QueueTransaction(device->Controller, device->Port, transaction);
-    if (status != OsSuccess) {
-        AhciTransactionDestroy(transaction);
-    }
-    return status;
+    // The transaction is now prepared, the message loop only routes it to the port
+    gracht_vali_message_defer_response(&transaction->DeferredMessage, message);
+    transaction->Respond = respond;
+    return QueueTransaction(device->Port, transaction);
 }
 
-void ctt_storage_transfer_async_callback(struct gracht_recv_message* message, struct ctt_storage_transfer_async_args* args)
+static OsStatus_t
+TransferBuffer(
+    _In_ struct gracht_recv_message* message,
+    _In_ AhciTransactionResponse_t   respond,
+    _In_ UUId_t                      deviceId,
+    _In_ int                         direction,
+    _In_ unsigned int                sectorLo,
+    _In_ unsigned int                sectorHi,
+    _In_ UUId_t                      bufferHandle,
+    _In_ unsigned int                bufferOffset,
+    _In_ size_t                      sectorCount)
 {
-    AhciDevice_t*   device = AhciManagerGetDevice(args->device_id);
-    OsStatus_t      status;
-    LargeUInteger_t sector;
+    AhciDevice_t*    device = AhciManagerGetDevice(deviceId);
+    StorageSegment_t segment;
+    LargeUInteger_t  sector;
     
-    sector.u.LowPart = args->sector_lo;
-    sector.u.HighPart = args->sector_hi;
+    if (!device) {
+        return OsInvalidParameters;
+    }
+
+    sector.u.LowPart  = sectorLo;
+    sector.u.HighPart = sectorHi;
     
-    status = AhciTransactionStorageCreate(device, message, args->direction, sector.QuadPart,
-        args->buffer_id, args->buffer_offset, args->sector_count);
+    // A single buffer is a transfer of one segment
+    segment.BufferHandle = bufferHandle;
+    segment.Offset       = bufferOffset;
+    segment.Length       = sectorCount * device->SectorSize;
+    return AhciTransactionStorageCreate(device, message, respond, direction, sector.QuadPart,
+        &segment, 1, sectorCount);
+}
+
+void ctt_storage_transfer_async_callback(struct gracht_recv_message* message, struct ctt_storage_transfer_async_args* args)
+{
+    OsStatus_t status = TransferBuffer(message, ctt_storage_transfer_async_response, args->device_id,
+        args->direction, args->sector_lo, args->sector_hi, args->buffer_id, args->buffer_offset,
+        args->sector_count);
     if (status != OsSuccess) {
         ctt_storage_transfer_async_response(message, status, 0);
     }
 }
 
 void ctt_storage_transfer_callback(struct gracht_recv_message* message, struct ctt_storage_transfer_args* args)
+{
+    OsStatus_t status = TransferBuffer(message, ctt_storage_transfer_response, args->device_id,
+        args->direction, args->sector_lo, args->sector_hi, args->buffer_id, args->buffer_offset,
+        args->sector_count);
+    if (status != OsSuccess) {
+        ctt_storage_transfer_response(message, status, 0);
+    }
+}
+
+void ctt_storage_transfer_segments_callback(struct gracht_recv_message* message, struct ctt_storage_transfer_segments_args* args)
 {
     AhciDevice_t*   device = AhciManagerGetDevice(args->device_id);
     OsStatus_t      status;
     LargeUInteger_t sector;
     
+    // The segment table is read straight out of the message, so it must fit in what was sent
+    if (args->segment_count <= 0 || args->segment_count > STORAGE_MAX_SEGMENTS ||
+        ((size_t)args->segment_count * sizeof(StorageSegment_t)) > args->segments_length) {
+        ctt_storage_transfer_segments_response(message, OsInvalidParameters, 0);
+        return;
+    }
+    
     sector.u.LowPart = args->sector_lo;
     sector.u.HighPart = args->sector_hi;
     
-    status = AhciTransactionStorageCreate(device, message, args->direction, sector.QuadPart,
-        args->buffer_id, args->buffer_offset, args->sector_count);
+    status = AhciTransactionStorageCreate(device, message, ctt_storage_transfer_segments_response,
+        args->direction, sector.QuadPart, (const StorageSegment_t*)args->segments, args->segment_count, args->sector_count);
     if (status != OsSuccess) {
-        ctt_storage_transfer_response(message, status, 0);
+        ctt_storage_transfer_segments_response(message, status, 0);
     }
 }
 
@@ -278,7 +430,14 @@ OsStatus_t
 AhciManagerCancelTransaction(
     _In_ AhciTransaction_t* Transaction)
 {
-    return OsNotSupported;
+    AhciPort_t* Port = Transaction->Port;
+
+    if (Transaction->Slot != -1) {
+        Port->Transactions[Transaction->Slot] = NULL;
+        AhciPortFreeCommandSlot(Port, Transaction->Slot);
+        Transaction->Slot = -1;
+    }
+    return AhciTransactionFinish(Port, Transaction, OsCancelled);
 }
 
 static OsStatus_t
@@ -306,6 +465,16 @@ VerifyRegisterFISD2H(
     return OsSuccess;
 }
 
+void
+AhciTransactionComplete(
+    _In_ CompletionEntry_t* Entry,
+    _In_ void*              Context)
+{
+    AhciTransaction_t* Transaction = COMPLETION_ENTRY_OWNER(Entry, AhciTransaction_t, Completion);
+    AhciPort_t*        Port        = (AhciPort_t*)Context;
+    AhciTransactionHandleResponse(Port->Controller, Port, Transaction);
+}
+
 OsStatus_t
 AhciTransactionHandleResponse(
     _In_ AhciController_t*  Controller,
@@ -326,14 +495,7 @@ AhciTransactionHandleResponse(
 
     // Is the transaction finished? (Or did it error?)
     if (status != OsSuccess || Transaction->BytesLeft == 0) {
-        if (Transaction->Internal) {
-            AhciManagerHandleControlResponse(Port, Transaction);
-        }
-        else {
-            ctt_storage_transfer_response(&Transaction->DeferredMessage.recv_message,
-                status, Transaction->SectorsTransferred);
-        }
-        return AhciTransactionDestroy(Transaction);
+        return AhciTransactionFinish(Port, Transaction, status);
     }
-    return QueueTransaction(Controller, Port, Transaction);
+    return QueueTransaction(Port, Transaction);
 }
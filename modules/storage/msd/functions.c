@@ -31,11 +31,13 @@
 
 extern MsdOperations_t BulkOperations;
 extern MsdOperations_t UfiOperations;
+extern MsdOperations_t UasOperations;
 static MsdOperations_t *ProtocolOperations[ProtocolCount] = {
     NULL,
     &UfiOperations,
     &UfiOperations,
-    &BulkOperations
+    &BulkOperations,
+    &UasOperations
 };
 
 const char* SenseKeys[] = {
@@ -137,6 +139,12 @@ MsdScsiCommand(
         return TransferInvalid;
     }
 
+    // UAS commands are tagged and executed as a whole
+    if (Device->Protocol == ProtocolUAS) {
+        return UasScsiCommand(Device, Direction, ScsiCommand, SectorStart, 
+            BufferHandle, BufferOffset, DataLength, NULL);
+    }
+
     // Send the command
     Status = Device->Operations->SendCommand(Device, ScsiCommand, 
         SectorStart, BufferHandle, BufferOffset, DataLength);
@@ -276,6 +284,39 @@ MsdReadCapabilities(
     return OsSuccess;
 }
 
+static void
+MsdReadBlockLimits(
+    _In_ MsdDevice_t*   Device,
+    _In_ ScsiInquiry_t* Inquiry)
+{
+    ScsiBlockLimits_t* BlockLimits = NULL;
+
+    // Vital product data is known to upset older devices, only ask for it
+    // when the device claims SPC-3 or newer
+    Device->MaxTransferSectors = 0;
+    if (Device->Protocol == ProtocolCB || Device->Protocol == ProtocolCBI ||
+        Inquiry->Version < SCSI_INQUIRY_VERSION_SPC3) {
+        return;
+    }
+
+    if (dma_pool_allocate(UsbRetrievePool(), sizeof(ScsiBlockLimits_t), 
+        (void**)&BlockLimits) != OsSuccess) {
+        ERROR("Failed to allocate buffer (block limits)");
+        return;
+    }
+
+    memset(BlockLimits, 0, sizeof(ScsiBlockLimits_t));
+    if (MsdScsiCommand(Device, 0, SCSI_INQUIRY, SCSI_VPD_BLOCK_LIMITS, 
+            dma_pool_handle(UsbRetrievePool()), dma_pool_offset(UsbRetrievePool(), BlockLimits),
+            sizeof(ScsiBlockLimits_t)) == TransferFinished &&
+        BlockLimits->PageCode == SCSI_VPD_BLOCK_LIMITS) {
+        Device->MaxTransferSectors = rev32(BlockLimits->MaxTransferLength);
+        TRACE("Block limits: max transfer %u, optimal transfer %u", 
+            LODWORD(Device->MaxTransferSectors), rev32(BlockLimits->OptimalTransferLength));
+    }
+    dma_pool_free(UsbRetrievePool(), (void*)BlockLimits);
+}
+
 OsStatus_t
 MsdDeviceStart(
     _In_ MsdDevice_t *Device)
@@ -321,6 +362,7 @@ MsdDeviceStart(
         dma_pool_free(UsbRetrievePool(), (void*)InquiryData);
         return OsError;
     }
+    MsdReadBlockLimits(Device, InquiryData);
     dma_pool_free(UsbRetrievePool(), (void*)InquiryData);
     return MsdReadCapabilities(Device);
 }
@@ -345,10 +387,15 @@ SelectScsiTransferCommand(
         *commandOut         = (direction == __STORAGE_OPERATION_READ) ? SCSI_READ_16 : SCSI_WRITE_16;
         *maxSectorsCountOut = UINT32_MAX;
     }
+
+    // The device may impose a lower limit than the command can describe
+    if (device->MaxTransferSectors != 0) {
+        *maxSectorsCountOut = MIN(*maxSectorsCountOut, device->MaxTransferSectors);
+    }
 }
 
-OsStatus_t
-MsdTransferSectors(
+static OsStatus_t
+TransferBuffer(
     _In_  MsdDevice_t* device,
     _In_  int          direction,
     _In_  uint64_t     sector,
@@ -359,6 +406,7 @@ MsdTransferSectors(
 {
     UsbTransferStatus_t Result;
     size_t              SectorsToBeTransferred;
+    size_t              SectorsTransferred = 0;
     uint8_t             Command;
     size_t              MaxSectorsPerCommand;
 
@@ -379,58 +427,176 @@ MsdTransferSectors(
     
     // Detect limits based on type of device and protocol
     SelectScsiTransferCommand(device, direction, &Command, &MaxSectorsPerCommand);
-    SectorsToBeTransferred = MIN(SectorsToBeTransferred, MaxSectorsPerCommand);
+
+    // Large requests are split into multiple commands by the protocols
+    // so the request is completed in one go
+    if (device->Protocol == ProtocolUAS) {
+        return UasTransferSectors(device, direction == __STORAGE_OPERATION_WRITE, Command, 
+            sector, bufferHandle, bufferOffset, SectorsToBeTransferred, 
+            MaxSectorsPerCommand, sectorsTransferred);
+    }
+    else if (device->Protocol == ProtocolBulk) {
+        return BulkTransferSectors(device, direction == __STORAGE_OPERATION_WRITE, Command, 
+            sector, bufferHandle, bufferOffset, SectorsToBeTransferred, 
+            MaxSectorsPerCommand, sectorsTransferred);
+    }
 
     TRACE("[msd_transfer] command %u, max sectors for command %u", Command, MaxSectorsPerCommand);
-    Result = MsdScsiCommand(device, direction == __STORAGE_OPERATION_WRITE, Command, 
-        sector, bufferHandle, bufferOffset, SectorsToBeTransferred * device->Descriptor.SectorSize);
-    if (Result != TransferFinished) {
-        if (sectorsTransferred) {
-            *sectorsTransferred = 0;
+    while (SectorsTransferred < SectorsToBeTransferred) {
+        size_t Count = MIN(SectorsToBeTransferred - SectorsTransferred, MaxSectorsPerCommand);
+        Result = MsdScsiCommand(device, direction == __STORAGE_OPERATION_WRITE, Command, 
+            sector + SectorsTransferred, bufferHandle, 
+            bufferOffset + (SectorsTransferred * device->Descriptor.SectorSize), 
+            Count * device->Descriptor.SectorSize);
+        if (Result != TransferFinished) {
+            break;
         }
-        return OsError;
+        SectorsTransferred += Count;
+    }
+
+    if (sectorsTransferred) {
+        *sectorsTransferred = SectorsTransferred;
     }
-    else if (sectorsTransferred) {
-        *sectorsTransferred = SectorsToBeTransferred;
-        if (device->StatusBlock->DataResidue) {
-            // Data residue is in bytes not transferred as it does not seem
-            // required that we transfer in sectors
-            size_t SectorsLeft = DIVUP(device->StatusBlock->DataResidue, 
-                device->Descriptor.SectorSize);
-            *sectorsTransferred -= SectorsLeft;
+    return SectorsTransferred != 0 ? OsSuccess : OsError;
+}
+
+OsStatus_t
+MsdTransferSectors(
+    _In_  MsdDevice_t*            device,
+    _In_  int                     direction,
+    _In_  uint64_t                sector,
+    _In_  const StorageSegment_t* segments,
+    _In_  int                     segmentCount,
+    _In_  size_t                  sectorCount,
+    _Out_ size_t*                 sectorsTransferred)
+{
+    OsStatus_t status      = OsSuccess;
+    size_t     transferred = 0;
+    size_t     length      = 0;
+    int        i;
+
+    if (!device || !segments || segmentCount <= 0 || segmentCount > STORAGE_MAX_SEGMENTS) {
+        return OsInvalidParameters;
+    }
+
+    // The segments must cover the sectors exactly, in whole sectors
+    for (i = 0; i < segmentCount; i++) {
+        if (!segments[i].Length || (segments[i].Length % device->Descriptor.SectorSize) != 0) {
+            return OsInvalidParameters;
         }
+        length += segments[i].Length;
     }
-    return OsSuccess;
+    if (length != sectorCount * device->Descriptor.SectorSize) {
+        return OsInvalidParameters;
+    }
+
+    // Bulk-only devices can take the whole request as one command when it fits in
+    // a single command, the data stage is then split over the segments
+    if (device->Protocol == ProtocolBulk && segmentCount > 1 &&
+        sector + sectorCount <= device->Descriptor.SectorCount) {
+        uint8_t command;
+        size_t  maxSectorsPerCommand;
+
+        SelectScsiTransferCommand(device, direction, &command, &maxSectorsPerCommand);
+        if (sectorCount <= maxSectorsPerCommand) {
+            status = BulkTransferSegments(device, direction == __STORAGE_OPERATION_WRITE, command,
+                sector, segments, segmentCount, sectorCount, sectorsTransferred);
+            if (status != OsNotSupported) {
+                return status;
+            }
+        }
+    }
+
+    // Otherwise each segment is transferred with its own commands, one after
+    // the other. They still arrive as one request.
+    for (i = 0; i < segmentCount && transferred < sectorCount; i++) {
+        size_t count = segments[i].Length / device->Descriptor.SectorSize;
+        size_t segmentTransferred = 0;
+
+        status = TransferBuffer(device, direction, sector + transferred, segments[i].BufferHandle,
+            segments[i].Offset, count, &segmentTransferred);
+        transferred += segmentTransferred;
+        if (status != OsSuccess || segmentTransferred != count) {
+            break;
+        }
+    }
+
+    if (sectorsTransferred) {
+        *sectorsTransferred = transferred;
+    }
+    return transferred != 0 ? OsSuccess : status;
+}
+
+static OsStatus_t
+TransferSingleBuffer(
+    _In_  UUId_t       deviceId,
+    _In_  int          direction,
+    _In_  unsigned int sectorLo,
+    _In_  unsigned int sectorHi,
+    _In_  UUId_t       bufferHandle,
+    _In_  unsigned int bufferOffset,
+    _In_  size_t       sectorCount,
+    _Out_ size_t*      sectorsTransferred)
+{
+    MsdDevice_t*     device = MsdDeviceGet(deviceId);
+    StorageSegment_t segment;
+    LargeUInteger_t  sector;
+
+    *sectorsTransferred = 0;
+    if (!device) {
+        return OsInvalidParameters;
+    }
+
+    sector.u.LowPart  = sectorLo;
+    sector.u.HighPart = sectorHi;
+
+    // A single buffer is a transfer of one segment
+    segment.BufferHandle = bufferHandle;
+    segment.Offset       = bufferOffset;
+    segment.Length       = sectorCount * device->Descriptor.SectorSize;
+    return MsdTransferSectors(device, direction, sector.QuadPart, &segment, 1,
+        sectorCount, sectorsTransferred);
 }
 
 void ctt_storage_transfer_async_callback(struct gracht_recv_message* message, struct ctt_storage_transfer_async_args* args)
 {
-    MsdDevice_t*    device = MsdDeviceGet(args->device_id);
-    OsStatus_t      status;
-    LargeUInteger_t sector;
-    size_t          sectorsTransferred;
+    OsStatus_t status;
+    size_t     sectorsTransferred;
     
-    sector.u.LowPart = args->sector_lo;
-    sector.u.HighPart = args->sector_hi;
-    
-    status = MsdTransferSectors(device, args->direction, sector.QuadPart,
-        args->buffer_id, args->buffer_offset, args->sector_count,
-        &sectorsTransferred);
+    status = TransferSingleBuffer(args->device_id, args->direction, args->sector_lo, args->sector_hi,
+        args->buffer_id, args->buffer_offset, args->sector_count, &sectorsTransferred);
     ctt_storage_transfer_async_response(message, status, sectorsTransferred);
 }
 
 void ctt_storage_transfer_callback(struct gracht_recv_message* message, struct ctt_storage_transfer_args* args)
 {
-    MsdDevice_t*    device = MsdDeviceGet(args->device_id);
+    OsStatus_t status;
+    size_t     sectorsTransferred;
+    
+    status = TransferSingleBuffer(args->device_id, args->direction, args->sector_lo, args->sector_hi,
+        args->buffer_id, args->buffer_offset, args->sector_count, &sectorsTransferred);
+    ctt_storage_transfer_response(message, status, sectorsTransferred);
+}
+
+void ctt_storage_transfer_segments_callback(struct gracht_recv_message* message, struct ctt_storage_transfer_segments_args* args)
+{
+    MsdDevice_t*    device             = MsdDeviceGet(args->device_id);
+    size_t          sectorsTransferred = 0;
     OsStatus_t      status;
     LargeUInteger_t sector;
-    size_t          sectorsTransferred;
+    
+    // The segment table is read straight out of the message, so it must fit in what was sent
+    if (args->segment_count <= 0 || args->segment_count > STORAGE_MAX_SEGMENTS ||
+        ((size_t)args->segment_count * sizeof(StorageSegment_t)) > args->segments_length) {
+        ctt_storage_transfer_segments_response(message, OsInvalidParameters, 0);
+        return;
+    }
     
     sector.u.LowPart = args->sector_lo;
     sector.u.HighPart = args->sector_hi;
     
     status = MsdTransferSectors(device, args->direction, sector.QuadPart,
-        args->buffer_id, args->buffer_offset, args->sector_count,
+        (const StorageSegment_t*)args->segments, args->segment_count, args->sector_count,
         &sectorsTransferred);
-    ctt_storage_transfer_response(message, status, sectorsTransferred);
+    ctt_storage_transfer_segments_response(message, status, sectorsTransferred);
 }
@@ -37,7 +37,8 @@ static const char *DeviceProtocolStrings[ProtocolCount] = {
     "Unknown",
     "CB",
     "CBI",
-    "Bulk"
+    "Bulk",
+    "UAS"
 };
 
 static void
@@ -66,11 +67,72 @@ UnregisterStorage(
     gracht_vali_message_finish(&msg);
 }
 
+static int
+MsdFindUasSetting(
+    _In_ UsbDevice_t* UsbDevice)
+{
+    int i;
+
+    // UAS is always offered as an alternate setting next to the bulk-only one
+    if (UsbDevice->Interface.Subclass != MSD_SUBCLASS_SCSI) {
+        return -1;
+    }
+
+    for (i = 0; i < UsbDevice->Interface.VersionCount && i < USB_MAX_VERSIONS; i++) {
+        if (UsbDevice->Interface.Versions[i].Protocol == MSD_PROTOCOL_UAS &&
+            UsbDevice->Interface.Versions[i].EndpointIndex != 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static OsStatus_t
+MsdFindUasPipes(
+    _In_ MsdDevice_t* Device,
+    _In_ int          Setting)
+{
+    UsbHcInterfaceVersion_t* Version = &Device->Base.Interface.Versions[Setting];
+    int                      i;
+
+    // The pipes are identified by their pipe usage instead of type and direction
+    for (i = Version->EndpointIndex; i < Version->EndpointIndex + Version->EndpointCount; i++) {
+        UsbHcEndpointDescriptor_t* Endpoint = &Device->Base.Endpoints[i];
+        if (Endpoint->PipeId == USB_PIPE_COMMAND) {
+            Device->CommandPipe = Endpoint;
+        }
+        else if (Endpoint->PipeId == USB_PIPE_STATUS) {
+            Device->StatusPipe = Endpoint;
+        }
+        else if (Endpoint->PipeId == USB_PIPE_DATA_IN) {
+            Device->In = Endpoint;
+        }
+        else if (Endpoint->PipeId == USB_PIPE_DATA_OUT) {
+            Device->Out = Endpoint;
+        }
+    }
+
+    if (Device->CommandPipe == NULL || Device->StatusPipe == NULL || 
+        Device->In == NULL || Device->Out == NULL) {
+        WARNING("UAS setting %i is missing pipes, using bulk-only", Setting);
+        Device->CommandPipe = NULL;
+        Device->StatusPipe  = NULL;
+        Device->In          = NULL;
+        Device->Out         = NULL;
+        return OsError;
+    }
+
+    Device->AlternateSetting = Version->Id;
+    Device->Protocol         = ProtocolUAS;
+    return OsSuccess;
+}
+
 MsdDevice_t*
 MsdDeviceCreate(
     _In_ UsbDevice_t* UsbDevice)
 {
     MsdDevice_t* Device = NULL;
+    int          UasSetting;
     int          i;
 
     // Debug
@@ -94,25 +156,29 @@ MsdDeviceCreate(
     memcpy(&Device->Base, UsbDevice, sizeof(UsbDevice_t));
     
     ELEMENT_INIT(&Device->Header, (uintptr_t)UsbDevice->Base.Id, &Device);
-    Device->Control = &Device->Base.Endpoints[0];
+    Device->Control  = &Device->Base.Endpoints[0];
+    Device->Protocol = ProtocolUnknown;
 
-    // Find neccessary endpoints
-    for (i = 1; i < Device->Base.Interface.Versions[0].EndpointCount + 1; i++) {
-        if (Device->Base.Endpoints[i].Type == EndpointInterrupt) {
-            Device->Interrupt = &Device->Base.Endpoints[i];
-        }
-        else if (Device->Base.Endpoints[i].Type == EndpointBulk) {
-            if (Device->Base.Endpoints[i].Direction == USB_ENDPOINT_IN) {
-                Device->In = &Device->Base.Endpoints[i];
+    // Prefer UAS when the device offers it, otherwise use the endpoints
+    // of the default setting
+    UasSetting = MsdFindUasSetting(UsbDevice);
+    if (UasSetting == -1 || MsdFindUasPipes(Device, UasSetting) != OsSuccess) {
+        for (i = 1; i < Device->Base.Interface.Versions[0].EndpointCount + 1; i++) {
+            if (Device->Base.Endpoints[i].Type == EndpointInterrupt) {
+                Device->Interrupt = &Device->Base.Endpoints[i];
             }
-            else if (Device->Base.Endpoints[i].Direction == USB_ENDPOINT_OUT) {
-                Device->Out = &Device->Base.Endpoints[i];
+            else if (Device->Base.Endpoints[i].Type == EndpointBulk) {
+                if (Device->Base.Endpoints[i].Direction == USB_ENDPOINT_IN) {
+                    Device->In = &Device->Base.Endpoints[i];
+                }
+                else if (Device->Base.Endpoints[i].Direction == USB_ENDPOINT_OUT) {
+                    Device->Out = &Device->Base.Endpoints[i];
+                }
             }
         }
     }
 
     // Set initial shared stuff
-    Device->Protocol = ProtocolUnknown;
     Device->AlignedAccess = 0;
     Device->Descriptor.SectorsPerCylinder = 64;
     Device->Descriptor.SectorSize = 512;
@@ -201,6 +267,9 @@ MsdDeviceDestroy(
     // @todo
 
     // Free reusable buffers
+    if (Device->Protocol == ProtocolUAS) {
+        UasDestroy(Device);
+    }
     if (Device->CommandBlock != NULL) {
         dma_pool_free(UsbRetrievePool(), (void*)Device->CommandBlock);
     }
@@ -29,6 +29,7 @@
 
 #include <ddk/usbdevice.h>
 #include <ddk/storage.h>
+#include <ddk/threadpool.h>
 
 /* MSD Subclass Definitions 
  * Contains generic magic constants and definitions */
@@ -104,6 +105,79 @@ PACKED_TYPESTRUCT(MsdCommandStatus, {
 #define MSD_CSW_FAIL			        0x1
 #define MSD_CSW_PHASE_ERROR		        0x2
 
+/* UAS Information Unit Definitions
+ * Contains the information unit ids used on the command and status pipes */
+#define UAS_IU_COMMAND                  0x01
+#define UAS_IU_SENSE                    0x03
+#define UAS_IU_RESPONSE                 0x04
+#define UAS_IU_TASK_MANAGEMENT          0x05
+#define UAS_IU_READ_READY               0x06
+#define UAS_IU_WRITE_READY              0x07
+
+// Tags are used as stream ids as well, and as stream 0 is reserved the tags
+// start at 1. Requests larger than the split size are spread over the tags.
+#define UAS_MAX_QUEUE_DEPTH             16
+#define UAS_SPLIT_SIZE                  0x10000
+
+// A command that has not reported its status within the timeout is aborted. The
+// data stage may complete shortly after the status, the grace is how long it
+// gets before it is cancelled.
+#define UAS_COMMAND_TIMEOUT             30000
+#define UAS_DATA_GRACE                  100
+
+/* UasTaskManagementIU::Function and UasResponseIU::ResponseCode
+ * Contains the task management functions and responses used */
+#define UAS_TM_ABORT_TASK               0x01
+#define UAS_TM_LOGICAL_UNIT_RESET       0x08
+#define UAS_TM_COMPLETE                 0x00
+#define UAS_TM_SUCCEEDED                0x08
+
+PACKED_TYPESTRUCT(UasCommandIU, {
+    uint8_t  Id;
+    uint8_t  Reserved0;
+    uint16_t Tag;           // Big-endian
+    uint8_t  Attributes;    // Task priority and attribute, bits 0-2 are the attribute
+    uint8_t  Reserved1;
+    uint8_t  Length;        // Additional CDB length in dwords, bits 2-7
+    uint8_t  Reserved2;
+    uint8_t  Lun[8];
+    uint8_t  CommandBytes[16];
+});
+
+PACKED_TYPESTRUCT(UasSenseIU, {
+    uint8_t  Id;
+    uint8_t  Reserved0;
+    uint16_t Tag;           // Big-endian
+    uint16_t StatusQualifier;
+    uint8_t  Status;        // SCSI status, 0 is GOOD
+    uint8_t  Reserved1[7];
+    uint16_t Length;        // Big-endian, length of the sense data
+    uint8_t  Sense[96];
+});
+
+PACKED_TYPESTRUCT(UasTaskManagementIU, {
+    uint8_t  Id;
+    uint8_t  Reserved0;
+    uint16_t Tag;           // Big-endian
+    uint8_t  Function;
+    uint8_t  Reserved1;
+    uint16_t TaskTag;       // Big-endian, the tag of the command to manage
+    uint8_t  Lun[8];
+});
+
+PACKED_TYPESTRUCT(UasResponseIU, {
+    uint8_t  Id;
+    uint8_t  Reserved0;
+    uint16_t Tag;           // Big-endian
+    uint8_t  AdditionalInformation[3];
+    uint8_t  ResponseCode;
+});
+
+typedef struct _UasTag {
+    UasCommandIU_t* CommandIU;
+    UasSenseIU_t*   StatusIU;
+} UasTag_t;
+
 typedef enum _MsdDeviceType {
     TypeFloppy,
 	TypeDiskDrive,
@@ -116,6 +190,7 @@ typedef enum _MsdProtocolType {
     ProtocolCB,
 	ProtocolCBI,
 	ProtocolBulk,
+    ProtocolUAS,
     ProtocolCount
 } MsdProtocolType_t;
 
@@ -136,9 +211,10 @@ typedef struct _MsdDevice {
     MsdProtocolType_t   Protocol;
     MsdOperations_t*    Operations;
 
-	int IsReady;
-	int IsExtended;
-    int AlignedAccess;
+	int    IsReady;
+	int    IsExtended;
+    int    AlignedAccess;
+    size_t MaxTransferSectors; // From the block limits, 0 if there is no limit
 
     // Reusable buffers
     MsdCommandBlock_t*  CommandBlock;
@@ -149,6 +225,22 @@ typedef struct _MsdDevice {
     UsbHcEndpointDescriptor_t* In;
 	UsbHcEndpointDescriptor_t* Out;
 	UsbHcEndpointDescriptor_t* Interrupt;
+
+    // UAS Information, In and Out are used as the data pipes
+    int                        AlternateSetting;
+    UsbHcEndpointDescriptor_t* CommandPipe;
+    UsbHcEndpointDescriptor_t* StatusPipe;
+    ThreadPool_t*              Workers;
+    int                        UseStreams;
+    int                        QueueDepth;
+    _Atomic(unsigned int)      TagsInUse;
+    UasTag_t                   Tags[UAS_MAX_QUEUE_DEPTH];
+    ThreadPool_t*              StageWorkers;    // Streams only, runs the data and status stages side by side
+    
+    // Task management uses the tag after the command tags, one at a time
+    mtx_t                      TaskLock;
+    UasTaskManagementIU_t*     TaskIU;
+    UasResponseIU_t*           TaskResponseIU;
 } MsdDevice_t;
 
 /* MsdDeviceCreate
@@ -178,6 +270,70 @@ __EXTERN OsStatus_t
 MsdDeviceStart(
     _In_ MsdDevice_t *Device);
 
+/* BulkTransferSectors
+ * Transfers the sectors using as many commands as needed. */
+__EXTERN OsStatus_t
+BulkTransferSectors(
+    _In_  MsdDevice_t* Device,
+    _In_  int          Direction,
+    _In_  uint8_t      ScsiCommand,
+    _In_  uint64_t     Sector,
+    _In_  UUId_t       BufferHandle,
+    _In_  size_t       BufferOffset,
+    _In_  size_t       SectorCount,
+    _In_  size_t       MaxSectorsPerCommand,
+    _Out_ size_t*      SectorsTransferred);
+
+/* BulkTransferSegments
+ * Transfers the sectors into the segments with a single command, the data stage
+ * is split over the segments. Returns OsNotSupported if the segments do not end
+ * on packet boundaries, the caller then has to issue a command per segment. */
+__EXTERN OsStatus_t
+BulkTransferSegments(
+    _In_  MsdDevice_t*            Device,
+    _In_  int                     Direction,
+    _In_  uint8_t                 ScsiCommand,
+    _In_  uint64_t                Sector,
+    _In_  const StorageSegment_t* Segments,
+    _In_  int                     SegmentCount,
+    _In_  size_t                  SectorCount,
+    _Out_ size_t*                 SectorsTransferred);
+
+/* UasScsiCommand
+ * Executes a single SCSI command on an UAS device, the command is tagged and
+ * can run next to other outstanding commands. */
+__EXTERN UsbTransferStatus_t
+UasScsiCommand(
+    _In_  MsdDevice_t* Device,
+    _In_  int          Direction,
+    _In_  uint8_t      ScsiCommand,
+    _In_  uint64_t     SectorStart,
+    _In_  UUId_t       BufferHandle,
+    _In_  size_t       BufferOffset,
+    _In_  size_t       DataLength,
+    _Out_ size_t*      BytesTransferred);
+
+/* UasTransferSectors
+ * Splits a sector transfer into multiple commands and queues them on the
+ * available tags. Returns the number of sectors transferred from the start. */
+__EXTERN OsStatus_t
+UasTransferSectors(
+    _In_  MsdDevice_t* Device,
+    _In_  int          Direction,
+    _In_  uint8_t      ScsiCommand,
+    _In_  uint64_t     Sector,
+    _In_  UUId_t       BufferHandle,
+    _In_  size_t       BufferOffset,
+    _In_  size_t       SectorCount,
+    _In_  size_t       MaxSectorsPerCommand,
+    _Out_ size_t*      SectorsTransferred);
+
+/* UasDestroy
+ * Cleans up the tag resources and workers of an UAS device */
+__EXTERN void
+UasDestroy(
+    _In_ MsdDevice_t* Device);
+
 __EXTERN MsdDevice_t*
 MsdDeviceGet(
     _In_ UUId_t deviceId);
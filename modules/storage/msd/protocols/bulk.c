@@ -140,11 +140,19 @@ BulkScsiCommandConstruct(
             CmdBlock->CommandBytes[4] = 18; // Response length
         } break;
 
-        // Inquiry - 6 (IN)
+        // Inquiry - 6 (IN), a non-zero sector selects a vital product data page
         case SCSI_INQUIRY: {
             CmdBlock->Flags = MSD_CBW_IN;
             CmdBlock->Length = 6;
-            CmdBlock->CommandBytes[4] = 36; // Response length
+            if (SectorLBA != 0) {
+                CmdBlock->CommandBytes[1] = 0x1; // EVPD
+                CmdBlock->CommandBytes[2] = (SectorLBA & 0xFF);
+                CmdBlock->CommandBytes[3] = ((DataLen >> 8) & 0xFF);
+                CmdBlock->CommandBytes[4] = (DataLen & 0xFF);
+            }
+            else {
+                CmdBlock->CommandBytes[4] = 36; // Response length
+            }
         } break;
 
         // Read Capacities - 10 (IN)
@@ -421,6 +429,29 @@ MsdSanitizeResponse(
     return TransferFinished;
 }
 
+static UsbTransferStatus_t
+BulkQueueCommand(
+    _In_ MsdDevice_t* Device,
+    _In_ uint8_t      ScsiCommand,
+    _In_ uint64_t     SectorStart,
+    _In_ size_t       DataLength)
+{
+    MsdCommandBlock_t* CommandBlock = Device->CommandBlock;
+    UsbTransfer_t      CommandStage = { 0 };
+    size_t             bytesTransferred;
+
+    // Construct our command build the usb transfer
+    BulkScsiCommandConstruct(CommandBlock, ScsiCommand, SectorStart, 
+        DataLength, (uint16_t)Device->Descriptor.SectorSize);
+    UsbTransferInitialize(&CommandStage, &Device->Base.Device, 
+        Device->Out, BulkTransfer, 0);
+    UsbTransferOut(&CommandStage, dma_pool_handle(UsbRetrievePool()), 
+        dma_pool_offset(UsbRetrievePool(), CommandBlock),
+        sizeof(MsdCommandBlock_t), 0);
+    return UsbTransferQueue(Device->Base.DriverId, Device->Base.DeviceId, 
+        &CommandStage, &bytesTransferred);
+}
+
 UsbTransferStatus_t 
 BulkSendCommand(
     _In_ MsdDevice_t *Device,
@@ -431,23 +462,12 @@ BulkSendCommand(
     _In_ size_t       DataLength)
 {
     UsbTransferStatus_t Result;
-    UsbTransfer_t       CommandStage = { 0 };
-    size_t              bytesTransferred;
 
     // Debug
     TRACE("BulkSendCommand(Command %u, Start %u, Length %u)",
         ScsiCommand, LODWORD(SectorStart), DataLength);
 
-    // Construct our command build the usb transfer
-    BulkScsiCommandConstruct(Device->CommandBlock, ScsiCommand, SectorStart, 
-        DataLength, (uint16_t)Device->Descriptor.SectorSize);
-    UsbTransferInitialize(&CommandStage, &Device->Base.Device, 
-        Device->Out, BulkTransfer, 0);
-    UsbTransferOut(&CommandStage, dma_pool_handle(UsbRetrievePool()), 
-        dma_pool_offset(UsbRetrievePool(), Device->CommandBlock),
-        sizeof(MsdCommandBlock_t), 0);
-    Result = UsbTransferQueue(Device->Base.DriverId, Device->Base.DeviceId, 
-        &CommandStage, &bytesTransferred);
+    Result = BulkQueueCommand(Device, ScsiCommand, SectorStart, DataLength);
 
     // Sanitize for any transport errors
     if (Result != TransferFinished) {
@@ -581,6 +601,130 @@ BulkGetStatus(
     }
 }
 
+// Commands are issued back to back until the request is complete. A failed command
+// ends the transfer without a reset recovery, so the device keeps the sense data of
+// the command for a following REQUEST SENSE.
+OsStatus_t
+BulkTransferSectors(
+    _In_  MsdDevice_t* Device,
+    _In_  int          Direction,
+    _In_  uint8_t      ScsiCommand,
+    _In_  uint64_t     Sector,
+    _In_  UUId_t       BufferHandle,
+    _In_  size_t       BufferOffset,
+    _In_  size_t       SectorCount,
+    _In_  size_t       MaxSectorsPerCommand,
+    _Out_ size_t*      SectorsTransferred)
+{
+    UsbTransferStatus_t Result      = TransferFinished;
+    size_t              SectorSize  = Device->Descriptor.SectorSize;
+    size_t              Transferred = 0;
+
+    TRACE("BulkTransferSectors(Sector %u, Count %u, Max %u)",
+        LODWORD(Sector), LODWORD(SectorCount), LODWORD(MaxSectorsPerCommand));
+
+    while (Transferred < SectorCount) {
+        size_t Count  = MIN(SectorCount - Transferred, MaxSectorsPerCommand);
+        size_t Offset = BufferOffset + (Transferred * SectorSize);
+        size_t BytesTransferred;
+
+        Result = BulkSendCommand(Device, ScsiCommand, Sector + Transferred, 
+            BufferHandle, Offset, Count * SectorSize);
+        if (Result != TransferFinished) {
+            break;
+        }
+
+        // A stall ends the data stage, the status is still read
+        if (Direction == 0) Result = BulkReadData(Device, BufferHandle, Offset, Count * SectorSize, &BytesTransferred);
+        else                Result = BulkWriteData(Device, BufferHandle, Offset, Count * SectorSize, &BytesTransferred);
+        if (Result != TransferFinished && Result != TransferStalled) {
+            ERROR("Fatal error transfering data, skipping status stage");
+            break;
+        }
+
+        Result = BulkGetStatus(Device);
+        if (Result != TransferFinished) {
+            break;
+        }
+
+        // Data residue is in bytes not transferred as it does not seem
+        // required that we transfer in sectors
+        if (Device->StatusBlock->DataResidue) {
+            Transferred += Count - MIN(Count, DIVUP(Device->StatusBlock->DataResidue, SectorSize));
+            break;
+        }
+        Transferred += Count;
+    }
+
+    if (SectorsTransferred) {
+        *SectorsTransferred = Transferred;
+    }
+    return (Transferred != 0 || Result == TransferFinished) ? OsSuccess : OsError;
+}
+
+OsStatus_t
+BulkTransferSegments(
+    _In_  MsdDevice_t*            Device,
+    _In_  int                     Direction,
+    _In_  uint8_t                 ScsiCommand,
+    _In_  uint64_t                Sector,
+    _In_  const StorageSegment_t* Segments,
+    _In_  int                     SegmentCount,
+    _In_  size_t                  SectorCount,
+    _Out_ size_t*                 SectorsTransferred)
+{
+    UsbHcEndpointDescriptor_t* Endpoint   = (Direction == 0) ? Device->In : Device->Out;
+    UsbTransferStatus_t        Result;
+    size_t                     SectorSize = Device->Descriptor.SectorSize;
+    size_t                     Length     = SectorCount * SectorSize;
+    size_t                     BytesTotal = 0;
+    size_t                     Transferred = 0;
+    int                        i;
+
+    TRACE("BulkTransferSegments(Sector %u, Count %u, Segments %i)",
+        LODWORD(Sector), LODWORD(SectorCount), SegmentCount);
+
+    // The data stage can only be split over several transfers if every transfer
+    // but the last ends on a packet boundary, a short packet ends the data stage
+    for (i = 0; i < SegmentCount - 1; i++) {
+        if (!Endpoint->MaxPacketSize || (Segments[i].Length % Endpoint->MaxPacketSize) != 0) {
+            return OsNotSupported;
+        }
+    }
+
+    Result = BulkSendCommand(Device, ScsiCommand, Sector, UUID_INVALID, 0, Length);
+    for (i = 0; i < SegmentCount && Result == TransferFinished; i++) {
+        size_t BytesTransferred = 0;
+
+        if (Direction == 0) Result = BulkReadData(Device, Segments[i].BufferHandle, Segments[i].Offset, Segments[i].Length, &BytesTransferred);
+        else                Result = BulkWriteData(Device, Segments[i].BufferHandle, Segments[i].Offset, Segments[i].Length, &BytesTransferred);
+        BytesTotal += BytesTransferred;
+        if (BytesTransferred != Segments[i].Length) {
+            break;
+        }
+    }
+
+    // A stall ends the data stage, the status is still read
+    if (Result == TransferFinished || Result == TransferStalled) {
+        Result = BulkGetStatus(Device);
+        if (Result == TransferFinished) {
+            // Data residue is in bytes not transferred, only whole sectors are reported
+            if (Device->StatusBlock->DataResidue) {
+                BytesTotal = MIN(BytesTotal, Length - MIN(Length, Device->StatusBlock->DataResidue));
+            }
+            Transferred = BytesTotal / SectorSize;
+        }
+    }
+    else {
+        ERROR("Fatal error transfering data, skipping status stage");
+    }
+
+    if (SectorsTransferred) {
+        *SectorsTransferred = Transferred;
+    }
+    return (Transferred != 0 || Result == TransferFinished) ? OsSuccess : OsError;
+}
+
 MsdOperations_t BulkOperations = {
     BulkInitialize,
     BulkSendCommand,
@@ -0,0 +1,776 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Mass Storage Device Driver (Generic)
+ *  - USB Attached SCSI Protocol Implementation
+ */
+//#define __TRACE
+
+#include <ddk/usb.h>
+#include <ddk/utils.h>
+#include "../msd.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <threads.h>
+
+// Tags and lengths in the information units are big-endian
+#define UAS_SWAP16(Value) ((uint16_t)((((Value) & 0xFF) << 8) | (((Value) >> 8) & 0xFF)))
+
+typedef struct _UasBatch {
+    mtx_t Lock;
+    cnd_t Done;
+    int   Outstanding;
+} UasBatch_t;
+
+typedef struct _UasCommand UasCommand_t;
+
+typedef struct _UasStage {
+    MsdDevice_t*               Device;
+    UasCommand_t*              Command;
+    UsbHcEndpointDescriptor_t* Endpoint;
+    int                        Tag;
+    int                        Direction;
+    UUId_t                     BufferHandle;
+    size_t                     BufferOffset;
+    size_t                     Length;
+    UUId_t                     TransferId;
+    size_t                     BytesTransferred;
+    UsbTransferStatus_t        Status;
+    int                        Done;
+} UasStage_t;
+
+struct _UasCommand {
+    mtx_t      Lock;
+    cnd_t      Signal;
+    UasStage_t Data;
+    UasStage_t Status;
+};
+
+typedef struct _UasRequest {
+    MsdDevice_t*        Device;
+    UasBatch_t*         Batch;
+    int                 Direction;
+    uint8_t             ScsiCommand;
+    uint64_t            Sector;
+    UUId_t              BufferHandle;
+    size_t              BufferOffset;
+    size_t              Length;
+    size_t              BytesTransferred;
+    UsbTransferStatus_t Status;
+} UasRequest_t;
+
+extern void
+BulkScsiCommandConstruct(
+    _InOut_ MsdCommandBlock_t *CmdBlock,
+    _In_ uint8_t ScsiCommand,
+    _In_ uint64_t SectorLBA,
+    _In_ uint32_t DataLen,
+    _In_ uint16_t SectorSize);
+
+static int
+UasAllocateTag(
+    _In_ MsdDevice_t* Device)
+{
+    int i;
+
+    // There are never more workers than tags, so this only spins if the tags
+    // are used from outside the workers as well
+    while (1) {
+        for (i = 0; i < Device->QueueDepth; i++) {
+            unsigned int Bit = 1U << i;
+            if (!(atomic_fetch_or(&Device->TagsInUse, Bit) & Bit)) {
+                return i;
+            }
+        }
+        thrd_yield();
+    }
+}
+
+static void
+UasFreeTag(
+    _In_ MsdDevice_t* Device,
+    _In_ int          Index)
+{
+    atomic_fetch_and(&Device->TagsInUse, ~(1U << Index));
+}
+
+static UsbTransferStatus_t
+UasQueueWithId(
+    _In_  MsdDevice_t*               Device,
+    _In_  UsbHcEndpointDescriptor_t* Endpoint,
+    _In_  int                        Tag,
+    _In_  int                        Direction,
+    _In_  UUId_t                     BufferHandle,
+    _In_  size_t                     BufferOffset,
+    _In_  size_t                     Length,
+    _In_  UUId_t                     TransferId,
+    _Out_ size_t*                    BytesTransferred)
+{
+    UsbTransferStatus_t Result;
+    UsbTransfer_t       Transfer = { 0 };
+
+    UsbTransferInitialize(&Transfer, &Device->Base.Device, Endpoint, BulkTransfer, 0);
+    if (Direction == USB_ENDPOINT_IN) {
+        UsbTransferIn(&Transfer, BufferHandle, BufferOffset, Length, 0);
+    }
+    else {
+        UsbTransferOut(&Transfer, BufferHandle, BufferOffset, Length, 0);
+    }
+
+    // The command pipe never uses streams, the others use the tag as stream
+    if (Device->UseStreams && Endpoint != Device->CommandPipe) {
+        Transfer.StreamId = Tag;
+    }
+
+    Result = UsbTransferQueueWithId(Device->Base.DriverId, Device->Base.DeviceId,
+        &Transfer, TransferId, BytesTransferred);
+    if (Result == TransferStalled) {
+        WARNING("UAS pipe %u stalled, clearing", Endpoint->Address);
+        UsbClearFeature(Device->Base.DriverId, Device->Base.DeviceId,
+            &Device->Base.Device, Device->Control, USBPACKET_DIRECTION_ENDPOINT,
+            (uint16_t)(Endpoint->Address | (Endpoint->Direction == USB_ENDPOINT_IN ? 0x80 : 0)),
+            USB_FEATURE_HALT);
+        UsbEndpointReset(Device->Base.DriverId, Device->Base.DeviceId,
+            &Device->Base.Device, Endpoint);
+    }
+    return Result;
+}
+
+static UsbTransferStatus_t
+UasQueue(
+    _In_  MsdDevice_t*               Device,
+    _In_  UsbHcEndpointDescriptor_t* Endpoint,
+    _In_  int                        Tag,
+    _In_  int                        Direction,
+    _In_  UUId_t                     BufferHandle,
+    _In_  size_t                     BufferOffset,
+    _In_  size_t                     Length,
+    _Out_ size_t*                    BytesTransferred)
+{
+    return UasQueueWithId(Device, Endpoint, Tag, Direction, BufferHandle, BufferOffset,
+        Length, UsbTransferAllocateId(), BytesTransferred);
+}
+
+static UsbTransferStatus_t
+UasCheckStatusTag(
+    _In_ MsdDevice_t* Device,
+    _In_ int          Index)
+{
+    UasSenseIU_t* StatusIU = Device->Tags[Index].StatusIU;
+
+    if (UAS_SWAP16(StatusIU->Tag) != (uint16_t)(Index + 1)) {
+        ERROR("Status for tag %u received on tag %i", UAS_SWAP16(StatusIU->Tag), Index + 1);
+        return TransferInvalid;
+    }
+    return TransferFinished;
+}
+
+static UsbTransferStatus_t
+UasReadStatus(
+    _In_ MsdDevice_t* Device,
+    _In_ int          Index)
+{
+    UasSenseIU_t*       StatusIU = Device->Tags[Index].StatusIU;
+    UsbTransferStatus_t Result;
+    size_t              BytesTransferred;
+
+    memset(StatusIU, 0, sizeof(UasSenseIU_t));
+    Result = UasQueue(Device, Device->StatusPipe, Index + 1, USB_ENDPOINT_IN,
+        dma_pool_handle(UsbRetrievePool()), dma_pool_offset(UsbRetrievePool(), StatusIU),
+        sizeof(UasSenseIU_t), &BytesTransferred);
+    if (Result != TransferFinished) {
+        ERROR("Failed to read the status of tag %i, transfer-code %u", Index + 1, Result);
+        return Result;
+    }
+    return UasCheckStatusTag(Device, Index);
+}
+
+static UsbTransferStatus_t
+UasSanitizeStatus(
+    _In_ MsdDevice_t* Device,
+    _In_ int          Index)
+{
+    UasSenseIU_t* StatusIU = Device->Tags[Index].StatusIU;
+
+    if (StatusIU->Id == UAS_IU_RESPONSE) {
+        UasResponseIU_t* Response = (UasResponseIU_t*)StatusIU;
+        ERROR("Command on tag %i was rejected, response code 0x%x",
+            Index + 1, Response->ResponseCode);
+        return TransferInvalid;
+    }
+    else if (StatusIU->Id != UAS_IU_SENSE) {
+        ERROR("Unexpected information unit 0x%x on tag %i", StatusIU->Id, Index + 1);
+        return TransferInvalid;
+    }
+
+    if (StatusIU->Status != 0) {
+        ScsiSense_t* Sense = (ScsiSense_t*)&StatusIU->Sense[0];
+        ERROR("Command on tag %i failed with status 0x%x (sense key 0x%x)",
+            Index + 1, StatusIU->Status,
+            UAS_SWAP16(StatusIU->Length) ? SCSI_SENSE_KEY(Sense->Flags) : 0);
+        return TransferInvalid;
+    }
+    return TransferFinished;
+}
+
+static UsbTransferStatus_t
+UasTaskManagement(
+    _In_ MsdDevice_t* Device,
+    _In_ uint8_t      Function,
+    _In_ int          TaskTag)
+{
+    UasTaskManagementIU_t* TaskIU   = Device->TaskIU;
+    UasResponseIU_t*       Response = Device->TaskResponseIU;
+    UsbTransferStatus_t    Result;
+    size_t                 BytesTransferred;
+    int                    Tag      = Device->QueueDepth + 1;
+
+    TRACE("UasTaskManagement(Function 0x%x, Tag %i)", Function, TaskTag);
+
+    mtx_lock(&Device->TaskLock);
+    memset(TaskIU, 0, sizeof(UasTaskManagementIU_t));
+    TaskIU->Id       = UAS_IU_TASK_MANAGEMENT;
+    TaskIU->Tag      = UAS_SWAP16(Tag);
+    TaskIU->Function = Function;
+    TaskIU->TaskTag  = UAS_SWAP16(TaskTag);
+    Result = UasQueue(Device, Device->CommandPipe, Tag, USB_ENDPOINT_OUT,
+        dma_pool_handle(UsbRetrievePool()), dma_pool_offset(UsbRetrievePool(), TaskIU),
+        sizeof(UasTaskManagementIU_t), &BytesTransferred);
+    if (Result == TransferFinished) {
+        memset(Response, 0, sizeof(UasResponseIU_t));
+        Result = UasQueue(Device, Device->StatusPipe, Tag, USB_ENDPOINT_IN,
+            dma_pool_handle(UsbRetrievePool()), dma_pool_offset(UsbRetrievePool(), Response),
+            sizeof(UasResponseIU_t), &BytesTransferred);
+    }
+
+    if (Result == TransferFinished && (Response->Id != UAS_IU_RESPONSE ||
+            UAS_SWAP16(Response->Tag) != (uint16_t)Tag ||
+            (Response->ResponseCode != UAS_TM_COMPLETE && Response->ResponseCode != UAS_TM_SUCCEEDED))) {
+        ERROR("Task management function 0x%x was rejected, response code 0x%x",
+            Function, Response->ResponseCode);
+        Result = TransferInvalid;
+    }
+    mtx_unlock(&Device->TaskLock);
+    return Result;
+}
+
+static void
+UasAbortCommand(
+    _In_ MsdDevice_t* Device,
+    _In_ int          Index)
+{
+    // Try to abort just the command, and reset the unit if the device won't
+    WARNING("Aborting the command on tag %i", Index + 1);
+    if (UasTaskManagement(Device, UAS_TM_ABORT_TASK, Index + 1) == TransferFinished) {
+        return;
+    }
+    if (UasTaskManagement(Device, UAS_TM_LOGICAL_UNIT_RESET, 0) != TransferFinished) {
+        ERROR("Failed to reset the logical unit, the device may be unusable");
+    }
+}
+
+static void
+UasDeadline(
+    _Out_ struct timespec* Deadline,
+    _In_  size_t           Milliseconds)
+{
+    timespec_get(Deadline, TIME_UTC);
+    Deadline->tv_sec  += Milliseconds / MSEC_PER_SEC;
+    Deadline->tv_nsec += (Milliseconds % MSEC_PER_SEC) * (NSEC_PER_SEC / MSEC_PER_SEC);
+    if (Deadline->tv_nsec >= NSEC_PER_SEC) {
+        Deadline->tv_nsec -= NSEC_PER_SEC;
+        Deadline->tv_sec++;
+    }
+}
+
+static int
+UasStageWorker(
+    _In_ void* Context)
+{
+    UasStage_t*         Stage   = (UasStage_t*)Context;
+    UasCommand_t*       Command = Stage->Command;
+    UsbTransferStatus_t Result;
+    size_t              BytesTransferred = 0;
+
+    Result = UasQueueWithId(Stage->Device, Stage->Endpoint, Stage->Tag, Stage->Direction,
+        Stage->BufferHandle, Stage->BufferOffset, Stage->Length, Stage->TransferId,
+        &BytesTransferred);
+
+    mtx_lock(&Command->Lock);
+    Stage->Status           = Result;
+    Stage->BytesTransferred = BytesTransferred;
+    Stage->Done             = 1;
+    cnd_signal(&Command->Signal);
+    mtx_unlock(&Command->Lock);
+    return 0;
+}
+
+static OsStatus_t
+UasStartStage(
+    _In_ UasStage_t*                Stage,
+    _In_ UasCommand_t*              Command,
+    _In_ MsdDevice_t*               Device,
+    _In_ UsbHcEndpointDescriptor_t* Endpoint,
+    _In_ int                        Tag,
+    _In_ int                        Direction,
+    _In_ UUId_t                     BufferHandle,
+    _In_ size_t                     BufferOffset,
+    _In_ size_t                     Length)
+{
+    Stage->Device           = Device;
+    Stage->Command          = Command;
+    Stage->Endpoint         = Endpoint;
+    Stage->Tag              = Tag;
+    Stage->Direction        = Direction;
+    Stage->BufferHandle     = BufferHandle;
+    Stage->BufferOffset     = BufferOffset;
+    Stage->Length           = Length;
+    Stage->TransferId       = UsbTransferAllocateId();
+    Stage->BytesTransferred = 0;
+    Stage->Status           = TransferNotProcessed;
+    Stage->Done             = 0;
+
+    if (ThreadPoolAddWork(Device->StageWorkers, UasStageWorker, Stage) != OsSuccess) {
+        Stage->Done = 1;
+        return OsOutOfMemory;
+    }
+    return OsSuccess;
+}
+
+static void
+UasCancelStage(
+    _In_ UasCommand_t* Command,
+    _In_ UasStage_t*   Stage)
+{
+    struct timespec Deadline;
+
+    // The transfer might not have reached the controller yet when it is cancelled,
+    // so keep cancelling until the stage has ended
+    mtx_lock(&Command->Lock);
+    while (!Stage->Done) {
+        mtx_unlock(&Command->Lock);
+        (void)UsbTransferCancel(Stage->Device->Base.DriverId, Stage->Device->Base.DeviceId,
+            Stage->TransferId);
+        mtx_lock(&Command->Lock);
+        if (!Stage->Done) {
+            UasDeadline(&Deadline, UAS_DATA_GRACE);
+            (void)cnd_timedwait(&Command->Signal, &Command->Lock, &Deadline);
+        }
+    }
+    mtx_unlock(&Command->Lock);
+}
+
+static UsbTransferStatus_t
+UasExecuteStages(
+    _In_  MsdDevice_t* Device,
+    _In_  int          Index,
+    _In_  int          Direction,
+    _In_  UUId_t       BufferHandle,
+    _In_  size_t       BufferOffset,
+    _In_  size_t       DataLength,
+    _Out_ size_t*      BytesTransferred)
+{
+    UasSenseIU_t*       StatusIU = Device->Tags[Index].StatusIU;
+    UasCommand_t        Command;
+    UsbTransferStatus_t Result;
+    struct timespec     Deadline;
+    int                 TimedOut = 0;
+
+    mtx_init(&Command.Lock, mtx_plain);
+    cnd_init(&Command.Signal);
+
+    // With streams there are no ready units, the status is read alongside the data
+    // stage as a device that fails the command reports it without any data stage
+    memset(StatusIU, 0, sizeof(UasSenseIU_t));
+    if (UasStartStage(&Command.Status, &Command, Device, Device->StatusPipe, Index + 1,
+            USB_ENDPOINT_IN, dma_pool_handle(UsbRetrievePool()),
+            dma_pool_offset(UsbRetrievePool(), StatusIU), sizeof(UasSenseIU_t)) != OsSuccess) {
+        ERROR("Failed to start the status stage of tag %i", Index + 1);
+        TimedOut = 1;
+    }
+    if (UasStartStage(&Command.Data, &Command, Device, Direction == 0 ? Device->In : Device->Out,
+            Index + 1, Direction == 0 ? USB_ENDPOINT_IN : USB_ENDPOINT_OUT,
+            BufferHandle, BufferOffset, DataLength) != OsSuccess) {
+        ERROR("Failed to start the data stage of tag %i", Index + 1);
+        TimedOut = 1;
+    }
+
+    // Wait for the status, or for the data stage to fail in a way that leaves
+    // the status pending
+    UasDeadline(&Deadline, UAS_COMMAND_TIMEOUT);
+    mtx_lock(&Command.Lock);
+    while (!TimedOut && !Command.Status.Done && !(Command.Data.Done &&
+            Command.Data.Status != TransferFinished && Command.Data.Status != TransferStalled)) {
+        TimedOut = cnd_timedwait(&Command.Signal, &Command.Lock, &Deadline) == thrd_timedout;
+    }
+
+    // The data stage may still be completing when the status arrives
+    if (!TimedOut && Command.Status.Done) {
+        UasDeadline(&Deadline, UAS_DATA_GRACE);
+        while (!Command.Data.Done) {
+            if (cnd_timedwait(&Command.Signal, &Command.Lock, &Deadline) == thrd_timedout) {
+                break;
+            }
+        }
+    }
+    mtx_unlock(&Command.Lock);
+
+    // Whatever is still pending now will not complete by itself
+    UasCancelStage(&Command, &Command.Data);
+    UasCancelStage(&Command, &Command.Status);
+
+    if (Command.Status.Status == TransferFinished) {
+        Result = UasCheckStatusTag(Device, Index);
+        if (Result == TransferFinished) {
+            Result = UasSanitizeStatus(Device, Index);
+        }
+    }
+    else {
+        ERROR("No status for tag %i, transfer-code %u", Index + 1, Command.Status.Status);
+        UasAbortCommand(Device, Index);
+        if (TimedOut) {
+            Result = TransferNotResponding;
+        }
+        else if (Command.Status.Status == TransferCancelled) {
+            Result = Command.Data.Status; // The status was cancelled as the data stage failed
+        }
+        else {
+            Result = Command.Status.Status;
+        }
+    }
+
+    *BytesTransferred = Command.Data.BytesTransferred;
+    mtx_destroy(&Command.Lock);
+    cnd_destroy(&Command.Signal);
+    return Result;
+}
+
+UsbTransferStatus_t
+UasScsiCommand(
+    _In_  MsdDevice_t* Device,
+    _In_  int          Direction,
+    _In_  uint8_t      ScsiCommand,
+    _In_  uint64_t     SectorStart,
+    _In_  UUId_t       BufferHandle,
+    _In_  size_t       BufferOffset,
+    _In_  size_t       DataLength,
+    _Out_ size_t*      BytesTransferred)
+{
+    MsdCommandBlock_t   CommandBlock;
+    UasCommandIU_t*     CommandIU;
+    UsbTransferStatus_t Result;
+    size_t              bytesTransferred = 0;
+    int                 Index;
+
+    TRACE("UasScsiCommand(Direction %i, Command 0x%x, Start %u, Length %u)",
+        Direction, ScsiCommand, LODWORD(SectorStart), DataLength);
+
+    Index     = UasAllocateTag(Device);
+    CommandIU = Device->Tags[Index].CommandIU;
+
+    // Reuse the bulk command construction for the CDB
+    BulkScsiCommandConstruct(&CommandBlock, ScsiCommand, SectorStart,
+        (uint32_t)DataLength, (uint16_t)Device->Descriptor.SectorSize);
+    memset(CommandIU, 0, sizeof(UasCommandIU_t));
+    CommandIU->Id  = UAS_IU_COMMAND;
+    CommandIU->Tag = UAS_SWAP16(Index + 1);
+    memcpy(&CommandIU->CommandBytes[0], &CommandBlock.CommandBytes[0], 16);
+
+    Result = UasQueue(Device, Device->CommandPipe, Index + 1, USB_ENDPOINT_OUT,
+        dma_pool_handle(UsbRetrievePool()), dma_pool_offset(UsbRetrievePool(), CommandIU),
+        sizeof(UasCommandIU_t), &bytesTransferred);
+    if (Result != TransferFinished) {
+        ERROR("Failed to send the command IU, transfer-code %u", Result);
+        goto Exit;
+    }
+
+    if (DataLength != 0 && Device->UseStreams) {
+        Result = UasExecuteStages(Device, Index, Direction, BufferHandle, BufferOffset,
+            DataLength, &bytesTransferred);
+        goto Exit;
+    }
+
+    // Without streams the device announces the data stage on the status pipe. It
+    // may also skip the data stage and report the status right away.
+    if (DataLength != 0) {
+        Result = UasReadStatus(Device, Index);
+        if (Result != TransferFinished) {
+            UasAbortCommand(Device, Index);
+            goto Exit;
+        }
+
+        if (Device->Tags[Index].StatusIU->Id != UAS_IU_READ_READY &&
+            Device->Tags[Index].StatusIU->Id != UAS_IU_WRITE_READY) {
+            Result = UasSanitizeStatus(Device, Index);
+            goto Exit;
+        }
+    }
+
+    // Data stage, a stall ends the data stage but the status is still read
+    bytesTransferred = 0;
+    if (DataLength != 0) {
+        Result = UasQueue(Device, Direction == 0 ? Device->In : Device->Out, Index + 1,
+            Direction == 0 ? USB_ENDPOINT_IN : USB_ENDPOINT_OUT,
+            BufferHandle, BufferOffset, DataLength, &bytesTransferred);
+        if (Result != TransferFinished && Result != TransferStalled) {
+            ERROR("Fatal error transfering data, skipping status stage");
+            UasAbortCommand(Device, Index);
+            goto Exit;
+        }
+    }
+
+    Result = UasReadStatus(Device, Index);
+    if (Result == TransferFinished) {
+        Result = UasSanitizeStatus(Device, Index);
+    }
+    else {
+        UasAbortCommand(Device, Index);
+    }
+
+Exit:
+    UasFreeTag(Device, Index);
+    if (BytesTransferred != NULL) {
+        *BytesTransferred = bytesTransferred;
+    }
+    return Result;
+}
+
+static int
+UasWorker(
+    _In_ void* Context)
+{
+    UasRequest_t* Request = (UasRequest_t*)Context;
+    UasBatch_t*   Batch   = Request->Batch;
+
+    Request->Status = UasScsiCommand(Request->Device, Request->Direction, Request->ScsiCommand,
+        Request->Sector, Request->BufferHandle, Request->BufferOffset, Request->Length,
+        &Request->BytesTransferred);
+
+    mtx_lock(&Batch->Lock);
+    Batch->Outstanding--;
+    if (!Batch->Outstanding) {
+        cnd_signal(&Batch->Done);
+    }
+    mtx_unlock(&Batch->Lock);
+    return 0;
+}
+
+OsStatus_t
+UasTransferSectors(
+    _In_  MsdDevice_t* Device,
+    _In_  int          Direction,
+    _In_  uint8_t      ScsiCommand,
+    _In_  uint64_t     Sector,
+    _In_  UUId_t       BufferHandle,
+    _In_  size_t       BufferOffset,
+    _In_  size_t       SectorCount,
+    _In_  size_t       MaxSectorsPerCommand,
+    _Out_ size_t*      SectorsTransferred)
+{
+    UasRequest_t* Requests;
+    UasBatch_t    Batch;
+    size_t        SectorsPerCommand;
+    size_t        SectorSize = Device->Descriptor.SectorSize;
+    size_t        Transferred = 0;
+    int           RequestCount;
+    int           i;
+
+    // Spread the request over the tags, but don't split it into commands that
+    // are too small to be worth the overhead
+    SectorsPerCommand = DIVUP(SectorCount, Device->QueueDepth);
+    SectorsPerCommand = MAX(SectorsPerCommand, UAS_SPLIT_SIZE / SectorSize);
+    SectorsPerCommand = MIN(SectorsPerCommand, MaxSectorsPerCommand);
+    RequestCount      = (int)DIVUP(SectorCount, SectorsPerCommand);
+
+    TRACE("[uas_transfer] sectors %u, commands %i of %u sectors",
+        LODWORD(SectorCount), RequestCount, LODWORD(SectorsPerCommand));
+
+    Requests = (UasRequest_t*)malloc(sizeof(UasRequest_t) * RequestCount);
+    if (!Requests) {
+        return OsOutOfMemory;
+    }
+
+    Batch.Outstanding = RequestCount;
+    mtx_init(&Batch.Lock, mtx_plain);
+    cnd_init(&Batch.Done);
+
+    for (i = 0; i < RequestCount; i++) {
+        size_t Count = MIN(SectorCount - (i * SectorsPerCommand), SectorsPerCommand);
+
+        Requests[i].Device           = Device;
+        Requests[i].Batch            = &Batch;
+        Requests[i].Direction        = Direction;
+        Requests[i].ScsiCommand      = ScsiCommand;
+        Requests[i].Sector           = Sector + (i * SectorsPerCommand);
+        Requests[i].BufferHandle     = BufferHandle;
+        Requests[i].BufferOffset     = BufferOffset + (i * SectorsPerCommand * SectorSize);
+        Requests[i].Length           = Count * SectorSize;
+        Requests[i].BytesTransferred = 0;
+        Requests[i].Status           = TransferNotProcessed;
+
+        // Run the commands inline when there is nothing to overlap with
+        if (Device->Workers == NULL || RequestCount == 1 ||
+            ThreadPoolAddWork(Device->Workers, UasWorker, &Requests[i]) != OsSuccess) {
+            UasWorker(&Requests[i]);
+        }
+    }
+
+    mtx_lock(&Batch.Lock);
+    while (Batch.Outstanding) {
+        cnd_wait(&Batch.Done, &Batch.Lock);
+    }
+    mtx_unlock(&Batch.Lock);
+
+    // Only the sectors up to the first failed or short command are reported
+    for (i = 0; i < RequestCount; i++) {
+        Transferred += Requests[i].BytesTransferred / SectorSize;
+        if (Requests[i].Status != TransferFinished ||
+            Requests[i].BytesTransferred != Requests[i].Length) {
+            break;
+        }
+    }
+
+    mtx_destroy(&Batch.Lock);
+    cnd_destroy(&Batch.Done);
+    free(Requests);
+
+    if (SectorsTransferred) {
+        *SectorsTransferred = Transferred;
+    }
+    return Transferred != 0 ? OsSuccess : OsError;
+}
+
+OsStatus_t
+UasInitialize(
+    _In_ MsdDevice_t* Device)
+{
+    UsbTransferStatus_t Status;
+    size_t              Streams;
+    int                 i;
+
+    TRACE("UasInitialize(Setting %i)", Device->AlternateSetting);
+
+    // Switch the interface to the UAS setting, the controller configures the
+    // endpoints of the setting on their first use
+    Status = UsbExecutePacket(Device->Base.DriverId, Device->Base.DeviceId,
+        &Device->Base.Device, Device->Control, USBPACKET_DIRECTION_INTERFACE,
+        USBPACKET_TYPE_SET_INTERFACE, 0, (uint8_t)Device->AlternateSetting,
+        (uint16_t)Device->Base.Interface.Id, 0, NULL);
+    if (Status != TransferFinished) {
+        ERROR("Failed to select the UAS interface setting, transfer-code %u", Status);
+        return OsError;
+    }
+
+    // Streams are required for more than one outstanding command, the tags
+    // double as stream ids
+    Streams = MIN(Device->In->MaxStreams, MIN(Device->Out->MaxStreams, Device->StatusPipe->MaxStreams));
+    Device->UseStreams = Device->Base.Device.Speed == SuperSpeed && Streams > 1;
+    Device->QueueDepth = Device->UseStreams ? (int)MIN(Streams - 1, UAS_MAX_QUEUE_DEPTH) : 1;
+    TRACE("UAS queue depth %i (streams %u)", Device->QueueDepth, LODWORD(Streams));
+
+    mtx_init(&Device->TaskLock, mtx_plain);
+    if (dma_pool_allocate(UsbRetrievePool(), sizeof(UasTaskManagementIU_t),
+            (void**)&Device->TaskIU) != OsSuccess ||
+        dma_pool_allocate(UsbRetrievePool(), sizeof(UasResponseIU_t),
+            (void**)&Device->TaskResponseIU) != OsSuccess) {
+        ERROR("Failed to allocate buffers for task management");
+        return OsOutOfMemory;
+    }
+
+    for (i = 0; i < Device->QueueDepth; i++) {
+        if (dma_pool_allocate(UsbRetrievePool(), sizeof(UasCommandIU_t),
+                (void**)&Device->Tags[i].CommandIU) != OsSuccess ||
+            dma_pool_allocate(UsbRetrievePool(), sizeof(UasSenseIU_t),
+                (void**)&Device->Tags[i].StatusIU) != OsSuccess) {
+            ERROR("Failed to allocate buffers for tag %i", i + 1);
+            return OsOutOfMemory;
+        }
+    }
+
+    if (Device->QueueDepth > 1 &&
+        ThreadPoolInitialize(Device->QueueDepth, &Device->Workers) != OsSuccess) {
+        WARNING("Failed to create UAS workers, commands will not be queued");
+        Device->Workers = NULL;
+    }
+
+    // Every command in flight has its data and status stage pending at once
+    if (Device->UseStreams &&
+        ThreadPoolInitialize(Device->QueueDepth * 2, &Device->StageWorkers) != OsSuccess) {
+        ERROR("Failed to create the UAS stage workers");
+        Device->StageWorkers = NULL;
+        return OsOutOfMemory;
+    }
+
+    // Reset the pipes of the new setting
+    if (UsbEndpointReset(Device->Base.DriverId, Device->Base.DeviceId,
+            &Device->Base.Device, Device->CommandPipe) != OsSuccess ||
+        UsbEndpointReset(Device->Base.DriverId, Device->Base.DeviceId,
+            &Device->Base.Device, Device->StatusPipe) != OsSuccess ||
+        UsbEndpointReset(Device->Base.DriverId, Device->Base.DeviceId,
+            &Device->Base.Device, Device->In) != OsSuccess ||
+        UsbEndpointReset(Device->Base.DriverId, Device->Base.DeviceId,
+            &Device->Base.Device, Device->Out) != OsSuccess) {
+        ERROR("Failed to reset the UAS pipes");
+        return OsError;
+    }
+    return OsSuccess;
+}
+
+void
+UasDestroy(
+    _In_ MsdDevice_t* Device)
+{
+    int i;
+
+    if (Device->Workers != NULL) {
+        ThreadPoolDestroy(Device->Workers);
+        Device->Workers = NULL;
+    }
+    if (Device->StageWorkers != NULL) {
+        ThreadPoolDestroy(Device->StageWorkers);
+        Device->StageWorkers = NULL;
+    }
+
+    if (Device->TaskIU != NULL) {
+        dma_pool_free(UsbRetrievePool(), (void*)Device->TaskIU);
+        mtx_destroy(&Device->TaskLock);
+    }
+    if (Device->TaskResponseIU != NULL) {
+        dma_pool_free(UsbRetrievePool(), (void*)Device->TaskResponseIU);
+    }
+
+    for (i = 0; i < UAS_MAX_QUEUE_DEPTH; i++) {
+        if (Device->Tags[i].CommandIU != NULL) {
+            dma_pool_free(UsbRetrievePool(), (void*)Device->Tags[i].CommandIU);
+        }
+        if (Device->Tags[i].StatusIU != NULL) {
+            dma_pool_free(UsbRetrievePool(), (void*)Device->Tags[i].StatusIU);
+        }
+    }
+}
+
+// Commands are executed as a whole by UasScsiCommand, the staged
+// operations are not used for UAS
+MsdOperations_t UasOperations = {
+    UasInitialize,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
@@ -123,6 +123,30 @@ PACKED_TYPESTRUCT(ScsiInquiry, {
  * Contains definitions and bitfield definitions for ScsiInquiry::Removable */
 #define SCSI_INQUIRY_REMOVABLE                      0x80
 
+/* ScsiInquiry::Version
+ * Contains definitions and bitfield definitions for ScsiInquiry::Version */
+#define SCSI_INQUIRY_VERSION_SPC3                   0x05
+
+/* ScsiBlockLimits
+ * The block limits vital product data page, returned by the INQUIRY command when
+ * the page is requested. All fields are big-endian and lengths are in blocks. */
+PACKED_TYPESTRUCT(ScsiBlockLimits, {
+    uint8_t             PeripheralInfo;
+    uint8_t             PageCode;
+    uint16_t            PageLength;
+    uint8_t             Flags;
+    uint8_t             MaxCompareWriteLength;
+    uint16_t            OptimalTransferGranularity;
+    uint32_t            MaxTransferLength; // 0 if there is no limit
+    uint32_t            OptimalTransferLength;
+    uint32_t            MaxPrefetchLength;
+    uint8_t             Reserved[44];
+});
+
+/* ScsiBlockLimits::PageCode
+ * Contains definitions and bitfield definitions for ScsiBlockLimits::PageCode */
+#define SCSI_VPD_BLOCK_LIMITS                       0xB0
+
 /* ScsiSense
  * Request device sense response structure. Contains information about
  * device status and state. This is returned upon the SENSE command. */
@@ -458,7 +458,7 @@ class CGenerator:
         if not param.is_value():
             if param.is_string():
                 param_typename = "char"
-            elif param.is_buffer():
+            elif param.is_buffer() or param.is_shm():
                 param_typename = param.get_subtype()
         
         # format parameter, unfortunately there are 5 cases to do this
@@ -632,6 +632,8 @@ class CGenerator:
         outfile.write("GRACHT_STRUCT(" + struct_name + ", {\n")
         for param in params:
             outfile.write("    " + self.get_param_typename(protocol, param, case) + ";\n")
+            if (param.is_buffer() or param.is_shm()) and param.has_length_component():
+                outfile.write("    " + self.get_param_typename(protocol, Parameter(param.get_name() + "_length", "size_t"), case) + ";\n")
         outfile.write("});\n")
         return
 
@@ -722,9 +724,32 @@ class CGenerator:
                 function_prototype = function_prototype + ", "
         return function_prototype + parameter_string + ")"
 
+    def has_async_variant(self, func):
+        return func.is_synchronous() and len(func.get_response_params()) > 0
+
+    def get_async_function_prototype(self, protocol, func, case):
+        function_prototype = "int " + protocol.get_namespace().lower() + "_" + protocol.get_name().lower() + "_" + func.get_name() + "_async"
+        function_client_param = self.get_param_typename(protocol, Parameter("client", "gracht_client_t*"), case)
+        function_context_param = self.get_param_typename(protocol, Parameter("context", "struct gracht_message_context*"), case)
+        function_prototype = function_prototype + "(" + function_client_param + ", " + function_context_param
+        parameter_string = self.get_parameter_string(protocol, func.get_request_params(), case)
+        if parameter_string != "":
+            function_prototype = function_prototype + ", "
+        return function_prototype + parameter_string + ")"
+
+    def get_result_function_prototype(self, protocol, func, case):
+        function_prototype = "int " + protocol.get_namespace().lower() + "_" + protocol.get_name().lower() + "_" + func.get_name() + "_result"
+        function_client_param = self.get_param_typename(protocol, Parameter("client", "gracht_client_t*"), case)
+        function_context_param = self.get_param_typename(protocol, Parameter("context", "struct gracht_message_context*"), case)
+        function_prototype = function_prototype + "(" + function_client_param + ", " + function_context_param + ", "
+        return function_prototype + self.get_parameter_string(protocol, func.get_response_params(), case) + ")"
+
     def define_prototypes(self, protocol, outfile):
         for func in protocol.get_functions():
             outfile.write("    " + self.get_function_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_CALL) + ";\n")
+            if self.has_async_variant(func):
+                outfile.write("    " + self.get_async_function_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_CALL) + ";\n")
+                outfile.write("    " + self.get_result_function_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_CALL) + ";\n")
         outfile.write("\n")
         return
 
@@ -746,7 +771,7 @@ class CGenerator:
             message_size = message_size + " + (" + str(len(params)) + " * sizeof(struct gracht_param))"
         return message_size
     
-    def define_message_struct(self, protocol, action_id, params_in, params_out, flags, is_response, outfile):
+    def define_message_struct(self, protocol, action_id, params_in, params_out, flags, is_response, outfile, output_buffers = True):
         params_all = params_in + params_out
 
         # define variables
@@ -789,7 +814,7 @@ class CGenerator:
             for index, param in enumerate(params_out):
                 size_function = self.get_size_function(protocol, param, is_response)
                 buffer_variable = param.get_name() + "_out"
-                if "MESSAGE_FLAG_ASYNC" in flags:
+                if "MESSAGE_FLAG_ASYNC" in flags or not output_buffers:
                     buffer_variable = "NULL"
 
                 if param.is_value():
@@ -813,6 +838,31 @@ class CGenerator:
         outfile.write("    return gracht_client_invoke(client, (struct gracht_message*)&__message, context);\n")
         return
 
+    def define_async_function_body(self, protocol, func, outfile):
+        flags = self.get_message_flags_func(func)
+        self.define_message_struct(protocol, func.get_id(), func.get_request_params(), func.get_response_params(), flags, False, outfile, False)
+        outfile.write("    return gracht_client_invoke_async(client, context, (struct gracht_message*)&__message);\n")
+        return
+
+    def define_result_function_body(self, protocol, func, outfile):
+        params_out = func.get_response_params()
+        outfile.write("    struct gracht_param __params[" + str(len(params_out)) + "] = {\n")
+        for index, param in enumerate(params_out):
+            size_function = self.get_size_function(protocol, param, False)
+            param_type = "GRACHT_PARAM_VALUE"
+            if param.is_buffer() or param.is_string():
+                param_type = "GRACHT_PARAM_BUFFER"
+            elif param.is_shm():
+                param_type = "GRACHT_PARAM_SHM"
+            outfile.write("        { .type = " + param_type + ", .data.buffer = " + param.get_name() + "_out, .length = " + size_function + " }")
+            if index + 1 < len(params_out):
+                outfile.write(",\n")
+            else:
+                outfile.write("\n")
+        outfile.write("    };\n\n")
+        outfile.write("    return gracht_client_status(client, context, &__params[0]);\n")
+        return
+
     def define_event_body_single(self, protocol, evt, outfile):
         self.define_message_struct(protocol, evt.get_id(), evt.get_params(), [], "0", False, outfile)
         outfile.write("    return gracht_server_send_event(client, (struct gracht_message*)&__message, 0);\n")
@@ -834,6 +884,17 @@ class CGenerator:
             outfile.write("{\n")
             self.define_function_body(protocol, func, outfile)
             outfile.write("}\n\n")
+            
+            if self.has_async_variant(func):
+                outfile.write(self.get_async_function_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_CALL) + "\n")
+                outfile.write("{\n")
+                self.define_async_function_body(protocol, func, outfile)
+                outfile.write("}\n\n")
+                
+                outfile.write(self.get_result_function_prototype(protocol, func, CONST.TYPENAME_CASE_FUNCTION_CALL) + "\n")
+                outfile.write("{\n")
+                self.define_result_function_body(protocol, func, outfile)
+                outfile.write("}\n\n")
         return
 
     def define_server_responses(self, protocol, outfile):
@@ -890,15 +951,90 @@ class CGenerator:
             outfile.write("\n")
         return
     
+    def get_protocol_invoke_name(self, protocol, action):
+        return protocol.get_namespace() + "_" + protocol.get_name() + "_" + action.get_name() + "_invoke"
+
+    def can_specialize_params(self, params):
+        for param in params:
+            if int(param.get_count()) > 1:
+                return False
+        return True
+
+    def write_param_unpack(self, protocol, struct_name, params, outfile):
+        outfile.write("    struct gracht_param* __params  = message->params;\n")
+        if len([param for param in params if param.is_string() or param.is_buffer()]) > 0:
+            outfile.write("    char*                __storage = (char*)message->params + (message->param_count * sizeof(struct gracht_param));\n")
+        outfile.write("    struct " + struct_name + " __args;\n\n")
+        for index, param in enumerate(params):
+            member = "__args." + param.get_name()
+            if param.is_value():
+                value_typename = self.get_param_typename(protocol, param, CONST.TYPENAME_CASE_SIZEOF)
+                outfile.write("    " + member + " = (" + value_typename + ")__params[" + str(index) + "].data.value;\n")
+            elif param.is_shm():
+                outfile.write("    " + member + " = __params[" + str(index) + "].data.buffer;\n")
+                if param.has_length_component():
+                    outfile.write("    " + member + "_length = __params[" + str(index) + "].length;\n")
+            else:
+                # links may move large buffers out of the message into shared memory
+                param_ref = "__params[" + str(index) + "]"
+                outfile.write("    if (" + param_ref + ".type == GRACHT_PARAM_SHM) {\n")
+                outfile.write("        " + member + " = " + param_ref + ".data.buffer;\n")
+                outfile.write("    }\n")
+                outfile.write("    else {\n")
+                outfile.write("        " + member + " = (" + param_ref + ".length != 0) ? (void*)__storage : NULL;\n")
+                outfile.write("        __storage += " + param_ref + ".length;\n")
+                outfile.write("    }\n")
+                if param.is_buffer() and param.has_length_component():
+                    outfile.write("    " + member + "_length = " + param_ref + ".length;\n")
+        return
+
+    def write_server_invoke(self, protocol, func, outfile):
+        outfile.write("static void " + self.get_protocol_invoke_name(protocol, func) + "(struct gracht_recv_message* message)\n")
+        outfile.write("{\n")
+        if len(func.get_request_params()) > 0:
+            self.write_param_unpack(protocol, self.get_input_struct_name(protocol, func), func.get_request_params(), outfile)
+            outfile.write("    " + self.get_protocol_server_callback_name(protocol, func) + "(message, &__args);\n")
+        else:
+            outfile.write("    " + self.get_protocol_server_callback_name(protocol, func) + "(message);\n")
+        outfile.write("}\n\n")
+        return
+
+    def write_client_invoke(self, protocol, evt, outfile):
+        outfile.write("static void " + self.get_protocol_invoke_name(protocol, evt) + "(struct gracht_recv_message* message)\n")
+        outfile.write("{\n")
+        if len(evt.get_params()) > 0:
+            self.write_param_unpack(protocol, self.get_event_struct_name(protocol, evt), evt.get_params(), outfile)
+            outfile.write("    " + self.get_protocol_client_event_callback_name(protocol, evt) + "(&__args);\n")
+        else:
+            outfile.write("    (void)message;\n")
+            outfile.write("    " + self.get_protocol_client_event_callback_name(protocol, evt) + "();\n")
+        outfile.write("}\n\n")
+        return
+
+    # The function tables are emitted dense and in action id order, so the runtime
+    # can resolve an action by indexing with (action - action_base)
+    def write_protocol_table(self, protocol, actions, callback_name_fn, invoke_fn, outfile):
+        function_array_name = protocol.get_namespace() + "_" + protocol.get_name() + "_functions"
+        actions = sorted(actions, key=lambda action: int(action.get_id()))
+        for action in actions:
+            if self.can_specialize_params(action.get_params() if isinstance(action, Event) else action.get_request_params()):
+                invoke_fn(protocol, action, outfile)
+
+        outfile.write("static gracht_protocol_function_t " + function_array_name + "[] = {\n")
+        for action in actions:
+            invoke_name = "NULL"
+            if self.can_specialize_params(action.get_params() if isinstance(action, Event) else action.get_request_params()):
+                invoke_name = self.get_protocol_invoke_name(protocol, action)
+            outfile.write("    { " + action.get_id() + ", " + callback_name_fn(protocol, action) + ", " + invoke_name + " },\n")
+        outfile.write("};\n\n")
+        outfile.write("gracht_protocol_t " + protocol.get_namespace() + "_" + protocol.get_name() + "_protocol = ")
+        outfile.write("GRACHT_PROTOCOL_INIT_INDEXED(" + protocol.get_id() + ", " + actions[0].get_id() + ", " + str(len(actions)) + ", " + function_array_name + ");\n\n")
+        return
+
     def write_server_protocol(self, protocol, outfile):
         if len(protocol.get_functions()) > 0:
-            function_array_name = protocol.get_namespace() + "_" + protocol.get_name() + "_functions"
-            outfile.write("static gracht_protocol_function_t " + function_array_name + "[] = {\n")
-            for func in protocol.get_functions():
-                outfile.write("    { " + func.get_id() + ", " + self.get_protocol_server_callback_name(protocol, func) + " },\n")
-            outfile.write("};\n\n")
-            outfile.write("gracht_protocol_t " + protocol.get_namespace() + "_" + protocol.get_name() + "_protocol = ")
-            outfile.write("GRACHT_PROTOCOL_INIT(" + protocol.get_id() + ", " + str(len(protocol.get_functions())) + ", " + function_array_name + ");\n\n")
+            self.write_protocol_table(protocol, protocol.get_functions(),
+                self.get_protocol_server_callback_name, self.write_server_invoke, outfile)
         return
     
     def write_client_protocol_prototype(self, protocol, outfile):
@@ -920,13 +1056,8 @@ class CGenerator:
     
     def write_client_protocol(self, protocol, outfile):
         if len(protocol.get_events()) > 0:
-            function_array_name = protocol.get_namespace() + "_" + protocol.get_name() + "_functions"
-            outfile.write("static gracht_protocol_function_t " + function_array_name + "[] = {\n")
-            for evt in protocol.get_events():
-                outfile.write("    { " + evt.get_id() + ", " + self.get_protocol_client_callback_name(protocol, evt) + " },\n")
-            outfile.write("};\n\n")
-            outfile.write("gracht_protocol_t " + protocol.get_namespace() + "_" + protocol.get_name() + "_protocol = ")
-            outfile.write("GRACHT_PROTOCOL_INIT(" + protocol.get_id() + ", " + str(len(protocol.get_functions())) + ", " + function_array_name + ");\n\n")
+            self.write_protocol_table(protocol, protocol.get_events(),
+                self.get_protocol_client_callback_name, self.write_client_invoke, outfile)
         return
 
     def generate_shared_header(self, protocol, directory):
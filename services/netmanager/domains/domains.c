@@ -23,14 +23,33 @@
  *   and bluetooth to name the popular ones.
  */
 
+//#define __TRACE
+
 #include "domains.h"
+#include <ddk/handle.h>
+#include <ddk/utils.h>
+#include <ds/list.h>
 #include <inet/socket.h>
+#include <io_events.h>
+#include <stdlib.h>
 #include "../socket.h"
+#include "../manager.h"
 
 typedef struct SocketDomain {
     SocketDomainOps_t Ops;
 } SocketDomain_t;
 
+typedef struct ConnectionRequest {
+    element_t                          Header;
+    UUId_t                             SourceSocketHandle;
+    struct vali_link_deferred_response Response;
+} ConnectionRequest_t;
+
+typedef struct AcceptRequest {
+    element_t                          Header;
+    struct vali_link_deferred_response Response;
+} AcceptRequest_t;
+
 // Supported domains
 extern OsStatus_t DomainUnspecCreate(SocketDomain_t**);
 extern OsStatus_t DomainLocalCreate(SocketDomain_t**);
@@ -179,3 +198,128 @@ DomainGetAddress(
     }
     return Socket->Domain->Ops.GetAddress(Socket, Source, Address);
 }
+
+static ConnectionRequest_t*
+CreateConnectionRequest(
+    _In_ UUId_t                      sourceSocketHandle,
+    _In_ struct gracht_recv_message* message)
+{
+    ConnectionRequest_t* request = malloc(sizeof(ConnectionRequest_t));
+    if (!request) {
+        return NULL;
+    }
+    
+    ELEMENT_INIT(&request->Header, 0, request);
+    request->SourceSocketHandle = sourceSocketHandle;
+    gracht_vali_message_defer_response(&request->Response, message);
+    return request;
+}
+
+static AcceptRequest_t*
+CreateAcceptRequest(
+    _In_ struct gracht_recv_message* message)
+{
+    AcceptRequest_t* request = malloc(sizeof(AcceptRequest_t));
+    if (!request) {
+        return NULL;
+    }
+    
+    ELEMENT_INIT(&request->Header, 0, request);
+    gracht_vali_message_defer_response(&request->Response, message);
+    return request;
+}
+
+OsStatus_t
+DomainQueueConnectionRequest(
+    _In_ struct gracht_recv_message* message,
+    _In_ Socket_t*                   sourceSocket,
+    _In_ Socket_t*                   targetSocket,
+    _In_ DomainAcceptConnectionFn    acceptConnection)
+{
+    ConnectionRequest_t* connectionRequest;
+    AcceptRequest_t*     acceptRequest;
+    element_t*           element;
+    
+    TRACE("[domain] [handle_connect] %u => %u",
+        LODWORD(sourceSocket->Header.key), LODWORD(targetSocket->Header.key));
+    
+    // Check for active accept requests, otherwise we need to queue it up. If the backlog
+    // is full, we need to reject the connection request.
+    mtx_lock(&targetSocket->SyncObject);
+    element = queue_pop(&targetSocket->AcceptRequests);
+    if (!element) {
+        TRACE("[domain] [handle_connect] creating request");
+        connectionRequest = CreateConnectionRequest((UUId_t)(uintptr_t)sourceSocket->Header.key, message);
+        if (!connectionRequest) {
+            mtx_unlock(&targetSocket->SyncObject);
+            ERROR("[domain] [handle_connect] failed to allocate memory for connection request");
+            return OsOutOfMemory;
+        }
+        
+        // TODO If the backlog is full, reject
+        // return OsConnectionRefused
+        queue_push(&targetSocket->ConnectionRequests, &connectionRequest->Header);
+        handle_set_activity((UUId_t)(uintptr_t)targetSocket->Header.key, IOEVTCTL);
+    }
+    mtx_unlock(&targetSocket->SyncObject);
+    
+    // Handle the accept request we popped earlier here, this means someone
+    // has called accept() on the socket and is actively waiting
+    if (element) {
+        acceptRequest = element->value;
+        acceptConnection(&acceptRequest->Response.recv_message, targetSocket,
+            sourceSocket, message);
+        free(acceptRequest);
+    }
+    return OsSuccess;
+}
+
+OsStatus_t
+DomainQueueAcceptRequest(
+    _In_ struct gracht_recv_message* message,
+    _In_ Socket_t*                   socket,
+    _In_ DomainAcceptConnectionFn    acceptConnection)
+{
+    Socket_t*            connectSocket;
+    ConnectionRequest_t* connectionRequest;
+    AcceptRequest_t*     acceptRequest;
+    element_t*           element;
+    OsStatus_t           status = OsSuccess;
+    TRACE("[domain] [accept] %u", LODWORD(socket->Header.key));
+    
+    // Check if there is any requests available
+    mtx_lock(&socket->SyncObject);
+    element = queue_pop(&socket->ConnectionRequests);
+    if (element) {
+        mtx_unlock(&socket->SyncObject);
+        connectionRequest = element->value;
+        
+        // Lookup the socket handle, to check if it is still valid
+        connectSocket = NetworkManagerSocketGet(connectionRequest->SourceSocketHandle);
+        if (connectSocket) {
+            acceptConnection(message, socket, connectSocket,
+                &connectionRequest->Response.recv_message);
+        }
+        else {
+            status = OsConnectionAborted;
+        }
+        free(connectionRequest);
+    }
+    else {
+        // Only wait if configured to blocking, otherwise return OsBusy ish
+        if (socket->Configuration.Blocking) {
+            acceptRequest = CreateAcceptRequest(message);
+            if (acceptRequest) {
+                queue_push(&socket->AcceptRequests, &acceptRequest->Header);
+            }
+            else {
+                status = OsOutOfMemory;
+            }
+        }
+        else {
+            status = OsBusy; // TODO: OsTryAgain
+        }
+        mtx_unlock(&socket->SyncObject);
+    }
+    return status;
+}
@@ -46,6 +46,12 @@ typedef OsStatus_t (*DomainPairFn)(Socket_t*, Socket_t*);
 typedef OsStatus_t (*DomainGetAddressFn)(Socket_t*, int, struct sockaddr*);
 typedef void       (*DomainDestroyFn)(SocketDomain_t*);
 
+// Sets up the socket for an accepted connection and replies to both the accept()
+// and the connect() call. Arguments are the accept message, the listening socket,
+// the connecting socket and the connect message.
+typedef void (*DomainAcceptConnectionFn)(struct gracht_recv_message*, Socket_t*,
+    Socket_t*, struct gracht_recv_message*);
+
 typedef struct SocketDomainOps {
     DomainAllocateAddressFn  AddressAllocate;
     DomainFreeAddressFn      AddressFree;
@@ -116,4 +122,19 @@ DomainGetAddress(
     _In_ int              Source,
     _In_ struct sockaddr* Address);
 
+// Connection oriented domains share the queues of connection and accept requests
+// of listening sockets, and only provide how a connection is accepted.
+OsStatus_t
+DomainQueueConnectionRequest(
+    _In_ struct gracht_recv_message* message,
+    _In_ Socket_t*                   sourceSocket,
+    _In_ Socket_t*                   targetSocket,
+    _In_ DomainAcceptConnectionFn    acceptConnection);
+
+OsStatus_t
+DomainQueueAcceptRequest(
+    _In_ struct gracht_recv_message* message,
+    _In_ Socket_t*                   socket,
+    _In_ DomainAcceptConnectionFn    acceptConnection);
+
 #endif //!__NETMANAGER_DOMAINS_H__
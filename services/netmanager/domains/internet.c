@@ -21,18 +21,707 @@
  * - Contains the implementation of the socket domain type in the network
  *   manager. There a lot of different types of sockets, like internet, ipc
  *   and bluetooth to name the popular ones.
+ * - The internet domain only supports the loopback network for now. Stream
+ *   sockets are connected to each others pipes like local sockets, and datagrams
+ *   are routed by port between the pipes of the sockets.
  */
+//#define __TRACE
 
 #include "domains.h"
+#include "../socket.h"
+#include "../manager.h"
+#include <ddk/handle.h>
+#include <ddk/utils.h>
+#include <ds/list.h>
+#include <internal/_socket.h>
+#include <inet/internet.h>
+#include <inet/bits.h>
+#include <io_events.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "../svc_socket_protocol_server.h"
+
+// Streams and datagrams have their own port space per address family. The key
+// of a port record combines all three.
+#define PORT_KIND_STREAM   0
+#define PORT_KIND_DGRAM    1
+#define PORT_KEY(Family, Kind, Port) \
+    (void*)(uintptr_t)((((Family) == AF_INET6) << 17) | ((Kind) << 16) | (Port))
+
+#define PORT_EPHEMERAL_FIRST 49152
+#define PORT_EPHEMERAL_COUNT 16384
+#define PORT_REGISTER_BUCKETS 256
+
+// Records only refer to their socket by handle, sockets are resolved through
+// the network manager which knows when a socket has been destroyed. Accepted
+// sockets share the port of their listener, and their records are not registered.
+typedef struct PortRecord {
+    element_t               Header;
+    UUId_t                  Socket;
+    int                     Kind;
+    int                     Registered;
+    uint16_t                Port;
+    struct sockaddr_storage Address;
+} PortRecord_t;
 
 typedef struct SocketDomain {
     SocketDomainOps_t Ops;
+    int               Family;
+    UUId_t            ConnectedSocket;
+    PortRecord_t*     Record;
+    int               Accepted;
 } SocketDomain_t;
 
+// Each bucket of the port register has its own lock, which covers the lookup and
+// the use of a record, as records are freed by other monitor threads.
+static list_t                PortRegister[PORT_REGISTER_BUCKETS];
+static mtx_t                 PortRegisterLocks[PORT_REGISTER_BUCKETS];
+static once_flag             PortRegisterOnce  = ONCE_FLAG_INIT;
+static _Atomic(unsigned int) NextEphemeralPort = ATOMIC_VAR_INIT(0);
+
+static void
+InitializePortRegister(void)
+{
+    int i;
+    for (i = 0; i < PORT_REGISTER_BUCKETS; i++) {
+        list_construct(&PortRegister[i]);
+        mtx_init(&PortRegisterLocks[i], mtx_plain);
+    }
+}
+
+static int
+GetPortBucket(
+    _In_ uint16_t Port)
+{
+    return Port & (PORT_REGISTER_BUCKETS - 1);
+}
+
+static int
+GetPortKind(
+    _In_ Socket_t* Socket)
+{
+    return Socket->Type == SOCK_STREAM ? PORT_KIND_STREAM : PORT_KIND_DGRAM;
+}
+
+// Must be called with the lock of the bucket held
+static PortRecord_t*
+GetPortRecord(
+    _In_ int      Family,
+    _In_ int      Kind,
+    _In_ uint16_t Port)
+{
+    element_t* Element = list_find(&PortRegister[GetPortBucket(Port)], PORT_KEY(Family, Kind, Port));
+    if (!Element) {
+        return NULL;
+    }
+    return Element->value;
+}
+
+static Socket_t*
+GetPortSocket(
+    _In_ int      Family,
+    _In_ int      Kind,
+    _In_ uint16_t Port)
+{
+    int           Bucket = GetPortBucket(Port);
+    PortRecord_t* Record;
+    UUId_t        Handle = UUID_INVALID;
+
+    mtx_lock(&PortRegisterLocks[Bucket]);
+    Record = GetPortRecord(Family, Kind, Port);
+    if (Record) {
+        Handle = Record->Socket;
+    }
+    mtx_unlock(&PortRegisterLocks[Bucket]);
+    if (Handle == UUID_INVALID) {
+        return NULL;
+    }
+    return NetworkManagerSocketGet(Handle);
+}
+
+// Only the loopback network exists, so the any address and every address of
+// the loopback network refer to this host.
+static int
+IsLoopbackAddress(
+    _In_ const struct sockaddr* Address)
+{
+    if (Address->sa_family == AF_INET) {
+        in_addr_t HostAddress = ntohl(((const struct sockaddr_in*)Address)->sin_addr.s_addr);
+        return HostAddress == INADDR_ANY || (HostAddress >> 24) == IN_LOOPBACKNET;
+    }
+    else if (Address->sa_family == AF_INET6) {
+        const struct in6_addr* Address6 = &((const struct sockaddr_in6*)Address)->sin6_addr;
+        int                    i;
+
+        for (i = 0; i < 15; i++) {
+            if (Address6->s6_addr[i]) {
+                return 0;
+            }
+        }
+        return Address6->s6_addr[15] <= 1;
+    }
+    return 0;
+}
+
+static uint16_t
+GetAddressPort(
+    _In_ const struct sockaddr* Address)
+{
+    if (Address->sa_family == AF_INET6) {
+        return ntohs(((const struct sockaddr_in6*)Address)->sin6_port);
+    }
+    return ntohs(((const struct sockaddr_in*)Address)->sin_port);
+}
+
+static socklen_t
+GetAddressLength(
+    _In_ int Family)
+{
+    return Family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+// Builds the address of a port on this host. Unspecified addresses are replaced
+// by the loopback address, which is what the peer sees.
+static void
+SetRecordAddress(
+    _In_ PortRecord_t*          Record,
+    _In_ int                    Family,
+    _In_ const struct sockaddr* Address)
+{
+    memset(&Record->Address, 0, sizeof(struct sockaddr_storage));
+    if (Family == AF_INET6) {
+        struct sockaddr_in6* Address6 = (struct sockaddr_in6*)&Record->Address;
+        Address6->sin6_len              = sizeof(struct sockaddr_in6);
+        Address6->sin6_family           = AF_INET6;
+        Address6->sin6_port             = htons(Record->Port);
+        Address6->sin6_addr.s6_addr[15] = 1;
+    }
+    else {
+        struct sockaddr_in* Address4 = (struct sockaddr_in*)&Record->Address;
+        Address4->sin_len         = sizeof(struct sockaddr_in);
+        Address4->sin_family      = AF_INET;
+        Address4->sin_port        = htons(Record->Port);
+        Address4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (Address && ((const struct sockaddr_in*)Address)->sin_addr.s_addr != INADDR_ANY) {
+            Address4->sin_addr = ((const struct sockaddr_in*)Address)->sin_addr;
+        }
+    }
+}
+
+// Must be called with the lock of the bucket of the port held
+static void
+RegisterPort(
+    _In_ Socket_t*     Socket,
+    _In_ PortRecord_t* Record,
+    _In_ uint16_t      Port)
+{
+    Record->Port       = Port;
+    Record->Registered = 1;
+    ELEMENT_INIT(&Record->Header, PORT_KEY(Socket->Domain->Family, Record->Kind, Port), Record);
+    list_append(&PortRegister[GetPortBucket(Port)], &Record->Header);
+}
+
+static void
+UnregisterPort(
+    _In_ PortRecord_t* Record)
+{
+    int Bucket = GetPortBucket(Record->Port);
+
+    mtx_lock(&PortRegisterLocks[Bucket]);
+    if (Record->Registered) {
+        list_remove(&PortRegister[Bucket], &Record->Header);
+        Record->Registered = 0;
+    }
+    mtx_unlock(&PortRegisterLocks[Bucket]);
+}
+
+static OsStatus_t
+DomainInternetGetAddress(
+    _In_ Socket_t*        Socket,
+    _In_ int              Source,
+    _In_ struct sockaddr* Address)
+{
+    PortRecord_t* Record = Socket->Domain->Record;
+
+    switch (Source) {
+        case SVC_SOCKET_GET_ADDRESS_SOURCE_THIS: {
+            if (!Record) {
+                return OsDoesNotExist;
+            }
+            memcpy(Address, &Record->Address, GetAddressLength(Socket->Domain->Family));
+            return OsSuccess;
+        } break;
+
+        case SVC_SOCKET_GET_ADDRESS_SOURCE_PEER: {
+            Socket_t* PeerSocket = NetworkManagerSocketGet(Socket->Domain->ConnectedSocket);
+            if (!PeerSocket) {
+                return OsDoesNotExist;
+            }
+            return DomainInternetGetAddress(PeerSocket,
+                SVC_SOCKET_GET_ADDRESS_SOURCE_THIS, Address);
+        } break;
+    }
+    return OsInvalidParameters;
+}
+
+// Connected stream sockets read and write each others pipes directly, so the
+// only thing left to do is to tune the pipe and let the peer know that data is available.
+static OsStatus_t
+HandleStreamData(
+    _In_ Socket_t* Socket)
+{
+    Socket_t* TargetSocket = NetworkManagerSocketGet(Socket->Domain->ConnectedSocket);
+    if (!TargetSocket) {
+        TRACE("[socket] [inet] [send_stream] target socket %u was not found",
+            LODWORD(Socket->Domain->ConnectedSocket));
+        return OsDoesNotExist;
+    }
+
+    SocketPipeTune(GetSocketSendPipe(Socket), 0);
+    handle_set_activity((UUId_t)(uintptr_t)TargetSocket->Header.key, IOEVTIN);
+    return OsSuccess;
+}
+
+// Copies the remaining data of a packet between two streams in pieces, which
+// avoids having to allocate room for the entire packet.
+static void
+CopyPacketData(
+    _In_ streambuffer_t* SourceStream,
+    _In_ unsigned int*   SourceState,
+    _In_ streambuffer_t* TargetStream,
+    _In_ unsigned int*   TargetState,
+    _In_ size_t          Length)
+{
+    char Buffer[256];
+    while (Length) {
+        size_t BytesToCopy = MIN(Length, sizeof(Buffer));
+        streambuffer_read_packet_data(SourceStream, &Buffer[0], BytesToCopy, SourceState);
+        streambuffer_write_packet_data(TargetStream, &Buffer[0], BytesToCopy, TargetState);
+        Length -= BytesToCopy;
+    }
+}
+
+// Datagrams are routed to the socket bound to the destination port, with the
+// destination address replaced by the address of the sender. Like on a real
+// network, datagrams are dropped if the receiver does not exist or has no room.
+static OsStatus_t
+HandleDatagram(
+    _In_ Socket_t*         Socket,
+    _In_ streambuffer_t*   SourceStream,
+    _In_ struct packethdr* Packet,
+    _In_ unsigned int*     SourceState)
+{
+    struct sockaddr_storage Address;
+    Socket_t*               TargetSocket;
+    streambuffer_t*         TargetStream;
+    struct packethdr        TargetPacket;
+    size_t                  TargetLength;
+    size_t                  BytesLeft;
+    unsigned int            Base, State;
+
+    if (Packet->addresslen < GetAddressLength(Socket->Domain->Family) ||
+        Packet->addresslen > sizeof(struct sockaddr_storage)) {
+        WARNING("[socket] [inet] [send_packet] invalid destination address");
+        return OsInvalidParameters;
+    }
+
+    streambuffer_read_packet_data(SourceStream, &Address, (size_t)Packet->addresslen, SourceState);
+    if (Address.__ss_family != Socket->Domain->Family || !IsLoopbackAddress((struct sockaddr*)&Address)) {
+        TRACE("[socket] [inet] [send_packet] destination is not reachable");
+        return OsHostUnreachable;
+    }
+
+    TargetSocket = GetPortSocket(Socket->Domain->Family, PORT_KIND_DGRAM,
+        GetAddressPort((struct sockaddr*)&Address));
+    if (!TargetSocket) {
+        TRACE("[socket] [inet] [send_packet] no socket on port %u",
+            GetAddressPort((struct sockaddr*)&Address));
+        return OsDoesNotExist;
+    }
+
+    TargetPacket            = *Packet;
+    TargetPacket.addresslen = GetAddressLength(Socket->Domain->Family);
+    BytesLeft               = (size_t)(Packet->controllen + Packet->payloadlen);
+    TargetLength            = sizeof(struct packethdr) + (size_t)TargetPacket.addresslen + BytesLeft;
+
+    SocketPipeTune(GetSocketRecvPipe(TargetSocket), 0);
+    TargetStream = GetSocketRecvStream(TargetSocket);
+    if (!TargetStream) {
+        return OsDoesNotExist;
+    }
+    if (!streambuffer_write_packet_start(TargetStream, TargetLength,
+            STREAMBUFFER_NO_BLOCK, &Base, &State)) {
+        SocketPipeTune(GetSocketRecvPipe(TargetSocket), 1);
+        TRACE("[socket] [inet] [send_packet] receiver is full, dropping packet");
+        return OsBusy;
+    }
+
+    streambuffer_write_packet_data(TargetStream, &TargetPacket, sizeof(struct packethdr), &State);
+    streambuffer_write_packet_data(TargetStream, &Socket->Domain->Record->Address,
+        (size_t)TargetPacket.addresslen, &State);
+    CopyPacketData(SourceStream, SourceState, TargetStream, &State, BytesLeft);
+    streambuffer_write_packet_end(TargetStream, Base, TargetLength);
+    handle_set_activity((UUId_t)(uintptr_t)TargetSocket->Header.key, IOEVTIN);
+    return OsSuccess;
+}
+
+static OsStatus_t
+HandleDatagramData(
+    _In_ Socket_t* Socket)
+{
+    streambuffer_t*  SourceStream = GetSocketSendStream(Socket);
+    struct packethdr Packet;
+    unsigned int     Base, State;
+    size_t           BytesRead;
+    TRACE("[socket] [inet] [send_packet]");
+
+    if (!SourceStream) {
+        return OsDoesNotExist;
+    }
+
+    SocketPipeTune(GetSocketSendPipe(Socket), 0);
+    while (1) {
+        BytesRead = streambuffer_read_packet_start(SourceStream,
+            STREAMBUFFER_NO_BLOCK, &Base, &State);
+        if (!BytesRead) {
+            break;
+        }
+
+        if (BytesRead >= sizeof(struct packethdr)) {
+            streambuffer_read_packet_data(SourceStream, &Packet, sizeof(struct packethdr), &State);
+            if ((sizeof(struct packethdr) + Packet.addresslen +
+                    Packet.controllen + Packet.payloadlen) <= BytesRead) {
+                (void)HandleDatagram(Socket, SourceStream, &Packet, &State);
+            }
+        }
+        streambuffer_read_packet_end(SourceStream, Base, BytesRead);
+    }
+    SocketPipeTune(GetSocketSendPipe(Socket), 0);
+    return OsSuccess;
+}
+
+static OsStatus_t
+DomainInternetSend(
+    _In_ Socket_t* Socket)
+{
+    TRACE("[socket] [inet] [send]");
+    if (Socket->Type == SOCK_STREAM) {
+        return HandleStreamData(Socket);
+    }
+    return HandleDatagramData(Socket);
+}
+
+static OsStatus_t
+DomainInternetReceive(
+    _In_ Socket_t* Socket)
+{
+    TRACE("DomainInternetReceive()");
+    return OsNotSupported;
+}
+
+// Only sockets created by accepting a connection can be paired, as the pipes of
+// the two ends are connected at that point. socketpair() is not supported for
+// internet sockets.
+static OsStatus_t
+DomainInternetPair(
+    _In_ Socket_t* Socket1,
+    _In_ Socket_t* Socket2)
+{
+    if (!Socket1->Domain->Accepted && !Socket2->Domain->Accepted) {
+        return OsNotSupported;
+    }
+
+    Socket1->Domain->ConnectedSocket = (UUId_t)(uintptr_t)Socket2->Header.key;
+    Socket2->Domain->ConnectedSocket = (UUId_t)(uintptr_t)Socket1->Header.key;
+    return OsSuccess;
+}
+
+static OsStatus_t
+DomainInternetAllocateAddress(
+    _In_ Socket_t* Socket)
+{
+    PortRecord_t* Record;
+    int           Kind;
+    int           i;
+    TRACE("[socket] [inet] allocate address 0x%" PRIxIN " [%u]",
+        Socket, (UUId_t)Socket->Header.key);
+
+    if (Socket->Type != SOCK_STREAM && Socket->Type != SOCK_DGRAM) {
+        return OsNotSupported;
+    }
+
+    if (Socket->Domain->Record) {
+        ERROR("[socket] [inet] domain address 0x%" PRIxIN " already registered",
+            Socket->Domain->Record);
+        return OsExists;
+    }
+
+    Record = malloc(sizeof(PortRecord_t));
+    if (!Record) {
+        return OsOutOfMemory;
+    }
+
+    Kind               = GetPortKind(Socket);
+    Record->Socket     = (UUId_t)(uintptr_t)Socket->Header.key;
+    Record->Kind       = Kind;
+    Record->Registered = 0;
+    for (i = 0; i < PORT_EPHEMERAL_COUNT; i++) {
+        uint16_t Port = (uint16_t)(PORT_EPHEMERAL_FIRST +
+            (atomic_fetch_add(&NextEphemeralPort, 1) % PORT_EPHEMERAL_COUNT));
+        int      Bucket = GetPortBucket(Port);
+
+        mtx_lock(&PortRegisterLocks[Bucket]);
+        if (!GetPortRecord(Socket->Domain->Family, Kind, Port)) {
+            RegisterPort(Socket, Record, Port);
+            mtx_unlock(&PortRegisterLocks[Bucket]);
+            SetRecordAddress(Record, Socket->Domain->Family, NULL);
+            Socket->Domain->Record = Record;
+            return OsSuccess;
+        }
+        mtx_unlock(&PortRegisterLocks[Bucket]);
+    }
+
+    ERROR("[socket] [inet] out of ephemeral ports");
+    free(Record);
+    return OsBusy;
+}
+
+static void
+DestroyPortRecord(
+    _In_ PortRecord_t* Record)
+{
+    TRACE("DestroyPortRecord()");
+    UnregisterPort(Record);
+    free(Record);
+}
+
+static void
+DomainInternetFreeAddress(
+    _In_ Socket_t* Socket)
+{
+    TRACE("DomainInternetFreeAddress()");
+    if (Socket->Domain->Record) {
+        DestroyPortRecord(Socket->Domain->Record);
+        Socket->Domain->Record = NULL;
+    }
+}
+
+static OsStatus_t
+DomainInternetBind(
+    _In_ Socket_t*              Socket,
+    _In_ const struct sockaddr* Address)
+{
+    PortRecord_t* Record = Socket->Domain->Record;
+    uint16_t      Port;
+    int           PreviousBucket;
+    int           Bucket;
+    TRACE("[domain] [inet] [bind]");
+
+    if (!Record) {
+        ERROR("[domain] [inet] [bind] no record");
+        return OsError;
+    }
+
+    // Accepted sockets are bound to the address of their listener
+    if (Socket->Domain->Accepted || Address->sa_family != Socket->Domain->Family) {
+        return OsInvalidParameters;
+    }
+
+    if (!IsLoopbackAddress(Address)) {
+        ERROR("[domain] [inet] [bind] only loopback addresses are available");
+        return OsHostUnreachable;
+    }
+
+    // Port 0 keeps the ephemeral port the socket was given
+    Port = GetAddressPort(Address);
+    if (Port && Port != Record->Port) {
+        // The check and the move of the record must happen under both bucket locks,
+        // which are taken in order to not deadlock with another bind
+        PreviousBucket = GetPortBucket(Record->Port);
+        Bucket         = GetPortBucket(Port);
+        mtx_lock(&PortRegisterLocks[MIN(PreviousBucket, Bucket)]);
+        if (PreviousBucket != Bucket) {
+            mtx_lock(&PortRegisterLocks[MAX(PreviousBucket, Bucket)]);
+        }
+
+        if (GetPortRecord(Socket->Domain->Family, Record->Kind, Port) != NULL) {
+            ERROR("[domain] [inet] [bind] port %u already bound", Port);
+            if (PreviousBucket != Bucket) {
+                mtx_unlock(&PortRegisterLocks[MAX(PreviousBucket, Bucket)]);
+            }
+            mtx_unlock(&PortRegisterLocks[MIN(PreviousBucket, Bucket)]);
+            return OsExists;
+        }
+
+        list_remove(&PortRegister[PreviousBucket], &Record->Header);
+        RegisterPort(Socket, Record, Port);
+        if (PreviousBucket != Bucket) {
+            mtx_unlock(&PortRegisterLocks[MAX(PreviousBucket, Bucket)]);
+        }
+        mtx_unlock(&PortRegisterLocks[MIN(PreviousBucket, Bucket)]);
+    }
+    SetRecordAddress(Record, Socket->Domain->Family, Address);
+    return OsSuccess;
+}
+
+// Accepted sockets take over the local address of the listener, which keeps the
+// port. The ephemeral port given to the socket on creation is released again.
+static void
+InheritListenerAddress(
+    _In_ Socket_t* acceptSocket,
+    _In_ Socket_t* listenSocket)
+{
+    PortRecord_t* record       = acceptSocket->Domain->Record;
+    PortRecord_t* listenRecord = listenSocket->Domain->Record;
+
+    if (!record || !listenRecord) {
+        return;
+    }
+
+    UnregisterPort(record);
+    record->Port = listenRecord->Port;
+    memcpy(&record->Address, &listenRecord->Address, sizeof(struct sockaddr_storage));
+}
+
+static void
+AcceptConnectionRequest(
+    _In_ struct gracht_recv_message* acceptMessage,
+    _In_ Socket_t*                   listenSocket,
+    _In_ Socket_t*                   connectSocket,
+    _In_ struct gracht_recv_message* connectMessage)
+{
+    UUId_t                  handle, send_handle, recv_handle;
+    struct sockaddr_storage address;
+    Socket_t*               acceptSocket;
+    OsStatus_t              status;
+
+    TRACE("[domain] [inet] [accept_request]");
+
+    DomainInternetGetAddress(connectSocket, SVC_SOCKET_GET_ADDRESS_SOURCE_THIS, (struct sockaddr*)&address);
+
+    // Create a new socket for the acceptor, and hand it the pipes of the connector
+    // crossed over. It then writes into the receive stream of the connector and
+    // reads from its send stream.
+    status = NetworkManagerSocketCreate(connectSocket->DomainType,
+        connectSocket->Type, connectSocket->Protocol,
+        (UUId_t)(uintptr_t)connectSocket->Header.key, &handle,
+        &send_handle, &recv_handle);
+    if (status == OsSuccess) {
+        acceptSocket = NetworkManagerSocketGet(handle);
+        if (acceptSocket) {
+            acceptSocket->Domain->Accepted = 1;
+            InheritListenerAddress(acceptSocket, listenSocket);
+            status = NetworkManagerSocketPair(handle, (UUId_t)(uintptr_t)connectSocket->Header.key);
+        }
+        else {
+            status = OsDoesNotExist;
+        }
+
+        if (status != OsSuccess) {
+            (void)NetworkManagerSocketShutdown(handle, SVC_SOCKET_CLOSE_OPTIONS_DESTROY);
+        }
+    }
+
+    svc_socket_connect_response(connectMessage, status);
+    svc_socket_accept_response(acceptMessage, status, (struct sockaddr*)&address,
+        handle, send_handle, recv_handle);
+}
+
+static OsStatus_t
+DomainInternetConnect(
+    _In_ struct gracht_recv_message* message,
+    _In_ Socket_t*                   socket,
+    _In_ const struct sockaddr*      address)
+{
+    Socket_t* target;
+    TRACE("[domain] [inet] [connect]");
+
+    if (address->sa_family != socket->Domain->Family || !IsLoopbackAddress(address)) {
+        return OsHostUnreachable;
+    }
+
+    // Datagram sockets keep their default destination in libc
+    if (socket->Type != SOCK_STREAM) {
+        return OsSuccess;
+    }
+
+    target = GetPortSocket(socket->Domain->Family, PORT_KIND_STREAM, GetAddressPort(address));
+    if (!target || !target->Configuration.Passive) {
+        TRACE("[domain] [inet] [connect] port %u is not listening", GetAddressPort(address));
+        return OsConnectionRefused;
+    }
+    return DomainQueueConnectionRequest(message, socket, target, AcceptConnectionRequest);
+}
+
+static OsStatus_t
+DomainInternetDisconnect(
+    _In_ Socket_t* Socket)
+{
+    Socket_t*  PeerSocket = NetworkManagerSocketGet(Socket->Domain->ConnectedSocket);
+    OsStatus_t Status     = OsHostUnreachable;
+    TRACE("[domain] [inet] [disconnect] %u => %u", LODWORD(Socket->Header.key),
+        LODWORD(Socket->Domain->ConnectedSocket));
+
+    if (PeerSocket) {
+        handle_set_activity(Socket->Domain->ConnectedSocket, IOEVTCTL);
+        Status = OsSuccess;
+    }
+
+    Socket->Domain->ConnectedSocket = UUID_INVALID;
+    Socket->Configuration.Connected = 0;
+    return Status;
+}
+
+static OsStatus_t
+DomainInternetAccept(
+    _In_ struct gracht_recv_message* message,
+    _In_ Socket_t*                   socket)
+{
+    return DomainQueueAcceptRequest(message, socket, AcceptConnectionRequest);
+}
+
+static void
+DomainInternetDestroy(
+    _In_ SocketDomain_t* Domain)
+{
+    TRACE("DomainInternetDestroy()");
+    if (Domain->Record) {
+        DestroyPortRecord(Domain->Record);
+    }
+    free(Domain);
+}
+
 OsStatus_t
 DomainInternetCreate(
     _In_  int              DomainType,
     _Out_ SocketDomain_t** DomainOut)
 {
-    return OsNotSupported;
+    SocketDomain_t* Domain = malloc(sizeof(SocketDomain_t));
+    if (!Domain) {
+        return OsOutOfMemory;
+    }
+    TRACE("DomainInternetCreate()");
+    call_once(&PortRegisterOnce, InitializePortRegister);
+
+    Domain->Ops.AddressAllocate = DomainInternetAllocateAddress;
+    Domain->Ops.AddressFree     = DomainInternetFreeAddress;
+    Domain->Ops.Bind            = DomainInternetBind;
+    Domain->Ops.Connect         = DomainInternetConnect;
+    Domain->Ops.Disconnect      = DomainInternetDisconnect;
+    Domain->Ops.Accept          = DomainInternetAccept;
+    Domain->Ops.Send            = DomainInternetSend;
+    Domain->Ops.Receive         = DomainInternetReceive;
+    Domain->Ops.Pair            = DomainInternetPair;
+    Domain->Ops.GetAddress      = DomainInternetGetAddress;
+    Domain->Ops.Destroy         = DomainInternetDestroy;
+
+    Domain->Family          = DomainType;
+    Domain->ConnectedSocket = UUID_INVALID;
+    Domain->Record          = NULL;
+    Domain->Accepted        = 0;
+
+    *DomainOut = Domain;
+    return OsSuccess;
 }
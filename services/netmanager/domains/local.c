@@ -36,33 +36,45 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <threads.h>
 
 #include "../svc_socket_protocol_server.h"
 
+#define LOCAL_ADDRESS_LENGTH sizeof(((struct sockaddr_lc*)0)->slc_addr)
+
+// Records only refer to their socket by handle, sockets are resolved through
+// the network manager which knows when a socket has been destroyed.
 typedef struct AddressRecord {
     element_t Header;
-    Socket_t* Socket;
+    UUId_t    Socket;
+    char      Address[LOCAL_ADDRESS_LENGTH];
 } AddressRecord_t;
 
+// Sockets with direct pipes exchange data through each others buffers, the
+// network manager only forwards the activity events between them. The last
+// address a packet was sent to is cached by a copy of the address and the handle
+// of the target, together with the register generation it was resolved in.
 typedef struct SocketDomain {
     SocketDomainOps_t Ops;
     UUId_t            ConnectedSocket;
     AddressRecord_t*  Record;
+    int               DirectPipes;
+    UUId_t            CachedTarget;
+    char              CachedAddress[LOCAL_ADDRESS_LENGTH];
+    unsigned int      CachedGeneration;
 } SocketDomain_t;
 
-typedef struct ConnectionRequest {
-    element_t                          Header;
-    UUId_t                             SourceSocketHandle;
-    struct vali_link_deferred_response Response;
-} ConnectionRequest_t;
-
-typedef struct AcceptRequest {
-    element_t                          Header;
-    struct vali_link_deferred_response Response;
-} AcceptRequest_t;
+// The address register is split into buckets by the hash of the address. Each
+// bucket is a list with its own lock, so lookups of different addresses do not
+// contend. The lock covers the lookup and the use of the record, as records are
+// freed by other monitor threads. The generation is increased whenever an address
+// is removed or changed, which invalidates all cached targets.
+#define ADDRESS_REGISTER_BUCKETS 256
 
-// TODO: should be hashtable
-static list_t AddressRegister = LIST_INIT_CMP(list_cmp_string);
+static list_t                AddressRegister[ADDRESS_REGISTER_BUCKETS];
+static mtx_t                 AddressRegisterLocks[ADDRESS_REGISTER_BUCKETS];
+static once_flag             AddressRegisterOnce = ONCE_FLAG_INIT;
+static _Atomic(unsigned int) AddressGeneration   = ATOMIC_VAR_INIT(0);
 
 static OsStatus_t HandleInvalidType(Socket_t*);
 static OsStatus_t HandleSocketStreamData(Socket_t*);
@@ -78,18 +90,91 @@ static LocalTypeHandler LocalTypeHandlers[6] = {
     HandleSocketStreamData  // SOCK_SEQPACKET
 };
 
+static void
+InitializeAddressRegister(void)
+{
+    int i;
+    for (i = 0; i < ADDRESS_REGISTER_BUCKETS; i++) {
+        list_construct_cmp(&AddressRegister[i], list_cmp_string);
+        mtx_init(&AddressRegisterLocks[i], mtx_plain);
+    }
+}
+
+// FNV-1a
+static int
+GetAddressBucket(
+    _In_ const char* Address)
+{
+    uint32_t Hash = 2166136261U;
+    size_t   i;
+    for (i = 0; i < LOCAL_ADDRESS_LENGTH && Address[i]; i++) {
+        Hash ^= (uint8_t)Address[i];
+        Hash *= 16777619U;
+    }
+    return (int)(Hash & (ADDRESS_REGISTER_BUCKETS - 1));
+}
+
+// Must be called with the lock of the bucket held
+static AddressRecord_t*
+GetRecordFromAddress(
+    _In_ int         Bucket,
+    _In_ const char* Address)
+{
+    element_t* Element = list_find(&AddressRegister[Bucket], (void*)Address);
+    if (!Element) {
+        return NULL;
+    }
+    return Element->value;
+}
+
+static UUId_t
+GetSocketHandleFromAddress(
+    _In_ const char* Address)
+{
+    int              Bucket = GetAddressBucket(Address);
+    AddressRecord_t* Record;
+    UUId_t           Handle = UUID_INVALID;
+    
+    mtx_lock(&AddressRegisterLocks[Bucket]);
+    Record = GetRecordFromAddress(Bucket, Address);
+    if (Record) {
+        Handle = Record->Socket;
+    }
+    mtx_unlock(&AddressRegisterLocks[Bucket]);
+    return Handle;
+}
+
 static Socket_t*
 GetSocketFromAddress(
     _In_ const struct sockaddr* Address)
 {
-    AddressRecord_t* Record;
-    element_t*       Element = list_find(&AddressRegister, (void*)&Address->sa_data[0]);
-    if (!Element) {
+    UUId_t Handle = GetSocketHandleFromAddress(&Address->sa_data[0]);
+    if (Handle == UUID_INVALID) {
         return NULL;
     }
-    
-    Record = Element->value;
-    return Record->Socket;
+    return NetworkManagerSocketGet(Handle);
+}
+
+// Resolves the target of a packet, reusing the target of the previous packet if
+// it was sent to the same address and no address changed since.
+static Socket_t*
+GetCachedSocketFromAddress(
+    _In_ Socket_t*              Socket,
+    _In_ const struct sockaddr* Address)
+{
+    SocketDomain_t* Domain     = Socket->Domain;
+    unsigned int    Generation = atomic_load(&AddressGeneration);
+    
+    if (Domain->CachedTarget == UUID_INVALID || Domain->CachedGeneration != Generation ||
+        strncmp(&Domain->CachedAddress[0], &Address->sa_data[0], LOCAL_ADDRESS_LENGTH)) {
+        Domain->CachedTarget = GetSocketHandleFromAddress(&Address->sa_data[0]);
+        if (Domain->CachedTarget == UUID_INVALID) {
+            return NULL;
+        }
+        strncpy(&Domain->CachedAddress[0], &Address->sa_data[0], LOCAL_ADDRESS_LENGTH);
+        Domain->CachedGeneration = Generation;
+    }
+    return NetworkManagerSocketGet(Domain->CachedTarget);
 }
 
 static OsStatus_t
@@ -117,7 +202,7 @@ DomainLocalGetAddress(
             if (!Record) {
                 return OsDoesNotExist;
             }
-            strcpy(&LcAddress->slc_addr[0], (const char*)Record->Header.key);
+            strncpy(&LcAddress->slc_addr[0], &Record->Address[0], LOCAL_ADDRESS_LENGTH);
             return OsSuccess;
         } break;
         
@@ -138,6 +223,7 @@ HandleSocketStreamData(
     _In_ Socket_t* Socket)
 {
     int             DoRead       = 1;
+    int             Stalled      = 0;
     streambuffer_t* SourceStream = GetSocketSendStream(Socket);
     streambuffer_t* TargetStream;
     Socket_t*       TargetSocket;
@@ -154,7 +240,21 @@ HandleSocketStreamData(
         return OsDoesNotExist;
     }
     
+    // The peer reads straight from our send stream, so just let it know
+    if (Socket->Domain->DirectPipes) {
+        SocketPipeTune(GetSocketSendPipe(Socket), 0);
+        handle_set_activity((UUId_t)TargetSocket->Header.key, IOEVTIN);
+        return OsSuccess;
+    }
+    
+    SocketPipeTune(GetSocketSendPipe(Socket), 0);
+    SocketPipeTune(GetSocketRecvPipe(TargetSocket), 0);
+    
     TargetStream = GetSocketRecvStream(TargetSocket);
+    if (!SourceStream || !TargetStream) {
+        return OsDoesNotExist;
+    }
+    
     BytesRead    = SocketGetQueuedPacket(Socket, &StoredBuffer);
     if (BytesRead) {
         memcpy(&TemporaryBuffer, StoredBuffer, BytesRead);
@@ -184,6 +284,7 @@ HandleSocketStreamData(
             
             memcpy(StoredBuffer, &TemporaryBuffer[BytesWritten], BytesRead - BytesWritten);
             SocketSetQueuedPacket(Socket, StoredBuffer, BytesRead - BytesWritten);
+            Stalled = 1;
             break;
         }
         
@@ -191,6 +292,9 @@ HandleSocketStreamData(
             break;
         }
     }
+    
+    SocketPipeTune(GetSocketSendPipe(Socket), 0);
+    SocketPipeTune(GetSocketRecvPipe(TargetSocket), Stalled);
     handle_set_activity((UUId_t)TargetSocket->Header.key, IOEVTIN);
     return OsSuccess;
 }
@@ -211,7 +315,7 @@ ProcessSocketPacket(
     Pointer += sizeof(struct packethdr);
     if (Packet->addresslen) {
         Address      = (struct sockaddr*)Pointer;
-        TargetSocket = GetSocketFromAddress(Address);
+        TargetSocket = GetCachedSocketFromAddress(Socket, Address);
         TRACE("[socket] [local] [process_packet] target address %s", &Address->sa_data[0]);
     }
     else {
@@ -251,6 +355,11 @@ HandleSocketPacketData(
     int             DoRead = 1;
     TRACE("[socket] [local] [send_packet]");
     
+    if (!SourceStream) {
+        return OsDoesNotExist;
+    }
+    
+    SocketPipeTune(GetSocketSendPipe(Socket), 0);
     BytesRead = SocketGetQueuedPacket(Socket, &Buffer);
     if (BytesRead) {
         DoRead = 0;
@@ -281,11 +390,15 @@ HandleSocketPacketData(
         }
         
         TargetSocket = ProcessSocketPacket(Socket, Buffer, BytesRead);
-        if (TargetSocket) {
+        if (TargetSocket && GetSocketRecvStream(TargetSocket)) {
             streambuffer_t* TargetStream = GetSocketRecvStream(TargetSocket);
-            size_t          BytesWritten = streambuffer_write_packet_start(TargetStream,
+            size_t          BytesWritten;
+            
+            SocketPipeTune(GetSocketRecvPipe(TargetSocket), 0);
+            BytesWritten = streambuffer_write_packet_start(TargetStream,
                 BytesRead, STREAMBUFFER_NO_BLOCK, &Base, &State);
             if (!BytesWritten) {
+                SocketPipeTune(GetSocketRecvPipe(TargetSocket), 1);
                 WARNING("[socket] [local] [send_packet] ran out of space in target stream, requested %" PRIuIN, BytesRead);
                 SocketSetQueuedPacket(Socket, Buffer, BytesRead);
                 break;
@@ -300,6 +413,7 @@ HandleSocketPacketData(
         }
         free(Buffer);
     }
+    SocketPipeTune(GetSocketSendPipe(Socket), 0);
     return OsSuccess;
 }
 
@@ -334,7 +448,7 @@ DomainLocalAllocateAddress(
     _In_ Socket_t* Socket)
 {
     AddressRecord_t* Record;
-    char             AddressBuffer[16];
+    int              Bucket;
     TRACE("[socket] [local] allocate address 0x%" PRIxIN " [%u]", 
         Socket, (UUId_t)Socket->Header.key);
     
@@ -350,18 +464,24 @@ DomainLocalAllocateAddress(
     }
     
     // Create a new address of the form /lc/{id}
-    sprintf(&AddressBuffer[0], "/lc/%u", (UUId_t)(uintptr_t)Socket->Header.key);
-    TRACE("[socket] [local] address created %s", &AddressBuffer[0]);
-    if (list_find(&AddressRegister, &AddressBuffer[0]) != NULL) {
-        ERROR("[socket] [local] address %s exists in register", &AddressBuffer[0]);
+    memset(&Record->Address[0], 0, LOCAL_ADDRESS_LENGTH);
+    sprintf(&Record->Address[0], "/lc/%u", (UUId_t)(uintptr_t)Socket->Header.key);
+    ELEMENT_INIT(&Record->Header, &Record->Address[0], Record);
+    Record->Socket = (UUId_t)(uintptr_t)Socket->Header.key;
+    TRACE("[socket] [local] address created %s", &Record->Address[0]);
+    
+    Bucket = GetAddressBucket(&Record->Address[0]);
+    mtx_lock(&AddressRegisterLocks[Bucket]);
+    if (GetRecordFromAddress(Bucket, &Record->Address[0]) != NULL) {
+        mtx_unlock(&AddressRegisterLocks[Bucket]);
+        ERROR("[socket] [local] address %s exists in register", &Record->Address[0]);
         free(Record);
         return OsExists;
     }
+    list_append(&AddressRegister[Bucket], &Record->Header);
+    mtx_unlock(&AddressRegisterLocks[Bucket]);
     
-    ELEMENT_INIT(&Record->Header, strdup(&AddressBuffer[0]), Record);
-    Record->Socket = Socket;
     Socket->Domain->Record = Record;
-    list_append(&AddressRegister, &Record->Header);
     return OsSuccess;
 }
 
@@ -369,9 +489,13 @@ static void
 DestroyAddressRecord(
     _In_ AddressRecord_t* Record)
 {
+    int Bucket = GetAddressBucket(&Record->Address[0]);
     TRACE("DestroyAddressRecord()");
-    list_remove(&AddressRegister, &Record->Header);
-    free(Record->Header.key);
+    
+    mtx_lock(&AddressRegisterLocks[Bucket]);
+    list_remove(&AddressRegister[Bucket], &Record->Header);
+    mtx_unlock(&AddressRegisterLocks[Bucket]);
+    atomic_fetch_add(&AddressGeneration, 1);
     free(Record);
 }
 
@@ -391,64 +515,61 @@ DomainLocalBind(
     _In_ Socket_t*              Socket,
     _In_ const struct sockaddr* Address)
 {
-    char* PreviousBuffer;
+    AddressRecord_t* Record = Socket->Domain->Record;
+    int              PreviousBucket;
+    int              Bucket;
     TRACE("[domain] [local] [bind] %s", &Address->sa_data[0]);
     
-    if (!Socket->Domain->Record) {
+    if (!Record) {
         ERROR("[domain] [local] [bind] no record");
         return OsError; // Should not happen tho
     }
     
-    if (list_find(&AddressRegister, (void*)&Address->sa_data[0]) != NULL) {
-        ERROR("[domain] [local] [bind] address already bound");
-        return OsExists;
+    if (strnlen(&Address->sa_data[0], LOCAL_ADDRESS_LENGTH) == LOCAL_ADDRESS_LENGTH) {
+        return OsInvalidParameters;
     }
     
-    // Update key
-    PreviousBuffer = (char*)Socket->Domain->Record->Header.key;
-    Socket->Domain->Record->Header.key = strdup(&Address->sa_data[0]);
-    free(PreviousBuffer);
-    return OsSuccess;
-}
-
-static ConnectionRequest_t*
-CreateConnectionRequest(
-    _In_ UUId_t                      sourceSocketHandle,
-    _In_ struct gracht_recv_message* message)
-{
-    ConnectionRequest_t* request = malloc(sizeof(ConnectionRequest_t));
-    if (!request) {
-        return NULL;
+    // The check and the move of the record must happen under both bucket locks,
+    // which are taken in order to not deadlock with another bind
+    PreviousBucket = GetAddressBucket(&Record->Address[0]);
+    Bucket         = GetAddressBucket(&Address->sa_data[0]);
+    mtx_lock(&AddressRegisterLocks[MIN(PreviousBucket, Bucket)]);
+    if (PreviousBucket != Bucket) {
+        mtx_lock(&AddressRegisterLocks[MAX(PreviousBucket, Bucket)]);
     }
     
-    ELEMENT_INIT(&request->Header, 0, request);
-    request->SourceSocketHandle = sourceSocketHandle;
-    gracht_vali_message_defer_response(&request->Response, message);
-    return request;
-}
-
-static AcceptRequest_t*
-CreateAcceptRequest(
-    _In_ struct gracht_recv_message* message)
-{
-    AcceptRequest_t* request = malloc(sizeof(AcceptRequest_t));
-    if (!request) {
-        return NULL;
+    if (GetRecordFromAddress(Bucket, &Address->sa_data[0]) != NULL) {
+        ERROR("[domain] [local] [bind] address already bound");
+        if (PreviousBucket != Bucket) {
+            mtx_unlock(&AddressRegisterLocks[MAX(PreviousBucket, Bucket)]);
+        }
+        mtx_unlock(&AddressRegisterLocks[MIN(PreviousBucket, Bucket)]);
+        return OsExists;
     }
     
-    ELEMENT_INIT(&request->Header, 0, request);
-    gracht_vali_message_defer_response(&request->Response, message);
-    return request;
+    // Update key, the record must move to the bucket of the new address
+    list_remove(&AddressRegister[PreviousBucket], &Record->Header);
+    strcpy(&Record->Address[0], &Address->sa_data[0]);
+    list_append(&AddressRegister[Bucket], &Record->Header);
+    atomic_fetch_add(&AddressGeneration, 1);
+    
+    if (PreviousBucket != Bucket) {
+        mtx_unlock(&AddressRegisterLocks[MAX(PreviousBucket, Bucket)]);
+    }
+    mtx_unlock(&AddressRegisterLocks[MIN(PreviousBucket, Bucket)]);
+    return OsSuccess;
 }
 
 static void
 AcceptConnectionRequest(
     _In_ struct gracht_recv_message* acceptMessage,
+    _In_ Socket_t*                   listenSocket,
     _In_ Socket_t*                   connectSocket,
     _In_ struct gracht_recv_message* connectMessage)
 {
-    UUId_t                  handle, recv_handle, send_handle;
+    UUId_t                  handle, send_handle, recv_handle;
     struct sockaddr_storage address;
+    Socket_t*               acceptSocket;
     OsStatus_t              status;
     
     TRACE("[net_manager] [accept_request]");
@@ -457,12 +578,21 @@ AcceptConnectionRequest(
     DomainLocalGetAddress(connectSocket, SVC_SOCKET_GET_ADDRESS_SOURCE_THIS, (struct sockaddr*)&address);
     
     // Create a new socket for the acceptor. This socket will be paired with
-    // the connector socket.
+    // the connector socket, and is handed the pipes of the connector crossed over,
+    // so it writes into the receive stream of the connector and reads from its
+    // send stream. The data then never passes through the network manager.
     status = NetworkManagerSocketCreate(connectSocket->DomainType,
-        connectSocket->Type, connectSocket->Protocol, &handle,
-        &recv_handle, &send_handle);
+        connectSocket->Type, connectSocket->Protocol,
+        (UUId_t)(uintptr_t)connectSocket->Header.key, &handle,
+        &send_handle, &recv_handle);
     if (status == OsSuccess) {
         NetworkManagerSocketPair(handle, (UUId_t)(uintptr_t)connectSocket->Header.key);
+        
+        acceptSocket = NetworkManagerSocketGet(handle);
+        if (acceptSocket) {
+            acceptSocket->Domain->DirectPipes  = 1;
+            connectSocket->Domain->DirectPipes = 1;
+        }
     }
     
     // Reply to the connector (the thread that called connect())
@@ -470,51 +600,7 @@ AcceptConnectionRequest(
     
     // Reply to the accepter (the thread that called accept())
     svc_socket_accept_response(acceptMessage, status, (struct sockaddr*)&address,
-        handle, recv_handle, send_handle);
-}
-
-static OsStatus_t
-HandleLocalConnectionRequest(
-    _In_ struct gracht_recv_message* message,
-    _In_ Socket_t*                   sourceSocket,
-    _In_ Socket_t*                   targetSocket)
-{
-    ConnectionRequest_t* connectionRequest;
-    AcceptRequest_t*     acceptRequest;
-    element_t*           element;
-    
-    TRACE("[domain] [local] [handle_connect] %u => %u",
-        LODWORD(sourceSocket->Header.key), LODWORD(targetSocket->Header.key));
-    
-    // Check for active accept requests, otherwise we need to queue it up. If the backlog
-    // is full, we need to reject the connection request.
-    mtx_lock(&targetSocket->SyncObject);
-    element = queue_pop(&targetSocket->AcceptRequests);
-    if (!element) {
-        TRACE("[domain] [local] [handle_connect] creating request");
-        connectionRequest = CreateConnectionRequest((UUId_t)(uintptr_t)sourceSocket->Header.key, message);
-        if (!connectionRequest) {
-            mtx_unlock(&targetSocket->SyncObject);
-            ERROR("[domain] [local] [handle_connect] failed to allocate memory for connection request");
-            return OsOutOfMemory;
-        }
-        
-        // TODO If the backlog is full, reject
-        // return OsConnectionRefused
-        queue_push(&targetSocket->ConnectionRequests, &connectionRequest->Header);
-        handle_set_activity((UUId_t)(uintptr_t)targetSocket->Header.key, IOEVTCTL);
-    }
-    mtx_unlock(&targetSocket->SyncObject);
-    
-    // Handle the accept request we popped earlier here, this means someone
-    // has called accept() on the socket and is actively waiting
-    if (element) {
-        acceptRequest = element->value;
-        AcceptConnectionRequest(&acceptRequest->Response.recv_message,
-            sourceSocket, message);
-        free(acceptRequest);
-    }
-    return OsSuccess;
+        handle, send_handle, recv_handle);
 }
 
 static OsStatus_t
@@ -538,7 +624,7 @@ DomainLocalConnect(
     }
     
     if (socket->Type == SOCK_STREAM || socket->Type == SOCK_SEQPACKET) {
-        return HandleLocalConnectionRequest(message, socket, target);
+        return DomainQueueConnectionRequest(message, socket, target, AcceptConnectionRequest);
     }
     else {
         // Don't handle this scenario. It is handled locally in libc
@@ -571,48 +657,7 @@ DomainLocalAccept(
     _In_ struct gracht_recv_message* message,
     _In_ Socket_t*                   socket)
 {
-    Socket_t*            connectSocket;
-    ConnectionRequest_t* connectionRequest;
-    AcceptRequest_t*     acceptRequest;
-    element_t*           element;
-    OsStatus_t           status = OsSuccess;
-    TRACE("[domain] [local] [accept] %u", LODWORD(socket->Header.key));
-    
-    // Check if there is any requests available
-    mtx_lock(&socket->SyncObject);
-    element = queue_pop(&socket->ConnectionRequests);
-    if (element) {
-        mtx_unlock(&socket->SyncObject);
-        connectionRequest = element->value;
-        
-        // Lookup the socket handle, to check if it is still valid
-        connectSocket = NetworkManagerSocketGet(connectionRequest->SourceSocketHandle);
-        if (connectSocket) {
-            AcceptConnectionRequest(message, connectSocket,
-                &connectionRequest->Response.recv_message);
-        }
-        else {
-            status = OsConnectionAborted;
-        }
-        free(connectionRequest);
-    }
-    else {
-        // Only wait if configured to blocking, otherwise return OsBusy ish
-        if (socket->Configuration.Blocking) {
-            acceptRequest = CreateAcceptRequest(message);
-            if (acceptRequest) {
-                queue_push(&socket->AcceptRequests, &acceptRequest->Header);
-            }
-            else {
-                status = OsOutOfMemory;
-            }
-        }
-        else {
-            status = OsBusy; // TODO: OsTryAgain
-        }
-        mtx_unlock(&socket->SyncObject);
-    }
-    return status;
+    return DomainQueueAcceptRequest(message, socket, AcceptConnectionRequest);
 }
 
 static void
@@ -658,6 +703,7 @@ DomainLocalCreate(
         return OsOutOfMemory;
     }
     TRACE("DomainLocalCreate()");
+    call_once(&AddressRegisterOnce, InitializeAddressRegister);
     
     // Setup operations
     Domain->Ops.AddressAllocate = DomainLocalAllocateAddress;
@@ -674,6 +720,8 @@ DomainLocalCreate(
     
     Domain->ConnectedSocket = UUID_INVALID;
     Domain->Record          = NULL;
+    Domain->DirectPipes     = 0;
+    Domain->CachedTarget    = UUID_INVALID;
     
     *DomainOut = Domain;
     return OsSuccess;
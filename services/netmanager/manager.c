@@ -31,6 +31,7 @@
 #include <inet/local.h>
 #include <io_events.h>
 #include "manager.h"
+#include <os/mollenos.h>
 #include "socket.h"
 #include <stdlib.h>
 #include <string.h>
@@ -38,11 +39,43 @@
 
 #include "svc_socket_protocol_server.h"
 
+// Sockets are spread over a number of monitors that each wait on their own
+// handle set. A socket always lands on the same monitor, so events for one
+// socket are handled in order by a single thread.
+typedef struct SocketMonitor {
+    UUId_t HandleSet;
+    thrd_t Thread;
+    int    Index;
+} SocketMonitor_t;
+
 // This socket tree contains all the local system sockets that were created by
 // this machine. All remote sockets are maintained by the domains
-static rb_tree_t Sockets;
-static UUId_t    SocketSet;
-static thrd_t    SocketMonitorHandle;
+static rb_tree_t       Sockets;
+static SocketMonitor_t Monitors[NETWORK_MANAGER_MONITOR_MAX_COUNT];
+static int             MonitorCount;
+
+static SocketMonitor_t*
+GetSocketMonitor(
+    _In_ UUId_t Handle)
+{
+    // Handles are handed out sequentially, mix them so neighbours are spread
+    uint32_t Hash = (uint32_t)Handle * 2654435761U;
+    return &Monitors[(Hash >> 16) % MonitorCount];
+}
+
+static int
+GetMonitorCount(void)
+{
+    SystemDescriptor_t Descriptor;
+    int                Count;
+
+    if (SystemQuery(&Descriptor) != OsSuccess) {
+        return 1;
+    }
+
+    Count = (int)Descriptor.NumberOfActiveCores;
+    return MAX(1, MIN(Count, NETWORK_MANAGER_MONITOR_MAX_COUNT));
+}
 
 /////////////////////////////////////////////////////
 // APPLICATIONS => NetworkService
@@ -105,14 +138,14 @@ static int
 SocketMonitor(
     _In_ void* Context)
 {
-    int             RunForever = 1;
-    handle_event_t* Events;
-    int             EventCount;
-    int             i;
-    OsStatus_t      Status;
+    SocketMonitor_t* Monitor    = Context;
+    int              RunForever = 1;
+    handle_event_t*  Events;
+    int              EventCount;
+    int              i;
+    OsStatus_t       Status;
     
-    _CRT_UNUSED(Context);
-    TRACE("[socket monitor] starting");
+    TRACE("[socket monitor] starting %i", Monitor->Index);
     
     Events = malloc(sizeof(handle_event_t) * NETWORK_MANAGER_MONITOR_MAX_EVENTS);
     if (!Events) {
@@ -120,7 +153,7 @@ SocketMonitor(
     }
     
     while (RunForever) {
-        Status = handle_set_wait(SocketSet, Events,
+        Status = handle_set_wait(Monitor->HandleSet, Events,
             NETWORK_MANAGER_MONITOR_MAX_EVENTS, 0, &EventCount);
         if (Status != OsSuccess) {
             ERROR("[socket_monitor] WaitForHandleSet FAILED: %u", Status);
@@ -145,45 +178,42 @@ SocketMonitor(
 // The recv buffer is split up into frames of N size (determined by max-packet 
 // from the driver), and queued up for listening.
 
-// network_monitor thread:
-// 1. Receive tx event
-// 2. Check if the tx event matches a socket that has data pending for tx
-static int
-NetworkMonitor(
-    _In_ void* Context)
-{
-    int RunForever = 1;
-    
-    while (RunForever) {
-        
-    }
-    return 0;
-}
+// Adapters get no thread of their own. Their tx and rx events are meant to be
+// added to the handle set of a socket monitor once they register, so frames
+// are processed when the driver signals them instead of by polling.
 
 OsStatus_t
 NetworkManagerInitialize(void)
 {
     OsStatus_t Status;
     int        Code;
+    int        i;
     TRACE("[net_manager] initialize");
     
     rb_tree_construct(&Sockets);
-    Status = handle_set_create(0, &SocketSet);
-    if (Status != OsSuccess) {
-        ERROR("[net_manager] failed to create socket handle set");
-        return Status;
+    
+    // Spawn a socket monitor per core, all sets must exist before the first
+    // socket can be created
+    MonitorCount = GetMonitorCount();
+    for (i = 0; i < MonitorCount; i++) {
+        Monitors[i].Index = i;
+        Status = handle_set_create(0, &Monitors[i].HandleSet);
+        if (Status != OsSuccess) {
+            ERROR("[net_manager] failed to create socket handle set");
+            return Status;
+        }
     }
     
-    // Spawn the socket monitor thread, the network monitor threads are
-    // only spawned once a network card is registered.
-    TRACE("[net_manager] creating thread");
-    Code = thrd_create(&SocketMonitorHandle, SocketMonitor, NULL);
-    if (Code != thrd_success) {
-        ERROR("[net_manager] thrd_create failed %i", Code);
-        return OsError;
+    TRACE("[net_manager] creating %i threads", MonitorCount);
+    for (i = 0; i < MonitorCount; i++) {
+        Code = thrd_create(&Monitors[i].Thread, SocketMonitor, &Monitors[i]);
+        if (Code != thrd_success) {
+            ERROR("[net_manager] thrd_create failed %i", Code);
+            return OsError;
+        }
     }
     TRACE("[net_manager] done");
-    return Status;
+    return OsSuccess;
 }
 
 OsStatus_t
@@ -191,12 +221,15 @@ NetworkManagerSocketCreate(
     _In_  int     Domain,
     _In_  int     Type,
     _In_  int     Protocol,
+    _In_  UUId_t  PipePeer,
     _Out_ UUId_t* HandleOut,
     _Out_ UUId_t* SendBufferHandleOut,
     _Out_ UUId_t* RecvBufferHandleOut)
 {
-    Socket_t*  Socket;
-    OsStatus_t Status;
+    Socket_t*     Socket;
+    SocketPipe_t* SendPipe;
+    SocketPipe_t* RecvPipe;
+    OsStatus_t    Status;
     
     TRACE("[net_manager] [create] %i, %i, %i", Domain, Type, Protocol);
     
@@ -205,15 +238,24 @@ NetworkManagerSocketCreate(
         return OsInvalidParameters;
     }
     
-    Status = SocketCreateImpl(Domain, Type, Protocol, &Socket);
+    Status = SocketCreateImpl(Domain, Type, Protocol, PipePeer, &Socket);
     if (Status != OsSuccess) {
         WARNING("SocketCreateImpl failed with %u", Status);
         return Status;
     }
     
+    // Sockets with a pipe peer have no pipes of their own, so resolve the pipes
+    // the socket uses before the handles are given out
+    SendPipe = GetSocketSendPipe(Socket);
+    RecvPipe = GetSocketRecvPipe(Socket);
+    if (!SendPipe || !RecvPipe) {
+        (void)SocketShutdownImpl(Socket, SVC_SOCKET_CLOSE_OPTIONS_DESTROY);
+        return OsDoesNotExist;
+    }
+    
     // Add it to the handle set
-    Status = handle_set_ctrl(SocketSet, IO_EVT_DESCRIPTOR_ADD,
-        (UUId_t)(uintptr_t)Socket->Header.key, IOEVTIN | IOEVTOUT, NULL);
+    Status = handle_set_ctrl(GetSocketMonitor((UUId_t)(uintptr_t)Socket->Header.key)->HandleSet,
+        IO_EVT_DESCRIPTOR_ADD, (UUId_t)(uintptr_t)Socket->Header.key, IOEVTIN | IOEVTOUT, NULL);
     if (Status != OsSuccess) {
         // what the fuck TODO
         assert(0);
@@ -221,8 +263,8 @@ NetworkManagerSocketCreate(
     
     rb_tree_append(&Sockets, &Socket->Header);
     *HandleOut           = (UUId_t)(uintptr_t)Socket->Header.key;
-    *SendBufferHandleOut = Socket->Send.DmaAttachment.handle;
-    *RecvBufferHandleOut = Socket->Receive.DmaAttachment.handle;
+    *SendBufferHandleOut = SendPipe->DmaAttachment.handle;
+    *RecvBufferHandleOut = RecvPipe->DmaAttachment.handle;
     TRACE("[net_manager] [create] => %u", *HandleOut);
     return Status;
 }
@@ -231,7 +273,7 @@ void svc_socket_create_callback(struct gracht_recv_message* message, struct svc_
 {
     UUId_t     handle, recv_handle, send_handle;
     OsStatus_t status = NetworkManagerSocketCreate(args->domain, args->type, args->protocol,
-        &handle, &recv_handle, &send_handle);
+        UUID_INVALID, &handle, &recv_handle, &send_handle);
     svc_socket_create_response(message, status, handle, recv_handle, send_handle);
 }
 
@@ -259,7 +301,8 @@ NetworkManagerSocketShutdown(
             return OsDoesNotExist;
         }
         
-        Status = handle_set_ctrl(SocketSet, IO_EVT_DESCRIPTOR_DEL, Handle, 0, NULL);
+        Status = handle_set_ctrl(GetSocketMonitor(Handle)->HandleSet,
+            IO_EVT_DESCRIPTOR_DEL, Handle, 0, NULL);
         if (Status != OsSuccess) {
             ERROR("[net_manager] [shutdown] failed to remove handle %u from socket set", Handle);
         }
@@ -34,6 +34,7 @@ typedef struct Socket Socket_t;
 typedef struct SocketDescriptor SocketDescriptor_t;
 
 #define NETWORK_MANAGER_MONITOR_MAX_EVENTS 32
+#define NETWORK_MANAGER_MONITOR_MAX_COUNT  8
 
 OsStatus_t
 NetworkManagerInitialize(void);
@@ -43,6 +44,7 @@ NetworkManagerSocketCreate(
     _In_  int     Domain,
     _In_  int     Type,
     _In_  int     Protocol,
+    _In_  UUId_t  PipePeer,
     _Out_ UUId_t* HandleOut,
     _Out_ UUId_t* SendBufferHandleOut,
     _Out_ UUId_t* RecvBufferHandleOut);
@@ -27,9 +27,11 @@
 #include <ddk/handle.h>
 #include <ddk/utils.h>
 #include "domains/domains.h"
+#include "manager.h"
 #include "socket.h"
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
 
 #include "svc_socket_protocol_server.h"
 
@@ -37,23 +39,25 @@
 // TODO recv pipe should have STREAMBUFFER_MULTIPLE_READERS only
 static void
 InitializeStreambuffer(
-    _In_ streambuffer_t* Stream)
+    _In_ streambuffer_t* Stream,
+    _In_ size_t          Size)
 {
-    size_t       ActualBufferSize = SOCKET_DEFAULT_BUFFER_SIZE - sizeof(streambuffer_t);
+    size_t       ActualBufferSize = Size - sizeof(streambuffer_t);
     unsigned int BufferOptions    = STREAMBUFFER_MULTIPLE_READERS | STREAMBUFFER_MULTIPLE_WRITERS | STREAMBUFFER_GLOBAL;
     streambuffer_construct(Stream, ActualBufferSize, BufferOptions);
 }
 
 static OsStatus_t
 CreateSocketPipe(
-    _In_ SocketPipe_t* Pipe)
+    _In_ SocketPipe_t* Pipe,
+    _In_ int           Type)
 {
     struct dma_buffer_info Buffer;
     OsStatus_t             Status;
     TRACE("CreateSocketPipe()");
     
     Buffer.name     = "socket_buffer";
-    Buffer.length   = SOCKET_DEFAULT_BUFFER_SIZE;
+    Buffer.length   = (Type == SOCK_STREAM) ? SOCKET_MINIMUM_BUFFER_SIZE : SOCKET_DEFAULT_BUFFER_SIZE;
     Buffer.capacity = SOCKET_SYSMAX_BUFFER_SIZE; // Should be from global settings
     Buffer.flags    = 0;
     
@@ -62,8 +66,125 @@ CreateSocketPipe(
         return Status;
     }
     
-    Pipe->Stream = Pipe->DmaAttachment.buffer;
-    InitializeStreambuffer(Pipe->Stream);
+    Pipe->Stream     = Pipe->DmaAttachment.buffer;
+    Pipe->Limit      = SOCKET_SYSMAX_BUFFER_SIZE;
+    Pipe->TargetSize = Buffer.length;
+    Pipe->AutoTune   = 1;
+    Pipe->Tuning     = ATOMIC_VAR_INIT(0);
+    InitializeStreambuffer(Pipe->Stream, Buffer.length);
+    return OsSuccess;
+}
+
+static inline size_t
+GetSocketPipeSize(
+    _In_ SocketPipe_t* Pipe)
+{
+    return Pipe->Stream->capacity + sizeof(streambuffer_t);
+}
+
+// The memory of the pipe is grown first, which maps the new pages for all users of
+// the pipe, and then the stream. The stream refuses to grow while it is in use, in which
+// case the resize is retried the next time the pipe is tuned.
+static void
+ApplySocketPipeSize(
+    _In_ SocketPipe_t* Pipe)
+{
+    OsStatus_t Status;
+    
+    if (Pipe->TargetSize <= GetSocketPipeSize(Pipe)) {
+        return;
+    }
+    
+    if (Pipe->DmaAttachment.length < Pipe->TargetSize) {
+        Status = dma_attachment_resize(&Pipe->DmaAttachment, Pipe->TargetSize);
+        if (Status != OsSuccess) {
+            WARNING("[socket] [tune] failed to grow pipe to %" PRIuIN " bytes [%u]",
+                Pipe->TargetSize, Status);
+            Pipe->TargetSize = GetSocketPipeSize(Pipe);
+            return;
+        }
+    }
+    
+    Status = streambuffer_resize(Pipe->Stream, Pipe->TargetSize - sizeof(streambuffer_t));
+    if (Status == OsSuccess) {
+        TRACE("[socket] [tune] pipe grown to %" PRIuIN " bytes", Pipe->TargetSize);
+    }
+}
+
+void
+SocketPipeTune(
+    _In_ SocketPipe_t* Pipe,
+    _In_ int           Stalled)
+{
+    size_t Capacity;
+    size_t Size;
+    
+    if (!Pipe) {
+        return;
+    }
+    
+    // Pipes can be tuned from the monitor of every socket that writes to them
+    if (atomic_exchange(&Pipe->Tuning, 1)) {
+        return;
+    }
+    
+    Capacity = Pipe->Stream->capacity;
+    if (Pipe->AutoTune && (Stalled || streambuffer_bytes_readable(Pipe->Stream) >= ((Capacity * 3) / 4))) {
+        Size = MIN(GetSocketPipeSize(Pipe) * 2, Pipe->Limit);
+        if (Size > Pipe->TargetSize) {
+            Pipe->TargetSize = Size;
+        }
+    }
+    ApplySocketPipeSize(Pipe);
+    atomic_store(&Pipe->Tuning, 0);
+}
+
+// Setting the size explicitly disables auto-tuning of the pipe. Pipes can not shrink,
+// so a size below the current one only stops further growth.
+static OsStatus_t
+SetSocketPipeSize(
+    _In_ SocketPipe_t* Pipe,
+    _In_ const void*   Data,
+    _In_ socklen_t     DataLength)
+{
+    size_t Size;
+    
+    if (!Pipe) {
+        return OsDoesNotExist;
+    }
+    
+    if (!Data || DataLength < sizeof(int) || *((const int*)Data) <= 0) {
+        return OsInvalidParameters;
+    }
+    
+    Size = (size_t)*((const int*)Data);
+    Size = ALIGN(Size, 0x1000, 1);
+    Size = MAX(SOCKET_MINIMUM_BUFFER_SIZE, MIN(Size, SOCKET_SYSMAX_BUFFER_SIZE));
+    
+    while (atomic_exchange(&Pipe->Tuning, 1)) {
+        thrd_yield();
+    }
+    
+    Pipe->AutoTune   = 0;
+    Pipe->Limit      = Size;
+    Pipe->TargetSize = MAX(Size, GetSocketPipeSize(Pipe));
+    ApplySocketPipeSize(Pipe);
+    atomic_store(&Pipe->Tuning, 0);
+    return OsSuccess;
+}
+
+static OsStatus_t
+GetSocketPipeSizeOption(
+    _In_  SocketPipe_t* Pipe,
+    _In_  void*         Data,
+    _Out_ socklen_t*    DataLengthOut)
+{
+    if (!Pipe) {
+        return OsDoesNotExist;
+    }
+    
+    *((int*)Data)  = (int)MAX(Pipe->TargetSize, GetSocketPipeSize(Pipe));
+    *DataLengthOut = sizeof(int);
     return OsSuccess;
 }
 
@@ -88,6 +209,7 @@ SocketCreateImpl(
     _In_  int        Domain,
     _In_  int        Type,
     _In_  int        Protocol,
+    _In_  UUId_t     PipePeer,
     _Out_ Socket_t** SocketOut)
 {
     Socket_t*  Socket;
@@ -106,6 +228,7 @@ SocketCreateImpl(
     Socket->DomainType          = Domain;
     Socket->Type                = Type;
     Socket->Protocol            = Protocol;
+    Socket->PipePeer            = PipePeer;
     SetDefaultConfiguration(&Socket->Configuration);
     
     mtx_init(&Socket->SyncObject, mtx_plain);
@@ -136,7 +259,13 @@ SocketCreateImpl(
         return Status;
     }
     
-    Status = CreateSocketPipe(&Socket->Receive);
+    // The pipes of a socket with a pipe peer are never used, so they are not allocated
+    if (PipePeer != UUID_INVALID) {
+        *SocketOut = Socket;
+        return OsSuccess;
+    }
+    
+    Status = CreateSocketPipe(&Socket->Receive, Type);
     if (Status != OsSuccess) {
         ERROR("Failed to initialize the socket receive pipe");
         DomainDestroy(Socket->Domain);
@@ -145,7 +274,7 @@ SocketCreateImpl(
         return Status;
     }
     
-    Status = CreateSocketPipe(&Socket->Send);
+    Status = CreateSocketPipe(&Socket->Send, Type);
     if (Status != OsSuccess) {
         ERROR("Failed to initialize the socket send pipe");
         DomainDestroy(Socket->Domain);
@@ -172,8 +301,10 @@ SocketShutdownImpl(
         
         mtx_destroy(&Socket->SyncObject);
         DomainDestroy(Socket->Domain);
-        DestroySocketPipe(&Socket->Receive);
-        DestroySocketPipe(&Socket->Send);
+        if (Socket->PipePeer == UUID_INVALID) {
+            DestroySocketPipe(&Socket->Receive);
+            DestroySocketPipe(&Socket->Send);
+        }
         (void)handle_destroy((UUId_t)(uintptr_t)Socket->Header.key);
         free(Socket);
         return OsSuccess;
@@ -215,6 +346,22 @@ SetSocketOptionImpl(
     _In_ const void*      Data,
     _In_ socklen_t        DataLength)
 {
+    if (Protocol != SOL_SOCKET) {
+        return OsNotSupported;
+    }
+    
+    // The pipes of accepted sockets are shared with the peer, sizing one of them
+    // sizes the opposite pipe of the peer as well
+    switch (Option) {
+        case SO_SNDBUF: {
+            return SetSocketPipeSize(GetSocketSendPipe(Socket), Data, DataLength);
+        }
+        case SO_RCVBUF: {
+            return SetSocketPipeSize(GetSocketRecvPipe(Socket), Data, DataLength);
+        }
+        default:
+            break;
+    }
     return OsNotSupported;
 }
     
@@ -226,21 +373,63 @@ GetSocketOptionImpl(
     _In_  void*            Data,
     _Out_ socklen_t*       DataLengthOut)
 {
+    if (Protocol != SOL_SOCKET) {
+        return OsNotSupported;
+    }
+    
+    switch (Option) {
+        case SO_SNDBUF: {
+            return GetSocketPipeSizeOption(GetSocketSendPipe(Socket), Data, DataLengthOut);
+        }
+        case SO_RCVBUF: {
+            return GetSocketPipeSizeOption(GetSocketRecvPipe(Socket), Data, DataLengthOut);
+        }
+        default:
+            break;
+    }
     return OsNotSupported;
 }
 
+SocketPipe_t*
+GetSocketSendPipe(
+    _In_ Socket_t* Socket)
+{
+    Socket_t* Peer;
+    
+    if (Socket->PipePeer == UUID_INVALID) {
+        return &Socket->Send;
+    }
+    Peer = NetworkManagerSocketGet(Socket->PipePeer);
+    return Peer ? &Peer->Receive : NULL;
+}
+
+SocketPipe_t*
+GetSocketRecvPipe(
+    _In_ Socket_t* Socket)
+{
+    Socket_t* Peer;
+    
+    if (Socket->PipePeer == UUID_INVALID) {
+        return &Socket->Receive;
+    }
+    Peer = NetworkManagerSocketGet(Socket->PipePeer);
+    return Peer ? &Peer->Send : NULL;
+}
+
 streambuffer_t*
 GetSocketSendStream(
     _In_ Socket_t* Socket)
 {
-    return (streambuffer_t*)Socket->Send.Stream;
+    SocketPipe_t* Pipe = GetSocketSendPipe(Socket);
+    return Pipe ? (streambuffer_t*)Pipe->Stream : NULL;
 }
 
 streambuffer_t*
 GetSocketRecvStream(
     _In_ Socket_t* Socket)
 {
-    return (streambuffer_t*)Socket->Receive.Stream;
+    SocketPipe_t* Pipe = GetSocketRecvPipe(Socket);
+    return Pipe ? (streambuffer_t*)Pipe->Stream : NULL;
 }
 
 OsStatus_t
@@ -33,6 +33,9 @@
 #include <os/dmabuf.h>
 #include <os/osdefs.h>
 
+// Stream pipes start small and are grown on demand, packet pipes start at the default
+// size as a packet must fit the pipe as a whole
+#define SOCKET_MINIMUM_BUFFER_SIZE (4 * 4096)
 #define SOCKET_DEFAULT_BUFFER_SIZE (16 * 4096)
 #define SOCKET_SYSMAX_BUFFER_SIZE  (256 * 4096)
 
@@ -54,6 +57,10 @@ typedef struct QueuedPacket {
 typedef struct SocketPipe {
     struct dma_attachment DmaAttachment;
     streambuffer_t*       Stream;
+    size_t                Limit;
+    size_t                TargetSize;
+    int                   AutoTune;
+    _Atomic(int)          Tuning;
 } SocketPipe_t;
 
 typedef struct Socket {
@@ -69,6 +76,7 @@ typedef struct Socket {
     SocketDomain_t*       Domain;
     SocketPipe_t          Send;
     SocketPipe_t          Receive;
+    UUId_t                PipePeer;     // Set when the pipes used are the peer's, crossed over
     QueuedPacket_t        QueuedPacket;
     queue_t               ConnectionRequests;
     queue_t               AcceptRequests;
@@ -76,12 +84,15 @@ typedef struct Socket {
 
 /* SocketCreateImpl
  * Creates and initializes a new socket of default options. The socket
- * will be assigned an temporary address, and resource will be allocated. */
+ * will be assigned an temporary address, and resource will be allocated. Sockets
+ * created with a pipe peer use the pipes of the peer crossed over, and have none
+ * of their own. */
 OsStatus_t
 SocketCreateImpl(
     _In_  int              Domain,
     _In_  int              Type,
     _In_  int              Protocol,
+    _In_  UUId_t           PipePeer,
     _Out_ Socket_t**       SocketOut);
 
 /* SocketShutdownImpl
@@ -123,6 +134,29 @@ GetSocketOptionImpl(
     _In_  void*            Data,
     _Out_ socklen_t*       DataLengthOut);
 
+/* SocketPipeTune
+ * Auto-tunes the size of a pipe that data was just moved through. A pipe that is found
+ * running full, or that a write into stalled on, is grown towards its limit. Growth can
+ * only be applied while the pipe is empty, until then it is kept pending. */
+void
+SocketPipeTune(
+    _In_ SocketPipe_t* Pipe,
+    _In_ int           Stalled);
+
+/* GetSocketSendPipe
+ * Resolves the pipe the socket writes into. Accepted sockets write into the receive
+ * pipe of their peer, so the returned pipe is NULL if the peer is gone. */
+SocketPipe_t*
+GetSocketSendPipe(
+    _In_ Socket_t* Socket);
+
+/* GetSocketRecvPipe
+ * Resolves the pipe the socket reads from. Accepted sockets read from the send pipe
+ * of their peer, so the returned pipe is NULL if the peer is gone. */
+SocketPipe_t*
+GetSocketRecvPipe(
+    _In_ Socket_t* Socket);
+
 streambuffer_t*
 GetSocketSendStream(
     _In_ Socket_t* Socket);
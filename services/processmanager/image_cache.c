@@ -0,0 +1,606 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager - Image Cache
+ * - Keeps recently loaded image files in memory, so spawning the same executable
+ *   or loading the same library again does not read it from disk again.
+ */
+//#define __TRACE
+
+#include <ds/list.h>
+#include <ds/mstring.h>
+#include <ddk/memory.h>
+#include <ddk/utils.h>
+#include <errno.h>
+#include "image_cache.h"
+#include <os/dmabuf.h>
+#include <os/mollenos.h>
+#include <os/spinlock.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The cache never keeps more than this in unused images, and never more than a
+// fraction of the memory that is still available in the system.
+#define IMAGE_CACHE_MAX_SIZE        (32 * 1024 * 1024)
+#define IMAGE_CACHE_MEMORY_FRACTION 8
+
+// The shared sections of an image are prepared by the first memory space that loads
+// the image after it was cached. Loads in other spaces map private pages meanwhile.
+#define IMAGE_SECTIONS_NONE     0
+#define IMAGE_SECTIONS_BUILDING 1
+#define IMAGE_SECTIONS_READY    2
+#define IMAGE_SECTIONS_FAILED   3
+
+// A read-only section of an image at a stable base. Its pages are relocated once and
+// mapped into every memory space that loads the image.
+typedef struct ImageSection {
+    element_t             Header;
+    uintptr_t             Address;
+    size_t                Length;
+    Flags_t               Flags;
+    struct dma_attachment Memory;
+} ImageSection_t;
+
+typedef struct ImageCacheEntry {
+    element_t       Header;
+    MString_t*      Path;
+    uint64_t        FileSize;
+    struct timespec ModifiedAt;
+    void*           Buffer;
+    size_t          Length;
+    int             References;
+    unsigned int    LastUsed;
+    int             Stale;
+    int             Verified;
+    list_t          Sections;
+    size_t          SectionBytes;
+    int             SectionState;
+    UUId_t          SectionBuilder;
+} ImageCacheEntry_t;
+
+// Unmapping the shared sections does not release their pages, so a memory space keeps
+// a reference on every image whose sections it has mapped until it is released.
+typedef struct ImageSpaceUse {
+    element_t          Header;
+    UUId_t             MemorySpace;
+    ImageCacheEntry_t* Entry;
+} ImageSpaceUse_t;
+
+static list_t       CachedImages = LIST_INIT_CMP(list_cmp_string);
+static list_t       StaleImages  = LIST_INIT;
+static spinlock_t   CacheLock    = _SPN_INITIALIZER_NP(spinlock_plain);
+static size_t       CacheSize    = 0;
+static unsigned int CacheTick    = 0;
+static list_t       SpaceUses    = LIST_INIT;
+
+static void
+DestroySection(
+    _In_ element_t* Element,
+    _In_ void*      Context)
+{
+    ImageSection_t* Section = Element->value;
+    _CRT_UNUSED(Context);
+
+    dma_attachment_unmap(&Section->Memory);
+    dma_detach(&Section->Memory);
+    free(Section);
+}
+
+static void
+DestroyEntry(
+    _In_ ImageCacheEntry_t* Entry)
+{
+    list_clear(&Entry->Sections, DestroySection, NULL);
+    MStringDestroy(Entry->Path);
+    free(Entry->Buffer);
+    free(Entry);
+}
+
+static int
+IsEntryCurrent(
+    _In_ ImageCacheEntry_t*  Entry,
+    _In_ OsFileDescriptor_t* FileStats)
+{
+    return Entry->FileSize == FileStats->Size.QuadPart &&
+        Entry->ModifiedAt.tv_sec == FileStats->ModifiedAt.tv_sec &&
+        Entry->ModifiedAt.tv_nsec == FileStats->ModifiedAt.tv_nsec;
+}
+
+// Must be called with the cache lock held. Removes the entry from the cache, and
+// destroys it if no one is using it anymore. Otherwise it lingers until released.
+static void
+EvictEntry(
+    _In_ ImageCacheEntry_t* Entry)
+{
+    TRACE("[image_cache] [evict] %s", MStringRaw(Entry->Path));
+    list_remove(&CachedImages, &Entry->Header);
+    CacheSize -= Entry->Length + Entry->SectionBytes;
+    if (Entry->References) {
+        Entry->Stale = 1;
+        list_append(&StaleImages, &Entry->Header);
+    }
+    else {
+        DestroyEntry(Entry);
+    }
+}
+
+static ImageCacheEntry_t*
+FindEntryByBuffer(
+    _In_ list_t* List,
+    _In_ void*   Buffer)
+{
+    element_t* Element;
+
+    _foreach(Element, List) {
+        ImageCacheEntry_t* Entry = Element->value;
+        if (Entry->Buffer == Buffer) {
+            return Entry;
+        }
+    }
+    return NULL;
+}
+
+static ImageCacheEntry_t*
+FindEntryLocked(
+    _In_ void* Buffer)
+{
+    ImageCacheEntry_t* Entry = FindEntryByBuffer(&CachedImages, Buffer);
+    if (!Entry) {
+        Entry = FindEntryByBuffer(&StaleImages, Buffer);
+    }
+    return Entry;
+}
+
+static void
+TrimLocked(
+    _In_ size_t MaximumSize)
+{
+    while (CacheSize > MaximumSize) {
+        ImageCacheEntry_t* Victim = NULL;
+        element_t*         Element;
+
+        _foreach(Element, &CachedImages) {
+            ImageCacheEntry_t* Entry = Element->value;
+            if (!Entry->References && (!Victim || (int)(Entry->LastUsed - Victim->LastUsed) < 0)) {
+                Victim = Entry;
+            }
+        }
+
+        if (!Victim) {
+            break;
+        }
+        EvictEntry(Victim);
+    }
+}
+
+static size_t
+GetCacheBudget(void)
+{
+    SystemDescriptor_t Descriptor;
+    size_t             FreeBytes;
+
+    if (SystemQuery(&Descriptor) != OsSuccess) {
+        return IMAGE_CACHE_MAX_SIZE;
+    }
+
+    FreeBytes = (Descriptor.PagesTotal - Descriptor.PagesUsed) * Descriptor.PageSizeBytes;
+    return MIN(IMAGE_CACHE_MAX_SIZE, FreeBytes / IMAGE_CACHE_MEMORY_FRACTION);
+}
+
+static size_t
+GetPageSizeBytes(void)
+{
+    static size_t      PageSize = 0;
+    SystemDescriptor_t Descriptor;
+
+    if (!PageSize) {
+        PageSize = (SystemQuery(&Descriptor) == OsSuccess) ? Descriptor.PageSizeBytes : 0x1000;
+    }
+    return PageSize;
+}
+
+static OsStatus_t
+ReadImageFile(
+    _In_  MString_t* FullPath,
+    _In_  size_t     Length,
+    _Out_ void**     BufferOut)
+{
+    FILE*  file;
+    void*  fileBuffer;
+    size_t bytesRead;
+
+    file = fopen(MStringRaw(FullPath), "rb");
+    if (!file) {
+        ERROR("[image_cache] [open_file] failed: %i", errno);
+        return OsError;
+    }
+
+    fileBuffer = malloc(Length);
+    if (!fileBuffer) {
+        // Give up everything we can spare, and retry once
+        spinlock_acquire(&CacheLock);
+        TrimLocked(0);
+        spinlock_release(&CacheLock);
+
+        fileBuffer = malloc(Length);
+        if (!fileBuffer) {
+            ERROR("[image_cache] [malloc] null");
+            fclose(file);
+            return OsOutOfMemory;
+        }
+    }
+
+    bytesRead = fread(fileBuffer, 1, Length, file);
+    fclose(file);
+
+    TRACE("[image_cache] [transfer_file] read %" PRIuIN " bytes from file", bytesRead);
+    if (bytesRead != Length) {
+        ERROR("[image_cache] [transfer_file] short read %" PRIuIN "/%" PRIuIN, bytesRead, Length);
+        free(fileBuffer);
+        return OsError;
+    }
+
+    *BufferOut = fileBuffer;
+    return OsSuccess;
+}
+
+OsStatus_t
+ImageCacheAcquire(
+    _In_  MString_t* FullPath,
+    _Out_ void**     BufferOut,
+    _Out_ size_t*    LengthOut)
+{
+    ImageCacheEntry_t* Entry;
+    ImageCacheEntry_t* Existing;
+    OsFileDescriptor_t FileStats;
+    OsStatus_t         Status;
+    size_t             Budget;
+
+    TRACE("[image_cache] [acquire] %s", MStringRaw(FullPath));
+    if (GetFileInformationFromPath(MStringRaw(FullPath), &FileStats) != FsOk) {
+        ERROR("[image_cache] [acquire] failed to stat %s", MStringRaw(FullPath));
+        return OsDoesNotExist;
+    }
+
+    spinlock_acquire(&CacheLock);
+    Entry = list_find_value(&CachedImages, (void*)MStringRaw(FullPath));
+    if (Entry) {
+        if (IsEntryCurrent(Entry, &FileStats)) {
+            Entry->References++;
+            Entry->LastUsed = CacheTick++;
+            *BufferOut      = Entry->Buffer;
+            *LengthOut      = Entry->Length;
+            spinlock_release(&CacheLock);
+            return OsSuccess;
+        }
+
+        // The file was modified since it was cached
+        EvictEntry(Entry);
+    }
+    spinlock_release(&CacheLock);
+
+    Entry = malloc(sizeof(ImageCacheEntry_t));
+    if (!Entry) {
+        return OsOutOfMemory;
+    }
+    memset(Entry, 0, sizeof(ImageCacheEntry_t));
+    list_construct(&Entry->Sections);
+
+    Entry->Length = (size_t)FileStats.Size.QuadPart;
+    Status        = ReadImageFile(FullPath, Entry->Length, &Entry->Buffer);
+    if (Status != OsSuccess) {
+        free(Entry);
+        return Status;
+    }
+
+    Entry->Path       = MStringClone(FullPath);
+    Entry->FileSize   = FileStats.Size.QuadPart;
+    Entry->ModifiedAt = FileStats.ModifiedAt;
+    Entry->References = 1;
+    ELEMENT_INIT(&Entry->Header, MStringRaw(Entry->Path), Entry);
+
+    Budget = GetCacheBudget();
+    spinlock_acquire(&CacheLock);
+
+    // Another load of the same file may have finished while we were reading
+    Existing = list_find_value(&CachedImages, (void*)MStringRaw(FullPath));
+    if (Existing) {
+        EvictEntry(Existing);
+    }
+
+    Entry->LastUsed = CacheTick++;
+    list_append(&CachedImages, &Entry->Header);
+    CacheSize += Entry->Length;
+    TrimLocked(Budget);
+    spinlock_release(&CacheLock);
+
+    *BufferOut = Entry->Buffer;
+    *LengthOut = Entry->Length;
+    return OsSuccess;
+}
+
+static void
+ReleaseEntryLocked(
+    _In_ ImageCacheEntry_t* Entry,
+    _In_ size_t             Budget)
+{
+    Entry->References--;
+    if (!Entry->References) {
+        if (Entry->Stale) {
+            list_remove(&StaleImages, &Entry->Header);
+            DestroyEntry(Entry);
+        }
+        else {
+            TrimLocked(Budget);
+        }
+    }
+}
+
+void
+ImageCacheRelease(
+    _In_ void* Buffer)
+{
+    ImageCacheEntry_t* Entry;
+    size_t             Budget = GetCacheBudget();
+
+    spinlock_acquire(&CacheLock);
+    Entry = FindEntryLocked(Buffer);
+    if (!Entry) {
+        spinlock_release(&CacheLock);
+        ERROR("[image_cache] [release] buffer 0x%" PRIxIN " was not cached", Buffer);
+        return;
+    }
+
+    ReleaseEntryLocked(Entry, Budget);
+    spinlock_release(&CacheLock);
+}
+
+int
+ImageCacheIsVerified(
+    _In_ void* Buffer)
+{
+    ImageCacheEntry_t* Entry;
+    int                Verified = 0;
+
+    spinlock_acquire(&CacheLock);
+    Entry = FindEntryLocked(Buffer);
+    if (Entry) {
+        Verified = Entry->Verified;
+    }
+    spinlock_release(&CacheLock);
+    return Verified;
+}
+
+void
+ImageCacheSetVerified(
+    _In_ void* Buffer)
+{
+    ImageCacheEntry_t* Entry;
+
+    spinlock_acquire(&CacheLock);
+    Entry = FindEntryLocked(Buffer);
+    if (Entry) {
+        Entry->Verified = 1;
+    }
+    spinlock_release(&CacheLock);
+}
+
+void
+ImageCacheTrim(
+    _In_ size_t MaximumSize)
+{
+    spinlock_acquire(&CacheLock);
+    TrimLocked(MaximumSize);
+    spinlock_release(&CacheLock);
+}
+
+// Must be called with the cache lock held. A memory space takes a single reference on
+// an image, no matter how many of its sections it maps.
+static OsStatus_t
+AddSpaceUseLocked(
+    _In_ ImageCacheEntry_t* Entry,
+    _In_ UUId_t             MemorySpace)
+{
+    ImageSpaceUse_t* Use;
+    element_t*       Element;
+
+    _foreach(Element, &SpaceUses) {
+        Use = Element->value;
+        if (Use->MemorySpace == MemorySpace && Use->Entry == Entry) {
+            return OsSuccess;
+        }
+    }
+
+    Use = malloc(sizeof(ImageSpaceUse_t));
+    if (!Use) {
+        return OsOutOfMemory;
+    }
+
+    ELEMENT_INIT(&Use->Header, 0, Use);
+    Use->MemorySpace = MemorySpace;
+    Use->Entry       = Entry;
+    Entry->References++;
+    list_append(&SpaceUses, &Use->Header);
+    return OsSuccess;
+}
+
+static ImageSection_t*
+CreateSection(
+    _In_ uintptr_t Address,
+    _In_ size_t    Length,
+    _In_ Flags_t   Flags)
+{
+    struct dma_buffer_info Info;
+    ImageSection_t*        Section;
+    size_t                 PageSize = GetPageSizeBytes();
+
+    Section = malloc(sizeof(ImageSection_t));
+    if (!Section) {
+        return NULL;
+    }
+
+    Info.name     = "image_section";
+    Info.length   = DIVUP(Length, PageSize) * PageSize;
+    Info.capacity = Info.length;
+    Info.flags    = DMA_CLEAN;
+    if (dma_create(&Info, &Section->Memory) != OsSuccess) {
+        free(Section);
+        return NULL;
+    }
+
+    ELEMENT_INIT(&Section->Header, 0, Section);
+    Section->Address = Address;
+    Section->Length  = Length;
+    Section->Flags   = Flags;
+    return Section;
+}
+
+static ImageSection_t*
+FindSectionLocked(
+    _In_ ImageCacheEntry_t* Entry,
+    _In_ uintptr_t          Address)
+{
+    element_t* Element;
+
+    _foreach(Element, &Entry->Sections) {
+        ImageSection_t* Section = Element->value;
+        if (Section->Address == Address) {
+            return Section;
+        }
+    }
+    return NULL;
+}
+
+OsStatus_t
+ImageCacheAcquireSection(
+    _In_  void*     Buffer,
+    _In_  UUId_t    MemorySpace,
+    _In_  uintptr_t Address,
+    _In_  size_t    Length,
+    _In_  Flags_t   Flags,
+    _Out_ void**    BufferOut,
+    _Out_ int*      PreparedOut)
+{
+    struct MemoryMappingParameters Parameters;
+    ImageCacheEntry_t*             Entry;
+    ImageSection_t*                Section = NULL;
+    OsStatus_t                     Status  = OsSuccess;
+
+    spinlock_acquire(&CacheLock);
+    Entry = FindEntryLocked(Buffer);
+    if (!Entry) {
+        spinlock_release(&CacheLock);
+        return OsDoesNotExist;
+    }
+
+    if (Entry->SectionState == IMAGE_SECTIONS_NONE) {
+        Entry->SectionState   = IMAGE_SECTIONS_BUILDING;
+        Entry->SectionBuilder = MemorySpace;
+    }
+
+    if (Entry->SectionState == IMAGE_SECTIONS_READY) {
+        Section = FindSectionLocked(Entry, Address);
+        if (!Section || Section->Length != Length || Section->Flags != Flags) {
+            Status = OsDoesNotExist;
+        }
+    }
+    else if (Entry->SectionState != IMAGE_SECTIONS_BUILDING || Entry->SectionBuilder != MemorySpace) {
+        Status = OsBusy;
+    }
+
+    if (Status == OsSuccess) {
+        Status = AddSpaceUseLocked(Entry, MemorySpace);
+    }
+    spinlock_release(&CacheLock);
+    if (Status != OsSuccess) {
+        return Status;
+    }
+
+    // The pages of a new section are filled in by the caller, and are only handed
+    // to other memory spaces once the image was loaded successfully
+    *PreparedOut = Section != NULL;
+    if (!Section) {
+        Section = CreateSection(Address, Length, Flags);
+        if (!Section) {
+            ImageCacheCompleteSections(Buffer, MemorySpace, OsOutOfMemory);
+            return OsOutOfMemory;
+        }
+
+        spinlock_acquire(&CacheLock);
+        list_append(&Entry->Sections, &Section->Header);
+        Entry->SectionBytes += Section->Memory.length;
+        if (!Entry->Stale) {
+            CacheSize += Section->Memory.length;
+        }
+        spinlock_release(&CacheLock);
+    }
+
+    Parameters.VirtualAddress = Address;
+    Parameters.Length         = Section->Memory.length;
+    Parameters.Flags          = Flags;
+    Status = CreateMemoryRegionMapping(MemorySpace, Section->Memory.handle, &Parameters);
+    if (Status != OsSuccess) {
+        ERROR("[image_cache] [acquire_section] failed to map 0x%" PRIxIN ": %u", Address, Status);
+        if (!*PreparedOut) {
+            ImageCacheCompleteSections(Buffer, MemorySpace, Status);
+        }
+        return Status;
+    }
+
+    *BufferOut = Section->Memory.buffer;
+    return OsSuccess;
+}
+
+void
+ImageCacheCompleteSections(
+    _In_ void*      Buffer,
+    _In_ UUId_t     MemorySpace,
+    _In_ OsStatus_t Status)
+{
+    ImageCacheEntry_t* Entry;
+
+    spinlock_acquire(&CacheLock);
+    Entry = FindEntryLocked(Buffer);
+    if (Entry && Entry->SectionState == IMAGE_SECTIONS_BUILDING && Entry->SectionBuilder == MemorySpace) {
+        Entry->SectionState = (Status == OsSuccess) ? IMAGE_SECTIONS_READY : IMAGE_SECTIONS_FAILED;
+    }
+    spinlock_release(&CacheLock);
+}
+
+void
+ImageCacheReleaseSpace(
+    _In_ UUId_t MemorySpace)
+{
+    element_t* Element;
+    size_t     Budget = GetCacheBudget();
+
+    spinlock_acquire(&CacheLock);
+    _foreach_nolink(Element, &SpaceUses) {
+        ImageSpaceUse_t* Use = Element->value;
+        Element = Element->next;
+
+        if (Use->MemorySpace == MemorySpace) {
+            list_remove(&SpaceUses, &Use->Header);
+            ReleaseEntryLocked(Use->Entry, Budget);
+            free(Use);
+        }
+    }
+    spinlock_release(&CacheLock);
+}
@@ -0,0 +1,101 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager - Image Cache
+ * - Keeps recently loaded image files in memory, so spawning the same executable
+ *   or loading the same library again does not read it from disk again.
+ */
+
+#ifndef __PROCESS_IMAGE_CACHE__
+#define __PROCESS_IMAGE_CACHE__
+
+#include <os/osdefs.h>
+
+DECL_STRUCT(MString);
+
+/* ImageCacheAcquire
+ * Retrieves the contents of the image file at the given path. The cached copy is used
+ * as long as the file has not changed since it was read. The buffer is read-only and
+ * shared, and must be released again with ImageCacheRelease. */
+__EXTERN OsStatus_t
+ImageCacheAcquire(
+    _In_  MString_t* FullPath,
+    _Out_ void**     BufferOut,
+    _Out_ size_t*    LengthOut);
+
+/* ImageCacheRelease
+ * Releases a buffer acquired by ImageCacheAcquire. Unused images stay cached until
+ * they are evicted. */
+__EXTERN void
+ImageCacheRelease(
+    _In_ void* Buffer);
+
+/* ImageCacheIsVerified
+ * Returns whether the contents of an acquired buffer were marked as verified. */
+__EXTERN int
+ImageCacheIsVerified(
+    _In_ void* Buffer);
+
+/* ImageCacheSetVerified
+ * Marks the contents of an acquired buffer as verified, which lasts until the file
+ * changes on disk. */
+__EXTERN void
+ImageCacheSetVerified(
+    _In_ void* Buffer);
+
+/* ImageCacheAcquireSection
+ * Maps the shared pages of a read-only image section into the memory space. The first
+ * space to load the image creates the pages, and must fill and relocate them through
+ * the returned buffer. Later spaces get the prepared pages. Fails with OsBusy while
+ * another space is still preparing the sections, and the caller should then map
+ * pages of its own. */
+__EXTERN OsStatus_t
+ImageCacheAcquireSection(
+    _In_  void*     Buffer,
+    _In_  UUId_t    MemorySpace,
+    _In_  uintptr_t Address,
+    _In_  size_t    Length,
+    _In_  Flags_t   Flags,
+    _Out_ void**    BufferOut,
+    _Out_ int*      PreparedOut);
+
+/* ImageCacheCompleteSections
+ * Ends the preparation of the shared sections by the memory space. The sections are
+ * only shared with other spaces if the image was loaded successfully. */
+__EXTERN void
+ImageCacheCompleteSections(
+    _In_ void*      Buffer,
+    _In_ UUId_t     MemorySpace,
+    _In_ OsStatus_t Status);
+
+/* ImageCacheReleaseSpace
+ * Releases the images whose shared sections were mapped into the memory space. Must
+ * only be called once the memory space is no longer used. */
+__EXTERN void
+ImageCacheReleaseSpace(
+    _In_ UUId_t MemorySpace);
+
+/* ImageCacheTrim
+ * Evicts unused images, least recently used first, until the cache uses no more than
+ * the given number of bytes. */
+__EXTERN void
+ImageCacheTrim(
+    _In_ size_t MaximumSize);
+
+#endif //!__PROCESS_IMAGE_CACHE__
@@ -0,0 +1,165 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager - Library Base Addresses
+ * - Assigns every shared library one address that it is loaded at in all processes,
+ *   so libraries prelinked for that address need no relocation.
+ */
+//#define __TRACE
+
+#include <ds/list.h>
+#include <ds/mstring.h>
+#include <ddk/utils.h>
+#include "library_base.h"
+#include "../../librt/libds/pe/pe.h"
+#include <os/spinlock.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Assignments are never released, as any process may still have the library
+// mapped at that address. A library that is replaced by a larger file gets a
+// new range, and the old one is kept as retired.
+typedef struct LibraryBase {
+    element_t  Header;
+    MString_t* Path;
+    uintptr_t  Base;
+    size_t     Size;
+    int        Retired;
+} LibraryBase_t;
+
+static list_t     LibraryBases = LIST_INIT;
+static spinlock_t BaseLock     = _SPN_INITIALIZER_NP(spinlock_plain);
+
+static LibraryBase_t*
+FindAssignment(
+    _In_ MString_t* FullPath)
+{
+    element_t* Element;
+
+    _foreach(Element, &LibraryBases) {
+        LibraryBase_t* Assignment = Element->value;
+        if (!Assignment->Retired && MStringCompare(Assignment->Path, FullPath, 0) == MSTRING_FULL_MATCH) {
+            return Assignment;
+        }
+    }
+    return NULL;
+}
+
+static LibraryBase_t*
+FindOverlap(
+    _In_ uintptr_t Base,
+    _In_ size_t    Size)
+{
+    element_t* Element;
+
+    _foreach(Element, &LibraryBases) {
+        LibraryBase_t* Assignment = Element->value;
+        if (Base < (Assignment->Base + Assignment->Size) && Assignment->Base < (Base + Size)) {
+            return Assignment;
+        }
+    }
+    return NULL;
+}
+
+// Uses the preferred base if possible. Otherwise the highest free range in the region
+// is used, as the prelink tool hands out preferred bases from the bottom of it.
+static uintptr_t
+FindFreeRange(
+    _In_ uintptr_t PreferredBase,
+    _In_ size_t    Size)
+{
+    uintptr_t      RegionStart = GetBaseAddress() + PE_SHARED_REGION_OFFSET;
+    uintptr_t      RegionEnd   = RegionStart + PE_SHARED_REGION_SIZE;
+    uintptr_t      Candidate;
+    LibraryBase_t* Overlap;
+
+    if (Size > PE_SHARED_REGION_SIZE) {
+        return 0;
+    }
+
+    if (PreferredBase >= RegionStart && !(PreferredBase % PE_SHARED_REGION_ALIGN) &&
+        Size <= (RegionEnd - PreferredBase) && !FindOverlap(PreferredBase, Size)) {
+        return PreferredBase;
+    }
+
+    Candidate = RegionEnd - Size;
+    while (1) {
+        Overlap = FindOverlap(Candidate, Size);
+        if (!Overlap) {
+            return Candidate;
+        }
+
+        if ((Overlap->Base - RegionStart) < Size) {
+            break;
+        }
+        Candidate = Overlap->Base - Size;
+    }
+    return 0;
+}
+
+uintptr_t
+LibraryBaseAssign(
+    _In_ MString_t* FullPath,
+    _In_ uintptr_t  PreferredBase,
+    _In_ size_t     ImageSize)
+{
+    LibraryBase_t* Assignment;
+    uintptr_t      Base;
+    size_t         Size;
+
+    Size = (ImageSize + (PE_SHARED_REGION_ALIGN - 1)) & ~(PE_SHARED_REGION_ALIGN - 1);
+    if (!Size) {
+        return 0;
+    }
+
+    spinlock_acquire(&BaseLock);
+    Assignment = FindAssignment(FullPath);
+    if (Assignment) {
+        if (Size <= Assignment->Size) {
+            Base = Assignment->Base;
+            spinlock_release(&BaseLock);
+            return Base;
+        }
+        Assignment->Retired = 1;
+    }
+
+    Base = FindFreeRange(PreferredBase, Size);
+    if (!Base) {
+        spinlock_release(&BaseLock);
+        WARNING("[library_base] no room for %s (%" PRIuIN " bytes)", MStringRaw(FullPath), Size);
+        return 0;
+    }
+
+    Assignment = malloc(sizeof(LibraryBase_t));
+    if (!Assignment) {
+        spinlock_release(&BaseLock);
+        return 0;
+    }
+
+    Assignment->Path    = MStringClone(FullPath);
+    Assignment->Base    = Base;
+    Assignment->Size    = Size;
+    Assignment->Retired = 0;
+    ELEMENT_INIT(&Assignment->Header, 0, Assignment);
+    list_append(&LibraryBases, &Assignment->Header);
+    spinlock_release(&BaseLock);
+
+    TRACE("[library_base] %s => 0x%" PRIxIN, MStringRaw(FullPath), Base);
+    return Base;
+}
@@ -0,0 +1,42 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Process Manager - Library Base Addresses
+ * - Assigns every shared library one address that it is loaded at in all processes,
+ *   so libraries prelinked for that address need no relocation.
+ */
+
+#ifndef __PROCESS_LIBRARY_BASE__
+#define __PROCESS_LIBRARY_BASE__
+
+#include <os/osdefs.h>
+
+DECL_STRUCT(MString);
+
+/* LibraryBaseAssign
+ * Retrieves the address the library at the given path is loaded at. The preferred
+ * base of the image is used if it lies in the shared region and is not taken by
+ * another library. Returns 0 if the shared region has no room for the image. */
+__EXTERN uintptr_t
+LibraryBaseAssign(
+    _In_ MString_t* FullPath,
+    _In_ uintptr_t  PreferredBase,
+    _In_ size_t     ImageSize);
+
+#endif //!__PROCESS_LIBRARY_BASE__
@@ -27,6 +27,7 @@
 #include <ds/mstring.h>
 #include <ddk/eventqueue.h>
 #include <ddk/handle.h>
+#include <ddk/threadpool.h>
 #include <ddk/utils.h>
 #include <internal/_syscalls.h> // for Syscall_ThreadCreate
 #include <internal/_io.h>
@@ -35,18 +36,26 @@
 #include <os/mollenos.h>
 #include <os/dmabuf.h>
 #include <os/context.h>
+#include "image_cache.h"
+#include "library_base.h"
 #include "process.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <threads.h>
 
 #include "svc_library_protocol_server.h"
 #include "svc_process_protocol_server.h"
 
-static list_t        Processes  = LIST_INIT;
-static list_t        Joiners    = LIST_INIT;
-static EventQueue_t* EventQueue = NULL;
+// The number of threads that load dependencies of an image in addition to the loader,
+// they are shared by all loads
+#define PREFETCH_WORKER_COUNT 3
+
+static list_t        Processes    = LIST_INIT;
+static list_t        Joiners      = LIST_INIT;
+static EventQueue_t* EventQueue   = NULL;
+static ThreadPool_t* PrefetchPool = NULL;
 
 static OsStatus_t
 DestroyProcess(
@@ -69,7 +78,9 @@ DestroyProcess(
             MStringDestroy(Process->AssemblyDirectory);
         }
         if (Process->Executable != NULL) {
+            UUId_t MemorySpace = (UUId_t)(uintptr_t)Process->Executable->MemorySpace;
             PeUnloadImage(Process->Executable);
+            ImageCacheReleaseSpace(MemorySpace);
         }
         handle_destroy(Handle);
         free(Process);
@@ -245,38 +256,8 @@ LoadFile(
     _Out_ void**     BufferOut,
     _Out_ size_t*    LengthOut)
 {
-    FILE*  file;
-    long   fileSize;
-    void*  fileBuffer;
-    size_t bytesRead;
-    
     TRACE("[load_file] %s", MStringRaw(FullPath));
-    
-    file = fopen(MStringRaw(FullPath), "rb");
-    if (!file) {
-        ERROR("[load_file] [open_file] failed: %i", errno);
-        return OsError;
-    }
-    
-    fseek(file, 0, SEEK_END);
-    fileSize = ftell(file);
-    rewind(file);
-    
-    fileBuffer = malloc(fileSize);
-    if (!fileBuffer) {
-        ERROR("[load_file] [malloc] null");
-        fclose(file);
-        return OsOutOfMemory;
-    }
-    
-    bytesRead = fread(fileBuffer, 1, fileSize, file);
-    fclose(file);
-    
-    TRACE("[load_file] [transfer_file] read %" PRIuIN " bytes from file", bytesRead);
-    
-    *BufferOut = fileBuffer;
-    *LengthOut = fileSize;
-    return OsSuccess;
+    return ImageCacheAcquire(FullPath, BufferOut, LengthOut);
 }
 
 void
@@ -284,16 +265,180 @@ UnloadFile(
     _In_ MString_t* FullPath,
     _In_ void*      Buffer)
 {
-    // So right now we will simply free the buffer, 
-    // but when we implement caching we will check if it should stay cached
     _CRT_UNUSED(FullPath);
-    free(Buffer);
+    ImageCacheRelease(Buffer);
+}
+
+int
+IsFileVerified(
+    _In_ MString_t* FullPath,
+    _In_ void*      Buffer)
+{
+    _CRT_UNUSED(FullPath);
+    return ImageCacheIsVerified(Buffer);
+}
+
+void
+SetFileVerified(
+    _In_ MString_t* FullPath,
+    _In_ void*      Buffer)
+{
+    _CRT_UNUSED(FullPath);
+    ImageCacheSetVerified(Buffer);
+}
+
+OsStatus_t
+AcquireSharedSection(
+    _In_  MemorySpaceHandle_t MemorySpace,
+    _In_  void*               FileBuffer,
+    _In_  uintptr_t           Address,
+    _In_  size_t              Length,
+    _In_  Flags_t             Flags,
+    _Out_ uint8_t**           BufferOut,
+    _Out_ int*                PreparedOut)
+{
+    return ImageCacheAcquireSection(FileBuffer, (UUId_t)(uintptr_t)MemorySpace, Address,
+        Length, Flags, (void**)BufferOut, PreparedOut);
+}
+
+void
+CompleteSharedSections(
+    _In_ MemorySpaceHandle_t MemorySpace,
+    _In_ void*               FileBuffer,
+    _In_ OsStatus_t          Status)
+{
+    ImageCacheCompleteSections(FileBuffer, (UUId_t)(uintptr_t)MemorySpace, Status);
+}
+
+// A job is shared by the loader and the pool workers helping it. Workers may only
+// start after the loader finished all files, so the job is reference counted and
+// the loader only waits for files that are still being loaded.
+typedef struct PrefetchJob {
+    UUId_t      Owner;
+    int         Count;
+    MString_t** Paths;
+    MString_t** FullPaths;
+    void**      Buffers;
+    size_t*     Lengths;
+    atomic_int  Next;
+    atomic_int  References;
+    int         Completed;
+    mtx_t       Lock;
+    cnd_t       Signal;
+} PrefetchJob_t;
+
+static void
+ReleasePrefetchJob(
+    _In_ PrefetchJob_t* Job)
+{
+    if (atomic_fetch_sub(&Job->References, 1) == 1) {
+        mtx_destroy(&Job->Lock);
+        cnd_destroy(&Job->Signal);
+        free(Job);
+    }
+}
+
+// ResolveFilePath and LoadFile are safe to run on several threads at once. The
+// process list locks itself and GuessBasePath holds a reference and the lock of
+// the owner while copying its working directory. The image cache serializes on its
+// own lock, and the remaining work is done on strings private to each file.
+static int
+PrefetchWorker(
+    _In_ void* Context)
+{
+    PrefetchJob_t* Job = Context;
+    int            Index;
+
+    while ((Index = atomic_fetch_add(&Job->Next, 1)) < Job->Count) {
+        Job->FullPaths[Index] = NULL;
+        Job->Buffers[Index]   = NULL;
+        if (ResolveFilePath(Job->Owner, Job->Paths[Index], &Job->FullPaths[Index]) == OsSuccess) {
+            if (LoadFile(Job->FullPaths[Index], &Job->Buffers[Index], &Job->Lengths[Index]) != OsSuccess) {
+                Job->Buffers[Index] = NULL;
+            }
+        }
+
+        mtx_lock(&Job->Lock);
+        if (++Job->Completed == Job->Count) {
+            cnd_signal(&Job->Signal);
+        }
+        mtx_unlock(&Job->Lock);
+    }
+    ReleasePrefetchJob(Job);
+    return 0;
+}
+
+OsStatus_t
+PrefetchFiles(
+    _In_  UUId_t      Owner,
+    _In_  int         Count,
+    _In_  MString_t** Paths,
+    _Out_ MString_t** FullPathsOut,
+    _Out_ void**      BuffersOut,
+    _Out_ size_t*     LengthsOut)
+{
+    PrefetchJob_t* Job;
+    int            i;
+
+    if (!PrefetchPool) {
+        return OsNotSupported;
+    }
+
+    Job = malloc(sizeof(PrefetchJob_t));
+    if (!Job) {
+        return OsOutOfMemory;
+    }
+
+    Job->Owner     = Owner;
+    Job->Count     = Count;
+    Job->Paths     = Paths;
+    Job->FullPaths = FullPathsOut;
+    Job->Buffers   = BuffersOut;
+    Job->Lengths   = LengthsOut;
+    Job->Completed = 0;
+    atomic_store(&Job->Next, 0);
+    atomic_store(&Job->References, 1);
+    mtx_init(&Job->Lock, mtx_plain);
+    cnd_init(&Job->Signal);
+
+    // The calling thread takes part as well, so it needs one helper less
+    for (i = 0; i < MIN(Count - 1, PREFETCH_WORKER_COUNT); i++) {
+        atomic_fetch_add(&Job->References, 1);
+        if (ThreadPoolAddWork(PrefetchPool, PrefetchWorker, Job) != OsSuccess) {
+            atomic_fetch_sub(&Job->References, 1);
+            break;
+        }
+    }
+
+    atomic_fetch_add(&Job->References, 1);
+    PrefetchWorker(Job);
+
+    mtx_lock(&Job->Lock);
+    while (Job->Completed != Job->Count) {
+        cnd_wait(&Job->Signal, &Job->Lock);
+    }
+    mtx_unlock(&Job->Lock);
+    ReleasePrefetchJob(Job);
+    return OsSuccess;
+}
+
+uintptr_t
+GetLibraryBaseAddress(
+    _In_ MString_t* FullPath,
+    _In_ uintptr_t  PreferredBase,
+    _In_ size_t     ImageSize)
+{
+    return LibraryBaseAssign(FullPath, PreferredBase, ImageSize);
 }
 
 OsStatus_t
 InitializeProcessManager(void)
 {
     CreateEventQueue(&EventQueue);
+    if (ThreadPoolInitialize(PREFETCH_WORKER_COUNT, &PrefetchPool) != OsSuccess) {
+        WARNING("[process_manager] failed to create the prefetch workers, files are loaded one by one");
+        PrefetchPool = NULL;
+    }
     return OsSuccess;
 }
 
@@ -347,6 +492,8 @@ CreateProcess(
         free(Process);
         return Status;
     }
+    TRACE("[create_process] %s loaded in %u ms", Path,
+        (unsigned int)(((clock() - Process->StartedAt) * 1000) / CLOCKS_PER_SEC));
 
     // it won't fail, since -1 + 1 = 0, so we just copy the entire string
     Process->Path              = MStringCreate((void*)MStringRaw(Process->Executable->FullPath), StrUTF8);
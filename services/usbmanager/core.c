@@ -223,6 +223,15 @@ UsbQueryConfigurationDescriptors(
             UsbHcInterfaceVersion_t *UsbIfVersion = NULL;
             UsbInterface_t *UsbInterface = NULL;
 
+            // Ignore interfaces and alternate settings we have no room for, and
+            // make sure their endpoints are ignored as well
+            if (Interface->NumInterface >= USB_MAX_INTERFACES || 
+                Interface->AlternativeSetting >= USB_MAX_VERSIONS) {
+                WARNING("Ignoring interface %u.%u", Interface->NumInterface, Interface->AlternativeSetting);
+                CurrentIfVersion = -1;
+                goto NextEntry;
+            }
+
             // Short-hand the interface pointer
             UsbInterface = &Device->Interfaces[Interface->NumInterface];
 
@@ -255,7 +264,10 @@ UsbQueryConfigurationDescriptors(
 
                 // Store number of endpoints and generate an id
                 UsbIfVersionMeta->Base.Id = Interface->AlternativeSetting;
+                UsbIfVersionMeta->Base.Protocol = Interface->Protocol;
                 UsbIfVersionMeta->Base.EndpointCount = Interface->NumEndpoints;
+                UsbIfVersionMeta->Exists = 1;
+                UsbInterface->Base.VersionCount++;
 
                 // Setup some state-machine variables
                 CurrentIfVersion = Interface->AlternativeSetting;
@@ -276,7 +288,8 @@ UsbQueryConfigurationDescriptors(
             size_t EndpointAddress = 0;
 
             // Protect against null interface-endpoints
-            if (Device->Base.InterfaceCount == 0) {
+            if (Device->Base.InterfaceCount == 0 || CurrentIfVersion == -1 ||
+                EpIterator >= USB_MAX_ENDPOINTS) {
                 goto NextEntry;
             }
 
@@ -324,6 +337,41 @@ UsbQueryConfigurationDescriptors(
             // Increase the EP index
             EpIterator++;
         }
+        else if (Length == 6 && Type == USB_DESCRIPTOR_SS_EP_CPN) {
+            UsbSsEndpointCompanionDescriptor_t* Companion;
+            UsbHcEndpointDescriptor_t*          HcEndpoint;
+
+            // The companion describes the endpoint just parsed
+            if (Device->Base.InterfaceCount == 0 || CurrentIfVersion == -1 || EpIterator == 0) {
+                goto NextEntry;
+            }
+
+            Companion  = (UsbSsEndpointCompanionDescriptor_t*)BufferPointer;
+            HcEndpoint = &Device->Interfaces[
+                Device->Base.InterfaceCount - 1].
+                    Versions[CurrentIfVersion].Endpoints[EpIterator - 1];
+
+            HcEndpoint->MaxBurst = Companion->MaxBurst;
+            if (HcEndpoint->Type == EndpointBulk && USB_SS_COMPANION_MAXSTREAMS(Companion->Attributes)) {
+                HcEndpoint->MaxStreams = 1 << USB_SS_COMPANION_MAXSTREAMS(Companion->Attributes);
+            }
+        }
+        else if (Length == sizeof(UsbPipeUsageDescriptor_t) && Type == USB_DESCRIPTOR_PIPE_USAGE) {
+            UsbPipeUsageDescriptor_t*  PipeUsage;
+            UsbHcEndpointDescriptor_t* HcEndpoint;
+
+            // The pipe usage describes the endpoint just parsed, it can appear
+            // both before and after the companion descriptor
+            if (Device->Base.InterfaceCount == 0 || CurrentIfVersion == -1 || EpIterator == 0) {
+                goto NextEntry;
+            }
+
+            PipeUsage  = (UsbPipeUsageDescriptor_t*)BufferPointer;
+            HcEndpoint = &Device->Interfaces[
+                Device->Base.InterfaceCount - 1].
+                    Versions[CurrentIfVersion].Endpoints[EpIterator - 1];
+            HcEndpoint->PipeId = PipeUsage->PipeId;
+        }
 
         // Go to next descriptor entry
     NextEntry:
@@ -473,10 +521,26 @@ UsbDeviceLoadDrivers(
         // Copy specific interface-information to structure
         if (Device->Interfaces[i].Exists) {
             const char *Identification = UsbGetIdentificationString(Device->Interfaces[i].Base.Class);
+            int EndpointIndex = 1;
+            int j;
+
             memcpy(&CoreDevice.Interface, &Device->Interfaces[i].Base, 
                 sizeof(UsbHcInterface_t));
-            memcpy(&CoreDevice.Endpoints[1], &Device->Interfaces[i].Versions[0].Endpoints[0],
-                sizeof(UsbHcEndpointDescriptor_t) * Device->Interfaces[i].Versions[0].Base.EndpointCount);
+
+            // The endpoints of all alternate settings are handed to the driver, one
+            // after the other, so it can switch to the one it supports
+            for (j = 0; j < USB_MAX_VERSIONS; j++) {
+                UsbInterfaceVersion_t* Version = &Device->Interfaces[i].Versions[j];
+                if (!Version->Exists || 
+                    (EndpointIndex + Version->Base.EndpointCount) > USB_MAX_ENDPOINTS) {
+                    continue;
+                }
+
+                memcpy(&CoreDevice.Endpoints[EndpointIndex], &Version->Endpoints[0],
+                    sizeof(UsbHcEndpointDescriptor_t) * Version->Base.EndpointCount);
+                CoreDevice.Interface.Versions[j].EndpointIndex = EndpointIndex;
+                EndpointIndex += Version->Base.EndpointCount;
+            }
 
             // Let interface determine the class/subclass
             if (Identification != NULL) {
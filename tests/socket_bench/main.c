@@ -0,0 +1,357 @@
+/**
+ * MollenOS
+ *
+ * Copyright 2020, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Local Socket Benchmark
+ *  - Measures round trip latency and throughput of local and loopback internet
+ *    stream and datagram sockets between two threads.
+ */
+
+#include <inet/internet.h>
+#include <inet/bits.h>
+#include <inet/local.h>
+#include <inet/socket.h>
+#include <io.h>
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#define ADDRESS_STREAM   0
+#define ADDRESS_DGRAM_A  1
+#define ADDRESS_DGRAM_B  2
+#define INET_PORT_BASE   7000
+
+#define ROUND_TRIPS      1000
+#define STREAM_BYTES     (64 * 1024 * 1024)
+#define DGRAM_PACKETS    16384
+#define DGRAM_WINDOW     8
+#define CHUNK_SIZE       4096
+
+typedef struct BenchAddress {
+    struct sockaddr_storage Storage;
+    socklen_t               Length;
+} BenchAddress_t;
+
+typedef struct DatagramPeerContext {
+    int            Socket;
+    BenchAddress_t Address;
+} DatagramPeerContext_t;
+
+static const char* LocalPaths[] = {
+    "/lc/bench-stream", "/lc/bench-dgram-a", "/lc/bench-dgram-b"
+};
+
+static char ChunkBuffer[CHUNK_SIZE];
+static char PeerBuffer[CHUNK_SIZE];
+
+static void
+MakeAddress(
+    _In_ BenchAddress_t* Address,
+    _In_ int             Family,
+    _In_ int             Index)
+{
+    memset(Address, 0, sizeof(BenchAddress_t));
+    if (Family == AF_INET) {
+        struct sockaddr_in* Address4 = (struct sockaddr_in*)&Address->Storage;
+        Address4->sin_len         = sizeof(struct sockaddr_in);
+        Address4->sin_family      = AF_INET;
+        Address4->sin_port        = htons(INET_PORT_BASE + Index);
+        Address4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Address->Length           = sizeof(struct sockaddr_in);
+    }
+    else {
+        struct sockaddr_lc* AddressLc = (struct sockaddr_lc*)&Address->Storage;
+        AddressLc->slc_len    = sizeof(struct sockaddr_lc);
+        AddressLc->slc_family = AF_LOCAL;
+        strcpy(&AddressLc->slc_addr[0], LocalPaths[Index]);
+        Address->Length = sizeof(struct sockaddr_lc);
+    }
+}
+
+static double
+ElapsedSeconds(
+    _In_ struct timespec* Start)
+{
+    struct timespec Stop, Result;
+    timespec_get(&Stop, TIME_MONOTONIC);
+    timespec_diff(Start, &Stop, &Result);
+    return (double)Result.tv_sec + ((double)Result.tv_nsec / 1000000000.0);
+}
+
+static void
+PrintResult(
+    _In_ const char* Name,
+    _In_ double      LatencySeconds,
+    _In_ size_t      Bytes,
+    _In_ double      TransferSeconds)
+{
+    printf("%-10s latency %8.2f us/round trip, throughput %8.2f MB/s\n", Name,
+        (LatencySeconds * 1000000.0) / ROUND_TRIPS,
+        ((double)Bytes / (1024.0 * 1024.0)) / TransferSeconds);
+}
+
+static int
+RecvAll(
+    _In_ int    Socket,
+    _In_ char*  Buffer,
+    _In_ size_t Length)
+{
+    size_t BytesLeft = Length;
+    while (BytesLeft) {
+        intmax_t BytesRead = recv(Socket, Buffer, BytesLeft, 0);
+        if (BytesRead <= 0) {
+            return -1;
+        }
+        BytesLeft -= (size_t)BytesRead;
+        Buffer    += BytesRead;
+    }
+    return 0;
+}
+
+static int
+SendAll(
+    _In_ int         Socket,
+    _In_ const char* Buffer,
+    _In_ size_t      Length)
+{
+    size_t BytesLeft = Length;
+    while (BytesLeft) {
+        intmax_t BytesWritten = send(Socket, Buffer, BytesLeft, 0);
+        if (BytesWritten <= 0) {
+            return -1;
+        }
+        BytesLeft -= (size_t)BytesWritten;
+        Buffer    += BytesWritten;
+    }
+    return 0;
+}
+
+// Echoes the round trips, then consumes the bulk transfer and acknowledges it
+static int
+StreamPeer(
+    _In_ void* Context)
+{
+    int    Server = *(int*)Context;
+    int    Client;
+    size_t BytesLeft = STREAM_BYTES;
+    int    i;
+
+    Client = accept(Server, NULL, NULL);
+    if (Client < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        if (RecvAll(Client, &PeerBuffer[0], 1) || SendAll(Client, &PeerBuffer[0], 1)) {
+            return -1;
+        }
+    }
+
+    while (BytesLeft) {
+        intmax_t BytesRead = recv(Client, &PeerBuffer[0], sizeof(PeerBuffer), 0);
+        if (BytesRead <= 0) {
+            return -1;
+        }
+        BytesLeft -= (size_t)BytesRead;
+    }
+
+    SendAll(Client, &PeerBuffer[0], 1);
+    close(Client);
+    return 0;
+}
+
+static int
+BenchmarkStream(
+    _In_ int         Family,
+    _In_ const char* Name)
+{
+    BenchAddress_t  Address;
+    struct timespec Start;
+    double          Latency;
+    size_t          BytesLeft = STREAM_BYTES;
+    thrd_t          Peer;
+    int             Server, Client;
+    int             Result = -1;
+    int             i;
+
+    MakeAddress(&Address, Family, ADDRESS_STREAM);
+    Server = socket(Family, SOCK_STREAM, 0);
+    Client = socket(Family, SOCK_STREAM, 0);
+    if (Server < 0 || Client < 0) {
+        printf("%s: failed to create sockets\n", Name);
+        return -1;
+    }
+
+    if (bind(Server, (struct sockaddr*)&Address.Storage, Address.Length) || listen(Server, 1) ||
+        thrd_create(&Peer, StreamPeer, &Server) != thrd_success) {
+        printf("%s: failed to setup listener\n", Name);
+        goto Exit;
+    }
+
+    if (connect(Client, (struct sockaddr*)&Address.Storage, Address.Length)) {
+        printf("%s: failed to connect\n", Name);
+        goto Exit;
+    }
+
+    timespec_get(&Start, TIME_MONOTONIC);
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        if (SendAll(Client, &ChunkBuffer[0], 1) || RecvAll(Client, &ChunkBuffer[0], 1)) {
+            printf("%s: round trip %i failed\n", Name, i);
+            goto Exit;
+        }
+    }
+    Latency = ElapsedSeconds(&Start);
+
+    timespec_get(&Start, TIME_MONOTONIC);
+    while (BytesLeft) {
+        size_t Length = BytesLeft < sizeof(ChunkBuffer) ? BytesLeft : sizeof(ChunkBuffer);
+        if (SendAll(Client, &ChunkBuffer[0], Length)) {
+            printf("%s: transfer failed\n", Name);
+            goto Exit;
+        }
+        BytesLeft -= Length;
+    }
+
+    if (RecvAll(Client, &ChunkBuffer[0], 1)) {
+        printf("%s: transfer was not acknowledged\n", Name);
+        goto Exit;
+    }
+    PrintResult(Name, Latency, STREAM_BYTES, ElapsedSeconds(&Start));
+    thrd_join(Peer, &Result);
+
+Exit:
+    close(Client);
+    close(Server);
+    return Result;
+}
+
+static int
+DatagramPeer(
+    _In_ void* Context)
+{
+    DatagramPeerContext_t* Peer    = Context;
+    struct sockaddr*       Address = (struct sockaddr*)&Peer->Address.Storage;
+    int                    Socket  = Peer->Socket;
+    int                    i;
+
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        if (recv(Socket, &PeerBuffer[0], sizeof(PeerBuffer), 0) <= 0 ||
+            sendto(Socket, &PeerBuffer[0], 1, 0, Address, Peer->Address.Length) <= 0) {
+            return -1;
+        }
+    }
+
+    for (i = 1; i <= DGRAM_PACKETS; i++) {
+        if (recv(Socket, &PeerBuffer[0], sizeof(PeerBuffer), 0) <= 0) {
+            return -1;
+        }
+
+        if (!(i % DGRAM_WINDOW)) {
+            sendto(Socket, &PeerBuffer[0], 1, 0, Address, Peer->Address.Length);
+        }
+    }
+    return 0;
+}
+
+static int
+BenchmarkDatagram(
+    _In_ int         Family,
+    _In_ const char* Name)
+{
+    DatagramPeerContext_t PeerContext;
+    BenchAddress_t        AddressB;
+    struct sockaddr*      Target = (struct sockaddr*)&AddressB.Storage;
+    struct timespec       Start;
+    double                Latency;
+    thrd_t                Peer;
+    int                   SocketA, SocketB;
+    int                   Result = -1;
+    int                   i;
+
+    MakeAddress(&PeerContext.Address, Family, ADDRESS_DGRAM_A);
+    MakeAddress(&AddressB, Family, ADDRESS_DGRAM_B);
+    SocketA = socket(Family, SOCK_DGRAM, 0);
+    SocketB = socket(Family, SOCK_DGRAM, 0);
+    if (SocketA < 0 || SocketB < 0) {
+        printf("%s: failed to create sockets\n", Name);
+        return -1;
+    }
+
+    PeerContext.Socket = SocketB;
+    if (bind(SocketA, (struct sockaddr*)&PeerContext.Address.Storage, PeerContext.Address.Length) ||
+        bind(SocketB, Target, AddressB.Length) ||
+        thrd_create(&Peer, DatagramPeer, &PeerContext) != thrd_success) {
+        printf("%s: failed to setup sockets\n", Name);
+        goto Exit;
+    }
+
+    timespec_get(&Start, TIME_MONOTONIC);
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        if (sendto(SocketA, &ChunkBuffer[0], 1, 0, Target, AddressB.Length) <= 0 ||
+            recv(SocketA, &ChunkBuffer[0], sizeof(ChunkBuffer), 0) <= 0) {
+            printf("%s: round trip %i failed\n", Name, i);
+            goto Exit;
+        }
+    }
+    Latency = ElapsedSeconds(&Start);
+
+    // Datagrams may be dropped when the receiver is full, so only a window of
+    // them is in flight before the receiver acknowledges it
+    timespec_get(&Start, TIME_MONOTONIC);
+    for (i = 1; i <= DGRAM_PACKETS; i++) {
+        if (sendto(SocketA, &ChunkBuffer[0], sizeof(ChunkBuffer), 0, Target, AddressB.Length) <= 0) {
+            printf("%s: packet %i failed\n", Name, i);
+            goto Exit;
+        }
+
+        if (!(i % DGRAM_WINDOW) && recv(SocketA, &ChunkBuffer[0], sizeof(ChunkBuffer), 0) <= 0) {
+            printf("%s: window %i was not acknowledged\n", Name, i / DGRAM_WINDOW);
+            goto Exit;
+        }
+    }
+    PrintResult(Name, Latency, (size_t)DGRAM_PACKETS * sizeof(ChunkBuffer), ElapsedSeconds(&Start));
+    thrd_join(Peer, &Result);
+
+Exit:
+    close(SocketA);
+    close(SocketB);
+    return Result;
+}
+
+int main(int argc, char **argv)
+{
+    int Errors = 0;
+
+    if (BenchmarkStream(AF_LOCAL, "lc-stream")) {
+        Errors++;
+    }
+
+    if (BenchmarkDatagram(AF_LOCAL, "lc-dgram")) {
+        Errors++;
+    }
+
+    if (BenchmarkStream(AF_INET, "in-stream")) {
+        Errors++;
+    }
+
+    if (BenchmarkDatagram(AF_INET, "in-dgram")) {
+        Errors++;
+    }
+    return Errors;
+}
@@ -53,11 +53,157 @@ static std::string GetCTypename(std::shared_ptr<GrachtUnit> CodeUnit,
     return Typename;
 }
 
+static std::string ToUpper(const std::string& Value)
+{
+    std::string UppercaseValue = Value;
+    std::transform(UppercaseValue.begin(), UppercaseValue.end(), UppercaseValue.begin(),
+        [](unsigned char c){ return std::toupper(c); });
+    return UppercaseValue;
+}
+
+static std::string ToLower(const std::string& Value)
+{
+    std::string LowercaseValue = Value;
+    std::transform(LowercaseValue.begin(), LowercaseValue.end(), LowercaseValue.begin(),
+        [](unsigned char c){ return std::tolower(c); });
+    return LowercaseValue;
+}
+
+// Function ids are assigned in declaration order, starting at 0, and are sent as
+// the action of the message, which makes them usable as direct indices into the
+// generated function table
+static std::string GetFunctionIdName(std::shared_ptr<GrachtUnit> CodeUnit,
+    std::shared_ptr<GrachtFunction> Function)
+{
+    return ToUpper(CodeUnit->GetName()) + "_" + ToUpper(Function->GetName()) + "_ID";
+}
+
+static std::string GetProtocolIdName(std::shared_ptr<GrachtUnit> CodeUnit)
+{
+    return "PROTOCOL_" + ToUpper(CodeUnit->GetName()) + "_ID";
+}
+
+static std::string GetFunctionName(std::shared_ptr<GrachtUnit> CodeUnit,
+    std::shared_ptr<GrachtFunction> Function)
+{
+    return ToLower(CodeUnit->GetName()) + "_" + Function->GetName();
+}
+
+// Typed parameters are sent as values, strings and objects as buffers
+static std::string GetParamLength(std::shared_ptr<GrachtUnit> CodeUnit,
+    std::shared_ptr<GrachtDeclaration> Param)
+{
+    if (Param->GetTypename() == "string") {
+        return "((" + Param->GetName() + " == NULL) ? 0 : strlen(" + Param->GetName() + ") + 1)";
+    }
+    return "sizeof(" + GetCTypename(CodeUnit, Param->GetTypename()) + ")";
+}
+
+static std::string GetParamInitializer(std::shared_ptr<GrachtUnit> CodeUnit,
+    std::shared_ptr<GrachtDeclaration> Param)
+{
+    if (IsTyped(Param->GetTypename())) {
+        return "{ .type = GRACHT_PARAM_VALUE, .data.value = (size_t)" + Param->GetName() + 
+            ", .length = " + GetParamLength(CodeUnit, Param) + " }";
+    }
+    else if (Param->GetTypename() == "string") {
+        return "{ .type = GRACHT_PARAM_BUFFER, .data.buffer = (void*)" + Param->GetName() + 
+            ", .length = " + GetParamLength(CodeUnit, Param) + " }";
+    }
+    return "{ .type = GRACHT_PARAM_BUFFER, .data.buffer = (void*)&" + Param->GetName() + 
+        ", .length = " + GetParamLength(CodeUnit, Param) + " }";
+}
+
+// Writes a message with the given parameters, the buffers of the input parameters
+// are included in the message length
+static void WriteMessage(std::ofstream& Header, std::shared_ptr<GrachtUnit> CodeUnit,
+    std::shared_ptr<GrachtFunction> Function, const std::string& Name,
+    const std::list<std::shared_ptr<GrachtDeclaration>>& In,
+    const std::list<std::string>& Out)
+{
+    size_t ParamCount = In.size() + Out.size();
+
+    Header << "    struct {" << std::endl;
+    Header << "        struct gracht_message_header __base;" << std::endl;
+    if (ParamCount != 0) {
+        Header << "        struct gracht_param          __params[" << ParamCount << "];" << std::endl;
+    }
+    Header << "    } " << Name << " = { .__base = {" << std::endl;
+    Header << "        .length = sizeof(struct gracht_message) + (" << ParamCount << " * sizeof(struct gracht_param))";
+    for (auto Param : In) {
+        if (!IsTyped(Param->GetTypename())) {
+            Header << " + " << GetParamLength(CodeUnit, Param);
+        }
+    }
+    Header << "," << std::endl;
+    Header << "        .param_in = " << In.size() << "," << std::endl;
+    Header << "        .param_out = " << Out.size() << "," << std::endl;
+    Header << "        .flags = 0," << std::endl;
+    Header << "        .protocol = " << GetProtocolIdName(CodeUnit) << "," << std::endl;
+    Header << "        .action = " << GetFunctionIdName(CodeUnit, Function) << std::endl;
+    if (ParamCount == 0) {
+        Header << "    } };" << std::endl << std::endl;
+        return;
+    }
+    Header << "    }, .__params = {" << std::endl;
+
+    size_t i = 0;
+    for (auto Param : In) {
+        Header << "        " << GetParamInitializer(CodeUnit, Param);
+        Header << ((++i != ParamCount) ? "," : "") << std::endl;
+    }
+    for (auto& Param : Out) {
+        Header << "        " << Param;
+        Header << ((++i != ParamCount) ? "," : "") << std::endl;
+    }
+    Header << "    } };" << std::endl << std::endl;
+}
+
+static std::list<std::shared_ptr<GrachtDeclaration>> GetParams(
+    std::shared_ptr<GrachtFunction> Function)
+{
+    std::list<std::shared_ptr<GrachtDeclaration>> Params;
+    for (auto Param : Function->GetSymbolTable()->GetSymbols()) {
+        Params.push_back(std::static_pointer_cast<GrachtDeclaration>(Param));
+    }
+    return Params;
+}
+
 int GrachtGeneratorC::Generate(std::shared_ptr<GrachtUnit> CodeUnit, 
         const std::string& CommonHeadersPath,
         const std::string& ServerSourcesPath)
 {
+    auto Functions = CodeUnit->GetSymbolsOfType(GrachtSymbol::SymbolType::Function);
+
+    // The protocol and the action are 8 bit in the message header, and the parameter
+    // counts are 4 bit, the response carries the return value
+    if (m_ProtocolId < 0 || m_ProtocolId >= GRACHT_C_MAX_IDS) {
+        printf("gracht: protocol id %i is out of range for %s\n", m_ProtocolId, CodeUnit->GetName().c_str());
+        return -1;
+    }
+
+    if (Functions.size() > GRACHT_C_MAX_IDS) {
+        printf("gracht: %s has %zu functions, at most %i are supported\n",
+            CodeUnit->GetName().c_str(), Functions.size(), GRACHT_C_MAX_IDS);
+        return -1;
+    }
+
+    for (auto Func : Functions) {
+        auto CastedFunc = std::static_pointer_cast<GrachtFunction>(Func);
+        if (CastedFunc->GetSymbolTable()->GetSymbols().size() + 1 > GRACHT_C_MAX_PARAMS) {
+            printf("gracht: function %s has more than %i parameters\n",
+                CastedFunc->GetName().c_str(), GRACHT_C_MAX_PARAMS - 1);
+            return -1;
+        }
+        if (CastedFunc->GetReturnType() == "string") {
+            printf("gracht: function %s can not return a string\n", CastedFunc->GetName().c_str());
+            return -1;
+        }
+    }
+
     GenerateCommonHeaders(CodeUnit, CommonHeadersPath);
+    GenerateClientHeaders(CodeUnit, CommonHeadersPath);
+    GenerateServerDispatch(CodeUnit, ServerSourcesPath);
     return 0;
 }
 
@@ -67,14 +213,26 @@ void GrachtGeneratorC::GenerateCommonHeaders(
     auto Objects = CodeUnit->GetSymbolsOfType(GrachtSymbol::SymbolType::Object);
     auto Functions = CodeUnit->GetSymbolsOfType(GrachtSymbol::SymbolType::Function);
 
-    std::string Name = CodeUnit->GetName();
-    std::transform(Name.begin(), Name.end(), Name.begin(),
-        [](unsigned char c){ return std::tolower(c); });
+    std::string Name = ToLower(CodeUnit->GetName());
     std::string FullPath = Path + "/" + Name + ".h";
     
     std::ofstream Header(FullPath);
     if (Header.is_open()) {
+        int FunctionId = 0;
+
         GenerateHeaderStart(Header, CodeUnit->GetName());
+        Header << "#include <gracht/types.h>" << std::endl;
+        Header << "#include <stdbool.h>" << std::endl;
+        Header << "#include <stddef.h>" << std::endl << std::endl;
+
+        Header << "#define " << GetProtocolIdName(CodeUnit) << " " << m_ProtocolId << std::endl;
+        Header << "#define " << ToUpper(CodeUnit->GetName()) << "_FUNCTION_COUNT " << Functions.size() << std::endl;
+        for (auto Func : Functions) {
+            auto CastedFunc = std::static_pointer_cast<GrachtFunction>(Func);
+            Header << "#define " << GetFunctionIdName(CodeUnit, CastedFunc) << " " << FunctionId++ << std::endl;
+        }
+        Header << std::endl;
+
         for (auto Obj : Objects) {
             auto CastedObj = std::static_pointer_cast<GrachtObject>(Obj);
             Header << "struct " << CastedObj->GetName() << " {" << std::endl;
@@ -84,88 +242,216 @@ void GrachtGeneratorC::GenerateCommonHeaders(
             }
             Header << "};" << std::endl << std::endl;
         }
+        GenerateHeaderEnd(Header, CodeUnit->GetName());
+        Header.close();
+    }
+}
+
+void GrachtGeneratorC::GenerateClientHeaders(
+    std::shared_ptr<GrachtUnit> CodeUnit, const std::string& Path)
+{
+    auto Functions = CodeUnit->GetSymbolsOfType(GrachtSymbol::SymbolType::Function);
+
+    std::string Name = ToLower(CodeUnit->GetName());
+    std::string FullPath = Path + "/" + Name + "_client.h";
+    
+    std::ofstream Header(FullPath);
+    if (Header.is_open()) {
+        GenerateHeaderStart(Header, CodeUnit->GetName() + "_client");
+        Header << "#include <gracht/client.h>" << std::endl;
+        Header << "#include <string.h>" << std::endl;
+        Header << "#include \"" << Name << ".h\"" << std::endl << std::endl;
 
+        // The client calls are synchronous, the return value is written to the
+        // result parameter when the response arrives
         for (auto Func : Functions) {
             auto CastedFunc = std::static_pointer_cast<GrachtFunction>(Func);
-            Header << "static inline " << GetCTypename(CodeUnit, CastedFunc->GetReturnType()) << std::endl;
-            Header << CastedFunc->GetName() << "(";
+            auto Params     = GetParams(CastedFunc);
+            auto ReturnType = GetCTypename(CodeUnit, CastedFunc->GetReturnType());
+            std::list<std::string> Out;
 
-            if (CastedFunc->GetSymbolTable()->GetSymbols().size() > 0) {
-                Header << std::endl;
+            Header << "static inline int" << std::endl;
+            Header << GetFunctionName(CodeUnit, CastedFunc) << "(" << std::endl;
+            Header << "    gracht_client_t* client," << std::endl;
+            Header << "    void* context";
+            for (auto Param : Params) {
+                Header << "," << std::endl << "    " << GetCTypename(CodeUnit, Param->GetTypename()) << " " << Param->GetName();
+            }
+            if (CastedFunc->GetReturnType() != "void") {
+                Header << "," << std::endl << "    " << ReturnType << "* result";
+                Out.push_back(std::string("{ .type = ") + 
+                    (IsTyped(CastedFunc->GetReturnType()) ? "GRACHT_PARAM_VALUE" : "GRACHT_PARAM_BUFFER") +
+                    ", .data.buffer = result, .length = sizeof(" + ReturnType + ") }");
+            }
+            Header << ")" << std::endl;
+            Header << "{" << std::endl;
+            WriteMessage(Header, CodeUnit, CastedFunc, "__message", Params, Out);
+            Header << "    return gracht_client_invoke(client, (struct gracht_message*)&__message, context);" << std::endl;
+            Header << "}" << std::endl << std::endl;
+        }
+        GenerateHeaderEnd(Header, CodeUnit->GetName() + "_client");
+        Header.close();
+    }
+}
 
-                auto it = CastedFunc->GetSymbolTable()->GetSymbols().begin();
-                int  i;
-                for (i = 0; i < CastedFunc->GetSymbolTable()->GetSymbols().size(); i++, it++) {
-                    auto CastedParam = std::static_pointer_cast<GrachtDeclaration>(*it);
-                    Header << "    _In_ " << GetCTypename(CodeUnit, CastedParam->GetTypename()) << " " << CastedParam->GetName();
-                    if (i + 1 != CastedFunc->GetSymbolTable()->GetSymbols().size()) {
-                        Header << "," << std::endl;
+void GrachtGeneratorC::GenerateServerDispatch(
+    std::shared_ptr<GrachtUnit> CodeUnit, const std::string& Path)
+{
+    auto Functions = CodeUnit->GetSymbolsOfType(GrachtSymbol::SymbolType::Function);
+
+    std::string Name = ToLower(CodeUnit->GetName());
+    std::string FullPath = Path + "/" + Name + "_server.h";
+    
+    std::ofstream Header(FullPath);
+    if (Header.is_open()) {
+        GenerateHeaderStart(Header, CodeUnit->GetName() + "_server");
+        Header << "#include <gracht/server.h>" << std::endl;
+        Header << "#include \"" << Name << ".h\"" << std::endl << std::endl;
+
+        // Generate the prototypes the server must implement
+        for (auto Func : Functions) {
+            auto CastedFunc = std::static_pointer_cast<GrachtFunction>(Func);
+            auto Params     = GetParams(CastedFunc);
+            Header << "extern " << GetCTypename(CodeUnit, CastedFunc->GetReturnType()) << " " 
+                << GetFunctionName(CodeUnit, CastedFunc) << "_impl(";
+            if (Params.size() > 0) {
+                size_t i = 0;
+                for (auto Param : Params) {
+                    Header << GetCTypename(CodeUnit, Param->GetTypename()) << " " << Param->GetName();
+                    if (++i != Params.size()) {
+                        Header << ", ";
                     }
                 }
             }
             else {
                 Header << "void";
             }
+            Header << ");" << std::endl;
+        }
+        Header << std::endl;
 
-            Header << ")" << std::endl;
-            Header << "{" << std::endl;
+        // Generate the type-specialized invokers, each invoker knows the exact
+        // parameter layout of its function and needs no per-parameter interpretation.
+        // Messages that do not match the layout are dropped
+        for (auto Func : Functions) {
+            auto CastedFunc = std::static_pointer_cast<GrachtFunction>(Func);
+            auto Params     = GetParams(CastedFunc);
+            auto ReturnType = GetCTypename(CodeUnit, CastedFunc->GetReturnType());
+            int  Index      = 0;
 
-            // Generate variables
-            auto ResultString = "NULL";
-            Header << "    " << "IpcMessage_t Message;" << std::endl;
+            Header << "static void" << std::endl;
+            Header << "__" << GetFunctionName(CodeUnit, CastedFunc) << "_invoke(" << std::endl;
+            Header << "    struct gracht_recv_message* message)" << std::endl;
+            Header << "{" << std::endl;
+            if (Params.size() > 0) {
+                Header << "    struct gracht_param* __params  = message->params;" << std::endl;
+            }
+            if (std::any_of(Params.begin(), Params.end(), [](std::shared_ptr<GrachtDeclaration> const& Param) {
+                    return !IsTyped(Param->GetTypename()); })) {
+                Header << "    char*                __storage = (char*)message->params + (message->param_count * sizeof(struct gracht_param));" << std::endl;
+            }
+            for (auto Param : Params) {
+                auto ParamType = GetCTypename(CodeUnit, Param->GetTypename());
+                if (IsTyped(Param->GetTypename()) || Param->GetTypename() == "string") {
+                    Header << "    " << ParamType << " __" << Param->GetName() << ";" << std::endl;
+                }
+                else {
+                    Header << "    " << ParamType << "* __" << Param->GetName() << ";" << std::endl;
+                }
+            }
             if (CastedFunc->GetReturnType() != "void") {
-                Header << "    " << GetCTypename(CodeUnit, CastedFunc->GetReturnType()) << " Result;" << std::endl;
-                ResultString = "&Result";
+                Header << "    " << ReturnType << " __result;" << std::endl;
             }
             Header << std::endl;
-            Header << "    " << "IpcInitialize(&Message);" << std::endl;
-
-            // Generate parameters
-            if (CastedFunc->GetSymbolTable()->GetSymbols().size() > 0) {
-                auto it = CastedFunc->GetSymbolTable()->GetSymbols().begin();
-                int  i;
-                int  TypedIndex = 0;
-                int  UntypedIndex = 0;
-                for (i = 0; i < CastedFunc->GetSymbolTable()->GetSymbols().size(); i++, it++) {
-                    auto CastedParam = std::static_pointer_cast<GrachtDeclaration>(*it);
-                    if (IsTyped(CastedParam->GetTypename())) {
-                        Header << "    " << "IpcSetTypedArgument(&Message, " << TypedIndex++ << ", " << 
-                            CastedParam->GetName() << ");" << std::endl;
-                    }
-                    else {
-                        Header << "    " << "IpcSetUntypedArgumnet(&Message, " << UntypedIndex++ << ", " << 
-                            CastedParam->GetName() << ", ";
-                        if (CastedParam->GetTypename() == "string") {
-                            Header << "strlen(" << 
-                                GetCTypename(CodeUnit, CastedParam->GetTypename()) << 
-                                ") + 1" << ");" << std::endl;
-                        }
-                        else {
-                            Header << "sizeof(" << 
-                                GetCTypename(CodeUnit, CastedParam->GetTypename()) << 
-                                ")" << ");" << std::endl;
-                        }
+
+            Header << "    if (message->param_in != " << Params.size() << ") {" << std::endl;
+            Header << "        return;" << std::endl;
+            Header << "    }" << std::endl;
+            if (Params.size() > 0) {
+                Header << std::endl;
+            }
+
+            for (auto Param : Params) {
+                auto ParamType = GetCTypename(CodeUnit, Param->GetTypename());
+                auto Member    = "__" + Param->GetName();
+                auto Current   = "__params[" + std::to_string(Index++) + "]";
+                if (IsTyped(Param->GetTypename())) {
+                    Header << "    if (" << Current << ".type != GRACHT_PARAM_VALUE) {" << std::endl;
+                    Header << "        return;" << std::endl;
+                    Header << "    }" << std::endl;
+                    Header << "    " << Member << " = (" << ParamType << ")" << Current << ".data.value;" << std::endl;
+                    continue;
+                }
+
+                Header << "    if (" << Current << ".type == GRACHT_PARAM_SHM) {" << std::endl;
+                Header << "        " << Member << " = " << Current << ".data.buffer;" << std::endl;
+                Header << "    }" << std::endl;
+                Header << "    else {" << std::endl;
+                Header << "        " << Member << " = (" << Current << ".length != 0) ? (void*)__storage : NULL;" << std::endl;
+                Header << "        __storage += " << Current << ".length;" << std::endl;
+                Header << "    }" << std::endl;
+                if (Param->GetTypename() == "string") {
+                    Header << "    if (" << Member << " != NULL && (" << Current << ".length == 0 || " 
+                        << Member << "[" << Current << ".length - 1] != '\\0')) {" << std::endl;
+                }
+                else {
+                    Header << "    if (" << Member << " == NULL || " << Current << ".length != sizeof(" << ParamType << ")) {" << std::endl;
+                }
+                Header << "        return;" << std::endl;
+                Header << "    }" << std::endl;
+            }
+
+            Header << std::endl << "    ";
+            if (CastedFunc->GetReturnType() != "void") {
+                Header << "__result = ";
+            }
+            Header << GetFunctionName(CodeUnit, CastedFunc) << "_impl(";
+            if (Params.size() > 0) {
+                size_t i = 0;
+                Header << std::endl;
+                for (auto Param : Params) {
+                    Header << "        " << (IsTyped(Param->GetTypename()) || Param->GetTypename() == "string" ? "" : "*") 
+                        << "__" << Param->GetName();
+                    if (++i != Params.size()) {
+                        Header << "," << std::endl;
                     }
                 }
             }
+            Header << ");" << std::endl;
 
-            // Handle invocation and return
-            Header << "    " << "IpcInvoke(Target, &Message, 0, 0, " << ResultString << ");" << std::endl;
             if (CastedFunc->GetReturnType() != "void") {
-                Header << "    " << "return Result;" << std::endl;
+                auto Result = std::make_shared<GrachtDeclaration>(CastedFunc->GetReturnType(), "__result");
+                Header << std::endl;
+                WriteMessage(Header, CodeUnit, CastedFunc, "__response", { Result }, { });
+                Header << "    gracht_server_respond(message, (struct gracht_message*)&__response);" << std::endl;
             }
             Header << "}" << std::endl << std::endl;
         }
-        GenerateHeaderEnd(Header, CodeUnit->GetName());
+
+        // Generate the dense function table, indexed directly by the function id. The
+        // invoker is always present, so the generic unpacking never uses the address
+        Header << "static gracht_protocol_function_t __" << Name << "_functions[" 
+            << ToUpper(CodeUnit->GetName()) << "_FUNCTION_COUNT] = {" << std::endl;
+        for (auto Func : Functions) {
+            auto CastedFunc = std::static_pointer_cast<GrachtFunction>(Func);
+            Header << "    { " << GetFunctionIdName(CodeUnit, CastedFunc) << ", NULL, __" 
+                << GetFunctionName(CodeUnit, CastedFunc) << "_invoke }," << std::endl;
+        }
+        Header << "};" << std::endl << std::endl;
+
+        // The protocol is defined here, so the header must be included by exactly
+        // one source of the server, which registers it
+        Header << "static gracht_protocol_t " << Name << "_protocol = GRACHT_PROTOCOL_INIT_INDEXED(" 
+            << GetProtocolIdName(CodeUnit) << ", 0, " << ToUpper(CodeUnit->GetName()) << "_FUNCTION_COUNT, __" 
+            << Name << "_functions);" << std::endl << std::endl;
+        GenerateHeaderEnd(Header, CodeUnit->GetName() + "_server");
         Header.close();
     }
 }
 
 void GrachtGeneratorC::GenerateHeaderStart(std::ofstream& Stream, const std::string& Name)
 {
-    std::string UppercaseName = Name;
-    std::transform(UppercaseName.begin(), UppercaseName.end(), UppercaseName.begin(),
-        [](unsigned char c){ return std::toupper(c); });
+    std::string UppercaseName = ToUpper(Name);
 
     Stream << "/**" << std::endl;
     Stream << " * This header is automatically generated by the Gracht code generator" << std::endl;
@@ -175,15 +461,11 @@ void GrachtGeneratorC::GenerateHeaderStart(std::ofstream& Stream, const std::str
     Stream << "#ifndef __GC_CONTRACT_" + UppercaseName + "_H__" << std::endl;
     Stream << "#define __GC_CONTRACT_" + UppercaseName + "_H__";
     Stream << std::endl << std::endl;
-
-    Stream << "#include <os/ipc.h>" << std::endl << std::endl;
 }
 
 void GrachtGeneratorC::GenerateHeaderEnd(std::ofstream& Stream, const std::string& Name)
 {
-    std::string UppercaseName = Name;
-    std::transform(UppercaseName.begin(), UppercaseName.end(), UppercaseName.begin(),
-        [](unsigned char c){ return std::toupper(c); });
+    std::string UppercaseName = ToUpper(Name);
 
     Stream << "#endif //!__GC_CONTRACT_" + UppercaseName + "_H__"<< std::endl;
 }
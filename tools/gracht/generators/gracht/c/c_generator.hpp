@@ -5,15 +5,27 @@
 #include "../../generator.hpp"
 #include <fstream>
 
+// Limits of the gracht message header, protocol and action ids are 8 bit and
+// the parameter counts are 4 bit
+#define GRACHT_C_MAX_IDS    256
+#define GRACHT_C_MAX_PARAMS 15
+
 class GrachtGeneratorC : public GrachtGenerator {
 public:
+    GrachtGeneratorC(int ProtocolId) : m_ProtocolId(ProtocolId) { }
+
     int Generate(std::shared_ptr<GrachtUnit>, 
         const std::string& CommonHeadersPath,  
         const std::string& ServerSourcesPath) override;
 
 private:
     void GenerateCommonHeaders(std::shared_ptr<GrachtUnit>, const std::string& Path);
+    void GenerateClientHeaders(std::shared_ptr<GrachtUnit>, const std::string& Path);
+    void GenerateServerDispatch(std::shared_ptr<GrachtUnit>, const std::string& Path);
 
     void GenerateHeaderStart(std::ofstream&, const std::string&);
     void GenerateHeaderEnd(std::ofstream&, const std::string&);
+
+private:
+    int m_ProtocolId;
 };
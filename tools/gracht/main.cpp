@@ -9,12 +9,14 @@
 #include "parser/gracht/gracht_language.hpp"
 #include <memory>
 #include <queue>
+#include <stdlib.h>
 #include <string.h>
 
 struct CompilerArguments {
     std::string CommonHeadersPath;
     std::string ClientImplementationPath;
     std::string ServerImplementationPath;
+    int ProtocolId = -1;
     std::queue<std::string> Files;
 };
 
@@ -28,6 +30,9 @@ void GetArguments(CompilerArguments& Args, int argc, char** argv)
         else if (!strncmp(argv[i], "--server-impl=", 14)) {
             Args.ServerImplementationPath = (argv[i] + 14);
         }
+        else if (!strncmp(argv[i], "--protocol-id=", 14)) {
+            Args.ProtocolId = (int)strtol(argv[i] + 14, NULL, 0);
+        }
         else {
             Args.Files.push(std::string(argv[i]));
         }
@@ -41,9 +46,13 @@ int main(int argc, char** argv)
     if (Arguments.Files.size() == 0) {
         printf("gracht: no arguments are provided\n");
     }
+    if (Arguments.ProtocolId == -1) {
+        printf("gracht: the protocol id must be provided with --protocol-id=\n");
+        return -1;
+    }
     
     std::shared_ptr<Language>         Lang(new GrachtLanguage());
-    std::unique_ptr<GrachtGeneratorC> Generator(new GrachtGeneratorC());
+    std::unique_ptr<GrachtGeneratorC> Generator(new GrachtGeneratorC(Arguments.ProtocolId));
 
     while (Arguments.Files.size()) {
         std::shared_ptr<GrachtUnit> Code(new GrachtUnit(Arguments.Files.front(), Lang));
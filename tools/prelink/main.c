@@ -0,0 +1,487 @@
+/* Prelink Utility
+ * Author: Philip Meulengracht
+ * Date: 18-10-20
+ * Used as a utility for MollenOS to assign shared libraries their base address
+ * in the shared library region, and apply the relocations for that address in
+ * the image files, so the loader can skip relocation when loading them there. */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _MSC_VER
+#define PACKED_TYPESTRUCT(name, body) __pragma(pack(push, 1)) typedef struct _##name body name##_t __pragma(pack(pop))
+#else
+#define PACKED_TYPESTRUCT(name, body) typedef struct __attribute__((packed)) _##name body name##_t
+#endif
+
+// Must be kept in sync with the shared region defined by the loader (librt/libds/pe/pe.h)
+// and the user code region of the kernel (kernel/arch/x86/arch.h)
+#define REGION_BASE_32          0x28000000ULL
+#define REGION_SIZE_32          0x08000000ULL
+#define REGION_BASE_64          0x280000000ULL
+#define REGION_SIZE_64          0x80000000ULL
+#define REGION_ALIGN            0x10000ULL
+
+#define MZ_MAGIC                0x5A4D
+#define PE_MAGIC                0x00004550
+#define PE_ARCHITECTURE_32      0x10B
+#define PE_ARCHITECTURE_64      0x20B
+#define PE_ATTRIBUTE_DLL        0x2000
+#define PE_DIRECTORY_RELOCATION 5
+
+#define PE_RELOCATION_ALIGN     0
+#define PE_RELOCATION_HIGHLOW   3
+#define PE_RELOCATION_DIR64     10
+
+PACKED_TYPESTRUCT(MzHeader, {
+    uint16_t Signature;
+    uint16_t Unused[29];
+    uint32_t PeHeaderAddress;
+});
+
+PACKED_TYPESTRUCT(PeHeader, {
+    uint32_t Magic;
+    uint16_t Machine;
+    uint16_t NumSections;
+    uint32_t DateTimeStamp;
+    uint32_t SymbolTableOffset;
+    uint32_t NumSymbolsInTable;
+    uint16_t SizeOfOptionalHeader;
+    uint16_t Attributes;
+});
+
+PACKED_TYPESTRUCT(PeDataDirectory, {
+    uint32_t AddressRVA;
+    uint32_t Size;
+});
+
+PACKED_TYPESTRUCT(PeOptionalHeader32, {
+    uint16_t          Architecture;
+    uint8_t           Unused0[26];
+    uint32_t          BaseAddress;
+    uint8_t           Unused1[24];
+    uint32_t          SizeOfImage;
+    uint32_t          SizeOfHeaders;
+    uint32_t          ImageChecksum;
+    uint8_t           Unused2[24];
+    uint32_t          NumDataDirectories;
+    PeDataDirectory_t Directories[16];
+});
+
+PACKED_TYPESTRUCT(PeOptionalHeader64, {
+    uint16_t          Architecture;
+    uint8_t           Unused0[22];
+    uint64_t          BaseAddress;
+    uint8_t           Unused1[24];
+    uint32_t          SizeOfImage;
+    uint32_t          SizeOfHeaders;
+    uint32_t          ImageChecksum;
+    uint8_t           Unused2[40];
+    uint32_t          NumDataDirectories;
+    PeDataDirectory_t Directories[16];
+});
+
+PACKED_TYPESTRUCT(PeSectionHeader, {
+    uint8_t  Name[8];
+    uint32_t VirtualSize;
+    uint32_t VirtualAddress;
+    uint32_t RawSize;
+    uint32_t RawAddress;
+    uint32_t PointerToFileRelocations;
+    uint32_t PointerToFileLineNumbers;
+    uint16_t NumRelocations;
+    uint16_t NumLineNumbers;
+    uint32_t Flags;
+});
+
+typedef struct Assignment {
+    uint64_t Base;
+    uint64_t Size;
+} Assignment_t;
+
+typedef struct Image {
+    const char*        Path;
+    uint8_t*           Data;
+    size_t             Length;
+    PeSectionHeader_t* Sections;
+    int                NumSections;
+    int                Is64Bit;
+    uint64_t           ImageBase;
+    uint32_t           SizeOfImage;
+    uint8_t*           OptHeader;
+    PeDataDirectory_t* Relocations;
+} Image_t;
+
+static Assignment_t* Assignments     = NULL;
+static int           NumAssignments  = 0;
+static uint64_t      RegionBase      = REGION_BASE_32;
+static uint64_t      RegionSize      = REGION_SIZE_32;
+static int           TargetIs64Bit   = 0;
+
+// Prints usage format of this program
+static void ShowSyntax(void)
+{
+    printf("  Syntax:\n\n"
+           "    Prelink  :  prelink <arch> [-m <map>] <library> [<library> ...]\n\n");
+}
+
+/* PeCalculateChecksum
+ * Must produce the same checksum as the loader does (librt/libds/pe/verify.c) */
+static uint32_t
+PeCalculateChecksum(uint8_t* Data, size_t DataLength, size_t PeChkSumOffset)
+{
+    uint32_t* DataPtr  = (uint32_t*)Data;
+    uint64_t  Limit    = 4294967296;
+    uint64_t  CheckSum = 0;
+    size_t    i;
+
+    for (i = 0; i < (DataLength / 4); i++, DataPtr++) {
+        uint32_t Val = *DataPtr;
+        if (i == (PeChkSumOffset / 4)) {
+            continue;
+        }
+        CheckSum = (CheckSum & UINT32_MAX) + Val + (CheckSum >> 32);
+        if (CheckSum > Limit) {
+            CheckSum = (CheckSum & UINT32_MAX) + (CheckSum >> 32);
+        }
+    }
+
+    CheckSum = (CheckSum & UINT16_MAX) + (CheckSum >> 16);
+    CheckSum = (CheckSum) + (CheckSum >> 16);
+    CheckSum = CheckSum & UINT16_MAX;
+    CheckSum += (uint32_t)DataLength;
+    return (uint32_t)(CheckSum & UINT32_MAX);
+}
+
+static int
+ReadImage(Image_t* Image)
+{
+    FILE*       File;
+    MzHeader_t* DosHeader;
+    PeHeader_t* BaseHeader;
+    uint8_t*    OptHeader;
+    long        Length;
+
+    File = fopen(Image->Path, "rb");
+    if (!File) {
+        fprintf(stderr, "prelink: can't open %s for reading\n", Image->Path);
+        return -1;
+    }
+
+    fseek(File, 0, SEEK_END);
+    Length = ftell(File);
+    fseek(File, 0, SEEK_SET);
+    if (Length < (long)sizeof(MzHeader_t)) {
+        fclose(File);
+        return 1;
+    }
+
+    Image->Length = (size_t)Length;
+    Image->Data   = malloc(Image->Length);
+    if (!Image->Data || fread(Image->Data, 1, Image->Length, File) != Image->Length) {
+        fprintf(stderr, "prelink: failed to read %s\n", Image->Path);
+        fclose(File);
+        return -1;
+    }
+    fclose(File);
+
+    // Anything that is not a pe library is left alone
+    DosHeader = (MzHeader_t*)Image->Data;
+    if (DosHeader->Signature != MZ_MAGIC ||
+        (DosHeader->PeHeaderAddress + sizeof(PeHeader_t) + sizeof(PeOptionalHeader64_t)) > Image->Length) {
+        return 1;
+    }
+
+    BaseHeader = (PeHeader_t*)(Image->Data + DosHeader->PeHeaderAddress);
+    if (BaseHeader->Magic != PE_MAGIC || !(BaseHeader->Attributes & PE_ATTRIBUTE_DLL)) {
+        return 1;
+    }
+
+    OptHeader          = Image->Data + DosHeader->PeHeaderAddress + sizeof(PeHeader_t);
+    Image->OptHeader   = OptHeader;
+    Image->Sections    = (PeSectionHeader_t*)(OptHeader + BaseHeader->SizeOfOptionalHeader);
+    Image->NumSections = BaseHeader->NumSections;
+    if (((uint8_t*)&Image->Sections[Image->NumSections] - Image->Data) > (long)Image->Length) {
+        fprintf(stderr, "prelink: %s: invalid section table\n", Image->Path);
+        return -1;
+    }
+
+    if (*(uint16_t*)OptHeader == PE_ARCHITECTURE_32) {
+        PeOptionalHeader32_t* OptHeader32 = (PeOptionalHeader32_t*)OptHeader;
+        Image->Is64Bit     = 0;
+        Image->ImageBase   = OptHeader32->BaseAddress;
+        Image->SizeOfImage = OptHeader32->SizeOfImage;
+        Image->Relocations = &OptHeader32->Directories[PE_DIRECTORY_RELOCATION];
+    }
+    else if (*(uint16_t*)OptHeader == PE_ARCHITECTURE_64) {
+        PeOptionalHeader64_t* OptHeader64 = (PeOptionalHeader64_t*)OptHeader;
+        Image->Is64Bit     = 1;
+        Image->ImageBase   = OptHeader64->BaseAddress;
+        Image->SizeOfImage = OptHeader64->SizeOfImage;
+        Image->Relocations = &OptHeader64->Directories[PE_DIRECTORY_RELOCATION];
+    }
+    else {
+        return 1;
+    }
+    return (Image->Is64Bit == TargetIs64Bit) ? 0 : 1;
+}
+
+// Converts an RVA to a pointer into the file data, only valid if <Length>
+// bytes are present in the file at that location.
+static uint8_t*
+RvaToData(Image_t* Image, uint32_t Rva, uint32_t Length)
+{
+    int i;
+    for (i = 0; i < Image->NumSections; i++) {
+        PeSectionHeader_t* Section = &Image->Sections[i];
+        if (Rva >= Section->VirtualAddress && (Rva + Length) <= (Section->VirtualAddress + Section->RawSize)) {
+            if (((uint64_t)Section->RawAddress + Section->RawSize) > Image->Length) {
+                return NULL;
+            }
+            return Image->Data + Section->RawAddress + (Rva - Section->VirtualAddress);
+        }
+    }
+    return NULL;
+}
+
+static int
+ApplyRelocations(Image_t* Image, uint64_t Delta)
+{
+    uint8_t* Directory;
+    uint32_t Offset = 0;
+
+    Directory = RvaToData(Image, Image->Relocations->AddressRVA, Image->Relocations->Size);
+    if (!Directory) {
+        fprintf(stderr, "prelink: %s: invalid relocation directory\n", Image->Path);
+        return -1;
+    }
+
+    while ((Offset + 8) <= Image->Relocations->Size) {
+        uint32_t  PageRVA   = *(uint32_t*)(Directory + Offset);
+        uint32_t  BlockSize = *(uint32_t*)(Directory + Offset + 4);
+        uint16_t* Entries   = (uint16_t*)(Directory + Offset + 8);
+        uint32_t  i;
+
+        if (BlockSize < 8 || (Offset + BlockSize) > Image->Relocations->Size) {
+            fprintf(stderr, "prelink: %s: invalid relocation block at 0x%x\n", Image->Path, Offset);
+            return -1;
+        }
+
+        for (i = 0; i < (BlockSize - 8) / sizeof(uint16_t); i++) {
+            uint16_t Type  = Entries[i] >> 12;
+            uint32_t Rva   = PageRVA + (Entries[i] & 0x0FFF);
+            uint8_t* Value;
+
+            if (Type == PE_RELOCATION_ALIGN) {
+                continue;
+            }
+            else if (Type != PE_RELOCATION_HIGHLOW && Type != PE_RELOCATION_DIR64) {
+                fprintf(stderr, "prelink: %s: unsupported relocation type %u\n", Image->Path, Type);
+                return -1;
+            }
+
+            Value = RvaToData(Image, Rva, (Type == PE_RELOCATION_DIR64) ? 8 : 4);
+            if (!Value) {
+                fprintf(stderr, "prelink: %s: relocation at rva 0x%x is outside the file data\n",
+                    Image->Path, Rva);
+                return -1;
+            }
+
+            if (Type == PE_RELOCATION_DIR64) {
+                *(uint64_t*)Value += Delta;
+            }
+            else {
+                *(uint32_t*)Value += (uint32_t)Delta;
+            }
+        }
+        Offset += BlockSize;
+    }
+    return 0;
+}
+
+static Assignment_t*
+FindOverlap(uint64_t Base, uint64_t Size)
+{
+    int i;
+    for (i = 0; i < NumAssignments; i++) {
+        if (Base < (Assignments[i].Base + Assignments[i].Size) && Assignments[i].Base < (Base + Size)) {
+            return &Assignments[i];
+        }
+    }
+    return NULL;
+}
+
+// Keeps the current base if the image was already prelinked for it, otherwise
+// hands out the lowest free range in the region
+static uint64_t
+AssignBase(Image_t* Image)
+{
+    uint64_t      Size = ((uint64_t)Image->SizeOfImage + (REGION_ALIGN - 1)) & ~(REGION_ALIGN - 1);
+    uint64_t      Candidate;
+    Assignment_t* Overlap;
+
+    if (Image->ImageBase >= RegionBase && !(Image->ImageBase % REGION_ALIGN) &&
+        (Image->ImageBase + Size) <= (RegionBase + RegionSize) && !FindOverlap(Image->ImageBase, Size)) {
+        Candidate = Image->ImageBase;
+    }
+    else {
+        Candidate = RegionBase;
+        while ((Overlap = FindOverlap(Candidate, Size)) != NULL) {
+            Candidate = Overlap->Base + Overlap->Size;
+        }
+
+        if ((Candidate + Size) > (RegionBase + RegionSize)) {
+            return 0;
+        }
+    }
+
+    Assignments = realloc(Assignments, sizeof(Assignment_t) * (NumAssignments + 1));
+    if (!Assignments) {
+        return 0;
+    }
+    Assignments[NumAssignments].Base = Candidate;
+    Assignments[NumAssignments].Size = Size;
+    NumAssignments++;
+    return Candidate;
+}
+
+static int
+WriteImage(Image_t* Image, uint64_t Base)
+{
+    PeOptionalHeader32_t* OptHeader32 = (PeOptionalHeader32_t*)Image->OptHeader;
+    PeOptionalHeader64_t* OptHeader64 = (PeOptionalHeader64_t*)Image->OptHeader;
+    size_t                ChecksumOffset;
+    uint32_t              Checksum;
+    FILE*                 File;
+
+    if (Image->Is64Bit) {
+        OptHeader64->BaseAddress = Base;
+        Checksum       = OptHeader64->ImageChecksum;
+        ChecksumOffset = offsetof(PeOptionalHeader64_t, ImageChecksum);
+    }
+    else {
+        OptHeader32->BaseAddress = (uint32_t)Base;
+        Checksum       = OptHeader32->ImageChecksum;
+        ChecksumOffset = offsetof(PeOptionalHeader32_t, ImageChecksum);
+    }
+
+    // The loader only validates the checksum if one is present
+    if (Checksum != 0) {
+        ChecksumOffset += (size_t)(Image->OptHeader - Image->Data);
+        Checksum = PeCalculateChecksum(Image->Data, Image->Length, ChecksumOffset);
+        memcpy(Image->Data + ChecksumOffset, &Checksum, sizeof(uint32_t));
+    }
+
+    File = fopen(Image->Path, "wb");
+    if (!File) {
+        fprintf(stderr, "prelink: can't open %s for writing\n", Image->Path);
+        return -1;
+    }
+
+    if (fwrite(Image->Data, 1, Image->Length, File) != Image->Length) {
+        fprintf(stderr, "prelink: failed to write %s\n", Image->Path);
+        fclose(File);
+        return -1;
+    }
+    fclose(File);
+    return 0;
+}
+
+static int
+PrelinkImage(const char* Path, FILE* Map)
+{
+    Image_t  Image;
+    uint64_t Base;
+    int      Status = -1;
+
+    memset(&Image, 0, sizeof(Image_t));
+    Image.Path = Path;
+    Status = ReadImage(&Image);
+    if (Status) {
+        if (Status > 0) {
+            printf("prelink: skipping %s, not a library\n", Path);
+            Status = 0;
+        }
+        free(Image.Data);
+        return Status;
+    }
+    Status = -1;
+
+    // Without relocations the image can only ever be loaded at its own base
+    if (!Image.Relocations->AddressRVA || !Image.Relocations->Size) {
+        printf("prelink: skipping %s, no relocations\n", Path);
+        free(Image.Data);
+        return 0;
+    }
+
+    Base = AssignBase(&Image);
+    if (!Base) {
+        fprintf(stderr, "prelink: no room for %s (%u bytes) in the shared region\n", Path, Image.SizeOfImage);
+        goto Cleanup;
+    }
+
+    if (Base != Image.ImageBase) {
+        if (ApplyRelocations(&Image, Base - Image.ImageBase) || WriteImage(&Image, Base)) {
+            goto Cleanup;
+        }
+    }
+
+    printf("prelink: %s => 0x%llx\n", Path, (unsigned long long)Base);
+    if (Map) {
+        fprintf(Map, "0x%llx 0x%x %s\n", (unsigned long long)Base, Image.SizeOfImage, Path);
+    }
+    Status = 0;
+
+Cleanup:
+    free(Image.Data);
+    return Status;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE* Map = NULL;
+    int   Status = 0;
+    int   i = 2;
+
+    if (argc < 3) {
+        ShowSyntax();
+        return -1;
+    }
+
+    if (!strcmp(argv[1], "amd64")) {
+        RegionBase = REGION_BASE_64;
+        RegionSize = REGION_SIZE_64;
+        TargetIs64Bit = 1;
+    }
+    else if (strcmp(argv[1], "i386")) {
+        fprintf(stderr, "prelink: unsupported architecture %s\n", argv[1]);
+        return -1;
+    }
+
+    if (!strcmp(argv[i], "-m")) {
+        if (argc < 5) {
+            ShowSyntax();
+            return -1;
+        }
+
+        Map = fopen(argv[i + 1], "w");
+        if (!Map) {
+            fprintf(stderr, "prelink: can't open %s for writing\n", argv[i + 1]);
+            return -1;
+        }
+        i += 2;
+    }
+
+    // Images are assigned in the order they are given, so the result is stable
+    // for the same set of libraries
+    for (; i < argc && !Status; i++) {
+        Status = PrelinkImage(argv[i], Map);
+    }
+
+    if (Map) {
+        fclose(Map);
+    }
+    free(Assignments);
+    return Status;
+}